@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fmt/core.h>
+#include "xtensor/xarray.hpp"
+
+using std::string;
+using std::vector;
+
+// The result of one benchmark. time_min and time_median are the wall times of
+// a single call in seconds, work is the amount of work done by a call
+// measured in work_unit (e.g. source/target interactions), so that
+// work/time_median is the throughput.
+struct BenchmarkResult {
+    string name;
+    string config;
+    vector<std::pair<string, double>> parameters;
+    int repetitions = 0;
+    double time_min = 0., time_median = 0.;
+    double work = 0.;
+    string work_unit;
+    // additional measurements, e.g. the error of the mixed precision kernels
+    vector<std::pair<string, double>> metrics;
+};
+
+// Calls f once to warm up the caches and then repeatedly until it has run
+// for at least min_time seconds and at least min_repetitions times.
+template<class F>
+void measure(BenchmarkResult& result, double min_time, F f, int min_repetitions=3) {
+    using clock = std::chrono::steady_clock;
+    f();
+    vector<double> times;
+    double total = 0.;
+    while(total < min_time || int(times.size()) < min_repetitions) {
+        auto t1 = clock::now();
+        f();
+        auto t2 = clock::now();
+        double t = std::chrono::duration<double>(t2 - t1).count();
+        times.push_back(t);
+        total += t;
+    }
+    std::sort(times.begin(), times.end());
+    result.repetitions = times.size();
+    result.time_min = times[0];
+    result.time_median = times[times.size()/2];
+}
+
+inline string json_string(const string& s) {
+    string res = "\"";
+    for (char c : s) {
+        if(c == '"' || c == '\\')
+            res += '\\';
+        res += c;
+    }
+    return res + "\"";
+}
+
+inline string json_number(double x) {
+    return std::isfinite(x) ? fmt::format("{:.9g}", x) : "null";
+}
+
+inline string json_object(const vector<std::pair<string, double>>& values) {
+    string res = "{";
+    for (size_t i = 0; i < values.size(); ++i)
+        res += fmt::format("{}{}: {}", i > 0 ? ", " : "", json_string(values[i].first), json_number(values[i].second));
+    return res + "}";
+}
+
+// Writes the results in the format of src/profiling/benchmarks.py, so that
+// the output of both can be merged and compared across releases.
+inline string benchmarks_to_json(const vector<std::pair<string, string>>& context, const vector<BenchmarkResult>& results) {
+    string res = "{\n  \"context\": {";
+    for (size_t i = 0; i < context.size(); ++i)
+        res += fmt::format("{}{}: {}", i > 0 ? ", " : "", json_string(context[i].first), json_string(context[i].second));
+    res += "},\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& r = results[i];
+        res += fmt::format("{}\n    {{\"name\": {}, \"config\": {}, \"parameters\": {}, \"repetitions\": {}, "
+                "\"time_min\": {}, \"time_median\": {}, \"work\": {}, \"work_unit\": {}, \"throughput\": {}, \"metrics\": {}}}",
+                i > 0 ? "," : "", json_string(r.name), json_string(r.config), json_object(r.parameters), r.repetitions,
+                json_number(r.time_min), json_number(r.time_median), json_number(r.work), json_string(r.work_unit),
+                json_number(r.work/r.time_median), json_object(r.metrics));
+    }
+    return res + "\n  ]\n}\n";
+}
+
+// A coil set of simsopt.configs: the coils of one half field period, stored
+// as the Fourier coefficients of CurveXYZFourier in the files NCSX.dat etc.,
+// are expanded by the stellarator symmetry as in coils_via_symmetries.
+struct CoilConfig {
+    string name;
+    int nfp;
+    // major radius of the magnetic axis and an approximate minor radius of
+    // the plasma, used to place the target points
+    double major_radius, minor_radius;
+    vector<xt::xarray<double>> gamma, gammadash;
+    vector<double> currents;
+
+    int num_quadrature_points() const {
+        int n = 0;
+        for (auto& g : gamma)
+            n += g.shape(0);
+        return n;
+    }
+};
+
+inline vector<vector<double>> load_csv(const string& filename) {
+    std::ifstream file(filename);
+    if(!file)
+        throw std::runtime_error("Could not open " + filename);
+    vector<vector<double>> rows;
+    string line;
+    while(std::getline(file, line)) {
+        if(line.empty())
+            continue;
+        vector<double> row;
+        std::stringstream ss(line);
+        string entry;
+        while(std::getline(ss, entry, ','))
+            row.push_back(std::stod(entry));
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+// Loads the coils as CurveXYZFourier.load_curves_from_file(filename, order, ppp)
+// followed by coils_via_symmetries(curves, currents, nfp, True).
+inline CoilConfig load_coil_config(const string& name, const string& filename, int order, int ppp, int nfp,
+        const vector<double>& base_currents, double major_radius, double minor_radius) {
+    auto data = load_csv(filename);
+    int ncoils = data[0].size()/6;
+    if(int(base_currents.size()) != ncoils)
+        throw std::runtime_error(fmt::format("{} contains {} coils, but {} currents were given", filename, ncoils, base_currents.size()));
+    order = std::min(order, int(data.size()) - 1);
+    int nquad = order * ppp;
+
+    CoilConfig config{name, nfp, major_radius, minor_radius, {}, {}, {}};
+    for (int k = 0; k < nfp; ++k) {
+        double alpha = 2 * M_PI * k / nfp;
+        for (bool flip : {false, true}) {
+            for (int ic = 0; ic < ncoils; ++ic) {
+                xt::xarray<double> gamma = xt::zeros<double>({nquad, 3});
+                xt::xarray<double> gammadash = xt::zeros<double>({nquad, 3});
+                for (int i = 0; i < nquad; ++i) {
+                    double phi = 2 * M_PI * double(i) / nquad;
+                    double x[3], dx[3];
+                    for (int d = 0; d < 3; ++d) {
+                        x[d] = data[0][6*ic + 2*d + 1];
+                        dx[d] = 0.;
+                        for (int j = 1; j <= order; ++j) {
+                            double s = data[j][6*ic + 2*d], c = data[j][6*ic + 2*d + 1];
+                            x[d] += s * std::sin(j * phi) + c * std::cos(j * phi);
+                            dx[d] += 2 * M_PI * j * (s * std::cos(j * phi) - c * std::sin(j * phi));
+                        }
+                        if(flip && d > 0) {
+                            x[d] = -x[d];
+                            dx[d] = -dx[d];
+                        }
+                    }
+                    gamma(i, 0) = std::cos(alpha) * x[0] - std::sin(alpha) * x[1];
+                    gamma(i, 1) = std::sin(alpha) * x[0] + std::cos(alpha) * x[1];
+                    gamma(i, 2) = x[2];
+                    gammadash(i, 0) = std::cos(alpha) * dx[0] - std::sin(alpha) * dx[1];
+                    gammadash(i, 1) = std::sin(alpha) * dx[0] + std::cos(alpha) * dx[1];
+                    gammadash(i, 2) = dx[2];
+                }
+                config.gamma.push_back(gamma);
+                config.gammadash.push_back(gammadash);
+                config.currents.push_back(flip ? -base_currents[ic] : base_currents[ic]);
+            }
+        }
+    }
+    return config;
+}
+
+// The coils of get_ncsx_data, get_hsx_data and get_w7x_data in
+// simsopt.configs, with the same orders and quadrature points.
+inline vector<CoilConfig> load_coil_configs(const string& directory) {
+    vector<CoilConfig> configs;
+    configs.push_back(load_coil_config("NCSX", directory + "/NCSX.dat", 25, 10, 3,
+                {6.52271941985300E+05, 6.51868569367400E+05, 5.37743588647300E+05}, 1.4714, 0.32));
+    configs.push_back(load_coil_config("HSX", directory + "/HSX.dat", 16, 10, 4,
+                vector<double>(6, -1.500725500000000e+05), 1.2212, 0.12));
+    vector<double> w7x_currents(5, 15000. * 108);
+    w7x_currents.push_back(0.);
+    w7x_currents.push_back(0.);
+    configs.push_back(load_coil_config("W7-X", directory + "/W7-X.dat", 48, 2, 5, w7x_currents, 5.5607, 0.53));
+    return configs;
+}
@@ -0,0 +1,209 @@
+#!/usr/bin/env python
+r"""
+Benchmarks of the parts of simsoptpp that are called with numpy arrays, for
+the coils of NCSX, HSX and W7-X from :mod:`simsopt.configs`:
+
+- field line tracing with ``compute_fieldlines`` in an ``InterpolatedField``,
+- the ``gamma_impl`` of the coils, the magnetic axis and the surfaces,
+- ``dipole_field_Bn`` and the GPMO iteration ``GPMO_baseline``.
+
+The Biot-Savart kernels, ``RegularGridInterpolant3D`` and
+``boozer_residual_ds2`` are benchmarked by the C++ executable ``profiling``
+(``make profiling`` in the build directory). Both write their results as JSON
+in the same format, with the time per call in seconds and the throughput in
+the given unit of work per second, so that the output of different releases
+can be compared.
+
+Usage::
+
+    python benchmarks.py [--output FILE] [--min-time SECONDS] [--filter NAME]
+"""
+import argparse
+import json
+import platform
+import sys
+import time
+
+import numpy as np
+
+import simsopt
+import simsoptpp as sopp
+from simsopt.configs import get_ncsx_data, get_hsx_data, get_w7x_data
+from simsopt.field import BiotSavart, InterpolatedField, coils_via_symmetries
+from simsopt.field.tracing import compute_fieldlines
+from simsopt.geo import SurfaceRZFourier, SurfaceXYZTensorFourier
+
+# name, loader, nfp and an approximate minor radius of the plasma
+CONFIGS = [
+    ("NCSX", get_ncsx_data, 3, 0.32),
+    ("HSX", get_hsx_data, 4, 0.12),
+    ("W7-X", get_w7x_data, 5, 0.53),
+]
+
+
+def measure(f, min_time, min_repetitions=3):
+    """
+    Calls f once to warm up and then repeatedly until it has run for at least
+    min_time seconds and at least min_repetitions times. Returns the number
+    of repetitions and the minimal and median time of a call.
+    """
+    f()
+    times = []
+    while sum(times) < min_time or len(times) < min_repetitions:
+        t1 = time.perf_counter()
+        f()
+        times.append(time.perf_counter() - t1)
+    times.sort()
+    return len(times), times[0], times[len(times)//2]
+
+
+def result(name, config, parameters, f, work, work_unit, min_time, min_repetitions=3, metrics=None):
+    repetitions, time_min, time_median = measure(f, min_time, min_repetitions)
+    return {
+        "name": name, "config": config, "parameters": parameters,
+        "repetitions": repetitions, "time_min": time_min, "time_median": time_median,
+        "work": work, "work_unit": work_unit, "throughput": work/time_median,
+        "metrics": {} if metrics is None else metrics,
+    }
+
+
+def torus(nfp, R0, a, nphi, ntheta, phi_range=1.):
+    """ A torus with nphi x ntheta quadrature points on phi_range of the full torus. """
+    s = SurfaceRZFourier(nfp=nfp, stellsym=True, mpol=1, ntor=0,
+                         quadpoints_phi=np.linspace(0, phi_range, nphi, endpoint=False),
+                         quadpoints_theta=np.linspace(0, 1, ntheta, endpoint=False))
+    s.set_rc(0, 0, R0)
+    s.set_rc(1, 0, a)
+    s.set_zs(1, 0, a)
+    return s
+
+
+def benchmark_gamma(name, curves, bs, ma, nfp, R0, a, min_time):
+    results = []
+    for curve in curves[:1] + [ma]:
+        quadpoints = np.ascontiguousarray(curve.quadpoints)
+        gamma = np.zeros((len(quadpoints), 3))
+        results.append(result(
+            f"{type(curve).__name__}.gamma_impl", name, {"order": curve.order, "quadpoints": len(quadpoints)},
+            lambda: curve.gamma_impl(gamma, quadpoints), len(quadpoints), "points", min_time))
+
+    mpol = ntor = 10
+    nphi, ntheta = 4 * ntor + 1, 4 * mpol + 1
+    qphi = np.linspace(0, 1/nfp, nphi, endpoint=False)
+    qtheta = np.linspace(0, 1, ntheta, endpoint=False)
+    for cls in [SurfaceRZFourier, SurfaceXYZTensorFourier]:
+        # the cost doesn't depend on the shape of the surface
+        s = cls(nfp=nfp, stellsym=True, mpol=mpol, ntor=ntor, quadpoints_phi=qphi, quadpoints_theta=qtheta)
+        gamma = np.zeros((nphi, ntheta, 3))
+        results.append(result(
+            f"{cls.__name__}.gamma_impl", name, {"mpol": mpol, "ntor": ntor, "nphi": nphi, "ntheta": ntheta},
+            lambda: s.gamma_impl(gamma, qphi, qtheta), nphi * ntheta, "points", min_time))
+    return results
+
+
+def benchmark_tracing(name, curves, bs, ma, nfp, R0, a, min_time):
+    degree = 4
+    rrange = (R0 - 1.5 * a, R0 + 1.5 * a, 16)
+    phirange = (0, 2 * np.pi / nfp, 32)
+    zrange = (0, 1.5 * a, 8)
+    field = InterpolatedField(bs, degree, rrange, phirange, zrange, True, nfp=nfp, stellsym=True)
+    nlines = 8
+    transits = 20
+    R0s = np.linspace(R0, R0 + 0.8 * a, nlines)
+    Z0s = np.zeros(nlines)
+    tmax = transits * 2 * np.pi * R0
+    steps = []
+
+    def trace():
+        res_tys, _ = compute_fieldlines(field, R0s, Z0s, tmax=tmax, tol=1e-7)
+        steps[:] = [len(tys) for tys in res_tys]
+
+    res = result("compute_fieldlines", name, {"lines": nlines, "transits": transits, "tol": 1e-7, "degree": degree},
+                 trace, 0, "steps", min_time, min_repetitions=1)
+    res["work"] = sum(steps)
+    res["throughput"] = res["work"]/res["time_median"]
+    return [res]
+
+
+def benchmark_permanent_magnets(name, curves, bs, ma, nfp, R0, a, min_time):
+    # the plasma surface and a shell of dipoles around it on half a field period
+    nphi = ntheta = 32
+    s = torus(nfp, R0, a, nphi, ntheta, 1/(2 * nfp))
+    points = np.ascontiguousarray(s.gamma().reshape(-1, 3))
+    unitnormal = np.ascontiguousarray(s.unitnormal().reshape(-1, 3))
+    bs.set_points(points)
+    Bn = np.sum(bs.B() * unitnormal, axis=1)
+
+    ndr, ndphi, ndtheta = 2, 32, 32
+    r, phi, theta = np.meshgrid(np.linspace(1.3 * a, 1.6 * a, ndr), (np.arange(ndphi) + 0.5) * np.pi / (nfp * ndphi),
+                                np.linspace(0, 2 * np.pi, ndtheta, endpoint=False), indexing="ij")
+    R = R0 + r * np.cos(theta)
+    dipoles = np.ascontiguousarray(np.stack([R * np.cos(phi), R * np.sin(phi), r * np.sin(theta)], axis=-1).reshape(-1, 3))
+    ndipoles = dipoles.shape[0]
+
+    b = np.ascontiguousarray(Bn)
+    A = []
+
+    def assemble():
+        A[:] = [sopp.dipole_field_Bn(points, dipoles, unitnormal, nfp, 1, b, "cartesian", R0)]
+
+    results = [result("dipole_field_Bn", name, {"points": points.shape[0], "dipoles": ndipoles},
+                      assemble, points.shape[0] * ndipoles, "interactions", min_time, min_repetitions=1)]
+
+    Ngrid = points.shape[0]
+    Nnorms = np.ascontiguousarray(np.ravel(np.linalg.norm(s.normal(), axis=-1)))
+    A_obj = A[0].reshape(Ngrid, 3 * ndipoles) * np.sqrt(Nnorms / Ngrid)[:, None]
+    b_obj = np.ascontiguousarray(-Bn * np.sqrt(Nnorms / Ngrid))
+    mmax_vec = np.ones(3 * ndipoles)
+    A_gpmo = np.ascontiguousarray((A_obj * mmax_vec).T)
+    K = 1000
+    results.append(result(
+        "GPMO_baseline", name, {"points": Ngrid, "dipoles": ndipoles, "K": K},
+        lambda: sopp.GPMO_baseline(A_obj=A_gpmo, b_obj=b_obj, mmax=mmax_vec, normal_norms=Nnorms, K=K, nhistory=10),
+        K, "iterations", min_time, min_repetitions=1))
+    return results
+
+
+BENCHMARKS = {
+    "gamma_impl": benchmark_gamma,
+    "compute_fieldlines": benchmark_tracing,
+    "permanent_magnets": benchmark_permanent_magnets,
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--output", help="file to write the JSON results to, defaults to stdout")
+    parser.add_argument("--min-time", type=float, default=0.5, help="minimal time per benchmark in seconds")
+    parser.add_argument("--filter", default="", help="only run the benchmarks whose name contains this string")
+    args = parser.parse_args()
+
+    results = []
+    for name, loader, nfp, a in CONFIGS:
+        base_curves, base_currents, ma = loader()
+        coils = coils_via_symmetries(base_curves, base_currents, nfp, True)
+        bs = BiotSavart(coils)
+        R0 = ma.rc[0]
+        for benchmark, run in BENCHMARKS.items():
+            if args.filter not in benchmark:
+                continue
+            print(f"Running {benchmark} for {name}", file=sys.stderr)
+            results += run(name, base_curves, bs, ma, nfp, R0, a, args.min_time)
+
+    context = {
+        "simsopt": simsopt.__version__,
+        "python": platform.python_version(),
+        "numpy": np.__version__,
+        "machine": platform.machine(),
+        "processor": platform.processor(),
+    }
+    out = json.dumps({"context": context, "benchmarks": results}, indent=2)
+    if args.output is None:
+        print(out)
+    else:
+        with open(args.output, "w") as f:
+            f.write(out + "\n")
+
+
+if __name__ == "__main__":
+    main()
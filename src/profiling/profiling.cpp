@@ -1,260 +1,367 @@
-#include "xtensor/xrandom.hpp"
+#include "xtensor/xarray.hpp"
+#include "xtensor/xtensor.hpp"
 #include "xtensor/xlayout.hpp"
+#include "xtensor/xnorm.hpp"
 #include "simdhelpers.h"
 #include "biot_savart_impl.h"
+#include "biot_savart_mixed_impl.h"
 #include "biot_savart_vjp_c.h"
+#include "boozerresidual_impl.h"
+#include "regular_grid_interpolant_3d.h"
+#include "benchmark.h"
 
-#include <chrono>
-#include <iostream>
-#include <iomanip>
 #include <cstdlib>
-#include <stdint.h>
-
-using namespace std;
-
-/* rdtsc returns the Time Stamp Counter, which can serve as a high-resolution, 
-low-overhead way to get CPU timing information.
-The function is implementedd for x86_64, arm64 and PowerPC architectures.
-NOTE: This approach is archaic and should be replaced with a better timing function.
-*/
-#ifdef __x86_64__
-uint64_t rdtsc(){
-    unsigned int lo,hi;
-    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
-    return ((uint64_t)hi << 32) | lo;
-}
-#elif __aarch64__
-uint64_t rdtsc(){
-    uint64_t val;
-    asm volatile("mrs %0, cntvct_el0" : "=r" (val));
-    return val;
-}
-#elif __powerpc__
-uint64_t rdtsc(){
-    uint64_t result=0;
-    unsigned long int upper, lower,tmp;
-    __asm__ volatile(
-                "0:                  \n"
-                "\tmftbu   %0           \n"
-                "\tmftb    %1           \n"
-                "\tmftbu   %2           \n"
-                "\tcmpw    %2,%0        \n"
-                "\tbne     0b         \n"
-                : "=r"(upper),"=r"(lower),"=r"(tmp)
-                );
-    result = upper;
-    result = result << 32;
-    result = result | lower;
+#include <functional>
+#include <iostream>
+#include <random>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
-    return(result);
-}
+#ifndef SIMSOPT_CONFIGS_DIR
+#define SIMSOPT_CONFIGS_DIR "src/simsopt/configs"
 #endif
 
+/* Benchmarks of the C++ kernels of simsoptpp for the coils of NCSX, HSX and
+ * W7-X. The results are written as JSON, see benchmark.h. The kernels that
+ * take numpy arrays (field line tracing, the gamma_impl of the curves and
+ * surfaces, dipole_field_Bn and GPMO) are benchmarked from python by
+ * src/profiling/benchmarks.py, which writes the same format.
+ *
+ * Usage: profiling [--output FILE] [--configs DIR] [--min-time SECONDS] [--filter NAME]
+ */
+
+using namespace std;
 
-template<class vector_type>
-void profile_biot_savart(int nsources, int ntargets, int nderivatives){ 
-    // using vector_type = AlignedPaddedVec;
+using Array = xt::xarray<double>;
+template<class Type, std::size_t rank, xt::layout_type layout>
+using DefaultTensor = xt::xtensor<Type, rank, layout, XTENSOR_DEFAULT_ALLOCATOR(double)>;
+using Tensor2 = DefaultTensor<double, 2, xt::layout_type::row_major>;
 
-    xt::xarray<double> points         = xt::random::randn<double>({ntargets, 3});
-    xt::xarray<double> gamma          = xt::random::randn<double>({nsources, 3});
-    xt::xarray<double> dgamma_by_dphi = xt::random::randn<double>({nsources, 3});
+struct Points {
+    AlignedPaddedVec x, y, z;
+    int size() const { return x.size(); }
+};
 
-    auto B = xt::xarray<double>::from_shape({points.shape(0), 3});
-    auto dB_by_dX = xt::xarray<double>::from_shape({points.shape(0), 3, 3});
-    auto d2B_by_dXdX = xt::xarray<double>::from_shape({points.shape(0), 3, 3, 3});
-    int n = int(1e8/(nsources*ntargets));
+Points make_points(const Vec& xs, const Vec& ys, const Vec& zs) {
+    Points p{AlignedPaddedVec(xs.size(), 0), AlignedPaddedVec(xs.size(), 0), AlignedPaddedVec(xs.size(), 0)};
+    for (size_t i = 0; i < xs.size(); ++i) {
+        p.x[i] = xs[i];
+        p.y[i] = ys[i];
+        p.z[i] = zs[i];
+    }
+    return p;
+}
 
-    auto pointsx = vector_type(ntargets, 0);
-    auto pointsy = vector_type(ntargets, 0);
-    auto pointsz = vector_type(ntargets, 0);
-    for (int j = 0; j < ntargets; ++j) {
-        pointsx[j] = points(j, 0);
-        pointsy[j] = points(j, 1);
-        pointsz[j] = points(j, 2);
+// nphi x ntheta points on the torus of the major and minor radius of the
+// config, over the full torus or over one field period
+Points torus_points(CoilConfig& config, int nphi, int ntheta, bool field_period=false) {
+    Vec xs, ys, zs;
+    double phi_max = field_period ? 2 * M_PI / config.nfp : 2 * M_PI;
+    for (int i = 0; i < nphi; ++i) {
+        double phi = phi_max * i / nphi;
+        for (int j = 0; j < ntheta; ++j) {
+            double theta = 2 * M_PI * j / ntheta;
+            double R = config.major_radius + config.minor_radius * cos(theta);
+            xs.push_back(R * cos(phi));
+            ys.push_back(R * sin(phi));
+            zs.push_back(config.minor_radius * sin(theta));
+        }
     }
-    uint64_t tick = rdtsc();  // tick before
-    auto t1 = std::chrono::high_resolution_clock::now();
-    for (int i = 0; i < n; ++i) {
-        if(nderivatives == 0)
-            biot_savart_kernel<xt::xarray<double>, 0>(pointsx, pointsy, pointsz, gamma, dgamma_by_dphi, B, dB_by_dX, d2B_by_dXdX);
-        else if(nderivatives == 1)
-            biot_savart_kernel<xt::xarray<double>, 1>(pointsx, pointsy, pointsz, gamma, dgamma_by_dphi, B, dB_by_dX, d2B_by_dXdX);
+    return make_points(xs, ys, zs);
+}
+
+// The field of all coils of the config and its first derivs derivatives, as
+// computed by BiotSavart.
+template<int derivs>
+void coil_field(CoilConfig& config, Points& points, bool mixed_precision, Array& B, Array& dB, Array& ddB) {
+    int n = points.size();
+    Array B_coil = xt::zeros<double>({n, 3});
+    Array dB_coil = xt::zeros<double>({n, 3, 3});
+    Array ddB_coil = xt::zeros<double>({n, 3, 3, 3});
+    B = xt::zeros<double>({n, 3});
+    dB = xt::zeros<double>({n, 3, 3});
+    ddB = xt::zeros<double>({n, 3, 3, 3});
+    for (size_t c = 0; c < config.gamma.size(); ++c) {
+        Array& gamma = config.gamma[c];
+        Array& gammadash = config.gammadash[c];
+        if(mixed_precision)
+            biot_savart_kernel_mixed<Array, derivs>(points.x, points.y, points.z, gamma, gammadash, B_coil, dB_coil, ddB_coil);
         else
-            biot_savart_kernel<xt::xarray<double>, 2>(pointsx, pointsy, pointsz, gamma, dgamma_by_dphi, B, dB_by_dX, d2B_by_dXdX);
-        //if(i==0){
-        //    std::cout << B(0, 0) << " " << B(8, 0) << std::endl;
-        //    std::cout << dB_by_dX(0, 0, 0) << " " << dB_by_dX(8, 0, 0) << std::endl;
-        //    std::cout << d2B_by_dXdX(0, 0, 0, 0) << " " << d2B_by_dXdX(8, 0, 0, 0) << std::endl;
-        //}
+            biot_savart_kernel<Array, derivs>(points.x, points.y, points.z, gamma, gammadash, B_coil, dB_coil, ddB_coil);
+        double current = config.currents[c];
+        B += current * B_coil;
+        if(derivs > 0)
+            dB += current * dB_coil;
+        if(derivs > 1)
+            ddB += current * ddB_coil;
     }
-    auto t2 = std::chrono::high_resolution_clock::now();
-    auto clockcycles = rdtsc() - tick;
-    double simdtime = std::chrono::duration_cast<std::chrono::milliseconds>( t2 - t1 ).count();
-    double interactions = points.shape(0) * gamma.shape(0) * n;
-    std::cout << std::setw (10) << nsources*ntargets 
-        << std::setw (13) << simdtime/n 
-        << std::setw (19) << std::setprecision(5) << (interactions/(1e9 * simdtime/1000.)) 
-        << std::setw (19)<< clockcycles/interactions 
-        << std::endl;
 }
 
-template<class vector_type>
-void profile_biot_savart_vjp(int nsources, int ntargets, int nderivatives){ 
-    // using vector_type = AlignedPaddedVec;
+void run_coil_field(int derivs, CoilConfig& config, Points& points, bool mixed_precision, Array& B, Array& dB, Array& ddB) {
+    if(derivs == 0)
+        coil_field<0>(config, points, mixed_precision, B, dB, ddB);
+    else if(derivs == 1)
+        coil_field<1>(config, points, mixed_precision, B, dB, ddB);
+    else
+        coil_field<2>(config, points, mixed_precision, B, dB, ddB);
+}
 
-    xt::xarray<double> points         = xt::random::randn<double>({ntargets, 3});
-    xt::xarray<double> gamma          = xt::random::randn<double>({nsources, 3});
-    xt::xarray<double> dgamma_by_dphi = xt::random::randn<double>({nsources, 3});
-    xt::xarray<double> v = xt::random::randn<double>({ntargets, 3});
-    xt::xarray<double> vgrad = xt::random::randn<double>({ntargets, 3, 3});
+void benchmark_biot_savart(CoilConfig& config, double min_time, vector<BenchmarkResult>& results) {
+    int nphi = 64, ntheta = 32;
+    Points points = torus_points(config, nphi, ntheta);
+    for (bool mixed_precision : {false, true}) {
+        for (int derivs = 0; derivs <= 2; ++derivs) {
+            BenchmarkResult r;
+            r.name = mixed_precision ? "biot_savart_mixed" : "biot_savart";
+            r.config = config.name;
+            r.parameters = {{"derivatives", derivs}, {"sources", config.num_quadrature_points()}, {"targets", points.size()}};
+            r.work = double(config.num_quadrature_points()) * points.size();
+            r.work_unit = "interactions";
+            Array B, dB, ddB;
+            measure(r, min_time, [&]() { run_coil_field(derivs, config, points, mixed_precision, B, dB, ddB); });
+            if(mixed_precision) {
+                // relative error of the highest derivative compared to the double precision kernel
+                Array Bref, dBref, ddBref;
+                run_coil_field(derivs, config, points, false, Bref, dBref, ddBref);
+                double err;
+                if(derivs == 0)
+                    err = xt::norm_l2(B-Bref)()/xt::norm_l2(Bref)();
+                else if(derivs == 1)
+                    err = xt::norm_l2(dB-dBref)()/xt::norm_l2(dBref)();
+                else
+                    err = xt::norm_l2(ddB-ddBref)()/xt::norm_l2(ddBref)();
+                r.metrics.push_back({"relative_error", err});
+            }
+            results.push_back(r);
+        }
+    }
+}
 
-    auto pointsx = vector_type(points.shape(0), 0);
-    auto pointsy = vector_type(points.shape(0), 0);
-    auto pointsz = vector_type(points.shape(0), 0);
-    for (int i = 0; i < points.shape(0); ++i) {
-        pointsx[i] = points(i, 0);
-        pointsy[i] = points(i, 1);
-        pointsz[i] = points(i, 2);
+void benchmark_biot_savart_vjp(CoilConfig& config, double min_time, vector<BenchmarkResult>& results) {
+    int nphi = 64, ntheta = 32;
+    Points points = torus_points(config, nphi, ntheta);
+    int n = points.size();
+    std::mt19937 generator(1);
+    std::normal_distribution<double> normal;
+    Array v = xt::zeros<double>({n, 3});
+    Array vgrad = xt::zeros<double>({n, 3, 3});
+    for (auto& x : v)
+        x = normal(generator);
+    for (auto& x : vgrad)
+        x = normal(generator);
+    for (int derivs = 0; derivs <= 1; ++derivs) {
+        BenchmarkResult r;
+        r.name = "biot_savart_vjp";
+        r.config = config.name;
+        r.parameters = {{"derivatives", derivs}, {"sources", config.num_quadrature_points()}, {"targets", n}};
+        r.work = double(config.num_quadrature_points()) * n;
+        r.work_unit = "interactions";
+        measure(r, min_time, [&]() {
+            for (size_t c = 0; c < config.gamma.size(); ++c) {
+                Array& gamma = config.gamma[c];
+                Array& gammadash = config.gammadash[c];
+                int nquad = gamma.shape(0);
+                Array res_gamma = xt::zeros<double>({nquad, 3});
+                Array res_gammadash = xt::zeros<double>({nquad, 3});
+                Array res_grad_gamma = xt::zeros<double>({nquad, 3});
+                Array res_grad_gammadash = xt::zeros<double>({nquad, 3});
+                if(derivs == 0)
+                    biot_savart_vjp_kernel<Array, 0>(points.x, points.y, points.z, gamma, gammadash, v, res_gamma, res_gammadash, vgrad, res_grad_gamma, res_grad_gammadash);
+                else
+                    biot_savart_vjp_kernel<Array, 1>(points.x, points.y, points.z, gamma, gammadash, v, res_gamma, res_gammadash, vgrad, res_grad_gamma, res_grad_gammadash);
+            }
+        });
+        results.push_back(r);
     }
+}
 
-    xt::xarray<double> res_gamma = xt::zeros<double>({nsources, 3});
-    xt::xarray<double> res_dgamma_by_dphi = xt::zeros<double>({nsources, 3});
-    xt::xarray<double> res_grad_gamma = xt::zeros<double>({nsources, 3});
-    xt::xarray<double> res_grad_dgamma_by_dphi = xt::zeros<double>({nsources, 3});
+// Interpolates the field of the coils in cylindrical coordinates on one field
+// period, as InterpolatedField does, and evaluates the interpolant at random
+// points.
+void benchmark_interpolant(CoilConfig& config, double min_time, vector<BenchmarkResult>& results) {
+    double R0 = config.major_radius, a = 1.5 * config.minor_radius;
+    RangeTriplet rrange = {R0 - a, R0 + a, 16};
+    RangeTriplet phirange = {0., 2 * M_PI / config.nfp, 32};
+    RangeTriplet zrange = {-a, a, 16};
+    std::function<Vec(Vec, Vec, Vec)> f = [&config](Vec rs, Vec phis, Vec zs) {
+        Vec xs(rs.size()), ys(rs.size());
+        for (size_t i = 0; i < rs.size(); ++i) {
+            xs[i] = rs[i] * cos(phis[i]);
+            ys[i] = rs[i] * sin(phis[i]);
+        }
+        Points points = make_points(xs, ys, zs);
+        Array B, dB, ddB;
+        coil_field<0>(config, points, false, B, dB, ddB);
+        return Vec(B.begin(), B.end());
+    };
 
+    for (int degree : {3, 5}) {
+        auto rule = UniformInterpolationRule(degree);
+        int nnodes = (std::get<2>(rrange) * degree + 1) * (std::get<2>(phirange) * degree + 1) * (std::get<2>(zrange) * degree + 1);
 
-    int n = int(1e8/(nsources*ntargets));
+        BenchmarkResult build;
+        build.name = "regular_grid_interpolant_build";
+        build.config = config.name;
+        build.parameters = {{"degree", degree}, {"nr", std::get<2>(rrange)}, {"nphi", std::get<2>(phirange)}, {"nz", std::get<2>(zrange)}};
+        build.work = nnodes;
+        build.work_unit = "nodes";
+        std::unique_ptr<RegularGridInterpolant3D<Tensor2>> interpolant;
+        measure(build, min_time, [&]() {
+            interpolant = std::make_unique<RegularGridInterpolant3D<Tensor2>>(rule, rrange, phirange, zrange, 3, false);
+            interpolant->interpolate_batch(f);
+        }, 1);
+        auto err = interpolant->estimate_error(f, 1000);
+        build.metrics.push_back({"error_mean", err.first});
+        build.metrics.push_back({"error_max", err.second});
+        results.push_back(build);
 
-    uint64_t tick = rdtsc();  // tick before
-    auto t1 = std::chrono::high_resolution_clock::now();
-    for (int i = 0; i < n; ++i) {
-        if(nderivatives == 0)
-            biot_savart_vjp_kernel<xt::xarray<double>, 0>(pointsx, pointsy, pointsz, gamma, dgamma_by_dphi, v, res_gamma, res_dgamma_by_dphi, vgrad, res_grad_gamma, res_grad_dgamma_by_dphi);
-        else
-            biot_savart_vjp_kernel<xt::xarray<double>, 1>(pointsx, pointsy, pointsz, gamma, dgamma_by_dphi, v, res_gamma, res_dgamma_by_dphi, vgrad, res_grad_gamma, res_grad_dgamma_by_dphi);
+        int samples = 100000;
+        std::mt19937 generator(1);
+        std::uniform_real_distribution<double> uniform(0.01, 0.99);
+        Tensor2 rphiz = xt::zeros<double>({samples, 3});
+        Tensor2 B = xt::zeros<double>({samples, 3});
+        for (int i = 0; i < samples; ++i) {
+            rphiz(i, 0) = R0 - a + 2 * a * uniform(generator);
+            rphiz(i, 1) = 2 * M_PI / config.nfp * uniform(generator);
+            rphiz(i, 2) = -a + 2 * a * uniform(generator);
+        }
+        BenchmarkResult evaluate;
+        evaluate.name = "regular_grid_interpolant_evaluate";
+        evaluate.config = config.name;
+        evaluate.parameters = build.parameters;
+        evaluate.parameters.push_back({"points", samples});
+        evaluate.work = samples;
+        evaluate.work_unit = "points";
+        measure(evaluate, min_time, [&]() { interpolant->evaluate_batch(rphiz, B); });
+        results.push_back(evaluate);
     }
-    auto t2 = std::chrono::high_resolution_clock::now();
-    auto clockcycles = rdtsc() - tick;
-    double simdtime = std::chrono::duration_cast<std::chrono::milliseconds>( t2 - t1 ).count();
-    double interactions = points.shape(0) * gamma.shape(0) * n;
-    std::cout << std::setw (10) << nsources*ntargets 
-        << std::setw (13) << simdtime/n 
-        << std::setw (19) << std::setprecision(5) << (interactions/(1e9 * simdtime/1000.)) 
-        << std::setw (19)<< clockcycles/interactions 
-        << std::endl;
 }
 
-/*
-#include <functional>
-#include "regular_grid_interpolant_3d.h"
-template<class Type, std::size_t rank, xt::layout_type layout>
-using DefaultTensor = xt::xtensor<Type, rank, layout, XTENSOR_DEFAULT_ALLOCATOR(double)>;
-using Tensor2 = DefaultTensor<double, 2, xt::layout_type::row_major>;
-using std::sin;
-using std::cos;
-using std::exp;
+// boozer_residual_ds2 for a surface with the resolution of the BoozerLS
+// examples (mpol = ntor = 6, stellarator symmetric) on the torus of the
+// config, with the field of the coils. The derivatives of the surface with
+// respect to its dofs are random, which doesn't change the cost.
+void benchmark_boozer_residual(CoilConfig& config, double min_time, vector<BenchmarkResult>& results) {
+    int mpol = 6, ntor = 6;
+    int nphi = 2 * ntor + 1 + 5, ntheta = 2 * mpol + 1 + 5;
+    int ndofs = 3 * (2 * mpol + 1) * (2 * ntor + 1) / 2;
+    Points points = torus_points(config, nphi, ntheta, true);
+    Array B_flat, dB_flat, ddB_flat;
+    coil_field<2>(config, points, false, B_flat, dB_flat, ddB_flat);
+    Array B = B_flat;
+    B.reshape({nphi, ntheta, 3});
+    Array dB = dB_flat;
+    dB.reshape({nphi, ntheta, 3, 3});
+    Array ddB = ddB_flat;
+    ddB.reshape({nphi, ntheta, 3, 3, 3});
 
-Vec batchify(std::function<Vec(double, double, double)>& f, Vec xs, Vec ys, Vec zs){
-    Vec fxyz = f(0., 0., 0.);
-    int value_size = fxyz.size();
-    int n = xs.size();
-    Vec res(value_size*n, 0.);
-    for (int i = 0; i < n; ++i) {
-        fxyz = f(xs[i], ys[i], zs[i]);
-        for (int l = 0; l < value_size; ++l) {
-            res[i*value_size + l] = fxyz[l];
+    Array xphi = xt::zeros<double>({nphi, ntheta, 3});
+    Array xtheta = xt::zeros<double>({nphi, ntheta, 3});
+    double R0 = config.major_radius, a = config.minor_radius;
+    double modB = 0.;
+    for (int i = 0; i < nphi; ++i) {
+        double phi = 2 * M_PI / config.nfp * i / nphi;
+        for (int j = 0; j < ntheta; ++j) {
+            double theta = 2 * M_PI * j / ntheta;
+            double R = R0 + a * cos(theta);
+            xphi(i, j, 0) = -2 * M_PI * R * sin(phi);
+            xphi(i, j, 1) = 2 * M_PI * R * cos(phi);
+            xtheta(i, j, 0) = -2 * M_PI * a * sin(theta) * cos(phi);
+            xtheta(i, j, 1) = -2 * M_PI * a * sin(theta) * sin(phi);
+            xtheta(i, j, 2) = 2 * M_PI * a * cos(theta);
+            modB += sqrt(B(i, j, 0) * B(i, j, 0) + B(i, j, 1) * B(i, j, 1) + B(i, j, 2) * B(i, j, 2));
         }
     }
-    return res;
-}
-*/
-/*
-void profile_interpolation(InterpolationRule rule, int nx, int ny, int nz){
-    std::function<Vec(double, double, double)> f = [](double x, double y, double z) { return Vec{x+2*y+3*z, x*x+y*y+z*z, sin(5*x)*cos(x)+sin(y*x)+exp(z)}; };
-    double x = 0.13;
-    double y = 0.221;
-    double z = 0.31;
-    auto fx = f(x, y, z);
-    std::function<Vec(Vec, Vec, Vec)> fb = [&f](Vec x, Vec y, Vec z) { return batchify(f, x, y, z); };
+    // G = mu0 I_pol / (2 pi) is approximately |B| R0 on the torus
+    double G = 2 * M_PI * R0 * modB / (nphi * ntheta);
+    double iota = 0.4;
 
-    auto fh = RegularGridInterpolant3D<Tensor2>(rule, nx, ny, nz, 3);
-    //fh.interpolate(f);
-    fh.interpolate_batch(fb);
-    auto fhx = fh.evaluate(x, y, z);
-    //fmt::print("fh({}, {}, {}) = [{}, {}, {}]\n", x, y, z, fhx[0], fhx[1], fhx[2]);
-    //fmt::print(" f({}, {}, {}) = [{}, {}, {}]\n", x, y, z, fx[0], fx[1], fx[2]);
-    auto err = fh.estimate_error(fb, 1000000);
-    //fmt::print("[{}, {}]\n", err.first, err.second);
+    std::mt19937 generator(1);
+    std::normal_distribution<double> normal;
+    Array dx_ds = xt::zeros<double>({nphi, ntheta, 3, ndofs});
+    Array dxphi_ds = xt::zeros<double>({nphi, ntheta, 3, ndofs});
+    Array dxtheta_ds = xt::zeros<double>({nphi, ntheta, 3, ndofs});
+    for (Array* arr : {&dx_ds, &dxphi_ds, &dxtheta_ds})
+        for (auto& x : *arr)
+            x = normal(generator);
 
-    int samples = 1000000;
-    std::default_random_engine generator;
-    std::uniform_real_distribution<double> distribution(0.0, +1.0);
-    Tensor2 xyz = xt::zeros<double>({samples, 3});
-    Tensor2 fhxyz = xt::zeros<double>({samples, 3});
-    for (int i = 0; i < samples; ++i) {
-        xyz(i, 0) = 0.01 + 0.98*distribution(generator);
-        xyz(i, 1) = 0.01 + 0.98*distribution(generator);
-        xyz(i, 2) = 0.01 + 0.98*distribution(generator);
-    }
-    auto t1 = std::chrono::high_resolution_clock::now();
-    fh.evaluate_batch(xyz, fhxyz);
-    auto t2 = std::chrono::high_resolution_clock::now();
-    double time = std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count();
-    fmt::print("{:1d}  {:10d}   {:.7f}µs   {:.15f}\n", rule.degree, nx*ny*nz, time/samples, (err.first+err.second)/2);
-    //std::cout << std::setw (10) << rule.degree
-    //    << std::setw (10) << nx*ny*nz
-    //    << std::setw (13) << time/samples
-    //    << std::setw (19) << std::setprecision(5) << (err.first+err.second)/2 << std::endl;
+    BenchmarkResult r;
+    r.name = "boozer_residual_ds2";
+    r.config = config.name;
+    r.parameters = {{"nphi", nphi}, {"ntheta", ntheta}, {"ndofs", ndofs}};
+    r.work = double(nphi) * ntheta;
+    r.work_unit = "points";
+    double res;
+    Array dres = xt::zeros<double>({ndofs + 2});
+    Array d2res = xt::zeros<double>({ndofs + 2, ndofs + 2});
+    measure(r, min_time, [&]() {
+        res = 0.;
+        dres.fill(0.);
+        d2res.fill(0.);
+        boozer_residual_impl<Array, 2>(G, iota, B, dB, ddB, xphi, xtheta, dx_ds, dxphi_ds, dxtheta_ds, res, dres, d2res, ndofs, true);
+    });
+    results.push_back(r);
 }
-*/
 
+int main(int argc, char** argv) {
+    string output = "";
+    string configs_dir = SIMSOPT_CONFIGS_DIR;
+    string filter = "";
+    double min_time = 0.5;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if(i + 1 < argc && arg == "--output")
+            output = argv[++i];
+        else if(i + 1 < argc && arg == "--configs")
+            configs_dir = argv[++i];
+        else if(i + 1 < argc && arg == "--min-time")
+            min_time = std::stod(argv[++i]);
+        else if(i + 1 < argc && arg == "--filter")
+            filter = argv[++i];
+        else {
+            cerr << "Usage: " << argv[0] << " [--output FILE] [--configs DIR] [--min-time SECONDS] [--filter NAME]" << endl;
+            return 1;
+        }
+    }
 
-
-int main() {
-
+    vector<std::pair<string, string>> context;
 #if defined(USE_XSIMD)
-    cout << "BiotSavart with XSIMD:\n";
+    context.push_back({"simd", fmt::format("xsimd ({} doubles)", xsimd::simd_type<double>::size)});
 #else
-    cout << "BiotSavart with No-XSIMD:\n";
+    context.push_back({"simd", "none"});
 #endif
-    for(int nd=0; nd<3; nd++) {
-        std::cout << "Number of derivatives: " << nd << std::endl;
-        std::cout << "         N" << " Time (in ms)" << " Gigainteractions/s" << " cycles/interaction" << std::endl;
-        for(int nst=10; nst<=10000; nst*=10)
-            profile_biot_savart<AlignedPaddedVec>(nst, nst, nd);
-    }
-
-
-    /*cout << "BiotSavartVJP with Non XSIMD:\n";
-    for(int nd=0; nd<2; nd++) {
-        std::cout << "Number of derivatives: " << nd << std::endl;
-        std::cout << "         N" << " Time (in ms)" << " Gigainteractions/s" << " cycles/interaction" << std::endl;
-        for(int nst=10; nst<=10000; nst*=10)
-            profile_biot_savart_vjp<AlignedPaddedVecPortable>(nst, nst, nd);
-    }*/
-#if defined(USE_XSIMD)
-    cout << "BiotSavartVJP with XSIMD:\n";
+#if defined(_OPENMP)
+    context.push_back({"threads", std::to_string(omp_get_max_threads())});
 #else
-    cout << "BiotSavartVJP with Non XSIMD:\n";
+    context.push_back({"threads", "1"});
 #endif
-    for(int nd=0; nd<2; nd++) {
-        std::cout << "Number of derivatives: " << nd << std::endl;
-        std::cout << "         N" << " Time (in ms)" << " Gigainteractions/s" << " cycles/interaction" << std::endl;
-        for(int nst=10; nst<=10000; nst*=10)
-            profile_biot_savart_vjp<AlignedPaddedVec>(nst, nst, nd);
-    }
+    context.push_back({"compiler", __VERSION__});
 
-    /*
-    for (int deg = 1; deg <= 6; ++deg) {
-        for (int n = 1; n*deg <= 128; n*=2) {
-            profile_interpolation(UniformInterpolationRule(deg), n, n, n);
-            //profile_interpolation(ChebyshevInterpolationRule(deg), n, n, n);
+    using Benchmark = std::function<void(CoilConfig&, double, vector<BenchmarkResult>&)>;
+    vector<std::pair<string, Benchmark>> benchmarks = {
+        {"biot_savart", benchmark_biot_savart},
+        {"biot_savart_vjp", benchmark_biot_savart_vjp},
+        {"regular_grid_interpolant", benchmark_interpolant},
+        {"boozer_residual_ds2", benchmark_boozer_residual},
+    };
+
+    vector<BenchmarkResult> results;
+    for (auto& config : load_coil_configs(configs_dir)) {
+        for (auto& [name, benchmark] : benchmarks) {
+            if(name.find(filter) == string::npos)
+                continue;
+            cerr << "Running " << name << " for " << config.name << endl;
+            benchmark(config, min_time, results);
         }
-        std::cout << std::endl;
     }
-    */
-    //profile_interpolation(UniformInterpolationRule(2), 64, 64, 64);
-    //profile_interpolation(UniformInterpolationRule(8), 2, 2, 2);
 
+    string json = benchmarks_to_json(context, results);
+    if(output.empty()) {
+        cout << json;
+    } else {
+        std::ofstream file(output);
+        file << json;
+    }
     return 0;
 }
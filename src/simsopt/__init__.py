@@ -21,3 +21,5 @@ from ._version import version as __version__
 
 # Expose XSIMD depedency in simsoptpp
 from simsoptpp import using_xsimd as __built_with_xsimd__
+# The instruction set simsoptpp was compiled for, see SIMSOPT_SIMD_DISPATCH
+from simsoptpp import simd_variant as __simd_variant__
@@ -7,7 +7,9 @@ This module contains small utility functions and classes needed by *_core*
 subpackage.
 """
 
+import hashlib
 import itertools
+import os
 from numbers import Integral, Real, Number
 from dataclasses import dataclass
 from abc import ABCMeta
@@ -297,3 +299,53 @@ def parallel_loop_bounds(comm, n):
         assert idxs[-1] == n
         return idxs[comm.rank], idxs[comm.rank+1]
 
+
+
+def dynamic_loop_chunks(comm, n, chunk_size):
+    """
+    Hand out the indices [0, 1, ..., n-1] across an mpi communicator in chunks
+    of (at most) ``chunk_size`` consecutive indices, on demand. This is a
+    generator yielding ``range`` objects; the next chunk is taken from a
+    counter on rank 0 with an atomic one sided operation, so that ranks
+    whose work items finish early pick up more chunks. The generator has to
+    be consumed completely on all ranks, since creating and freeing the
+    counter is collective. For ``comm=None`` all indices are yielded.
+    """
+
+    assert chunk_size > 0
+    if comm is None:
+        for start in range(0, n, chunk_size):
+            yield range(start, min(start + chunk_size, n))
+        return
+    from mpi4py import MPI
+    counter = np.zeros(1, dtype=np.int64)
+    win = MPI.Win.Create(counter if comm.rank == 0 else None, comm=comm)
+    incr = np.array([chunk_size], dtype=np.int64)
+    start = np.zeros(1, dtype=np.int64)
+    try:
+        while True:
+            win.Lock(0)
+            win.Fetch_and_op(incr, start, 0, 0, MPI.SUM)
+            win.Unlock(0)
+            if start[0] >= n:
+                break
+            yield range(int(start[0]), min(int(start[0]) + chunk_size, n))
+    finally:
+        win.Free()
+
+
+def interpolant_cache_prefix(cache_dir, params, probes):
+    """
+    Returns the path prefix in ``cache_dir`` of the files into which an
+    interpolated field caches its interpolants. The name is a hash of
+    ``params``, a tuple describing the interpolant, and of ``probes``, the
+    values of the underlying field at a few points. Any change of the
+    underlying field changes its values at generic points, so the cache does
+    not need to know how the field was set up.
+    """
+
+    h = hashlib.sha256()
+    h.update(repr(params).encode())
+    h.update(np.ascontiguousarray(probes, dtype=np.float64).tobytes())
+    os.makedirs(cache_dir, exist_ok=True)
+    return os.path.join(cache_dir, h.hexdigest()[:32])
@@ -2,9 +2,10 @@ import numpy as np
 
 import simsoptpp as sopp
 from .magneticfield import MagneticField
+from .mgrid import MGrid
 from .._core.json import GSONDecoder
 
-__all__ = ['BiotSavart']
+__all__ = ['BiotSavart', 'BiotSavartSymmetric']
 
 
 class BiotSavart(sopp.BiotSavart, MagneticField):
@@ -18,6 +19,61 @@ class BiotSavart(sopp.BiotSavart, MagneticField):
 
     where :math:`\mu_0=4\pi 10^{-7}` is the magnetic constant.
 
+    If both the field and the vector potential are needed at the same points,
+    ``compute_all(derivatives_B, derivatives_A)`` evaluates them (and the
+    requested number of derivatives) in a single pass over the coils and fills
+    the caches for both.
+
+    For large numbers of evaluation points, the direct summation can be
+    replaced by a treecode approximation via ``set_treecode(theta)``. The
+    opening parameter ``theta`` controls the accuracy: the relative error of
+    ``B``, ``dB_by_dX`` and ``A`` (and their derivatives) scales as
+    ``theta**3``. Setting ``theta=0`` restores the direct summation.
+
+    Calling ``set_mixed_precision(True)`` evaluates the direct summation in
+    single precision (which doubles the SIMD width) with double precision
+    accumulation. The relative error is around ``1e-6``, which is sufficient
+    e.g. for the early iterations of a coil optimization.
+
+    The fields of the individual coils are only evaluated again for coils
+    whose curve has changed since the last evaluation. If only the currents
+    change, the total field is obtained by summing up the stored per coil
+    fields with the new currents.
+
+    To evaluate the field on several independent sets of points (e.g. on a
+    number of surfaces), ``B_batch(points)`` and ``dB_by_dX_batch(points)``
+    take a list of arrays of shape ``(n_k, 3)`` and evaluate all of them in
+    one pass, without changing the points set via ``set_points``.
+
+    For fixed coil shapes and points, the field is linear in the currents.
+    ``response_matrix()`` returns the fields of all coils per unit current as
+    one array of shape ``(ncoils, npoints, 3)``, and
+    ``normal_response_matrix(normal)`` their normal components as an array of
+    shape ``(ncoils, npoints)``. Both are kept until the points or the coil
+    shapes change, and ``B_from_currents``, ``Bn_from_currents``,
+    ``B_vjp_currents`` and ``Bn_vjp_currents`` evaluate the field and the
+    derivatives with respect to the currents as a single matrix vector
+    product.
+
+    By default, the fields of the individual coils are stored, since they are
+    needed for the derivatives with respect to the coil currents and for the
+    vector Jacobian products. When only the total field is required (e.g. for
+    field line or particle tracing), ``set_totals_only(True)`` avoids storing
+    these, which reduces the memory footprint from ``ncoils`` to one field
+    per point.
+
+    ``set_adaptive_quadrature(eta)`` evaluates blocks of points that are far
+    away from a coil with a decimated quadrature of that coil (every second,
+    fourth, ... quadrature point). The coarsest level whose point spacing
+    ``h`` satisfies ``distance >= eta * h`` is used, and the relative error
+    behaves roughly like ``exp(-2*pi*eta)``; e.g. ``eta=6`` typically gives
+    errors below ``1e-8``. The field and its derivatives are approximated,
+    the vector Jacobian products always use all quadrature points.
+
+    If simsopt was compiled with ``SIMSOPT_WITH_CUDA=ON``, the direct
+    summation and the vector Jacobian products can be evaluated on the GPU
+    after calling ``simsoptpp.set_gpu_enabled(True)``.
+
     Args:
         coils: A list of :obj:`simsopt.field.coil.Coil` objects.
     """
@@ -105,19 +161,51 @@ class BiotSavart(sopp.BiotSavart, MagneticField):
         """
 
         coils = self._coils
-        gammas = [coil.curve.gamma() for coil in coils]
-        gammadashs = [coil.curve.gammadash() for coil in coils]
-        currents = [coil.current.get_value() for coil in coils]
-        res_gamma = [np.zeros_like(gamma) for gamma in gammas]
-        res_gammadash = [np.zeros_like(gammadash) for gammadash in gammadashs]
-
-        points = self.get_points_cart_ref()
-        sopp.biot_savart_vjp_graph(points, gammas, gammadashs, currents, v,
-                                   res_gamma, res_gammadash, [], [], [])
-        dB_by_dcoilcurrents = self.dB_by_dcoilcurrents()
-        res_current = [np.sum(v * dB_by_dcoilcurrents[i]) for i in range(len(dB_by_dcoilcurrents))]
+        res_gamma = [np.zeros_like(coil.curve.gamma()) for coil in coils]
+        res_gammadash = [np.zeros_like(coil.curve.gammadash()) for coil in coils]
+        res_current = self.B_vjp_graph(v, res_gamma, res_gammadash)
         return sum([coils[i].vjp(res_gamma[i], res_gammadash[i], np.asarray([res_current[i]])) for i in range(len(coils))])
 
+    def squared_flux(self, normal, target=None, definition="quadratic flux", derivatives=False):
+        r"""
+        Returns the objective of :obj:`simsopt.objectives.SquaredFlux` for
+        the field at the points, which have to be the quadrature points of a
+        surface with the given normals (of shape ``(npoints, 3)`` or
+        ``(nphi, ntheta, 3)``) and optional target values of
+        :math:`\mathbf{B}\cdot\mathbf{n}`. :math:`\mathbf{B}\cdot\mathbf{n}`
+        is reduced to the objective block by block of points, without
+        creating the intermediate arrays. If ``derivatives`` is true, the
+        derivative of the objective with respect to the coil dofs is computed
+        in the same pass and returned as well.
+        """
+
+        normal = np.ascontiguousarray(normal).reshape((-1, 3))
+        target = np.zeros((0,)) if target is None else np.ascontiguousarray(target).reshape((-1,))
+        if not derivatives:
+            J, _ = self.squared_flux_graph(normal, target, definition, False, [], [])
+            return J
+        coils = self._coils
+        res_gamma = [np.zeros_like(coil.curve.gamma()) for coil in coils]
+        res_gammadash = [np.zeros_like(coil.curve.gammadash()) for coil in coils]
+        J, res_current = self.squared_flux_graph(normal, target, definition, True, res_gamma, res_gammadash)
+        return J, sum([coils[i].vjp(res_gamma[i], res_gammadash[i], np.asarray([res_current[i]])) for i in range(len(coils))])
+
+    def B_and_B_vjp(self, v):
+        r"""
+        Returns the field :math:`\mathbf{B}` and the vector Jacobian product
+        of :obj:`simsopt.field.biotsavart.BiotSavart.B_vjp`, computed in a
+        single pass over the pairs of evaluation points and quadrature points.
+        This is cheaper than calling ``B()`` and ``B_vjp(v)`` separately, but
+        requires ``v`` to be known before the field is evaluated.
+        """
+
+        coils = self._coils
+        res_gamma = [np.zeros_like(coil.curve.gamma()) for coil in coils]
+        res_gammadash = [np.zeros_like(coil.curve.gammadash()) for coil in coils]
+        res_current = self.compute_and_vjp(v, 0, res_gamma, res_gammadash)
+        vjp = sum([coils[i].vjp(res_gamma[i], res_gammadash[i], np.asarray([res_current[i]])) for i in range(len(coils))])
+        return self.B(), vjp
+
     def dA_by_dcoilcurrents(self, compute_derivatives=0):
         points = self.get_points_cart_ref()
         npoints = len(points)
@@ -209,6 +297,82 @@ class BiotSavart(sopp.BiotSavart, MagneticField):
         res_current = [np.sum(v * dA_by_dcoilcurrents[i]) for i in range(len(dA_by_dcoilcurrents))]
         return sum([coils[i].vjp(res_gamma[i], res_gammadash[i], np.asarray([res_current[i]])) for i in range(len(coils))])
 
+    def to_mgrid(self, filename, nr=10, nphi=4, nz=12, rmin=1.0, rmax=2.0, zmin=-0.5, zmax=0.5, nfp=1,
+                 include_potential=False, groups=None, group_names=None, stellsym=False, max_points=2**20):
+        """Export the field to the mgrid format for free boundary calculations.
+
+        Unlike :meth:`MagneticField.to_mgrid`, the coils can be split into
+        several coil groups, whose fields are stored separately and can be
+        scaled with ``extcur`` in VMEC. The fields of all groups are computed
+        from a single evaluation of every coil, and the grid is evaluated and
+        written in slabs of toroidal planes with at most ``max_points`` points,
+        so that the per coil fields are never stored for the whole grid.
+
+        Args:
+            filename, nr, nphi, nz, rmin, rmax, zmin, zmax, nfp: see
+                :meth:`MagneticField.to_mgrid`.
+            include_potential: if true, the vector potential is included and
+                :meth:`MagneticField.to_mgrid` is used, which supports neither
+                groups nor slabs.
+            groups: list of lists of coils, one per coil group. Defaults to a
+                single group containing all coils.
+            group_names: names of the coil groups.
+            stellsym: whether the field of each group is stellarator
+                symmetric. In that case only the toroidal planes in the first
+                half of the field period are evaluated, and the others are
+                obtained from :math:`B_R(R, -\phi, -z) = -B_R(R, \phi, z)`,
+                :math:`B_\phi(R, -\phi, -z) = B_\phi(R, \phi, z)` and
+                :math:`B_z(R, -\phi, -z) = B_z(R, \phi, z)`. Requires
+                ``zmin == -zmax``.
+            max_points: maximal number of grid points that are evaluated at once.
+        """
+        if include_potential:
+            if groups is not None:
+                raise ValueError("The vector potential can only be written for a single coil group.")
+            return MagneticField.to_mgrid(self, filename, nr=nr, nphi=nphi, nz=nz, rmin=rmin, rmax=rmax,
+                                          zmin=zmin, zmax=zmax, nfp=nfp, include_potential=True)
+        if stellsym and not np.isclose(zmin, -zmax):
+            raise ValueError("The stellarator symmetry of the grid requires zmin == -zmax.")
+        if groups is None:
+            groups = [self._coils]
+        if group_names is None:
+            group_names = ['simsopt_coils'] if len(groups) == 1 else ['magnet_%i' % j for j in range(len(groups))]
+        if len(group_names) != len(groups):
+            raise ValueError("group_names needs to contain one name per group.")
+
+        index = {id(c): i for i, c in enumerate(self._coils)}
+        weights = np.zeros((len(groups), len(self._coils)))
+        for g, group in enumerate(groups):
+            for c in group:
+                if id(c) not in index:
+                    raise ValueError("The coils of the groups need to be coils of this BiotSavart object.")
+                weights[g, index[id(c)]] = c.current.get_value()
+
+        rs = np.linspace(rmin, rmax, nr, endpoint=True)
+        phis = np.linspace(0, 2 * np.pi / nfp, nphi, endpoint=False)
+        zs = np.linspace(zmin, zmax, nz, endpoint=True)
+        # planes k and nphi - k are mirror images under stellarator symmetry
+        nevaluated = nphi // 2 + 1 if stellsym else nphi
+        planes_per_slab = max(1, max_points // (nr * nz))
+
+        def slabs():
+            for k0 in range(0, nevaluated, planes_per_slab):
+                planes = list(range(k0, min(k0 + planes_per_slab, nevaluated)))
+                Phi, Z, R = np.meshgrid(phis[planes], zs, rs, indexing='ij')
+                points = np.stack((R * np.cos(Phi), R * np.sin(Phi), Z), axis=-1).reshape((-1, 3))
+                self.set_points_cart(points)
+                B = self.B_cyl_groups(weights).reshape((len(groups), len(planes), nz, nr, 3))
+                br, bp, bz = B[..., 0], B[..., 1], B[..., 2]
+                yield planes, br, bp, bz
+                if stellsym:
+                    mirrored = [(j, nphi - k) for j, k in enumerate(planes) if 0 < nphi - k < nphi and nphi - k >= nevaluated]
+                    if mirrored:
+                        src = [j for j, _ in mirrored]
+                        yield ([k for _, k in mirrored], -br[:, src, ::-1, :], bp[:, src, ::-1, :], bz[:, src, ::-1, :])
+
+        mgrid = MGrid(nfp=nfp, nr=nr, nz=nz, nphi=nphi, rmin=rmin, rmax=rmax, zmin=zmin, zmax=zmax)
+        mgrid.write_slabs(filename, group_names, slabs())
+
     def as_dict(self, serial_objs_dict) -> dict:
         d = super().as_dict(serial_objs_dict=serial_objs_dict)
         d["points"] = self.get_points_cart()
@@ -226,3 +390,140 @@ class BiotSavart(sopp.BiotSavart, MagneticField):
         bs = cls(coils)
         bs.set_points_cart(xyz)
         return bs
+
+
+class BiotSavartSymmetric(sopp.BiotSavartSymmetric, MagneticField):
+    r"""
+    Computes the same field as
+
+    .. code-block:: python
+
+        BiotSavart(coils_via_symmetries(curves, currents, nfp, stellsym))
+
+    but only evaluates the base coils. Denote by :math:`G` one of the
+    ``num_symmetries() = nfp * (1 + stellsym)`` matrices mapping the base
+    coils onto their copies and by :math:`s` the sign of the current of that
+    copy (negative for stellarator symmetric copies). Then the field of the copy
+    is given by :math:`s G B(G^T \mathbf{x})`, where :math:`B` is the field
+    of the base coil. Hence the field of all copies is obtained by
+    evaluating the base coils at the images :math:`G^T \mathbf{x}` of the points.
+
+    The per coil quantities returned by e.g. :obj:`dB_by_dcoilcurrents` contain
+    the field of the base coil and all its copies for unit current.
+
+    If the evaluation points are themselves symmetric, it suffices to evaluate the
+    field at the points on one field period and to use
+    ``symmetric_images_of_points()`` and ``B_on_symmetric_images()`` to obtain
+    the field on the remaining periods.
+
+    Args:
+        coils: A list of :obj:`simsopt.field.coil.Coil` objects, the base coils.
+        nfp: The number of field periods.
+        stellsym: Whether the coil set is stellarator symmetric.
+    """
+
+    def __init__(self, coils, nfp, stellsym):
+        self._coils = coils
+        sopp.BiotSavartSymmetric.__init__(self, coils, nfp, stellsym)
+        MagneticField.__init__(self, depends_on=coils)
+
+    def _per_coil(self, key, shape, derivatives, compute):
+        npoints = len(self.get_points_cart_ref())
+        ncoils = len(self._coils)
+        if any([not self.fieldcache_get_status(f'{key}_{i}') for i in range(ncoils)]):
+            compute(derivatives)
+        return [self.fieldcache_get_or_create(f'{key}_{i}', [npoints] + shape) for i in range(ncoils)]
+
+    def dB_by_dcoilcurrents(self, compute_derivatives=0):
+        return self._per_coil('B', [3], compute_derivatives, self.compute)
+
+    def d2B_by_dXdcoilcurrents(self, compute_derivatives=1):
+        assert compute_derivatives >= 1
+        return self._per_coil('dB', [3, 3], compute_derivatives, self.compute)
+
+    def d3B_by_dXdXdcoilcurrents(self, compute_derivatives=2):
+        assert compute_derivatives >= 2
+        return self._per_coil('ddB', [3, 3, 3], compute_derivatives, self.compute)
+
+    def dA_by_dcoilcurrents(self, compute_derivatives=0):
+        return self._per_coil('A', [3], compute_derivatives, self.compute_A)
+
+    def _vjp(self, graph, v, vgrad=None):
+        # v . B(x) = sum_G (s G^T v) . B_base(G^T x), and similarly for the
+        # gradient, so the vjp of the base coils is evaluated on the images of
+        # the points with transformed weights.
+        coils = self._coils
+        gammas = [coil.curve.gamma() for coil in coils]
+        gammadashs = [coil.curve.gammadash() for coil in coils]
+        currents = [coil.current.get_value() for coil in coils]
+        res_gamma = [np.zeros_like(gamma) for gamma in gammas]
+        res_gammadash = [np.zeros_like(gammadash) for gammadash in gammadashs]
+        res_grad_gamma = [np.zeros_like(gamma) for gamma in gammas] if vgrad is not None else []
+        res_grad_gammadash = [np.zeros_like(gammadash) for gammadash in gammadashs] if vgrad is not None else []
+
+        points = self.get_points_cart_ref()
+        mats = self.symmetry_matrices()
+        signs = self.symmetry_signs()
+        points_images = np.ascontiguousarray(np.concatenate([points @ G for G in mats]))
+        v_images = np.ascontiguousarray(np.concatenate([s * v @ G for G, s in zip(mats, signs)]))
+        if vgrad is None:
+            vgrad_images = []
+        else:
+            vgrad_images = np.ascontiguousarray(np.concatenate(
+                [s * np.einsum('km,ika,ab->imb', G, vgrad, G) for G, s in zip(mats, signs)]))
+        graph(points_images, gammas, gammadashs, currents, v_images,
+              res_gamma, res_gammadash, vgrad_images, res_grad_gamma, res_grad_gammadash)
+        return res_gamma, res_gammadash, res_grad_gamma, res_grad_gammadash
+
+    def B_vjp(self, v):
+        r"""
+        See :obj:`simsopt.field.biotsavart.BiotSavart.B_vjp`.
+        """
+        coils = self._coils
+        res_gamma, res_gammadash, _, _ = self._vjp(sopp.biot_savart_vjp_graph, v)
+        dB_by_dcoilcurrents = self.dB_by_dcoilcurrents()
+        res_current = [np.sum(v * dB_by_dcoilcurrents[i]) for i in range(len(dB_by_dcoilcurrents))]
+        return sum([coils[i].vjp(res_gamma[i], res_gammadash[i], np.asarray([res_current[i]])) for i in range(len(coils))])
+
+    def B_and_dB_vjp(self, v, vgrad):
+        r"""
+        See :obj:`simsopt.field.biotsavart.BiotSavart.B_and_dB_vjp`.
+        """
+        coils = self._coils
+        res_gamma, res_gammadash, res_grad_gamma, res_grad_gammadash = self._vjp(sopp.biot_savart_vjp_graph, v, vgrad)
+        dB_by_dcoilcurrents = self.dB_by_dcoilcurrents()
+        res_current = [np.sum(v * dB_by_dcoilcurrents[i]) for i in range(len(dB_by_dcoilcurrents))]
+        d2B_by_dXdcoilcurrents = self.d2B_by_dXdcoilcurrents()
+        res_grad_current = [np.sum(vgrad * d2B_by_dXdcoilcurrents[i]) for i in range(len(d2B_by_dXdcoilcurrents))]
+        return (
+            sum([coils[i].vjp(res_gamma[i], res_gammadash[i], np.asarray([res_current[i]])) for i in range(len(coils))]),
+            sum([coils[i].vjp(res_grad_gamma[i], res_grad_gammadash[i], np.asarray([res_grad_current[i]])) for i in range(len(coils))])
+        )
+
+    def A_vjp(self, v):
+        r"""
+        See :obj:`simsopt.field.biotsavart.BiotSavart.A_vjp`.
+        """
+        coils = self._coils
+        res_gamma, res_gammadash, _, _ = self._vjp(sopp.biot_savart_vector_potential_vjp_graph, v)
+        dA_by_dcoilcurrents = self.dA_by_dcoilcurrents()
+        res_current = [np.sum(v * dA_by_dcoilcurrents[i]) for i in range(len(dA_by_dcoilcurrents))]
+        return sum([coils[i].vjp(res_gamma[i], res_gammadash[i], np.asarray([res_current[i]])) for i in range(len(coils))])
+
+    def as_dict(self, serial_objs_dict) -> dict:
+        d = super().as_dict(serial_objs_dict=serial_objs_dict)
+        d["points"] = self.get_points_cart()
+        return d
+
+    @classmethod
+    def from_dict(cls, d, serial_objs_dict, recon_objs):
+        decoder = GSONDecoder()
+        xyz = decoder.process_decoded(d["points"],
+                                      serial_objs_dict=serial_objs_dict,
+                                      recon_objs=recon_objs)
+        coils = decoder.process_decoded(d["coils"],
+                                        serial_objs_dict=serial_objs_dict,
+                                        recon_objs=recon_objs)
+        bs = cls(coils, d["nfp"], d["stellsym"])
+        bs.set_points_cart(xyz)
+        return bs
@@ -1,4 +1,5 @@
 import simsoptpp as sopp
+from .._core.util import interpolant_cache_prefix
 from scipy.interpolate import InterpolatedUnivariateSpline
 import numpy as np
 import logging
@@ -299,7 +300,7 @@ class BoozerAnalytic(BoozerMagneticField):
         dKdzeta[:, 0] = -self.N*self.K1*r*np.cos(thetas-self.N*zetas)
 
 
-class BoozerRadialInterpolant(BoozerMagneticField):
+class BoozerRadialInterpolant(sopp.BoozerRadialInterpolant, BoozerMagneticField):
     r"""
     Given a :class:`Vmec` instance, performs a Boozer coordinate transformation using
     ``BOOZXFORM``.
@@ -308,6 +309,13 @@ class BoozerRadialInterpolant(BoozerMagneticField):
     and an inverse Fourier transform in the two angles.
     Throughout stellarator symmetry is assumed.
 
+    The splines are evaluated in compiled code, which sums a quantity and its
+    derivatives over all Fourier modes in a single pass, so that e.g.
+    ``modB()`` also fills the cache of ``modB_derivs()``. Use
+    ``set_fused(['modB', 'K'])`` to evaluate several of ``modB``, ``R``,
+    ``Z``, ``nu`` and ``K`` in the same pass, e.g. before building an
+    :class:`InterpolatedBoozerField` with ``fused=True``.
+
     Args:
         equil: instance of :class:`simsopt.mhd.vmec.Vmec` or :class:`simsopt.mhd.boozer.Boozer`.
             If it is an instance of :class:`simsopt.mhd.boozer.Boozer`, the
@@ -444,11 +452,21 @@ class BoozerRadialInterpolant(BoozerMagneticField):
                 self.dzmncds_splines = self.mpi.comm_world.bcast(self.dzmncds_splines, root=0)
                 self.bmns_splines = self.mpi.comm_world.bcast(self.bmns_splines, root=0)
                 self.dbmnsds_splines = self.mpi.comm_world.bcast(self.dbmnsds_splines, root=0)
+            if not self.no_K:
+                if not self.mpi.proc0_groups:
+                    self.kmns_splines = None
+                    self.kmnc_splines = None
+                self.kmns_splines = self.mpi.comm_world.bcast(self.kmns_splines, root=0)
+                if not self.stellsym:
+                    self.kmnc_splines = self.mpi.comm_world.bcast(self.kmnc_splines, root=0)
         else:
             self.init_splines()
             if (not self.no_K):
                 self.compute_K()
 
+        sopp.BoozerRadialInterpolant.__init__(self, self.psi0, self.xm_b, self.xn_b, self.stellsym, self.no_K)
+        self.set_compiled_splines()
+
     def init_splines(self):
         self.xm_b = self.booz.bx.xm_b
         self.xn_b = self.booz.bx.xn_b
@@ -722,366 +740,27 @@ class BoozerRadialInterpolant(BoozerMagneticField):
                 if not self.stellsym:
                     self.kmnc_splines.append(InterpolatedUnivariateSpline(self.s_half_ext, self.mn_factor_splines[im](self.s_half_ext)*kmnc[im, :], k=self.order))
 
-    def _K_impl(self, K):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        K[:, 0] = 0.
-        if self.no_K:
-            return
-        kmns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            kmns[im, :] = self.kmns_splines[im](s)/self.mn_factor_splines[im](s)
-        sopp.inverse_fourier_transform_odd(K[:, 0], kmns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            kmnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                kmnc[im, :] = self.kmnc_splines[im](s)/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_even(K[:, 0], kmnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dKdtheta_impl(self, dKdtheta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        dKdtheta[:, 0] = 0.
-        if self.no_K:
-            return
-        kmns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            kmns[im, :] = self.kmns_splines[im](s) * self.xm_b[im]/self.mn_factor_splines[im](s)
-        sopp.inverse_fourier_transform_even(dKdtheta[:, 0], kmns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            kmnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                kmnc[im, :] = -self.kmnc_splines[im](s) * self.xm_b[im]/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_odd(dKdtheta[:, 0], kmnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dKdzeta_impl(self, dKdzeta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        dKdzeta[:, 0] = 0.
-        if (self.no_K):
-            return
-        kmns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            kmns[im, :] = -self.kmns_splines[im](s) * self.xn_b[im]/self.mn_factor_splines[im](s)
-        sopp.inverse_fourier_transform_even(dKdzeta[:, 0], kmns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            kmnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                kmnc[im, :] = self.kmnc_splines[im](s) * self.xn_b[im]/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_odd(dKdzeta[:, 0], kmnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _nu_impl(self, nu):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        numns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            numns[im, :] = self.numns_splines[im](s)/self.mn_factor_splines[im](s)
-        nu[:, 0] = 0.
-        sopp.inverse_fourier_transform_odd(nu[:, 0], numns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            numnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                numnc[im, :] = self.numnc_splines[im](s)/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_even(nu[:, 0], numnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dnudtheta_impl(self, dnudtheta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        numns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            numns[im, :] = self.numns_splines[im](s)*self.xm_b[im]/self.mn_factor_splines[im](s)
-        dnudtheta[:, 0] = 0.
-        sopp.inverse_fourier_transform_even(dnudtheta[:, 0], numns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            numnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                numnc[im, :] = -self.numnc_splines[im](s)*self.xm_b[im]/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_odd(dnudtheta[:, 0], numnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dnudzeta_impl(self, dnudzeta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        numns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            numns[im, :] = -self.numns_splines[im](s)*self.xn_b[im]/self.mn_factor_splines[im](s)
-        dnudzeta[:, 0] = 0.
-        sopp.inverse_fourier_transform_even(dnudzeta[:, 0], numns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            numnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                numnc[im, :] = self.numnc_splines[im](s)*self.xn_b[im]/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_odd(dnudzeta[:, 0], numnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dnuds_impl(self, dnuds):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        numns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            d_mn_factor = self.d_mn_factor_splines[im](s)
-            mn_factor = self.mn_factor_splines[im](s)
-            numns[im, :] = ((self.dnumnsds_splines[im](s) - self.numns_splines[im](s)*d_mn_factor/mn_factor)/mn_factor)
-        dnuds[:, 0] = 0.
-        sopp.inverse_fourier_transform_odd(dnuds[:, 0], numns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            numnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                d_mn_factor = self.d_mn_factor_splines[im](s)
-                mn_factor = self.mn_factor_splines[im](s)
-                numnc[im, :] = ((self.dnumncds_splines[im](s) - self.numnc_splines[im](s)*d_mn_factor/mn_factor)/mn_factor)
-            sopp.inverse_fourier_transform_even(dnuds[:, 0], numnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dRdtheta_impl(self, dRdtheta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        rmnc = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            rmnc[im, :] = -self.rmnc_splines[im](s)*self.xm_b[im]/self.mn_factor_splines[im](s)
-        dRdtheta[:, 0] = 0.
-        sopp.inverse_fourier_transform_odd(dRdtheta[:, 0], rmnc, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            rmns = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                rmns[im, :] = self.rmns_splines[im](s)*self.xm_b[im]/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_even(dRdtheta[:, 0], rmns, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dRdzeta_impl(self, dRdzeta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        rmnc = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            rmnc[im, :] = self.rmnc_splines[im](s)*self.xn_b[im]/self.mn_factor_splines[im](s)
-        dRdzeta[:, 0] = 0.
-        sopp.inverse_fourier_transform_odd(dRdzeta[:, 0], rmnc, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            rmns = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                rmns[im, :] = -self.rmns_splines[im](s)*self.xn_b[im]/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_even(dRdzeta[:, 0], rmns, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dRds_impl(self, dRds):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        rmnc = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            d_mn_factor = self.d_mn_factor_splines[im](s)
-            mn_factor = self.mn_factor_splines[im](s)
-            rmnc[im, :] = ((self.drmncds_splines[im](s) - self.rmnc_splines[im](s)*d_mn_factor/mn_factor)/mn_factor)
-        dRds[:, 0] = 0.
-        sopp.inverse_fourier_transform_even(dRds[:, 0], rmnc, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            rmns = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                d_mn_factor = self.d_mn_factor_splines[im](s)
-                mn_factor = self.mn_factor_splines[im](s)
-                rmns[im, :] = ((self.drmnsds_splines[im](s) - self.rmns_splines[im](s)*d_mn_factor/mn_factor)/mn_factor)
-            sopp.inverse_fourier_transform_odd(dRds[:, 0], rmns, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _R_impl(self, R):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        rmnc = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            rmnc[im, :] = self.rmnc_splines[im](s)/self.mn_factor_splines[im](s)
-        R[:, 0] = 0.
-        sopp.inverse_fourier_transform_even(R[:, 0], rmnc, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            rmns = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                rmns[im, :] = self.rmns_splines[im](s)/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_odd(R[:, 0], rmns, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dZdtheta_impl(self, dZdtheta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        zmns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            zmns[im, :] = self.zmns_splines[im](s)*self.xm_b[im]/self.mn_factor_splines[im](s)
-        dZdtheta[:, 0] = 0.
-        sopp.inverse_fourier_transform_even(dZdtheta[:, 0], zmns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            zmnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                zmnc[im, :] = -self.zmnc_splines[im](s)*self.xm_b[im]/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_odd(dZdtheta[:, 0], zmnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dZdzeta_impl(self, dZdzeta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        zmns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            zmns[im, :] = -self.zmns_splines[im](s)*self.xn_b[im]/self.mn_factor_splines[im](s)
-        dZdzeta[:, 0] = 0.
-        sopp.inverse_fourier_transform_even(dZdzeta[:, 0], zmns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            zmnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                zmnc[im, :] = self.zmnc_splines[im](s)*self.xn_b[im]/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_odd(dZdzeta[:, 0], zmnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dZds_impl(self, dZds):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        zmns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            d_mn_factor = self.d_mn_factor_splines[im](s)
-            mn_factor = self.mn_factor_splines[im](s)
-            zmns[im, :] = ((self.dzmnsds_splines[im](s) - self.zmns_splines[im](s)*d_mn_factor/mn_factor)/mn_factor)
-        dZds[:, 0] = 0.
-        sopp.inverse_fourier_transform_odd(dZds[:, 0], zmns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            zmnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                d_mn_factor = self.d_mn_factor_splines[im](s)
-                mn_factor = self.mn_factor_splines[im](s)
-                zmnc[im, :] = ((self.dzmncds_splines[im](s) - self.zmnc_splines[im](s)*d_mn_factor/mn_factor)/mn_factor)
-            sopp.inverse_fourier_transform_even(dZds[:, 0], zmnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _Z_impl(self, Z):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        zmns = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            zmns[im, :] = self.zmns_splines[im](s)/self.mn_factor_splines[im](s)
-        Z[:, 0] = 0.
-        sopp.inverse_fourier_transform_odd(Z[:, 0], zmns, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            zmnc = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                zmnc[im, :] = self.zmnc_splines[im](s)/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_even(Z[:, 0], zmnc, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _psip_impl(self, psip):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        psip[:] = self.psip_spline(s)[:, None]
-
-    def _G_impl(self, G):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        G[:] = self.G_spline(s)[:, None]
-
-    def _I_impl(self, I):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        I[:] = self.I_spline(s)[:, None]
-
-    def _iota_impl(self, iota):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        iota[:] = self.iota_spline(s)[:, None]
-
-    def _dGds_impl(self, dGds):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        dGds[:] = self.dGds_spline(s)[:, None]
-
-    def _dIds_impl(self, dIds):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        dIds[:] = self.dIds_spline(s)[:, None]
-
-    def _diotads_impl(self, diotads):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        diotads[:] = self.diotads_spline(s)[:, None]
-
-    def _modB_impl(self, modB):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        bmnc = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            bmnc[im, :] = self.bmnc_splines[im](s)/self.mn_factor_splines[im](s)
-        modB[:, 0] = 0.
-        sopp.inverse_fourier_transform_even(modB[:, 0], bmnc, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            bmns = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                bmns[im, :] = self.bmns_splines[im](s)/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_odd(modB[:, 0], bmns, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dmodBdtheta_impl(self, dmodBdtheta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        bmnc = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            bmnc[im, :] = -self.xm_b[im]*self.bmnc_splines[im](s)/self.mn_factor_splines[im](s)
-        dmodBdtheta[:, 0] = 0.
-        sopp.inverse_fourier_transform_odd(dmodBdtheta[:, 0], bmnc, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            bmns = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                bmns[im, :] = self.xm_b[im]*self.bmns_splines[im](s)/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_even(dmodBdtheta[:, 0], bmns, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dmodBdzeta_impl(self, dmodBdzeta):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        bmnc = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            bmnc[im, :] = self.xn_b[im]*self.bmnc_splines[im](s)/self.mn_factor_splines[im](s)
-        dmodBdzeta[:, 0] = 0.
-        sopp.inverse_fourier_transform_odd(dmodBdzeta[:, 0], bmnc, self.xm_b, self.xn_b, thetas, zetas)
-        if not self.stellsym:
-            bmns = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                bmns[im, :] = -self.xn_b[im]*self.bmns_splines[im](s)/self.mn_factor_splines[im](s)
-            sopp.inverse_fourier_transform_even(dmodBdzeta[:, 0], bmns, self.xm_b, self.xn_b, thetas, zetas)
-
-    def _dmodBds_impl(self, dmodBds):
-        points = self.get_points_ref()
-        s = points[:, 0]
-        thetas = points[:, 1]
-        zetas = points[:, 2]
-        bmnc = np.zeros((len(self.xm_b), len(s)))
-        for im in range(len(self.xm_b)):
-            mn_factor = self.mn_factor_splines[im](s)
-            d_mn_factor = self.d_mn_factor_splines[im](s)
-            bmnc[im, :] = ((self.dbmncds_splines[im](s) - self.bmnc_splines[im](s)*d_mn_factor/mn_factor)/mn_factor)
-        dmodBds[:, 0] = 0.
-        sopp.inverse_fourier_transform_even(dmodBds[:, 0], bmnc, self.xm_b, self.xn_b, thetas, zetas)
+    def set_compiled_splines(self):
+        """
+        Hands the radial splines over to the compiled evaluation of the field,
+        which sums all Fourier modes of a quantity and its derivatives in one
+        pass. This has to be called again if the splines are modified.
+        """
+        for name in ['psip', 'G', 'I', 'iota', 'dGds', 'dIds', 'diotads']:
+            spline = getattr(self, name + '_spline')
+            self.set_splines(name, [spline.get_knots()], [spline.get_coeffs()])
+        names = ['mn_factor', 'd_mn_factor', 'bmnc', 'dbmncds', 'rmnc', 'drmncds',
+                 'zmns', 'dzmnsds', 'numns', 'dnumnsds']
+        if not self.no_K:
+            names.append('kmns')
         if not self.stellsym:
-            bmns = np.zeros((len(self.xm_b), len(s)))
-            for im in range(len(self.xm_b)):
-                mn_factor = self.mn_factor_splines[im](s)
-                d_mn_factor = self.d_mn_factor_splines[im](s)
-                bmns[im, :] = ((self.dbmnsds_splines[im](s) - self.bmns_splines[im](s)*d_mn_factor/mn_factor)/mn_factor)
-            sopp.inverse_fourier_transform_odd(dmodBds[:, 0], bmns, self.xm_b, self.xn_b, thetas, zetas)
+            names += ['bmns', 'dbmnsds', 'rmns', 'drmnsds', 'zmnc', 'dzmncds', 'numnc', 'dnumncds']
+            if not self.no_K:
+                names.append('kmnc')
+        for name in names:
+            splines = getattr(self, name + '_splines')
+            self.set_splines(name, [spline.get_knots() for spline in splines],
+                             [spline.get_coeffs() for spline in splines])
 
 
 class InterpolatedBoozerField(sopp.InterpolatedBoozerField, BoozerMagneticField):
@@ -1091,7 +770,12 @@ class InterpolatedBoozerField(sopp.InterpolatedBoozerField, BoozerMagneticField)
     be evaluated very quickly. This is modeled after :class:`InterpolatedField`.
     """
 
-    def __init__(self, field, degree, srange, thetarange, zetarange, extrapolate=True, nfp=1, stellsym=True):
+    #: The quantities that are needed by the guiding center equations, which
+    #: are fused for ``fused=True``.
+    GUIDING_CENTER_QUANTITIES = ('modB', 'modB_derivs', 'G', 'iota', 'I', 'dGds', 'dIds', 'K', 'K_derivs')
+
+    def __init__(self, field, degree, srange, thetarange, zetarange, extrapolate=True, nfp=1, stellsym=True,
+                 cache_dir=None, value_bits=64, fused=None):
         r"""
         Args:
             field: the underlying :class:`simsopt.field.boozermagneticfield.BoozerMagneticField` to be interpolated.
@@ -1111,6 +795,23 @@ class InterpolatedBoozerField(sopp.InterpolatedBoozerField, BoozerMagneticField)
             stellsym: Whether to exploit stellarator symmetry. In this case
                       ``theta`` is always mapped to the interval :math:`[0, \pi]`,
                       hence it makes sense to use ``thetamin=0`` and ``thetamax=np.pi``.
+            cache_dir: if set, the interpolants are stored in this directory
+                      once they are built, and later instances with the same
+                      parameters and the same underlying field map them into
+                      memory instead of evaluating ``field`` again, see
+                      :obj:`~simsopt.field.magneticfieldclasses.InterpolatedField`.
+            value_bits: the precision in which the values of the interpolants
+                      are stored, 64, 32 or 16, see
+                      :obj:`~simsopt.field.magneticfieldclasses.InterpolatedField`.
+                      With its many interpolants, this field benefits most
+                      from the reduced memory.
+            fused: a list of quantities, e.g. ``['modB', 'modB_derivs', 'G', 'iota']``,
+                   that are interpolated together in a single interpolant
+                   instead of one interpolant each. A point is then located
+                   only once for all of them, and evaluating one of them
+                   stores the others in the cache. ``True`` fuses
+                   :attr:`GUIDING_CENTER_QUANTITIES`, which is what particle
+                   tracing evaluates at every step.
         """
         BoozerMagneticField.__init__(self, field.psi0)
         if (np.any(np.asarray(thetarange[0:2]) < 0) or np.any(np.asarray(thetarange[0:2]) > 2*np.pi)):
@@ -1123,4 +824,20 @@ class InterpolatedBoozerField(sopp.InterpolatedBoozerField, BoozerMagneticField)
             logger.warning(fr"Sure about zetarange=[{zetarange[0]},{zetarange[1]}]? When exploiting rotational symmetry, the interpolant is only evaluated for zeta in [0,2\pi/nfp].")
 
         sopp.InterpolatedBoozerField.__init__(self, field, degree, srange, thetarange, zetarange, extrapolate, nfp, stellsym)
+        self.set_value_bits(value_bits)
+        if fused is True:
+            fused = self.GUIDING_CENTER_QUANTITIES
+        if fused:
+            self.set_fused(list(fused))
+        if cache_dir is not None:
+            rng = np.random.default_rng(0)
+            stz = rng.uniform(low=[srange[0], thetarange[0], zetarange[0]], high=[srange[1], thetarange[1], zetarange[1]], size=(8, 3))
+            old_points = field.get_points()
+            field.set_points(stz)
+            probes = np.concatenate([field.modB(), field.G(), field.I(), field.iota(), field.psip(), field.K()], axis=1)
+            if len(old_points) > 0:
+                field.set_points(old_points)
+            params = ('InterpolatedBoozerField', type(field).__name__, field.psi0, degree, tuple(srange),
+                      tuple(thetarange), tuple(zetarange), extrapolate, nfp, stellsym, value_bits)
+            self.set_cache(interpolant_cache_prefix(cache_dir, params, probes))
 
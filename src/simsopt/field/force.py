@@ -3,6 +3,7 @@ from scipy import constants
 import numpy as np
 import jax.numpy as jnp
 from jax import grad
+import simsoptpp as sopp
 from .biotsavart import BiotSavart
 from .selffield import B_regularized_pure, B_regularized, regularization_circ, regularization_rect
 from ..geo.jit import jit
@@ -49,6 +50,67 @@ def self_force_rect(coil, a, b):
     return self_force(coil, regularization_rect(a, b))
 
 
+def _force_kernel_args(coils, allcoils, regularizations):
+    ids = set(id(c) for c in coils)
+    ordered = list(coils) + [c for c in allcoils if id(c) not in ids]
+    return (
+        [c.curve.gamma() for c in ordered],
+        [c.curve.gammadash() for c in ordered],
+        [c.curve.gammadashdash() for c in coils],
+        [np.asarray(c.curve.quadpoints, dtype=float) for c in coils],
+        [c.current.get_value() for c in ordered],
+        [float(r) for r in regularizations],
+    ), ordered
+
+
+def coil_forces(coils, allcoils, regularizations):
+    r"""
+    Compute the Lorentz forces on several coils at once with the compiled
+    kernels of simsoptpp. The result is the same as calling :func:`coil_force`
+    for each coil in ``coils``, but without the pairwise temporaries.
+
+    The forces are only evaluated on ``coils``, while all coils in
+    ``allcoils`` contribute to the field. For coils obtained from
+    :func:`~simsopt.field.coils_via_symmetries`, it is sufficient to pass the
+    base coils as ``coils``, since the forces on the other coils are rotated
+    and reflected copies.
+
+    Args:
+        coils: the coils on which the forces are evaluated.
+        allcoils: all coils, the coils in ``coils`` may or may not be included.
+        regularizations: the regularization of the self field of each coil in
+            ``coils``, see :func:`regularization_circ` and
+            :func:`regularization_rect`.
+
+    Returns:
+        A tuple of the forces per unit length at the quadrature points of each
+        coil, an array of shape ``(len(coils), 3)`` with the net forces, and
+        one with the torques about the origin.
+    """
+    args, _ = _force_kernel_args(coils, allcoils, regularizations)
+    forces, net_forces, net_torques = sopp.coil_forces(*args)
+    return forces, net_forces, net_torques
+
+
+def coil_forces_vjp(coils, allcoils, regularizations, v):
+    r"""
+    Compute the derivative of :math:`\sum_i \sum_j v_i[j] \cdot F_i[j]` with
+    respect to the dofs of all coils, where :math:`F_i` are the forces per unit
+    length on ``coils[i]`` returned by :func:`coil_forces`.
+
+    Returns:
+        A :obj:`simsopt._core.derivative.Derivative`.
+    """
+    args, ordered = _force_kernel_args(coils, allcoils, regularizations)
+    res_gamma, res_gammadash, res_gammadashdash, res_current = sopp.coil_forces_vjp(*args, v)
+    res = ordered[0].vjp(res_gamma[0], res_gammadash[0], np.asarray([res_current[0]]))
+    for c, rg, rgd, rc in zip(ordered[1:], res_gamma[1:], res_gammadash[1:], res_current[1:]):
+        res += c.vjp(rg, rgd, np.asarray([rc]))
+    for c, rgdd in zip(coils, res_gammadashdash):
+        res += c.curve.dgammadashdash_by_dcoeff_vjp(rgdd)
+    return res
+
+
 @jit
 def lp_force_pure(gamma, gammadash, gammadashdash, quadpoints, current, regularization, B_mutual, p, threshold):
     r"""Pure function for minimizing the Lorentz force on a coil.
@@ -156,38 +156,18 @@ class MagneticField(sopp.MagneticField, Optimizable):
         mgrid.write(filename)
 
 
-class MagneticFieldMultiply(MagneticField):
+class MagneticFieldMultiply(sopp.MagneticFieldMultiply, MagneticField):
     """
     Class used to multiply a magnetic field by a scalar.  It takes as input a
     MagneticField class and a scalar and multiplies B, A and their derivatives
-    by that value.
+    by that value. The product is computed in C++.
     """
 
     def __init__(self, scalar, Bfield):
-        MagneticField.__init__(self, depends_on=[Bfield])
         self.scalar = scalar
         self.Bfield = Bfield
-
-    def _set_points_cb(self):
-        self.Bfield.set_points_cart(self.get_points_cart_ref())
-
-    def _B_impl(self, B):
-        B[:] = self.scalar*self.Bfield.B()
-
-    def _dB_by_dX_impl(self, dB):
-        dB[:] = self.scalar*self.Bfield.dB_by_dX()
-
-    def _d2B_by_dXdX_impl(self, ddB):
-        ddB[:] = self.scalar*self.Bfield.d2B_by_dXdX()
-
-    def _A_impl(self, A):
-        A[:] = self.scalar*self.Bfield.A()
-
-    def _dA_by_dX_impl(self, dA):
-        dA[:] = self.scalar*self.Bfield.dA_by_dX()
-
-    def _d2A_by_dXdX_impl(self, ddA):
-        ddA[:] = self.scalar*self.Bfield.d2A_by_dXdX()
+        sopp.MagneticFieldMultiply.__init__(self, scalar, Bfield)
+        MagneticField.__init__(self, depends_on=[Bfield])
 
     def as_dict(self, serial_objs_dict) -> dict:
         d = super().as_dict(serial_objs_dict=serial_objs_dict)
@@ -204,39 +184,23 @@ class MagneticFieldMultiply(MagneticField):
         return field
 
 
-class MagneticFieldSum(MagneticField):
+class MagneticFieldSum(sopp.MagneticFieldSum, MagneticField):
     """
     Class used to sum two or more magnetic field together.  It can either be
     called directly with a list of magnetic fields given as input and outputing
     another magnetic field with B, A and its derivatives added together or it
     can be called by summing magnetic fields classes as Bfield1 + Bfield1
+
+    The sum is computed in C++, so a sum of fields that are implemented in C++
+    (e.g. :obj:`~simsopt.field.BiotSavart` or
+    :obj:`~simsopt.field.Dommaschk`) can be traced without calling back into
+    Python.
     """
 
     def __init__(self, Bfields):
-        MagneticField.__init__(self, depends_on=Bfields)
         self.Bfields = Bfields
-
-    def _set_points_cb(self):
-        for bf in self.Bfields:
-            bf.set_points_cart(self.get_points_cart_ref())
-
-    def _B_impl(self, B):
-        B[:] = np.sum([bf.B() for bf in self.Bfields], axis=0)
-
-    def _dB_by_dX_impl(self, dB):
-        dB[:] = np.sum([bf.dB_by_dX() for bf in self.Bfields], axis=0)
-
-    def _d2B_by_dXdX_impl(self, ddB):
-        ddB[:] = np.sum([bf.d2B_by_dXdX() for bf in self.Bfields], axis=0)
-
-    def _A_impl(self, A):
-        A[:] = np.sum([bf.A() for bf in self.Bfields], axis=0)
-
-    def _dA_by_dX_impl(self, dA):
-        dA[:] = np.sum([bf.dA_by_dX() for bf in self.Bfields], axis=0)
-
-    def _d2A_by_dXdX_impl(self, ddA):
-        ddA[:] = np.sum([bf.d2A_by_dXdX() for bf in self.Bfields], axis=0)
+        sopp.MagneticFieldSum.__init__(self, Bfields)
+        MagneticField.__init__(self, depends_on=Bfields)
 
     def B_vjp(self, v):
         return sum([bf.B_vjp(v) for bf in self.Bfields if np.any(bf.dofs_free_status)])
@@ -13,6 +13,7 @@ except ImportError:
 import simsoptpp as sopp
 from .magneticfield import MagneticField
 from .._core.json import GSONDecoder
+from .._core.util import interpolant_cache_prefix
 
 logger = logging.getLogger(__name__)
 
@@ -604,6 +605,14 @@ class DipoleField(MagneticField):
         R0: double.
             The value of the major radius of the stellarator needed only for simple toroidal
             coordinates.
+
+    The field is computed by a direct sum over all the dipoles, which costs
+    O(npoints * ndipoles). For large numbers of dipoles (e.g. to trace field
+    lines or evaluate the field on fine grids for a final magnet solution), it
+    can be replaced by a treecode approximation via ``set_treecode(theta)``,
+    which costs O(npoints * log(ndipoles)). The relative error of ``B``,
+    ``dB_by_dX``, ``A`` and ``dA_by_dX`` scales as ``theta**3``. Setting
+    ``theta=0`` restores the direct summation.
     """
 
     def __init__(self, dipole_grid, dipole_vectors, stellsym=True, nfp=1, coordinate_flag='cartesian', m_maxima=None, R0=1):
@@ -612,23 +621,55 @@ class DipoleField(MagneticField):
             warnings.warn('Note that if using simple toroidal coordinates, '
                           'the major radius must be specified through R0 argument.')
         self.R0 = R0
+        self._tree = None
         self._dipole_fields_from_symmetries(dipole_grid, dipole_vectors, stellsym, nfp, coordinate_flag, m_maxima, R0)
 
+    def set_treecode(self, theta, leafsize=16):
+        """
+        Use a treecode approximation with opening parameter ``theta`` (the
+        relative error scales as ``theta**3``) and at most ``leafsize``
+        dipoles per leaf. The tree over the dipoles is built once here and
+        reused for all subsequent evaluations. ``theta=0`` restores the direct
+        summation.
+        """
+        if theta == 0.:
+            self._tree = None
+        else:
+            self._tree = sopp.DipoleFieldTreecode(self.dipole_grid, self.m_vec, theta, leafsize)
+        self.invalidate_cache()
+        return self
+
+    @property
+    def treecode_theta(self):
+        return 0. if self._tree is None else self._tree.theta
+
     def _B_impl(self, B):
         points = self.get_points_cart_ref()
-        B[:] = sopp.dipole_field_B(points, self.dipole_grid, self.m_vec)
+        if self._tree is not None:
+            B[:] = self._tree.B(points)
+        else:
+            B[:] = sopp.dipole_field_B(points, self.dipole_grid, self.m_vec)
 
     def _dB_by_dX_impl(self, dB):
         points = self.get_points_cart_ref()
-        dB[:] = sopp.dipole_field_dB(points, self.dipole_grid, self.m_vec)
+        if self._tree is not None:
+            dB[:] = self._tree.dB(points)
+        else:
+            dB[:] = sopp.dipole_field_dB(points, self.dipole_grid, self.m_vec)
 
     def _A_impl(self, A):
         points = self.get_points_cart_ref()
-        A[:] = sopp.dipole_field_A(points, self.dipole_grid, self.m_vec)
+        if self._tree is not None:
+            A[:] = self._tree.A(points)
+        else:
+            A[:] = sopp.dipole_field_A(points, self.dipole_grid, self.m_vec)
 
     def _dA_by_dX_impl(self, dA):
         points = self.get_points_cart_ref()
-        dA[:] = sopp.dipole_field_dA(points, self.dipole_grid, self.m_vec)
+        if self._tree is not None:
+            dA[:] = self._tree.dA(points)
+        else:
+            dA[:] = sopp.dipole_field_dA(points, self.dipole_grid, self.m_vec)
 
     def _dipole_fields_from_symmetries(self, dipole_grid, dipole_vectors, stellsym=True, nfp=1, coordinate_flag='cartesian', m_maxima=None, R0=1):
         """
@@ -748,7 +789,7 @@ class DipoleField(MagneticField):
         pointsToVTK(str(vtkname), ox, oy, oz, data=data)
 
 
-class Dommaschk(MagneticField):
+class Dommaschk(sopp.Dommaschk, MagneticField):
     """
     Vacuum magnetic field created by an explicit representation of the magnetic
     field scalar potential as proposed by W. Dommaschk (1986), Computer Physics
@@ -759,25 +800,18 @@ class Dommaschk(MagneticField):
         m: first harmonic array
         n: second harmonic array
         coeffs: coefficient for Vml for each of the ith index of the harmonics m and n
+
+    The field includes the toroidal field :math:`1/R \\hat{e}_\\phi`. It is
+    evaluated entirely in C++, so tracing in this field (or in sums of it
+    with other fields implemented in C++) does not call back into Python.
     """
 
     def __init__(self, mn=[[0, 0]], coeffs=[[0, 0]]):
-        MagneticField.__init__(self)
         self.m = np.array(mn, dtype=np.int16)[:, 0]
         self.n = np.array(mn, dtype=np.int16)[:, 1]
         self.coeffs = coeffs
-        self.Btor = ToroidalField(1, 1)
-
-    def _set_points_cb(self):
-        self.Btor.set_points_cart(self.get_points_cart_ref())
-
-    def _B_impl(self, B):
-        points = self.get_points_cart_ref()
-        B[:] = np.add.reduce(sopp.DommaschkB(self.m, self.n, self.coeffs, points))+self.Btor.B()
-
-    def _dB_by_dX_impl(self, dB):
-        points = self.get_points_cart_ref()
-        dB[:] = np.add.reduce(sopp.DommaschkdB(self.m, self.n, self.coeffs, points))+self.Btor.dB_by_dX()
+        sopp.Dommaschk.__init__(self, self.m, self.n, np.asarray(coeffs, dtype=float))
+        MagneticField.__init__(self)
 
     @property
     def mn(self):
@@ -798,7 +832,7 @@ class Dommaschk(MagneticField):
         return field
 
 
-class Reiman(MagneticField):
+class Reiman(sopp.Reiman, MagneticField):
     '''
     Magnetic field model in section 5 of Reiman and Greenside, Computer Physics Communications 43 (1986) 157—167.
     This field allows for an analytical expression of the magnetic island width
@@ -811,23 +845,18 @@ class Reiman(MagneticField):
         k: integer array specifying the Fourier modes used
         epsilonk: coefficient of the Fourier modes
         m0: toroidal symmetry parameter (normally m0=1)
+
+    The field is evaluated entirely in C++.
     '''
 
     def __init__(self, iota0=0.15, iota1=0.38, k=[6], epsilonk=[0.01], m0=1):
-        MagneticField.__init__(self)
         self.iota0 = iota0
         self.iota1 = iota1
         self.k = k
         self.epsilonk = epsilonk
         self.m0 = m0
-
-    def _B_impl(self, B):
-        points = self.get_points_cart_ref()
-        B[:] = sopp.ReimanB(self.iota0, self.iota1, self.k, self.epsilonk, self.m0, points)
-
-    def _dB_by_dX_impl(self, dB):
-        points = self.get_points_cart_ref()
-        dB[:] = sopp.ReimandB(self.iota0, self.iota1, self.k, self.epsilonk, self.m0, points)
+        sopp.Reiman.__init__(self, iota0, iota1, np.asarray(k, dtype=float), np.asarray(epsilonk, dtype=float), m0)
+        MagneticField.__init__(self)
 
     def as_dict(self, serial_objs_dict):
         d = super().as_dict(serial_objs_dict=serial_objs_dict)
@@ -857,7 +886,9 @@ class InterpolatedField(sopp.InterpolatedField, MagneticField):
     This resulting interpolant can then be evaluated very quickly.
     """
 
-    def __init__(self, field, degree, rrange, phirange, zrange, extrapolate=True, nfp=1, stellsym=False, skip=None):
+    def __init__(self, field, degree, rrange, phirange, zrange, extrapolate=True, nfp=1, stellsym=False, skip=None,
+                 cache_dir=None, adaptive_tol=None, max_refinement=4, max_build_memory=2**30, build_threads=1, value_bits=64,
+                 lazy=False, analytic_gradient=False):
         r"""
         Args:
             field: the underlying :mod:`simsopt.field.magneticfield.MagneticField` to be interpolated.
@@ -887,6 +918,50 @@ class InterpolatedField(sopp.InterpolatedField, MagneticField):
                   See also here
                   https://github.com/hiddenSymmetries/simsopt/pull/227 for a
                   graphical illustration.
+            cache_dir: if set, the interpolants are stored in this directory
+                  once they are built, and later instances with the same
+                  parameters and the same underlying field map them into
+                  memory instead of evaluating ``field`` again. The files are
+                  shared read-only by all processes on a node. The underlying
+                  field is identified by its values at a few points.
+            adaptive_tol: if set, the grid given by ``rrange``, ``phirange``
+                  and ``zrange`` is only the initial grid, and each of its
+                  cells is refined locally until the estimated interpolation
+                  error is below ``adaptive_tol`` relative to the largest
+                  value on the initial grid, see
+                  :obj:`simsoptpp.AdaptiveInterpolant3D`. This needs far fewer
+                  dofs than a uniformly refined grid when the field varies
+                  rapidly only in parts of the domain, e.g. close to the
+                  coils. Adaptive interpolants are not cached in ``cache_dir``.
+            max_refinement: the maximum number of times a cell of the initial
+                  grid is split in each direction when ``adaptive_tol`` is set.
+            max_build_memory: bound in bytes on the memory for the temporary
+                  coordinates and values while the regular grid interpolants
+                  are built tile by tile, in addition to the interpolants
+                  themselves.
+            build_threads: number of threads that build tiles concurrently.
+                  This needs copies of ``field`` for each thread, so it only
+                  takes effect for fields that support this; otherwise the
+                  tiles are built one after another.
+            value_bits: the precision in which the values of the interpolant
+                  are stored: 64 (double), 32 (float), or 16, in which case
+                  they are stored as integers scaled by the largest value in
+                  each cell and are accurate to about 2e-5 relative to that.
+                  Fewer bits reduce the memory and memory bandwidth of the
+                  interpolant, the evaluation is always done in double
+                  precision.
+            lazy: if ``True``, ``field`` is only evaluated on the cells of
+                  the grid in which the interpolant is evaluated, the first
+                  time this happens. This saves most of the build time when
+                  e.g. particles are only traced for a short time. With a
+                  ``cache_dir``, :meth:`save_cache` stores the cells that are
+                  computed so far, and later instances start from these.
+            analytic_gradient: if ``True``, :math:`\nabla|B|` is computed by
+                  differentiating the interpolant of ``B`` instead of being
+                  interpolated separately. This halves the time and memory
+                  needed to build the interpolants, and evaluates both with
+                  a single lookup, at the price of a gradient that is one
+                  order less accurate and not continuous across cells.
 
         """
         MagneticField.__init__(self)
@@ -901,6 +976,26 @@ class InterpolatedField(sopp.InterpolatedField, MagneticField):
 
         sopp.InterpolatedField.__init__(self, field, degree, rrange, phirange, zrange, extrapolate, nfp, stellsym, skip)
         self.__field = field
+        self.nfp = nfp
+        self.stellsym = stellsym
+        self.set_build_options(int(max_build_memory), build_threads)
+        self.set_value_bits(value_bits)
+        self.set_lazy(lazy)
+        self.set_analytic_gradient(analytic_gradient)
+        if adaptive_tol is not None:
+            self.set_adaptive(adaptive_tol, max_refinement)
+        elif cache_dir is not None:
+            rng = np.random.default_rng(0)
+            rphiz = rng.uniform(low=[rrange[0], phirange[0], zrange[0]], high=[rrange[1], phirange[1], zrange[1]], size=(8, 3))
+            xyz = np.stack([rphiz[:, 0]*np.cos(rphiz[:, 1]), rphiz[:, 0]*np.sin(rphiz[:, 1]), rphiz[:, 2]], axis=1)
+            old_points = field.get_points_cart()
+            field.set_points(xyz)
+            probes = field.B().copy()
+            if len(old_points) > 0:
+                field.set_points(old_points)
+            params = ('InterpolatedField', type(field).__name__, degree, tuple(rrange), tuple(phirange), tuple(zrange),
+                      extrapolate, nfp, stellsym, value_bits)
+            self.set_cache(interpolant_cache_prefix(cache_dir, params, probes))
 
     def to_vtk(self, filename):
         """Export the field evaluated on a regular grid for visualisation with e.g. Paraview."""
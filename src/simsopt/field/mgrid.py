@@ -122,6 +122,58 @@ class MGrid():
 
         # TO-DO: this function could check for size consistency, between different fields, and for the (nr,nphi,nz) settings of a given instance
 
+    def _write_header(self, ds, coil_names):
+        '''
+        Creates the dimensions and the scalar variables of an mgrid file in the
+        open netCDF file ``ds``, for the coil groups ``coil_names``.
+        '''
+        n_ext_cur = len(coil_names)
+
+        # set netcdf dimensions
+        ds.createDimension('stringsize', 30)
+        ds.createDimension('dim_00001', 1)
+        ds.createDimension('external_coil_groups', n_ext_cur)
+        ds.createDimension('external_coils', n_ext_cur)
+        ds.createDimension('rad', self.nr)
+        ds.createDimension('zee', self.nz)
+        ds.createDimension('phi', self.nphi)
+
+        # declare netcdf variables
+        var_ir = ds.createVariable('ir', 'i4', tuple())
+        var_jz = ds.createVariable('jz', 'i4', tuple())
+        var_kp = ds.createVariable('kp', 'i4', tuple())
+        var_nfp = ds.createVariable('nfp', 'i4', tuple())
+        var_nextcur = ds.createVariable('nextcur', 'i4', tuple())
+
+        var_rmin = ds.createVariable('rmin', 'f8', tuple())
+        var_zmin = ds.createVariable('zmin', 'f8', tuple())
+        var_rmax = ds.createVariable('rmax', 'f8', tuple())
+        var_zmax = ds.createVariable('zmax', 'f8', tuple())
+
+        if n_ext_cur == 1:
+            var_coil_group = ds.createVariable('coil_group', 'c', ('stringsize',))
+            var_coil_group[:] = coil_names[0]
+        else:
+            var_coil_group = ds.createVariable('coil_group', 'c', ('external_coil_groups', 'stringsize',))
+            var_coil_group[:] = coil_names
+        var_mgrid_mode = ds.createVariable('mgrid_mode', 'c', ('dim_00001',))
+        var_raw_coil_cur = ds.createVariable('raw_coil_cur', 'f8', ('external_coils',))
+
+        # assign values
+        var_ir.data[()] = self.nr
+        var_jz.data[()] = self.nz
+        var_kp.data[()] = self.nphi
+        var_nfp.data[()] = self.nfp
+        var_nextcur.data[()] = n_ext_cur
+
+        var_rmin.data[()] = self.rmin
+        var_zmin.data[()] = self.zmin
+        var_rmax.data[()] = self.rmax
+        var_zmax.data[()] = self.zmax
+
+        var_mgrid_mode[:] = 'N'  # R - Raw, S - scaled, N - none (old version)
+        var_raw_coil_cur[:] = np.ones(n_ext_cur)
+
     def write(self, filename): 
         '''
         Export class data as a netCDF binary.
@@ -135,51 +187,7 @@ class MGrid():
         '''
 
         with netcdf_file(filename, 'w', mmap=False) as ds:
-
-            # set netcdf dimensions
-            ds.createDimension('stringsize', 30)
-            ds.createDimension('dim_00001', 1)
-            ds.createDimension('external_coil_groups', self.n_ext_cur)
-            ds.createDimension('external_coils', self.n_ext_cur)
-            ds.createDimension('rad', self.nr)
-            ds.createDimension('zee', self.nz)
-            ds.createDimension('phi', self.nphi)
-
-            # declare netcdf variables
-            var_ir = ds.createVariable('ir', 'i4', tuple())
-            var_jz = ds.createVariable('jz', 'i4', tuple())
-            var_kp = ds.createVariable('kp', 'i4', tuple())
-            var_nfp = ds.createVariable('nfp', 'i4', tuple())
-            var_nextcur = ds.createVariable('nextcur', 'i4', tuple())
-
-            var_rmin = ds.createVariable('rmin', 'f8', tuple())
-            var_zmin = ds.createVariable('zmin', 'f8', tuple())
-            var_rmax = ds.createVariable('rmax', 'f8', tuple())
-            var_zmax = ds.createVariable('zmax', 'f8', tuple())
-
-            if self.n_ext_cur == 1:
-                var_coil_group = ds.createVariable('coil_group', 'c', ('stringsize',))
-                var_coil_group[:] = self.coil_names[0]
-            else:
-                var_coil_group = ds.createVariable('coil_group', 'c', ('external_coil_groups', 'stringsize',))
-                var_coil_group[:] = self.coil_names
-            var_mgrid_mode = ds.createVariable('mgrid_mode', 'c', ('dim_00001',))
-            var_raw_coil_cur = ds.createVariable('raw_coil_cur', 'f8', ('external_coils',))
-
-            # assign values
-            var_ir.data[()] = self.nr
-            var_jz.data[()] = self.nz
-            var_kp.data[()] = self.nphi
-            var_nfp.data[()] = self.nfp
-            var_nextcur.data[()] = self.n_ext_cur
-
-            var_rmin.data[()] = self.rmin
-            var_zmin.data[()] = self.zmin
-            var_rmax.data[()] = self.rmax
-            var_zmax.data[()] = self.zmax
-
-            var_mgrid_mode[:] = 'N'  # R - Raw, S - scaled, N - none (old version)
-            var_raw_coil_cur[:] = np.ones(self.n_ext_cur)
+            self._write_header(ds, self.coil_names)
 
             # add fields
             for j in np.arange(self.n_ext_cur):
@@ -204,6 +212,34 @@ class MGrid():
                     var_az_001 = ds.createVariable('az'+tag, 'f8', ('phi', 'zee', 'rad'))
                     var_az_001[:, :, :] = self.az_arr[j]
 
+    def write_slabs(self, filename, names, slabs):
+        '''
+        Export the fields of several coil groups as a netCDF binary, writing
+        them as they are produced instead of storing them in this object first.
+        This is used by :meth:`simsopt.field.BiotSavart.to_mgrid` for large grids.
+
+        Args:
+            filename: output file name
+            names: names of the coil groups
+            slabs: iterable of tuples ``(planes, br, bp, bz)``, where ``planes``
+                is a list of indices of toroidal planes, and ``br``, ``bp``
+                and ``bz`` are arrays of shape ``(len(names), len(planes), nz, nr)``.
+                Every plane needs to be contained in one of the slabs.
+        '''
+        self.coil_names = [_pad_string(name) for name in names]
+        self.n_ext_cur = len(names)
+        with netcdf_file(filename, 'w', mmap=False) as ds:
+            self._write_header(ds, self.coil_names)
+            variables = [
+                [ds.createVariable(c + '_%.3i' % (j+1), 'f8', ('phi', 'zee', 'rad')) for c in ('br', 'bp', 'bz')]
+                for j in range(len(names))
+            ]
+            for planes, br, bp, bz in slabs:
+                for j, (var_br, var_bp, var_bz) in enumerate(variables):
+                    var_br[planes] = br[j]
+                    var_bp[planes] = bp[j]
+                    var_bz[planes] = bz[j]
+
     @classmethod 
     def from_file(cls, filename):
         '''
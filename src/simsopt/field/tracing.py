@@ -1,10 +1,11 @@
 import logging
+import os
 from math import sqrt
 
 import numpy as np
 
 import simsoptpp as sopp
-from .._core.util import parallel_loop_bounds
+from .._core.util import parallel_loop_bounds, dynamic_loop_chunks
 from ..field.magneticfield import MagneticField
 from ..field.boozermagneticfield import BoozerMagneticField
 from ..field.sampling import draw_uniform_on_curve, draw_uniform_on_surface
@@ -20,6 +21,7 @@ __all__ = ['SurfaceClassifier', 'LevelsetStoppingCriterion',
            'MinRStoppingCriterion','MinZStoppingCriterion',
            'MaxRStoppingCriterion','MaxZStoppingCriterion',
            'IterationStoppingCriterion', 'ToroidalTransitStoppingCriterion',
+           'TrajectoryOutput', 'Integrator', 'TracingState',
            'compute_fieldlines', 'compute_resonances',
            'compute_poloidal_transits', 'compute_toroidal_transits',
            'trace_particles', 'trace_particles_boozer',
@@ -72,12 +74,95 @@ def gc_to_fullorbit_initial_guesses(field, xyz_inits, speed_pars, speed_total, m
     return xyz_inits_full, v_inits, rgs
 
 
+def _particle_lost(res_ty, res_hit, tmax):
+    # without a stored trajectory, the particle was lost if one of the
+    # stopping criteria was satisfied
+    if len(res_ty) == 0:
+        return len(res_hit) > 0 and res_hit[-1][1] < 0
+    return res_ty[-1][0] < tmax - 1e-15
+
+
+def _checkpoint_filename(checkpoint, comm):
+    # one file per MPI rank, as every rank traces its own particles
+    if comm is None or comm.size == 1:
+        return checkpoint + '.npz'
+    return f'{checkpoint}.{comm.rank}.npz'
+
+
+def _save_checkpoint(filename, idxs, done, current):
+    arrays = {'idxs': np.asarray(idxs, dtype=int)}
+    for i, (res_ty, res_hit) in done.items():
+        arrays[f'ty_{i}'] = res_ty
+        arrays[f'hit_{i}'] = res_hit
+    if current is not None:
+        i, state, res_ty, res_hit = current
+        arrays['current'] = np.asarray([i])
+        arrays['current_ty'] = res_ty
+        arrays['current_hit'] = res_hit
+        for key, val in state.as_dict().items():
+            arrays[f'state_{key}'] = np.asarray(val, dtype=float)
+    # write to a temporary file first, so that an interruption while writing
+    # does not destroy the previous checkpoint
+    with open(filename + '.tmp', 'wb') as f:
+        np.savez(f, **arrays)
+    os.replace(filename + '.tmp', filename)
+
+
+def _load_checkpoint(filename, idxs):
+    if not os.path.exists(filename):
+        return {}, None
+    with np.load(filename) as data:
+        if list(data['idxs']) != list(idxs):
+            raise ValueError(f"The checkpoint {filename} belongs to a different set of particles.")
+        done = {int(key[3:]): (data[key], data['hit' + key[2:]]) for key in data.files if key.startswith('ty_')}
+        current = None
+        if 'current' in data.files:
+            state = TracingState.from_dict({key[6:]: data[key] for key in data.files if key.startswith('state_')})
+            current = (int(data['current'][0]), state, data['current_ty'], data['current_hit'])
+    return done, current
+
+
+def _trace_checkpointed(trace_one, idxs, filename, interval):
+    """
+    Traces the particles ``idxs`` one after the other, calling
+    ``trace_one(i, state)`` repeatedly with a :obj:`TracingState` that stops
+    the integration after ``interval`` seconds. After each of these segments,
+    the finished particles and the state of the current one are written to
+    ``filename``, and a previous run is resumed from that file.
+    """
+    done, current = _load_checkpoint(filename, idxs)
+    for i in idxs:
+        if i in done:
+            continue
+        if current is not None and current[0] == i:
+            _, state, res_ty, res_hit = current
+            res_tys, res_hits = [res_ty], [res_hit]
+        else:
+            state = TracingState()
+            res_tys, res_hits = [], []
+        state.max_walltime = interval
+        while not state.finished:
+            res_ty, res_hit = trace_one(i, state)
+            res_tys.append(np.asarray(res_ty).reshape(-1, len(state.y) + 1))
+            res_hits.append(np.asarray(res_hit).reshape(-1, len(state.y) + 2))
+            res_tys, res_hits = [np.concatenate(res_tys)], [np.concatenate(res_hits)]
+            if state.finished:
+                done[i] = (res_tys[0], res_hits[0])
+                current = None
+            else:
+                current = (i, state, res_tys[0], res_hits[0])
+            _save_checkpoint(filename, idxs, done, current)
+    return [done[i] for i in idxs]
+
+
 def trace_particles_boozer(field: BoozerMagneticField,
                            stz_inits: RealArray,  
                            parallel_speeds: RealArray,
                            tmax=1e-4,
                            mass=ALPHA_PARTICLE_MASS, charge=ALPHA_PARTICLE_CHARGE, Ekin=FUSION_ALPHA_PARTICLE_ENERGY,
-                           tol=1e-9, comm=None, zetas=[], stopping_criteria=[], mode='gc_vac', forget_exact_path=False):
+                           tol=1e-9, comm=None, zetas=[], stopping_criteria=[], mode='gc_vac', forget_exact_path=False,
+                           trajectory_output=None, integrator=None, nthreads=None, chunk_size=None,
+                           checkpoint=None, checkpoint_interval=600.):
     r"""
     Follow particles in a :class:`BoozerMagneticField`. This is modeled after
     :func:`trace_particles`.
@@ -145,6 +230,32 @@ def trace_particles_boozer(field: BoozerMagneticField,
         forget_exact_path: return only the first and last position of each
             particle for the ``res_tys``. To be used when only res_zeta_hits is of
             interest or one wants to reduce memory usage.
+        trajectory_output: a :obj:`TrajectoryOutput` that selects which states of
+            the trajectories are stored. Defaults to every step
+            of the integrator.
+        integrator: an :obj:`Integrator` that selects the time integration scheme.
+            Defaults to the adaptive Dormand-Prince method with
+            tolerance ``tol``.
+        nthreads: if set, the particles of this MPI rank are traced in C++ on
+            ``nthreads`` threads (``0`` uses the OpenMP default), handing out
+            one particle at a time. The threads share the interpolation tables
+            of an :obj:`~simsopt.field.boozermagneticfield.InterpolatedBoozerField`,
+            so running one MPI rank per node with ``nthreads`` threads keeps
+            a single copy of the tables per node. Other fields are traced on
+            a single thread. The :obj:`ToroidalTransitStoppingCriterion` can
+            only be used with ``nthreads=1``.
+        chunk_size: if set together with ``comm``, the particles are not split
+            up statically across the ranks, but handed out on demand in chunks
+            of ``chunk_size`` particles, see :func:`~simsopt._core.util.dynamic_loop_chunks`.
+            This balances the load if some particles are lost early.
+        checkpoint: if set, the progress is written to the file
+            ``checkpoint + '.npz'`` (``checkpoint + f'.{rank}.npz'`` when
+            running on several MPI ranks) every ``checkpoint_interval``
+            seconds of walltime, and a run with the same arguments resumes
+            from that file. The resumed results are the same as those of an
+            uninterrupted run. Cannot be combined with ``nthreads`` or
+            ``chunk_size``.
+        checkpoint_interval: seconds of walltime between two checkpoints.
 
     Returns: 2 element tuple containing
         - ``res_tys``:
@@ -172,29 +283,53 @@ def trace_particles_boozer(field: BoozerMagneticField,
     mode = mode.lower()
     assert mode in ['gc', 'gc_vac', 'gc_nok']
 
-    res_tys = []
-    res_zeta_hits = []
     loss_ctr = 0
-    first, last = parallel_loop_bounds(comm, nparticles)
-    for i in range(first, last):
-        res_ty, res_zeta_hit = sopp.particle_guiding_center_boozer_tracing(
+    output = TrajectoryOutput() if trajectory_output is None else trajectory_output
+    integ = Integrator() if integrator is None else integrator
+
+    if checkpoint is not None:
+        assert nthreads is None and chunk_size is None, "checkpoints are only supported for the serial tracing"
+
+    def trace_one(i, state=None):
+        return sopp.particle_guiding_center_boozer_tracing(
             field, stz_inits[i, :],
             m, charge, speed_total, speed_par[i], tmax, tol, vacuum=(mode == 'gc_vac'),
-            noK=(mode == 'gc_nok'), zetas=zetas, stopping_criteria=stopping_criteria)
-        if not forget_exact_path:
-            res_tys.append(np.asarray(res_ty))
-        else:
-            res_tys.append(np.asarray([res_ty[0], res_ty[-1]]))
-        res_zeta_hits.append(np.asarray(res_zeta_hit))
-        dtavg = res_ty[-1][0]/len(res_ty)
-        logger.debug(f"{i+1:3d}/{nparticles}, t_final={res_ty[-1][0]}, average timestep {1000*dtavg:.10f}ms")
-        if res_ty[-1][0] < tmax - 1e-15:
-            loss_ctr += 1
+            noK=(mode == 'gc_nok'), zetas=zetas, stopping_criteria=stopping_criteria, output=output, integrator=integ,
+            state=state)
+
+    def trace(idxs):
+        if checkpoint is not None:
+            return _trace_checkpointed(trace_one, idxs, _checkpoint_filename(checkpoint, comm), checkpoint_interval)
+        if nthreads is None:
+            return [trace_one(i) for i in idxs]
+        return sopp.particle_guiding_center_boozer_tracing_many(
+            field, stz_inits[idxs, :],
+            m, charge, speed_total, [speed_par[i] for i in idxs], tmax, tol, vacuum=(mode == 'gc_vac'),
+            noK=(mode == 'gc_nok'), zetas=zetas, stopping_criteria=stopping_criteria, nthreads=nthreads,
+            output=output, integrator=integ)
+
+    if comm is not None and chunk_size is not None:
+        chunks = dynamic_loop_chunks(comm, nparticles, chunk_size)
+    else:
+        chunks = [range(*parallel_loop_bounds(comm, nparticles))]
+    # results of this rank, by particle index
+    results = {}
+    for idxs in chunks:
+        for i, (res_ty, res_zeta_hit) in zip(idxs, trace(list(idxs))):
+            if not forget_exact_path or len(res_ty) == 0:
+                res_tys_i = np.asarray(res_ty)
+            else:
+                res_tys_i = np.asarray([res_ty[0], res_ty[-1]])
+            results[i] = (res_tys_i, np.asarray(res_zeta_hit))
+            if len(res_ty) > 0:
+                logger.debug(f"{i+1:3d}/{nparticles}, t_final={res_ty[-1][0]}")
+            if _particle_lost(res_ty, res_zeta_hit, tmax):
+                loss_ctr += 1
     if comm is not None:
         loss_ctr = comm.allreduce(loss_ctr)
-    if comm is not None:
-        res_tys = [i for o in comm.allgather(res_tys) for i in o]
-        res_zeta_hits = [i for o in comm.allgather(res_zeta_hits) for i in o]
+        results = {i: r for o in comm.allgather(results) for i, r in o.items()}
+    res_tys = [results[i][0] for i in sorted(results)]
+    res_zeta_hits = [results[i][1] for i in sorted(results)]
     logger.debug(f'Particles lost {loss_ctr}/{nparticles}={(100*loss_ctr)//nparticles:d}%')
     return res_tys, res_zeta_hits
 
@@ -205,7 +340,8 @@ def trace_particles(field: MagneticField,
                     tmax=1e-4,
                     mass=ALPHA_PARTICLE_MASS, charge=ALPHA_PARTICLE_CHARGE, Ekin=FUSION_ALPHA_PARTICLE_ENERGY,
                     tol=1e-9, comm=None, phis=[], stopping_criteria=[], mode='gc_vac', forget_exact_path=False,
-                    phase_angle=0):
+                    phase_angle=0, batch_size=None, nthreads=None, trajectory_output=None,
+                    integrator=None, checkpoint=None, checkpoint_interval=600.):
     r"""
     Follow particles in a magnetic field.
 
@@ -250,6 +386,33 @@ def trace_particles(field: MagneticField,
                            particle for the ``res_tys``. To be used when only res_phi_hits is of
                            interest or one wants to reduce memory usage.
         phase_angle: the phase angle to use in the case of full orbit calculations
+        batch_size: only for ``mode='gc_vac'``. If set, blocks of ``batch_size``
+                    particles are advanced together, and the field is evaluated
+                    for all particles of a block at once. This is most useful
+                    for an :obj:`~simsopt.field.magneticfieldclasses.InterpolatedField`.
+                    The :obj:`ToroidalTransitStoppingCriterion` cannot be used
+                    in this case.
+        nthreads: if set, the particles of this MPI rank are traced in a single
+                  call to C++ on ``nthreads`` threads (``0`` uses the OpenMP
+                  default). Every thread evaluates its own copy of the field, which
+                  is supported by :obj:`~simsopt.field.magneticfieldclasses.InterpolatedField`;
+                  other fields are traced on a single thread. The
+                  :obj:`ToroidalTransitStoppingCriterion` can only be used with
+                  ``nthreads=1``. Ignored if ``batch_size`` is set.
+        trajectory_output: a :obj:`TrajectoryOutput` that selects which states of
+                           the trajectories are stored. Defaults to every step
+                           of the integrator.
+        integrator: an :obj:`Integrator` that selects the time integration scheme.
+                    Defaults to the adaptive Dormand-Prince method with
+                    tolerance ``tol``.
+        checkpoint: if set, the progress is written to the file
+                    ``checkpoint + '.npz'`` (``checkpoint + f'.{rank}.npz'`` when
+                    running on several MPI ranks) every ``checkpoint_interval``
+                    seconds of walltime, and a run with the same arguments
+                    resumes from that file. The resumed results are the same as
+                    those of an uninterrupted run. Cannot be combined with
+                    ``batch_size`` or ``nthreads``.
+        checkpoint_interval: seconds of walltime between two checkpoints.
 
     Returns: 2 element tuple containing
         - ``res_tys``:
@@ -284,25 +447,72 @@ def trace_particles(field: MagneticField,
     res_tys = []
     res_phi_hits = []
     loss_ctr = 0
+    output = TrajectoryOutput() if trajectory_output is None else trajectory_output
+    integ = Integrator() if integrator is None else integrator
     first, last = parallel_loop_bounds(comm, nparticles)
+    if batch_size is not None:
+        assert mode == 'gc_vac', "batched tracing is only implemented for mode='gc_vac'"
+        assert batch_size > 0
+        assert integ.method == sopp.Integrator.Method.dopri5, "batched tracing is only implemented for the dopri5 integrator"
+    batch = {}
+    if checkpoint is not None:
+        assert batch_size is None and nthreads is None, "checkpoints are only supported for the serial tracing"
+
+        def trace_one(i, state):
+            if 'gc' in mode:
+                return sopp.particle_guiding_center_tracing(
+                    field, xyz_inits[i, :],
+                    m, charge, speed_total, speed_par[i], tmax, tol,
+                    vacuum=(mode == 'gc_vac'), phis=phis, stopping_criteria=stopping_criteria, output=output,
+                    integrator=integ, state=state)
+            return sopp.particle_fullorbit_tracing(
+                field, xyz_inits[i, :], v_inits[i, :],
+                m, charge, tmax, tol, phis=phis, stopping_criteria=stopping_criteria, output=output,
+                integrator=integ, state=state)
+        idxs = list(range(first, last))
+        results = _trace_checkpointed(trace_one, idxs, _checkpoint_filename(checkpoint, comm), checkpoint_interval)
+        batch = dict(zip(idxs, results))
+    elif nthreads is not None and batch_size is None:
+        assert mode in ['gc_vac', 'full'], "multithreaded tracing is only implemented for mode='gc_vac' and mode='full'"
+        idxs = list(range(first, last))
+        if mode == 'gc_vac':
+            results = sopp.particle_guiding_center_tracing_many(
+                field, xyz_inits[idxs, :],
+                m, charge, speed_total, [speed_par[j] for j in idxs], tmax, tol,
+                vacuum=True, phis=phis, stopping_criteria=stopping_criteria, nthreads=nthreads, output=output, integrator=integ)
+        else:
+            results = sopp.particle_fullorbit_tracing_many(
+                field, xyz_inits[idxs, :], v_inits[idxs, :],
+                m, charge, tmax, tol, phis=phis, stopping_criteria=stopping_criteria, nthreads=nthreads, output=output, integrator=integ)
+        batch = dict(zip(idxs, results))
     for i in range(first, last):
-        if 'gc' in mode:
+        if i in batch:
+            res_ty, res_phi_hit = batch.pop(i)
+        elif batch_size is not None:
+            idxs = list(range(i, min(i + batch_size, last)))
+            results = sopp.particle_guiding_center_tracing_batch(
+                field, xyz_inits[idxs, :],
+                m, charge, speed_total, [speed_par[j] for j in idxs], tmax, tol,
+                phis=phis, stopping_criteria=stopping_criteria, output=output)
+            batch = dict(zip(idxs, results))
+            res_ty, res_phi_hit = batch.pop(i)
+        elif 'gc' in mode:
             res_ty, res_phi_hit = sopp.particle_guiding_center_tracing(
                 field, xyz_inits[i, :],
                 m, charge, speed_total, speed_par[i], tmax, tol,
-                vacuum=(mode == 'gc_vac'), phis=phis, stopping_criteria=stopping_criteria)
+                vacuum=(mode == 'gc_vac'), phis=phis, stopping_criteria=stopping_criteria, output=output, integrator=integ)
         else:
             res_ty, res_phi_hit = sopp.particle_fullorbit_tracing(
                 field, xyz_inits[i, :], v_inits[i, :],
-                m, charge, tmax, tol, phis=phis, stopping_criteria=stopping_criteria)
-        if not forget_exact_path:
+                m, charge, tmax, tol, phis=phis, stopping_criteria=stopping_criteria, output=output, integrator=integ)
+        if not forget_exact_path or len(res_ty) == 0:
             res_tys.append(np.asarray(res_ty))
         else:
             res_tys.append(np.asarray([res_ty[0], res_ty[-1]]))
         res_phi_hits.append(np.asarray(res_phi_hit))
-        dtavg = res_ty[-1][0]/len(res_ty)
-        logger.debug(f"{i+1:3d}/{nparticles}, t_final={res_ty[-1][0]}, average timestep {1000*dtavg:.10f}ms")
-        if res_ty[-1][0] < tmax - 1e-15:
+        if len(res_ty) > 0:
+            logger.debug(f"{i+1:3d}/{nparticles}, t_final={res_ty[-1][0]}")
+        if _particle_lost(res_ty, res_phi_hit, tmax):
             loss_ctr += 1
     if comm is not None:
         loss_ctr = comm.allreduce(loss_ctr)
@@ -318,7 +528,7 @@ def trace_particles_starting_on_curve(curve, field, nparticles, tmax=1e-4,
                                       Ekin=FUSION_ALPHA_PARTICLE_ENERGY,
                                       tol=1e-9, comm=None, seed=1, umin=-1, umax=+1,
                                       phis=[], stopping_criteria=[], mode='gc_vac', forget_exact_path=False,
-                                      phase_angle=0):
+                                      phase_angle=0, trajectory_output=None, integrator=None):
     r"""
     Follows particles spawned at random locations on the magnetic axis with random pitch angle.
     See :mod:`simsopt.field.tracing.trace_particles` for the governing equations.
@@ -352,6 +562,12 @@ def trace_particles_starting_on_curve(curve, field, nparticles, tmax=1e-4,
                            particle for the ``res_tys``. To be used when only res_phi_hits is of
                            interest or one wants to reduce memory usage.
         phase_angle: the phase angle to use in the case of full orbit calculations
+        trajectory_output: a :obj:`TrajectoryOutput` that selects which states of
+                           the trajectories are stored. Defaults to every step
+                           of the integrator.
+        integrator: an :obj:`Integrator` that selects the time integration scheme.
+                    Defaults to the adaptive Dormand-Prince method with
+                    tolerance ``tol``.
 
     Returns: see :mod:`simsopt.field.tracing.trace_particles`
     """
@@ -365,7 +581,7 @@ def trace_particles_starting_on_curve(curve, field, nparticles, tmax=1e-4,
         field, xyz, speed_par, tmax=tmax, mass=mass, charge=charge,
         Ekin=Ekin, tol=tol, comm=comm, phis=phis,
         stopping_criteria=stopping_criteria, mode=mode, forget_exact_path=forget_exact_path,
-        phase_angle=phase_angle)
+        phase_angle=phase_angle, trajectory_output=trajectory_output, integrator=integrator)
 
 
 def trace_particles_starting_on_surface(surface, field, nparticles, tmax=1e-4,
@@ -373,7 +589,7 @@ def trace_particles_starting_on_surface(surface, field, nparticles, tmax=1e-4,
                                         Ekin=FUSION_ALPHA_PARTICLE_ENERGY,
                                         tol=1e-9, comm=None, seed=1, umin=-1, umax=+1,
                                         phis=[], stopping_criteria=[], mode='gc_vac', forget_exact_path=False,
-                                        phase_angle=0):
+                                        phase_angle=0, trajectory_output=None, integrator=None):
     r"""
     Follows particles spawned at random locations on the magnetic axis with random pitch angle.
     See :mod:`simsopt.field.tracing.trace_particles` for the governing equations.
@@ -408,6 +624,12 @@ def trace_particles_starting_on_surface(surface, field, nparticles, tmax=1e-4,
                            particle for the ``res_tys``. To be used when only res_phi_hits is of
                            interest or one wants to reduce memory usage.
         phase_angle: the phase angle to use in the case of full orbit calculations
+        trajectory_output: a :obj:`TrajectoryOutput` that selects which states of
+                           the trajectories are stored. Defaults to every step
+                           of the integrator.
+        integrator: an :obj:`Integrator` that selects the time integration scheme.
+                    Defaults to the adaptive Dormand-Prince method with
+                    tolerance ``tol``.
 
     Returns: see :mod:`simsopt.field.tracing.trace_particles`
     """
@@ -421,7 +643,7 @@ def trace_particles_starting_on_surface(surface, field, nparticles, tmax=1e-4,
         field, xyz, speed_par, tmax=tmax, mass=mass, charge=charge,
         Ekin=Ekin, tol=tol, comm=comm, phis=phis,
         stopping_criteria=stopping_criteria, mode=mode, forget_exact_path=forget_exact_path,
-        phase_angle=phase_angle)
+        phase_angle=phase_angle, trajectory_output=trajectory_output, integrator=integrator)
 
 
 def compute_resonances(res_tys, res_phi_hits, ma=None, delta=1e-2):
@@ -654,7 +876,8 @@ def compute_poloidal_transits(res_tys, ma=None, flux=True):
     return ntransits
 
 
-def compute_fieldlines(field, R0, Z0, tmax=200, tol=1e-7, phis=[], stopping_criteria=[], comm=None):
+def compute_fieldlines(field, R0, Z0, tmax=200, tol=1e-7, phis=[], stopping_criteria=[], comm=None, nthreads=None,
+                       trajectory_output=None, integrator=None):
     r"""
     Compute magnetic field lines by solving
 
@@ -673,6 +896,15 @@ def compute_fieldlines(field, R0, Z0, tmax=200, tol=1e-7, phis=[], stopping_crit
         stopping_criteria: list of stopping criteria, mostly used in
                            combination with the ``LevelsetStoppingCriterion``
                            accessed via :obj:`simsopt.field.tracing.SurfaceClassifier`.
+        comm: MPI communicator to parallelize over
+        nthreads: if set, the field lines of this MPI rank are traced on
+                  ``nthreads`` threads, see :func:`trace_particles`.
+        trajectory_output: a :obj:`TrajectoryOutput` that selects which states of
+                           the trajectories are stored. Defaults to every step
+                           of the integrator.
+        integrator: an :obj:`Integrator` that selects the time integration scheme.
+                    Defaults to the adaptive Dormand-Prince method with
+                    tolerance ``tol``.
 
     Returns: 2 element tuple containing
         - ``res_tys``:
@@ -695,15 +927,27 @@ def compute_fieldlines(field, R0, Z0, tmax=200, tol=1e-7, phis=[], stopping_crit
     xyz_inits[:, 2] = np.asarray(Z0)
     res_tys = []
     res_phi_hits = []
+    output = TrajectoryOutput() if trajectory_output is None else trajectory_output
+    integ = Integrator() if integrator is None else integrator
     first, last = parallel_loop_bounds(comm, nlines)
+    batch = {}
+    if nthreads is not None:
+        idxs = list(range(first, last))
+        results = sopp.fieldline_tracing_many(
+            field, xyz_inits[idxs, :],
+            tmax, tol, phis=phis, stopping_criteria=stopping_criteria, nthreads=nthreads, output=output, integrator=integ)
+        batch = dict(zip(idxs, results))
     for i in range(first, last):
-        res_ty, res_phi_hit = sopp.fieldline_tracing(
-            field, xyz_inits[i, :],
-            tmax, tol, phis=phis, stopping_criteria=stopping_criteria)
+        if i in batch:
+            res_ty, res_phi_hit = batch.pop(i)
+        else:
+            res_ty, res_phi_hit = sopp.fieldline_tracing(
+                field, xyz_inits[i, :],
+                tmax, tol, phis=phis, stopping_criteria=stopping_criteria, output=output, integrator=integ)
         res_tys.append(np.asarray(res_ty))
         res_phi_hits.append(np.asarray(res_phi_hit))
-        dtavg = res_ty[-1][0]/len(res_ty)
-        logger.debug(f"{i+1:3d}/{nlines}, t_final={res_ty[-1][0]}, average timestep {dtavg:.10f}s")
+        if len(res_ty) > 0:
+            logger.debug(f"{i+1:3d}/{nlines}, t_final={res_ty[-1][0]}")
     if comm is not None:
         res_tys = [i for o in comm.allgather(res_tys) for i in o]
         res_phi_hits = [i for o in comm.allgather(res_phi_hits) for i in o]
@@ -736,7 +980,7 @@ class LevelsetStoppingCriterion(sopp.LevelsetStoppingCriterion):
         assert isinstance(classifier, SurfaceClassifier) \
             or isinstance(classifier, sopp.RegularGridInterpolant3D)
         if isinstance(classifier, SurfaceClassifier):
-            sopp.LevelsetStoppingCriterion.__init__(self, classifier.dist)
+            sopp.LevelsetStoppingCriterion.__init__(self, classifier.dist, classifier.nfp, classifier.stellsym)
         else:
             sopp.LevelsetStoppingCriterion.__init__(self, classifier)
 
@@ -791,6 +1035,111 @@ class ToroidalTransitStoppingCriterion(sopp.ToroidalTransitStoppingCriterion):
     pass
 
 
+class TrajectoryOutput(sopp.TrajectoryOutput):
+    """
+    Selects which states of a trajectory are returned by the tracing functions.
+
+    Usage:
+
+    .. code-block::
+
+        trajectory_output=TrajectoryOutput('sampled', dt=1e-6)
+
+    where the mode is one of
+
+    - ``'full'``: the state after every step of the integrator (the default),
+    - ``'every_n'``: the state after every ``every``-th step,
+    - ``'sampled'``: the states at times ``0, dt, 2*dt, ...``, evaluated with the
+      dense output of the integrator,
+    - ``'hits_only'``: only the initial and the final state, for when only the
+      phi (or zeta) hits and the end state are of interest,
+    - ``'none'``: no states at all.
+
+    Except for ``'none'``, the trajectory always contains the initial state and
+    the state at ``tmax``, or, if the particle was stopped, the state at which a
+    stopping criterion was satisfied (for ``'full'``, the last state before
+    that). The states are only stored in memory if they are selected, so that
+    long runs do not accumulate every step of the integrator.
+    """
+
+    def __init__(self, mode='full', every=1, dt=0.):
+        modes = ['full', 'every_n', 'sampled', 'hits_only', 'none']
+        if mode not in modes:
+            raise ValueError(f"mode has to be one of {modes}")
+        sopp.TrajectoryOutput.__init__(self, getattr(sopp.TrajectoryOutput.Mode, mode), every, dt)
+
+
+class Integrator(sopp.Integrator):
+    """
+    Selects the time integration scheme of the tracing functions.
+
+    Usage:
+
+    .. code-block::
+
+        integrator=Integrator('boris', dt=1e-9)
+
+    where the method is one of
+
+    - ``'dopri5'``: the adaptive Dormand-Prince 5(4) method with the tolerance
+      ``tol`` of the tracing function (the default),
+    - ``'rk4'``: the classical fourth order Runge-Kutta method with the fixed
+      step ``dt``,
+    - ``'boris'``: the Boris scheme with the fixed step ``dt``, only for full
+      orbit tracing. It takes a single field evaluation per step instead of
+      the six of the Dormand-Prince method, conserves the kinetic energy
+      exactly and, being volume preserving, remains stable over long times.
+
+    For the fixed step methods, the phi hits and sampled trajectory outputs
+    are computed by cubic Hermite interpolation in between the steps, and
+    ``tol`` only sets the accuracy of the phi hits.
+    """
+
+    def __init__(self, method='dopri5', dt=0.):
+        methods = ['dopri5', 'rk4', 'boris']
+        if method not in methods:
+            raise ValueError(f"method has to be one of {methods}")
+        sopp.Integrator.__init__(self, getattr(sopp.Integrator.Method, method), dt)
+
+
+class TracingState(sopp.TracingState):
+    """
+    The state of the tracing of a single particle, which allows interrupting
+    the integration and resuming it later. If passed as ``state`` to
+    ``sopp.particle_guiding_center_tracing``,
+    ``sopp.particle_guiding_center_boozer_tracing`` or
+    ``sopp.particle_fullorbit_tracing``, the integration returns after the
+    first step that ends more than ``max_walltime`` seconds after the call was
+    made, and a call with the same state continues from there, until
+    ``finished`` is set. Every call returns only the part of the trajectory
+    and of the hits computed in that call. Since the step size, the number of
+    steps and the state of the stopping criteria are stored as well, the
+    concatenated results are the same as for an uninterrupted integration.
+
+    The tracing functions use this for the ``checkpoint`` argument, and
+    :meth:`as_dict` and :meth:`from_dict` convert the state to and from plain
+    numbers for writing it to a file.
+    """
+
+    _keys = ['started', 'finished', 'max_walltime', 't', 'dt', 'iter', 'nsample', 'y', 'phi']
+
+    def as_dict(self):
+        d = {key: getattr(self, key) for key in self._keys}
+        for k, c in enumerate(self.criteria):
+            d[f'criterion_{k}'] = c
+        d['ncriteria'] = len(self.criteria)
+        return d
+
+    @classmethod
+    def from_dict(cls, d):
+        state = cls()
+        for key, typ in zip(cls._keys, [bool, bool, float, float, float, int, int, list, float]):
+            val = np.asarray(d[key])
+            setattr(state, key, [float(v) for v in val] if typ is list else typ(val))
+        state.criteria = [[float(v) for v in np.asarray(d[f'criterion_{k}'])] for k in range(int(d['ncriteria']))]
+        return state
+
+
 class IterationStoppingCriterion(sopp.IterationStoppingCriterion):
     """
     Stop the iteration once the maximum number of iterations is reached.
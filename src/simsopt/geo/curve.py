@@ -11,7 +11,7 @@ from .._core.derivative import Derivative
 from .jit import jit
 from .plotting import fix_matplotlib_3d
 
-__all__ = ['Curve', 'RotatedCurve', 'curves_to_vtk', 'create_equally_spaced_curves', 'create_equally_spaced_planar_curves']
+__all__ = ['Curve', 'RotatedCurve', 'CurveBatch', 'curves_to_vtk', 'create_equally_spaced_curves', 'create_equally_spaced_planar_curves']
 
 
 @jit
@@ -813,6 +813,34 @@ class RotatedCurve(sopp.Curve, Curve):
         return True if self.rotmat[2][2] == -1 else False
 
 
+class CurveBatch(sopp.CurveBatch):
+    """
+    Evaluates many curves of the same type at once, by multiplying a table
+    of the basis functions, which is only computed once, with the dofs of
+    all curves. The results are stored in the caches of the curves, so that
+    subsequent calls to e.g. ``curve.gamma()`` do not recompute them. This
+    is faster than evaluating the curves one by one for many curves of low
+    order, e.g. the base curves of a stage two optimization.
+
+    Args:
+        curves: A list of :obj:`~simsopt.geo.curvexyzfourier.CurveXYZFourier`,
+          :obj:`~simsopt.geo.curverzfourier.CurveRZFourier` or
+          :obj:`~simsopt.geo.curveplanarfourier.CurvePlanarFourier`, all of
+          the same type, order, quadrature points, ``nfp`` and ``stellsym``.
+
+    Example::
+
+        batch = CurveBatch(base_curves)
+        # before every evaluation of the objective
+        batch.evaluate(2)   # gamma, gammadash and gammadashdash
+    """
+
+    def __init__(self, curves):
+        # keep the python objects of the curves alive
+        self.curves = list(curves)
+        sopp.CurveBatch.__init__(self, self.curves)
+
+
 def curves_to_vtk(curves, filename, close=False, extra_data=None):
     """
     Export a list of Curve objects in VTK format, so they can be
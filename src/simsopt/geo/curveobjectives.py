@@ -182,23 +182,32 @@ class CurveCurveDistance(Optimizable):
         self.curves = curves
         self.minimum_distance = minimum_distance
 
-        self.J_jax = jit(lambda gamma1, l1, gamma2, l2: cc_distance_pure(gamma1, l1, gamma2, l2, minimum_distance))
-        self.thisgrad0 = jit(lambda gamma1, l1, gamma2, l2: grad(self.J_jax, argnums=0)(gamma1, l1, gamma2, l2))
-        self.thisgrad1 = jit(lambda gamma1, l1, gamma2, l2: grad(self.J_jax, argnums=1)(gamma1, l1, gamma2, l2))
-        self.thisgrad2 = jit(lambda gamma1, l1, gamma2, l2: grad(self.J_jax, argnums=2)(gamma1, l1, gamma2, l2))
-        self.thisgrad3 = jit(lambda gamma1, l1, gamma2, l2: grad(self.J_jax, argnums=3)(gamma1, l1, gamma2, l2))
         self.candidates = None
         self.num_basecurves = num_basecurves or len(curves)
+        # spatial hash over the curves, only the curves that moved since the
+        # last call to compute_candidates are rehashed
+        self._grid = None
+        self._moved = set()
         super().__init__(depends_on=curves)
 
     def recompute_bell(self, parent=None):
         self.candidates = None
+        moved = [i for i, c in enumerate(self.curves) if c is parent]
+        if self._moved is not None and len(moved) > 0:
+            self._moved.update(moved)
+        else:
+            self._moved = None
 
     def compute_candidates(self):
         if self.candidates is None:
-            candidates = sopp.get_pointclouds_closer_than_threshold_within_collection(
-                [c.gamma() for c in self.curves], self.minimum_distance, self.num_basecurves)
-            self.candidates = candidates
+            if self._grid is None or self._moved is None:
+                self._grid = sopp.PointCloudGrid(
+                    [c.gamma() for c in self.curves], self.minimum_distance)
+            else:
+                for i in self._moved:
+                    self._grid.set_cloud(i, self.curves[i].gamma())
+            self._moved = set()
+            self.candidates = self._grid.close_pairs(self.num_basecurves)
 
     def shortest_distance_among_candidates(self):
         self.compute_candidates()
@@ -217,14 +226,9 @@ class CurveCurveDistance(Optimizable):
         This returns the value of the quantity.
         """
         self.compute_candidates()
-        res = 0
-        for i, j in self.candidates:
-            gamma1 = self.curves[i].gamma()
-            l1 = self.curves[i].gammadash()
-            gamma2 = self.curves[j].gamma()
-            l2 = self.curves[j].gammadash()
-            res += self.J_jax(gamma1, l1, gamma2, l2)
-
+        res, _, _ = sopp.curve_curve_distance_penalty(
+            [c.gamma() for c in self.curves], [c.gammadash() for c in self.curves],
+            self.candidates, self.minimum_distance, derivatives=False)
         return res
 
     @derivative_dec
@@ -233,18 +237,9 @@ class CurveCurveDistance(Optimizable):
         This returns the derivative of the quantity with respect to the curve dofs.
         """
         self.compute_candidates()
-        dgamma_by_dcoeff_vjp_vecs = [np.zeros_like(c.gamma()) for c in self.curves]
-        dgammadash_by_dcoeff_vjp_vecs = [np.zeros_like(c.gammadash()) for c in self.curves]
-
-        for i, j in self.candidates:
-            gamma1 = self.curves[i].gamma()
-            l1 = self.curves[i].gammadash()
-            gamma2 = self.curves[j].gamma()
-            l2 = self.curves[j].gammadash()
-            dgamma_by_dcoeff_vjp_vecs[i] += self.thisgrad0(gamma1, l1, gamma2, l2)
-            dgammadash_by_dcoeff_vjp_vecs[i] += self.thisgrad1(gamma1, l1, gamma2, l2)
-            dgamma_by_dcoeff_vjp_vecs[j] += self.thisgrad2(gamma1, l1, gamma2, l2)
-            dgammadash_by_dcoeff_vjp_vecs[j] += self.thisgrad3(gamma1, l1, gamma2, l2)
+        _, dgamma_by_dcoeff_vjp_vecs, dgammadash_by_dcoeff_vjp_vecs = sopp.curve_curve_distance_penalty(
+            [c.gamma() for c in self.curves], [c.gammadash() for c in self.curves],
+            self.candidates, self.minimum_distance)
 
         res = [self.curves[i].dgamma_by_dcoeff_vjp(dgamma_by_dcoeff_vjp_vecs[i]) + self.curves[i].dgammadash_by_dcoeff_vjp(dgammadash_by_dcoeff_vjp_vecs[i]) for i in range(len(self.curves))]
         return sum(res)
@@ -289,10 +284,11 @@ class CurveSurfaceDistance(Optimizable):
         self.surface = surface
         self.minimum_distance = minimum_distance
 
-        self.J_jax = jit(lambda gammac, lc, gammas, ns: cs_distance_pure(gammac, lc, gammas, ns, minimum_distance))
-        self.thisgrad0 = jit(lambda gammac, lc, gammas, ns: grad(self.J_jax, argnums=0)(gammac, lc, gammas, ns))
-        self.thisgrad1 = jit(lambda gammac, lc, gammas, ns: grad(self.J_jax, argnums=1)(gammac, lc, gammas, ns))
         self.candidates = None
+        # spatial hash over the surface, which is reused as long as the
+        # surface does not change
+        self._grid = None
+        self._grid_surface = None
         super().__init__(depends_on=curves)  # Bharat's comment: Shouldn't we add surface here
 
     def recompute_bell(self, parent=None):
@@ -300,9 +296,11 @@ class CurveSurfaceDistance(Optimizable):
 
     def compute_candidates(self):
         if self.candidates is None:
-            candidates = sopp.get_pointclouds_closer_than_threshold_between_two_collections(
-                [c.gamma() for c in self.curves], [self.surface.gamma().reshape((-1, 3))], self.minimum_distance)
-            self.candidates = candidates
+            xyz_surf = self.surface.gamma().reshape((-1, 3))
+            if self._grid is None or not np.array_equal(xyz_surf, self._grid_surface):
+                self._grid_surface = np.array(xyz_surf)
+                self._grid = sopp.PointCloudGrid([self._grid_surface], self.minimum_distance)
+            self.candidates = self._grid.close_pairs_to([c.gamma() for c in self.curves])
 
     def shortest_distance_among_candidates(self):
         self.compute_candidates()
@@ -323,14 +321,16 @@ class CurveSurfaceDistance(Optimizable):
         This returns the value of the quantity.
         """
         self.compute_candidates()
-        res = 0
+        res, _, _ = self._penalty(derivatives=False)
+        return res
+
+    def _penalty(self, derivatives):
         gammas = self.surface.gamma().reshape((-1, 3))
         ns = self.surface.normal().reshape((-1, 3))
-        for i, _ in self.candidates:
-            gammac = self.curves[i].gamma()
-            lc = self.curves[i].gammadash()
-            res += self.J_jax(gammac, lc, gammas, ns)
-        return res
+        return sopp.curve_surface_distance_penalty(
+            [c.gamma() for c in self.curves], [c.gammadash() for c in self.curves],
+            gammas, ns, [i for i, _ in self.candidates], self.minimum_distance,
+            derivatives=derivatives)
 
     @derivative_dec
     def dJ(self):
@@ -338,17 +338,7 @@ class CurveSurfaceDistance(Optimizable):
         This returns the derivative of the quantity with respect to the curve dofs.
         """
         self.compute_candidates()
-        dgamma_by_dcoeff_vjp_vecs = [np.zeros_like(c.gamma()) for c in self.curves]
-        dgammadash_by_dcoeff_vjp_vecs = [np.zeros_like(c.gammadash()) for c in self.curves]
-        gammas = self.surface.gamma().reshape((-1, 3))
-
-        gammas = self.surface.gamma().reshape((-1, 3))
-        ns = self.surface.normal().reshape((-1, 3))
-        for i, _ in self.candidates:
-            gammac = self.curves[i].gamma()
-            lc = self.curves[i].gammadash()
-            dgamma_by_dcoeff_vjp_vecs[i] += self.thisgrad0(gammac, lc, gammas, ns)
-            dgammadash_by_dcoeff_vjp_vecs[i] += self.thisgrad1(gammac, lc, gammas, ns)
+        _, dgamma_by_dcoeff_vjp_vecs, dgammadash_by_dcoeff_vjp_vecs = self._penalty(derivatives=True)
         res = [self.curves[i].dgamma_by_dcoeff_vjp(dgamma_by_dcoeff_vjp_vecs[i]) + self.curves[i].dgammadash_by_dcoeff_vjp(dgammadash_by_dcoeff_vjp_vecs[i]) for i in range(len(self.curves))]
         return sum(res)
 
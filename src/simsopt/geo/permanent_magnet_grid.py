@@ -192,6 +192,12 @@ class PermanentMagnetGrid:
                 Optional integer for downsampling the FAMUS grid, since
                 the MUSE and other grids can be very high resolution
                 and this makes CI take a long while.
+            matrix_free: bool
+                If True, A_obj is a sopp.DipoleFieldOperator that recomputes
+                the dipole fields whenever it is applied, instead of a dense
+                (nphi * ntheta, 3 * Ndipoles) array, which does not fit in
+                memory for dense dipole grids. It is accepted by the
+                relax-and-split and all GPMO algorithms but the ArbVec ones.
         Returns
         -------
         pm_grid: An initialized PermanentMagnetGrid class object.
@@ -199,6 +205,7 @@ class PermanentMagnetGrid:
         """
         coordinate_flag = kwargs.pop("coordinate_flag", "cartesian")
         downsample = kwargs.pop("downsample", 1)
+        matrix_free = kwargs.pop("matrix_free", False)
         pol_vectors = kwargs.pop("pol_vectors", None)
         m_maxima = kwargs.pop("m_maxima", None)
         if str(famus_filename)[-6:] != '.focus':
@@ -261,7 +268,7 @@ class PermanentMagnetGrid:
                                  'must equal the number of dipoles')
 
         pm_grid.pol_vectors = pol_vectors
-        pm_grid._optimization_setup()
+        pm_grid._optimization_setup(matrix_free)
         return pm_grid
 
     @classmethod
@@ -332,12 +339,19 @@ class PermanentMagnetGrid:
                 Cartesian grid is initialized using the Nx, Ny, and Nz parameters. If
                 the coordinate_flag='cylindrical', a uniform cylindrical grid is initialized
                 using the dr and dz parameters.
+            matrix_free: bool
+                If True, A_obj is a sopp.DipoleFieldOperator that recomputes
+                the dipole fields whenever it is applied, instead of a dense
+                (nphi * ntheta, 3 * Ndipoles) array, which does not fit in
+                memory for dense dipole grids. It is accepted by the
+                relax-and-split and all GPMO algorithms but the ArbVec ones.
         Returns
         -------
         pm_grid: An initialized PermanentMagnetGrid class object.
 
         """
         coordinate_flag = kwargs.pop("coordinate_flag", "cartesian")
+        matrix_free = kwargs.pop("matrix_free", False)
         pol_vectors = kwargs.pop("pol_vectors", None)
         m_maxima = kwargs.pop("m_maxima", None)
         pm_grid = cls(plasma_boundary, Bn, coordinate_flag) 
@@ -412,10 +426,10 @@ class PermanentMagnetGrid:
                                  'must equal the number of dipoles')
 
         pm_grid.pol_vectors = pol_vectors
-        pm_grid._optimization_setup()
+        pm_grid._optimization_setup(matrix_free)
         return pm_grid
 
-    def _optimization_setup(self):
+    def _optimization_setup(self, matrix_free=False):
 
         if self.Bn.shape != (self.nphi, self.ntheta):
             raise ValueError('Normal magnetic field surface data is incorrect shape.')
@@ -424,31 +438,35 @@ class PermanentMagnetGrid:
         # term is integral(B_P + B_C + B_M)^2
         self.b_obj = - self.Bn.reshape(self.nphi * self.ntheta)
 
-        # Compute geometric factor with the C++ routine
-        self.A_obj = sopp.dipole_field_Bn(
-            np.ascontiguousarray(self.plasma_boundary.gamma().reshape(-1, 3)),
-            np.ascontiguousarray(self.dipole_grid_xyz),
-            np.ascontiguousarray(self.plasma_boundary.unitnormal().reshape(-1, 3)),
-            self.plasma_boundary.nfp, int(self.plasma_boundary.stellsym),
-            np.ascontiguousarray(self.b_obj),
-            self.coordinate_flag,  # cartesian, cylindrical, or simple toroidal
-            self.R0
-        )
-
         # Rescale the A matrix so that 0.5 * ||Am - b||^2 = f_b,
         # where f_b is the metric for Bnormal on the plasma surface
         Ngrid = self.nphi * self.ntheta
-        self.A_obj = self.A_obj.reshape(self.nphi * self.ntheta, self.ndipoles * 3)
         Nnorms = np.ravel(np.sqrt(np.sum(self.plasma_boundary.normal() ** 2, axis=-1)))
-        for i in range(self.A_obj.shape[0]):
-            self.A_obj[i, :] = self.A_obj[i, :] * np.sqrt(Nnorms[i] / Ngrid)
+        if matrix_free:
+            # the same matrix, applied without storing it
+            self.A_obj = self._dipole_operator()
+        else:
+            # Compute geometric factor with the C++ routine
+            self.A_obj = sopp.dipole_field_Bn(
+                *self._dipole_args(),
+                np.ascontiguousarray(self.b_obj),
+                self.coordinate_flag,  # cartesian, cylindrical, or simple toroidal
+                self.R0
+            )
+            self.A_obj = self.A_obj.reshape(self.nphi * self.ntheta, self.ndipoles * 3)
+            for i in range(self.A_obj.shape[0]):
+                self.A_obj[i, :] = self.A_obj[i, :] * np.sqrt(Nnorms[i] / Ngrid)
         self.b_obj = self.b_obj * np.sqrt(Nnorms / Ngrid)
-        self.ATb = self.A_obj.T @ self.b_obj
 
         # Compute singular values of A, use this to determine optimal step size
         # for the MwPGP algorithm, with alpha ~ 2 / ATA_scale
-        S = np.linalg.svd(self.A_obj, full_matrices=False, compute_uv=False)
-        self.ATA_scale = S[0] ** 2
+        if matrix_free:
+            self.ATb = self.A_obj.rmatvec(self.b_obj)
+            self.ATA_scale = self._ATA_norm_estimate()
+        else:
+            self.ATb = self.A_obj.T @ self.b_obj
+            S = np.linalg.svd(self.A_obj, full_matrices=False, compute_uv=False)
+            self.ATA_scale = S[0] ** 2
 
         # Set initial condition for the dipoles to default IC
         self.m0 = np.zeros(self.ndipoles * 3)
@@ -457,9 +475,54 @@ class PermanentMagnetGrid:
         self.m = self.m0
 
         # Print initial f_B metric using the initial guess
-        total_error = np.linalg.norm((self.A_obj.dot(self.m0) - self.b_obj), ord=2) ** 2 / 2.0
+        total_error = np.linalg.norm((self._A_obj_dot(self.m0) - self.b_obj), ord=2) ** 2 / 2.0
         print('f_B (total with initial SIMSOPT guess) = ', total_error)
 
+    def _dipole_args(self):
+        return (
+            np.ascontiguousarray(self.plasma_boundary.gamma().reshape(-1, 3)),
+            np.ascontiguousarray(self.dipole_grid_xyz),
+            np.ascontiguousarray(self.plasma_boundary.unitnormal().reshape(-1, 3)),
+            self.plasma_boundary.nfp, int(self.plasma_boundary.stellsym),
+        )
+
+    def _dipole_operator(self):
+        """
+        The optimization matrix A_obj as a matrix-free sopp.DipoleFieldOperator.
+        """
+        Ngrid = self.nphi * self.ntheta
+        Nnorms = np.ravel(np.sqrt(np.sum(self.plasma_boundary.normal() ** 2, axis=-1)))
+        return sopp.DipoleFieldOperator(
+            *self._dipole_args(), self.coordinate_flag, self.R0
+        ).scale_rows(np.sqrt(Nnorms / Ngrid))
+
+    def _ATA_norm_estimate(self, tol=1e-6, maxiter=1000):
+        """
+        Estimate the largest eigenvalue of A^T A for a matrix-free A_obj with
+        power iterations. The iterates approach it from below, so the result
+        is increased by 1% to keep the MwPGP step size alpha ~ 2 / ATA_scale
+        stable.
+        """
+        x = np.random.default_rng(0).standard_normal(self.A_obj.shape[1])
+        x /= np.linalg.norm(x)
+        lam = 0.0
+        for _ in range(maxiter):
+            y = self.A_obj.rmatvec(self.A_obj.matvec(x))
+            lam_new = np.linalg.norm(y)
+            x = y / lam_new
+            if abs(lam_new - lam) <= tol * lam_new:
+                break
+            lam = lam_new
+        return 1.01 * lam_new
+
+    def _A_obj_dot(self, m):
+        """
+        A_obj @ m, without converting a single precision A_obj to double.
+        """
+        if isinstance(self.A_obj, sopp.DipoleFieldOperator):
+            return self.A_obj.matvec(m)
+        return self.A_obj.dot(m.astype(self.A_obj.dtype, copy=False))
+
     def _print_initial_opt(self):
         """
         Print out initial errors and the bulk optimization parameters
@@ -467,8 +530,9 @@ class PermanentMagnetGrid:
         """
         ave_Bn = np.mean(np.abs(self.b_obj))
         total_Bn = np.sum(np.abs(self.b_obj) ** 2)
-        dipole_error = np.linalg.norm(self.A_obj.dot(self.m0), ord=2) ** 2
-        total_error = np.linalg.norm(self.A_obj.dot(self.m0) - self.b_obj, ord=2) ** 2
+        Am0 = self._A_obj_dot(self.m0)
+        dipole_error = np.linalg.norm(Am0, ord=2) ** 2
+        total_error = np.linalg.norm(Am0 - self.b_obj, ord=2) ** 2
         print('Number of phi quadrature points on plasma surface = ', self.nphi)
         print('Number of theta quadrature points on plasma surface = ', self.ntheta)
         print('<B * n> without the permanent magnets = {0:.4e}'.format(ave_Bn))
@@ -480,6 +544,94 @@ class PermanentMagnetGrid:
         print('Shape of b vector = ', self.b_obj.shape)
         print('Initial error on plasma surface = {0:.4e}'.format(total_error))
 
+    def convert_A_obj(self, dtype=np.float32):
+        """
+        Store the optimization matrix A_obj in the given precision. The
+        GPMO and relax-and-split solvers accept A_obj in either double or
+        single precision and always accumulate the residuals in double
+        precision, so storing A_obj in float32 halves its memory footprint
+        and the memory traffic of the solvers, which are bandwidth-bound
+        for large grids. ATb and ATA_scale are left as computed from the
+        double precision matrix.
+
+        Args:
+            dtype: numpy floating point type, np.float32 or np.float64.
+        """
+        if np.dtype(dtype) not in (np.dtype(np.float32), np.dtype(np.float64)):
+            raise ValueError('A_obj can only be stored as np.float32 or np.float64.')
+        if not hasattr(self, "A_obj"):
+            raise ValueError("The PermanentMagnetClass needs to use geo_setup() or "
+                             "geo_setup_from_famus() before converting A_obj.")
+        if isinstance(self.A_obj, sopp.DipoleFieldOperator):
+            raise ValueError("A matrix-free A_obj cannot be converted.")
+        self.A_obj = np.ascontiguousarray(self.A_obj, dtype=dtype)
+
+    def write_A_obj(self, filename, gpmo=False, dtype=np.float64, block_size=256):
+        """
+        Write the dense optimization matrix to the .npy file filename and
+        replace it by a read-only memory map of that file, see load_A_obj.
+        The matrix is computed in blocks of block_size rows straight into
+        the file, so at most one block is held in memory, also if the grid
+        was set up with matrix_free=True. ATb and ATA_scale are not changed.
+
+        Args:
+            filename: Name of the .npy file to write.
+            gpmo: If False, the file holds A_obj, of shape
+              (nphi * ntheta, 3 * ndipoles), as taken by relax_and_split.
+              If True, it holds the transpose of A_obj with the columns
+              scaled by m_maxima, of shape (3 * ndipoles, nphi * ntheta),
+              which is the matrix the GPMO algorithms work with. GPMO
+              then uses this file instead of forming the matrix itself.
+            dtype: np.float64 or np.float32, see convert_A_obj.
+            block_size: Number of rows computed at once.
+        """
+        if np.dtype(dtype) not in (np.dtype(np.float32), np.dtype(np.float64)):
+            raise ValueError('A_obj can only be stored as np.float32 or np.float64.')
+        if not hasattr(self, "A_obj"):
+            raise ValueError("The PermanentMagnetClass needs to use geo_setup() or "
+                             "geo_setup_from_famus() before writing A_obj.")
+        op = self._dipole_operator()
+        if gpmo:
+            op = op.scale_columns(np.repeat(self.m_maxima, 3))
+            shape, fill = (op.shape[1], op.shape[0]), op.dense_columns
+        else:
+            shape, fill = op.shape, op.dense_rows
+        A = np.lib.format.open_memmap(filename, mode='w+', dtype=dtype, shape=shape)
+        block = None if np.dtype(dtype) == np.float64 else np.empty((block_size, shape[1]))
+        for start in range(0, shape[0], block_size):
+            stop = min(start + block_size, shape[0])
+            if block is None:
+                fill(start, A[start:stop])
+            else:
+                A[start:stop] = fill(start, block[:stop - start])
+        A.flush()
+        del A
+        self.load_A_obj(filename, gpmo=gpmo)
+
+    def load_A_obj(self, filename, gpmo=False):
+        """
+        Use the matrix in the .npy file filename, written by write_A_obj,
+        through a read-only memory map. The solvers read the matrix from the
+        map without copying it, so several jobs on the same node that load
+        the same file share a single copy of it in the page cache.
+
+        Args:
+            filename: Name of the .npy file written by write_A_obj.
+            gpmo: Whether the file was written with gpmo=True. The map
+              is stored as A_obj_gpmo then, and A_obj is left unchanged.
+        """
+        A = np.load(filename, mmap_mode='r')
+        shape = (self.nphi * self.ntheta, 3 * self.ndipoles)
+        if gpmo:
+            shape = shape[::-1]
+        if A.shape != shape or A.dtype not in (np.float32, np.float64):
+            raise ValueError(f'{filename} does not hold a matrix of shape {shape} '
+                             'and type np.float32 or np.float64.')
+        if gpmo:
+            self.A_obj_gpmo = A
+        else:
+            self.A_obj = A
+
     def write_to_famus(self, out_dir=''):
         """
         Takes a PermanentMagnetGrid object and saves the geometry
@@ -892,14 +892,31 @@ class SurfaceClassifier():
     Takes in a toroidal surface and constructs an interpolant of the signed distance function
     :math:`f:R^3\to R` that is positive inside the volume contained by the surface,
     (approximately) zero on the surface, and negative outisde the volume contained by the surface.
+
+    The distance is computed in C++ to the triangulated quadrature grid of the
+    surface, see :obj:`simsoptpp.SurfaceDistance`, on all interpolation nodes
+    in parallel.
     """
 
-    def __init__(self, surface, p=1, h=0.05):
+    def __init__(self, surface, p=1, h=0.05, field=None, nfp=1, stellsym=False):
         """
         Args:
             surface: the surface to contruct the distance from.
             p: degree of the interpolant
             h: grid resolution of the interpolant
+            field: an :obj:`~simsopt.field.magneticfieldclasses.InterpolatedField`.
+                If given, the interpolant uses the same interpolation rule,
+                grid and symmetries as this field instead of ``p``, ``h``,
+                ``nfp`` and ``stellsym``, so that a particle that is traced in
+                the field looks up the same cells in both interpolants. Points
+                outside of the grid of the field are classified as outside.
+            nfp: if larger than one, the distance is only interpolated on
+                :math:`0\le\phi\le 2\pi/\mathrm{nfp}` and other angles are
+                mapped into this interval, which requires a surface with this
+                rotational symmetry.
+            stellsym: if ``True``, the distance is only interpolated for
+                :math:`z\ge 0` and other points are mapped there by stellarator
+                symmetry, which requires a stellarator symmetric surface.
         """
         gammas = surface.gamma()
         r = np.linalg.norm(gammas[:, :, :2], axis=2)
@@ -912,38 +929,61 @@ class SurfaceClassifier():
         self.zrange = (zmin, zmax)
         self.rrange = (rmin, rmax)
 
-        nr = int((self.rrange[1]-self.rrange[0])/h)
-        nphi = int(2*np.pi/h)
-        nz = int((self.zrange[1]-self.zrange[0])/h)
-
-        def fbatch(rs, phis, zs):
-            xyz = np.zeros((len(rs), 3))
-            xyz[:, 0] = rs * np.cos(phis)
-            xyz[:, 1] = rs * np.sin(phis)
-            xyz[:, 2] = zs
-            return list(signed_distance_from_surface(xyz, surface))
+        if field is not None:
+            rule = field.rule
+            rrange, phirange, zrange = field.r_range, field.phi_range, field.z_range
+            self.nfp = field.nfp
+            self.stellsym = field.stellsym
+        else:
+            rule = sopp.UniformInterpolationRule(p)
+            if stellsym:
+                zmin = 0.
+            nr = int((rmax-rmin)/h)
+            nphi = int(2*np.pi/nfp/h)
+            nz = int((zmax-zmin)/h)
+            rrange, phirange, zrange = [rmin, rmax, nr], [0., 2*np.pi/nfp, nphi], [zmin, zmax, nz]
+            self.nfp = nfp
+            self.stellsym = stellsym
+
+        self.distance = sopp.SurfaceDistance(self._full_torus_gamma(surface))
+        self.dist = sopp.RegularGridInterpolant3D(rule, rrange, phirange, zrange, 1, True)
+        self.distance.interpolate(self.dist)
 
-        rule = sopp.UniformInterpolationRule(p)
-        self.dist = sopp.RegularGridInterpolant3D(
-            rule, [rmin, rmax, nr], [0., 2*np.pi, nphi], [zmin, zmax, nz], 1, True)
-        self.dist.interpolate_batch(fbatch)
+    @staticmethod
+    def _full_torus_gamma(surface):
+        if surface.deduced_range == Surface.RANGE_FULL_TORUS:
+            return np.ascontiguousarray(surface.gamma())
+        nphi = len(surface.quadpoints_phi) * surface.nfp
+        if surface.deduced_range == Surface.RANGE_HALF_PERIOD:
+            nphi *= 2
+        phis, thetas = np.meshgrid(np.linspace(0, 1, nphi, endpoint=False), surface.quadpoints_theta, indexing='ij')
+        gamma = np.zeros((nphi, len(surface.quadpoints_theta), 3))
+        surface.gamma_lin(gamma, phis.flatten(), thetas.flatten())
+        return gamma
+
+    def _symmetry_domain(self, rphiz):
+        if self.nfp == 1 and not self.stellsym:
+            return rphiz
+        rphiz = np.array(rphiz, dtype=float)
+        if self.stellsym:
+            mirror = rphiz[:, 2] < 0
+            rphiz[mirror, 2] *= -1
+            rphiz[mirror, 1] = 2*np.pi - rphiz[mirror, 1]
+        rphiz[:, 1] = np.mod(rphiz[:, 1], 2*np.pi/self.nfp)
+        return rphiz
 
     def evaluate_xyz(self, xyz):
         rphiz = np.zeros_like(xyz)
         rphiz[:, 0] = np.linalg.norm(xyz[:, :2], axis=1)
         rphiz[:, 1] = np.mod(np.arctan2(xyz[:, 1], xyz[:, 0]), 2*np.pi)
         rphiz[:, 2] = xyz[:, 2]
-        # initialize to -1 since the regular grid interpolant will just keep
-        # that value when evaluated outside of bounds
-        d = -np.ones((xyz.shape[0], 1))
-        self.dist.evaluate_batch(rphiz, d)
-        return d
+        return self.evaluate_rphiz(rphiz)
 
     def evaluate_rphiz(self, rphiz):
         # initialize to -1 since the regular grid interpolant will just keep
         # that value when evaluated outside of bounds
         d = -np.ones((rphiz.shape[0], 1))
-        self.dist.evaluate_batch(rphiz, d)
+        self.dist.evaluate_batch(self._symmetry_domain(rphiz), d)
         return d
 
     @SimsoptRequires(gridToVTK is not None,
@@ -966,8 +1006,7 @@ class SurfaceClassifier():
         RPhiZ[:, 0] = R.flatten()
         RPhiZ[:, 1] = Phi.flatten()
         RPhiZ[:, 2] = Z.flatten()
-        vals = -np.ones((R.size, 1))
-        self.dist.evaluate_batch(RPhiZ, vals)
+        vals = self.evaluate_rphiz(RPhiZ)
         vals = vals.reshape(R.shape)
         gridToVTK(filename, X, Y, Z, pointData={"levelset": vals})
 
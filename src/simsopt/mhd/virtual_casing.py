@@ -11,6 +11,10 @@ For details of the algorithm, see
 D Malhotra, A J Cerfon, M O'Neil, and E Toler,
 "Efficient high-order singular quadrature schemes in magnetic fusion",
 Plasma Physics and Controlled Fusion 62, 024004 (2020).
+
+Alternatively, the virtual casing integral can be computed by the
+compiled kernel in ``simsoptpp``, see
+:func:`VirtualCasing.B_external_from_surface`.
 """
 
 import os
@@ -20,6 +24,8 @@ from datetime import datetime
 import numpy as np
 from scipy.io import netcdf_file
 
+import simsoptpp as sopp
+
 from .vmec_diagnostics import B_cartesian
 from .vmec import Vmec
 from ..geo.surfacerzfourier import SurfaceRZFourier
@@ -121,13 +127,17 @@ class VirtualCasing:
     """
 
     @classmethod
-    def from_vmec(cls, vmec, src_nphi, src_ntheta=None, trgt_nphi=None, trgt_ntheta=None, use_stellsym=True, digits=6, filename="auto"):
+    def from_vmec(cls, vmec, src_nphi, src_ntheta=None, trgt_nphi=None, trgt_ntheta=None, use_stellsym=True, digits=6, filename="auto",
+                  backend="virtual_casing"):
         """
         Given a :obj:`~simsopt.mhd.vmec.Vmec` object, compute the contribution
         to the total magnetic field due to currents outside the plasma.
 
-        This function requires the python ``virtual_casing`` package to be
-        installed.
+        With the default ``backend="virtual_casing"``, this function requires
+        the python ``virtual_casing`` package to be installed. With
+        ``backend="simsopt"``, the integral is computed by
+        :func:`B_external_from_surface` instead, which is less accurate
+        for the same resolution, but needs no additional package.
 
         The argument ``src_nphi`` refers to the number of points around a half
         field period if stellarator symmetry is exploited, or a full field
@@ -159,8 +169,11 @@ class VirtualCasing:
               filename will automatically be set to ``"vcasing_<extension>.nc"``
               where ``<extension>`` is the string associated with Vmec input and output
               files, analogous to the Vmec output file ``"wout_<extension>.nc"``.
+            backend: Either ``"virtual_casing"`` or ``"simsopt"``, see above.
+              ``digits`` is only used by the former.
         """
-        import virtual_casing as vc_module
+        if backend not in ["virtual_casing", "simsopt"]:
+            raise ValueError(f'Unknown virtual casing backend {backend}')
 
         if not isinstance(vmec, Vmec):
             vmec = Vmec(vmec)
@@ -225,29 +238,43 @@ class VirtualCasing:
                     index += 1
         """
 
-        vcasing = vc_module.VirtualCasing()
-        vcasing.setup(
-            digits, nfp, stellsym,
-            src_nphi, src_ntheta, gamma1d,
-            src_nphi, src_ntheta,
-            trgt_nphi, trgt_ntheta)
-        # This next line launches the main computation:
-        Bexternal1d = np.array(vcasing.compute_external_B(B1d))
-
-        # Unpack 1D array results:
-        Bexternal3d = np.zeros((trgt_nphi, trgt_ntheta, 3))
-        for jxyz in range(3):
-            Bexternal3d[:, :, jxyz] = Bexternal1d[jxyz * trgt_nphi * trgt_ntheta: (jxyz + 1) * trgt_nphi * trgt_ntheta].reshape((trgt_nphi, trgt_ntheta), order='C')
-
-        """
-        # Check order:
-        index = 0
-        for jxyz in range(3):
-            for jphi in range(trgt_nphi):
-                for jtheta in range(trgt_ntheta):
-                    np.testing.assert_allclose(Bexternal1d[index], Bexternal3d[jphi, jtheta, jxyz])
-                    index += 1
-        """
+        if backend == "simsopt":
+            # The kernel needs the sources on a full field period, which
+            # contains the half period grid if stellarator symmetry is used.
+            fp_nphi = (1 + int(stellsym)) * src_nphi
+            fp_phi = surf.quadpoints_phi[0] + np.arange(fp_nphi) / (nfp * fp_nphi)
+            fp_surf = SurfaceRZFourier(mpol=vmec.wout.mpol, ntor=vmec.wout.ntor, nfp=nfp,
+                                       quadpoints_phi=fp_phi, quadpoints_theta=surf.quadpoints_theta)
+            fp_surf.x = surf.x
+            fp_B = np.stack(B_cartesian(vmec, quadpoints_phi=fp_phi, quadpoints_theta=surf.quadpoints_theta), axis=-1)
+            trgt_B = np.stack(B_cartesian(vmec, nphi=trgt_nphi, ntheta=trgt_ntheta, range=ran), axis=-1)
+            Bexternal3d = cls.B_external_from_surface(fp_surf, fp_B, trgt_surf.gamma(), trgt_B)
+        else:
+            import virtual_casing as vc_module
+
+            vcasing = vc_module.VirtualCasing()
+            vcasing.setup(
+                digits, nfp, stellsym,
+                src_nphi, src_ntheta, gamma1d,
+                src_nphi, src_ntheta,
+                trgt_nphi, trgt_ntheta)
+            # This next line launches the main computation:
+            Bexternal1d = np.array(vcasing.compute_external_B(B1d))
+
+            # Unpack 1D array results:
+            Bexternal3d = np.zeros((trgt_nphi, trgt_ntheta, 3))
+            for jxyz in range(3):
+                Bexternal3d[:, :, jxyz] = Bexternal1d[jxyz * trgt_nphi * trgt_ntheta: (jxyz + 1) * trgt_nphi * trgt_ntheta].reshape((trgt_nphi, trgt_ntheta), order='C')
+
+            """
+            # Check order:
+            index = 0
+            for jxyz in range(3):
+                for jphi in range(trgt_nphi):
+                    for jtheta in range(trgt_ntheta):
+                        np.testing.assert_allclose(Bexternal1d[index], Bexternal3d[jphi, jtheta, jxyz])
+                        index += 1
+            """
 
         Bexternal_normal = np.sum(Bexternal3d * unit_normal, axis=2)
 
@@ -283,6 +310,56 @@ class VirtualCasing:
 
         return vc
 
+    @staticmethod
+    def B_external_from_surface(surface, B, targets=None, B_targets=None, eta=0.0):
+        r"""
+        Computes the contribution to the magnetic field on a surface due
+        to currents outside the surface, given the total field ``B`` on
+        the surface, with the compiled kernel in ``simsoptpp``.
+
+        The integral of the virtual casing principle is evaluated with the
+        trapezoidal rule on the quadrature points of ``surface``, which
+        need to be a uniform grid of one full field period, e.g. from
+        ``range="field period"``. The other field periods are obtained by
+        rotation, so the cost is proportional to ``nfp`` times the number
+        of grid points times the number of targets. The error decreases
+        linearly with the grid spacing, due to the weak singularity of the
+        integrand.
+
+        Args:
+            surface: A :obj:`~simsopt.geo.surface.Surface` with quadrature
+              points on one field period.
+            B: The total field on the quadrature points, of shape
+              ``(nphi, ntheta, 3)``.
+            targets: Points on the surface of shape ``(..., 3)``, at which the
+              external field is evaluated. If ``None``, the quadrature points
+              of ``surface`` are used.
+            B_targets: The total field at ``targets``.
+            eta: If positive, blocks of source points that are more than
+              ``eta`` times their grid spacing away from the targets are
+              evaluated on a coarser grid. Values around 10 give a
+              speedup for fine grids at a small loss of accuracy.
+
+        Returns:
+            The external field at the targets, with the same shape as ``targets``.
+        """
+        nfp = surface.nfp
+        phi = surface.quadpoints_phi
+        theta = surface.quadpoints_theta
+        if not (np.allclose(np.diff(phi), 1 / (nfp * len(phi))) and np.allclose(np.diff(theta), 1 / len(theta))):
+            raise ValueError('The quadrature points of the surface need to be a uniform grid of one field period.')
+        if targets is None:
+            targets, B_targets = surface.gamma(), B
+        gamma = surface.gamma()
+        normal = surface.normal()
+        # the kernel expects the outward normal
+        if np.sum(gamma * normal) < 0:
+            normal = -normal
+        return sopp.virtual_casing_B_external(
+            np.ascontiguousarray(gamma), np.ascontiguousarray(normal), np.ascontiguousarray(B, dtype=np.float64),
+            np.ascontiguousarray(targets, dtype=np.float64), np.ascontiguousarray(B_targets, dtype=np.float64),
+            nfp, eta)
+
     def save(self, filename="vcasing.nc"):
         """
         Save the results of a virtual casing calculation in a NetCDF file.
@@ -46,6 +46,11 @@ class SquaredFlux(Optimizable):
           in ``phi`` and ``theta`` direction.
         definition: A string to select among the definitions above. The
           available options are ``"quadratic flux"``, ``"normalized"``, and ``"local"``.
+
+    For a :obj:`~simsopt.field.BiotSavart` field, the objective and its
+    derivative are computed with
+    :obj:`simsopt.field.BiotSavart.squared_flux`, which forms
+    :math:`\mathbf{B}\cdot\mathbf{n}` inside the Biot-Savart sum.
     """
 
     def __init__(self, surface, field, target=None, definition="quadratic flux"):
@@ -64,12 +69,18 @@ class SquaredFlux(Optimizable):
 
     def J(self):
         n = self.surface.normal()
+        if isinstance(self.field, sopp.BiotSavart):
+            return self.field.squared_flux(n, self.target, self.definition)
         Bcoil = self.field.B().reshape(n.shape)
         return sopp.integral_BdotN(Bcoil, self.target, n, self.definition)
 
     @derivative_dec
     def dJ(self):
         n = self.surface.normal()
+        if isinstance(self.field, sopp.BiotSavart):
+            # B.n, the objective and the weights of the vector Jacobian
+            # product are formed in one pass over the points
+            return self.field.squared_flux(n, self.target, self.definition, derivatives=True)[1]
         absn = np.linalg.norm(n, axis=2)
         unitn = n * (1. / absn)[:, :, None]
         Bcoil = self.field.B().reshape(n.shape)
@@ -1,3 +1,4 @@
+import os
 import warnings
 
 
@@ -5,9 +6,14 @@ import numpy as np
 
 import simsoptpp as sopp
 from .._core.types import RealArray
+from .._core.dev import SimsoptRequires
+try:
+    from mpi4py import MPI
+except ImportError:
+    MPI = None
 
 
-__all__ = ['relax_and_split', 'GPMO']
+__all__ = ['relax_and_split', 'GPMO', 'GPMO_mpi', 'GPMO_baseline_mpi']
 
 
 def prox_l0(m: RealArray,
@@ -115,6 +121,17 @@ def setup_initial_condition(pm_opt, m0=None):
         pm_opt.m0 = m0
 
 
+def _write_checkpoint(checkpoint_file, **arrays):
+    """
+    Writes arrays to the .npz file checkpoint_file. The file is written to a
+    temporary file first, so that a run killed while writing leaves the
+    previous checkpoint intact.
+    """
+    with open(checkpoint_file + '.tmp', 'wb') as f:
+        np.savez(f, **arrays)
+    os.replace(checkpoint_file + '.tmp', checkpoint_file)
+
+
 def relax_and_split(pm_opt, m0=None, **kwargs):
     """
     Uses a relax-and-split algorithm for solving the permanent
@@ -165,6 +182,16 @@ def relax_and_split(pm_opt, m0=None, **kwargs):
                 called, and the number of times a prox is computed.
             verbose:
                 Prints out all the loss term errors separately.
+            checkpoint_file:
+                Name of a .npz file. If given, the state of the algorithm is
+                written to this file after every relax-and-split iteration,
+                or every 'checkpoint_every' MwPGP iterations if there is no
+                nonconvex term. If the file already exists, the run resumes
+                from it, so a run that was killed can be restarted with the
+                same arguments.
+            checkpoint_every:
+                Number of MwPGP iterations between checkpoints if there is no
+                nonconvex term, defaults to max_iter.
 
     Returns:
         A tuple of optimization loss, solution at each step, and sparse solution.
@@ -205,6 +232,15 @@ def relax_and_split(pm_opt, m0=None, **kwargs):
     reg_l1 = kwargs.pop("reg_l1", 0.0)
     max_iter_RS = kwargs.pop('max_iter_RS', 1)
     epsilon_RS = kwargs.pop('epsilon_RS', 1e-3)
+    checkpoint_file = kwargs.pop('checkpoint_file', None)
+    checkpoint_every = kwargs.pop('checkpoint_every', None)
+    checkpoint = None
+    if checkpoint_file is not None and os.path.exists(checkpoint_file):
+        checkpoint = dict(np.load(checkpoint_file))
+        if checkpoint["m"].shape != (pm_opt.ndipoles * 3,):
+            raise ValueError(f'{checkpoint_file} is not a checkpoint of a '
+                             'relax_and_split run on this grid.')
+        print(f'Resuming relax_and_split from {checkpoint_file} after {int(checkpoint["i"])} iterations.')
 
     if (not np.isclose(reg_l0, 0.0, atol=1e-16)) and (not np.isclose(reg_l1, 0.0, atol=1e-16)):
         raise ValueError(' L0 and L1 loss terms cannot be used concurrently.')
@@ -230,7 +266,14 @@ def relax_and_split(pm_opt, m0=None, **kwargs):
     if reg_rs > 0.0:
         # Relax-and-split algorithm
         m = pm_opt.m0
-        for i in range(max_iter_RS):
+        i_start = 0
+        if checkpoint is not None:
+            m, m_proxy = checkpoint["m"], checkpoint["m_proxy"]
+            i_start = int(checkpoint["i"])
+            errors = list(checkpoint["errors"])
+            m_history = list(checkpoint["m_history"])
+            m_proxy_history = list(checkpoint["m_proxy_history"])
+        for i in range(i_start, max_iter_RS):
             # update m with the CONVEX part of the algorithm
             algorithm_history, _, _, m = convex_step(
                 A_obj=pm_opt.A_obj,
@@ -249,22 +292,57 @@ def relax_and_split(pm_opt, m0=None, **kwargs):
             # Solve the nonconvex optimization -- i.e. take a prox
             m_proxy = prox(m, mmax, reg_rs, nu)
             m_proxy_history.append(m_proxy)
-            if np.linalg.norm(m - m_proxy) < epsilon_RS:
+            converged = np.linalg.norm(m - m_proxy) < epsilon_RS
+            if checkpoint_file is not None:
+                # a converged run is stored as finished
+                _write_checkpoint(checkpoint_file, m=m, m_proxy=m_proxy,
+                                  i=max_iter_RS if converged else i + 1,
+                                  errors=np.array(errors), m_history=np.array(m_history),
+                                  m_proxy_history=np.array(m_proxy_history))
+            if converged:
                 print('Relax-and-split finished early, at iteration ', i)
                 break
     else:
         m0 = np.ascontiguousarray(m0.reshape(pm_opt.ndipoles, 3))
         # no nonconvex terms being used, so just need one round of the
         # convex algorithm called MwPGP
-        algorithm_history, _, m_history, m = convex_step(
-            A_obj=pm_opt.A_obj,
-            b_obj=pm_opt.b_obj,
-            ATb=ATb,
-            m_proxy=m0,
-            m0=m0,
-            m_maxima=mmax,
-            **kwargs
-        )
+        if checkpoint_file is None:
+            algorithm_history, _, m_history, m = convex_step(
+                A_obj=pm_opt.A_obj,
+                b_obj=pm_opt.b_obj,
+                ATb=ATb,
+                m_proxy=m0,
+                m0=m0,
+                m_maxima=mmax,
+                **kwargs
+            )
+        else:
+            # run MwPGP in chunks of checkpoint_every iterations, each
+            # continuing from the solution of the previous chunk
+            max_iter = kwargs.pop('max_iter', 500)
+            if checkpoint_every is None:
+                checkpoint_every = max_iter
+            m_proxy, m, i_done = m0, m0, 0
+            if checkpoint is not None:
+                m_proxy = np.ascontiguousarray(checkpoint["m_proxy"].reshape(pm_opt.ndipoles, 3))
+                m = np.ascontiguousarray(checkpoint["m"].reshape(pm_opt.ndipoles, 3))
+                m_history = checkpoint["m_history"]
+                i_done = int(checkpoint["i"])
+            while i_done < max_iter:
+                max_iter_chunk = min(checkpoint_every, max_iter - i_done)
+                algorithm_history, _, m_history, m = convex_step(
+                    A_obj=pm_opt.A_obj,
+                    b_obj=pm_opt.b_obj,
+                    ATb=ATb,
+                    m_proxy=m_proxy,
+                    m0=np.ascontiguousarray(m),
+                    m_maxima=mmax,
+                    max_iter=max_iter_chunk,
+                    **kwargs
+                )
+                i_done += max_iter_chunk
+                _write_checkpoint(checkpoint_file, m=np.ravel(m), m_proxy=np.ravel(m_proxy), i=i_done,
+                                  m_history=m_history)
         m = np.ravel(m)
         m_proxy = m
 
@@ -274,6 +352,90 @@ def relax_and_split(pm_opt, m0=None, **kwargs):
     return errors, m_history, m_proxy_history
 
 
+def _gpmo_connectivity(pm_opt, dipole_grid_xyz, Nadjacent):
+    """
+    Neighbours of every dipole for the backtracking variants of GPMO. They only
+    depend on the dipole grid, so they are stored in pm_opt and reused as long
+    as the grid does not change and enough neighbours were computed.
+    """
+    cached = getattr(pm_opt, '_connectivity', None)
+    if cached is not None and cached[1].shape[1] >= Nadjacent and np.array_equal(cached[0], dipole_grid_xyz):
+        return cached[1]
+    dipole_grid_xyz = np.ascontiguousarray(dipole_grid_xyz, dtype=np.float64)
+    connectivity = sopp.connectivity_matrix(dipole_grid_xyz, Nadjacent, Nadjacent)
+    pm_opt._connectivity = (dipole_grid_xyz.copy(), connectivity)
+    return connectivity
+
+
+def _gpmo_checkpointed(run, pm_opt, algorithm, kwargs, checkpoint_file, checkpoint_every):
+    """
+    Runs a GPMO variant in chunks of checkpoint_every iterations, where every
+    chunk continues from the solution of the previous one, and writes the
+    solution, the number of iterations done and the histories to the .npz
+    file checkpoint_file after every chunk. If checkpoint_file exists, the run
+    resumes from it instead of starting from scratch.
+    """
+    if algorithm == 'ArbVec':
+        raise ValueError('The ArbVec algorithm does not support checkpoints, '
+                         'use ArbVec_backtracking instead.')
+    K = kwargs.pop("K", 1000)
+    nhistory = kwargs.pop("nhistory", 100)
+    x = kwargs.pop("x_init", None)
+    if checkpoint_every is None:
+        checkpoint_every = K
+    if checkpoint_every < 1:
+        raise ValueError('checkpoint_every needs to be positive.')
+    k_done = 0
+    # algorithm_history, Bn_history, m_history and num_nonzeros of all chunks
+    histories = ([], [], [], [])
+    if os.path.exists(checkpoint_file):
+        with np.load(checkpoint_file) as data:
+            if str(data["algorithm"]) != algorithm or data["x"].shape != (pm_opt.ndipoles, 3):
+                raise ValueError(f'{checkpoint_file} is not a checkpoint of a GPMO '
+                                 f'{algorithm} run on this grid.')
+            x = data["x"]
+            k_done = int(data["k"])
+            for h, key in zip(histories, ["algorithm_history", "Bn_history", "m_history", "num_nonzeros"]):
+                h.append(data[key])
+        print(f'Resuming GPMO from {checkpoint_file} after {k_done} iterations.')
+    else:
+        histories[2].append(np.zeros((pm_opt.ndipoles, 3, 0)))
+
+    while k_done < K:
+        K_chunk = min(checkpoint_every, K - k_done)
+        kw = dict(kwargs, K=K_chunk, nhistory=max(1, min(K_chunk, (nhistory * K_chunk) // K)))
+        if x is not None:
+            kw["x_init"] = np.ascontiguousarray(x)
+        algorithm_history, Bn_history, m_history, num_nonzeros, x = run(**kw)
+        recorded = algorithm_history != 0
+        histories[0].append(algorithm_history[recorded])
+        histories[1].append(Bn_history[recorded])
+        histories[2].append(m_history[:, :, recorded])
+        if num_nonzeros is not None:
+            histories[3].append(num_nonzeros[num_nonzeros != 0])
+        k_done += K_chunk
+
+        _write_checkpoint(checkpoint_file, algorithm=algorithm, x=x, k=k_done,
+                          algorithm_history=np.concatenate(histories[0]),
+                          Bn_history=np.concatenate(histories[1]),
+                          m_history=np.concatenate(histories[2], axis=-1),
+                          num_nonzeros=np.concatenate(histories[3] or [np.zeros(0)]))
+
+        # the backtracking variants stop once enough magnets are placed
+        if algorithm in ['backtracking', 'ArbVec_backtracking']:
+            num_nonzero = np.count_nonzero(np.any(x != 0, axis=-1))
+            if num_nonzero >= min(kwargs["max_nMagnets"], pm_opt.ndipoles):
+                break
+
+    if x is None:
+        x = np.zeros((pm_opt.ndipoles, 3))
+    return (np.concatenate(histories[0] or [np.zeros(0)]),
+            np.concatenate(histories[1] or [np.zeros(0)]),
+            np.concatenate(histories[2], axis=-1),
+            np.concatenate(histories[3]) if histories[3] else None,
+            x)
+
+
 def GPMO(pm_opt, algorithm='baseline', **kwargs):
     r"""
     GPMO is a greedy algorithm for the permanent magnet optimization problem.
@@ -347,6 +509,36 @@ def GPMO(pm_opt, algorithm='baseline', **kwargs):
             verbose: bool.
                 If True, print out the algorithm progress every 'nhistory'
                 iterations. Also needed to record the algorithm history.
+            incremental: bool.
+                If True, the least-squares term of every candidate dipole is
+                updated incrementally from the inner products of the columns of
+                A with the residual, instead of being recomputed from scratch in
+                every iteration. Gives the same results up to round-off and is
+                faster when many magnets are placed. Keyword argument only for
+                'baseline', 'multi', and 'backtracking'. Always used if the
+                grid was set up with matrix_free=True.
+            connectivity: 2D numpy array, shape (ndipoles, n) with n >= Nadjacent.
+                Indices of the closest dipoles to every dipole, as returned by
+                ``simsoptpp.connectivity_matrix``. Only a keyword argument for
+                'backtracking' and 'ArbVec_backtracking'. If not given, it is
+                computed once and stored in pm_opt, so that subsequent calls
+                on the same grid reuse it.
+            m_init: 2D numpy array, shape (ndipoles, 3).
+                Solution to continue from, e.g. pm_opt.m of a previous run
+                reshaped to (ndipoles, 3). Not a keyword argument for 'ArbVec'.
+            checkpoint_file: string.
+                Name of a .npz file. If given, the algorithm runs in chunks of
+                'checkpoint_every' iterations, each continuing from the
+                solution of the previous chunk, and the solution, the number
+                of iterations done and the histories are written to this file
+                after every chunk. If the file already exists, the run resumes
+                from it, so a run that was killed can be restarted with the
+                same arguments. For 'baseline' and 'multi', the same magnets are
+                placed as without checkpoints. For the backtracking variants,
+                the backtracking schedule restarts at every chunk. Not a
+                keyword argument for 'ArbVec'.
+            checkpoint_every: integer.
+                Number of iterations between checkpoints, defaults to K.
 
     Returns:
         Tuple of (errors, Bn_errors, m_history)
@@ -374,11 +566,27 @@ def GPMO(pm_opt, algorithm='baseline', **kwargs):
     mmax = pm_opt.m_maxima
     contig = np.ascontiguousarray
     mmax_vec = contig(np.array([mmax, mmax, mmax]).T.reshape(pm_opt.ndipoles * 3))
-    A_obj = pm_opt.A_obj * mmax_vec
+    if getattr(pm_opt, "A_obj_gpmo", None) is not None:
+        # already scaled and transposed, see PermanentMagnetGrid.write_A_obj
+        A_gpmo = pm_opt.A_obj_gpmo
+    elif isinstance(pm_opt.A_obj, sopp.DipoleFieldOperator):
+        if algorithm in ['ArbVec', 'ArbVec_backtracking']:
+            raise ValueError('The ArbVec algorithms need a dense A_obj, '
+                             'not a matrix-free one.')
+        # the operator is not transposed for the C++ code
+        A_gpmo = pm_opt.A_obj.scale_columns(mmax_vec)
+    else:
+        # keep the precision A_obj is stored in, see PermanentMagnetGrid.convert_A_obj
+        A_obj = pm_opt.A_obj * mmax_vec.astype(pm_opt.A_obj.dtype, copy=False)
+        # change to row-major order of the transpose for the C++ code
+        A_gpmo = contig(A_obj.T)
 
     if (algorithm != 'baseline' and algorithm != 'mutual_coherence' and algorithm != 'ArbVec') and 'dipole_grid_xyz' not in kwargs:
         raise ValueError('GPMO variants require dipole_grid_xyz to be defined.')
 
+    if algorithm in ['backtracking', 'ArbVec_backtracking'] and 'connectivity' not in kwargs:
+        kwargs['connectivity'] = _gpmo_connectivity(pm_opt, kwargs['dipole_grid_xyz'], kwargs.get('Nadjacent', 7))
+
     # Set the L2 regularization if it is included in the kwargs 
     reg_l2 = kwargs.pop("reg_l2", 0.0)
 
@@ -397,79 +605,95 @@ def GPMO(pm_opt, algorithm='baseline', **kwargs):
 
     Nnorms = contig(np.ravel(np.sqrt(np.sum(pm_opt.plasma_boundary.normal() ** 2, axis=-1))))
 
-    # Note, only baseline method has the f_m loss term implemented! 
-    if algorithm == 'baseline':  # GPMO
-        algorithm_history, Bn_history, m_history, m = sopp.GPMO_baseline(
-            A_obj=contig(A_obj.T),
-            b_obj=contig(pm_opt.b_obj),
-            mmax=np.sqrt(reg_l2)*mmax_vec,
-            normal_norms=Nnorms,
-            **kwargs
-        )
-    elif algorithm == 'ArbVec':  # GPMO with arbitrary polarization vectors
-        algorithm_history, Bn_history, m_history, m = sopp.GPMO_ArbVec(
-            A_obj=contig(A_obj.T),
-            b_obj=contig(pm_opt.b_obj),
-            mmax=np.sqrt(reg_l2)*mmax_vec,
-            normal_norms=Nnorms,
-            pol_vectors=contig(pm_opt.pol_vectors),
-            **kwargs
-        )
-    elif algorithm == 'backtracking':  # GPMOb
-        algorithm_history, Bn_history, m_history, num_nonzeros, m = sopp.GPMO_backtracking(
-            A_obj=contig(A_obj.T),
-            b_obj=contig(pm_opt.b_obj),
-            mmax=np.sqrt(reg_l2)*mmax_vec,
-            normal_norms=Nnorms,
-            **kwargs
-        )
-        pm_opt.num_nonzeros = num_nonzeros[num_nonzeros != 0]
-    elif algorithm == 'ArbVec_backtracking':  # GPMOb with arbitrary vectors
+    checkpoint_file = kwargs.pop("checkpoint_file", None)
+    checkpoint_every = kwargs.pop("checkpoint_every", None)
+    if algorithm == 'ArbVec_backtracking':
         if pm_opt.coordinate_flag != 'cartesian':
             raise ValueError('ArbVec_backtracking algorithm currently '
                              'only supports dipole grids with \n'
                              'moment vectors in the Cartesian basis.')
-        nGridPoints = int(A_obj.shape[1]/3)
-        if "m_init" in kwargs.keys():
-            if kwargs["m_init"].shape[0] != nGridPoints:
-                raise ValueError('Initialization vector `m_init` must have '
-                                 'as many rows as there are dipoles in the '
-                                 'grid')
-            elif kwargs["m_init"].shape[1] != 3:
-                raise ValueError('Initialization vector `m_init` must have '
-                                 'three columns')
-            kwargs["x_init"] = contig(kwargs["m_init"] \
-                                      / (mmax_vec.reshape(pm_opt.ndipoles, 3)))
-            kwargs.pop("m_init")
+    if "m_init" in kwargs.keys():
+        if algorithm == 'ArbVec':
+            raise ValueError('The ArbVec algorithm cannot be initialized with `m_init`.')
+        if kwargs["m_init"].shape[0] != pm_opt.ndipoles:
+            raise ValueError('Initialization vector `m_init` must have '
+                             'as many rows as there are dipoles in the '
+                             'grid')
+        elif kwargs["m_init"].shape[1] != 3:
+            raise ValueError('Initialization vector `m_init` must have '
+                             'three columns')
+        x_init = kwargs.pop("m_init") / mmax_vec.reshape(pm_opt.ndipoles, 3)
+        if algorithm != 'ArbVec_backtracking':
+            # the other variants only place binary magnets
+            x_init = np.rint(x_init)
+        kwargs["x_init"] = contig(x_init)
+    elif algorithm == 'ArbVec_backtracking':
+        kwargs["x_init"] = contig(np.zeros((pm_opt.ndipoles, 3)))
+
+    def run(**kw):
+        """ Run the GPMO variant, returns the histories, num_nonzeros and m. """
+        num_nonzeros = None
+        # Note, only baseline method has the f_m loss term implemented! 
+        if algorithm == 'baseline':  # GPMO
+            algorithm_history, Bn_history, m_history, m = sopp.GPMO_baseline(
+                A_obj=A_gpmo,
+                b_obj=contig(pm_opt.b_obj),
+                mmax=np.sqrt(reg_l2)*mmax_vec,
+                normal_norms=Nnorms,
+                **kw
+            )
+        elif algorithm == 'ArbVec':  # GPMO with arbitrary polarization vectors
+            algorithm_history, Bn_history, m_history, m = sopp.GPMO_ArbVec(
+                A_obj=A_gpmo,
+                b_obj=contig(pm_opt.b_obj),
+                mmax=np.sqrt(reg_l2)*mmax_vec,
+                normal_norms=Nnorms,
+                pol_vectors=contig(pm_opt.pol_vectors),
+                **kw
+            )
+        elif algorithm == 'backtracking':  # GPMOb
+            algorithm_history, Bn_history, m_history, num_nonzeros, m = sopp.GPMO_backtracking(
+                A_obj=A_gpmo,
+                b_obj=contig(pm_opt.b_obj),
+                mmax=np.sqrt(reg_l2)*mmax_vec,
+                normal_norms=Nnorms,
+                **kw
+            )
+        elif algorithm == 'ArbVec_backtracking':  # GPMOb with arbitrary vectors
+            algorithm_history, Bn_history, m_history, num_nonzeros, m = sopp.GPMO_ArbVec_backtracking(
+                A_obj=A_gpmo,
+                b_obj=contig(pm_opt.b_obj),
+                mmax=np.sqrt(reg_l2)*mmax_vec,
+                normal_norms=Nnorms,
+                pol_vectors=contig(pm_opt.pol_vectors),
+                **kw
+            )
+        elif algorithm == 'multi':  # GPMOm
+            algorithm_history, Bn_history, m_history, m = sopp.GPMO_multi(
+                A_obj=A_gpmo,
+                b_obj=contig(pm_opt.b_obj),
+                mmax=np.sqrt(reg_l2)*mmax_vec,
+                normal_norms=Nnorms,
+                **kw
+            )
         else:
-            kwargs["x_init"] = contig(np.zeros((nGridPoints, 3)))
-        algorithm_history, Bn_history, m_history, num_nonzeros, m = sopp.GPMO_ArbVec_backtracking(
-            A_obj=contig(A_obj.T),
-            b_obj=contig(pm_opt.b_obj),
-            mmax=np.sqrt(reg_l2)*mmax_vec,
-            normal_norms=Nnorms,
-            pol_vectors=contig(pm_opt.pol_vectors),
-            **kwargs
-        )
-    elif algorithm == 'multi':  # GPMOm
-        algorithm_history, Bn_history, m_history, m = sopp.GPMO_multi(
-            A_obj=contig(A_obj.T),
-            b_obj=contig(pm_opt.b_obj),
-            mmax=np.sqrt(reg_l2)*mmax_vec,
-            normal_norms=Nnorms,
-            **kwargs
-        )
+            raise NotImplementedError('Requested algorithm variant is incorrect or not yet implemented')
+        # rescale the m that have been saved every Nhistory iterations
+        m_history = m_history * mmax_vec.reshape(pm_opt.ndipoles, 3)[:, :, None]
+        return algorithm_history, Bn_history, m_history, num_nonzeros, m
+
+    if checkpoint_file is None:
+        algorithm_history, Bn_history, m_history, num_nonzeros, m = run(**kwargs)
     else:
-        raise NotImplementedError('Requested algorithm variant is incorrect or not yet implemented')
+        algorithm_history, Bn_history, m_history, num_nonzeros, m = _gpmo_checkpointed(
+            run, pm_opt, algorithm, kwargs, checkpoint_file, checkpoint_every)
+    if num_nonzeros is not None and algorithm == 'backtracking':
+        pm_opt.num_nonzeros = num_nonzeros[num_nonzeros != 0]
 
-    # rescale m and m_history
+    # rescale m
     m = m * (mmax_vec.reshape(pm_opt.ndipoles, 3))
     print('Number of binary dipoles returned by GPMO algorithm = ',
           np.count_nonzero(np.sum(m, axis=-1)))
-
-    # rescale the m that have been saved every Nhistory iterations
-    for i in range(m_history.shape[-1]):
-        m_history[:, :, i] = m_history[:, :, i] * (mmax_vec.reshape(pm_opt.ndipoles, 3))
     errors = algorithm_history[algorithm_history != 0]
     Bn_errors = Bn_history[Bn_history != 0]
 
@@ -477,3 +701,174 @@ def GPMO(pm_opt, algorithm='baseline', **kwargs):
     pm_opt.m = np.ravel(m)
     pm_opt.m_proxy = pm_opt.m
     return errors, Bn_errors, m_history
+
+
+def _mpi_dipole_range(ndipoles, comm):
+    """
+    Contiguous range of dipoles owned by every rank of comm, as in
+    np.array_split.
+    """
+    counts = np.full(comm.size, ndipoles // comm.size)
+    counts[:ndipoles % comm.size] += 1
+    starts = np.concatenate(([0], np.cumsum(counts)))
+    return starts[comm.rank], starts[comm.rank + 1]
+
+
+@SimsoptRequires(MPI is not None, "GPMO_baseline_mpi requires the mpi4py package.")
+def GPMO_baseline_mpi(A_local, b_obj, mmax_local, normal_norms, comm=None,
+                      K=1000, nhistory=100, verbose=False, single_direction=-1):
+    r"""
+    Distributed version of ``sopp.GPMO_baseline``. The dipoles are split into
+    contiguous ranges over the ranks of comm, and every rank only holds the
+    rows of the (transposed, scaled) GPMO matrix for its own dipoles. In every
+    iteration each rank scans its own candidates, the best candidate is found
+    by a global reduction, and only the row of the chosen dipole component
+    is broadcast from its owner to update the residual on all ranks.
+
+    The change of the least-squares term of a candidate row :math:`A_j` is
+    computed as :math:`\pm 2 A_j \cdot r + \|A_j\|^2` from the residual
+    :math:`r`, as in the incremental engine of the serial algorithms, so the
+    same dipoles are chosen up to round-off.
+
+    Args:
+        A_local: 2D numpy array, shape (3 * ndipoles_local, ngrid). Rows
+            3 * start, ..., 3 * end - 1 of the matrix that GPMO_baseline
+            takes, where [start, end) is the range of dipoles of this rank.
+            The ranges of the ranks need to be contiguous and in the order
+            of the ranks, e.g. as in np.array_split.
+        b_obj: 1D numpy array, shape (ngrid,). The same on all ranks.
+        mmax_local: 1D numpy array, shape (3 * ndipoles_local,). The L2
+            regularization of the dipole components of this rank.
+        normal_norms: 1D numpy array, shape (ngrid,). The same on all ranks.
+        comm: MPI communicator, defaults to MPI.COMM_WORLD.
+        K, nhistory, verbose, single_direction: See ``GPMO``.
+
+    Returns:
+        Tuple of (objective_history, Bn_history, m_history, x), as returned by
+        ``sopp.GPMO_baseline``. x, of shape (ndipoles, 3), is returned on all
+        ranks. The histories are gathered on rank 0, and are None on all
+        other ranks.
+    """
+    if comm is None:
+        comm = MPI.COMM_WORLD
+    A_local = np.ascontiguousarray(A_local)
+    b_obj = np.asarray(b_obj, dtype=np.float64)
+    N3_local, ngrid = A_local.shape
+    N_local = N3_local // 3
+    counts = comm.allgather(N_local)
+    offset = int(np.sum(counts[:comm.rank]))
+    N3 = 3 * int(np.sum(counts))
+
+    x = np.zeros((N_local, 3))
+    m_history = np.zeros((N_local, 3, nhistory + 1))
+    objective_history = np.zeros(nhistory + 1)
+    Bn_history = np.zeros(nhistory + 1)
+    print_iter = 0
+    if verbose and comm.rank == 0:
+        print("Iteration ... |Am - b|^2 ... lam*|m|^2")
+
+    # candidates that are not available (placed dipoles, other directions)
+    # are marked with an infinite cost
+    available = np.ones(N3_local, dtype=bool)
+    if single_direction >= 0:
+        available[:] = False
+        available[single_direction::3] = True
+    norms = np.einsum('ij,ij->i', A_local, A_local, dtype=np.float64)
+    mmax2 = np.asarray(mmax_local, dtype=np.float64) ** 2
+    r = -b_obj
+    row = np.empty(ngrid)
+    for k in range(K):
+        g = A_local @ r
+        R2s = np.concatenate((norms + 2 * g, norms - 2 * g)) + np.concatenate((mmax2, mmax2))
+        R2s[np.concatenate((~available, ~available))] = np.inf
+        if N3_local > 0:
+            j = int(np.argmin(R2s))
+            # global index of the candidate, as in the serial code, where all
+            # + candidates come before all - candidates
+            sign_j = 1 if j < N3_local else -1
+            jj = j % N3_local
+            candidate = (R2s[j], (0 if sign_j > 0 else N3) + 3 * offset + jj, comm.rank, jj, sign_j)
+        else:
+            candidate = (np.inf, np.inf, comm.rank, 0, 0)
+        best = min(comm.allgather(candidate))
+        if not np.isfinite(best[0]):
+            break
+        _, _, owner, jj, sign_j = best
+        if comm.rank == owner:
+            row[:] = A_local[jj]
+            x[jj // 3, jj % 3] = sign_j
+            available[3 * (jj // 3):3 * (jj // 3) + 3] = False
+        comm.Bcast(row, root=owner)
+        r = r + sign_j * row
+
+        if verbose and ((k % int(K / nhistory)) == 0 or k == 0 or k == K - 1):
+            R2 = 0.5 * np.sum(r * r)
+            objective_history[print_iter] = R2
+            Bn_history[print_iter] = np.sum(np.abs(r) * np.sqrt(normal_norms)) / np.sqrt(ngrid)
+            m_history[:, :, print_iter] = x
+            if comm.rank == 0:
+                print(f"{k} ... {R2:.2e} ... {0.0:.2e} ")
+            print_iter += 1
+
+    x = np.concatenate(comm.allgather(x))
+    m_history = comm.gather(m_history, root=0)
+    if comm.rank != 0:
+        return None, None, None, x
+    return objective_history, Bn_history, np.concatenate(m_history), x
+
+
+@SimsoptRequires(MPI is not None, "GPMO_mpi requires the mpi4py package.")
+def GPMO_mpi(pm_opt, comm=None, **kwargs):
+    """
+    Distributed version of ``GPMO(pm_opt, algorithm='baseline')`` for grids
+    whose GPMO matrix does not fit into the memory of a single node, see
+    ``GPMO_baseline_mpi``. Every rank only forms the rows of the matrix for
+    its own range of dipoles: from the matrix written by
+    ``pm_opt.write_A_obj(filename, gpmo=True)`` if it was loaded, from the
+    matrix-free operator if the grid was set up with ``matrix_free=True``,
+    and from the dense A_obj otherwise.
+
+    Args:
+        pm_opt: The permanent magnet grid, set up in the same way on all ranks.
+        comm: MPI communicator, defaults to MPI.COMM_WORLD.
+        kwargs: K, nhistory, verbose, single_direction and reg_l2, as in
+            ``GPMO``.
+
+    Returns:
+        Tuple of (errors, Bn_errors, m_history) as returned by ``GPMO`` on
+        rank 0, and (None, None, None) on all other ranks. pm_opt.m is set
+        on all ranks.
+    """
+    if not hasattr(pm_opt, "A_obj"):
+        raise ValueError("The PermanentMagnetClass needs to use geo_setup() or "
+                         "geo_setup_from_famus() before calling optimization routines.")
+    if comm is None:
+        comm = MPI.COMM_WORLD
+    reg_l2 = kwargs.pop("reg_l2", 0.0)
+    start, end = _mpi_dipole_range(pm_opt.ndipoles, comm)
+    mmax_vec = np.repeat(pm_opt.m_maxima, 3)
+    local = slice(3 * start, 3 * end)
+    if getattr(pm_opt, "A_obj_gpmo", None) is not None:
+        # only the rows of this rank are read from the memory map
+        A_local = np.array(pm_opt.A_obj_gpmo[local])
+    elif isinstance(pm_opt.A_obj, sopp.DipoleFieldOperator):
+        A_local = np.empty((3 * (end - start), pm_opt.A_obj.shape[0]))
+        pm_opt.A_obj.scale_columns(mmax_vec).dense_columns(3 * start, A_local)
+    else:
+        A_local = np.ascontiguousarray((pm_opt.A_obj[:, local] * mmax_vec[local].astype(pm_opt.A_obj.dtype, copy=False)).T)
+    Nnorms = np.ascontiguousarray(np.ravel(np.sqrt(np.sum(pm_opt.plasma_boundary.normal() ** 2, axis=-1))))
+    algorithm_history, Bn_history, m_history, m = GPMO_baseline_mpi(
+        A_local, np.ascontiguousarray(pm_opt.b_obj), np.sqrt(reg_l2) * mmax_vec[local],
+        Nnorms, comm=comm, **kwargs
+    )
+    m = m * mmax_vec.reshape(pm_opt.ndipoles, 3)
+    pm_opt.m = np.ravel(m)
+    pm_opt.m_proxy = pm_opt.m
+    if comm.rank != 0:
+        return None, None, None
+    print('Number of binary dipoles returned by GPMO algorithm = ',
+          np.count_nonzero(np.sum(m, axis=-1)))
+    m_history = m_history * mmax_vec.reshape(pm_opt.ndipoles, 3)[:, :, None]
+    errors = algorithm_history[algorithm_history != 0]
+    Bn_errors = Bn_history[Bn_history != 0]
+    return errors, Bn_errors, m_history
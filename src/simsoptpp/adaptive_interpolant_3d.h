@@ -0,0 +1,119 @@
+#pragma once
+#include "regular_grid_interpolant_3d.h"
+
+template<class Array>
+class AdaptiveInterpolant3D : public Interpolant3D<Array> {
+    /* This class implements a vector-valued piecewise polynomial interpolant
+     * on an adaptively refined mesh in three dimensions.
+     *
+     * The mesh starts from the same regular nx x ny x nz grid of cells as
+     * RegularGridInterpolant3D, but then each cell is the root of an octree:
+     * after interpolating f on a cell, the interpolant is compared with f at
+     * a few test points between the interpolation nodes, and if the error is
+     * larger than tol times the largest value of |f| on the initial grid,
+     * the cell is split into eight children of half the size. This is
+     * repeated up to max_depth times. Every leaf carries its own
+     * (degree+1)^3 values, hence regions in which f is smooth are covered by
+     * few large cells, and the dofs are spent near e.g. coils where the field
+     * varies rapidly. Neighbouring leaves of different size do not share
+     * nodes, so the interpolant is discontinuous across those faces, by at
+     * most the local interpolation error.
+     *
+     * Cells are skipped exactly as for the regular grid: a cell (at any
+     * level) is ignored if the skip function returns true on all of its
+     * eight corners.
+     */
+    private:
+        const int nx, ny, nz;  // number of root cells in x, y, and z direction
+        double hx, hy, hz; // size of the root cells in x, y, and z direction
+        const double xmin, ymin, zmin; // lower bounds of the x, y, and z coordinates
+        const double xmax, ymax, zmax; // upper bounds of the x, y, and z coordinates
+        const int value_size; // number of output dimensions of the interpolant
+        const InterpolationRule rule; // the interpolation rule to use on each cell
+        const bool out_of_bounds_ok; // whether to do nothing or throw an error when the interpolant is queried at an out-of-bounds point
+        const double tol; // relative tolerance for the error estimate on each cell
+        const int max_depth; // maximum number of times a root cell is split
+        std::function<std::vector<bool>(Vec, Vec, Vec)> skip;
+
+        // the octree: the first nx*ny*nz nodes are the root cells, ordered as
+        // in RegularGridInterpolant3D. children[node] is the index of the
+        // first of the eight children of an internal node, ordered by
+        // 4*(x >= 1/2) + 2*(y >= 1/2) + (z >= 1/2), and -1 for leaves.
+        std::vector<int32_t> children;
+        // the position of the values of each leaf in all_local_vals, -1 for
+        // skipped leaves. empty until the interpolant is built
+        std::vector<int32_t> node_to_local;
+        // the values at the dofs of all leaves that are kept, local_vals_size
+        // values per leaf
+        AlignedPaddedVec all_local_vals;
+        int leaves_to_keep = 0;
+        int depth_reached = 0;
+
+        #if defined(USE_XSIMD)
+        static const int simdcount = xsimd::simd_type<double>::size; // vector width for simd instructions
+        #else
+        static const int simdcount = 1; // vector width is set to 1 for non-xsimd code
+        #endif
+        int padded_value_size; // smallest multiple of simdcount that is larger than value_size
+        int local_vals_size;
+
+        inline int idx_cell(int i, int j, int k){
+            return i*ny*nz + j*nz + k;
+        }
+
+        inline int idx_dof_local(int i, int j, int k){
+            int degree = rule.degree;
+            return i*(degree+1)*(degree+1) + j*(degree+1) + k;
+        }
+
+        // returns the values of the leaf containing (x, y, z) and writes the
+        // coordinates of the point relative to the leaf, scaled to [0, 1], to
+        // local. Returns nullptr for points outside of the grid or in skipped
+        // leaves if out_of_bounds_ok is true, and throws otherwise.
+        const double* locate(double x, double y, double z, double* local);
+
+    public:
+        AdaptiveInterpolant3D(InterpolationRule rule, RangeTriplet xrange, RangeTriplet yrange, RangeTriplet zrange, int value_size, bool out_of_bounds_ok, double tol, int max_depth, std::function<std::vector<bool>(Vec, Vec, Vec)> skip) :
+            rule(rule),
+            xmin(std::get<0>(xrange)), xmax(std::get<1>(xrange)), nx(std::get<2>(xrange)),
+            ymin(std::get<0>(yrange)), ymax(std::get<1>(yrange)), ny(std::get<2>(yrange)),
+            zmin(std::get<0>(zrange)), zmax(std::get<1>(zrange)), nz(std::get<2>(zrange)),
+            value_size(value_size), out_of_bounds_ok(out_of_bounds_ok), tol(tol), max_depth(max_depth), skip(skip)
+        {
+            if(tol <= 0)
+                throw std::invalid_argument("tol has to be positive.");
+            if(max_depth < 0 || max_depth > 20)
+                throw std::invalid_argument("max_depth has to be in [0, 20].");
+            hx = (xmax-xmin)/nx;
+            hy = (ymax-ymin)/ny;
+            hz = (zmax-zmin)/nz;
+            // round up value_size to nearest multiple of simdcount
+            padded_value_size = (value_size % simdcount) ? (value_size + simdcount) - (value_size % simdcount) : value_size;
+            local_vals_size = (rule.degree+1)*(rule.degree+1)*(rule.degree+1)*padded_value_size;
+        }
+        AdaptiveInterpolant3D(InterpolationRule rule, RangeTriplet xrange, RangeTriplet yrange, RangeTriplet zrange, int value_size, bool out_of_bounds_ok, double tol, int max_depth) :
+            AdaptiveInterpolant3D(rule, xrange, yrange, zrange, value_size, out_of_bounds_ok, tol, max_depth, [](Vec x, Vec y, Vec z){ return std::vector<bool>(x.size(), false); })
+            {}
+
+        // build the interpolant, refining the mesh level by level. f is
+        // called once or a few times per level, for the nodes and test
+        // points of all cells on that level at once.
+        void interpolate_batch(std::function<Vec(Vec, Vec, Vec)> &f) override;
+
+        Vec evaluate(double x, double y, double z); // evaluate the interpolant at one location
+        // evaluate the interpolant at one location and write the value_size
+        // results to res, without allocating. res is left untouched in
+        // skipped cells if out_of_bounds_ok is true. This may be called
+        // concurrently from several threads.
+        void evaluate_inplace(double x, double y, double z, double* res) override;
+        void evaluate_batch(Array& xyz, Array& fxyz) override; // evaluate the interpolant at multiple locations
+
+        std::pair<double, double> estimate_error(std::function<Vec(Vec, Vec, Vec)> &f, int samples) override;
+
+        // number of leaves that are not skipped
+        int num_cells() const { return leaves_to_keep; }
+        // number of values stored per output dimension, i.e. num_cells()*(degree+1)^3
+        int num_dofs() const { return leaves_to_keep*(rule.degree+1)*(rule.degree+1)*(rule.degree+1); }
+        // the deepest level that was created during refinement
+        int depth() const { return depth_reached; }
+};
@@ -0,0 +1,247 @@
+#pragma once
+#include "adaptive_interpolant_3d.h"
+#include "regular_grid_interpolant_3d_impl.h"
+
+template<class Array>
+const int AdaptiveInterpolant3D<Array>::simdcount;
+
+template<class Array>
+void AdaptiveInterpolant3D<Array>::interpolate_batch(std::function<Vec(Vec, Vec, Vec)> &f) {
+    int degree = rule.degree;
+    int npoints_local = (degree+1)*(degree+1)*(degree+1);
+    // the error is estimated halfway between the first two and the last two
+    // nodes in each direction, where the Lagrange interpolant is least
+    // accurate
+    double tests[2] = {0.5*(rule.nodes[0]+rule.nodes[1]), 0.5*(rule.nodes[degree-1]+rule.nodes[degree])};
+    int ntests = 8;
+    int npoints_cell = npoints_local + ntests;
+
+    int ncells = nx*ny*nz;
+    children = std::vector<int32_t>(ncells, -1);
+    node_to_local = std::vector<int32_t>(ncells, -1);
+    all_local_vals = AlignedPaddedVec();
+    leaves_to_keep = 0;
+
+    // the cells on the current level of refinement, and their lower corners
+    std::vector<int32_t> level(ncells);
+    Vec x0(ncells), y0(ncells), z0(ncells);
+    for (int i = 0; i < nx; ++i) {
+        for (int j = 0; j < ny; ++j) {
+            for (int k = 0; k < nz; ++k) {
+                int idx = idx_cell(i, j, k);
+                level[idx] = idx;
+                x0[idx] = xmin + i*hx;
+                y0[idx] = ymin + j*hy;
+                z0[idx] = zmin + k*hz;
+            }
+        }
+    }
+
+    AlignedPaddedVec cell_vals(local_vals_size, 0.);
+    Vec fh(value_size, 0.);
+    double threshold = -1.;
+    for (int depth = 0; !level.empty(); ++depth) {
+        depth_reached = depth;
+        double scale = std::ldexp(1., -depth);
+        double cx = hx*scale, cy = hy*scale, cz = hz*scale;
+        int nlevel = level.size();
+
+        // as in RegularGridInterpolant3D, cells are skipped if all of their
+        // eight corners are outside the domain
+        Vec xs(8*nlevel), ys(8*nlevel), zs(8*nlevel);
+        for (int c = 0; c < nlevel; ++c) {
+            for (int corner = 0; corner < 8; ++corner) {
+                xs[8*c+corner] = x0[c] + ((corner >> 2) & 1)*cx;
+                ys[8*c+corner] = y0[c] + ((corner >> 1) & 1)*cy;
+                zs[8*c+corner] = z0[c] + (corner & 1)*cz;
+            }
+        }
+        std::vector<bool> skip_corner = skip(xs, ys, zs);
+        std::vector<int> kept;
+        for (int c = 0; c < nlevel; ++c) {
+            bool skip_this_one = true;
+            for (int corner = 0; corner < 8; ++corner)
+                skip_this_one = skip_this_one && skip_corner[8*c+corner];
+            if(!skip_this_one)
+                kept.push_back(c);
+        }
+
+        // evaluate f at the nodes and test points of all kept cells on this
+        // level, in batches of the same size as for the regular grid
+        size_t npoints = size_t(kept.size())*npoints_cell;
+        xs = Vec(npoints);
+        ys = Vec(npoints);
+        zs = Vec(npoints);
+        for (size_t c = 0; c < kept.size(); ++c) {
+            size_t offset = c*npoints_cell;
+            int cell = kept[c];
+            for (int i = 0; i < degree+1; ++i) {
+                for (int j = 0; j < degree+1; ++j) {
+                    for (int k = 0; k < degree+1; ++k) {
+                        size_t idx = offset + idx_dof_local(i, j, k);
+                        xs[idx] = x0[cell] + rule.nodes[i]*cx;
+                        ys[idx] = y0[cell] + rule.nodes[j]*cy;
+                        zs[idx] = z0[cell] + rule.nodes[k]*cz;
+                    }
+                }
+            }
+            for (int t = 0; t < ntests; ++t) {
+                size_t idx = offset + npoints_local + t;
+                xs[idx] = x0[cell] + tests[(t >> 2) & 1]*cx;
+                ys[idx] = y0[cell] + tests[(t >> 1) & 1]*cy;
+                zs[idx] = z0[cell] + tests[t & 1]*cz;
+            }
+        }
+        Vec fxyz(npoints*value_size, 0.);
+        size_t BATCH_SIZE = 16384;
+        for (size_t first = 0; first < npoints; first += BATCH_SIZE) {
+            size_t last = std::min(first + BATCH_SIZE, npoints);
+            Vec xsub(xs.begin() + first, xs.begin() + last);
+            Vec ysub(ys.begin() + first, ys.begin() + last);
+            Vec zsub(zs.begin() + first, zs.begin() + last);
+            Vec fxyzsub = f(xsub, ysub, zsub);
+            std::copy(fxyzsub.begin(), fxyzsub.begin() + (last-first)*value_size, fxyz.begin() + first*value_size);
+        }
+
+        // the tolerance is relative to the largest value on the root cells
+        if(threshold < 0) {
+            double fmax = 0.;
+            for (size_t c = 0; c < kept.size(); ++c) {
+                for (int idx = 0; idx < npoints_local; ++idx) {
+                    const double* val = &fxyz[(c*npoints_cell + idx)*value_size];
+                    double norm = 0.;
+                    for (int l = 0; l < value_size; ++l)
+                        norm += val[l]*val[l];
+                    fmax = std::max(fmax, std::sqrt(norm));
+                }
+            }
+            threshold = tol*fmax;
+        }
+
+        std::vector<int32_t> next_level;
+        Vec next_x0, next_y0, next_z0;
+        for (size_t c = 0; c < kept.size(); ++c) {
+            const double* fcell = &fxyz[c*npoints_cell*value_size];
+            for (int idx = 0; idx < npoints_local; ++idx) {
+                for (int l = 0; l < value_size; ++l)
+                    cell_vals[idx*padded_value_size + l] = fcell[idx*value_size + l];
+            }
+            double err = 0.;
+            for (int t = 0; t < ntests; ++t) {
+                evaluate_lagrange_3d(rule, value_size, padded_value_size, tests[(t >> 2) & 1], tests[(t >> 1) & 1], tests[t & 1], cell_vals.data(), (const double*) nullptr, fh.data());
+                const double* ftest = fcell + (npoints_local + t)*value_size;
+                double diff = 0.;
+                for (int l = 0; l < value_size; ++l)
+                    diff += std::pow(ftest[l]-fh[l], 2);
+                err = std::max(err, std::sqrt(diff));
+            }
+            int cell = kept[c];
+            int32_t node = level[cell];
+            if(err > threshold && depth < max_depth) {
+                int32_t first_child = children.size();
+                children[node] = first_child;
+                children.resize(first_child + 8, -1);
+                node_to_local.resize(first_child + 8, -1);
+                for (int child = 0; child < 8; ++child) {
+                    next_level.push_back(first_child + child);
+                    next_x0.push_back(x0[cell] + ((child >> 2) & 1)*0.5*cx);
+                    next_y0.push_back(y0[cell] + ((child >> 1) & 1)*0.5*cy);
+                    next_z0.push_back(z0[cell] + (child & 1)*0.5*cz);
+                }
+            } else {
+                node_to_local[node] = leaves_to_keep;
+                all_local_vals.resize(size_t(leaves_to_keep+1)*local_vals_size, 0.);
+                std::copy(cell_vals.begin(), cell_vals.end(), all_local_vals.begin() + size_t(leaves_to_keep)*local_vals_size);
+                leaves_to_keep++;
+            }
+        }
+        level = next_level;
+        x0 = next_x0;
+        y0 = next_y0;
+        z0 = next_z0;
+    }
+}
+
+template<class Array>
+const double* AdaptiveInterpolant3D<Array>::locate(double x, double y, double z, double* local){
+    // to avoid funny business when the data is just a tiny bit out of bounds
+    // due to machine precision, we perform this check and shift
+    if(x >= xmax) x -= _EPS_;
+    else if (x <= xmin) x += _EPS_;
+    if(y >= ymax) y -= _EPS_;
+    else if (y <= ymin) y += _EPS_;
+    if(z >= zmax) z -= _EPS_;
+    else if (z <= zmin) z += _EPS_;
+
+    int xidx = int(nx*(x-xmin)/(xmax-xmin));
+    int yidx = int(ny*(y-ymin)/(ymax-ymin));
+    int zidx = int(nz*(z-zmin)/(zmax-zmin));
+    bool xout = xidx < 0 || xidx >= nx;
+    bool yout = yidx < 0 || yidx >= ny;
+    bool zout = zidx < 0 || zidx >= nz;
+    if(!out_of_bounds_ok){
+        if(xout)
+            throw std::runtime_error(fmt::format("xidxs={} not within [0, {}]", xidx, nx-1));
+        if(yout)
+            throw std::runtime_error(fmt::format("yidxs={} not within [0, {}]", yidx, ny-1));
+        if(zout)
+            throw std::runtime_error(fmt::format("zidxs={} not within [0, {}]", zidx, nz-1));
+    }
+    if(xout || yout || zout)
+        return nullptr;
+    local[0] = (x-xmin)/hx - xidx;
+    local[1] = (y-ymin)/hy - yidx;
+    local[2] = (z-zmin)/hz - zidx;
+    int32_t node = idx_cell(xidx, yidx, zidx);
+    if(!node_to_local.empty()) {
+        // descend to the leaf, rescaling the coordinates to each child
+        while(children[node] >= 0) {
+            int cx = local[0] >= 0.5;
+            int cy = local[1] >= 0.5;
+            int cz = local[2] >= 0.5;
+            local[0] = 2*local[0] - cx;
+            local[1] = 2*local[1] - cy;
+            local[2] = 2*local[2] - cz;
+            node = children[node] + 4*cx + 2*cy + cz;
+        }
+    }
+    int32_t local_idx = node_to_local.empty() ? -1 : node_to_local[node];
+    if (local_idx < 0) {
+        if(out_of_bounds_ok)
+            return nullptr;
+        else
+            throw std::runtime_error(fmt::format("node={} is skipped or the interpolant has not been built", node));
+    }
+    return all_local_vals.data() + size_t(local_idx) * local_vals_size;
+}
+
+template<class Array>
+void AdaptiveInterpolant3D<Array>::evaluate_inplace(double x, double y, double z, double* res){
+    double local[3];
+    const double* vals_local = locate(x, y, z, local);
+    if(vals_local)
+        evaluate_lagrange_3d(rule, value_size, padded_value_size, local[0], local[1], local[2], vals_local, (const double*) nullptr, res);
+}
+
+template<class Array>
+Vec AdaptiveInterpolant3D<Array>::evaluate(double x, double y, double z){
+    Vec fxyz(value_size, 0.);
+    evaluate_inplace(x, y, z, fxyz.data());
+    return fxyz;
+}
+
+template<class Array>
+void AdaptiveInterpolant3D<Array>::evaluate_batch(Array& xyz, Array& fxyz){
+    if(fxyz.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("fxyz needs to be in row-major storage order");
+    int npoints = xyz.shape(0);
+    double* res = fxyz.data();
+    for (int i = 0; i < npoints; ++i) {
+        evaluate_inplace(xyz(i, 0), xyz(i, 1), xyz(i, 2), res + value_size*i);
+    }
+}
+
+template<class Array>
+std::pair<double, double> AdaptiveInterpolant3D<Array>::estimate_error(std::function<Vec(Vec, Vec, Vec)> &f, int samples) {
+    return estimate_interpolation_error<Array>(*this, f, samples, value_size, xmin, xmax, ymin, ymax, zmin, zmax);
+}
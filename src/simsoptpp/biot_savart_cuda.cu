@@ -0,0 +1,301 @@
+#include "biot_savart_cuda.h"
+
+#include <cuda_runtime.h>
+#include <vector>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+namespace biot_savart_cuda {
+
+static void check(cudaError_t err, const char* what) {
+    if(err != cudaSuccess)
+        throw std::runtime_error(std::string("CUDA error in ") + what + ": " + cudaGetErrorString(err));
+}
+
+bool device_available() {
+    int count = 0;
+    if(cudaGetDeviceCount(&count) != cudaSuccess) {
+        cudaGetLastError(); // reset the error state
+        return false;
+    }
+    return count > 0;
+}
+
+// A device buffer that remembers the host data that was uploaded last.
+struct DeviceArray {
+    double* data = nullptr;
+    size_t capacity = 0;
+    std::vector<double> shadow;
+
+    DeviceArray() {}
+    DeviceArray(const DeviceArray&) = delete;
+    DeviceArray& operator=(const DeviceArray&) = delete;
+    ~DeviceArray() {
+        if(data)
+            cudaFree(data);
+    }
+
+    void reserve(size_t n) {
+        if(n <= capacity)
+            return;
+        if(data)
+            check(cudaFree(data), "cudaFree");
+        check(cudaMalloc(&data, n*sizeof(double)), "cudaMalloc");
+        capacity = n;
+        shadow.clear();
+    }
+
+    // upload only if the host data differs from the last upload
+    void sync(const double* host, size_t n) {
+        if(shadow.size() == n && std::memcmp(shadow.data(), host, n*sizeof(double)) == 0)
+            return;
+        upload(host, n);
+        shadow.assign(host, host + n);
+    }
+
+    void upload(const double* host, size_t n) {
+        reserve(n);
+        check(cudaMemcpy(data, host, n*sizeof(double), cudaMemcpyHostToDevice), "cudaMemcpy");
+        shadow.clear();
+    }
+
+    void download(double* host, size_t n) {
+        check(cudaMemcpy(host, data, n*sizeof(double), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    }
+};
+
+struct DeviceState::Impl {
+    DeviceArray points;
+    std::vector<std::unique_ptr<DeviceArray>> gammas, dgammas;
+    DeviceArray v, vgrad, out;
+
+    void sync_coil(int coil, const double* gamma, const double* dgamma, int nquad) {
+        while(int(gammas.size()) <= coil) {
+            gammas.push_back(std::make_unique<DeviceArray>());
+            dgammas.push_back(std::make_unique<DeviceArray>());
+        }
+        gammas[coil]->sync(gamma, 3*nquad);
+        dgammas[coil]->sync(dgamma, 3*nquad);
+    }
+};
+
+DeviceState::DeviceState() : impl(new Impl()) {}
+DeviceState::~DeviceState() = default;
+
+constexpr int block_size = 128;
+
+// One thread per target point. The quadrature points are loaded into shared
+// memory in tiles of blockDim.x points. See biot_savart_impl.h for the
+// formulas.
+template<int derivs>
+__global__ void biot_savart_B_kernel(const double* __restrict__ points, int npoints,
+        const double* __restrict__ gamma, const double* __restrict__ dgamma, int nquad, double fak,
+        double* __restrict__ B, double* __restrict__ dB, double* __restrict__ ddB) {
+    extern __shared__ double tile[];
+    double* tile_gamma = tile;
+    double* tile_dgamma = tile + 3*blockDim.x;
+    int i = blockIdx.x*blockDim.x + threadIdx.x;
+    double x[3] = {0., 0., 0.};
+    if(i < npoints) {
+        x[0] = points[3*i+0]; x[1] = points[3*i+1]; x[2] = points[3*i+2];
+    }
+    double accB[3] = {0., 0., 0.};
+    double accdB[derivs > 0 ? 9 : 1] = {0.};
+    double accddB[derivs > 1 ? 27 : 1] = {0.};
+    for (int jt = 0; jt < nquad; jt += blockDim.x) {
+        int j = jt + threadIdx.x;
+        if(j < nquad) {
+            for (int l = 0; l < 3; ++l) {
+                tile_gamma[3*threadIdx.x+l] = gamma[3*j+l];
+                tile_dgamma[3*threadIdx.x+l] = dgamma[3*j+l];
+            }
+        }
+        __syncthreads();
+        int jmax = min((int)blockDim.x, nquad - jt);
+        for (int jj = 0; jj < jmax; ++jj) {
+            const double* t = tile_dgamma + 3*jj;
+            double d[3] = {x[0] - tile_gamma[3*jj+0], x[1] - tile_gamma[3*jj+1], x[2] - tile_gamma[3*jj+2]};
+            double rinv = rsqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+            double r3inv = rinv*rinv*rinv;
+            double cr[3] = {t[1]*d[2] - t[2]*d[1], t[2]*d[0] - t[0]*d[2], t[0]*d[1] - t[1]*d[0]};
+            for (int a = 0; a < 3; ++a)
+                accB[a] += cr[a]*r3inv;
+            if constexpr(derivs > 0) {
+                // t x e_k
+                const double txe[3][3] = {{0., t[2], -t[1]}, {-t[2], 0., t[0]}, {t[1], -t[0], 0.}};
+                double m3_r5inv = -3.*r3inv*rinv*rinv;
+                for (int k = 0; k < 3; ++k)
+                    for (int a = 0; a < 3; ++a)
+                        accdB[3*k+a] += txe[k][a]*r3inv + cr[a]*d[k]*m3_r5inv;
+                if constexpr(derivs > 1) {
+                    double fifteen_r7inv = 15.*r3inv*r3inv*rinv;
+                    for (int k1 = 0; k1 < 3; ++k1) {
+                        for (int k2 = 0; k2 <= k1; ++k2) {
+                            double fk = d[k1]*d[k2]*fifteen_r7inv + (k1 == k2 ? m3_r5inv : 0.);
+                            for (int a = 0; a < 3; ++a)
+                                accddB[9*k1+3*k2+a] += (txe[k2][a]*d[k1] + txe[k1][a]*d[k2])*m3_r5inv + cr[a]*fk;
+                        }
+                    }
+                }
+            }
+        }
+        __syncthreads();
+    }
+    if(i >= npoints)
+        return;
+    for (int a = 0; a < 3; ++a)
+        B[3*i+a] = fak*accB[a];
+    if constexpr(derivs > 0) {
+        for (int c = 0; c < 9; ++c)
+            dB[9*i+c] = fak*accdB[c];
+    }
+    if constexpr(derivs > 1) {
+        for (int k1 = 0; k1 < 3; ++k1) {
+            for (int k2 = 0; k2 <= k1; ++k2) {
+                for (int a = 0; a < 3; ++a) {
+                    ddB[27*i + 9*k1 + 3*k2 + a] = fak*accddB[9*k1+3*k2+a];
+                    ddB[27*i + 9*k2 + 3*k1 + a] = fak*accddB[9*k1+3*k2+a];
+                }
+            }
+        }
+    }
+}
+
+// One block per quadrature point, the threads of the block split the target
+// points and the partial sums are reduced in shared memory. The output has
+// shape (nquad, nres) with the columns res_gamma, res_dgamma and, for derivs >
+// 0, res_grad_gamma, res_grad_dgamma. See biot_savart_vjp_impl.h for the
+// formulas.
+template<int derivs>
+__global__ void biot_savart_vjp_kernel(const double* __restrict__ points, int npoints,
+        const double* __restrict__ gamma, const double* __restrict__ dgamma,
+        const double* __restrict__ v, const double* __restrict__ vgrad, double* __restrict__ res) {
+    constexpr int nres = derivs > 0 ? 12 : 6;
+    extern __shared__ double partial[];
+    int j = blockIdx.x;
+    const double g[3] = {gamma[3*j+0], gamma[3*j+1], gamma[3*j+2]};
+    const double t[3] = {dgamma[3*j+0], dgamma[3*j+1], dgamma[3*j+2]};
+    double acc[nres];
+    for (int c = 0; c < nres; ++c)
+        acc[c] = 0.;
+    for (int i = threadIdx.x; i < npoints; i += blockDim.x) {
+        double d[3] = {points[3*i+0] - g[0], points[3*i+1] - g[1], points[3*i+2] - g[2]};
+        const double* vi = v + 3*i;
+        double rinv = rsqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        double r2inv = rinv*rinv;
+        double r3inv = r2inv*rinv;
+        double three_r5inv = 3.*r3inv*r2inv;
+        double cr[3] = {t[1]*d[2] - t[2]*d[1], t[2]*d[0] - t[0]*d[2], t[0]*d[1] - t[1]*d[0]};
+        double cr_dot_v = cr[0]*vi[0] + cr[1]*vi[1] + cr[2]*vi[2];
+        // res_gamma += (t x v) / r^3 + 3 d ((t x d) . v) / r^5
+        acc[0] += (t[1]*vi[2] - t[2]*vi[1])*r3inv + d[0]*cr_dot_v*three_r5inv;
+        acc[1] += (t[2]*vi[0] - t[0]*vi[2])*r3inv + d[1]*cr_dot_v*three_r5inv;
+        acc[2] += (t[0]*vi[1] - t[1]*vi[0])*r3inv + d[2]*cr_dot_v*three_r5inv;
+        // res_dgamma += (d x v) / r^3
+        acc[3] += (d[1]*vi[2] - d[2]*vi[1])*r3inv;
+        acc[4] += (d[2]*vi[0] - d[0]*vi[2])*r3inv;
+        acc[5] += (d[0]*vi[1] - d[1]*vi[0])*r3inv;
+        if constexpr(derivs > 0) {
+            double fifteen_r7inv = 15.*r3inv*r2inv*r2inv;
+            const double txe[3][3] = {{0., t[2], -t[1]}, {-t[2], 0., t[0]}, {t[1], -t[0], 0.}};
+            for (int k = 0; k < 3; ++k) {
+                const double* w = vgrad + 9*i + 3*k;
+                double cr_dot_w = cr[0]*w[0] + cr[1]*w[1] + cr[2]*w[2];
+                double txe_dot_w = txe[k][0]*w[0] + txe[k][1]*w[1] + txe[k][2]*w[2];
+                double wxt[3] = {w[1]*t[2] - w[2]*t[1], w[2]*t[0] - w[0]*t[2], w[0]*t[1] - w[1]*t[0]};
+                double dxw[3] = {d[1]*w[2] - d[2]*w[1], d[2]*w[0] - d[0]*w[2], d[0]*w[1] - d[1]*w[0]};
+                // e_k x w
+                double exw[3] = {0., 0., 0.};
+                exw[(k+1)%3] = -w[(k+2)%3];
+                exw[(k+2)%3] = w[(k+1)%3];
+                for (int a = 0; a < 3; ++a) {
+                    acc[6+a] += d[a]*txe_dot_w*three_r5inv + wxt[a]*three_r5inv*d[k] - d[a]*d[k]*cr_dot_w*fifteen_r7inv;
+                    acc[9+a] += exw[a]*r3inv - dxw[a]*d[k]*three_r5inv;
+                }
+                acc[6+k] += cr_dot_w*three_r5inv;
+            }
+        }
+    }
+    for (int c = 0; c < nres; ++c)
+        partial[c*blockDim.x + threadIdx.x] = acc[c];
+    __syncthreads();
+    for (int s = blockDim.x/2; s > 0; s /= 2) {
+        if(threadIdx.x < s) {
+            for (int c = 0; c < nres; ++c)
+                partial[c*blockDim.x + threadIdx.x] += partial[c*blockDim.x + threadIdx.x + s];
+        }
+        __syncthreads();
+    }
+    if(threadIdx.x == 0) {
+        for (int c = 0; c < nres; ++c)
+            res[nres*j + c] = partial[c*blockDim.x];
+    }
+}
+
+void DeviceState::B(int coil, const double* points, int npoints, const double* gamma, const double* dgamma, int nquad,
+        int derivs, double* B, double* dB, double* ddB) {
+    if(npoints == 0)
+        return;
+    impl->points.sync(points, 3*npoints);
+    impl->sync_coil(coil, gamma, dgamma, nquad);
+    int ncomp = 3 + (derivs > 0 ? 9 : 0) + (derivs > 1 ? 27 : 0);
+    impl->out.reserve(size_t(ncomp)*npoints);
+    double* dev_B = impl->out.data;
+    double* dev_dB = dev_B + 3*npoints;
+    double* dev_ddB = dev_dB + 9*npoints;
+    double fak = 1e-7/nquad;
+    int nblocks = (npoints + block_size - 1)/block_size;
+    size_t shared = 6*block_size*sizeof(double);
+    const double* dev_points = impl->points.data;
+    const double* dev_gamma = impl->gammas[coil]->data;
+    const double* dev_dgamma = impl->dgammas[coil]->data;
+    if(derivs == 0)
+        biot_savart_B_kernel<0><<<nblocks, block_size, shared>>>(dev_points, npoints, dev_gamma, dev_dgamma, nquad, fak, dev_B, dev_dB, dev_ddB);
+    else if(derivs == 1)
+        biot_savart_B_kernel<1><<<nblocks, block_size, shared>>>(dev_points, npoints, dev_gamma, dev_dgamma, nquad, fak, dev_B, dev_dB, dev_ddB);
+    else
+        biot_savart_B_kernel<2><<<nblocks, block_size, shared>>>(dev_points, npoints, dev_gamma, dev_dgamma, nquad, fak, dev_B, dev_dB, dev_ddB);
+    check(cudaGetLastError(), "biot_savart_B_kernel");
+    check(cudaMemcpy(B, dev_B, 3*npoints*sizeof(double), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    if(derivs > 0)
+        check(cudaMemcpy(dB, dev_dB, 9*npoints*sizeof(double), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    if(derivs > 1)
+        check(cudaMemcpy(ddB, dev_ddB, 27*npoints*sizeof(double), cudaMemcpyDeviceToHost), "cudaMemcpy");
+}
+
+void DeviceState::B_vjp(int coil, const double* points, int npoints, const double* gamma, const double* dgamma, int nquad,
+        const double* v, const double* vgrad, double* res_gamma, double* res_dgamma,
+        double* res_grad_gamma, double* res_grad_dgamma) {
+    bool grad = vgrad != nullptr;
+    int nres = grad ? 12 : 6;
+    impl->points.sync(points, 3*npoints);
+    impl->sync_coil(coil, gamma, dgamma, nquad);
+    // v and vgrad typically change between calls, but are shared by all coils
+    impl->v.sync(v, 3*npoints);
+    if(grad)
+        impl->vgrad.sync(vgrad, 9*npoints);
+    impl->out.reserve(size_t(nres)*nquad);
+    size_t shared = nres*block_size*sizeof(double);
+    if(grad)
+        biot_savart_vjp_kernel<1><<<nquad, block_size, shared>>>(impl->points.data, npoints, impl->gammas[coil]->data,
+                impl->dgammas[coil]->data, impl->v.data, impl->vgrad.data, impl->out.data);
+    else
+        biot_savart_vjp_kernel<0><<<nquad, block_size, shared>>>(impl->points.data, npoints, impl->gammas[coil]->data,
+                impl->dgammas[coil]->data, impl->v.data, nullptr, impl->out.data);
+    check(cudaGetLastError(), "biot_savart_vjp_kernel");
+    std::vector<double> res(nres*nquad);
+    impl->out.download(res.data(), nres*nquad);
+    for (int j = 0; j < nquad; ++j) {
+        for (int l = 0; l < 3; ++l) {
+            res_gamma[3*j+l] += res[nres*j + l];
+            res_dgamma[3*j+l] += res[nres*j + 3 + l];
+            if(grad) {
+                res_grad_gamma[3*j+l] += res[nres*j + 6 + l];
+                res_grad_dgamma[3*j+l] += res[nres*j + 9 + l];
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+
+// Interface to the CUDA implementation of the Biot-Savart kernels in
+// biot_savart_cuda.cu, which is only compiled if the CMake option
+// SIMSOPT_WITH_CUDA is enabled. This header does not depend on xtensor, so
+// that it can be included from the CUDA translation unit.
+//
+// The device path is switched on globally via `set_enabled(true)`, which
+// affects `BiotSavart::compute` (for the direct sum of B and its derivatives),
+// `BiotSavart::B_vjp_graph` and `biot_savart_vjp_graph`.
+
+namespace biot_savart_cuda {
+
+#if defined(SIMSOPT_WITH_CUDA)
+bool device_available();
+#else
+inline bool device_available() { return false; }
+#endif
+
+inline bool& enabled_flag() {
+    static bool flag = false;
+    return flag;
+}
+
+inline bool enabled() { return enabled_flag(); }
+
+inline void set_enabled(bool enable) {
+    if(enable && !device_available())
+        throw std::runtime_error("No CUDA device available. Make sure that simsopt was compiled with SIMSOPT_WITH_CUDA=ON and that a GPU is visible.");
+    enabled_flag() = enable;
+}
+
+#if defined(SIMSOPT_WITH_CUDA)
+
+// Keeps the target points and the coil geometry resident on the device. The
+// host arrays are compared to a copy of the data that was uploaded last, and
+// are only transferred again if they have changed. All arrays are row-major,
+// points, gamma and dgamma have shape (n, 3).
+class DeviceState {
+    public:
+        DeviceState();
+        ~DeviceState();
+        DeviceState(const DeviceState&) = delete;
+        DeviceState& operator=(const DeviceState&) = delete;
+
+        // Field of coil number `coil` per unit current, i.e. including the
+        // 1e-7/nquad prefactor. dB and ddB are only written for derivs > 0
+        // and derivs > 1 respectively.
+        void B(int coil, const double* points, int npoints, const double* gamma, const double* dgamma, int nquad,
+                int derivs, double* B, double* dB, double* ddB);
+
+        // Adds the vector Jacobian product of coil number `coil` to the
+        // result arrays, without the current and the prefactor (as
+        // biot_savart_vjp_kernel). The gradient terms are only computed if
+        // vgrad is not null.
+        void B_vjp(int coil, const double* points, int npoints, const double* gamma, const double* dgamma, int nquad,
+                const double* v, const double* vgrad, double* res_gamma, double* res_dgamma,
+                double* res_grad_gamma, double* res_grad_dgamma);
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl;
+};
+
+#endif
+
+}
@@ -15,16 +15,22 @@ using namespace std;
 #define MYIF(c) if(c)
 #endif
 
+// The kernels below only evaluate the field at the points with indices in
+// [point_start, point_end), where point_end = -1 means all points. When using
+// simd, point_start has to be a multiple of the simd vector size.
+
 #if defined(USE_XSIMD)
 
 template<class T, int derivs>
 void biot_savart_kernel(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
-            T& gamma, T& dgamma_by_dphi, T& B, T& dB_by_dX, T& d2B_by_dXdX) {
+            T& gamma, T& dgamma_by_dphi, T& B, T& dB_by_dX, T& d2B_by_dXdX, int point_start=0, int point_end=-1) {
     if(gamma.layout() != xt::layout_type::row_major)
           throw std::runtime_error("gamma needs to be in row-major storage order");
     if(dgamma_by_dphi.layout() != xt::layout_type::row_major)
           throw std::runtime_error("dgamma_by_dphi needs to be in row-major storage order");
     int num_points         = pointsx.size();
+    if(point_end < 0)
+        point_end = num_points;
     int num_quad_points    = gamma.shape(0);
     constexpr int simd_size = xsimd::simd_type<double>::size;
     auto dB_dX_i = vector<Vec3dSimd, xs::aligned_allocator<Vec3dSimd, XSIMD_DEFAULT_ALIGNMENT>>();
@@ -46,7 +52,7 @@ void biot_savart_kernel(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, Al
     double* dgamma_j_by_dphi_ptr = &(dgamma_by_dphi(0, 0));
     // out vectors pointsx, pointsy, and pointsz are added and aligned, so we
     // don't have to worry about going out of bounds here
-    for(int i = 0; i < num_points; i += simd_size) {
+    for(int i = point_start; i < point_end; i += simd_size) {
         auto point_i = Vec3dSimd(&(pointsx[i]), &(pointsy[i]), &(pointsz[i]));
         auto B_i   = Vec3dSimd();
         MYIF(derivs > 0) {
@@ -138,7 +144,7 @@ void biot_savart_kernel(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, Al
         // vectors. so we have to ignore those results. Disgarding the unneeded
         // entries is actually faster than falling back to scalar operations
         // (which would require treat i = 8, 9, 10 all individually).
-        int jlimit = std::min(simd_size, num_points-i);
+        int jlimit = std::min(simd_size, point_end-i);
         for(int j=0; j<jlimit; j++){
             B(i+j, 0) = fak * B_i.x[j];
             B(i+j, 1) = fak * B_i.y[j];
@@ -172,12 +178,14 @@ void biot_savart_kernel(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, Al
 
 template<class T, int derivs>
 void biot_savart_kernel(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
-            T& gamma, T& dgamma_by_dphi, T& B, T& dB_by_dX, T& d2B_by_dXdX) {
+            T& gamma, T& dgamma_by_dphi, T& B, T& dB_by_dX, T& d2B_by_dXdX, int point_start=0, int point_end=-1) {
     if(gamma.layout() != xt::layout_type::row_major)
           throw std::runtime_error("gamma needs to be in row-major storage order");
     if(dgamma_by_dphi.layout() != xt::layout_type::row_major)
           throw std::runtime_error("dgamma_by_dphi needs to be in row-major storage order");
     int num_points         = pointsx.size();
+    if(point_end < 0)
+        point_end = num_points;
     int num_quad_points    = gamma.shape(0);
     auto dB_dX_i = vector<Vec3dStd>();
     MYIF(derivs > 0) {
@@ -198,7 +206,7 @@ void biot_savart_kernel(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, Al
     double* dgamma_j_by_dphi_ptr = &(dgamma_by_dphi(0, 0));
     // out vectors pointsx, pointsy, and pointsz are added and aligned, so we
     // don't have to worry about going out of bounds here
-    for(int i = 0; i < num_points; i++) {
+    for(int i = point_start; i < point_end; i++) {
         auto point_i = Vec3dStd(&(pointsx[i]), &(pointsy[i]), &(pointsz[i]));
         auto B_i   = Vec3dStd();
         MYIF(derivs > 0) {
@@ -293,12 +301,14 @@ void biot_savart_kernel(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, Al
 
 template<class T, int derivs>
 void biot_savart_kernel_A(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
-            T& gamma, T& dgamma_by_dphi, T& A, T& dA_by_dX, T& d2A_by_dXdX) {
+            T& gamma, T& dgamma_by_dphi, T& A, T& dA_by_dX, T& d2A_by_dXdX, int point_start=0, int point_end=-1) {
     if(gamma.layout() != xt::layout_type::row_major)
           throw std::runtime_error("gamma needs to be in row-major storage order");
     if(dgamma_by_dphi.layout() != xt::layout_type::row_major)
           throw std::runtime_error("dgamma_by_dphi needs to be in row-major storage order");
     int num_points         = pointsx.size();
+    if(point_end < 0)
+        point_end = num_points;
     int num_quad_points    = gamma.shape(0);
     constexpr int simd_size = xsimd::simd_type<double>::size;
     auto dA_dX_i = vector<Vec3dSimd, xs::aligned_allocator<Vec3dSimd, XSIMD_DEFAULT_ALIGNMENT>>();
@@ -320,7 +330,7 @@ void biot_savart_kernel_A(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy,
     double* dgamma_j_by_dphi_ptr = &(dgamma_by_dphi(0, 0));
     // out vectors pointsx, pointsy, and pointsz are added and aligned, so we
     // don't have to worry about going out of bounds here
-    for(int i = 0; i < num_points; i += simd_size) {
+    for(int i = point_start; i < point_end; i += simd_size) {
         auto point_i = Vec3dSimd(&(pointsx[i]), &(pointsy[i]), &(pointsz[i]));
         auto A_i   = Vec3dSimd();
         MYIF(derivs > 0) {
@@ -385,7 +395,7 @@ void biot_savart_kernel_A(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy,
         // entries is actually faster than falling back to scalar operations
         // (which would require treat i = 8, 9, 10 all individually).
 
-        int jlimit = std::min(simd_size, num_points-i);
+        int jlimit = std::min(simd_size, point_end-i);
         for(int j=0; j<jlimit; j++){
             A(i+j, 0) = fak * A_i.x[j];
             A(i+j, 1) = fak * A_i.y[j];
@@ -419,12 +429,14 @@ void biot_savart_kernel_A(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy,
 
 template<class T, int derivs>
 void biot_savart_kernel_A(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
-            T& gamma, T& dgamma_by_dphi, T& A, T& dA_by_dX, T& d2A_by_dXdX) {
+            T& gamma, T& dgamma_by_dphi, T& A, T& dA_by_dX, T& d2A_by_dXdX, int point_start=0, int point_end=-1) {
     if(gamma.layout() != xt::layout_type::row_major)
           throw std::runtime_error("gamma needs to be in row-major storage order");
     if(dgamma_by_dphi.layout() != xt::layout_type::row_major)
           throw std::runtime_error("dgamma_by_dphi needs to be in row-major storage order");
     int num_points         = pointsx.size();
+    if(point_end < 0)
+        point_end = num_points;
     int num_quad_points    = gamma.shape(0);
     auto dA_dX_i = vector<Vec3dStd>();
     MYIF(derivs > 0) {
@@ -445,7 +457,7 @@ void biot_savart_kernel_A(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy,
     double* dgamma_j_by_dphi_ptr = &(dgamma_by_dphi(0, 0));
     // out vectors pointsx, pointsy, and pointsz are added and aligned, so we
     // don't have to worry about going out of bounds here
-    for(int i = 0; i < num_points; i++) {
+    for(int i = point_start; i < point_end; i++) {
         auto point_i = Vec3dStd(&(pointsx[i]), &(pointsy[i]), &(pointsz[i]));
         auto A_i   = Vec3dStd();
         MYIF(derivs > 0) {
@@ -527,3 +539,152 @@ void biot_savart_kernel_A(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy,
 }
 
 #endif
+
+// Fused kernel that evaluates B and its first derivs_B derivatives and A and
+// its first derivs_A derivatives in a single pass over the quadrature points,
+// so that the displacement x - gamma and the powers of 1/|x - gamma| are only
+// computed once for both.  The same code is used with and without xsimd, the
+// lanes are either simd vectors or plain doubles.
+
+#if defined(USE_XSIMD)
+using fused_lane_t = simd_t;
+constexpr int fused_simd_size = xsimd::simd_type<double>::size;
+inline fused_lane_t fused_load(const double* ptr) { return xs::load_aligned(ptr); }
+inline double fused_lane(const fused_lane_t& x, int j) { return x[j]; }
+#else
+using fused_lane_t = double;
+constexpr int fused_simd_size = 1;
+inline fused_lane_t fused_load(const double* ptr) { return *ptr; }
+inline double fused_lane(const fused_lane_t& x, int j) { return x; }
+#endif
+
+template<class T, int derivs_B, int derivs_A>
+void biot_savart_kernel_BA(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+            T& gamma, T& dgamma_by_dphi, T& B, T& dB_by_dX, T& d2B_by_dXdX, T& A, T& dA_by_dX, T& d2A_by_dXdX,
+            int point_start=0, int point_end=-1) {
+    if(gamma.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("gamma needs to be in row-major storage order");
+    if(dgamma_by_dphi.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("dgamma_by_dphi needs to be in row-major storage order");
+    constexpr int derivs = derivs_B > derivs_A ? derivs_B : derivs_A;
+    int num_points         = pointsx.size();
+    if(point_end < 0)
+        point_end = num_points;
+    int num_quad_points    = gamma.shape(0);
+    double fak = (1e-7/num_quad_points);
+    double* gamma_j_ptr = &(gamma(0, 0));
+    double* dgamma_j_by_dphi_ptr = &(dgamma_by_dphi(0, 0));
+    fused_lane_t B_i[3], dB_i[9], d2B_i[27], A_i[3], dA_i[9], d2A_i[27];
+    // out vectors pointsx, pointsy, and pointsz are added and aligned, so we
+    // don't have to worry about going out of bounds here
+    for(int i = point_start; i < point_end; i += fused_simd_size) {
+        fused_lane_t x[3] = {fused_load(&(pointsx[i])), fused_load(&(pointsy[i])), fused_load(&(pointsz[i]))};
+        for (int c = 0; c < 3; ++c) {
+            B_i[c] = fused_lane_t(0.);
+            A_i[c] = fused_lane_t(0.);
+        }
+        for (int c = 0; c < 9; ++c) {
+            dB_i[c] = fused_lane_t(0.);
+            dA_i[c] = fused_lane_t(0.);
+        }
+        for (int c = 0; c < 27; ++c) {
+            d2B_i[c] = fused_lane_t(0.);
+            d2A_i[c] = fused_lane_t(0.);
+        }
+        for (int j = 0; j < num_quad_points; ++j) {
+            const double* t = &(dgamma_j_by_dphi_ptr[3*j]);
+            fused_lane_t diff[3] = {x[0] - gamma_j_ptr[3*j+0], x[1] - gamma_j_ptr[3*j+1], x[2] - gamma_j_ptr[3*j+2]};
+            fused_lane_t norm_diff_inv = rsqrt(diff[0]*diff[0] + diff[1]*diff[1] + diff[2]*diff[2]);
+            fused_lane_t norm_diff_2_inv = norm_diff_inv*norm_diff_inv;
+            fused_lane_t norm_diff_3_inv = norm_diff_2_inv*norm_diff_inv;
+            fused_lane_t norm_diff_5_inv, norm_diff_7_inv;
+            MYIF(derivs > 0)
+                norm_diff_5_inv = norm_diff_3_inv*norm_diff_2_inv;
+            MYIF(derivs_B > 1)
+                norm_diff_7_inv = norm_diff_5_inv*norm_diff_2_inv;
+
+            // B_a = (t x diff)_a / |diff|^3
+            fused_lane_t cr[3] = {t[1]*diff[2] - t[2]*diff[1], t[2]*diff[0] - t[0]*diff[2], t[0]*diff[1] - t[1]*diff[0]};
+            for (int a = 0; a < 3; ++a)
+                B_i[a] += cr[a]*norm_diff_3_inv;
+            MYIF(derivs_B > 0) {
+                // t x e_k
+                const double txe[3][3] = {{0., t[2], -t[1]}, {-t[2], 0., t[0]}, {t[1], -t[0], 0.}};
+                fused_lane_t m3_r5inv = (-3.)*norm_diff_5_inv;
+                for (int k = 0; k < 3; ++k) {
+                    fused_lane_t diffk_m3_r5inv = diff[k]*m3_r5inv;
+                    for (int a = 0; a < 3; ++a)
+                        dB_i[3*k + a] += txe[k][a]*norm_diff_3_inv + cr[a]*diffk_m3_r5inv;
+                }
+                MYIF(derivs_B > 1) {
+                    fused_lane_t fifteen_r7inv = 15.*norm_diff_7_inv;
+                    for (int k1 = 0; k1 < 3; ++k1) {
+                        for (int k2 = 0; k2 <= k1; ++k2) {
+                            fused_lane_t fk = diff[k1]*diff[k2]*fifteen_r7inv;
+                            if(k1 == k2)
+                                fk += m3_r5inv;
+                            for (int a = 0; a < 3; ++a)
+                                d2B_i[9*k1 + 3*k2 + a] += (txe[k2][a]*diff[k1] + txe[k1][a]*diff[k2])*m3_r5inv + cr[a]*fk;
+                        }
+                    }
+                }
+            }
+
+            // A_a = t_a / |diff|
+            for (int a = 0; a < 3; ++a)
+                A_i[a] += t[a]*norm_diff_inv;
+            MYIF(derivs_A > 0) {
+                for (int k = 0; k < 3; ++k) {
+                    fused_lane_t diffk_r3inv = diff[k]*norm_diff_3_inv;
+                    for (int a = 0; a < 3; ++a)
+                        dA_i[3*k + a] -= t[a]*diffk_r3inv;
+                }
+                MYIF(derivs_A > 1) {
+                    fused_lane_t three_r5inv = 3.*norm_diff_5_inv;
+                    for (int k1 = 0; k1 < 3; ++k1) {
+                        for (int k2 = 0; k2 <= k1; ++k2) {
+                            fused_lane_t fk = diff[k1]*diff[k2]*three_r5inv;
+                            if(k1 == k2)
+                                fk -= norm_diff_3_inv;
+                            for (int a = 0; a < 3; ++a)
+                                d2A_i[9*k1 + 3*k2 + a] += t[a]*fk;
+                        }
+                    }
+                }
+            }
+        }
+        // see biot_savart_kernel for why we discard the results of the last
+        // lanes in the final iteration
+        int jlimit = std::min(fused_simd_size, point_end-i);
+        for(int j=0; j<jlimit; j++){
+            for (int a = 0; a < 3; ++a) {
+                B(i+j, a) = fak * fused_lane(B_i[a], j);
+                A(i+j, a) = fak * fused_lane(A_i[a], j);
+            }
+            MYIF(derivs_B > 0) {
+                for (int k = 0; k < 3; ++k)
+                    for (int a = 0; a < 3; ++a)
+                        dB_by_dX(i+j, k, a) = fak * fused_lane(dB_i[3*k + a], j);
+            }
+            MYIF(derivs_A > 0) {
+                for (int k = 0; k < 3; ++k)
+                    for (int a = 0; a < 3; ++a)
+                        dA_by_dX(i+j, k, a) = fak * fused_lane(dA_i[3*k + a], j);
+            }
+            for (int k1 = 0; k1 < 3; ++k1) {
+                for (int k2 = 0; k2 <= k1; ++k2) {
+                    for (int a = 0; a < 3; ++a) {
+                        MYIF(derivs_B > 1) {
+                            d2B_by_dXdX(i+j, k1, k2, a) = fak * fused_lane(d2B_i[9*k1 + 3*k2 + a], j);
+                            d2B_by_dXdX(i+j, k2, k1, a) = fak * fused_lane(d2B_i[9*k1 + 3*k2 + a], j);
+                        }
+                        MYIF(derivs_A > 1) {
+                            d2A_by_dXdX(i+j, k1, k2, a) = fak * fused_lane(d2A_i[9*k1 + 3*k2 + a], j);
+                            d2A_by_dXdX(i+j, k2, k1, a) = fak * fused_lane(d2A_i[9*k1 + 3*k2 + a], j);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
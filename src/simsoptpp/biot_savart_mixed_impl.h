@@ -0,0 +1,203 @@
+#pragma once
+
+#include "simdhelpers.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "xtensor/xlayout.hpp"
+
+using std::vector;
+
+// Mixed precision version of the Biot-Savart kernels in biot_savart_impl.h.
+// The interaction of a target point with a quadrature point is computed in
+// single precision, which doubles the number of simd lanes. To control the
+// rounding errors
+//  - the points and the curve are shifted to the centroid of the curve before
+//    converting to float, so that x - gamma is formed without cancellation of
+//    the (possibly large) absolute coordinates,
+//  - the contributions are summed in float for blocks of `block_size`
+//    quadrature points only, and the block sums are accumulated in double.
+// The relative error of the result is typically around 1e-6, which is
+// sufficient for far field evaluations and for the early iterations of a coil
+// optimization.
+
+namespace biot_savart_mixed {
+
+#if defined(USE_XSIMD)
+using simd_float_t = xsimd::simd_type<float>;
+constexpr int simd_size = simd_float_t::size;
+inline simd_float_t load(const float* ptr) { return xsimd::load_unaligned(ptr); }
+inline void store(float* ptr, const simd_float_t& x) { x.store_unaligned(ptr); }
+inline simd_float_t inv_sqrt(const simd_float_t& x) { return simd_float_t(1.f)/xsimd::sqrt(x); }
+#else
+using simd_float_t = float;
+constexpr int simd_size = 1;
+inline simd_float_t load(const float* ptr) { return *ptr; }
+inline void store(float* ptr, const simd_float_t& x) { *ptr = x; }
+inline simd_float_t inv_sqrt(const simd_float_t& x) { return 1.f/std::sqrt(x); }
+#endif
+
+constexpr int block_size = 32;
+
+template<int derivs>
+constexpr int num_components() { return 3 + (derivs > 0 ? 9 : 0) + (derivs > 1 ? 27 : 0); }
+
+// Evaluates B (or A, if vector_potential is true) of a single coil at the points
+// [point_start, point_end).
+template<class T, int derivs, bool vector_potential>
+void kernel(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+        T& gamma, T& dgamma_by_dphi, T& F, T& dF_by_dX, T& d2F_by_dXdX, int point_start, int point_end) {
+    if(gamma.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("gamma needs to be in row-major storage order");
+    if(dgamma_by_dphi.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("dgamma_by_dphi needs to be in row-major storage order");
+    constexpr int nc = num_components<derivs>();
+    int num_points = pointsx.size();
+    if(point_end < 0)
+        point_end = num_points;
+    int num_quad_points = gamma.shape(0);
+    double fak = (1e-7/num_quad_points);
+    double* gamma_ptr = &(gamma(0, 0));
+    double* dgamma_ptr = &(dgamma_by_dphi(0, 0));
+
+    double origin[3] = {0., 0., 0.};
+    for (int j = 0; j < num_quad_points; ++j)
+        for (int l = 0; l < 3; ++l)
+            origin[l] += gamma_ptr[3*j+l]/num_quad_points;
+    vector<float> g(3*num_quad_points), t(3*num_quad_points);
+    for (int j = 0; j < num_quad_points; ++j) {
+        for (int l = 0; l < 3; ++l) {
+            g[3*j+l] = float(gamma_ptr[3*j+l] - origin[l]);
+            t[3*j+l] = float(dgamma_ptr[3*j+l]);
+        }
+    }
+
+    float lanes[3][simd_size];
+    float partial_lanes[simd_size];
+    double acc[nc][simd_size];
+    simd_float_t partial[nc];
+    for(int i = point_start; i < point_end; i += simd_size) {
+        int jlimit = std::min(simd_size, point_end-i);
+        for (int l = 0; l < simd_size; ++l) {
+            // the remaining lanes in the last iteration are discarded below
+            int idx = i + std::min(l, jlimit-1);
+            lanes[0][l] = float(pointsx[idx] - origin[0]);
+            lanes[1][l] = float(pointsy[idx] - origin[1]);
+            lanes[2][l] = float(pointsz[idx] - origin[2]);
+        }
+        simd_float_t x[3] = {load(lanes[0]), load(lanes[1]), load(lanes[2])};
+        for (int c = 0; c < nc; ++c) {
+            partial[c] = simd_float_t(0.f);
+            for (int l = 0; l < simd_size; ++l)
+                acc[c][l] = 0.;
+        }
+        for (int jstart = 0; jstart < num_quad_points; jstart += block_size) {
+            int jend = std::min(jstart + block_size, num_quad_points);
+            for (int j = jstart; j < jend; ++j) {
+                const float* tj = &(t[3*j]);
+                simd_float_t d[3] = {x[0] - simd_float_t(g[3*j+0]), x[1] - simd_float_t(g[3*j+1]), x[2] - simd_float_t(g[3*j+2])};
+                simd_float_t rinv = inv_sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+                simd_float_t r3inv = rinv*rinv*rinv;
+                if constexpr(vector_potential) {
+                    // A_a = t_a / r
+                    for (int a = 0; a < 3; ++a)
+                        partial[a] += simd_float_t(tj[a])*rinv;
+                    if constexpr(derivs > 0) {
+                        for (int k = 0; k < 3; ++k) {
+                            simd_float_t dk_r3inv = d[k]*r3inv;
+                            for (int a = 0; a < 3; ++a)
+                                partial[3 + 3*k + a] -= simd_float_t(tj[a])*dk_r3inv;
+                        }
+                    }
+                    if constexpr(derivs > 1) {
+                        simd_float_t three_r5inv = simd_float_t(3.f)*r3inv*rinv*rinv;
+                        for (int k1 = 0; k1 < 3; ++k1) {
+                            for (int k2 = 0; k2 <= k1; ++k2) {
+                                simd_float_t fk = d[k1]*d[k2]*three_r5inv;
+                                if(k1 == k2)
+                                    fk -= r3inv;
+                                for (int a = 0; a < 3; ++a)
+                                    partial[12 + 9*k1 + 3*k2 + a] += simd_float_t(tj[a])*fk;
+                            }
+                        }
+                    }
+                } else {
+                    // B_a = (t x d)_a / r^3
+                    simd_float_t cr[3] = {
+                        simd_float_t(tj[1])*d[2] - simd_float_t(tj[2])*d[1],
+                        simd_float_t(tj[2])*d[0] - simd_float_t(tj[0])*d[2],
+                        simd_float_t(tj[0])*d[1] - simd_float_t(tj[1])*d[0]
+                    };
+                    for (int a = 0; a < 3; ++a)
+                        partial[a] += cr[a]*r3inv;
+                    if constexpr(derivs > 0) {
+                        // t x e_k
+                        const float txe[3][3] = {{0.f, tj[2], -tj[1]}, {-tj[2], 0.f, tj[0]}, {tj[1], -tj[0], 0.f}};
+                        simd_float_t m3_r5inv = simd_float_t(-3.f)*r3inv*rinv*rinv;
+                        for (int k = 0; k < 3; ++k) {
+                            simd_float_t dk_m3_r5inv = d[k]*m3_r5inv;
+                            for (int a = 0; a < 3; ++a)
+                                partial[3 + 3*k + a] += simd_float_t(txe[k][a])*r3inv + cr[a]*dk_m3_r5inv;
+                        }
+                        if constexpr(derivs > 1) {
+                            simd_float_t fifteen_r7inv = simd_float_t(15.f)*r3inv*r3inv*rinv;
+                            for (int k1 = 0; k1 < 3; ++k1) {
+                                for (int k2 = 0; k2 <= k1; ++k2) {
+                                    simd_float_t fk = d[k1]*d[k2]*fifteen_r7inv;
+                                    if(k1 == k2)
+                                        fk += m3_r5inv;
+                                    for (int a = 0; a < 3; ++a)
+                                        partial[12 + 9*k1 + 3*k2 + a] +=
+                                            (simd_float_t(txe[k2][a])*d[k1] + simd_float_t(txe[k1][a])*d[k2])*m3_r5inv + cr[a]*fk;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+            // flush the single precision block sums into the double precision accumulators
+            for (int c = 0; c < nc; ++c) {
+                store(partial_lanes, partial[c]);
+                for (int l = 0; l < simd_size; ++l)
+                    acc[c][l] += partial_lanes[l];
+                partial[c] = simd_float_t(0.f);
+            }
+        }
+        for (int l = 0; l < jlimit; ++l) {
+            for (int a = 0; a < 3; ++a)
+                F(i+l, a) = fak * acc[a][l];
+            if constexpr(derivs > 0) {
+                for (int k = 0; k < 3; ++k)
+                    for (int a = 0; a < 3; ++a)
+                        dF_by_dX(i+l, k, a) = fak * acc[3 + 3*k + a][l];
+            }
+            if constexpr(derivs > 1) {
+                for (int k1 = 0; k1 < 3; ++k1) {
+                    for (int k2 = 0; k2 <= k1; ++k2) {
+                        for (int a = 0; a < 3; ++a) {
+                            d2F_by_dXdX(i+l, k1, k2, a) = fak * acc[12 + 9*k1 + 3*k2 + a][l];
+                            d2F_by_dXdX(i+l, k2, k1, a) = fak * acc[12 + 9*k1 + 3*k2 + a][l];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+}
+
+template<class T, int derivs>
+void biot_savart_kernel_mixed(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+            T& gamma, T& dgamma_by_dphi, T& B, T& dB_by_dX, T& d2B_by_dXdX, int point_start=0, int point_end=-1) {
+    biot_savart_mixed::kernel<T, derivs, false>(pointsx, pointsy, pointsz, gamma, dgamma_by_dphi,
+            B, dB_by_dX, d2B_by_dXdX, point_start, point_end);
+}
+
+template<class T, int derivs>
+void biot_savart_kernel_A_mixed(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+            T& gamma, T& dgamma_by_dphi, T& A, T& dA_by_dX, T& d2A_by_dXdX, int point_start=0, int point_end=-1) {
+    biot_savart_mixed::kernel<T, derivs, true>(pointsx, pointsy, pointsz, gamma, dgamma_by_dphi,
+            A, dA_by_dX, d2A_by_dXdX, point_start, point_end);
+}
@@ -1,7 +1,11 @@
 #include "biot_savart_impl.h"
 #include "biot_savart_py.h"
+#include "scratch.h"
+#include "perf_counters.h"
+#include "gil.h"
 
 void biot_savart(Array& points, vector<Array>& gammas, vector<Array>& dgamma_by_dphis, vector<Array>& B, vector<Array>& dB_by_dX, vector<Array>& d2B_by_dXdX) {
+    SIMSOPT_PERF_SCOPE(biot_savart_B, points.shape(0));
     auto pointsx = AlignedPaddedVec(points.shape(0), 0);
     auto pointsy = AlignedPaddedVec(points.shape(0), 0);
     auto pointsz = AlignedPaddedVec(points.shape(0), 0);
@@ -13,8 +17,8 @@ void biot_savart(Array& points, vector<Array>& gammas, vector<Array>& dgamma_by_
     }
     int num_coils  = gammas.size();
 
-    Array dummyjac = xt::zeros<double>({1, 1, 1});
-    Array dummyhess = xt::zeros<double>({1, 1, 1, 1});
+    Array& dummyjac = placeholder_array<Array>(3);
+    Array& dummyhess = placeholder_array<Array>(4);
 
     int nderivs = 0;
     if(dB_by_dX.size() == num_coils) {
@@ -23,7 +27,8 @@ void biot_savart(Array& points, vector<Array>& gammas, vector<Array>& dgamma_by_
             nderivs = 2;
         }
     }
-    
+
+    ReleaseGIL nogil;
     #pragma omp parallel for
     for(int i=0; i<num_coils; i++) {
         if(nderivs == 2)
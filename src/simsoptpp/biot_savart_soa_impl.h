@@ -0,0 +1,177 @@
+#include "simdhelpers.h"
+#include "coilcollection.h"
+
+// Kernels that stream over the quadrature points of all coils of a
+// CoilCollection at once. The simd lanes run over consecutive quadrature
+// points, possibly of different coils, and the weights of the collection
+// already contain the currents and the factor 1e-7/numquadpoints, so the
+// result is the total field of all coils.
+//
+// This header uses fused_lane_t etc. from biot_savart_impl.h, which needs to
+// be included first.
+
+#if defined(USE_XSIMD)
+inline double fused_lane_sum(const fused_lane_t& x) { return xsimd::hadd(x); }
+inline void fused_store(double* ptr, const fused_lane_t& x) { x.store_aligned(ptr); }
+#else
+inline double fused_lane_sum(const fused_lane_t& x) { return x; }
+inline void fused_store(double* ptr, const fused_lane_t& x) { *ptr = x; }
+#endif
+
+// Writes F = B, or F = A if vector_potential is true, and its first `derivs`
+// derivatives at the points with indices in [point_start, point_end) into
+// F[3*i + a], dF[9*i + 3*k + a] and d2F[27*i + 9*k1 + 3*k2 + a].
+template<bool vector_potential, int derivs>
+void biot_savart_kernel_soa(const AlignedPaddedVec& pointsx, const AlignedPaddedVec& pointsy, const AlignedPaddedVec& pointsz,
+        const CoilCollection& coils, double* F, double* dF, double* d2F, int point_start, int point_end) {
+    int num_quad_points = coils.padded_size();
+    const double* gx = coils.x.data();
+    const double* gy = coils.y.data();
+    const double* gz = coils.z.data();
+    const double* tx = coils.dx.data();
+    const double* ty = coils.dy.data();
+    const double* tz = coils.dz.data();
+    const double* w = coils.weights.data();
+    fused_lane_t F_i[3], dF_i[9], d2F_i[27];
+    for (int i = point_start; i < point_end; ++i) {
+        fused_lane_t x[3] = {fused_lane_t(pointsx[i]), fused_lane_t(pointsy[i]), fused_lane_t(pointsz[i])};
+        for (int c = 0; c < 3; ++c)
+            F_i[c] = fused_lane_t(0.);
+        for (int c = 0; c < 9; ++c)
+            dF_i[c] = fused_lane_t(0.);
+        for (int c = 0; c < 27; ++c)
+            d2F_i[c] = fused_lane_t(0.);
+        for (int j = 0; j < num_quad_points; j += fused_simd_size) {
+            fused_lane_t wj = fused_load(w + j);
+            fused_lane_t t[3] = {wj*fused_load(tx + j), wj*fused_load(ty + j), wj*fused_load(tz + j)};
+            fused_lane_t diff[3] = {x[0] - fused_load(gx + j), x[1] - fused_load(gy + j), x[2] - fused_load(gz + j)};
+            fused_lane_t norm_diff_inv = rsqrt(diff[0]*diff[0] + diff[1]*diff[1] + diff[2]*diff[2]);
+            fused_lane_t norm_diff_2_inv = norm_diff_inv*norm_diff_inv;
+            fused_lane_t norm_diff_3_inv = norm_diff_2_inv*norm_diff_inv;
+            fused_lane_t norm_diff_5_inv, norm_diff_7_inv;
+            MYIF(derivs > 0)
+                norm_diff_5_inv = norm_diff_3_inv*norm_diff_2_inv;
+            MYIF(derivs > 1 && !vector_potential)
+                norm_diff_7_inv = norm_diff_5_inv*norm_diff_2_inv;
+
+            MYIF(!vector_potential) {
+                // B_a = (t x diff)_a / |diff|^3, see biot_savart_kernel_BA
+                fused_lane_t cr[3] = {t[1]*diff[2] - t[2]*diff[1], t[2]*diff[0] - t[0]*diff[2], t[0]*diff[1] - t[1]*diff[0]};
+                for (int a = 0; a < 3; ++a)
+                    F_i[a] += cr[a]*norm_diff_3_inv;
+                MYIF(derivs > 0) {
+                    fused_lane_t zero(0.);
+                    // t x e_k
+                    fused_lane_t txe[3][3] = {{zero, t[2], -t[1]}, {-t[2], zero, t[0]}, {t[1], -t[0], zero}};
+                    fused_lane_t m3_r5inv = (-3.)*norm_diff_5_inv;
+                    for (int k = 0; k < 3; ++k) {
+                        fused_lane_t diffk_m3_r5inv = diff[k]*m3_r5inv;
+                        for (int a = 0; a < 3; ++a)
+                            dF_i[3*k + a] += txe[k][a]*norm_diff_3_inv + cr[a]*diffk_m3_r5inv;
+                    }
+                    MYIF(derivs > 1) {
+                        fused_lane_t fifteen_r7inv = 15.*norm_diff_7_inv;
+                        for (int k1 = 0; k1 < 3; ++k1) {
+                            for (int k2 = 0; k2 <= k1; ++k2) {
+                                fused_lane_t fk = diff[k1]*diff[k2]*fifteen_r7inv;
+                                if(k1 == k2)
+                                    fk += m3_r5inv;
+                                for (int a = 0; a < 3; ++a)
+                                    d2F_i[9*k1 + 3*k2 + a] += (txe[k2][a]*diff[k1] + txe[k1][a]*diff[k2])*m3_r5inv + cr[a]*fk;
+                            }
+                        }
+                    }
+                }
+            } else {
+                // A_a = t_a / |diff|
+                for (int a = 0; a < 3; ++a)
+                    F_i[a] += t[a]*norm_diff_inv;
+                MYIF(derivs > 0) {
+                    for (int k = 0; k < 3; ++k) {
+                        fused_lane_t diffk_r3inv = diff[k]*norm_diff_3_inv;
+                        for (int a = 0; a < 3; ++a)
+                            dF_i[3*k + a] -= t[a]*diffk_r3inv;
+                    }
+                    MYIF(derivs > 1) {
+                        fused_lane_t three_r5inv = 3.*norm_diff_5_inv;
+                        for (int k1 = 0; k1 < 3; ++k1) {
+                            for (int k2 = 0; k2 <= k1; ++k2) {
+                                fused_lane_t fk = diff[k1]*diff[k2]*three_r5inv;
+                                if(k1 == k2)
+                                    fk -= norm_diff_3_inv;
+                                for (int a = 0; a < 3; ++a)
+                                    d2F_i[9*k1 + 3*k2 + a] += t[a]*fk;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        for (int a = 0; a < 3; ++a)
+            F[3*i + a] = fused_lane_sum(F_i[a]);
+        MYIF(derivs > 0) {
+            for (int c = 0; c < 9; ++c)
+                dF[9*i + c] = fused_lane_sum(dF_i[c]);
+        }
+        MYIF(derivs > 1) {
+            for (int k1 = 0; k1 < 3; ++k1) {
+                for (int k2 = 0; k2 <= k1; ++k2) {
+                    for (int a = 0; a < 3; ++a) {
+                        double val = fused_lane_sum(d2F_i[9*k1 + 3*k2 + a]);
+                        d2F[27*i + 9*k1 + 3*k2 + a] = val;
+                        d2F[27*i + 9*k2 + 3*k1 + a] = val;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// The vector Jacobian product of B for the quadrature points with indices in
+// [quad_start, quad_end), which have to be multiples of the simd size.
+// Computes, for unit weights,
+//
+//      res_gamma[j]     = \sum_i (t_j x v_i) / |diff|^3 + 3 diff (v_i . (t_j x diff)) / |diff|^5,
+//      res_gammadash[j] = \sum_i (diff x v_i) / |diff|^3,
+//
+// with diff = x_i - gamma_j, and stores component c of quadrature point j at
+// c*padded_size + j. Every quadrature point is owned by one call, so no
+// reduction over threads is required.
+template<class T>
+void biot_savart_vjp_kernel_soa(const AlignedPaddedVec& pointsx, const AlignedPaddedVec& pointsy, const AlignedPaddedVec& pointsz,
+        int num_points, T& v, const CoilCollection& coils, double* res_gamma, double* res_gammadash, int quad_start, int quad_end) {
+    int n = coils.padded_size();
+    const double* vptr = v.data();
+    for (int j = quad_start; j < quad_end; j += fused_simd_size) {
+        fused_lane_t g[3] = {fused_load(coils.x.data() + j), fused_load(coils.y.data() + j), fused_load(coils.z.data() + j)};
+        fused_lane_t t[3] = {fused_load(coils.dx.data() + j), fused_load(coils.dy.data() + j), fused_load(coils.dz.data() + j)};
+        fused_lane_t rg[3] = {fused_lane_t(0.), fused_lane_t(0.), fused_lane_t(0.)};
+        fused_lane_t rgd[3] = {fused_lane_t(0.), fused_lane_t(0.), fused_lane_t(0.)};
+        // t x v_i is linear in v_i, so sum the v_i / |diff|^3 first
+        fused_lane_t v_r3[3] = {fused_lane_t(0.), fused_lane_t(0.), fused_lane_t(0.)};
+        for (int i = 0; i < num_points; ++i) {
+            const double* v_i = vptr + 3*i;
+            fused_lane_t diff[3] = {fused_lane_t(pointsx[i]) - g[0], fused_lane_t(pointsy[i]) - g[1], fused_lane_t(pointsz[i]) - g[2]};
+            fused_lane_t norm_diff_inv = rsqrt(diff[0]*diff[0] + diff[1]*diff[1] + diff[2]*diff[2]);
+            fused_lane_t norm_diff_2_inv = norm_diff_inv*norm_diff_inv;
+            fused_lane_t norm_diff_3_inv = norm_diff_2_inv*norm_diff_inv;
+            fused_lane_t norm_diff_5_inv_times_3 = 3.*norm_diff_3_inv*norm_diff_2_inv;
+            rgd[0] += (diff[1]*v_i[2] - diff[2]*v_i[1])*norm_diff_3_inv;
+            rgd[1] += (diff[2]*v_i[0] - diff[0]*v_i[2])*norm_diff_3_inv;
+            rgd[2] += (diff[0]*v_i[1] - diff[1]*v_i[0])*norm_diff_3_inv;
+            for (int a = 0; a < 3; ++a)
+                v_r3[a] += v_i[a]*norm_diff_3_inv;
+            fused_lane_t cr[3] = {t[1]*diff[2] - t[2]*diff[1], t[2]*diff[0] - t[0]*diff[2], t[0]*diff[1] - t[1]*diff[0]};
+            fused_lane_t v_cr = (cr[0]*v_i[0] + cr[1]*v_i[1] + cr[2]*v_i[2])*norm_diff_5_inv_times_3;
+            for (int a = 0; a < 3; ++a)
+                rg[a] += diff[a]*v_cr;
+        }
+        rg[0] += t[1]*v_r3[2] - t[2]*v_r3[1];
+        rg[1] += t[2]*v_r3[0] - t[0]*v_r3[2];
+        rg[2] += t[0]*v_r3[1] - t[1]*v_r3[0];
+        for (int c = 0; c < 3; ++c) {
+            fused_store(res_gamma + c*n + j, rg[c]);
+            fused_store(res_gammadash + c*n + j, rgd[c]);
+        }
+    }
+}
@@ -0,0 +1,385 @@
+#pragma once
+
+#include "simdhelpers.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "xtensor/xlayout.hpp"
+
+using std::vector;
+
+// Treecode (Barnes-Hut) approximation of the Biot-Savart law for a single
+// coil.  The quadrature points of the coil are split recursively into
+// contiguous index ranges (since the quadrature points are ordered along the
+// curve, these are spatially coherent segments).  For each segment we store
+// the center c, the radius and the moments of the current elements
+//     S_a    = sum_j dgamma_a(phi_j)
+//     M_ab   = sum_j dgamma_a(phi_j) y_b(phi_j)
+//     Q_abc  = sum_j dgamma_a(phi_j) y_b(phi_j) y_c(phi_j)
+// with y = gamma - c.  If a target point x is far from a segment, i.e.
+// radius < theta * |x-c|, the contribution of the segment is approximated by a
+// second order Taylor expansion of the kernel around c. The relative error of
+// that approximation is O(theta^3), so `theta` is the user controlled accuracy
+// parameter. Segments that are too close to x are opened, and leaves are
+// evaluated directly.
+//
+// All quantities are expressed in terms of the derivative tensors D_n of
+// 1/|r| with r = x - c: for a current element dl at y, we have
+//     B_a(x) = -eps_abc dl_b D_c(x-y)
+//     A_a(x) = dl_a D(x-y)
+// and for a segment we replace dl_b D_c...(x-y) by
+//     S_b D_c...(r) - M_bd D_cd...(r) + 1/2 Q_bde D_cde...(r).
+
+namespace biot_savart_treecode {
+
+constexpr int pow3[7] = {1, 3, 9, 27, 81, 243, 729};
+
+struct Node {
+    int lo, hi;
+    int left, right;
+    double center[3];
+    double radius;
+    double S[3];
+    double M[9];
+    double Q[27];
+};
+
+// Derivative tensors D_n of 1/|r|, stored as flattened row-major arrays of
+// size 3^n.
+struct InverseDistanceDerivatives {
+    double D[6][243];
+
+    template<int order>
+    inline void compute(const double* r) {
+        double r2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+        double rinv = 1./std::sqrt(r2);
+        double rinv2 = rinv*rinv;
+        double rinv3 = rinv*rinv2;
+        double rinv5 = rinv3*rinv2;
+        double rinv7 = rinv5*rinv2;
+        D[0][0] = rinv;
+        if constexpr(order >= 1) {
+            for (int a = 0; a < 3; ++a)
+                D[1][a] = -r[a]*rinv3;
+        }
+        if constexpr(order >= 2) {
+            for (int a = 0; a < 3; ++a)
+                for (int b = 0; b < 3; ++b)
+                    D[2][3*a+b] = 3.*r[a]*r[b]*rinv5 - (a == b ? rinv3 : 0.);
+        }
+        if constexpr(order >= 3) {
+            for (int a = 0; a < 3; ++a)
+                for (int b = 0; b < 3; ++b)
+                    for (int c = 0; c < 3; ++c) {
+                        double delta_terms = (a == b ? r[c] : 0.) + (a == c ? r[b] : 0.) + (b == c ? r[a] : 0.);
+                        D[3][9*a+3*b+c] = 3.*delta_terms*rinv5 - 15.*r[a]*r[b]*r[c]*rinv7;
+                    }
+        }
+        if constexpr(order >= 4)
+            compute_generic(4, r, rinv);
+        if constexpr(order >= 5)
+            compute_generic(5, r, rinv);
+    }
+
+    private:
+        // Sum over all partial pairings of the indices in `idx` (restricted to
+        // `mask`) of prod(delta) * prod(r), sorted by the number of pairs.
+        static void pairings(const int* idx, int n, int mask, const double* r, double prod, int npairs, double* sums) {
+            if(mask == 0) {
+                sums[npairs] += prod;
+                return;
+            }
+            int i = 0;
+            while(!(mask & (1 << i)))
+                i++;
+            int rest = mask & ~(1 << i);
+            pairings(idx, n, rest, r, prod*r[idx[i]], npairs, sums);
+            for (int j = i+1; j < n; ++j) {
+                if((rest & (1 << j)) && idx[i] == idx[j])
+                    pairings(idx, n, rest & ~(1 << j), r, prod, npairs+1, sums);
+            }
+        }
+
+        // Uses
+        //     D_n = sum_p (-1)^(n-p) (2(n-p)-1)!! |r|^(-2(n-p)-1) sum_{p pairings} prod(delta) prod(r).
+        void compute_generic(int n, const double* r, double rinv) {
+            double coeff[3];
+            for (int p = 0; 2*p <= n; ++p) {
+                double fac = 1.;
+                for (int k = 2*(n-p)-1; k > 1; k -= 2)
+                    fac *= k;
+                coeff[p] = ((n-p) % 2 == 0 ? fac : -fac) * std::pow(rinv, 2*(n-p)+1);
+            }
+            int idx[5];
+            for (int flat = 0; flat < pow3[n]; ++flat) {
+                int rem = flat;
+                for (int k = n-1; k >= 0; --k) {
+                    idx[k] = rem % 3;
+                    rem /= 3;
+                }
+                double sums[3] = {0., 0., 0.};
+                pairings(idx, n, (1 << n) - 1, r, 1., 0, sums);
+                double val = 0.;
+                for (int p = 0; 2*p <= n; ++p)
+                    val += coeff[p]*sums[p];
+                D[n][flat] = val;
+            }
+        }
+};
+
+class Tree {
+    public:
+        vector<Node> nodes;
+        const double* gamma;
+        const double* dgamma_by_dphi;
+
+        Tree(const double* gamma, const double* dgamma_by_dphi, int num_quad_points, int leafsize) :
+            gamma(gamma), dgamma_by_dphi(dgamma_by_dphi) {
+            if(leafsize < 1)
+                throw std::runtime_error("leafsize needs to be positive.");
+            nodes.reserve(4*(num_quad_points/leafsize + 1));
+            build(0, num_quad_points, leafsize);
+        }
+
+        // Accumulate B, dB/dX and d2B/dXdX at x (without the 1e-7/nquad
+        // prefactor) into the arrays B[3], dB[3*3] and ddB[3*3*3].
+        template<int derivs>
+        void evaluate_B(const double* x, double theta, double* B, double* dB, double* ddB) const {
+            InverseDistanceDerivatives D;
+            double theta2 = theta*theta;
+            int stack[128];
+            int top = 0;
+            stack[top++] = 0;
+            while(top > 0) {
+                const Node& node = nodes[stack[--top]];
+                double r[3] = {x[0]-node.center[0], x[1]-node.center[1], x[2]-node.center[2]};
+                double dist2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+                if(node.radius*node.radius < theta2*dist2) {
+                    D.compute<derivs+3>(r);
+                    add_B<derivs, 2>(D, node.S, node.M, node.Q, B, dB, ddB);
+                } else if(node.left < 0) {
+                    for (int j = node.lo; j < node.hi; ++j) {
+                        double rj[3] = {x[0]-gamma[3*j+0], x[1]-gamma[3*j+1], x[2]-gamma[3*j+2]};
+                        D.compute<derivs+1>(rj);
+                        add_B<derivs, 0>(D, &(dgamma_by_dphi[3*j]), nullptr, nullptr, B, dB, ddB);
+                    }
+                } else {
+                    stack[top++] = node.left;
+                    stack[top++] = node.right;
+                }
+            }
+        }
+
+        // Accumulate A, dA/dX and d2A/dXdX at x (without the 1e-7/nquad
+        // prefactor) into the arrays A[3], dA[3*3] and ddA[3*3*3].
+        template<int derivs>
+        void evaluate_A(const double* x, double theta, double* A, double* dA, double* ddA) const {
+            InverseDistanceDerivatives D;
+            double theta2 = theta*theta;
+            int stack[128];
+            int top = 0;
+            stack[top++] = 0;
+            while(top > 0) {
+                const Node& node = nodes[stack[--top]];
+                double r[3] = {x[0]-node.center[0], x[1]-node.center[1], x[2]-node.center[2]};
+                double dist2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+                if(node.radius*node.radius < theta2*dist2) {
+                    D.compute<derivs+2>(r);
+                    add_A<derivs, 2>(D, node.S, node.M, node.Q, A, dA, ddA);
+                } else if(node.left < 0) {
+                    for (int j = node.lo; j < node.hi; ++j) {
+                        double rj[3] = {x[0]-gamma[3*j+0], x[1]-gamma[3*j+1], x[2]-gamma[3*j+2]};
+                        D.compute<derivs>(rj);
+                        add_A<derivs, 0>(D, &(dgamma_by_dphi[3*j]), nullptr, nullptr, A, dA, ddA);
+                    }
+                } else {
+                    stack[top++] = node.left;
+                    stack[top++] = node.right;
+                }
+            }
+        }
+
+    private:
+        int build(int lo, int hi, int leafsize) {
+            int idx = nodes.size();
+            nodes.push_back(Node());
+            Node node;
+            node.lo = lo;
+            node.hi = hi;
+            node.left = -1;
+            node.right = -1;
+            int n = hi - lo;
+            std::fill(node.center, node.center+3, 0.);
+            std::fill(node.S, node.S+3, 0.);
+            std::fill(node.M, node.M+9, 0.);
+            std::fill(node.Q, node.Q+27, 0.);
+            for (int j = lo; j < hi; ++j) {
+                for (int d = 0; d < 3; ++d) {
+                    node.center[d] += gamma[3*j+d]/n;
+                    node.S[d] += dgamma_by_dphi[3*j+d];
+                }
+            }
+            node.radius = 0.;
+            for (int j = lo; j < hi; ++j) {
+                double y[3] = {gamma[3*j+0]-node.center[0], gamma[3*j+1]-node.center[1], gamma[3*j+2]-node.center[2]};
+                node.radius = std::max(node.radius, std::sqrt(y[0]*y[0] + y[1]*y[1] + y[2]*y[2]));
+                for (int a = 0; a < 3; ++a) {
+                    double dl = dgamma_by_dphi[3*j+a];
+                    for (int b = 0; b < 3; ++b) {
+                        node.M[3*a+b] += dl*y[b];
+                        for (int c = 0; c < 3; ++c)
+                            node.Q[9*a+3*b+c] += dl*y[b]*y[c];
+                    }
+                }
+            }
+            if(n > leafsize) {
+                int mid = lo + n/2;
+                node.left = build(lo, mid, leafsize);
+                node.right = build(mid, hi, leafsize);
+            }
+            nodes[idx] = node;
+            return idx;
+        }
+
+        // sum_m (-1)^m/m! Mom_m[b, d...] D_{1+m+q}[c, d..., K...], where K is
+        // the multi index of the q derivatives with flat index Kflat.
+        template<int morder>
+        static inline double contract(const InverseDistanceDerivatives& D, const double* S, const double* M, const double* Q, int b, int c, int q, int Kflat) {
+            double res = S[b]*D.D[1+q][c*pow3[q] + Kflat];
+            if constexpr(morder >= 1) {
+                for (int d = 0; d < 3; ++d)
+                    res -= M[3*b+d]*D.D[2+q][c*pow3[q+1] + d*pow3[q] + Kflat];
+            }
+            if constexpr(morder >= 2) {
+                for (int d = 0; d < 9; ++d)
+                    res += 0.5*Q[9*b+d]*D.D[3+q][c*pow3[q+2] + d*pow3[q] + Kflat];
+            }
+            return res;
+        }
+
+        // Adds -eps_abc (S_b D_c - M_bd D_cd + 1/2 Q_bde D_cde) and its derivatives.
+        template<int derivs, int morder>
+        static inline void add_B(const InverseDistanceDerivatives& D, const double* S, const double* M, const double* Q, double* B, double* dB, double* ddB) {
+            for (int a = 0; a < 3; ++a) {
+                int b = (a+1)%3;
+                int c = (a+2)%3;
+                B[a] -= contract<morder>(D, S, M, Q, b, c, 0, 0) - contract<morder>(D, S, M, Q, c, b, 0, 0);
+                if constexpr(derivs > 0) {
+                    for (int k = 0; k < 3; ++k)
+                        dB[3*k+a] -= contract<morder>(D, S, M, Q, b, c, 1, k) - contract<morder>(D, S, M, Q, c, b, 1, k);
+                }
+                if constexpr(derivs > 1) {
+                    for (int kl = 0; kl < 9; ++kl)
+                        ddB[3*kl+a] -= contract<morder>(D, S, M, Q, b, c, 2, kl) - contract<morder>(D, S, M, Q, c, b, 2, kl);
+                }
+            }
+        }
+
+        // sum_m (-1)^m/m! Mom_m[a, d...] D_{m+q}[d..., K...]
+        template<int morder>
+        static inline double contract_A(const InverseDistanceDerivatives& D, const double* S, const double* M, const double* Q, int a, int q, int Kflat) {
+            double res = S[a]*D.D[q][Kflat];
+            if constexpr(morder >= 1) {
+                for (int d = 0; d < 3; ++d)
+                    res -= M[3*a+d]*D.D[1+q][d*pow3[q] + Kflat];
+            }
+            if constexpr(morder >= 2) {
+                for (int d = 0; d < 9; ++d)
+                    res += 0.5*Q[9*a+d]*D.D[2+q][d*pow3[q] + Kflat];
+            }
+            return res;
+        }
+
+        // Adds S_a D - M_ab D_b + 1/2 Q_abc D_bc and its derivatives.
+        template<int derivs, int morder>
+        static inline void add_A(const InverseDistanceDerivatives& D, const double* S, const double* M, const double* Q, double* A, double* dA, double* ddA) {
+            for (int a = 0; a < 3; ++a) {
+                A[a] += contract_A<morder>(D, S, M, Q, a, 0, 0);
+                if constexpr(derivs > 0) {
+                    for (int k = 0; k < 3; ++k)
+                        dA[3*k+a] += contract_A<morder>(D, S, M, Q, a, 1, k);
+                }
+                if constexpr(derivs > 1) {
+                    for (int kl = 0; kl < 9; ++kl)
+                        ddA[3*kl+a] += contract_A<morder>(D, S, M, Q, a, 2, kl);
+                }
+            }
+        }
+};
+
+}
+
+// The tree of a coil with at most `leafsize` quadrature points per leaf. It
+// only depends on the coil, so it can be built once and then be used to
+// evaluate any number of chunks of points, also concurrently.
+template<class T>
+biot_savart_treecode::Tree biot_savart_treecode_tree(T& gamma, T& dgamma_by_dphi, int leafsize) {
+    if(gamma.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("gamma needs to be in row-major storage order");
+    if(dgamma_by_dphi.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("dgamma_by_dphi needs to be in row-major storage order");
+    return biot_savart_treecode::Tree(&(gamma(0, 0)), &(dgamma_by_dphi(0, 0)), gamma.shape(0), leafsize);
+}
+
+// Same interface as `biot_savart_kernel` but using the treecode
+// approximation with opening parameter `theta` (theta = 0 gives the direct
+// sum), given the tree of the coil from `biot_savart_treecode_tree`. Only the
+// points with indices in [point_start, point_end) are evaluated.
+template<class T, int derivs>
+void biot_savart_treecode_kernel(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+            const biot_savart_treecode::Tree& tree, int num_quad_points, T& B, T& dB_by_dX, T& d2B_by_dXdX, double theta, int point_start=0, int point_end=-1) {
+    int num_points         = pointsx.size();
+    if(point_end < 0)
+        point_end = num_points;
+    double fak = (1e-7/num_quad_points);
+    for (int i = point_start; i < point_end; ++i) {
+        double x[3] = {pointsx[i], pointsy[i], pointsz[i]};
+        double B_i[3] = {0., 0., 0.};
+        double dB_i[9] = {0.};
+        double ddB_i[27] = {0.};
+        tree.evaluate_B<derivs>(x, theta, B_i, dB_i, ddB_i);
+        for (int a = 0; a < 3; ++a) {
+            B(i, a) = fak*B_i[a];
+            if constexpr(derivs > 0) {
+                for (int k = 0; k < 3; ++k)
+                    dB_by_dX(i, k, a) = fak*dB_i[3*k+a];
+            }
+            if constexpr(derivs > 1) {
+                for (int k = 0; k < 3; ++k)
+                    for (int l = 0; l < 3; ++l)
+                        d2B_by_dXdX(i, k, l, a) = fak*ddB_i[9*k+3*l+a];
+            }
+        }
+    }
+}
+
+// Same interface as `biot_savart_kernel_A` but using the treecode
+// approximation, see `biot_savart_treecode_kernel`.
+template<class T, int derivs>
+void biot_savart_treecode_kernel_A(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+            const biot_savart_treecode::Tree& tree, int num_quad_points, T& A, T& dA_by_dX, T& d2A_by_dXdX, double theta, int point_start=0, int point_end=-1) {
+    int num_points         = pointsx.size();
+    if(point_end < 0)
+        point_end = num_points;
+    double fak = (1e-7/num_quad_points);
+    for (int i = point_start; i < point_end; ++i) {
+        double x[3] = {pointsx[i], pointsy[i], pointsz[i]};
+        double A_i[3] = {0., 0., 0.};
+        double dA_i[9] = {0.};
+        double ddA_i[27] = {0.};
+        tree.evaluate_A<derivs>(x, theta, A_i, dA_i, ddA_i);
+        for (int a = 0; a < 3; ++a) {
+            A(i, a) = fak*A_i[a];
+            if constexpr(derivs > 0) {
+                for (int k = 0; k < 3; ++k)
+                    dA_by_dX(i, k, a) = fak*dA_i[3*k+a];
+            }
+            if constexpr(derivs > 1) {
+                for (int k = 0; k < 3; ++k)
+                    for (int l = 0; l < 3; ++l)
+                        d2A_by_dXdX(i, k, l, a) = fak*ddA_i[9*k+3*l+a];
+            }
+        }
+    }
+}
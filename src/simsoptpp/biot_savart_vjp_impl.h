@@ -505,3 +505,135 @@ void biot_savart_vector_potential_vjp_kernel(
 }
 
 #endif
+
+// Evaluates B (and dB_by_dX if derivs > 0) of a single coil like
+// biot_savart_kernel and, in the same sweep over all pairs of points and
+// quadrature points, adds the vector Jacobian product of B with respect to
+// gamma and dgamma_by_dphi to res_gamma and res_dgamma_by_dphi like
+// biot_savart_vjp_kernel<T, 0>. The pairwise quantities x_i - gamma_j,
+// |x_i - gamma_j|^{-3} and dgamma_j x (x_i - gamma_j) are shared by both.
+// As for the separate kernels, B and dB_by_dX include the prefactor
+// 1e-7/num_quad_points, while the vjp results don't. Only the points with
+// indices in [point_start, point_end) are considered, where point_end = -1
+// means all points. When using simd, point_start has to be a multiple of the
+// simd vector size.
+template<class T, int derivs>
+void biot_savart_kernel_and_vjp(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+            T& gamma, T& dgamma_by_dphi, T& v, T& B, T& dB_by_dX, T& res_gamma, T& res_dgamma_by_dphi,
+            int point_start=0, int point_end=-1) {
+    if(gamma.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("gamma needs to be in row-major storage order");
+    if(dgamma_by_dphi.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("dgamma_by_dphi needs to be in row-major storage order");
+    if(res_gamma.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("res_gamma needs to be in row-major storage order");
+    if(res_dgamma_by_dphi.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("res_dgamma_by_dphi needs to be in row-major storage order");
+    int num_points         = pointsx.size();
+    if(point_end < 0)
+        point_end = num_points;
+    int num_quad_points    = gamma.shape(0);
+    double fak = (1e-7/num_quad_points);
+    double* gamma_j_ptr = &(gamma(0, 0));
+    double* dgamma_j_by_dphi_ptr = &(dgamma_by_dphi(0, 0));
+    double* res_dgamma_by_dphi_ptr = &(res_dgamma_by_dphi(0, 0));
+    double* res_gamma_ptr = &(res_gamma(0, 0));
+    int i = point_start;
+#if defined(USE_XSIMD)
+    constexpr int simd_size = xsimd::simd_type<double>::size;
+    for(; i + simd_size <= point_end; i += simd_size) {
+        Vec3dSimd point_i = Vec3dSimd(&(pointsx[i]), &(pointsy[i]), &(pointsz[i]));
+        auto v_i = Vec3dSimd();
+        for(int k=0; k<simd_size; k++)
+            for (int d = 0; d < 3; ++d)
+                v_i[d][k] = v(i+k, d);
+        auto B_i = Vec3dSimd();
+        auto dB_dX_i = vector<Vec3dSimd, xs::aligned_allocator<Vec3dSimd, XSIMD_DEFAULT_ALIGNMENT>>{
+            Vec3dSimd(), Vec3dSimd(), Vec3dSimd()
+        };
+
+        for (int j = 0; j < num_quad_points; ++j) {
+            auto dgamma_j_by_dphi = Vec3d{ dgamma_j_by_dphi_ptr[3*j+0], dgamma_j_by_dphi_ptr[3*j+1], dgamma_j_by_dphi_ptr[3*j+2] };
+            auto diff = point_i - Vec3dSimd(gamma_j_ptr[3*j+0], gamma_j_ptr[3*j+1], gamma_j_ptr[3*j+2]);
+            auto norm_diff_2 = normsq(diff);
+            auto norm_diff_inv = rsqrt(norm_diff_2);
+            auto norm_diff_2_inv = norm_diff_inv*norm_diff_inv;
+            auto norm_diff_3_inv = norm_diff_2_inv*norm_diff_inv;
+            auto norm_diff_5_inv_times_3 = 3.*norm_diff_3_inv*norm_diff_2_inv;
+            auto cross_dgamma_j_by_dphi_diff = cross(dgamma_j_by_dphi, diff);
+
+            // forward
+            B_i += cross_dgamma_j_by_dphi_diff * norm_diff_3_inv;
+            MYIF(derivs > 0) {
+#pragma unroll
+                for(int k=0; k<3; k++) {
+                    dB_dX_i[k] += Vec3dSimd(cross(dgamma_j_by_dphi, k)) * norm_diff_3_inv;
+                    dB_dX_i[k] -= cross_dgamma_j_by_dphi_diff * (diff[k] * norm_diff_5_inv_times_3);
+                }
+            }
+
+            // vjp
+            auto res_dgamma_by_dphi_add = cross(diff, v_i) * norm_diff_3_inv;
+            res_dgamma_by_dphi_ptr[3*j+0] += xsimd::hadd(res_dgamma_by_dphi_add.x);
+            res_dgamma_by_dphi_ptr[3*j+1] += xsimd::hadd(res_dgamma_by_dphi_add.y);
+            res_dgamma_by_dphi_ptr[3*j+2] += xsimd::hadd(res_dgamma_by_dphi_add.z);
+
+            auto res_gamma_add = cross(dgamma_j_by_dphi, v_i) * norm_diff_3_inv;
+            res_gamma_add += diff * inner(cross_dgamma_j_by_dphi_diff, v_i) * (norm_diff_5_inv_times_3);
+            res_gamma_ptr[3*j+0] += xsimd::hadd(res_gamma_add.x);
+            res_gamma_ptr[3*j+1] += xsimd::hadd(res_gamma_add.y);
+            res_gamma_ptr[3*j+2] += xsimd::hadd(res_gamma_add.z);
+        }
+        for(int k=0; k<simd_size; k++) {
+            for (int d = 0; d < 3; ++d) {
+                B(i+k, d) = fak * B_i[d][k];
+                MYIF(derivs > 0) {
+                    for (int dd = 0; dd < 3; ++dd)
+                        dB_by_dX(i+k, dd, d) = fak * dB_dX_i[dd][d][k];
+                }
+            }
+        }
+    }
+#endif
+    for (; i < point_end; ++i) {
+        Vec3d point_i = Vec3d{pointsx[i], pointsy[i], pointsz[i]};
+        Vec3d v_i = Vec3d{v(i, 0), v(i, 1), v(i, 2)};
+        Vec3d B_i = Vec3d::Zero();
+        Vec3d dB_dX_i[3] = {Vec3d::Zero(), Vec3d::Zero(), Vec3d::Zero()};
+        for (int j = 0; j < num_quad_points; ++j) {
+            Vec3d diff = point_i - Vec3d{gamma_j_ptr[3*j+0], gamma_j_ptr[3*j+1], gamma_j_ptr[3*j+2]};
+            Vec3d dgamma_j_by_dphi = Vec3d{dgamma_j_by_dphi_ptr[3*j+0], dgamma_j_by_dphi_ptr[3*j+1], dgamma_j_by_dphi_ptr[3*j+2]};
+            double norm_diff = norm(diff);
+            double norm_diff_inv = 1/norm_diff;
+            double norm_diff_2_inv = norm_diff_inv*norm_diff_inv;
+            double norm_diff_3_inv = norm_diff_2_inv*norm_diff_inv;
+            double norm_diff_5_inv_times_3 = 3.*norm_diff_3_inv*norm_diff_2_inv;
+            Vec3d cross_dgamma_j_by_dphi_diff = cross(dgamma_j_by_dphi, diff);
+
+            // forward
+            B_i += cross_dgamma_j_by_dphi_diff * norm_diff_3_inv;
+            MYIF(derivs > 0) {
+                for(int k=0; k<3; k++) {
+                    dB_dX_i[k] += cross(dgamma_j_by_dphi, k) * norm_diff_3_inv;
+                    dB_dX_i[k] -= cross_dgamma_j_by_dphi_diff * (diff[k] * norm_diff_5_inv_times_3);
+                }
+            }
+
+            // vjp
+            Vec3d res_dgamma_by_dphi_add = cross(diff, v_i) * norm_diff_3_inv;
+            Vec3d res_gamma_add = cross(dgamma_j_by_dphi, v_i) * norm_diff_3_inv;
+            res_gamma_add += diff * inner(cross_dgamma_j_by_dphi_diff, v_i) * norm_diff_5_inv_times_3;
+            for (int d = 0; d < 3; ++d) {
+                res_dgamma_by_dphi_ptr[3*j+d] += res_dgamma_by_dphi_add.coeff(d);
+                res_gamma_ptr[3*j+d] += res_gamma_add.coeff(d);
+            }
+        }
+        for (int d = 0; d < 3; ++d) {
+            B(i, d) = fak * B_i.coeff(d);
+            MYIF(derivs > 0) {
+                for (int dd = 0; dd < 3; ++dd)
+                    dB_by_dX(i, dd, d) = fak * dB_dX_i[dd].coeff(d);
+            }
+        }
+    }
+}
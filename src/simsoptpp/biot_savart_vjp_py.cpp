@@ -1,7 +1,11 @@
 #include "biot_savart_vjp_impl.h"
 #include "biot_savart_vjp_py.h"
+#include "biot_savart_cuda.h"
+#include "perf_counters.h"
+#include "gil.h"
 
 void biot_savart_vjp(Array& points, vector<Array>& gammas, vector<Array>& dgamma_by_dphis, vector<double>& currents, Array& v, Array& vgrad, vector<Array>& dgamma_by_dcoeffs, vector<Array>& d2gamma_by_dphidcoeffs, vector<Array>& res_B, vector<Array>& res_dB){
+    SIMSOPT_PERF_SCOPE(biot_savart_vjp, points.shape(0));
     auto pointsx = AlignedPaddedVec(points.shape(0), 0);
     auto pointsy = AlignedPaddedVec(points.shape(0), 0);
     auto pointsz = AlignedPaddedVec(points.shape(0), 0);
@@ -31,6 +35,7 @@ void biot_savart_vjp(Array& points, vector<Array>& gammas, vector<Array>& dgamma
     }
     Array dummy = Array();
 
+    ReleaseGIL nogil;
     #pragma omp parallel for
     for(int i=0; i<num_coils; i++) {
         if(compute_dB)
@@ -63,7 +68,50 @@ void biot_savart_vjp(Array& points, vector<Array>& gammas, vector<Array>& dgamma
     }
 }
 
+#if defined(SIMSOPT_WITH_CUDA)
+// Runs biot_savart_vjp_graph on the device. The device state is shared between
+// calls, so that the points and coils are only transferred when they change.
+static void biot_savart_vjp_graph_cuda(Array& points, vector<Array>& gammas, vector<Array>& dgamma_by_dphis, vector<double>& currents, Array& v, vector<Array>& res_gamma, vector<Array>& res_dgamma_by_dphi, Array& vgrad, vector<Array>& res_grad_gamma, vector<Array>& res_grad_dgamma_by_dphi) {
+    static biot_savart_cuda::DeviceState state;
+    int num_points = points.shape(0);
+    int num_coils  = gammas.size();
+    bool compute_dB = res_grad_gamma.size() > 0;
+    vector<double> points_(3*num_points), v_(3*num_points), vgrad_(compute_dB ? 9*num_points : 0);
+    for (int i = 0; i < num_points; ++i) {
+        for (int l = 0; l < 3; ++l) {
+            points_[3*i+l] = points(i, l);
+            v_[3*i+l] = v(i, l);
+            if(compute_dB)
+                for (int k = 0; k < 3; ++k)
+                    vgrad_[9*i+3*k+l] = vgrad(i, k, l);
+        }
+    }
+    for(int i=0; i<num_coils; i++) {
+        if(gammas[i].layout() != xt::layout_type::row_major || dgamma_by_dphis[i].layout() != xt::layout_type::row_major)
+            throw std::runtime_error("gamma and dgamma_by_dphi need to be in row-major storage order");
+        state.B_vjp(i, points_.data(), num_points, gammas[i].data(), dgamma_by_dphis[i].data(), gammas[i].shape(0),
+                v_.data(), compute_dB ? vgrad_.data() : nullptr,
+                res_gamma[i].data(), res_dgamma_by_dphi[i].data(),
+                compute_dB ? res_grad_gamma[i].data() : nullptr, compute_dB ? res_grad_dgamma_by_dphi[i].data() : nullptr);
+        double fak = (currents[i] * 1e-7/gammas[i].shape(0));
+        res_gamma[i] *= fak;
+        res_dgamma_by_dphi[i] *= fak;
+        if(compute_dB) {
+            res_grad_gamma[i] *= fak;
+            res_grad_dgamma_by_dphi[i] *= fak;
+        }
+    }
+}
+#endif
+
 void biot_savart_vjp_graph(Array& points, vector<Array>& gammas, vector<Array>& dgamma_by_dphis, vector<double>& currents, Array& v, vector<Array>& res_gamma, vector<Array>& res_dgamma_by_dphi, Array& vgrad, vector<Array>& res_grad_gamma, vector<Array>& res_grad_dgamma_by_dphi) {
+    SIMSOPT_PERF_SCOPE(biot_savart_vjp, points.shape(0));
+#if defined(SIMSOPT_WITH_CUDA)
+    if(biot_savart_cuda::enabled()) {
+        biot_savart_vjp_graph_cuda(points, gammas, dgamma_by_dphis, currents, v, res_gamma, res_dgamma_by_dphi, vgrad, res_grad_gamma, res_grad_dgamma_by_dphi);
+        return;
+    }
+#endif
     auto pointsx = AlignedPaddedVec(points.shape(0), 0);
     auto pointsy = AlignedPaddedVec(points.shape(0), 0);
     auto pointsz = AlignedPaddedVec(points.shape(0), 0);
@@ -77,6 +125,7 @@ void biot_savart_vjp_graph(Array& points, vector<Array>& gammas, vector<Array>&
     bool compute_dB = res_grad_gamma.size() > 0;
     Array dummy = Array();
 
+    ReleaseGIL nogil;
     #pragma omp parallel for
     for(int i=0; i<num_coils; i++) {
         if(compute_dB)
@@ -99,6 +148,7 @@ void biot_savart_vjp_graph(Array& points, vector<Array>& gammas, vector<Array>&
 }
 
 void biot_savart_vector_potential_vjp_graph(Array& points, vector<Array>& gammas, vector<Array>& dgamma_by_dphis, vector<double>& currents, Array& v, vector<Array>& res_gamma, vector<Array>& res_dgamma_by_dphi, Array& vgrad, vector<Array>& res_grad_gamma, vector<Array>& res_grad_dgamma_by_dphi) {
+    SIMSOPT_PERF_SCOPE(biot_savart_vjp, points.shape(0));
     auto pointsx = AlignedPaddedVec(points.shape(0), 0);
     auto pointsy = AlignedPaddedVec(points.shape(0), 0);
     auto pointsz = AlignedPaddedVec(points.shape(0), 0);
@@ -112,6 +162,7 @@ void biot_savart_vector_potential_vjp_graph(Array& points, vector<Array>& gammas
     bool compute_dA = res_grad_gamma.size() > 0;
     Array dummy = Array();
 
+    ReleaseGIL nogil;
     #pragma omp parallel for
     for(int i=0; i<num_coils; i++) {
         if(compute_dA)
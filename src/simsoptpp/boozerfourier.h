@@ -0,0 +1,432 @@
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <numeric>
+#include <vector>
+#include "harmonics.h"
+
+using std::vector;
+
+// Fourier series in the Boozer angles as used by BoozerRadialInterpolant,
+//
+//      even:   f(theta, zeta) = \sum_i c_i cos(xm_i theta - xn_i zeta),
+//      odd:    f(theta, zeta) = \sum_i c_i sin(xm_i theta - xn_i zeta),
+//
+// and the projections of values at points (theta_p, zeta_p) onto the modes,
+//
+//      c_i = \sum_p f_p b_i(p) / \sum_p b_i(p)^2,
+//
+// where b_i is the cosine or sine of mode i. The first mode is skipped in odd
+// series, since it is the (0, 0) mode in the ordering of booz_xform.
+//
+// If the xm are integers and the xn integer multiples of a common factor
+// (nfp), the basis functions are computed from tables of cos(m theta) and
+// cos(n nfp zeta), which are filled with trig recurrences, instead of calling
+// sin and cos for every mode and point. If in addition the points form a
+// tensor product grid, e.g. a flattened np.meshgrid, the projection is
+// computed as a sum over theta for every m followed by a sum over zeta for
+// every mode, which takes O(N (mmax + modes/mmax)) instead of O(N modes)
+// operations for N points, and the synthesis of series whose coefficients
+// are the same at all points is computed in the opposite order.
+//
+// All routines work on a batch of nb series at once, e.g. one per radial
+// surface, and every sum is computed by one thread in a fixed order, so that
+// the results don't depend on the number of threads.
+
+// The points p = it*theta_stride + iz*zeta_stride, 0 <= it < ntheta,
+// 0 <= iz < nzeta, of a tensor product grid.
+struct BoozerGrid {
+    bool tensor = false;
+    int ntheta = 0, nzeta = 0;
+    int theta_stride = 0, zeta_stride = 0;
+};
+
+inline BoozerGrid boozer_tensor_grid(const double* thetas, const double* zetas, int num_points) {
+    BoozerGrid grid;
+    if(num_points == 0)
+        return grid;
+    // inner: the angle that varies fastest, outer: the other one
+    auto detect = [&](const double* inner, const double* outer) {
+        int n = 1;
+        while(n < num_points && outer[n] == outer[0])
+            ++n;
+        if(num_points % n != 0)
+            return 0;
+        for (int p = 0; p < num_points; ++p) {
+            if(inner[p] != inner[p % n] || outer[p] != outer[(p / n) * n])
+                return 0;
+        }
+        return n;
+    };
+    if(int n = detect(thetas, zetas)) {
+        grid.tensor = true;
+        grid.ntheta = n;
+        grid.nzeta = num_points / n;
+        grid.theta_stride = 1;
+        grid.zeta_stride = n;
+    } else if(int n = detect(zetas, thetas)) {
+        grid.tensor = true;
+        grid.nzeta = n;
+        grid.ntheta = num_points / n;
+        grid.zeta_stride = 1;
+        grid.theta_stride = n;
+    }
+    return grid;
+}
+
+class BoozerFourierModes {
+    private:
+        int num_modes;
+        vector<double> xm, xn;
+        // xm_i = m[i] and xn_i = n[i]*nfactor if integral is true
+        bool integral = true;
+        vector<int> m, n;
+        int mmax = 0, nmax = 0;
+        double nfactor = 1.;
+
+        static bool is_integer(double x) {
+            return std::abs(x - std::round(x)) <= 1e-12 * std::max(1., std::abs(x));
+        }
+
+        // cos(m theta), sin(m theta) for m = 0, ..., mmax and
+        // cos(n nfactor zeta), sin(n nfactor zeta) for n = 0, ..., nmax.
+        void fill_tables(double theta, double zeta, double* cm, double* sm, double* cn, double* sn) const {
+            fill_harmonics(theta, mmax, cm, sm);
+            fill_harmonics(nfactor*zeta, nmax, cn, sn);
+        }
+
+        // cos and sin of xm_i theta - xn_i zeta from the tables
+        inline void basis(int i, const double* cm, const double* sm, const double* cn, const double* sn, double& c, double& s) const {
+            int mi = m[i];
+            int ni = std::abs(n[i]);
+            double cz = cn[ni];
+            double sz = n[i] < 0 ? -sn[ni] : sn[ni];
+            c = cm[mi]*cz + sm[mi]*sz;
+            s = sm[mi]*cz - cm[mi]*sz;
+        }
+
+        template<bool odd>
+        inline double basis(int i, const double* cm, const double* sm, const double* cn, const double* sn) const {
+            double c, s;
+            basis(i, cm, sm, cn, sn, c, s);
+            return odd ? s : c;
+        }
+
+        template<bool odd>
+        inline double basis_direct(int i, double theta, double zeta) const {
+            double angle = xm[i]*theta - xn[i]*zeta;
+            return odd ? std::sin(angle) : std::cos(angle);
+        }
+
+        template<bool odd>
+        void synthesize_points(int num_points, const double* thetas, const double* zetas, int nb,
+                const double* c, long c_i, long c_p, long c_b, double* K, long K_p, long K_b) const;
+
+        template<bool odd>
+        void synthesize_tensor(const BoozerGrid& grid, const double* thetas, const double* zetas, int nb,
+                const double* c, long c_i, long c_b, double* K, long K_p, long K_b) const;
+
+        template<bool odd>
+        void analyze_tensor(const BoozerGrid& grid, const double* thetas, const double* zetas, int nb,
+                const double* K, long K_p, long K_b, double* out, long out_i, long out_b, bool normalize) const;
+
+        template<bool odd>
+        void analyze_points(int num_points, const double* thetas, const double* zetas, int nb,
+                const double* K, long K_p, long K_b, double* out, long out_i, long out_b, bool normalize) const;
+
+    public:
+        template<class Array>
+        BoozerFourierModes(const Array& xm_, const Array& xn_) : num_modes(xm_.size()), xm(xm_.begin(), xm_.end()), xn(xn_.begin(), xn_.end()), m(num_modes), n(num_modes) {
+            int gcd = 0;
+            for (int i = 0; i < num_modes; ++i) {
+                integral = integral && is_integer(xm[i]) && is_integer(xn[i]) && xm[i] >= 0;
+                if(integral)
+                    gcd = std::gcd(gcd, int(std::abs(std::lround(xn[i]))));
+            }
+            if(!integral)
+                return;
+            nfactor = gcd > 0 ? gcd : 1;
+            for (int i = 0; i < num_modes; ++i) {
+                m[i] = std::lround(xm[i]);
+                n[i] = std::lround(xn[i]) / int(nfactor);
+                mmax = std::max(mmax, m[i]);
+                nmax = std::max(nmax, std::abs(n[i]));
+            }
+        }
+
+        int size() const { return num_modes; }
+
+        // Number of doubles that for_each_mode needs for its table.
+        int table_size() const {
+            return integral ? 2*(mmax + 1) + 2*(nmax + 1) : 0;
+        }
+
+        // Calls f(i, c, s) with c = cos(xm_i theta - xn_i zeta) and
+        // s = sin(xm_i theta - xn_i zeta) for every mode i at a single point.
+        // The harmonics of theta and zeta are computed once into table, so
+        // that several series at this point can be summed in the same loop.
+        template<class F>
+        void for_each_mode(double theta, double zeta, double* table, F&& f) const {
+            if(!integral) {
+                for (int i = 0; i < num_modes; ++i) {
+                    double angle = xm[i]*theta - xn[i]*zeta;
+                    f(i, std::cos(angle), std::sin(angle));
+                }
+                return;
+            }
+            double* cm = table;
+            double* sm = cm + mmax + 1;
+            double* cn = sm + mmax + 1;
+            double* sn = cn + nmax + 1;
+            fill_tables(theta, zeta, cm, sm, cn, sn);
+            for (int i = 0; i < num_modes; ++i) {
+                double c, s;
+                basis(i, cm, sm, cn, sn, c, s);
+                f(i, c, s);
+            }
+        }
+
+        // K[p*K_p + b*K_b] += \sum_i c[i*c_i + p*c_p + b*c_b] b_i(theta_p, zeta_p)
+        // for 0 <= b < nb. c_p = 0 for coefficients that are the same at all
+        // points, and c_p != 0 for coefficients that vary from point to point,
+        // e.g. with the radial coordinate.
+        template<bool odd>
+        void synthesize(int num_points, const double* thetas, const double* zetas, int nb,
+                const double* c, long c_i, long c_p, long c_b, double* K, long K_p, long K_b) const {
+            if(integral && c_p == 0) {
+                BoozerGrid grid = boozer_tensor_grid(thetas, zetas, num_points);
+                if(grid.tensor) {
+                    synthesize_tensor<odd>(grid, thetas, zetas, nb, c, c_i, c_b, K, K_p, K_b);
+                    return;
+                }
+            }
+            synthesize_points<odd>(num_points, thetas, zetas, nb, c, c_i, c_p, c_b, K, K_p, K_b);
+        }
+
+        // out[i*out_i + b*out_b] = \sum_p K[p*K_p + b*K_b] b_i(p) / \sum_p b_i(p)^2
+        // for 0 <= b < nb, or the same without the division by the norm if
+        // normalize is false. For odd series, the first mode is set to zero.
+        template<bool odd>
+        void analyze(int num_points, const double* thetas, const double* zetas, int nb,
+                const double* K, long K_p, long K_b, double* out, long out_i, long out_b, bool normalize=true) const {
+            BoozerGrid grid = boozer_tensor_grid(thetas, zetas, num_points);
+            if(integral && grid.tensor)
+                analyze_tensor<odd>(grid, thetas, zetas, nb, K, K_p, K_b, out, out_i, out_b, normalize);
+            else
+                analyze_points<odd>(num_points, thetas, zetas, nb, K, K_p, K_b, out, out_i, out_b, normalize);
+            if(odd && num_modes > 0) {
+                for (int b = 0; b < nb; ++b)
+                    out[b*out_b] = 0.;
+            }
+        }
+};
+
+template<bool odd>
+void BoozerFourierModes::analyze_points(int num_points, const double* thetas, const double* zetas, int nb,
+        const double* K, long K_p, long K_b, double* out, long out_i, long out_b, bool normalize) const {
+    int first = odd ? 1 : 0;
+    // tables of all points, at [p*mstride + m] and [p*nstride + n]
+    int mstride = mmax + 1, nstride = nmax + 1;
+    vector<double> cm, sm, cn, sn;
+    if(integral) {
+        cm.resize(size_t(num_points)*mstride);
+        sm.resize(size_t(num_points)*mstride);
+        cn.resize(size_t(num_points)*nstride);
+        sn.resize(size_t(num_points)*nstride);
+#pragma omp parallel for schedule(static)
+        for (int p = 0; p < num_points; ++p)
+            fill_tables(thetas[p], zetas[p], &cm[size_t(p)*mstride], &sm[size_t(p)*mstride], &cn[size_t(p)*nstride], &sn[size_t(p)*nstride]);
+    }
+#pragma omp parallel
+    {
+        vector<double> acc(nb);
+#pragma omp for schedule(dynamic)
+        for (int i = first; i < num_modes; ++i) {
+            std::fill(acc.begin(), acc.end(), 0.);
+            double norm = 0.;
+            for (int p = 0; p < num_points; ++p) {
+                double bi = integral
+                    ? basis<odd>(i, &cm[size_t(p)*mstride], &sm[size_t(p)*mstride], &cn[size_t(p)*nstride], &sn[size_t(p)*nstride])
+                    : basis_direct<odd>(i, thetas[p], zetas[p]);
+                norm += bi*bi;
+                for (int b = 0; b < nb; ++b)
+                    acc[b] += K[p*K_p + b*K_b] * bi;
+            }
+            if(!normalize)
+                norm = 1.;
+            for (int b = 0; b < nb; ++b)
+                out[i*out_i + b*out_b] = acc[b] / norm;
+        }
+    }
+}
+
+template<bool odd>
+void BoozerFourierModes::analyze_tensor(const BoozerGrid& grid, const double* thetas, const double* zetas, int nb,
+        const double* K, long K_p, long K_b, double* out, long out_i, long out_b, bool normalize) const {
+    int first = odd ? 1 : 0;
+    int ntheta = grid.ntheta, nzeta = grid.nzeta;
+    // cos(q theta_it), sin(q theta_it) for q <= 2 mmax at [it*mstride + q], and
+    // the same for zeta, the doubled frequencies are needed for the norms
+    int mstride = 2*mmax + 1, nstride = 2*nmax + 1;
+    vector<double> ct(size_t(ntheta)*mstride), st(size_t(ntheta)*mstride);
+    vector<double> cz(size_t(nzeta)*nstride), sz(size_t(nzeta)*nstride);
+    for (int it = 0; it < ntheta; ++it)
+        fill_harmonics(thetas[it*grid.theta_stride], 2*mmax, &ct[size_t(it)*mstride], &st[size_t(it)*mstride]);
+    for (int iz = 0; iz < nzeta; ++iz)
+        fill_harmonics(nfactor*zetas[iz*grid.zeta_stride], 2*nmax, &cz[size_t(iz)*nstride], &sz[size_t(iz)*nstride]);
+
+    // C[(q*nzeta + iz)*nb + b] = \sum_it K(it, iz, b) cos(q theta_it), S the same with sin
+    vector<double> C(size_t(mmax + 1)*nzeta*nb), S(size_t(mmax + 1)*nzeta*nb);
+#pragma omp parallel for collapse(2) schedule(static)
+    for (int q = 0; q <= mmax; ++q) {
+        for (int iz = 0; iz < nzeta; ++iz) {
+            double* Cq = &C[(size_t(q)*nzeta + iz)*nb];
+            double* Sq = &S[(size_t(q)*nzeta + iz)*nb];
+            for (int b = 0; b < nb; ++b) {
+                Cq[b] = 0.;
+                Sq[b] = 0.;
+            }
+            for (int it = 0; it < ntheta; ++it) {
+                double c = ct[size_t(it)*mstride + q];
+                double s = st[size_t(it)*mstride + q];
+                const double* Kp = K + long(it*grid.theta_stride + iz*grid.zeta_stride)*K_p;
+                for (int b = 0; b < nb; ++b) {
+                    Cq[b] += Kp[b*K_b] * c;
+                    Sq[b] += Kp[b*K_b] * s;
+                }
+            }
+        }
+    }
+
+    // \sum_it cos(q theta_it) and \sum_it sin(q theta_it), the same for zeta
+    vector<double> sum_ct(mstride, 0.), sum_st(mstride, 0.), sum_cz(nstride, 0.), sum_sz(nstride, 0.);
+    for (int it = 0; it < ntheta; ++it) {
+        for (int q = 0; q < mstride; ++q) {
+            sum_ct[q] += ct[size_t(it)*mstride + q];
+            sum_st[q] += st[size_t(it)*mstride + q];
+        }
+    }
+    for (int iz = 0; iz < nzeta; ++iz) {
+        for (int q = 0; q < nstride; ++q) {
+            sum_cz[q] += cz[size_t(iz)*nstride + q];
+            sum_sz[q] += sz[size_t(iz)*nstride + q];
+        }
+    }
+
+#pragma omp parallel
+    {
+        vector<double> acc(nb);
+#pragma omp for schedule(static)
+        for (int i = first; i < num_modes; ++i) {
+            int mi = m[i];
+            int ni = std::abs(n[i]);
+            double sign = n[i] < 0 ? -1. : 1.;
+            std::fill(acc.begin(), acc.end(), 0.);
+            for (int iz = 0; iz < nzeta; ++iz) {
+                double c = cz[size_t(iz)*nstride + ni];
+                double s = sign*sz[size_t(iz)*nstride + ni];
+                const double* Cq = &C[(size_t(mi)*nzeta + iz)*nb];
+                const double* Sq = &S[(size_t(mi)*nzeta + iz)*nb];
+                for (int b = 0; b < nb; ++b) {
+                    // sin(a - b) = sin a cos b - cos a sin b, cos(a - b) = cos a cos b + sin a sin b
+                    acc[b] += odd ? Sq[b]*c - Cq[b]*s : Cq[b]*c + Sq[b]*s;
+                }
+            }
+            // \sum_p b_i(p)^2 = (N -+ \sum_p cos(2 xm theta_p - 2 xn zeta_p))/2
+            double sum_cos2 = sum_ct[2*mi]*sum_cz[2*ni] + sum_st[2*mi]*sign*sum_sz[2*ni];
+            double norm = normalize ? 0.5*(double(ntheta)*nzeta + (odd ? -sum_cos2 : sum_cos2)) : 1.;
+            for (int b = 0; b < nb; ++b)
+                out[i*out_i + b*out_b] = acc[b] / norm;
+        }
+    }
+}
+
+template<bool odd>
+void BoozerFourierModes::synthesize_points(int num_points, const double* thetas, const double* zetas, int nb,
+        const double* c, long c_i, long c_p, long c_b, double* K, long K_p, long K_b) const {
+    int first = odd ? 1 : 0;
+#pragma omp parallel
+    {
+        vector<double> tables(integral ? 2*(mmax + 1) + 2*(nmax + 1) : 0);
+        double* cm = tables.data();
+        double* sm = cm + (mmax + 1);
+        double* cn = sm + (mmax + 1);
+        double* sn = cn + (nmax + 1);
+        vector<double> acc(nb);
+#pragma omp for schedule(static)
+        for (int p = 0; p < num_points; ++p) {
+            if(integral)
+                fill_tables(thetas[p], zetas[p], cm, sm, cn, sn);
+            std::fill(acc.begin(), acc.end(), 0.);
+            for (int i = first; i < num_modes; ++i) {
+                double bi = integral ? basis<odd>(i, cm, sm, cn, sn) : basis_direct<odd>(i, thetas[p], zetas[p]);
+                const double* ci = c + i*c_i + p*c_p;
+                for (int b = 0; b < nb; ++b)
+                    acc[b] += ci[b*c_b] * bi;
+            }
+            for (int b = 0; b < nb; ++b)
+                K[p*K_p + b*K_b] += acc[b];
+        }
+    }
+}
+
+// The transpose of analyze_tensor: with
+//      P_q(iz, b) = \sum_{i: m_i = q} c_ib cos(xn_i zeta_iz),
+//      Q_q(iz, b) = \sum_{i: m_i = q} c_ib sin(xn_i zeta_iz),
+// the series are \sum_q cos(q theta) P_q + sin(q theta) Q_q if even and
+// \sum_q sin(q theta) P_q - cos(q theta) Q_q if odd, which takes
+// O(nzeta modes + N mmax) instead of O(N modes) operations.
+template<bool odd>
+void BoozerFourierModes::synthesize_tensor(const BoozerGrid& grid, const double* thetas, const double* zetas, int nb,
+        const double* c, long c_i, long c_b, double* K, long K_p, long K_b) const {
+    int first = odd ? 1 : 0;
+    int ntheta = grid.ntheta, nzeta = grid.nzeta;
+    int mstride = mmax + 1, nstride = nmax + 1;
+    vector<double> ct(size_t(ntheta)*mstride), st(size_t(ntheta)*mstride);
+    vector<double> cz(size_t(nzeta)*nstride), sz(size_t(nzeta)*nstride);
+    for (int it = 0; it < ntheta; ++it)
+        fill_harmonics(thetas[it*grid.theta_stride], mmax, &ct[size_t(it)*mstride], &st[size_t(it)*mstride]);
+    for (int iz = 0; iz < nzeta; ++iz)
+        fill_harmonics(nfactor*zetas[iz*grid.zeta_stride], nmax, &cz[size_t(iz)*nstride], &sz[size_t(iz)*nstride]);
+
+    // P and Q at [(iz*mstride + q)*nb + b]
+    vector<double> P(size_t(nzeta)*mstride*nb, 0.), Q(size_t(nzeta)*mstride*nb, 0.);
+#pragma omp parallel for schedule(static)
+    for (int iz = 0; iz < nzeta; ++iz) {
+        for (int i = first; i < num_modes; ++i) {
+            int ni = std::abs(n[i]);
+            double cn = cz[size_t(iz)*nstride + ni];
+            double sn = n[i] < 0 ? -sz[size_t(iz)*nstride + ni] : sz[size_t(iz)*nstride + ni];
+            double* Pq = &P[(size_t(iz)*mstride + m[i])*nb];
+            double* Qq = &Q[(size_t(iz)*mstride + m[i])*nb];
+            const double* ci = c + i*c_i;
+            for (int b = 0; b < nb; ++b) {
+                Pq[b] += ci[b*c_b] * cn;
+                Qq[b] += ci[b*c_b] * sn;
+            }
+        }
+    }
+
+#pragma omp parallel
+    {
+        vector<double> acc(nb);
+#pragma omp for collapse(2) schedule(static)
+        for (int iz = 0; iz < nzeta; ++iz) {
+            for (int it = 0; it < ntheta; ++it) {
+                std::fill(acc.begin(), acc.end(), 0.);
+                for (int q = 0; q <= mmax; ++q) {
+                    double cq = ct[size_t(it)*mstride + q];
+                    double sq = st[size_t(it)*mstride + q];
+                    const double* Pq = &P[(size_t(iz)*mstride + q)*nb];
+                    const double* Qq = &Q[(size_t(iz)*mstride + q)*nb];
+                    for (int b = 0; b < nb; ++b)
+                        acc[b] += odd ? sq*Pq[b] - cq*Qq[b] : cq*Pq[b] + sq*Qq[b];
+                }
+                double* Kp = K + long(it*grid.theta_stride + iz*grid.zeta_stride)*K_p;
+                for (int b = 0; b < nb; ++b)
+                    Kp[b*K_b] += acc[b];
+            }
+        }
+    }
+}
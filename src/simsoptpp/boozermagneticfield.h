@@ -16,6 +16,19 @@ using std::vector;
 using std::shared_ptr;
 using std::make_shared;
 
+// Values of a BoozerMagneticField at a single point, as needed by the guiding
+// center equations, see BoozerMagneticField::evaluate_point. Which of them
+// are computed depends on the equations:
+//  - vacuum: modB, its derivatives, G and iota,
+//  - noK: additionally I, dGds and dIds,
+//  - full: additionally K and its derivatives.
+struct BoozerPointValues {
+    enum Equations { vacuum, noK, full };
+    double modB, dmodBds, dmodBdtheta, dmodBdzeta, G, iota;
+    double I, dGds, dIds;
+    double K, dKdtheta, dKdzeta;
+};
+
 template<template<class, std::size_t, xt::layout_type> class T>
 class BoozerMagneticField {
     public:
@@ -71,6 +84,7 @@ class BoozerMagneticField {
           data_dnudtheta, data_dnudzeta, data_dnuds, data_nu_derivs, data_dKdtheta, \
           data_dKdzeta, data_K_derivs, data_d2modBdtheta2, data_d2modBdzeta2, data_d2modBdthetadzeta;
         int npoints;
+        Tensor2 single_point = Tensor2({{0., 0., 0.}});
 
     public:
         BoozerMagneticField(double psi0) : psi0(psi0) {
@@ -125,6 +139,44 @@ class BoozerMagneticField {
             return *this;
         }
 
+        // Returns a field that evaluates to the same values as this one but
+        // has its own cache, so that the two can be evaluated concurrently
+        // with evaluate_point for the given equations on different threads.
+        // Expensive data such as interpolation tables is shared. Fields that
+        // do not support this return nullptr.
+        virtual shared_ptr<BoozerMagneticField<T>> thread_copy(BoozerPointValues::Equations equations) {
+            return nullptr;
+        }
+
+        // Evaluates the quantities needed by the given guiding center
+        // equations at the single point (s, theta, zeta). This is used by the
+        // right hand sides in tracing, so fields that can evaluate a point
+        // cheaply override it to skip the cache and avoid any allocation. The
+        // default implementation goes through set_points, so it changes the
+        // points of the field.
+        virtual void evaluate_point(double s, double theta, double zeta, BoozerPointValues& values, BoozerPointValues::Equations equations) {
+            single_point(0, 0) = s;
+            single_point(0, 1) = theta;
+            single_point(0, 2) = zeta;
+            this->set_points(single_point);
+            values.modB = modB_ref()(0);
+            values.dmodBds = modB_derivs_ref()(0);
+            values.dmodBdtheta = modB_derivs_ref()(1);
+            values.dmodBdzeta = modB_derivs_ref()(2);
+            values.G = G_ref()(0);
+            values.iota = iota_ref()(0);
+            if(equations == BoozerPointValues::vacuum)
+                return;
+            values.I = I_ref()(0);
+            values.dGds = dGds_ref()(0);
+            values.dIds = dIds_ref()(0);
+            if(equations == BoozerPointValues::noK)
+                return;
+            values.K = K_ref()(0);
+            values.dKdtheta = K_derivs_ref()(0);
+            values.dKdzeta = K_derivs_ref()(1);
+        }
+
         Tensor2 get_points() {
             return get_points_ref();
         }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include "boozermagneticfield.h"
 #include "xtensor/xlayout.hpp"
 #include "regular_grid_interpolant_3d.h"
@@ -34,11 +36,47 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         const bool stellsym = false;
         const int nfp = 1;
         vector<bool> symmetries = vector<bool>(1, false);
+        std::string cache_prefix;
+        int value_bits = 64;
+
+        // The fused interpolant, see set_fused: all fused quantities are
+        // interleaved in one interpolant, fused[i] describes where the values
+        // of the i-th quantity are stored and into which cache they go.
+        enum class Symmetry { none, odd, even };
+        struct FusedQuantity {
+            std::string name;
+            int size;
+            Symmetry symmetry; // how the values change under stellarator symmetry, see apply_odd_symmetry and apply_even_symmetry
+            bool fluxfunction;
+            CachedTensor<T, 2>* cache;
+            int offset;
+        };
+        static constexpr int max_fused_size = 64;
+        std::vector<FusedQuantity> fused;
+        int fused_size = 0;
+        bool fused_fluxfunctions_only = false;
+        // offsets of modB, modB_derivs, G, iota, I, dGds, dIds, K, K_derivs
+        // in the fused values, -1 if not fused. Used by evaluate_point.
+        int fused_point_offsets[9] = {-1, -1, -1, -1, -1, -1, -1, -1, -1};
+        shared_ptr<RegularGridInterpolant3D<Tensor2>> interp_fused;
+        bool status_fused = false;
+        CachedTensor<T, 2> fused_values;
+
+        shared_ptr<RegularGridInterpolant3D<Tensor2>> make_interpolant(const std::string& name,
+                RangeTriplet range0, RangeTriplet range1, RangeTriplet range2, int value_size) {
+            auto interp = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, range0, range1, range2, value_size, extrapolate);
+            interp->set_value_bits(value_bits);
+            if(!cache_prefix.empty())
+                interp->set_cache_file(cache_prefix + "_" + name + ".rgi");
+            return interp;
+        }
 
     protected:
       void _psip_impl(Tensor2& psip) override {
+          if(evaluate_fused("psip", psip))
+              return;
           if(!interp_psip)
-              interp_psip = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+              interp_psip = make_interpolant("psip", s_range, angle0_range, angle0_range, 1);
           if(!status_psip) {
               Tensor2 old_points = this->field->get_points();
               string which_scalar = "psip";
@@ -56,8 +94,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
       }
 
         void _G_impl(Tensor2& G) override {
+            if(evaluate_fused("G", G))
+                return;
             if(!interp_G)
-                interp_G = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+                interp_G = make_interpolant("G", s_range, angle0_range, angle0_range, 1);
             if(!status_G) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "G";
@@ -75,8 +115,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _I_impl(Tensor2& I) override {
+            if(evaluate_fused("I", I))
+                return;
             if(!interp_I)
-                interp_I = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+                interp_I = make_interpolant("I", s_range, angle0_range, angle0_range, 1);
             if(!status_I) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "I";
@@ -94,8 +136,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _iota_impl(Tensor2& iota) override {
+            if(evaluate_fused("iota", iota))
+                return;
             if(!interp_iota)
-                interp_iota = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+                interp_iota = make_interpolant("iota", s_range, angle0_range, angle0_range, 1);
             if(!status_iota) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "iota";
@@ -113,8 +157,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dGds_impl(Tensor2& dGds) override {
+            if(evaluate_fused("dGds", dGds))
+                return;
             if(!interp_dGds)
-                interp_dGds = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+                interp_dGds = make_interpolant("dGds", s_range, angle0_range, angle0_range, 1);
             if(!status_dGds) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dGds";
@@ -132,8 +178,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dIds_impl(Tensor2& dIds) override {
+            if(evaluate_fused("dIds", dIds))
+                return;
             if(!interp_dIds)
-                interp_dIds = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+                interp_dIds = make_interpolant("dIds", s_range, angle0_range, angle0_range, 1);
             if(!status_dIds) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dIds";
@@ -151,8 +199,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _diotads_impl(Tensor2& diotads) override {
+            if(evaluate_fused("diotads", diotads))
+                return;
             if(!interp_diotads)
-                interp_diotads = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+                interp_diotads = make_interpolant("diotads", s_range, angle0_range, angle0_range, 1);
             if(!status_diotads) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "diotads";
@@ -170,8 +220,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _K_impl(Tensor2& K) override {
+            if(evaluate_fused("K", K))
+                return;
             if(!interp_K)
-                interp_K = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_K = make_interpolant("K", s_range, theta_range, zeta_range, 1);
             if(!status_K) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "K";
@@ -192,8 +244,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dKdtheta_impl(Tensor2& dKdtheta) override {
+            if(evaluate_fused("dKdtheta", dKdtheta))
+                return;
             if(!interp_dKdtheta)
-                interp_dKdtheta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dKdtheta = make_interpolant("dKdtheta", s_range, theta_range, zeta_range, 1);
             if(!status_dKdtheta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dKdtheta";
@@ -211,8 +265,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dKdzeta_impl(Tensor2& dKdzeta) override {
+            if(evaluate_fused("dKdzeta", dKdzeta))
+                return;
             if(!interp_dKdzeta)
-                interp_dKdzeta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dKdzeta = make_interpolant("dKdzeta", s_range, theta_range, zeta_range, 1);
             if(!status_dKdzeta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dKdzeta";
@@ -230,8 +286,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _K_derivs_impl(Tensor2& K_derivs) override {
+            if(evaluate_fused("K_derivs", K_derivs))
+                return;
             if(!interp_K_derivs)
-                interp_K_derivs = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 2, extrapolate);
+                interp_K_derivs = make_interpolant("K_derivs", s_range, theta_range, zeta_range, 2);
             if(!status_K_derivs) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "K_derivs";
@@ -249,8 +307,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _nu_impl(Tensor2& nu) override {
+            if(evaluate_fused("nu", nu))
+                return;
             if(!interp_nu)
-                interp_nu = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_nu = make_interpolant("nu", s_range, theta_range, zeta_range, 1);
             if(!status_nu) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "nu";
@@ -271,8 +331,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dnudtheta_impl(Tensor2& dnudtheta) override {
+            if(evaluate_fused("dnudtheta", dnudtheta))
+                return;
             if(!interp_dnudtheta)
-                interp_dnudtheta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dnudtheta = make_interpolant("dnudtheta", s_range, theta_range, zeta_range, 1);
             if(!status_dnudtheta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dnudtheta";
@@ -290,8 +352,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dnudzeta_impl(Tensor2& dnudzeta) override {
+            if(evaluate_fused("dnudzeta", dnudzeta))
+                return;
             if(!interp_dnudzeta)
-                interp_dnudzeta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dnudzeta = make_interpolant("dnudzeta", s_range, theta_range, zeta_range, 1);
             if(!status_dnudzeta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dnudzeta";
@@ -309,8 +373,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dnuds_impl(Tensor2& dnuds) override {
+            if(evaluate_fused("dnuds", dnuds))
+                return;
             if(!interp_dnuds)
-                interp_dnuds = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dnuds = make_interpolant("dnuds", s_range, theta_range, zeta_range, 1);
             if(!status_dnuds) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dnuds";
@@ -331,8 +397,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _nu_derivs_impl(Tensor2& nu_derivs) override {
+            if(evaluate_fused("nu_derivs", nu_derivs))
+                return;
             if(!interp_nu_derivs)
-                interp_nu_derivs = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 3, extrapolate);
+                interp_nu_derivs = make_interpolant("nu_derivs", s_range, theta_range, zeta_range, 3);
             if(!status_nu_derivs) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "nu_derivs";
@@ -353,8 +421,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _R_impl(Tensor2& R) override {
+            if(evaluate_fused("R", R))
+                return;
             if(!interp_R)
-                interp_R = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_R = make_interpolant("R", s_range, theta_range, zeta_range, 1);
             if(!status_R) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "R";
@@ -372,8 +442,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dRdtheta_impl(Tensor2& dRdtheta) override {
+            if(evaluate_fused("dRdtheta", dRdtheta))
+                return;
             if(!interp_dRdtheta)
-                interp_dRdtheta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dRdtheta = make_interpolant("dRdtheta", s_range, theta_range, zeta_range, 1);
             if(!status_dRdtheta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dRdtheta";
@@ -394,8 +466,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dRdzeta_impl(Tensor2& dRdzeta) override {
+            if(evaluate_fused("dRdzeta", dRdzeta))
+                return;
             if(!interp_dRdzeta)
-                interp_dRdzeta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dRdzeta = make_interpolant("dRdzeta", s_range, theta_range, zeta_range, 1);
             if(!status_dRdzeta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dRdzeta";
@@ -416,8 +490,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dRds_impl(Tensor2& dRds) override {
+            if(evaluate_fused("dRds", dRds))
+                return;
             if(!interp_dRds)
-                interp_dRds = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dRds = make_interpolant("dRds", s_range, theta_range, zeta_range, 1);
             if(!status_dRds) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dRds";
@@ -435,8 +511,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _R_derivs_impl(Tensor2& R_derivs) override {
+            if(evaluate_fused("R_derivs", R_derivs))
+                return;
             if(!interp_R_derivs)
-                interp_R_derivs = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 3, extrapolate);
+                interp_R_derivs = make_interpolant("R_derivs", s_range, theta_range, zeta_range, 3);
             if(!status_R_derivs) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "R_derivs";
@@ -457,8 +535,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _Z_impl(Tensor2& Z) override {
+            if(evaluate_fused("Z", Z))
+                return;
             if(!interp_Z)
-                interp_Z = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_Z = make_interpolant("Z", s_range, theta_range, zeta_range, 1);
             if(!status_Z) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "Z";
@@ -479,8 +559,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dZdtheta_impl(Tensor2& dZdtheta) override {
+            if(evaluate_fused("dZdtheta", dZdtheta))
+                return;
             if(!interp_dZdtheta)
-                interp_dZdtheta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dZdtheta = make_interpolant("dZdtheta", s_range, theta_range, zeta_range, 1);
             if(!status_dZdtheta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dZdtheta";
@@ -498,8 +580,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dZdzeta_impl(Tensor2& dZdzeta) override {
+            if(evaluate_fused("dZdzeta", dZdzeta))
+                return;
             if(!interp_dZdzeta)
-                interp_dZdzeta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dZdzeta = make_interpolant("dZdzeta", s_range, theta_range, zeta_range, 1);
             if(!status_dZdzeta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dZdzeta";
@@ -517,8 +601,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dZds_impl(Tensor2& dZds) override {
+            if(evaluate_fused("dZds", dZds))
+                return;
             if(!interp_dZds)
-                interp_dZds = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dZds = make_interpolant("dZds", s_range, theta_range, zeta_range, 1);
             if(!status_dZds) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dZds";
@@ -539,8 +625,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _Z_derivs_impl(Tensor2& Z_derivs) override {
+            if(evaluate_fused("Z_derivs", Z_derivs))
+                return;
             if(!interp_Z_derivs)
-                interp_Z_derivs = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 3, extrapolate);
+                interp_Z_derivs = make_interpolant("Z_derivs", s_range, theta_range, zeta_range, 3);
             if(!status_Z_derivs) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "Z_derivs";
@@ -561,8 +649,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _modB_impl(Tensor2& modB) override {
+            if(evaluate_fused("modB", modB))
+                return;
             if(!interp_modB)
-                interp_modB = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_modB = make_interpolant("modB", s_range, theta_range, zeta_range, 1);
             if(!status_modB) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "modB";
@@ -580,8 +670,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dmodBdtheta_impl(Tensor2& dmodBdtheta) override {
+            if(evaluate_fused("dmodBdtheta", dmodBdtheta))
+                return;
             if(!interp_dmodBdtheta)
-                interp_dmodBdtheta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dmodBdtheta = make_interpolant("dmodBdtheta", s_range, theta_range, zeta_range, 1);
             if(!status_dmodBdtheta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dmodBdtheta";
@@ -602,8 +694,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dmodBdzeta_impl(Tensor2& dmodBdzeta) override {
+            if(evaluate_fused("dmodBdzeta", dmodBdzeta))
+                return;
             if(!interp_dmodBdzeta)
-                interp_dmodBdzeta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dmodBdzeta = make_interpolant("dmodBdzeta", s_range, theta_range, zeta_range, 1);
             if(!status_dmodBdzeta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dmodBdzeta";
@@ -624,8 +718,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _dmodBds_impl(Tensor2& dmodBds) override {
+            if(evaluate_fused("dmodBds", dmodBds))
+                return;
             if(!interp_dmodBds)
-                interp_dmodBds = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_dmodBds = make_interpolant("dmodBds", s_range, theta_range, zeta_range, 1);
             if(!status_dmodBds) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "dmodBds";
@@ -643,8 +739,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _modB_derivs_impl(Tensor2& modB_derivs) override {
+            if(evaluate_fused("modB_derivs", modB_derivs))
+                return;
             if(!interp_modB_derivs)
-                interp_modB_derivs = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 3, extrapolate);
+                interp_modB_derivs = make_interpolant("modB_derivs", s_range, theta_range, zeta_range, 3);
             if(!status_modB_derivs) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "modB_derivs";
@@ -665,8 +763,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _d2modBdtheta2_impl(Tensor2& d2modBdtheta2) override {
+            if(evaluate_fused("d2modBdtheta2", d2modBdtheta2))
+                return;
             if(!interp_d2modBdtheta2)
-                interp_d2modBdtheta2 = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_d2modBdtheta2 = make_interpolant("d2modBdtheta2", s_range, theta_range, zeta_range, 1);
             if(!status_d2modBdtheta2) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "d2modBdtheta2";
@@ -684,8 +784,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _d2modBdthetadzeta_impl(Tensor2& d2modBdthetadzeta) override {
+            if(evaluate_fused("d2modBdthetadzeta", d2modBdthetadzeta))
+                return;
             if(!interp_d2modBdthetadzeta)
-                interp_d2modBdthetadzeta = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_d2modBdthetadzeta = make_interpolant("d2modBdthetadzeta", s_range, theta_range, zeta_range, 1);
             if(!status_d2modBdthetadzeta) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "d2modBdthetadzeta";
@@ -703,8 +805,10 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
         }
 
         void _d2modBdzeta2_impl(Tensor2& d2modBdzeta2) override {
+            if(evaluate_fused("d2modBdzeta2", d2modBdzeta2))
+                return;
             if(!interp_d2modBdzeta2)
-                interp_d2modBdzeta2 = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                interp_d2modBdzeta2 = make_interpolant("d2modBdzeta2", s_range, theta_range, zeta_range, 1);
             if(!status_d2modBdzeta2) {
                 Tensor2 old_points = this->field->get_points();
                 string which_scalar = "d2modBdzeta2";
@@ -733,50 +837,58 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
             }
         }
 
+        // Maps (theta, zeta) to the domain of the interpolants and returns
+        // whether the stellarator symmetry was used for that.
+        bool exploit_symmetries_point(double& theta, double& zeta){
+            double period = (2*M_PI)/nfp;
+            bool symmetric;
+            // Restrict theta to [0,2 pi]
+            int theta_mult = int(theta/(2*M_PI));
+            theta = theta - theta_mult * 2*M_PI;
+            if (theta < 0) {
+              theta = theta + 2*M_PI;
+            }
+            if (theta > 2*M_PI) {
+              theta = theta - 2*M_PI;
+            }
+            // Restrict zeta to [0,2 pi/nfp]
+            int zeta_mult = int(zeta/period);
+            zeta = zeta - zeta_mult * period;
+            if (zeta < 0) {
+              zeta = zeta + period;
+            }
+            if (zeta > period) {
+              zeta = zeta - period;
+            }
+            assert(theta >= 0);
+            assert(theta <= 2*M_PI);
+            assert(zeta >= 0);
+            assert(zeta <= period);
+            if(theta > M_PI && stellsym) {
+                zeta = period-zeta;
+                theta = 2*M_PI-theta;
+                symmetric = true;
+                assert(theta >= 0);
+                assert(theta <= M_PI);
+                assert(zeta >= 0);
+                assert(zeta <= period);
+            } else{
+                symmetric = false;
+            }
+            return symmetric;
+        }
+
         void exploit_symmetries_points(Tensor2& stz, Tensor2& stz_sym){
             int npoints = stz.shape(0);
             if(symmetries.size() != npoints)
                 symmetries = vector<bool>(npoints, false);
-            double period = (2*M_PI)/nfp;
             double* dataptr = &(stz(0, 0));
             double* datasymptr = &(stz_sym(0, 0));
             for (int i = 0; i < npoints; ++i) {
                 double s = dataptr[3*i+0];
                 double theta = dataptr[3*i+1];
                 double zeta = dataptr[3*i+2];
-                // Restrict theta to [0,2 pi]
-                int theta_mult = int(theta/(2*M_PI));
-                theta = theta - theta_mult * 2*M_PI;
-                if (theta < 0) {
-                  theta = theta + 2*M_PI;
-                }
-                if (theta > 2*M_PI) {
-                  theta = theta - 2*M_PI;
-                }
-                // Restrict zeta to [0,2 pi/nfp]
-                int zeta_mult = int(zeta/period);
-                zeta = zeta - zeta_mult * period;
-                if (zeta < 0) {
-                  zeta = zeta + period;
-                }
-                if (zeta > period) {
-                  zeta = zeta - period;
-                }
-                assert(theta >= 0);
-                assert(theta <= 2*M_PI);
-                assert(zeta >= 0);
-                assert(zeta <= period);
-                if(theta > M_PI && stellsym) {
-                    zeta = period-zeta;
-                    theta = 2*M_PI-theta;
-                    symmetries[i] = true;
-                    assert(theta >= 0);
-                    assert(theta <= M_PI);
-                    assert(zeta >= 0);
-                    assert(zeta <= period);
-                } else{
-                    symmetries[i] = false;
-                }
+                symmetries[i] = exploit_symmetries_point(theta, zeta);
                 datasymptr[3*i+0] = s;
                 datasymptr[3*i+1] = theta;
                 datasymptr[3*i+2] = zeta;
@@ -897,6 +1009,156 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
             return Vec(scalar.data(), scalar.data()+npoints);
         }
 
+        // all quantities that can be fused, with offset 0
+        std::vector<FusedQuantity> fusable_quantities() {
+            return {
+                {"modB", 1, Symmetry::none, false, &this->data_modB, 0},
+                {"dmodBdtheta", 1, Symmetry::odd, false, &this->data_dmodBdtheta, 0},
+                {"dmodBdzeta", 1, Symmetry::odd, false, &this->data_dmodBdzeta, 0},
+                {"dmodBds", 1, Symmetry::none, false, &this->data_dmodBds, 0},
+                {"modB_derivs", 3, Symmetry::even, false, &this->data_modB_derivs, 0},
+                {"d2modBdtheta2", 1, Symmetry::none, false, &this->data_d2modBdtheta2, 0},
+                {"d2modBdzeta2", 1, Symmetry::none, false, &this->data_d2modBdzeta2, 0},
+                {"d2modBdthetadzeta", 1, Symmetry::none, false, &this->data_d2modBdthetadzeta, 0},
+                {"K", 1, Symmetry::odd, false, &this->data_K, 0},
+                {"dKdtheta", 1, Symmetry::none, false, &this->data_dKdtheta, 0},
+                {"dKdzeta", 1, Symmetry::none, false, &this->data_dKdzeta, 0},
+                {"K_derivs", 2, Symmetry::none, false, &this->data_K_derivs, 0},
+                {"nu", 1, Symmetry::odd, false, &this->data_nu, 0},
+                {"dnudtheta", 1, Symmetry::none, false, &this->data_dnudtheta, 0},
+                {"dnudzeta", 1, Symmetry::none, false, &this->data_dnudzeta, 0},
+                {"dnuds", 1, Symmetry::odd, false, &this->data_dnuds, 0},
+                {"nu_derivs", 3, Symmetry::odd, false, &this->data_nu_derivs, 0},
+                {"R", 1, Symmetry::none, false, &this->data_R, 0},
+                {"dRdtheta", 1, Symmetry::odd, false, &this->data_dRdtheta, 0},
+                {"dRdzeta", 1, Symmetry::odd, false, &this->data_dRdzeta, 0},
+                {"dRds", 1, Symmetry::none, false, &this->data_dRds, 0},
+                {"R_derivs", 3, Symmetry::even, false, &this->data_R_derivs, 0},
+                {"Z", 1, Symmetry::odd, false, &this->data_Z, 0},
+                {"dZdtheta", 1, Symmetry::none, false, &this->data_dZdtheta, 0},
+                {"dZdzeta", 1, Symmetry::none, false, &this->data_dZdzeta, 0},
+                {"dZds", 1, Symmetry::odd, false, &this->data_dZds, 0},
+                {"Z_derivs", 3, Symmetry::odd, false, &this->data_Z_derivs, 0},
+                {"psip", 1, Symmetry::none, true, &this->data_psip, 0},
+                {"G", 1, Symmetry::none, true, &this->data_G, 0},
+                {"I", 1, Symmetry::none, true, &this->data_I, 0},
+                {"iota", 1, Symmetry::none, true, &this->data_iota, 0},
+                {"dGds", 1, Symmetry::none, true, &this->data_dGds, 0},
+                {"dIds", 1, Symmetry::none, true, &this->data_dIds, 0},
+                {"diotads", 1, Symmetry::none, true, &this->data_diotads, 0},
+            };
+        }
+
+        Vec fbatch_fused(Vec s, Vec theta, Vec zeta) {
+            int npoints = s.size();
+            Vec res(npoints*fused_size, 0.);
+            for (auto& q : fused) {
+                Vec vals = fbatch_scalar(s, theta, zeta, q.name);
+                for (int i = 0; i < npoints; ++i)
+                    for (int c = 0; c < q.size; ++c)
+                        res[i*fused_size + q.offset + c] = vals[i*q.size + c];
+            }
+            return res;
+        }
+
+        void build_fused() {
+            if(!interp_fused) {
+                // the cache file depends on the fused quantities and their
+                // order, which is summarized by a FNV-1a hash of the names
+                uint64_t hash = 14695981039346656037ull;
+                for (auto& q : fused) {
+                    for (char c : q.name + ",") {
+                        hash ^= (unsigned char) c;
+                        hash *= 1099511628211ull;
+                    }
+                }
+                std::string name = fmt::format("fused{}_{:016x}", fused.size(), hash);
+                if(fused_fluxfunctions_only)
+                    interp_fused = make_interpolant(name, s_range, angle0_range, angle0_range, fused_size);
+                else
+                    interp_fused = make_interpolant(name, s_range, theta_range, zeta_range, fused_size);
+            }
+            if(!status_fused) {
+                Tensor2 old_points = this->field->get_points();
+                std::function<Vec(Vec, Vec, Vec)> fbatch = [this](Vec s, Vec theta, Vec zeta) {
+                  return fbatch_fused(s, theta, zeta);
+                };
+                interp_fused->interpolate_batch(fbatch);
+                this->field->set_points(old_points);
+                status_fused = true;
+            }
+        }
+
+        // If name is fused, evaluates the fused interpolant at the current
+        // points, writes the values of name to out and those of all other
+        // fused quantities to their caches, unless they are cached already.
+        // Returns whether name is fused.
+        bool evaluate_fused(const std::string& name, Tensor2& out) {
+            auto requested = std::find_if(fused.begin(), fused.end(), [&name](const FusedQuantity& q) { return q.name == name; });
+            if(requested == fused.end())
+                return false;
+            build_fused();
+            Tensor2& stz = this->get_points_ref();
+            Tensor2& stz_sym = points_cyl_sym.get_or_create({npoints, 3});
+            if(fused_fluxfunctions_only)
+                exploit_fluxfunction_points(stz, stz_sym);
+            else
+                exploit_symmetries_points(stz, stz_sym);
+            Tensor2& vals = fused_values.get_or_create({npoints, fused_size});
+            std::fill(vals.data(), vals.data() + size_t(npoints)*fused_size, 0.);
+            interp_fused->evaluate_batch(stz_sym, vals);
+            for (auto q = fused.begin(); q != fused.end(); ++q) {
+                if(q != requested && q->cache->get_status())
+                    continue;
+                Tensor2& target = (q == requested) ? out : q->cache->get_or_create({npoints, q->size});
+                for (int i = 0; i < npoints; ++i)
+                    for (int c = 0; c < q->size; ++c)
+                        target(i, c) = vals(i, q->offset + c);
+                if(stellsym && !fused_fluxfunctions_only) {
+                    if(q->symmetry == Symmetry::odd)
+                        apply_odd_symmetry(target);
+                    else if(q->symmetry == Symmetry::even)
+                        apply_even_symmetry(target);
+                }
+            }
+            return true;
+        }
+
+        // evaluate_point with a single lookup in the fused interpolant.
+        // Returns false if it is not built yet or some of the quantities
+        // needed by the equations are not fused.
+        bool evaluate_point_fused(double s, double theta, double zeta, BoozerPointValues& values, BoozerPointValues::Equations equations) {
+            int needed = equations == BoozerPointValues::vacuum ? 4 : (equations == BoozerPointValues::noK ? 7 : 9);
+            if(!status_fused)
+                return false;
+            for (int i = 0; i < needed; ++i) {
+                if(fused_point_offsets[i] < 0)
+                    return false;
+            }
+            const int* offsets = fused_point_offsets;
+            double vals[max_fused_size] = {};
+            bool symmetric = exploit_symmetries_point(theta, zeta);
+            interp_fused->evaluate_inplace(s, theta, zeta, vals);
+            double sign = symmetric ? -1. : 1.;
+            values.modB = vals[offsets[0]];
+            values.dmodBds = vals[offsets[1]];
+            values.dmodBdtheta = sign*vals[offsets[1]+1];
+            values.dmodBdzeta = sign*vals[offsets[1]+2];
+            values.G = vals[offsets[2]];
+            values.iota = vals[offsets[3]];
+            if(equations == BoozerPointValues::vacuum)
+                return true;
+            values.I = vals[offsets[4]];
+            values.dGds = vals[offsets[5]];
+            values.dIds = vals[offsets[6]];
+            if(equations == BoozerPointValues::noK)
+                return true;
+            values.K = sign*vals[offsets[7]];
+            values.dKdtheta = vals[offsets[8]];
+            values.dKdzeta = vals[offsets[8]+1];
+            return true;
+        }
+
     public:
         const shared_ptr<BoozerMagneticField<T>> field;
         const RangeTriplet s_range, theta_range, zeta_range, angle0_range = {0., M_PI, 1};
@@ -915,9 +1177,172 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
                 RangeTriplet s_range, RangeTriplet theta_range, RangeTriplet zeta_range,
                 bool extrapolate, int nfp, bool stellsym) : InterpolatedBoozerField(field, UniformInterpolationRule(degree), s_range, theta_range, zeta_range, extrapolate, nfp, stellsym) {}
 
+        void evaluate_point(double s, double theta, double zeta, BoozerPointValues& values, BoozerPointValues::Equations equations) override {
+            if(evaluate_point_fused(s, theta, zeta, values, equations))
+                return;
+            // the first evaluation builds the interpolants through the cache
+            bool built = status_modB && status_modB_derivs && status_G && status_iota;
+            if(equations != BoozerPointValues::vacuum)
+                built = built && status_I && status_dGds && status_dIds;
+            if(equations == BoozerPointValues::full)
+                built = built && status_K && status_K_derivs;
+            if(!built)
+                return BoozerMagneticField<T>::evaluate_point(s, theta, zeta, values, equations);
+            bool symmetric = exploit_symmetries_point(theta, zeta);
+            double modB_derivs[3] = {0., 0., 0.};
+            values.modB = 0.;
+            interp_modB->evaluate_inplace(s, theta, zeta, &values.modB);
+            interp_modB_derivs->evaluate_inplace(s, theta, zeta, modB_derivs);
+            if(symmetric) {
+                modB_derivs[1] = -modB_derivs[1];
+                modB_derivs[2] = -modB_derivs[2];
+            }
+            values.dmodBds = modB_derivs[0];
+            values.dmodBdtheta = modB_derivs[1];
+            values.dmodBdzeta = modB_derivs[2];
+            // flux functions, see exploit_fluxfunction_points
+            values.G = 0.;
+            values.iota = 0.;
+            interp_G->evaluate_inplace(s, 0., 0., &values.G);
+            interp_iota->evaluate_inplace(s, 0., 0., &values.iota);
+            if(equations == BoozerPointValues::vacuum)
+                return;
+            values.I = 0.;
+            values.dGds = 0.;
+            values.dIds = 0.;
+            interp_I->evaluate_inplace(s, 0., 0., &values.I);
+            interp_dGds->evaluate_inplace(s, 0., 0., &values.dGds);
+            interp_dIds->evaluate_inplace(s, 0., 0., &values.dIds);
+            if(equations == BoozerPointValues::noK)
+                return;
+            double K_derivs[2] = {0., 0.};
+            values.K = 0.;
+            interp_K->evaluate_inplace(s, theta, zeta, &values.K);
+            interp_K_derivs->evaluate_inplace(s, theta, zeta, K_derivs);
+            if(symmetric)
+                values.K = -values.K;
+            values.dKdtheta = K_derivs[0];
+            values.dKdzeta = K_derivs[1];
+        }
+
+        // Caches each interpolant in the file prefix + "_" + name + ".rgi",
+        // with the name of the interpolated quantity, e.g. "modB", see
+        // RegularGridInterpolant3D::set_cache_file. Only affects the
+        // interpolants that are created afterwards, so this has to be called
+        // before the field is evaluated.
+        void set_cache(const std::string& prefix) {
+            cache_prefix = prefix;
+        }
+
+        // Stores the values of the interpolants with 64, 32 or 16 bits, see
+        // RegularGridInterpolant3D::set_value_bits. As for set_cache, this
+        // has to be called before the field is evaluated.
+        void set_value_bits(int bits) {
+            if(bits != 64 && bits != 32 && bits != 16)
+                throw std::invalid_argument("bits has to be 64, 32 or 16.");
+            value_bits = bits;
+        }
+
+        // Interpolates the given quantities, e.g. {"modB", "modB_derivs",
+        // "G", "iota"}, in a single interpolant with one value per quantity
+        // and component, so that a point is only located once for all of
+        // them. Whenever one of these quantities is requested, the values of
+        // all the others are written to their caches as well, and
+        // evaluate_point needs a single lookup if modB, modB_derivs, G, iota
+        // and, depending on the equations, I, dGds, dIds, K and K_derivs are
+        // fused. Flux functions are constant in theta and zeta on the 3D grid,
+        // so they are interpolated as accurately as on their own. An empty
+        // list turns the fused interpolant off. As for set_cache, this has to
+        // be called before the field is evaluated.
+        void set_fused(const std::vector<std::string>& names) {
+            std::vector<FusedQuantity> quantities = fusable_quantities();
+            std::vector<FusedQuantity> new_fused;
+            int size = 0;
+            for (auto& name : names) {
+                auto q = std::find_if(quantities.begin(), quantities.end(), [&name](const FusedQuantity& q) { return q.name == name; });
+                if(q == quantities.end())
+                    throw std::invalid_argument(fmt::format("{} is not a quantity of InterpolatedBoozerField.", name));
+                for (auto& other : new_fused) {
+                    if(other.name == name)
+                        throw std::invalid_argument(fmt::format("{} is fused twice.", name));
+                }
+                new_fused.push_back(*q);
+                new_fused.back().offset = size;
+                size += q->size;
+            }
+            if(size > max_fused_size)
+                throw std::invalid_argument(fmt::format("The fused quantities have more than {} values.", max_fused_size));
+            fused = new_fused;
+            fused_size = size;
+            fused_fluxfunctions_only = std::all_of(fused.begin(), fused.end(), [](const FusedQuantity& q) { return q.fluxfunction; });
+            const char* point_names[9] = {"modB", "modB_derivs", "G", "iota", "I", "dGds", "dIds", "K", "K_derivs"};
+            for (int i = 0; i < 9; ++i) {
+                fused_point_offsets[i] = -1;
+                for (auto& q : fused) {
+                    if(q.name == point_names[i])
+                        fused_point_offsets[i] = q.offset;
+                }
+            }
+            interp_fused = nullptr;
+            status_fused = false;
+        }
+
+        std::vector<std::string> get_fused() const {
+            std::vector<std::string> names;
+            for (auto& q : fused)
+                names.push_back(q.name);
+            return names;
+        }
+
+        shared_ptr<BoozerMagneticField<T>> thread_copy(BoozerPointValues::Equations equations) override {
+            // build the interpolants that evaluate_point needs now, so that
+            // all copies share them and never have to evaluate the underlying
+            // field
+            Tensor2 old_points = this->get_points();
+            Tensor2 stz({{std::get<0>(s_range), std::get<0>(theta_range), std::get<0>(zeta_range)}});
+            this->set_points(stz);
+            this->modB_ref();
+            this->modB_derivs_ref();
+            this->G_ref();
+            this->iota_ref();
+            if(equations != BoozerPointValues::vacuum) {
+                this->I_ref();
+                this->dGds_ref();
+                this->dIds_ref();
+            }
+            if(equations == BoozerPointValues::full) {
+                this->K_ref();
+                this->K_derivs_ref();
+            }
+            this->set_points(old_points);
+            auto copy = std::make_shared<InterpolatedBoozerField<T>>(field, rule, s_range, theta_range, zeta_range, extrapolate, nfp, stellsym);
+            copy->interp_modB = interp_modB;
+            copy->interp_modB_derivs = interp_modB_derivs;
+            copy->interp_G = interp_G;
+            copy->interp_iota = interp_iota;
+            copy->interp_I = interp_I;
+            copy->interp_dGds = interp_dGds;
+            copy->interp_dIds = interp_dIds;
+            copy->interp_K = interp_K;
+            copy->interp_K_derivs = interp_K_derivs;
+            copy->status_modB = status_modB;
+            copy->status_modB_derivs = status_modB_derivs;
+            copy->status_G = status_G;
+            copy->status_iota = status_iota;
+            copy->status_I = status_I;
+            copy->status_dGds = status_dGds;
+            copy->status_dIds = status_dIds;
+            copy->status_K = status_K;
+            copy->status_K_derivs = status_K_derivs;
+            copy->set_fused(get_fused());
+            copy->interp_fused = interp_fused;
+            copy->status_fused = status_fused;
+            return copy;
+        }
+
                 std::pair<double, double> estimate_error_modB(int samples) {
                     if(!interp_modB) {
-                      interp_modB = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                      interp_modB = make_interpolant("modB", s_range, theta_range, zeta_range, 1);
                     }
                     std::function<Vec(Vec, Vec, Vec)> fbatch = [this](Vec s, Vec theta, Vec zeta) {
                       return fbatch_scalar(s,theta,zeta,"modB");
@@ -933,7 +1358,7 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
 
                 std::pair<double, double> estimate_error_K(int samples) {
                     if(!interp_K) {
-                      interp_K = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                      interp_K = make_interpolant("K", s_range, theta_range, zeta_range, 1);
                     }
                     std::function<Vec(Vec, Vec, Vec)> fbatch = [this](Vec s, Vec theta, Vec zeta) {
                       return fbatch_scalar(s,theta,zeta,"K");
@@ -949,7 +1374,7 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
 
                 std::pair<double, double> estimate_error_R(int samples) {
                     if(!interp_R) {
-                      interp_R = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                      interp_R = make_interpolant("R", s_range, theta_range, zeta_range, 1);
                     }
                     std::function<Vec(Vec, Vec, Vec)> fbatch = [this](Vec s, Vec theta, Vec zeta) {
                       return fbatch_scalar(s,theta,zeta,"R");
@@ -965,7 +1390,7 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
 
                 std::pair<double, double> estimate_error_Z(int samples) {
                     if(!interp_Z) {
-                      interp_Z = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                      interp_Z = make_interpolant("Z", s_range, theta_range, zeta_range, 1);
                     }
                     std::function<Vec(Vec, Vec, Vec)> fbatch = [this](Vec s, Vec theta, Vec zeta) {
                       return fbatch_scalar(s,theta,zeta,"Z");
@@ -981,7 +1406,7 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
 
                 std::pair<double, double> estimate_error_nu(int samples) {
                     if(!interp_nu) {
-                      interp_nu = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, theta_range, zeta_range, 1, extrapolate);
+                      interp_nu = make_interpolant("nu", s_range, theta_range, zeta_range, 1);
                     }
                     std::function<Vec(Vec, Vec, Vec)> fbatch = [this](Vec s, Vec theta, Vec zeta) {
                       return fbatch_scalar(s,theta,zeta,"nu");
@@ -997,7 +1422,7 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
 
                 std::pair<double, double> estimate_error_G(int samples) {
                     if(!interp_G) {
-                      interp_G = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+                      interp_G = make_interpolant("G", s_range, angle0_range, angle0_range, 1);
                     }
                     std::function<Vec(Vec, Vec, Vec)> fbatch = [this](Vec s, Vec theta, Vec zeta) {
                       return fbatch_scalar(s,theta,zeta,"G");
@@ -1013,7 +1438,7 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
 
                 std::pair<double, double> estimate_error_I(int samples) {
                     if(!interp_I) {
-                      interp_I = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+                      interp_I = make_interpolant("I", s_range, angle0_range, angle0_range, 1);
                     }
                     std::function<Vec(Vec, Vec, Vec)> fbatch = [this](Vec s, Vec theta, Vec zeta) {
                       return fbatch_scalar(s,theta,zeta,"I");
@@ -1029,7 +1454,7 @@ class InterpolatedBoozerField : public BoozerMagneticField<T> {
 
                 std::pair<double, double> estimate_error_iota(int samples) {
                     if(!interp_iota) {
-                      interp_iota = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, s_range, angle0_range, angle0_range, 1, extrapolate);
+                      interp_iota = make_interpolant("iota", s_range, angle0_range, angle0_range, 1);
                     }
                     std::function<Vec(Vec, Vec, Vec)> fbatch = [this](Vec s, Vec theta, Vec zeta) {
                       return fbatch_scalar(s,theta,zeta,"iota");
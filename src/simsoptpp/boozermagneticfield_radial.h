@@ -0,0 +1,470 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include "boozermagneticfield.h"
+#include "boozerfourier.h"
+
+using std::string;
+
+// The radial splines of BoozerRadialInterpolant. Flux functions have a single
+// spline, all other quantities one spline per Fourier mode.
+enum RadialSpline {
+    SPLINE_psip = 0, SPLINE_G, SPLINE_I, SPLINE_iota, SPLINE_dGds, SPLINE_dIds, SPLINE_diotads,
+    SPLINE_mn_factor, SPLINE_d_mn_factor,
+    SPLINE_bmnc, SPLINE_dbmncds, SPLINE_bmns, SPLINE_dbmnsds,
+    SPLINE_rmnc, SPLINE_drmncds, SPLINE_rmns, SPLINE_drmnsds,
+    SPLINE_zmnc, SPLINE_dzmncds, SPLINE_zmns, SPLINE_dzmnsds,
+    SPLINE_numnc, SPLINE_dnumncds, SPLINE_numns, SPLINE_dnumnsds,
+    SPLINE_kmnc, SPLINE_kmns,
+    NUM_RADIAL_SPLINES
+};
+
+inline const char* const radial_spline_names[NUM_RADIAL_SPLINES] = {
+    "psip", "G", "I", "iota", "dGds", "dIds", "diotads",
+    "mn_factor", "d_mn_factor",
+    "bmnc", "dbmncds", "bmns", "dbmnsds",
+    "rmnc", "drmncds", "rmns", "drmnsds",
+    "zmnc", "dzmncds", "zmns", "dzmnsds",
+    "numnc", "dnumncds", "numns", "dnumnsds",
+    "kmnc", "kmns"
+};
+
+// scipy.interpolate.InterpolatedUnivariateSpline allows degrees up to 5
+constexpr int radial_max_degree = 5;
+
+// The degree + 1 B-splines of degree k on the knots t that can be nonzero at
+// x, as in FITPACK's fpbspl. Outside of the knots, the polynomials of the
+// first and last interval are continued, which is how scipy's splines
+// extrapolate by default. Returns the index of the coefficient of B[0].
+inline int radial_bspline_basis(const vector<double>& t, int k, double x, double* B) {
+    int ncoeffs = t.size() - k - 1;
+    int l = std::upper_bound(t.begin() + k + 1, t.begin() + ncoeffs, x) - t.begin() - 1;
+    double h[radial_max_degree + 1];
+    B[0] = 1.;
+    for (int j = 1; j <= k; ++j) {
+        for (int i = 0; i < j; ++i)
+            h[i] = B[i];
+        B[0] = 0.;
+        for (int i = 1; i <= j; ++i) {
+            double tr = t[l + i], tl = t[l + i - j];
+            if(tr == tl) {
+                B[i] = 0.;
+                continue;
+            }
+            double f = h[i - 1]/(tr - tl);
+            B[i - 1] += f*(tr - x);
+            B[i] = f*(x - tl);
+        }
+    }
+    return l - k;
+}
+
+// Groups of quantities that are summed from the same Fourier coefficients:
+// the value and the derivatives with respect to s, theta and zeta of
+//
+//      \sum_i A_i(s) cos(xm_i theta - xn_i zeta) + B_i(s) sin(xm_i theta - xn_i zeta),
+//
+// where A_i is given by the spline cos and B_i by the spline sin, and their
+// derivatives by dcos and dsin (-1 if there is none). The series that is
+// present without stellarator symmetry is cos for modB and R, and sin for Z,
+// nu and K.
+enum RadialFamily { FAMILY_modB = 0, FAMILY_R, FAMILY_Z, FAMILY_nu, FAMILY_K, NUM_RADIAL_FAMILIES };
+
+struct RadialFamilySplines {
+    const char* name;
+    int cos, dcos, sin, dsin;
+    bool stellsym_cos;
+};
+
+inline const RadialFamilySplines radial_families[NUM_RADIAL_FAMILIES] = {
+    {"modB", SPLINE_bmnc, SPLINE_dbmncds, SPLINE_bmns, SPLINE_dbmnsds, true},
+    {"R", SPLINE_rmnc, SPLINE_drmncds, SPLINE_rmns, SPLINE_drmnsds, true},
+    {"Z", SPLINE_zmnc, SPLINE_dzmncds, SPLINE_zmns, SPLINE_dzmnsds, false},
+    {"nu", SPLINE_numnc, SPLINE_dnumncds, SPLINE_numns, SPLINE_dnumnsds, false},
+    {"K", SPLINE_kmnc, -1, SPLINE_kmns, -1, false}
+};
+
+// The field of simsopt.field.boozermagneticfield.BoozerRadialInterpolant.
+// The flux functions and the Fourier coefficients of modB, R, Z, nu and K are
+// splines in s that are computed in python and handed over with set_splines.
+// As in python, the coefficient of mode i is spline_i(s)/mn_factor_i(s) and
+// its derivative (dspline_i(s) - spline_i(s) d_mn_factor_i(s)/mn_factor_i(s))/mn_factor_i(s).
+//
+// At a point, the B-splines are evaluated once for all splines on the same
+// knots, and the value and the three derivatives of a quantity are summed in
+// a single loop over the modes, which shares one table of
+// cos/sin(xm theta - xn zeta), see BoozerFourierModes::for_each_mode.
+// Evaluating e.g. modB therefore also fills the caches of dmodBds,
+// dmodBdtheta, dmodBdzeta and modB_derivs, and quantities that are fused with
+// set_fused are added to the same loop.
+template<template<class, std::size_t, xt::layout_type> class T>
+class BoozerRadialInterpolant : public BoozerMagneticField<T> {
+    public:
+        using typename BoozerMagneticField<T>::Tensor2;
+
+    private:
+        // The splines, which are shared with the thread copies. Row i of a
+        // quantity q uses the knots row_knots[q][i], and its coefficients
+        // start at coeffs[q][row_offsets[q][i]].
+        struct Splines {
+            BoozerFourierModes modes;
+            vector<double> xm, xn;
+            // knot vectors including the repeated boundary knots, and their degree
+            vector<vector<double>> knots;
+            vector<int> degrees;
+            vector<int> row_knots[NUM_RADIAL_SPLINES];
+            vector<int> row_offsets[NUM_RADIAL_SPLINES];
+            vector<double> coeffs[NUM_RADIAL_SPLINES];
+
+            Splines(const vector<double>& xm, const vector<double>& xn) : modes(xm, xn), xm(xm), xn(xn) { }
+        };
+
+        // The B-splines of all knot vectors at the current s and the table of
+        // BoozerFourierModes::for_each_mode.
+        struct Workspace {
+            vector<int> first;
+            vector<double> basis;
+            vector<double> table;
+        };
+
+        // The splines that are summed for the requested families, see terms().
+        struct Terms {
+            int count = 0;
+            int family[NUM_RADIAL_FAMILIES];
+            int splines[NUM_RADIAL_FAMILIES][4];
+        };
+
+        shared_ptr<Splines> splines;
+        bool stellsym, no_K;
+        unsigned fused = 0;
+        Workspace point_workspace;
+
+        Splines& mutable_splines() {
+            // thread copies keep the splines they were created with
+            if(splines.use_count() > 1)
+                splines = std::make_shared<Splines>(*splines);
+            return *splines;
+        }
+
+        void basis(double s, Workspace& w) const {
+            const Splines& sp = *splines;
+            int nknots = sp.knots.size();
+            w.first.resize(nknots);
+            w.basis.resize(nknots*(radial_max_degree + 1));
+            w.table.resize(sp.modes.table_size());
+            for (int k = 0; k < nknots; ++k)
+                w.first[k] = radial_bspline_basis(sp.knots[k], sp.degrees[k], s, &w.basis[k*(radial_max_degree + 1)]);
+        }
+
+        inline double value(int q, int row, const Workspace& w) const {
+            const Splines& sp = *splines;
+            int k = sp.row_knots[q][row];
+            const double* c = &sp.coeffs[q][sp.row_offsets[q][row] + w.first[k]];
+            const double* B = &w.basis[k*(radial_max_degree + 1)];
+            double res = 0.;
+            for (int j = 0; j <= sp.degrees[k]; ++j)
+                res += c[j]*B[j];
+            return res;
+        }
+
+        void require(int q) const {
+            if(q >= 0 && splines->row_knots[q].empty())
+                throw logic_error(fmt::format("The spline {} of BoozerRadialInterpolant was not set.", radial_spline_names[q]));
+        }
+
+        // The splines of the families in mask. Series that vanish due to
+        // stellarator symmetry, and K for no_K, are left out.
+        Terms terms(unsigned mask) const {
+            Terms res;
+            require(SPLINE_mn_factor);
+            require(SPLINE_d_mn_factor);
+            for (int f = 0; f < NUM_RADIAL_FAMILIES; ++f) {
+                if(!(mask & (1u << f)) || (f == FAMILY_K && no_K))
+                    continue;
+                const RadialFamilySplines& fs = radial_families[f];
+                int* q = res.splines[res.count];
+                q[0] = fs.cos;
+                q[1] = fs.dcos;
+                q[2] = fs.sin;
+                q[3] = fs.dsin;
+                if(stellsym) {
+                    int unused = fs.stellsym_cos ? 2 : 0;
+                    q[unused] = q[unused + 1] = -1;
+                }
+                for (int j = 0; j < 4; ++j)
+                    require(q[j]);
+                res.family[res.count++] = f;
+            }
+            return res;
+        }
+
+        // out[f] = (value, d/ds, d/dtheta, d/dzeta) of family f at (s, theta,
+        // zeta), for the families in terms and zero otherwise. basis(s, w)
+        // has to be called first.
+        void synthesize(const Terms& terms, double theta, double zeta, Workspace& w, double out[NUM_RADIAL_FAMILIES][4]) const {
+            for (int f = 0; f < NUM_RADIAL_FAMILIES; ++f)
+                for (int j = 0; j < 4; ++j)
+                    out[f][j] = 0.;
+            if(terms.count == 0)
+                return;
+            const Splines& sp = *splines;
+            sp.modes.for_each_mode(theta, zeta, w.table.data(), [&](int i, double c, double s) {
+                double mn_factor = value(SPLINE_mn_factor, i, w);
+                double ratio = value(SPLINE_d_mn_factor, i, w)/mn_factor;
+                for (int t = 0; t < terms.count; ++t) {
+                    const int* q = terms.splines[t];
+                    double a = 0., da = 0., b = 0., db = 0.;
+                    if(q[0] >= 0) {
+                        double v = value(q[0], i, w);
+                        a = v/mn_factor;
+                        if(q[1] >= 0)
+                            da = (value(q[1], i, w) - v*ratio)/mn_factor;
+                    }
+                    if(q[2] >= 0) {
+                        double v = value(q[2], i, w);
+                        b = v/mn_factor;
+                        if(q[3] >= 0)
+                            db = (value(q[3], i, w) - v*ratio)/mn_factor;
+                    }
+                    // derivative with respect to xm_i theta - xn_i zeta
+                    double dangle = b*c - a*s;
+                    double* o = out[terms.family[t]];
+                    o[0] += a*c + b*s;
+                    o[1] += da*c + db*s;
+                    o[2] += sp.xm[i]*dangle;
+                    o[3] -= sp.xn[i]*dangle;
+                }
+            });
+        }
+
+        // Writes column j of res (npoints, NUM_RADIAL_FAMILIES, 4) for family
+        // f into the columns of the cache.
+        void store(CachedTensor<T, 2>& cache, const vector<double>& res, int f, int first, int count) {
+            int n = this->npoints;
+            Tensor2& data = cache.get_or_create({n, count});
+            for (int p = 0; p < n; ++p)
+                for (int j = 0; j < count; ++j)
+                    data(p, j) = res[(size_t(p)*NUM_RADIAL_FAMILIES + f)*4 + first + j];
+        }
+
+        // Evaluates family and the fused families at all points and fills
+        // the caches of their values and derivatives.
+        void fill(int family) {
+            Terms t = terms((1u << family) | fused);
+            int n = this->npoints;
+            const double* stz = this->get_points_ref().data();
+            vector<double> res(size_t(n)*NUM_RADIAL_FAMILIES*4);
+#pragma omp parallel
+            {
+                Workspace w;
+#pragma omp for schedule(static)
+                for (int p = 0; p < n; ++p) {
+                    basis(stz[3*p], w);
+                    synthesize(t, stz[3*p + 1], stz[3*p + 2], w, reinterpret_cast<double(*)[4]>(&res[size_t(p)*NUM_RADIAL_FAMILIES*4]));
+                }
+            }
+            for (int f = 0; f < NUM_RADIAL_FAMILIES; ++f) {
+                if(!(((1u << family) | fused) & (1u << f)))
+                    continue;
+                switch(f) {
+                    case FAMILY_modB:
+                        store(this->data_modB, res, f, 0, 1);
+                        store(this->data_dmodBds, res, f, 1, 1);
+                        store(this->data_dmodBdtheta, res, f, 2, 1);
+                        store(this->data_dmodBdzeta, res, f, 3, 1);
+                        store(this->data_modB_derivs, res, f, 1, 3);
+                        break;
+                    case FAMILY_R:
+                        store(this->data_R, res, f, 0, 1);
+                        store(this->data_dRds, res, f, 1, 1);
+                        store(this->data_dRdtheta, res, f, 2, 1);
+                        store(this->data_dRdzeta, res, f, 3, 1);
+                        store(this->data_R_derivs, res, f, 1, 3);
+                        break;
+                    case FAMILY_Z:
+                        store(this->data_Z, res, f, 0, 1);
+                        store(this->data_dZds, res, f, 1, 1);
+                        store(this->data_dZdtheta, res, f, 2, 1);
+                        store(this->data_dZdzeta, res, f, 3, 1);
+                        store(this->data_Z_derivs, res, f, 1, 3);
+                        break;
+                    case FAMILY_nu:
+                        store(this->data_nu, res, f, 0, 1);
+                        store(this->data_dnuds, res, f, 1, 1);
+                        store(this->data_dnudtheta, res, f, 2, 1);
+                        store(this->data_dnudzeta, res, f, 3, 1);
+                        store(this->data_nu_derivs, res, f, 1, 3);
+                        break;
+                    case FAMILY_K:
+                        store(this->data_K, res, f, 0, 1);
+                        store(this->data_dKdtheta, res, f, 2, 1);
+                        store(this->data_dKdzeta, res, f, 3, 1);
+                        store(this->data_K_derivs, res, f, 2, 2);
+                        break;
+                }
+            }
+        }
+
+        void fill_fluxfunction(int q, Tensor2& out) {
+            require(q);
+            const double* stz = this->get_points_ref().data();
+            Workspace w;
+            for (int p = 0; p < this->npoints; ++p) {
+                basis(stz[3*p], w);
+                out(p, 0) = value(q, 0, w);
+            }
+        }
+
+    protected:
+        void _modB_impl(Tensor2& modB) override { fill(FAMILY_modB); }
+        void _dmodBds_impl(Tensor2& dmodBds) override { fill(FAMILY_modB); }
+        void _dmodBdtheta_impl(Tensor2& dmodBdtheta) override { fill(FAMILY_modB); }
+        void _dmodBdzeta_impl(Tensor2& dmodBdzeta) override { fill(FAMILY_modB); }
+        void _modB_derivs_impl(Tensor2& modB_derivs) override { fill(FAMILY_modB); }
+        void _R_impl(Tensor2& R) override { fill(FAMILY_R); }
+        void _dRds_impl(Tensor2& dRds) override { fill(FAMILY_R); }
+        void _dRdtheta_impl(Tensor2& dRdtheta) override { fill(FAMILY_R); }
+        void _dRdzeta_impl(Tensor2& dRdzeta) override { fill(FAMILY_R); }
+        void _R_derivs_impl(Tensor2& R_derivs) override { fill(FAMILY_R); }
+        void _Z_impl(Tensor2& Z) override { fill(FAMILY_Z); }
+        void _dZds_impl(Tensor2& dZds) override { fill(FAMILY_Z); }
+        void _dZdtheta_impl(Tensor2& dZdtheta) override { fill(FAMILY_Z); }
+        void _dZdzeta_impl(Tensor2& dZdzeta) override { fill(FAMILY_Z); }
+        void _Z_derivs_impl(Tensor2& Z_derivs) override { fill(FAMILY_Z); }
+        void _nu_impl(Tensor2& nu) override { fill(FAMILY_nu); }
+        void _dnuds_impl(Tensor2& dnuds) override { fill(FAMILY_nu); }
+        void _dnudtheta_impl(Tensor2& dnudtheta) override { fill(FAMILY_nu); }
+        void _dnudzeta_impl(Tensor2& dnudzeta) override { fill(FAMILY_nu); }
+        void _nu_derivs_impl(Tensor2& nu_derivs) override { fill(FAMILY_nu); }
+        void _K_impl(Tensor2& K) override { fill(FAMILY_K); }
+        void _dKdtheta_impl(Tensor2& dKdtheta) override { fill(FAMILY_K); }
+        void _dKdzeta_impl(Tensor2& dKdzeta) override { fill(FAMILY_K); }
+        void _K_derivs_impl(Tensor2& K_derivs) override { fill(FAMILY_K); }
+        void _psip_impl(Tensor2& psip) override { fill_fluxfunction(SPLINE_psip, psip); }
+        void _G_impl(Tensor2& G) override { fill_fluxfunction(SPLINE_G, G); }
+        void _I_impl(Tensor2& I) override { fill_fluxfunction(SPLINE_I, I); }
+        void _iota_impl(Tensor2& iota) override { fill_fluxfunction(SPLINE_iota, iota); }
+        void _dGds_impl(Tensor2& dGds) override { fill_fluxfunction(SPLINE_dGds, dGds); }
+        void _dIds_impl(Tensor2& dIds) override { fill_fluxfunction(SPLINE_dIds, dIds); }
+        void _diotads_impl(Tensor2& diotads) override { fill_fluxfunction(SPLINE_diotads, diotads); }
+
+    public:
+        // xm, xn are the mode numbers of the Fourier coefficients. For
+        // stellsym, the splines bmns, rmns, zmnc, numnc and kmnc and their
+        // derivatives are not needed, and for no_K, K vanishes.
+        BoozerRadialInterpolant(double psi0, const vector<double>& xm, const vector<double>& xn, bool stellsym, bool no_K) :
+            BoozerMagneticField<T>(psi0), splines(std::make_shared<Splines>(xm, xn)), stellsym(stellsym), no_K(no_K) {
+            if(xm.size() != xn.size())
+                throw std::invalid_argument("xm and xn need to have the same size.");
+        }
+
+        // Sets the splines of the quantity name, one for a flux function and
+        // one per mode otherwise. Each spline is given by its knots and
+        // coefficients as returned by get_knots() and get_coeffs() of
+        // scipy.interpolate.InterpolatedUnivariateSpline, which determine the
+        // degree.
+        void set_splines(const string& name, const vector<vector<double>>& knots, const vector<vector<double>>& coeffs) {
+            auto it = std::find_if(std::begin(radial_spline_names), std::end(radial_spline_names),
+                    [&name](const char* n) { return name == n; });
+            if(it == std::end(radial_spline_names))
+                throw std::invalid_argument(fmt::format("{} is not a spline of BoozerRadialInterpolant.", name));
+            int q = it - std::begin(radial_spline_names);
+            int rows = q < SPLINE_mn_factor ? 1 : splines->xm.size();
+            if((int)knots.size() != rows || (int)coeffs.size() != rows)
+                throw std::invalid_argument(fmt::format("{} needs {} splines.", name, rows));
+            Splines& sp = mutable_splines();
+            sp.row_knots[q].clear();
+            sp.row_offsets[q].clear();
+            sp.coeffs[q].clear();
+            for (int i = 0; i < rows; ++i) {
+                int degree = int(coeffs[i].size()) - int(knots[i].size()) + 1;
+                if(knots[i].size() < 2 || degree < 0 || degree > radial_max_degree)
+                    throw std::invalid_argument(fmt::format("The knots and coefficients of {} do not form a spline of degree at most {}.", name, radial_max_degree));
+                // the knots of scipy's tck, which repeats the boundary knots
+                vector<double> t(degree, knots[i].front());
+                t.insert(t.end(), knots[i].begin(), knots[i].end());
+                t.insert(t.end(), degree, knots[i].back());
+                int k = 0;
+                while(k < (int)sp.knots.size() && !(sp.degrees[k] == degree && sp.knots[k] == t))
+                    ++k;
+                if(k == (int)sp.knots.size()) {
+                    sp.knots.push_back(t);
+                    sp.degrees.push_back(degree);
+                }
+                sp.row_knots[q].push_back(k);
+                sp.row_offsets[q].push_back(sp.coeffs[q].size());
+                sp.coeffs[q].insert(sp.coeffs[q].end(), coeffs[i].begin(), coeffs[i].end());
+            }
+            this->invalidate_cache();
+        }
+
+        // Whenever one of the given families "modB", "R", "Z", "nu" or "K" is
+        // evaluated, the others are summed in the same loop over the modes
+        // and stored in their caches as well. This pays off if they are
+        // needed at the same points, e.g. modB and K for the guiding center
+        // equations.
+        void set_fused(const vector<string>& names) {
+            unsigned mask = 0;
+            for (auto& name : names) {
+                int f = 0;
+                while(f < NUM_RADIAL_FAMILIES && name != radial_families[f].name)
+                    ++f;
+                if(f == NUM_RADIAL_FAMILIES)
+                    throw std::invalid_argument(fmt::format("{} is not one of modB, R, Z, nu and K.", name));
+                mask |= 1u << f;
+            }
+            fused = mask;
+        }
+
+        vector<string> get_fused() const {
+            vector<string> names;
+            for (int f = 0; f < NUM_RADIAL_FAMILIES; ++f)
+                if(fused & (1u << f))
+                    names.push_back(radial_families[f].name);
+            return names;
+        }
+
+        shared_ptr<BoozerMagneticField<T>> thread_copy(BoozerPointValues::Equations equations) override {
+            auto copy = std::make_shared<BoozerRadialInterpolant<T>>(this->psi0, splines->xm, splines->xn, stellsym, no_K);
+            copy->splines = splines;
+            copy->fused = fused;
+            return copy;
+        }
+
+        // modB and K are summed in the same loop over the modes, and the
+        // B-splines in s are shared with the flux functions.
+        void evaluate_point(double s, double theta, double zeta, BoozerPointValues& values, BoozerPointValues::Equations equations) override {
+            unsigned mask = 1u << FAMILY_modB;
+            if(equations == BoozerPointValues::full)
+                mask |= 1u << FAMILY_K;
+            Terms t = terms(mask);
+            require(SPLINE_G);
+            require(SPLINE_iota);
+            if(equations != BoozerPointValues::vacuum) {
+                require(SPLINE_I);
+                require(SPLINE_dGds);
+                require(SPLINE_dIds);
+            }
+            Workspace& w = point_workspace;
+            double out[NUM_RADIAL_FAMILIES][4];
+            basis(s, w);
+            synthesize(t, theta, zeta, w, out);
+            values.modB = out[FAMILY_modB][0];
+            values.dmodBds = out[FAMILY_modB][1];
+            values.dmodBdtheta = out[FAMILY_modB][2];
+            values.dmodBdzeta = out[FAMILY_modB][3];
+            values.G = value(SPLINE_G, 0, w);
+            values.iota = value(SPLINE_iota, 0, w);
+            if(equations == BoozerPointValues::vacuum)
+                return;
+            values.I = value(SPLINE_I, 0, w);
+            values.dGds = value(SPLINE_dGds, 0, w);
+            values.dIds = value(SPLINE_dIds, 0, w);
+            if(equations == BoozerPointValues::noK)
+                return;
+            values.K = out[FAMILY_K][0];
+            values.dKdtheta = out[FAMILY_K][2];
+            values.dKdzeta = out[FAMILY_K][3];
+        }
+};
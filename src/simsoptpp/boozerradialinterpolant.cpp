@@ -3,6 +3,156 @@
 #include "xtensor-python/pyarray.hpp"
 typedef xt::pyarray<double> Array;
 #include <xtensor/xview.hpp>
+#include <stdexcept>
+#include "boozerfourier.h"
+
+// Copies an array of angles or mode numbers, which may be a strided view,
+// into contiguous memory.
+static vector<double> contiguous(const Array& a) {
+    return vector<double>(a.begin(), a.end());
+}
+
+// The quantities entering the integrand K of compute_kmns and compute_kmnc_kmns,
+// ordered such that the first KMN_NUM_EVEN of them only have cosine
+// coefficients and the remaining ones only sine coefficients in the
+// stellarator symmetric case.
+enum {
+    KMN_B, KMN_R, KMN_DRDS, KMN_DZDTHETA, KMN_DZDZETA, KMN_DNUDTHETA, KMN_DNUDZETA,
+    KMN_DRDTHETA, KMN_DRDZETA, KMN_DZDS, KMN_NU, KMN_DNUDS,
+    KMN_NUM_QUANTITIES
+};
+constexpr int KMN_NUM_EVEN = KMN_DRDTHETA;
+
+// Radial profiles of the Fourier coefficients in Boozer coordinates, of shape
+// (num_modes, num_surf). The non stellarator symmetric ones are nullptr for
+// stellarator symmetric equilibria.
+struct BoozerProfiles {
+    Array *rmnc, *drmncds, *zmns, *dzmnsds, *numns, *dnumnsds, *bmnc;
+    Array *rmns = nullptr, *drmnsds = nullptr, *zmnc = nullptr, *dzmncds = nullptr,
+          *numnc = nullptr, *dnumncds = nullptr, *bmns = nullptr;
+};
+
+// Computes
+//      kmns(im, isurf) = \sum_p K_p sin(xm_im theta_p - xn_im zeta_p)/(2 pi^2),  im > 0,
+//      kmnc(im, isurf) = \sum_p K_p cos(xm_im theta_p - xn_im zeta_p)/(2 pi^2),  im > 0,
+// with kmns(0, isurf) = 0 and kmnc(0, isurf) using 1/(4 pi^2), and stores them
+// with strides (num_surf, 1). kmnc is only computed if it is not nullptr.
+//
+// All quantities entering K are evaluated for several surfaces at once with
+// BoozerFourierModes::synthesize, and the projections use
+// BoozerFourierModes::analyze, so both are parallel over points and surfaces
+// and don't call sin and cos for every mode if the points form a tensor
+// product grid. The surfaces are processed in chunks to bound the memory
+// required for the values at the points.
+static void compute_kmn(const BoozerProfiles& f, Array& iota, Array& G, Array& I, Array& xm, Array& xn,
+        Array& thetas_, Array& zetas_, double* kmns, double* kmnc) {
+    int num_modes = f.rmnc->shape(0);
+    int num_surf = f.rmnc->shape(1);
+    int num_points = thetas_.shape(0);
+    bool stellsym = f.rmns == nullptr;
+    if(num_modes == 0 || num_surf == 0)
+        return;
+    BoozerFourierModes modes(xm, xn);
+    vector<double> thetas = contiguous(thetas_), zetas = contiguous(zetas_);
+
+    int nq = KMN_NUM_QUANTITIES;
+    long budget = long(1) << 22;
+    int chunk = std::max(1L, std::min(long(num_surf), budget / std::max(1L, long(nq + 1)*num_points)));
+    vector<double> even(size_t(num_modes)*nq*chunk), odd(size_t(num_modes)*nq*chunk);
+    vector<double> values(size_t(num_points)*nq*chunk), K(size_t(num_points)*chunk);
+    for (int s0 = 0; s0 < num_surf; s0 += chunk) {
+        int ns = std::min(chunk, num_surf - s0);
+        // cosine and sine coefficients of quantity q on surface s0 + js at
+        // [im*nq*ns + q*ns + js]
+        auto coefficients = [&](int im, int q, int js, double c, double s) {
+            even[(size_t(im)*nq + q)*ns + js] = c;
+            odd[(size_t(im)*nq + q)*ns + js] = s;
+        };
+#pragma omp parallel for schedule(static)
+        for (int im = 0; im < num_modes; ++im) {
+            double m = xm(im), n = xn(im);
+            for (int js = 0; js < ns; ++js) {
+                int isurf = s0 + js;
+                double rmnc = (*f.rmnc)(im, isurf), zmns = (*f.zmns)(im, isurf), numns = (*f.numns)(im, isurf);
+                double rmns = 0., zmnc = 0., numnc = 0.;
+                double drmnsds = 0., dzmncds = 0., dnumncds = 0., bmns = 0.;
+                if(!stellsym) {
+                    rmns = (*f.rmns)(im, isurf);
+                    zmnc = (*f.zmnc)(im, isurf);
+                    numnc = (*f.numnc)(im, isurf);
+                    drmnsds = (*f.drmnsds)(im, isurf);
+                    dzmncds = (*f.dzmncds)(im, isurf);
+                    dnumncds = (*f.dnumncds)(im, isurf);
+                    bmns = (*f.bmns)(im, isurf);
+                }
+                coefficients(im, KMN_B, js, (*f.bmnc)(im, isurf), bmns);
+                coefficients(im, KMN_R, js, rmnc, rmns);
+                coefficients(im, KMN_DRDTHETA, js, rmns*m, -rmnc*m);
+                coefficients(im, KMN_DRDZETA, js, -rmns*n, rmnc*n);
+                coefficients(im, KMN_DRDS, js, (*f.drmncds)(im, isurf), drmnsds);
+                coefficients(im, KMN_DZDTHETA, js, zmns*m, -zmnc*m);
+                coefficients(im, KMN_DZDZETA, js, -zmns*n, zmnc*n);
+                coefficients(im, KMN_DZDS, js, dzmncds, (*f.dzmnsds)(im, isurf));
+                coefficients(im, KMN_NU, js, numnc, numns);
+                coefficients(im, KMN_DNUDS, js, dnumncds, (*f.dnumnsds)(im, isurf));
+                coefficients(im, KMN_DNUDTHETA, js, numns*m, -numnc*m);
+                coefficients(im, KMN_DNUDZETA, js, -numns*n, numnc*n);
+            }
+        }
+
+        // values of quantity q on surface s0 + js at [p*nq*ns + q*ns + js]
+        std::fill(values.begin(), values.end(), 0.);
+        long stride = long(nq)*ns;
+        if(stellsym) {
+            long split = long(KMN_NUM_EVEN)*ns;
+            modes.synthesize<false>(num_points, thetas.data(), zetas.data(), split,
+                    even.data(), stride, 0, 1, values.data(), stride, 1);
+            modes.synthesize<true>(num_points, thetas.data(), zetas.data(), stride - split,
+                    odd.data() + split, stride, 0, 1, values.data() + split, stride, 1);
+        } else {
+            modes.synthesize<false>(num_points, thetas.data(), zetas.data(), stride,
+                    even.data(), stride, 0, 1, values.data(), stride, 1);
+            modes.synthesize<true>(num_points, thetas.data(), zetas.data(), stride,
+                    odd.data(), stride, 0, 1, values.data(), stride, 1);
+        }
+
+#pragma omp parallel for collapse(2) schedule(static)
+        for (int ip = 0; ip < num_points; ++ip) {
+            for (int js = 0; js < ns; ++js) {
+                int isurf = s0 + js;
+                auto v = [&](int q) { return values[(size_t(ip)*nq + q)*ns + js]; };
+                double B = v(KMN_B), R = v(KMN_R);
+                double phi = zetas[ip] - v(KMN_NU);
+                double dphids = - v(KMN_DNUDS);
+                double dphidtheta = - v(KMN_DNUDTHETA);
+                double dphidzeta = 1 - v(KMN_DNUDZETA);
+                double cosphi = cos(phi), sinphi = sin(phi);
+                double dXdtheta = v(KMN_DRDTHETA) * cosphi - R * sinphi * dphidtheta;
+                double dYdtheta = v(KMN_DRDTHETA) * sinphi + R * cosphi * dphidtheta;
+                double dXds   = v(KMN_DRDS)   * cosphi - R * sinphi * dphids;
+                double dYds   = v(KMN_DRDS)   * sinphi + R * cosphi * dphids;
+                double dXdzeta  = v(KMN_DRDZETA)  * cosphi - R * sinphi * dphidzeta;
+                double dYdzeta  = v(KMN_DRDZETA)  * sinphi + R * cosphi * dphidzeta;
+                double gstheta = dXdtheta * dXds + dYdtheta * dYds + v(KMN_DZDTHETA) * v(KMN_DZDS);
+                double gszeta  = dXdzeta  * dXds + dYdzeta  * dYds + v(KMN_DZDZETA)  * v(KMN_DZDS);
+                double sqrtg = (G(isurf) + iota(isurf)*I(isurf))/(B*B);
+                K[size_t(ip)*ns + js] = (gszeta + iota(isurf)*gstheta)/sqrtg;
+            }
+        }
+
+        modes.analyze<true>(num_points, thetas.data(), zetas.data(), ns, K.data(), ns, 1,
+                kmns + s0, num_surf, 1, false);
+        if(kmnc)
+            modes.analyze<false>(num_points, thetas.data(), zetas.data(), ns, K.data(), ns, 1,
+                    kmnc + s0, num_surf, 1, false);
+    }
+
+    for (long k = 0; k < long(num_modes)*num_surf; ++k) {
+        kmns[k] /= 2.*M_PI*M_PI;
+        if(kmnc)
+            kmnc[k] /= (k < num_surf ? 4. : 2.)*M_PI*M_PI;
+    }
+}
 
 Array compute_kmnc_kmns(Array& rmnc, Array& drmncds, Array& zmns, Array& dzmnsds,
     Array& numns, Array& dnumnsds, Array& bmnc,
@@ -12,67 +162,12 @@ Array compute_kmnc_kmns(Array& rmnc, Array& drmncds, Array& zmns, Array& dzmnsds
 
     int num_modes = rmnc.shape(0);
     int num_surf = rmnc.shape(1);
-    int num_points = thetas.shape(0);
 
     Array kmnc_kmns = xt::zeros<double>({2,num_modes,num_surf});
-
-    // Outer iteration over surface
-    #pragma omp parallel for
-    for (int isurf=0; isurf < num_surf; ++isurf) {
-      for (int ip=0; ip < num_points; ++ip) {
-        double B = 0.;
-        double R = 0.;
-        double dRdtheta = 0.;
-        double dRdzeta = 0.;
-        double dRds = 0.;
-        double dZdtheta = 0.;
-        double dZdzeta = 0.;
-        double dZds = 0.;
-        double nu = 0.;
-        double dnuds = 0.;
-        double dnudtheta = 0.;
-        double dnudzeta = 0.;
-        for (int im=0; im < num_modes; ++im) {
-          double angle = xm(im)*thetas(ip)-xn(im)*zetas(ip);
-          B += bmnc(im,isurf)*cos(angle) + bmns(im,isurf)*sin(angle);
-          R += rmnc(im,isurf)*cos(angle) + rmns(im,isurf)*sin(angle);
-          dRdtheta += -rmnc(im,isurf)*xm(im)*sin(angle) + rmns(im,isurf)*xm(im)*cos(angle);
-          dRdzeta  +=  rmnc(im,isurf)*xn(im)*sin(angle) - rmns(im,isurf)*xn(im)*cos(angle);
-          dRds += drmncds(im,isurf)*cos(angle) + drmnsds(im,isurf)*sin(angle);
-          dZdtheta += zmns(im,isurf)*xm(im)*cos(angle) - zmnc(im,isurf)*xm(im)*sin(angle);
-          dZdzeta += -zmns(im,isurf)*xn(im)*cos(angle) + zmnc(im,isurf)*xn(im)*sin(angle);
-          dZds += dzmnsds(im,isurf)*sin(angle) + dzmncds(im,isurf)*cos(angle);
-          nu   += numns(im,isurf)*sin(angle) + numnc(im,isurf)*cos(angle);
-          dnuds += dnumnsds(im,isurf)*sin(angle) + dnumncds(im,isurf)*cos(angle);
-          dnudtheta += numns(im,isurf)*xm(im)*cos(angle) - numnc(im,isurf)*xm(im)*sin(angle);
-          dnudzeta += -numns(im,isurf)*xn(im)*cos(angle) + numnc(im,isurf)*xn(im)*sin(angle);
-        }
-        double phi = zetas(ip) - nu;
-        double dphids = - dnuds;
-        double dphidtheta = - dnudtheta;
-        double dphidzeta = 1 - dnudzeta;
-        double dXdtheta = dRdtheta * cos(phi) - R * sin(phi) * dphidtheta;
-        double dYdtheta = dRdtheta * sin(phi) + R * cos(phi) * dphidtheta;
-        double dXds   = dRds   * cos(phi) - R * sin(phi) * dphids;
-        double dYds   = dRds   * sin(phi) + R * cos(phi) * dphids;
-        double dXdzeta  = dRdzeta  * cos(phi) - R * sin(phi) * dphidzeta;
-        double dYdzeta  = dRdzeta  * sin(phi) + R * cos(phi) * dphidzeta;
-        double gstheta = dXdtheta * dXds + dYdtheta * dYds + dZdtheta * dZds;
-        double gszeta  = dXdzeta  * dXds + dYdzeta  * dYds + dZdzeta  * dZds;
-        double sqrtg = (G(isurf) + iota(isurf)*I(isurf))/(B*B);
-        double K = (gszeta + iota(isurf)*gstheta)/sqrtg;
-
-        for (int im=0; im < num_modes; ++im) {
-          double angle = xm(im)*thetas(ip)-xn(im)*zetas(ip);
-          if (im > 0) {
-            kmnc_kmns(1,im,isurf) = kmnc_kmns(1,im,isurf) + K*sin(angle)/(2.*M_PI*M_PI);
-            kmnc_kmns(0,im,isurf) = kmnc_kmns(0,im,isurf) + K*cos(angle)/(2.*M_PI*M_PI);
-          } else {
-            kmnc_kmns(0,im,isurf) = kmnc_kmns(0,im,isurf) + K*cos(angle)/(4.*M_PI*M_PI);
-          }
-        }
-      }
-    }
+    BoozerProfiles f = {&rmnc, &drmncds, &zmns, &dzmnsds, &numns, &dnumnsds, &bmnc,
+        &rmns, &drmnsds, &zmnc, &dzmncds, &numnc, &dnumncds, &bmns};
+    double* kmnc = kmnc_kmns.data();
+    compute_kmn(f, iota, G, I, xm, xn, thetas, zetas, kmnc + long(num_modes)*num_surf, kmnc);
     return kmnc_kmns;
 }
 
@@ -80,141 +175,71 @@ Array compute_kmns(Array& rmnc, Array& drmncds, Array& zmns, Array& dzmnsds, Arr
 
     int num_modes = rmnc.shape(0);
     int num_surf = rmnc.shape(1);
-    int num_points = thetas.shape(0);
 
     Array kmns = xt::zeros<double>({num_modes,num_surf});
+    BoozerProfiles f = {&rmnc, &drmncds, &zmns, &dzmnsds, &numns, &dnumnsds, &bmnc};
+    compute_kmn(f, iota, G, I, xm, xn, thetas, zetas, kmns.data(), nullptr);
+    return kmns;
+}
 
-    // Outer iteration over surface
-    #pragma omp parallel for
-    for (int isurf=0; isurf < num_surf; ++isurf) {
-      for (int ip=0; ip < num_points; ++ip) {
-        double B = 0.;
-        double R = 0.;
-        double dRdtheta = 0.;
-        double dRdzeta = 0.;
-        double dRds = 0.;
-        double dZdtheta = 0.;
-        double dZdzeta = 0.;
-        double dZds = 0.;
-        double nu = 0.;
-        double dnuds = 0.;
-        double dnudtheta = 0.;
-        double dnudzeta = 0.;
-        for (int im=0; im < num_modes; ++im) {
-          B += bmnc(im,isurf)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          R += rmnc(im,isurf)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          dRdtheta += -rmnc(im,isurf)*xm(im)*sin(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          dRdzeta +=   rmnc(im,isurf)*xn(im)*sin(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          dRds += drmncds(im,isurf)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          dZdtheta += zmns(im,isurf)*xm(im)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          dZdzeta += -zmns(im,isurf)*xn(im)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          dZds += dzmnsds(im,isurf)*sin(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          nu += numns(im,isurf)*sin(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          dnuds += dnumnsds(im,isurf)*sin(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          dnudtheta += numns(im,isurf)*xm(im)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-          dnudzeta += -numns(im,isurf)*xn(im)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-        }
-        double phi = zetas(ip) - nu;
-        double dphids = - dnuds;
-        double dphidtheta = - dnudtheta;
-        double dphidzeta = 1 - dnudzeta;
-        double dXdtheta = dRdtheta * cos(phi) - R * sin(phi) * dphidtheta;
-        double dYdtheta = dRdtheta * sin(phi) + R * cos(phi) * dphidtheta;
-        double dXds   = dRds   * cos(phi) - R * sin(phi) * dphids;
-        double dYds   = dRds   * sin(phi) + R * cos(phi) * dphids;
-        double dXdzeta  = dRdzeta  * cos(phi) - R * sin(phi) * dphidzeta;
-        double dYdzeta  = dRdzeta  * sin(phi) + R * cos(phi) * dphidzeta;
-        double gstheta = dXdtheta * dXds + dYdtheta * dYds + dZdtheta * dZds;
-        double gszeta  = dXdzeta  * dXds + dYdzeta  * dYds + dZdzeta  * dZds;
-        double sqrtg = (G(isurf) + iota(isurf)*I(isurf))/(B*B);
-        double K = (gszeta + iota(isurf)*gstheta)/sqrtg;
-
-        for (int im=1; im < num_modes; ++im) {
-          kmns(im,isurf) = kmns(im,isurf) + K*sin(xm(im)*thetas(ip)-xn(im)*zetas(ip))/(2.*M_PI*M_PI);
-        }
-      }
-    }
+template<bool odd>
+Array fourier_transform(Array& K, Array& xm, Array& xn, Array& thetas, Array& zetas) {
+    BoozerFourierModes modes(xm, xn);
+    int num_modes = modes.size();
+    int num_points = thetas.size();
+    int dim = K.dimension();
+    if((dim != 1 && dim != 2) || K.shape(0) != num_points || zetas.size() != num_points)
+        throw std::invalid_argument("K needs to have shape (npoints,) or (npoints, nbatch), and thetas and zetas shape (npoints,).");
+    if(num_points == 0)
+        throw std::invalid_argument("The Fourier transform needs at least one point.");
+    int nb = dim == 2 ? K.shape(1) : 1;
+    Array kmns = dim == 2 ? Array(xt::zeros<double>({num_modes, nb})) : Array(xt::zeros<double>({num_modes}));
+    vector<double> th = contiguous(thetas), ze = contiguous(zetas);
+    const double* Kptr = dim == 2 ? &K(0, 0) : &K(0);
+    long K_p = K.strides()[0];
+    long K_b = dim == 2 ? K.strides()[1] : 0;
+    modes.analyze<odd>(num_points, th.data(), ze.data(), nb, Kptr, K_p, K_b, kmns.data(), nb, 1);
     return kmns;
 }
 
-Array fourier_transform_odd(Array& K, Array& xm, Array& xn, Array& thetas, Array& zetas) {
+template<bool odd>
+void inverse_fourier_transform(Array& K, Array& kmns, Array& xm, Array& xn, Array& thetas, Array& zetas) {
+    BoozerFourierModes modes(xm, xn);
+    int num_modes = modes.size();
+    int num_points = thetas.size();
+    int dim = K.dimension();
+    int cdim = kmns.dimension();
+    if((dim != 1 && dim != 2) || K.shape(0) != num_points || zetas.size() != num_points)
+        throw std::invalid_argument("K needs to have shape (npoints,) or (npoints, nbatch), and thetas and zetas shape (npoints,).");
+    if(cdim < 1 || cdim > 2 || kmns.shape(0) != num_modes || (dim == 2 && (cdim != 2 || kmns.shape(1) != K.shape(1))) || (dim == 1 && cdim == 2 && kmns.shape(1) != num_points))
+        throw std::invalid_argument("kmns needs to have shape (nmodes,) or (nmodes, npoints) for K of shape (npoints,), and (nmodes, nbatch) for K of shape (npoints, nbatch).");
+    if(num_points == 0 || num_modes == 0)
+        return;
+    int nb = dim == 2 ? K.shape(1) : 1;
+    vector<double> th = contiguous(thetas), ze = contiguous(zetas);
+    double* Kptr = dim == 2 ? &K(0, 0) : &K(0);
+    long K_p = K.strides()[0];
+    long K_b = dim == 2 ? K.strides()[1] : 0;
+    const double* cptr = cdim == 2 ? &kmns(0, 0) : &kmns(0);
+    long c_i = kmns.strides()[0];
+    // per point coefficients for K of shape (npoints,), one column per batch entry otherwise
+    long c_p = dim == 1 && cdim == 2 ? kmns.strides()[1] : 0;
+    long c_b = dim == 2 ? kmns.strides()[1] : 0;
+    modes.synthesize<odd>(num_points, th.data(), ze.data(), nb, cptr, c_i, c_p, c_b, Kptr, K_p, K_b);
+}
 
-    int num_modes = xm.shape(0);
-    int num_points = thetas.shape(0);
-    Array kmns = xt::zeros<double>({num_modes});
-
-    double norm;
-    for (int im=1; im < num_modes; ++im) {
-      norm = 0.;
-      #pragma omp parallel for
-      for (int ip=0; ip < num_points; ++ip) {
-        kmns(im) += K(ip)*sin(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-        norm += pow(sin(xm(im)*thetas(ip)-xn(im)*zetas(ip)),2.);
-      }
-      kmns(im) = kmns(im)/norm;
-    }
-    return kmns;
+Array fourier_transform_odd(Array& K, Array& xm, Array& xn, Array& thetas, Array& zetas) {
+    return fourier_transform<true>(K, xm, xn, thetas, zetas);
 }
 
 Array fourier_transform_even(Array& K, Array& xm, Array& xn, Array& thetas, Array& zetas) {
-
-    int num_modes = xm.shape(0);
-    int num_points = thetas.shape(0);
-    Array kmns = xt::zeros<double>({num_modes});
-
-    double norm;
-    for (int im=0; im < num_modes; ++im) {
-      norm = 0.;
-      #pragma omp parallel for
-      for (int ip=0; ip < num_points; ++ip) {
-        kmns(im) += K(ip)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-        norm += pow(cos(xm(im)*thetas(ip)-xn(im)*zetas(ip)),2.);
-      }
-      kmns(im) = kmns(im)/norm;
-    }
-    return kmns;
+    return fourier_transform<false>(K, xm, xn, thetas, zetas);
 }
 
 void inverse_fourier_transform_odd(Array& K, Array& kmns, Array& xm, Array& xn, Array& thetas, Array& zetas) {
-
-    int num_modes = xm.shape(0);
-    int num_points = thetas.shape(0);
-    int dim = kmns.dimension();
-    if (dim==2) {
-      for (int im=1; im < num_modes; ++im) {
-        #pragma omp parallel for
-        for (int ip=0; ip < num_points; ++ip) {
-          K(ip) += kmns(im,ip)*sin(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-        }
-      }
-    } else {
-      for (int im=1; im < num_modes; ++im) {
-        #pragma omp parallel for
-        for (int ip=0; ip < num_points; ++ip) {
-          K(ip) += kmns(im)*sin(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-        }
-      }
-    }
+    inverse_fourier_transform<true>(K, kmns, xm, xn, thetas, zetas);
 }
 
 void inverse_fourier_transform_even(Array& K, Array& kmns, Array& xm, Array& xn, Array& thetas, Array& zetas) {
-
-    int num_modes = xm.shape(0);
-    int num_points = thetas.shape(0);
-    int dim = kmns.dimension();
-    if (dim==2) {
-      for (int im=0; im < num_modes; ++im) {
-        #pragma omp parallel for
-        for (int ip=0; ip < num_points; ++ip) {
-          K(ip) += kmns(im,ip)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-        }
-      }
-    } else {
-      for (int im=0; im < num_modes; ++im) {
-        #pragma omp parallel for
-        for (int ip=0; ip < num_points; ++ip) {
-          K(ip) += kmns(im)*cos(xm(im)*thetas(ip)-xn(im)*zetas(ip));
-        }
-      }
-    }
+    inverse_fourier_transform<false>(K, kmns, xm, xn, thetas, zetas);
 }
@@ -1,7 +1,15 @@
-#include "xsimd/xsimd.hpp"
+#pragma once
+
+#include <algorithm>
+#include <vector>
 #include "simdhelpers.h"
 #include "vec3dsimd.h"
+#include "scratch.h"
+#include "perf_counters.h"
 #include "xtensor/xarray.hpp"
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 #if __cplusplus >= 201703L
 #define MYIF(c) if constexpr(c)
@@ -9,550 +17,540 @@
 #define MYIF(c) if(c)
 #endif
 
+// The Boozer residual
+//
+//      res = 1/2 \sum_{ij} |rtil_ij|^2,   rtil_ij = w_ij (G B_ij - |B_ij|^2 (xphi_ij + iota xtheta_ij)),
+//
+// with w_ij = 1/|B_ij| if weight_inv_modB and w_ij = 1 otherwise, and its
+// gradient and Hessian with respect to the surface dofs, iota and G.
+//
+// The computation is split in two passes over blocks of surface points:
+//
+//  1) boozer_point_derivatives computes, independently for every point, the
+//     derivatives of rtil_ij and the intermediate quantities that the Hessian
+//     needs. The points of a block are distributed over the threads.
+//  2) boozer_point_rows adds the contribution of one point to a block of
+//     boozer_simd_size rows of the gradient and of the upper triangle of the
+//     Hessian. Every row block is owned by a single thread, which visits the
+//     points in order.
+//
+// Hence every entry of res, dres and d2res is accumulated by one thread in
+// the serial order of the points. There is no reduction over threads, and
+// the result is bit-for-bit the same for any number of threads.
+
 #if defined(USE_XSIMD)
-template<class T, int deriv> void boozer_residual_impl(double G, double iota, T& B, T& dB_dx, T& d2B_dx2, T& xphi, T& xtheta, T& dx_ds, T& dxphi_ds, T& dxtheta_ds, double& res, T& dres, T& d2res, size_t ndofs, bool weight_inv_modB){
-    int nphi = xphi.shape(0);
-    int ntheta = xtheta.shape(1);
-    int num_points = 3 * nphi * ntheta;
-
-    constexpr size_t simd_size = xsimd::simd_type<double>::size;
-    auto dx_ds_ij0 = AlignedPaddedVec(ndofs, 0);
-    auto dx_ds_ij1 = AlignedPaddedVec(ndofs, 0);
-    auto dx_ds_ij2 = AlignedPaddedVec(ndofs, 0);
-    auto dxphi_ds_ij0 = AlignedPaddedVec(ndofs, 0);
-    auto dxphi_ds_ij1 = AlignedPaddedVec(ndofs, 0);
-    auto dxphi_ds_ij2 = AlignedPaddedVec(ndofs, 0);
-    auto dxtheta_ds_ij0 = AlignedPaddedVec(ndofs, 0);
-    auto dxtheta_ds_ij1 = AlignedPaddedVec(ndofs, 0);
-    auto dxtheta_ds_ij2 = AlignedPaddedVec(ndofs, 0);
-
-    auto drtilij0 = AlignedPaddedVec(ndofs+2, 0);
-    auto drtilij1 = AlignedPaddedVec(ndofs+2, 0);
-    auto drtilij2 = AlignedPaddedVec(ndofs+2, 0);
-    
-    auto dresij0 = AlignedPaddedVec(ndofs+2, 0);
-    auto dresij1 = AlignedPaddedVec(ndofs+2, 0);
-    auto dresij2 = AlignedPaddedVec(ndofs+2, 0);
-
-    auto dw_ij = AlignedPaddedVec(ndofs+2, 0);
-
-    auto dtang_ij0 = AlignedPaddedVec(ndofs+2, 0);
-    auto dtang_ij1 = AlignedPaddedVec(ndofs+2, 0);
-    auto dtang_ij2 = AlignedPaddedVec(ndofs+2, 0);
-
-    auto dB2_ij = AlignedPaddedVec(ndofs+2, 0);
-    auto dBij0 = AlignedPaddedVec(ndofs+2, 0);
-    auto dBij1 = AlignedPaddedVec(ndofs+2, 0);
-    auto dBij2 = AlignedPaddedVec(ndofs+2, 0);
-    auto dmodB_ij = AlignedPaddedVec(ndofs+2, 0);
-     
-    simd_t it(iota); 
-    simd_t GG(G); 
-    
-    for(int i=0; i<nphi; i++){
-        for(int j=0; j<ntheta; j++){
-            double B2ij = B(i,j,0)*B(i,j,0) + B(i,j,1)*B(i,j,1) + B(i,j,2)*B(i,j,2);
-            double rB2ij = 1/B2ij;
-            double wij = weight_inv_modB ? sqrt(rB2ij) : 1.;
-            double modB_ij = sqrt(B2ij);
-            double powrmodBijthree = wij*wij*wij;
-
-            double tang_ij0 = xphi(i,j,0)+iota*xtheta(i,j,0); 
-            double tang_ij1 = xphi(i,j,1)+iota*xtheta(i,j,1); 
-            double tang_ij2 = xphi(i,j,2)+iota*xtheta(i,j,2);  
-
-            double resij0 = G*B(i, j, 0)  - B2ij * tang_ij0;
-            double resij1 = G*B(i, j, 1)  - B2ij * tang_ij1;
-            double resij2 = G*B(i, j, 2)  - B2ij * tang_ij2;
-            
-            double rtil_ij0, rtil_ij1, rtil_ij2;
-
-            rtil_ij0 = resij0 * wij;
-            rtil_ij1 = resij1 * wij;
-            rtil_ij2 = resij2 * wij;
-
-            res += 0.5*(rtil_ij0*rtil_ij0 + rtil_ij1*rtil_ij1 + rtil_ij2*rtil_ij2);
-            
-            MYIF(deriv>0){ 
-                simd_t Bij0(B(i, j, 0)); 
-                simd_t Bij1(B(i, j, 1)); 
-                simd_t Bij2(B(i, j, 2)); 
-
-                simd_t dB_dxij00(dB_dx(i, j, 0, 0));
-                simd_t dB_dxij10(dB_dx(i, j, 1, 0));
-                simd_t dB_dxij20(dB_dx(i, j, 2, 0));
-                simd_t dB_dxij01(dB_dx(i, j, 0, 1));
-                simd_t dB_dxij11(dB_dx(i, j, 1, 1));
-                simd_t dB_dxij21(dB_dx(i, j, 2, 1));
-                simd_t dB_dxij02(dB_dx(i, j, 0, 2));
-                simd_t dB_dxij12(dB_dx(i, j, 1, 2));
-                simd_t dB_dxij22(dB_dx(i, j, 2, 2));
-                
-                simd_t bw_ij(wij); 
-                simd_t btang_ij0(tang_ij0); 
-                simd_t btang_ij1(tang_ij1); 
-                simd_t btang_ij2(tang_ij2); 
-                
-                simd_t brtil_ij0(rtil_ij0); 
-                simd_t brtil_ij1(rtil_ij1);
-                simd_t brtil_ij2(rtil_ij2);
-
-                for (int m = 0; m < ndofs; ++m) {
-                    dx_ds_ij0[m] = dx_ds(i,j,0,m);
-                    dx_ds_ij1[m] = dx_ds(i,j,1,m);
-                    dx_ds_ij2[m] = dx_ds(i,j,2,m);
-
-                    dxphi_ds_ij0[m] = dxphi_ds(i,j,0,m);
-                    dxphi_ds_ij1[m] = dxphi_ds(i,j,1,m);
-                    dxphi_ds_ij2[m] = dxphi_ds(i,j,2,m);
-
-                    dxtheta_ds_ij0[m] = dxtheta_ds(i,j,0,m);
-                    dxtheta_ds_ij1[m] = dxtheta_ds(i,j,1,m);
-                    dxtheta_ds_ij2[m] = dxtheta_ds(i,j,2,m);
+using boozer_lane_t = simd_t;
+constexpr int boozer_simd_size = xsimd::simd_type<double>::size;
+inline boozer_lane_t boozer_load(const double* ptr) { return xs::load_aligned(ptr); }
+inline double boozer_lane(const boozer_lane_t& x, int j) { return x[j]; }
+#else
+using boozer_lane_t = double;
+constexpr int boozer_simd_size = 1;
+inline boozer_lane_t boozer_load(const double* ptr) { return *ptr; }
+inline double boozer_lane(const boozer_lane_t& x, int) { return x; }
+#endif
 
-                }
-                
-                for (int m = 0; m < ndofs; m+=simd_size) {
-                    simd_t dx_ds_ij0m = xs::load_aligned(&dx_ds_ij0[m]);
-                    simd_t dx_ds_ij1m = xs::load_aligned(&dx_ds_ij1[m]);
-                    simd_t dx_ds_ij2m = xs::load_aligned(&dx_ds_ij2[m]);
-
-                    simd_t dxphi_ds_ij0m = xs::load_aligned(&dxphi_ds_ij0[m]);
-                    simd_t dxphi_ds_ij1m = xs::load_aligned(&dxphi_ds_ij1[m]);
-                    simd_t dxphi_ds_ij2m = xs::load_aligned(&dxphi_ds_ij2[m]);
-
-                    simd_t dxtheta_ds_ij0m = xs::load_aligned(&dxtheta_ds_ij0[m]);
-                    simd_t dxtheta_ds_ij1m = xs::load_aligned(&dxtheta_ds_ij1[m]);
-                    simd_t dxtheta_ds_ij2m = xs::load_aligned(&dxtheta_ds_ij2[m]);
-
-                    auto dBij0m = xsimd::fma(dB_dxij00,dx_ds_ij0m,xsimd::fma(dB_dxij10,dx_ds_ij1m,dB_dxij20*dx_ds_ij2m)); 
-                    auto dBij1m = xsimd::fma(dB_dxij01,dx_ds_ij0m,xsimd::fma(dB_dxij11,dx_ds_ij1m,dB_dxij21*dx_ds_ij2m)); 
-                    auto dBij2m = xsimd::fma(dB_dxij02,dx_ds_ij0m,xsimd::fma(dB_dxij12,dx_ds_ij1m,dB_dxij22*dx_ds_ij2m));
-
-                    auto dB2_ijm = 2*(Bij0 * dBij0m + Bij1 * dBij1m + Bij2 * dBij2m);
-                    auto tang_ij0m = xsimd::fma(it, dxtheta_ds_ij0m , dxphi_ds_ij0m);
-                    auto tang_ij1m = xsimd::fma(it, dxtheta_ds_ij1m , dxphi_ds_ij1m);
-                    auto tang_ij2m = xsimd::fma(it, dxtheta_ds_ij2m , dxphi_ds_ij2m);
-
-                    auto dresij0m = xsimd::fms(GG , dBij0m , xsimd::fma(dB2_ijm , btang_ij0 , B2ij * tang_ij0m));
-                    auto dresij1m = xsimd::fms(GG , dBij1m , xsimd::fma(dB2_ijm , btang_ij1 , B2ij * tang_ij1m));
-                    auto dresij2m = xsimd::fms(GG , dBij2m , xsimd::fma(dB2_ijm , btang_ij2 , B2ij * tang_ij2m));
-
-                    auto dmodB_ijm = 0.5 * dB2_ijm * wij;
-                    auto dw_ijm = weight_inv_modB ? -dmodB_ijm * rB2ij : simd_t(0.);
-                    auto drtil_ij0m = xsimd::fma(dresij0m , bw_ij , dw_ijm * resij0); 
-                    auto drtil_ij1m = xsimd::fma(dresij1m , bw_ij , dw_ijm * resij1); 
-                    auto drtil_ij2m = xsimd::fma(dresij2m , bw_ij , dw_ijm * resij2);
-
-                    // sum_k (r_k grad r_k)
-                    auto dresm = xsimd::fma(brtil_ij0, drtil_ij0m, xsimd::fma(brtil_ij1, drtil_ij1m , brtil_ij2 * drtil_ij2m));                    
-                    
-                    int jjlimit = std::min(simd_size, ndofs-m);
-                    for(int jj = 0; jj < jjlimit; jj++){
-                        dres(m+jj) += dresm[jj];
-
-                        drtilij0[m+jj] = drtil_ij0m[jj];
-                        drtilij1[m+jj] = drtil_ij1m[jj];
-                        drtilij2[m+jj] = drtil_ij2m[jj];
-                    
-                        dB2_ij[m+jj] = dB2_ijm[jj];
-                        dtang_ij0[m+jj] = tang_ij0m[jj];
-                        dtang_ij1[m+jj] = tang_ij1m[jj];
-                        dtang_ij2[m+jj] = tang_ij2m[jj];
-                        dresij0[m+jj] = dresij0m[jj];
-                        dresij1[m+jj] = dresij1m[jj];
-                        dresij2[m+jj] = dresij2m[jj];
-
-                        dBij0[m+jj] = dBij0m[jj];
-                        dBij1[m+jj] = dBij1m[jj];
-                        dBij2[m+jj] = dBij2m[jj];
-
-                        dw_ij[m+jj] = dw_ijm[jj];
-
-                        dmodB_ij[m+jj] = dmodB_ijm[jj];
-                    }
-                }
-                
-                double dres_ij0iota = -B2ij * xtheta(i, j, 0);
-                double dres_ij1iota = -B2ij * xtheta(i, j, 1);
-                double dres_ij2iota = -B2ij * xtheta(i, j, 2);
-                 
-                double drtil_ij0iota = dres_ij0iota * wij; 
-                double drtil_ij1iota = dres_ij1iota * wij; 
-                double drtil_ij2iota = dres_ij2iota * wij;
-                dres(ndofs + 0) += rtil_ij0 * drtil_ij0iota + rtil_ij1 * drtil_ij1iota + rtil_ij2 * drtil_ij2iota;
-                
-                drtilij0[ndofs + 0] = drtil_ij0iota; 
-                drtilij1[ndofs + 0] = drtil_ij1iota; 
-                drtilij2[ndofs + 0] = drtil_ij2iota; 
-
-
-                double dres_ij0_dG = B(i, j, 0);
-                double dres_ij1_dG = B(i, j, 1);
-                double dres_ij2_dG = B(i, j, 2);
-
-                double drtil_ij0_dG = wij * dres_ij0_dG;
-                double drtil_ij1_dG = wij * dres_ij1_dG;
-                double drtil_ij2_dG = wij * dres_ij2_dG;
-                dres(ndofs + 1) += rtil_ij0 * drtil_ij0_dG + rtil_ij1 * drtil_ij1_dG + rtil_ij2 * drtil_ij2_dG;
-
-                drtilij0[ndofs + 1] = drtil_ij0_dG; 
-                drtilij1[ndofs + 1] = drtil_ij1_dG; 
-                drtilij2[ndofs + 1] = drtil_ij2_dG; 
-                
+// Number of vectors of length ndofs+2 per point that the passes share.
+constexpr int boozer_point_vectors(int deriv) { return deriv > 1 ? 21 : (deriv > 0 ? 3 : 0); }
+
+// Number of points per block. It only depends on the amount of memory per
+// point and never on the number of threads, so that it doesn't affect the
+// order of the summation.
+inline int boozer_point_block(size_t doubles_per_point) {
+    constexpr size_t budget = size_t(1) << 21; // doubles, i.e. 16MB
+    constexpr int max_block = 256;
+    if(doubles_per_point == 0)
+        return max_block;
+    return std::max(1, int(std::min(size_t(max_block), budget / doubles_per_point)));
+}
+
+// The quantities of the surface point (i, j) that are needed by
+// boozer_point_rows. The vectors have ndofs+2 entries (the dofs, iota and G)
+// padded to a multiple of boozer_simd_size, and the entries that aren't
+// written are zero. Only drtil is used for deriv == 1.
+struct BoozerPoint {
+    double B[3], B2, w, modB, w3;
+    double tang[3], r[3], rtil[3], xtheta[3];
+    double dr_iota[3], dr_G[3];
+    // d2B[k][l][c] = d^2 B_c / dx_k dx_l
+    double d2B[3][3][3];
+    double *drtil[3], *dr[3], *dtang[3], *dB[3], *dx[3], *dxtheta[3];
+    // derivatives of |B|^2, w and |B|
+    double *dB2, *dw, *dmodB;
+};
+
+// Fills p for the surface point (i, j) and returns its contribution to res.
+template<class T, int deriv>
+double boozer_point_derivatives(double G, double iota, T& B, T& dB_dx, T& d2B_dx2, T& xphi, T& xtheta, T& dx_ds, T& dxphi_ds, T& dxtheta_ds, size_t ndofs, bool weight_inv_modB, int i, int j, BoozerPoint& p){
+    p.B2 = 0.;
+    for (int c = 0; c < 3; ++c) {
+        p.B[c] = B(i, j, c);
+        p.B2 += p.B[c]*p.B[c];
+    }
+    double rB2 = 1/p.B2;
+    p.w = weight_inv_modB ? sqrt(rB2) : 1.;
+    p.modB = sqrt(p.B2);
+    p.w3 = p.w*p.w*p.w;
+
+    double res = 0.;
+    for (int c = 0; c < 3; ++c) {
+        p.xtheta[c] = xtheta(i, j, c);
+        p.tang[c] = xphi(i, j, c) + iota*p.xtheta[c];
+        p.r[c] = G*p.B[c] - p.B2*p.tang[c];
+        p.rtil[c] = p.r[c]*p.w;
+        res += p.rtil[c]*p.rtil[c];
+    }
+    res *= 0.5;
+
+    MYIF(deriv > 0) {
+        double dB_dx_ij[3][3];
+        for (int k = 0; k < 3; ++k)
+            for (int c = 0; c < 3; ++c)
+                dB_dx_ij[k][c] = dB_dx(i, j, k, c);
+        MYIF(deriv > 1) {
+            for (int k = 0; k < 3; ++k)
+                for (int l = 0; l < 3; ++l)
+                    for (int c = 0; c < 3; ++c)
+                        p.d2B[k][l][c] = d2B_dx2(i, j, k, l, c);
+        }
+
+        for (int m = 0; m < ndofs; ++m) {
+            double dx_m[3], dB_m[3];
+            for (int k = 0; k < 3; ++k)
+                dx_m[k] = dx_ds(i, j, k, m);
+            double dB2_m = 0.;
+            for (int c = 0; c < 3; ++c) {
+                dB_m[c] = dB_dx_ij[0][c]*dx_m[0] + dB_dx_ij[1][c]*dx_m[1] + dB_dx_ij[2][c]*dx_m[2];
+                dB2_m += p.B[c]*dB_m[c];
+            }
+            dB2_m *= 2;
+            double dmodB_m = 0.5*dB2_m*p.w;
+            double dw_m = weight_inv_modB ? -dmodB_m*rB2 : 0.;
+            for (int c = 0; c < 3; ++c) {
+                double dxtheta_m = dxtheta_ds(i, j, c, m);
+                double dtang_m = iota*dxtheta_m + dxphi_ds(i, j, c, m);
+                double dr_m = G*dB_m[c] - (dB2_m*p.tang[c] + p.B2*dtang_m);
+                p.drtil[c][m] = dr_m*p.w + dw_m*p.r[c];
                 MYIF(deriv > 1) {
-                    // outer product d_rij0_dm (x) d_rij0_dm
-                    for(int m = 0; m < ndofs + 2; m+=simd_size){
-                        simd_t drtilij0_dm  = xs::load_aligned(&drtilij0[m]);
-                        simd_t drtilij1_dm  = xs::load_aligned(&drtilij1[m]);
-                        simd_t drtilij2_dm  = xs::load_aligned(&drtilij2[m]);
-                        for(int n = m; n < ndofs + 2; n++){
-                            simd_t drtilij0_dn(drtilij0[n]);
-                            simd_t drtilij1_dn(drtilij1[n]);
-                            simd_t drtilij2_dn(drtilij2[n]);
-                            simd_t d2res_mn = drtilij0_dm * drtilij0_dn + drtilij1_dm * drtilij1_dn + drtilij2_dm * drtilij2_dn;
-                        
-                            int jjlimit = std::min(simd_size, ndofs+2-m);
-                            for(int jj = 0; jj < jjlimit; jj++){
-                                d2res(m+jj, n) += d2res_mn[jj];
-                            }
-                        }
-                    }
-
-                    // rij * d2rij_dmn
-                    for(int m = 0; m < ndofs; m+=simd_size){
-                        simd_t dx_ds_ij0m = xsimd::load_aligned(&dx_ds_ij0[m]);
-                        simd_t dx_ds_ij1m = xsimd::load_aligned(&dx_ds_ij1[m]);
-                        simd_t dx_ds_ij2m = xsimd::load_aligned(&dx_ds_ij2[m]);
-                        
-                        simd_t dxphi_ds_ij0m = xsimd::load_aligned(&dxphi_ds_ij0[m]);
-                        simd_t dxphi_ds_ij1m = xsimd::load_aligned(&dxphi_ds_ij1[m]);
-                        simd_t dxphi_ds_ij2m = xsimd::load_aligned(&dxphi_ds_ij2[m]);
-                        
-                        simd_t dxtheta_ds_ij0m = xsimd::load_aligned(&dxtheta_ds_ij0[m]);
-                        simd_t dxtheta_ds_ij1m = xsimd::load_aligned(&dxtheta_ds_ij1[m]);
-                        simd_t dxtheta_ds_ij2m = xsimd::load_aligned(&dxtheta_ds_ij2[m]);
-                        
-                        simd_t dBij0m = xsimd::load_aligned(&dBij0[m]);
-                        simd_t dBij1m = xsimd::load_aligned(&dBij1[m]);
-                        simd_t dBij2m = xsimd::load_aligned(&dBij2[m]);
-                        
-                        simd_t dB2_ijm = xsimd::load_aligned(&dB2_ij[m]);
-                        simd_t dmodB_ijm = xsimd::load_aligned(&dmodB_ij[m]);
-                        simd_t dw_ijm = xsimd::load_aligned(&dw_ij[m]);
-                        
-                        simd_t dresij0m = xsimd::load_aligned(&dresij0[m]);
-                        simd_t dresij1m = xsimd::load_aligned(&dresij1[m]);
-                        simd_t dresij2m = xsimd::load_aligned(&dresij2[m]);
-                        
-                        simd_t dtang_ij0m = xsimd::load_aligned(&dtang_ij0[m]);
-                        simd_t dtang_ij1m = xsimd::load_aligned(&dtang_ij1[m]);
-                        simd_t dtang_ij2m = xsimd::load_aligned(&dtang_ij2[m]);
-
-                        for(int n = m; n < ndofs; n++){
-                            simd_t d2Bij0_mn(0.);
-                            simd_t d2Bij1_mn(0.); 
-                            simd_t d2Bij2_mn(0.); 
-                            for(int l = 0; l < 3; l++){
-                                simd_t dx_ds_ijln(dx_ds(i, j, l, n));
-
-                                d2Bij0_mn += d2B_dx2(i, j, 0, l, 0) * dx_ds_ij0m * dx_ds_ijln;
-                                d2Bij1_mn += d2B_dx2(i, j, 0, l, 1) * dx_ds_ij0m * dx_ds_ijln;
-                                d2Bij2_mn += d2B_dx2(i, j, 0, l, 2) * dx_ds_ij0m * dx_ds_ijln;
-                                d2Bij0_mn += d2B_dx2(i, j, 1, l, 0) * dx_ds_ij1m * dx_ds_ijln;
-                                d2Bij1_mn += d2B_dx2(i, j, 1, l, 1) * dx_ds_ij1m * dx_ds_ijln;
-                                d2Bij2_mn += d2B_dx2(i, j, 1, l, 2) * dx_ds_ij1m * dx_ds_ijln;
-                                d2Bij0_mn += d2B_dx2(i, j, 2, l, 0) * dx_ds_ij2m * dx_ds_ijln;
-                                d2Bij1_mn += d2B_dx2(i, j, 2, l, 1) * dx_ds_ij2m * dx_ds_ijln;
-                                d2Bij2_mn += d2B_dx2(i, j, 2, l, 2) * dx_ds_ij2m * dx_ds_ijln;
-                            }
-                            
-                            auto d2B2_ijmn = 2*(dBij0m*dBij0[n] + dBij1m*dBij1[n] + dBij2m*dBij2[n]+ B(i,j,0) * d2Bij0_mn + B(i,j,1) * d2Bij1_mn + B(i,j,2) * d2Bij2_mn);
-                            auto term1_0 = -dtang_ij0[n] * dB2_ijm;
-                            auto term1_1 = -dtang_ij1[n] * dB2_ijm;
-                            auto term1_2 = -dtang_ij2[n] * dB2_ijm;
-
-                            auto term2_0 = -dtang_ij0m * dB2_ij[n];
-                            auto term2_1 = -dtang_ij1m * dB2_ij[n];
-                            auto term2_2 = -dtang_ij2m * dB2_ij[n];
-
-                            auto term3_0 = -tang_ij0 * d2B2_ijmn;
-                            auto term3_1 = -tang_ij1 * d2B2_ijmn;
-                            auto term3_2 = -tang_ij2 * d2B2_ijmn;
-
-                            auto d2res_ij0mn = xsimd::fma(GG , d2Bij0_mn , term1_0) + term2_0 + term3_0;
-                            auto d2res_ij1mn = xsimd::fma(GG , d2Bij1_mn , term1_1) + term2_1 + term3_1;
-                            auto d2res_ij2mn = xsimd::fma(GG , d2Bij2_mn , term1_2) + term2_2 + term3_2;
-                            
-                            auto d2modB_ijmn = (2 * B2ij * d2B2_ijmn - dB2_ijm*dB2_ij[n]) * powrmodBijthree / 4. ;
-                            auto d2wij_mn = weight_inv_modB ? (2. * dmodB_ijm * dmodB_ij[n] - modB_ij * d2modB_ijmn) * powrmodBijthree : simd_t(0.);
-                           
-                            auto d2rtil_0mn = dresij0m *dw_ij[n] + dresij0[n] * dw_ijm + d2res_ij0mn * wij + resij0 * d2wij_mn;
-                            auto d2rtil_1mn = dresij1m *dw_ij[n] + dresij1[n] * dw_ijm + d2res_ij1mn * wij + resij1 * d2wij_mn;
-                            auto d2rtil_2mn = dresij2m *dw_ij[n] + dresij2[n] * dw_ijm + d2res_ij2mn * wij + resij2 * d2wij_mn;
-                            
-                            auto d2res_mn = rtil_ij0 * d2rtil_0mn + rtil_ij1 * d2rtil_1mn +rtil_ij2 * d2rtil_2mn;
-
-                            int jjlimit = std::min(simd_size, ndofs-m);
-                            for(int jj = 0; jj < jjlimit; jj++){
-                                d2res(m+jj, n) += d2res_mn[jj];
-                            }
-                        }
-                        auto d2res_ij0miota = -(dB2_ijm * xtheta(i, j, 0) + B2ij * dxtheta_ds_ij0m); 
-                        auto d2res_ij1miota = -(dB2_ijm * xtheta(i, j, 1) + B2ij * dxtheta_ds_ij1m);
-                        auto d2res_ij2miota = -(dB2_ijm * xtheta(i, j, 2) + B2ij * dxtheta_ds_ij2m);
-                        
-
-                        auto d2rtil_ij0miota = d2res_ij0miota * wij + dres_ij0iota * dw_ijm ;
-                        auto d2rtil_ij1miota = d2res_ij1miota * wij + dres_ij1iota * dw_ijm ;
-                        auto d2rtil_ij2miota = d2res_ij2miota * wij + dres_ij2iota * dw_ijm ;
-                        auto d2res_miota = rtil_ij0*d2rtil_ij0miota+rtil_ij1*d2rtil_ij1miota+rtil_ij2*d2rtil_ij2miota;   
-
-                        int jjlimit = std::min(simd_size, ndofs-m);
-                        for(int jj = 0; jj < jjlimit; jj++){
-                            d2res(m+jj, ndofs) += d2res_miota[jj];
-                        }
-
-                        auto d2res_ij0mG = dBij0m; 
-                        auto d2res_ij1mG = dBij1m;
-                        auto d2res_ij2mG = dBij2m;
-
-                        auto d2rtil_ij0mG = d2res_ij0mG * wij + dres_ij0_dG * dw_ijm;
-                        auto d2rtil_ij1mG = d2res_ij1mG * wij + dres_ij1_dG * dw_ijm;
-                        auto d2rtil_ij2mG = d2res_ij2mG * wij + dres_ij2_dG * dw_ijm;
-                        auto d2res_mG = rtil_ij0*d2rtil_ij0mG+rtil_ij1*d2rtil_ij1mG+rtil_ij2*d2rtil_ij2mG;
-
-                        for(int jj = 0; jj < jjlimit; jj++){
-                            d2res(m+jj, ndofs+1) += d2res_mG[jj];
-                        }
-
-                    }
+                    p.dr[c][m] = dr_m;
+                    p.dtang[c][m] = dtang_m;
+                    p.dB[c][m] = dB_m[c];
+                    p.dx[c][m] = dx_m[c];
+                    p.dxtheta[c][m] = dxtheta_m;
                 }
             }
+            MYIF(deriv > 1) {
+                p.dB2[m] = dB2_m;
+                p.dw[m] = dw_m;
+                p.dmodB[m] = dmodB_m;
+            }
+        }
+
+        for (int c = 0; c < 3; ++c) {
+            p.dr_iota[c] = -p.B2*p.xtheta[c];
+            p.dr_G[c] = p.B[c];
+            p.drtil[c][ndofs + 0] = p.dr_iota[c]*p.w;
+            p.drtil[c][ndofs + 1] = p.dr_G[c]*p.w;
         }
     }
+    return res;
+}
 
-    MYIF(deriv > 1){
-        // symmetrize the Hessian
-        for(int m = 0; m < ndofs+2; m++){
-            for(int n = m+1; n < ndofs+2; n++){
-                d2res(n, m) = d2res(m, n);
+// Adds the contribution of the point p to the rows m, ..., m+boozer_simd_size-1
+// of dres and of the upper triangle of d2res, which is stored row major in
+// d2res_ptr. m is a multiple of boozer_simd_size.
+template<int deriv>
+void boozer_point_rows(const BoozerPoint& p, double G, size_t ndofs, bool weight_inv_modB, int m, double* dres_ptr, double* d2res_ptr){
+    int nrows = ndofs + 2;
+    int jjlimit = std::min(boozer_simd_size, nrows - m);
+
+    boozer_lane_t rtil[3], drtil_m[3];
+    for (int c = 0; c < 3; ++c) {
+        rtil[c] = boozer_lane_t(p.rtil[c]);
+        drtil_m[c] = boozer_load(p.drtil[c] + m);
+    }
+
+    // sum_k (r_k grad r_k)
+    boozer_lane_t dres_m = rtil[0]*drtil_m[0] + rtil[1]*drtil_m[1] + rtil[2]*drtil_m[2];
+    for (int jj = 0; jj < jjlimit; ++jj)
+        dres_ptr[m + jj] += boozer_lane(dres_m, jj);
+
+    MYIF(deriv > 1) {
+        // The rows beyond ndofs belong to iota and G, and their entries of
+        // the vectors other than drtil are zero. Hence the second derivative
+        // terms below vanish for them, and all rows can be treated the same.
+        boozer_lane_t dx_m[3], dxtheta_m[3], dB_m[3], dr_m[3], dtang_m[3];
+        for (int c = 0; c < 3; ++c) {
+            dx_m[c] = boozer_load(p.dx[c] + m);
+            dxtheta_m[c] = boozer_load(p.dxtheta[c] + m);
+            dB_m[c] = boozer_load(p.dB[c] + m);
+            dr_m[c] = boozer_load(p.dr[c] + m);
+            dtang_m[c] = boozer_load(p.dtang[c] + m);
+        }
+        boozer_lane_t dB2_m = boozer_load(p.dB2 + m);
+        boozer_lane_t dw_m = boozer_load(p.dw + m);
+        boozer_lane_t dmodB_m = boozer_load(p.dmodB + m);
+
+        // d^2 B_c / ds_m ds_n = \sum_l d2Bx_m[l][c] dx_l / ds_n
+        boozer_lane_t d2Bx_m[3][3];
+        for (int l = 0; l < 3; ++l)
+            for (int c = 0; c < 3; ++c)
+                d2Bx_m[l][c] = p.d2B[0][l][c]*dx_m[0] + p.d2B[1][l][c]*dx_m[1] + p.d2B[2][l][c]*dx_m[2];
+
+        double* row = d2res_ptr + size_t(m)*nrows;
+        for (int n = m; n < ndofs; ++n) {
+            // outer product d_rtil_dm (x) d_rtil_dn
+            boozer_lane_t d2res_mn = drtil_m[0]*p.drtil[0][n] + drtil_m[1]*p.drtil[1][n] + drtil_m[2]*p.drtil[2][n];
+
+            // rtil * d2rtil_dmn
+            boozer_lane_t d2B_mn[3];
+            for (int c = 0; c < 3; ++c)
+                d2B_mn[c] = d2Bx_m[0][c]*p.dx[0][n] + d2Bx_m[1][c]*p.dx[1][n] + d2Bx_m[2][c]*p.dx[2][n];
+            boozer_lane_t d2B2_mn = 2*(dB_m[0]*p.dB[0][n] + dB_m[1]*p.dB[1][n] + dB_m[2]*p.dB[2][n]
+                    + p.B[0]*d2B_mn[0] + p.B[1]*d2B_mn[1] + p.B[2]*d2B_mn[2]);
+            boozer_lane_t d2modB_mn = (2*p.B2*d2B2_mn - dB2_m*p.dB2[n]) * (p.w3/4.);
+            boozer_lane_t d2w_mn = weight_inv_modB ? (2.*dmodB_m*p.dmodB[n] - p.modB*d2modB_mn)*p.w3 : boozer_lane_t(0.);
+            for (int c = 0; c < 3; ++c) {
+                boozer_lane_t d2r_mn = G*d2B_mn[c] - p.dtang[c][n]*dB2_m - dtang_m[c]*p.dB2[n] - p.tang[c]*d2B2_mn;
+                boozer_lane_t d2rtil_mn = dr_m[c]*p.dw[n] + p.dr[c][n]*dw_m + d2r_mn*p.w + p.r[c]*d2w_mn;
+                d2res_mn += rtil[c]*d2rtil_mn;
             }
+            for (int jj = 0; jj < jjlimit; ++jj)
+                row[jj*nrows + n] += boozer_lane(d2res_mn, jj);
+        }
+
+        // the columns of iota and G
+        boozer_lane_t d2res_miota = drtil_m[0]*p.drtil[0][ndofs] + drtil_m[1]*p.drtil[1][ndofs] + drtil_m[2]*p.drtil[2][ndofs];
+        boozer_lane_t d2res_mG = drtil_m[0]*p.drtil[0][ndofs+1] + drtil_m[1]*p.drtil[1][ndofs+1] + drtil_m[2]*p.drtil[2][ndofs+1];
+        for (int c = 0; c < 3; ++c) {
+            boozer_lane_t d2r_miota = -(dB2_m*p.xtheta[c] + p.B2*dxtheta_m[c]);
+            boozer_lane_t d2rtil_miota = d2r_miota*p.w + p.dr_iota[c]*dw_m;
+            d2res_miota += rtil[c]*d2rtil_miota;
+            boozer_lane_t d2rtil_mG = dB_m[c]*p.w + p.dr_G[c]*dw_m;
+            d2res_mG += rtil[c]*d2rtil_mG;
+        }
+        for (int jj = 0; jj < jjlimit; ++jj) {
+            if(m + jj <= ndofs)
+                row[jj*nrows + ndofs] += boozer_lane(d2res_miota, jj);
+            row[jj*nrows + ndofs + 1] += boozer_lane(d2res_mG, jj);
         }
     }
 }
 
-#else
 template<class T, int deriv> void boozer_residual_impl(double G, double iota, T& B, T& dB_dx, T& d2B_dx2, T& xphi, T& xtheta, T& dx_ds, T& dxphi_ds, T& dxtheta_ds, double& res, T& dres, T& d2res, size_t ndofs, bool weight_inv_modB){
     int nphi = xphi.shape(0);
     int ntheta = xtheta.shape(1);
+    int num_points = nphi * ntheta;
+    SIMSOPT_PERF_SCOPE(boozer_residual, num_points);
+
+    int nrows = deriv > 0 ? ndofs + 2 : 0;
+    int row_blocks = (nrows + boozer_simd_size - 1)/boozer_simd_size;
+    size_t stride = size_t(row_blocks)*boozer_simd_size;
+    size_t nvec = boozer_point_vectors(deriv);
+    int block = boozer_point_block(nvec*stride);
+
+    ScratchBuffer<double> buffer(std::max(size_t(block)*nvec*stride, size_t(1)), 0.);
+    std::vector<BoozerPoint> points(block);
+    std::vector<double> res_points(block);
+    for (int q = 0; q < block && nvec > 0; ++q) {
+        double* ptr = buffer.data() + q*nvec*stride;
+        auto take = [&]() { double* v = ptr; ptr += stride; return v; };
+        BoozerPoint& p = points[q];
+        for (int c = 0; c < 3; ++c)
+            p.drtil[c] = take();
+        MYIF(deriv > 1) {
+            for (int c = 0; c < 3; ++c) {
+                p.dr[c] = take();
+                p.dtang[c] = take();
+                p.dB[c] = take();
+                p.dx[c] = take();
+                p.dxtheta[c] = take();
+            }
+            p.dB2 = take();
+            p.dw = take();
+            p.dmodB = take();
+        }
+    }
 
-    for(int i=0; i<nphi; i++){
-        for(int j=0; j<ntheta; j++){
-            double B2ij = B(i,j,0)*B(i,j,0) + B(i,j,1)*B(i,j,1) + B(i,j,2)*B(i,j,2);
-            double rB2ij = 1/B2ij;
-            double wij = weight_inv_modB ? sqrt(rB2ij) : 1.;
-            double modB_ij = sqrt(B2ij);
-            double powrmodBijthree = wij*wij*wij;
-
-            double tang_ij0 = xphi(i,j,0)+iota*xtheta(i,j,0); 
-            double tang_ij1 = xphi(i,j,1)+iota*xtheta(i,j,1); 
-            double tang_ij2 = xphi(i,j,2)+iota*xtheta(i,j,2);  
-
-            double resij0 = G*B(i, j, 0)  - B2ij * tang_ij0;
-            double resij1 = G*B(i, j, 1)  - B2ij * tang_ij1;
-            double resij2 = G*B(i, j, 2)  - B2ij * tang_ij2;
-            
-            double rtil_ij0, rtil_ij1, rtil_ij2;
-
-            rtil_ij0 = resij0 * wij;
-            rtil_ij1 = resij1 * wij;
-            rtil_ij2 = resij2 * wij;
-
-            res += 0.5*(rtil_ij0*rtil_ij0 + rtil_ij1*rtil_ij1 + rtil_ij2*rtil_ij2);
-            
-            MYIF(deriv>0){
-                auto drtilij0 = AlignedPaddedVec(ndofs+2, 0);
-                auto drtilij1 = AlignedPaddedVec(ndofs+2, 0);
-                auto drtilij2 = AlignedPaddedVec(ndofs+2, 0);
-                
-                auto dresij0 = AlignedPaddedVec(ndofs+2, 0);
-                auto dresij1 = AlignedPaddedVec(ndofs+2, 0);
-                auto dresij2 = AlignedPaddedVec(ndofs+2, 0);
-
-                auto dw_ij = AlignedPaddedVec(ndofs+2, 0);
-
-                auto dtang_ij0 = AlignedPaddedVec(ndofs+2, 0);
-                auto dtang_ij1 = AlignedPaddedVec(ndofs+2, 0);
-                auto dtang_ij2 = AlignedPaddedVec(ndofs+2, 0);
-
-                auto dB2_ij = AlignedPaddedVec(ndofs+2, 0);
-                auto dBij0 = AlignedPaddedVec(ndofs+2, 0);
-                auto dBij1 = AlignedPaddedVec(ndofs+2, 0);
-                auto dBij2 = AlignedPaddedVec(ndofs+2, 0);
-                auto dmodB_ij = AlignedPaddedVec(ndofs+2, 0);
-
-                for (int m = 0; m < ndofs; m++) {
-                    double dBij0m = dB_dx(i,j,0,0)*dx_ds(i,j,0,m)+dB_dx(i,j,1,0)*dx_ds(i,j,1,m)+dB_dx(i,j,2,0)*dx_ds(i,j,2,m); 
-                    double dBij1m = dB_dx(i,j,0,1)*dx_ds(i,j,0,m)+dB_dx(i,j,1,1)*dx_ds(i,j,1,m)+dB_dx(i,j,2,1)*dx_ds(i,j,2,m); 
-                    double dBij2m = dB_dx(i,j,0,2)*dx_ds(i,j,0,m)+dB_dx(i,j,1,2)*dx_ds(i,j,1,m)+dB_dx(i,j,2,2)*dx_ds(i,j,2,m);
-
-                    double dB2_ijm = 2*(B(i,j,0) * dBij0m + B(i,j,1) * dBij1m + B(i,j,2) * dBij2m);
-                    double tang_ij0m = iota*dxtheta_ds(i,j,0,m) + dxphi_ds(i,j,0,m);
-                    double tang_ij1m = iota*dxtheta_ds(i,j,1,m) + dxphi_ds(i,j,1,m);
-                    double tang_ij2m = iota*dxtheta_ds(i,j,2,m) + dxphi_ds(i,j,2,m);
-
-                    double dresij0m = G * dBij0m - (dB2_ijm * tang_ij0 + B2ij * tang_ij0m);
-                    double dresij1m = G * dBij1m - (dB2_ijm * tang_ij1 + B2ij * tang_ij1m);
-                    double dresij2m = G * dBij2m - (dB2_ijm * tang_ij2 + B2ij * tang_ij2m);
-
-                    double dmodB_ijm = 0.5 * dB2_ijm * wij;
-                    double dw_ijm = weight_inv_modB ? -dmodB_ijm * rB2ij : 0.;
-                    double drtil_ij0m = dresij0m * wij + dw_ijm * resij0; 
-                    double drtil_ij1m = dresij1m * wij + dw_ijm * resij1; 
-                    double drtil_ij2m = dresij2m * wij + dw_ijm * resij2;
-
-                    // sum_k (r_k grad r_k)
-                    dres(m) += rtil_ij0 * drtil_ij0m + rtil_ij1 * drtil_ij1m + rtil_ij2 * drtil_ij2m;
-
-                    drtilij0[m] = drtil_ij0m;
-                    drtilij1[m] = drtil_ij1m;
-                    drtilij2[m] = drtil_ij2m;
-                    
-                    dB2_ij[m] = dB2_ijm;
-                    dtang_ij0[m] = tang_ij0m;
-                    dtang_ij1[m] = tang_ij1m;
-                    dtang_ij2[m] = tang_ij2m;
-                    dresij0[m] = dresij0m;
-                    dresij1[m] = dresij1m;
-                    dresij2[m] = dresij2m;
-
-                    dBij0[m] = dBij0m;
-                    dBij1[m] = dBij1m;
-                    dBij2[m] = dBij2m;
-
-                    dw_ij[m] = dw_ijm;
-
-                    dmodB_ij[m] = dmodB_ijm;
-                }
-                
-                double dres_ij0iota = -B2ij * xtheta(i, j, 0);
-                double dres_ij1iota = -B2ij * xtheta(i, j, 1);
-                double dres_ij2iota = -B2ij * xtheta(i, j, 2);
-                 
-                double drtil_ij0iota = dres_ij0iota * wij; 
-                double drtil_ij1iota = dres_ij1iota * wij; 
-                double drtil_ij2iota = dres_ij2iota * wij;
-                dres(ndofs + 0) += rtil_ij0 * drtil_ij0iota + rtil_ij1 * drtil_ij1iota + rtil_ij2 * drtil_ij2iota;
-                
-                drtilij0[ndofs + 0] = drtil_ij0iota; 
-                drtilij1[ndofs + 0] = drtil_ij1iota; 
-                drtilij2[ndofs + 0] = drtil_ij2iota; 
-
-
-                double dres_ij0_dG = B(i, j, 0);
-                double dres_ij1_dG = B(i, j, 1);
-                double dres_ij2_dG = B(i, j, 2);
-
-                double drtil_ij0_dG = wij * dres_ij0_dG;
-                double drtil_ij1_dG = wij * dres_ij1_dG;
-                double drtil_ij2_dG = wij * dres_ij2_dG;
-                dres(ndofs + 1) += rtil_ij0 * drtil_ij0_dG + rtil_ij1 * drtil_ij1_dG + rtil_ij2 * drtil_ij2_dG;
-
-                drtilij0[ndofs + 1] = drtil_ij0_dG; 
-                drtilij1[ndofs + 1] = drtil_ij1_dG; 
-                drtilij2[ndofs + 1] = drtil_ij2_dG; 
-                MYIF(deriv > 1) {
-                    // outer product d_rij0_dm (x) d_rij0_dm
-                    for(int m = 0; m < ndofs + 2; m++){
-                        for(int n = m; n < ndofs + 2; n++){
-                            d2res(m, n) += drtilij0[m] * drtilij0[n] + drtilij1[m] * drtilij1[n] + drtilij2[m] * drtilij2[n];
-                        }
-                    }
-
-                    // rij * d2rij_dmn
-                    for(int m = 0; m < ndofs; m++){
-                        for(int n = m; n < ndofs; n++){
-                            double d2Bij0_mn = 0.;
-                            double d2Bij1_mn = 0.; 
-                            double d2Bij2_mn = 0.; 
-                            for(int l = 0; l < 3; l++){
-                                d2Bij0_mn += d2B_dx2(i, j, 0, l, 0) * dx_ds(i,j,0,m) * dx_ds(i, j, l, n);
-                                d2Bij1_mn += d2B_dx2(i, j, 0, l, 1) * dx_ds(i,j,0,m) * dx_ds(i, j, l, n);
-                                d2Bij2_mn += d2B_dx2(i, j, 0, l, 2) * dx_ds(i,j,0,m) * dx_ds(i, j, l, n);
-                                d2Bij0_mn += d2B_dx2(i, j, 1, l, 0) * dx_ds(i,j,1,m) * dx_ds(i, j, l, n);
-                                d2Bij1_mn += d2B_dx2(i, j, 1, l, 1) * dx_ds(i,j,1,m) * dx_ds(i, j, l, n);
-                                d2Bij2_mn += d2B_dx2(i, j, 1, l, 2) * dx_ds(i,j,1,m) * dx_ds(i, j, l, n);
-                                d2Bij0_mn += d2B_dx2(i, j, 2, l, 0) * dx_ds(i,j,2,m) * dx_ds(i, j, l, n);
-                                d2Bij1_mn += d2B_dx2(i, j, 2, l, 1) * dx_ds(i,j,2,m) * dx_ds(i, j, l, n);
-                                d2Bij2_mn += d2B_dx2(i, j, 2, l, 2) * dx_ds(i,j,2,m) * dx_ds(i, j, l, n);
-                            }
-                            
-                            auto d2B2_ijmn = 2*(dBij0[m]*dBij0[n] + dBij1[m]*dBij1[n] + dBij2[m]*dBij2[n]+ B(i,j,0) * d2Bij0_mn + B(i,j,1) * d2Bij1_mn + B(i,j,2) * d2Bij2_mn);
-                            auto term1_0 = -dtang_ij0[n] * dB2_ij[m];
-                            auto term1_1 = -dtang_ij1[n] * dB2_ij[m];
-                            auto term1_2 = -dtang_ij2[n] * dB2_ij[m];
-
-                            auto term2_0 = -dtang_ij0[m] * dB2_ij[n];
-                            auto term2_1 = -dtang_ij1[m] * dB2_ij[n];
-                            auto term2_2 = -dtang_ij2[m] * dB2_ij[n];
-
-                            auto term3_0 = -tang_ij0 * d2B2_ijmn;
-                            auto term3_1 = -tang_ij1 * d2B2_ijmn;
-                            auto term3_2 = -tang_ij2 * d2B2_ijmn;
-
-                            auto d2res_ij0mn = G * d2Bij0_mn + term1_0 + term2_0 + term3_0;
-                            auto d2res_ij1mn = G * d2Bij1_mn + term1_1 + term2_1 + term3_1;
-                            auto d2res_ij2mn = G * d2Bij2_mn + term1_2 + term2_2 + term3_2;
-                            
-                            auto d2modB_ijmn = (2 * B2ij * d2B2_ijmn - dB2_ij[m]*dB2_ij[n]) * powrmodBijthree / 4. ;
-                            auto d2wij_mn = weight_inv_modB ? (2. * dmodB_ij[m] * dmodB_ij[n] - modB_ij * d2modB_ijmn) * powrmodBijthree : 0.;
-                           
-                            auto d2rtil_0mn = dresij0[m] *dw_ij[n] + dresij0[n] * dw_ij[m] + d2res_ij0mn * wij + resij0 * d2wij_mn;
-                            auto d2rtil_1mn = dresij1[m] *dw_ij[n] + dresij1[n] * dw_ij[m] + d2res_ij1mn * wij + resij1 * d2wij_mn;
-                            auto d2rtil_2mn = dresij2[m] *dw_ij[n] + dresij2[n] * dw_ij[m] + d2res_ij2mn * wij + resij2 * d2wij_mn;
-                            
-                            auto d2res_mn = rtil_ij0 * d2rtil_0mn + rtil_ij1 * d2rtil_1mn +rtil_ij2 * d2rtil_2mn;
-
-                            d2res(m, n) += d2res_mn;
-                        }
-                        auto d2res_ij0miota = -(dB2_ij[m] * xtheta(i, j, 0) + B2ij * dxtheta_ds(i,j,0,m)); 
-                        auto d2res_ij1miota = -(dB2_ij[m] * xtheta(i, j, 1) + B2ij * dxtheta_ds(i,j,1,m));
-                        auto d2res_ij2miota = -(dB2_ij[m] * xtheta(i, j, 2) + B2ij * dxtheta_ds(i,j,2,m));
-                        
-
-                        auto d2rtil_ij0miota = d2res_ij0miota * wij + dres_ij0iota * dw_ij[m] ;
-                        auto d2rtil_ij1miota = d2res_ij1miota * wij + dres_ij1iota * dw_ij[m] ;
-                        auto d2rtil_ij2miota = d2res_ij2miota * wij + dres_ij2iota * dw_ij[m] ;
-                        auto d2res_miota = rtil_ij0*d2rtil_ij0miota+rtil_ij1*d2rtil_ij1miota+rtil_ij2*d2rtil_ij2miota;   
-
-                        d2res(m, ndofs) += d2res_miota;
-
-                        auto d2res_ij0mG = dBij0[m]; 
-                        auto d2res_ij1mG = dBij1[m];
-                        auto d2res_ij2mG = dBij2[m];
-
-                        auto d2rtil_ij0mG = d2res_ij0mG * wij + dres_ij0_dG * dw_ij[m];
-                        auto d2rtil_ij1mG = d2res_ij1mG * wij + dres_ij1_dG * dw_ij[m];
-                        auto d2rtil_ij2mG = d2res_ij2mG * wij + dres_ij2_dG * dw_ij[m];
-                        auto d2res_mG = rtil_ij0*d2rtil_ij0mG+rtil_ij1*d2rtil_ij1mG+rtil_ij2*d2rtil_ij2mG;
-
-                        d2res(m, ndofs+1) += d2res_mG;
-
-                    }
-                }
+    double* dres_ptr = nullptr;
+    double* d2res_ptr = nullptr;
+    MYIF(deriv > 0)
+        dres_ptr = &dres(0);
+    MYIF(deriv > 1)
+        d2res_ptr = &d2res(0, 0);
+
+#pragma omp parallel
+    {
+#if defined(_OPENMP)
+        int thread = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+#else
+        int thread = 0;
+        int nthreads = 1;
+#endif
+        for (int start = 0; start < num_points; start += block) {
+            int count = std::min(block, num_points - start);
+#pragma omp for schedule(static)
+            for (int q = 0; q < count; ++q) {
+                int i = (start + q) / ntheta;
+                int j = (start + q) % ntheta;
+                res_points[q] = boozer_point_derivatives<T, deriv>(G, iota, B, dB_dx, d2B_dx2, xphi, xtheta, dx_ds, dxphi_ds, dxtheta_ds, ndofs, weight_inv_modB, i, j, points[q]);
+            }
+#pragma omp single nowait
+            {
+                for (int q = 0; q < count; ++q)
+                    res += res_points[q];
             }
+            MYIF(deriv > 0) {
+                // cyclic distribution of the row blocks, so that the threads
+                // get a similar share of the triangle
+                for (int q = 0; q < count; ++q)
+                    for (int b = thread; b < row_blocks; b += nthreads)
+                        boozer_point_rows<deriv>(points[q], G, ndofs, weight_inv_modB, b*boozer_simd_size, dres_ptr, d2res_ptr);
+            }
+#pragma omp barrier
         }
     }
 
     MYIF(deriv > 1){
         // symmetrize the Hessian
-        for(int m = 0; m < ndofs+2; m++){
-            for(int n = m+1; n < ndofs+2; n++){
+        for(int m = 0; m < nrows; m++){
+            for(int n = m+1; n < nrows; n++){
                 d2res(n, m) = d2res(m, n);
             }
         }
     }
 }
 
+// Adds the contribution of the point p to the Hessian vector product
+// hvp = d2res v, without forming the Hessian. With the directional
+// derivatives delta q = \sum_n (dq/dx_n) v_n along v, the second derivatives
+// of the residual only enter through
+//
+//      (d2rtil v)_m = (d2r v)_m w + dr_m delta w + delta r dw_m + r (d2w v)_m,
+//
+// and since x is linear in the dofs, d2r v and d2w v only require the first
+// derivatives and the contraction of d2B_dx2 with delta x. The cost is
+// O(ndofs) per point instead of O(ndofs^2).
+inline void boozer_point_hvp(const BoozerPoint& p, double G, size_t ndofs, bool weight_inv_modB, const double* v, double* hvp){
+    double v_iota = v[ndofs], v_G = v[ndofs + 1];
+
+    double delta_x[3] = {0., 0., 0.}, delta_B[3] = {0., 0., 0.}, delta_tang[3] = {0., 0., 0.};
+    double delta_xtheta[3] = {0., 0., 0.}, delta_r[3] = {0., 0., 0.}, delta_rtil[3] = {0., 0., 0.};
+    double delta_B2 = 0., delta_w = 0.;
+    for (int n = 0; n < ndofs; ++n) {
+        double vn = v[n];
+        for (int c = 0; c < 3; ++c) {
+            delta_x[c] += p.dx[c][n]*vn;
+            delta_B[c] += p.dB[c][n]*vn;
+            delta_tang[c] += p.dtang[c][n]*vn;
+            delta_xtheta[c] += p.dxtheta[c][n]*vn;
+            delta_r[c] += p.dr[c][n]*vn;
+        }
+        delta_B2 += p.dB2[n]*vn;
+        delta_w += p.dw[n]*vn;
+    }
+    for (int c = 0; c < 3; ++c) {
+        delta_tang[c] += v_iota*p.xtheta[c];
+        delta_r[c] += v_iota*p.dr_iota[c] + v_G*p.dr_G[c];
+        for (int n = 0; n < ndofs + 2; ++n)
+            delta_rtil[c] += p.drtil[c][n]*v[n];
+    }
+
+    // (d2B_c v)_m = \sum_k dx_k/ds_m Q[k][c]
+    double Q[3][3];
+    for (int k = 0; k < 3; ++k)
+        for (int c = 0; c < 3; ++c)
+            Q[k][c] = p.d2B[k][0][c]*delta_x[0] + p.d2B[k][1][c]*delta_x[1] + p.d2B[k][2][c]*delta_x[2];
+    double w5 = p.w3*p.w*p.w;
+
+    for (int m = 0; m < ndofs; ++m) {
+        double d2Bv[3];
+        double d2B2v = 0.;
+        for (int c = 0; c < 3; ++c) {
+            d2Bv[c] = p.dx[0][m]*Q[0][c] + p.dx[1][m]*Q[1][c] + p.dx[2][m]*Q[2][c];
+            d2B2v += p.dB[c][m]*delta_B[c] + p.B[c]*d2Bv[c];
+        }
+        d2B2v *= 2;
+        double d2wv = weight_inv_modB ? 0.75*w5*p.dB2[m]*delta_B2 - 0.5*p.w3*d2B2v : 0.;
+        double hvp_m = 0.;
+        for (int c = 0; c < 3; ++c) {
+            double d2rv = v_G*p.dB[c][m] + G*d2Bv[c] - d2B2v*p.tang[c] - p.dB2[m]*delta_tang[c]
+                - delta_B2*p.dtang[c][m] - p.B2*p.dxtheta[c][m]*v_iota;
+            double d2rtilv = d2rv*p.w + p.dr[c][m]*delta_w + delta_r[c]*p.dw[m] + p.r[c]*d2wv;
+            hvp_m += p.drtil[c][m]*delta_rtil[c] + p.rtil[c]*d2rtilv;
+        }
+        hvp[m] += hvp_m;
+    }
+
+    // iota and G only enter linearly and don't change w
+    double hvp_iota = 0., hvp_G = 0.;
+    for (int c = 0; c < 3; ++c) {
+        double d2rv_iota = -delta_B2*p.xtheta[c] - p.B2*delta_xtheta[c];
+        double d2rtilv_iota = d2rv_iota*p.w + p.dr_iota[c]*delta_w;
+        hvp_iota += p.drtil[c][ndofs]*delta_rtil[c] + p.rtil[c]*d2rtilv_iota;
+        double d2rtilv_G = delta_B[c]*p.w + p.dr_G[c]*delta_w;
+        hvp_G += p.drtil[c][ndofs + 1]*delta_rtil[c] + p.rtil[c]*d2rtilv_G;
+    }
+    hvp[ndofs] += hvp_iota;
+    hvp[ndofs + 1] += hvp_G;
+}
+
+// hvp = d2res v, see boozer_point_hvp. Every phi row of surface points is
+// summed into its own partial product, and the partial products are added
+// in order, so that the result is the same for any number of threads.
+template<class T> void boozer_residual_hvp_impl(double G, double iota, T& B, T& dB_dx, T& d2B_dx2, T& xphi, T& xtheta, T& dx_ds, T& dxphi_ds, T& dxtheta_ds, const double* v, double* hvp, size_t ndofs, bool weight_inv_modB){
+    int nphi = xphi.shape(0);
+    int ntheta = xtheta.shape(1);
+    SIMSOPT_PERF_SCOPE(boozer_residual, nphi * ntheta);
+    size_t nrows = ndofs + 2;
+    size_t stride = (nrows + boozer_simd_size - 1)/boozer_simd_size*boozer_simd_size;
+    size_t nvec = boozer_point_vectors(2);
+
+    ScratchBuffer<double> partial(nphi*stride, 0.);
+#pragma omp parallel
+    {
+        ScratchBuffer<double> buffer(nvec*stride, 0.);
+        BoozerPoint p;
+        double* ptr = buffer.data();
+        auto take = [&]() { double* vec = ptr; ptr += stride; return vec; };
+        for (int c = 0; c < 3; ++c) {
+            p.drtil[c] = take();
+            p.dr[c] = take();
+            p.dtang[c] = take();
+            p.dB[c] = take();
+            p.dx[c] = take();
+            p.dxtheta[c] = take();
+        }
+        p.dB2 = take();
+        p.dw = take();
+        p.dmodB = take();
+
+#pragma omp for schedule(dynamic)
+        for (int i = 0; i < nphi; ++i) {
+            double* hvp_i = partial.data() + i*stride;
+            for (int j = 0; j < ntheta; ++j) {
+                boozer_point_derivatives<T, 2>(G, iota, B, dB_dx, d2B_dx2, xphi, xtheta, dx_ds, dxphi_ds, dxtheta_ds, ndofs, weight_inv_modB, i, j, p);
+                boozer_point_hvp(p, G, ndofs, weight_inv_modB, v, hvp_i);
+            }
+        }
+
+#pragma omp for schedule(static)
+        for (int m = 0; m < nrows; ++m) {
+            for (int i = 0; i < nphi; ++i)
+                hvp[m] += partial[i*stride + m];
+        }
+    }
+}
+
+#if defined(USE_XSIMD)
+inline void boozer_loadu(const double* ptr, simd_t& x) { x = xs::load_unaligned(ptr); }
+inline void boozer_storeu(double* ptr, const simd_t& x) { x.store_unaligned(ptr); }
 #endif
+inline void boozer_loadu(const double* ptr, double& x) { x = *ptr; }
+inline void boozer_storeu(double* ptr, const double& x) { *ptr = x; }
+
+// The dofs m, ..., m+size(L)-1 of
+//
+//      dres_d/dc_m = G dB_d/dc_m - 2 (B . dB/dc_m) tang_d - B2 (dxphi_d/dc_m + iota dxtheta_d/dc_m)
+//
+// at one surface point, see boozer_dresidual_dc_impl. If vjp is true,
+// \sum_d v[d] dres_d/dc_m is added to out[0][m], otherwise dres_d/dc_m is
+// stored in out[d][m].
+template<class L, bool vjp>
+inline void boozer_dresidual_dc_lanes(int m, double G, double iota, const double* const dB_dc[3], const double B[3], const double tang[3], double B2,
+        const double* const dxphi_dc[3], const double* const dxtheta_dc[3], const double v[3], double* const out[3]) {
+    L dB[3], dxphi[3], dxtheta[3];
+    for (int d = 0; d < 3; ++d) {
+        boozer_loadu(dB_dc[d] + m, dB[d]);
+        boozer_loadu(dxphi_dc[d] + m, dxphi[d]);
+        boozer_loadu(dxtheta_dc[d] + m, dxtheta[d]);
+    }
+    L B_dB = B[0]*dB[0] + B[1]*dB[1] + B[2]*dB[2];
+    L acc(0.);
+    for (int d = 0; d < 3; ++d) {
+        L res = G*dB[d] - 2*B_dB*tang[d] - B2*(dxphi[d] + iota*dxtheta[d]);
+        MYIF(vjp)
+            acc += v[d]*res;
+        else
+            boozer_storeu(out[d] + m, res);
+    }
+    MYIF(vjp) {
+        L sum;
+        boozer_loadu(out[0] + m, sum);
+        boozer_storeu(out[0] + m, sum + acc);
+    }
+}
+
+template<bool vjp, class T>
+inline void boozer_dresidual_dc_point(int i, int j, double G, double iota, T& dB_dc, T& B, T& tang, T& B2, T& dxphi_dc, T& dxtheta_dc, const double v[3], double* const out[3]) {
+    int ndofs = dB_dc.shape(3);
+    const double* dB_dc_ij[3];
+    const double* dxphi_dc_ij[3];
+    const double* dxtheta_dc_ij[3];
+    double B_ij[3], tang_ij[3];
+    for (int d = 0; d < 3; ++d) {
+        dB_dc_ij[d] = &(dB_dc(i, j, d, 0));
+        dxphi_dc_ij[d] = &(dxphi_dc(i, j, d, 0));
+        dxtheta_dc_ij[d] = &(dxtheta_dc(i, j, d, 0));
+        B_ij[d] = B(i, j, d);
+        tang_ij[d] = tang(i, j, d);
+    }
+    double B2_ij = B2(i, j);
+    int m = 0;
+    for (; m + boozer_simd_size <= ndofs; m += boozer_simd_size)
+        boozer_dresidual_dc_lanes<boozer_lane_t, vjp>(m, G, iota, dB_dc_ij, B_ij, tang_ij, B2_ij, dxphi_dc_ij, dxtheta_dc_ij, v, out);
+    for (; m < ndofs; ++m)
+        boozer_dresidual_dc_lanes<double, vjp>(m, G, iota, dB_dc_ij, B_ij, tang_ij, B2_ij, dxphi_dc_ij, dxtheta_dc_ij, v, out);
+}
+
+// Derivative of the unweighted Boozer residual G B - B2 (xphi + iota xtheta)
+// with respect to the surface dofs, without the contribution of dB2/dc to the
+// last term's B2, as used in boozer_surface_residual:
+//
+//      res(i, j, d, m) = G dB_dc(i, j, d, m) - 2 (B . dB_dc)(i, j, m) tang(i, j, d) - B2(i, j) (dxphi_dc + iota dxtheta_dc)(i, j, d, m)
+//
+// The arrays of shape (nphi, ntheta, 3, ndofs) need to be contiguous in their
+// last dimension.
+template<class T>
+void boozer_dresidual_dc_impl(double G, T& dB_dc, T& B, T& tang, T& B2, T& dxphi_dc, double iota, T& dxtheta_dc, T& res) {
+    int nphi = dB_dc.shape(0);
+    int ntheta = dB_dc.shape(1);
+#pragma omp parallel for schedule(static)
+    for (int ij = 0; ij < nphi*ntheta; ++ij) {
+        int i = ij / ntheta;
+        int j = ij % ntheta;
+        double* out[3] = {&(res(i, j, 0, 0)), &(res(i, j, 1, 0)), &(res(i, j, 2, 0))};
+        boozer_dresidual_dc_point<false>(i, j, G, iota, dB_dc, B, tang, B2, dxphi_dc, dxtheta_dc, nullptr, out);
+    }
+}
+
+// out(m) = \sum_{ijd} v(i, j, d) res(i, j, d, m) for res as in
+// boozer_dresidual_dc_impl, without storing res. As in
+// boozer_residual_hvp_impl, every phi row is summed separately and the rows
+// are added in order, so that the result doesn't depend on the number of
+// threads.
+template<class T>
+void boozer_dresidual_dc_vjp_impl(double G, T& dB_dc, T& B, T& tang, T& B2, T& dxphi_dc, double iota, T& dxtheta_dc, T& v, double* out) {
+    int nphi = dB_dc.shape(0);
+    int ntheta = dB_dc.shape(1);
+    int ndofs = dB_dc.shape(3);
+    ScratchBuffer<double> partial(size_t(nphi)*ndofs, 0.);
+#pragma omp parallel
+    {
+#pragma omp for schedule(static)
+        for (int i = 0; i < nphi; ++i) {
+            double* partial_i = partial.data() + size_t(i)*ndofs;
+            double* acc[3] = {partial_i, nullptr, nullptr};
+            for (int j = 0; j < ntheta; ++j) {
+                double v_ij[3] = {v(i, j, 0), v(i, j, 1), v(i, j, 2)};
+                boozer_dresidual_dc_point<true>(i, j, G, iota, dB_dc, B, tang, B2, dxphi_dc, dxtheta_dc, v_ij, acc);
+            }
+        }
+#pragma omp for schedule(static)
+        for (int m = 0; m < ndofs; ++m) {
+            for (int i = 0; i < nphi; ++i)
+                out[m] += partial[size_t(i)*ndofs + m];
+        }
+    }
+}
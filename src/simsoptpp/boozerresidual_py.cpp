@@ -1,9 +1,11 @@
 #include "boozerresidual_impl.h"
 #include "boozerresidual_py.h"
+#include "scratch.h"
+#include "gil.h"
 
 double boozer_residual(double G, double iota, Array& xphi, Array& xtheta, Array& B, bool weight_inv_modB){
     double res = 0.;
-    Array dummy  = xt::zeros<double>({1});
+    Array& dummy = placeholder_array<Array>(1);
     boozer_residual_impl<Array, 0>(G, iota, B, dummy, dummy, xphi, xtheta, dummy, dummy, dummy, res, dummy, dummy, 0, weight_inv_modB);
     return res;
 }
@@ -13,8 +15,11 @@ std::tuple<double, Array> boozer_residual_ds(double G, double iota, Array& B, Ar
     
     double res = 0.;
     Array dres  = xt::zeros<double>({ndofs+2});
-    Array dummy  = xt::zeros<double>({1});
-    boozer_residual_impl<Array, 1>(G, iota, B, dB_dx, dummy, xphi, xtheta, dx_ds, dxphi_ds, dxtheta_ds, res, dres, dummy, ndofs, weight_inv_modB);
+    Array& dummy = placeholder_array<Array>(1);
+    {
+        ReleaseGIL nogil;
+        boozer_residual_impl<Array, 1>(G, iota, B, dB_dx, dummy, xphi, xtheta, dx_ds, dxphi_ds, dxtheta_ds, res, dres, dummy, ndofs, weight_inv_modB);
+    }
     auto tup = std::make_tuple(res, dres);
     return tup;
 }
@@ -25,8 +30,49 @@ std::tuple<double, Array, Array> boozer_residual_ds2(double G, double iota, Arra
     double res = 0.;
     Array dres  = xt::zeros<double>({ndofs+2});
     Array d2res = xt::zeros<double>({ndofs+2, ndofs+2});
-    boozer_residual_impl<Array, 2>(G, iota, B, dB_dx, d2B_dx2, xphi, xtheta, dx_ds, dxphi_ds, dxtheta_ds, res, dres, d2res, ndofs, weight_inv_modB);
+    {
+        ReleaseGIL nogil;
+        boozer_residual_impl<Array, 2>(G, iota, B, dB_dx, d2B_dx2, xphi, xtheta, dx_ds, dxphi_ds, dxtheta_ds, res, dres, d2res, ndofs, weight_inv_modB);
+    }
     auto tup = std::make_tuple(res, dres, d2res);
     return tup;
 }
 
+
+Array boozer_residual_hvp(double G, double iota, Array& B, Array& dB_dx, Array& d2B_dx2, Array& xphi, Array& xtheta, Array& dx_ds, Array& dxphi_ds, Array& dxtheta_ds, Array& v, bool weight_inv_modB){
+    size_t ndofs = dx_ds.shape(3);
+    if(v.size() != ndofs+2)
+        throw std::invalid_argument("v needs to have ndofs+2 entries, for the surface dofs, iota and G.");
+
+    // v may be a strided view of a larger array
+    ScratchBuffer<double> vc(ndofs+2);
+    std::copy(v.begin(), v.end(), vc.begin());
+    Array hvp = xt::zeros<double>({ndofs+2});
+    {
+        ReleaseGIL nogil;
+        boozer_residual_hvp_impl<Array>(G, iota, B, dB_dx, d2B_dx2, xphi, xtheta, dx_ds, dxphi_ds, dxtheta_ds, vc.data(), hvp.data(), ndofs, weight_inv_modB);
+    }
+    return hvp;
+}
+
+Array& boozer_dresidual_dc(double G, Array& dB_dc, Array& B, Array& tang, Array& B2, Array& dxphi_dc, double iota, Array& dxtheta_dc, Array& res){
+    if(res.dimension() != 4 || res.shape(0) != dB_dc.shape(0) || res.shape(1) != dB_dc.shape(1) || res.shape(2) != 3 || res.shape(3) != dB_dc.shape(3))
+        throw std::invalid_argument("out needs to have the same shape as dB_dc.");
+    {
+        ReleaseGIL nogil;
+        boozer_dresidual_dc_impl<Array>(G, dB_dc, B, tang, B2, dxphi_dc, iota, dxtheta_dc, res);
+    }
+    return res;
+}
+
+Array boozer_dresidual_dc_vjp(double G, Array& dB_dc, Array& B, Array& tang, Array& B2, Array& dxphi_dc, double iota, Array& dxtheta_dc, Array& v){
+    if(v.dimension() != 3 || v.shape(0) != dB_dc.shape(0) || v.shape(1) != dB_dc.shape(1) || v.shape(2) != 3)
+        throw std::invalid_argument("v needs to have shape (nphi, ntheta, 3).");
+    size_t ndofs = dB_dc.shape(3);
+    Array res = xt::zeros<double>({ndofs});
+    {
+        ReleaseGIL nogil;
+        boozer_dresidual_dc_vjp_impl<Array>(G, dB_dc, B, tang, B2, dxphi_dc, iota, dxtheta_dc, v, res.data());
+    }
+    return res;
+}
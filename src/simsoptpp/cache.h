@@ -2,21 +2,262 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <mutex>
+#include <tuple>
+#include <algorithm>
+#include <functional>
+#include <array>
+#include <memory>
+#include <chrono>
+#include <cstdint>
 #include <xtensor/xarray.hpp>
 //#include <fmt/core.h>
 //#include <fmt/format.h>
 //#include <fmt/ranges.h>
 #include "cachedarray.h"
+#include "threads.h"
 
 
 using std::string;
 using std::vector;
 
+class RegisteredCache;
+
+// Keeps track of all caches below, so that the memory they hold can be
+// reported, and limited by a budget.
+//
+// If a budget is set, then after every allocation of a cache entry the
+// registry frees stale entries, i.e. ones that have been invalidated and
+// would be recomputed on the next access anyway, least recently used first,
+// until the total is below the budget. This is always safe. Entries that
+// still hold valid data are only evicted by an explicit call to trim(),
+// since C++ code may hold references to them (e.g. BiotSavart keeps pointers
+// to the gamma() of all coils while computing the field). trim() should hence
+// only be called between evaluations, e.g. once per iteration of an
+// optimisation, and trades recomputation for a bounded footprint.
+//
+// Caches are created and accessed while holding the GIL, so apart from
+// (un)registering no synchronisation is needed.
+class CacheRegistry {
+    public:
+        struct Usage {
+            string owner;
+            int object_id;
+            string key;
+            size_t bytes;
+            bool valid;
+        };
+
+    private:
+        std::mutex mutex;
+        std::set<RegisteredCache*> caches;
+        size_t budget = 0; // in bytes, 0 means unlimited
+        int64_t num_evicted = 0;
+        int next_object_id = 0;
+        uint64_t clock = 0;
+
+        size_t evict_until_within_budget(bool stale_only);
+
+    public:
+        // never destroyed, since caches owned by python objects may be
+        // deleted after static destructors have run
+        static CacheRegistry& instance() {
+            static CacheRegistry* registry = new CacheRegistry();
+            return *registry;
+        }
+
+        void add(RegisteredCache* cache) {
+            std::lock_guard<std::mutex> lock(mutex);
+            caches.insert(cache);
+        }
+
+        void remove(RegisteredCache* cache) {
+            std::lock_guard<std::mutex> lock(mutex);
+            caches.erase(cache);
+        }
+
+        // Id that identifies the object owning one or more caches in usage().
+        int new_object_id() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return next_object_id++;
+        }
+
+        uint64_t tick() { return ++clock; }
+
+        // Called by the caches after allocating an entry.
+        void allocated() {
+            if(budget > 0)
+                evict_until_within_budget(true);
+        }
+
+        void set_budget(size_t bytes) {
+            budget = bytes;
+            if(budget > 0)
+                evict_until_within_budget(true);
+        }
+        size_t get_budget() const { return budget; }
+
+        // Evicts entries, stale ones first and then valid ones in LRU order,
+        // until the total is below the budget. Returns the number of bytes
+        // freed.
+        size_t trim() {
+            return budget > 0 ? evict_until_within_budget(false) : 0;
+        }
+
+        // Frees all stale entries regardless of the budget.
+        size_t free_stale();
+
+        int64_t evictions() const { return num_evicted; }
+        size_t total_bytes();
+        vector<Usage> usage();
+};
+
+// Base class of the caches below, which registers them with the
+// CacheRegistry. Entries are addressed by (slot, idx), their meaning is up to
+// the derived class.
+class RegisteredCache {
+    public:
+        struct Entry {
+            int slot;
+            int idx;
+            size_t bytes;
+            bool valid;
+            uint64_t last_used;
+        };
+
+        const char* owner;
+        int object_id;
+
+        RegisteredCache(const char* owner, int object_id) : owner(owner), object_id(object_id) {
+            CacheRegistry::instance().add(this);
+        }
+        RegisteredCache(const RegisteredCache& other) : owner(other.owner), object_id(CacheRegistry::instance().new_object_id()) {
+            CacheRegistry::instance().add(this);
+        }
+        // the registration belongs to the object, not to its contents
+        RegisteredCache& operator=(const RegisteredCache&) { return *this; }
+        virtual ~RegisteredCache() {
+            CacheRegistry::instance().remove(this);
+        }
+
+        // Appends all entries that hold memory to res. Busy entries, i.e.
+        // ones that are being filled, are not reported.
+        virtual void entries(vector<Entry>& res) const = 0;
+        virtual string key(const Entry& entry) const = 0;
+        virtual void evict(const Entry& entry) = 0;
+
+    protected:
+        template<class Array>
+        static void add_entry(vector<Entry>& res, const CachedArray<Array>& entry, int slot, int idx) {
+            if(!entry.busy && entry.data.size() > 0)
+                res.push_back({slot, idx, entry.data.size()*sizeof(double), entry.status, entry.last_used});
+        }
+};
+
+inline size_t CacheRegistry::evict_until_within_budget(bool stale_only) {
+    vector<std::pair<RegisteredCache*, RegisteredCache::Entry>> candidates;
+    size_t total = 0;
+    for (auto cache : caches) {
+        vector<RegisteredCache::Entry> entries;
+        cache->entries(entries);
+        for (auto& entry : entries) {
+            total += entry.bytes;
+            if(!stale_only || !entry.valid)
+                candidates.push_back({cache, entry});
+        }
+    }
+    if(total <= budget)
+        return 0;
+    // stale entries first, then the least recently used ones
+    std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) {
+        return std::make_tuple(a.second.valid, a.second.last_used) < std::make_tuple(b.second.valid, b.second.last_used);
+    });
+    size_t freed = 0;
+    for (auto& c : candidates) {
+        if(total - freed <= budget)
+            break;
+        c.first->evict(c.second);
+        freed += c.second.bytes;
+        num_evicted++;
+    }
+    return freed;
+}
+
+inline size_t CacheRegistry::free_stale() {
+    size_t freed = 0;
+    for (auto cache : caches) {
+        vector<RegisteredCache::Entry> entries;
+        cache->entries(entries);
+        for (auto& entry : entries) {
+            if(entry.valid)
+                continue;
+            cache->evict(entry);
+            freed += entry.bytes;
+            num_evicted++;
+        }
+    }
+    return freed;
+}
+
+inline size_t CacheRegistry::total_bytes() {
+    size_t total = 0;
+    for (auto cache : caches) {
+        vector<RegisteredCache::Entry> entries;
+        cache->entries(entries);
+        for (auto& entry : entries)
+            total += entry.bytes;
+    }
+    return total;
+}
+
+inline vector<CacheRegistry::Usage> CacheRegistry::usage() {
+    vector<Usage> res;
+    for (auto cache : caches) {
+        vector<RegisteredCache::Entry> entries;
+        cache->entries(entries);
+        for (auto& entry : entries)
+            res.push_back({cache->owner, cache->object_id, cache->key(entry), entry.bytes, entry.valid});
+    }
+    std::sort(res.begin(), res.end(), [](const Usage& a, const Usage& b) {
+        return std::tie(a.object_id, a.owner, a.key) < std::tie(b.object_id, b.owner, b.key);
+    });
+    return res;
+}
+
 template<class Array>
-class Cache {
+class Cache : public RegisteredCache {
     private:
         std::map<string, CachedArray<Array>> cache;
+        // the keys in insertion order, so that entries can be addressed by a
+        // slot number
+        vector<string> keys;
+
+        // returns the entry for key, and sets allocated to true if a new
+        // array had to be allocated
+        typename std::map<string, CachedArray<Array>>::iterator find_or_allocate(const string& key, const vector<int>& dims, bool& allocated){
+            auto loc = cache.find(key);
+            allocated = true;
+            if(loc == cache.end()){ // Key not found --> allocate array
+                loc = cache.insert(std::make_pair(key, CachedArray<Array>(first_touch_zeros<Array>(dims)))).first;
+                keys.push_back(key);
+                //fmt::print("Create a new array for key {} of size [{}] at {}\n", key, fmt::join(dims, ", "), fmt::ptr(loc->second.data.data()));
+            } else if(loc->second.data.shape(0) != dims[0]) { // key found but not the right number of points, or evicted
+                loc->second = CachedArray<Array>(first_touch_zeros<Array>(dims));
+                //fmt::print("Create a new array for key {} of size [{}] at {}\n", key, fmt::join(dims, ", "), fmt::ptr(loc->second.data.data()));
+            } else {
+                //fmt::print("Existing array found for key {} of size [{}] at {}\n", key, fmt::join(dims, ", "), fmt::ptr(loc->second.data.data()));
+                allocated = false;
+            }
+            loc->second.last_used = CacheRegistry::instance().tick();
+            return loc;
+        }
+
     public:
+        Cache(const char* owner = "Cache", int object_id = CacheRegistry::instance().new_object_id()) : RegisteredCache(owner, object_id) {}
+
         bool get_status(string key) const {
             auto loc = cache.find(key);
             if(loc == cache.end()){ // Key not found
@@ -28,34 +269,26 @@ class Cache {
             return true;
         }
         Array& get_or_create(string key, vector<int> dims){
-            auto loc = cache.find(key);
-            if(loc == cache.end()){ // Key not found --> allocate array
-                loc = cache.insert(std::make_pair(key, CachedArray<Array>(xt::zeros<double>(dims)))).first; 
-                //fmt::print("Create a new array for key {} of size [{}] at {}\n", key, fmt::join(dims, ", "), fmt::ptr(loc->second.data.data()));
-            } else if(loc->second.data.shape(0) != dims[0]) { // key found but not the right number of points
-                loc->second = CachedArray<Array>(xt::zeros<double>(dims));
-                //fmt::print("Create a new array for key {} of size [{}] at {}\n", key, fmt::join(dims, ", "), fmt::ptr(loc->second.data.data()));
-            } else {
-                //fmt::print("Existing array found for key {} of size [{}] at {}\n", key, fmt::join(dims, ", "), fmt::ptr(loc->second.data.data()));
-            }
+            bool allocated;
+            auto loc = find_or_allocate(key, dims, allocated);
             loc->second.status = true;
+            if(allocated)
+                CacheRegistry::instance().allocated();
             return loc->second.data;
         }
 
         Array& get_or_create_and_fill(string key, vector<int> dims, std::function<void(Array&)> impl) {
-            auto loc = cache.find(key);
-            if(loc == cache.end()){ // Key not found --> allocate array
-                loc = cache.insert(std::make_pair(key, CachedArray<Array>(xt::zeros<double>(dims)))).first; 
-                //fmt::print("Create a new array for key {} of size [{}] at {}\n", key, fmt::join(dims, ", "), fmt::ptr(loc->second.data.data()));
-            } else if(loc->second.data.shape(0) != dims[0]) { // key found but not the right number of points
-                loc->second = CachedArray<Array>(xt::zeros<double>(dims));
-                //fmt::print("Create a new array for key {} of size [{}] at {}\n", key, fmt::join(dims, ", "), fmt::ptr(loc->second.data.data()));
-            }
+            bool allocated;
+            auto loc = find_or_allocate(key, dims, allocated);
             if(!(loc->second.status)){ // needs recomputing
                 //fmt::print("Fill array for key {} of size [{}] at {}\n", key, fmt::join(dims, ", "), fmt::ptr(loc->second.data.data()));
+                loc->second.busy = true;
                 impl(loc->second.data);
+                loc->second.busy = false;
                 loc->second.status = true;
             }
+            if(allocated)
+                CacheRegistry::instance().allocated();
             return loc->second.data;
         }
 
@@ -64,4 +297,219 @@ class Cache {
                 it->second.status = false;
             }
         }
+
+        void entries(vector<Entry>& res) const override {
+            for (int slot = 0; slot < int(keys.size()); ++slot)
+                add_entry(res, cache.at(keys[slot]), slot, 0);
+        }
+
+        string key(const Entry& entry) const override {
+            return keys[entry.slot];
+        }
+
+        // The entry is replaced by an empty array, so that the slots of the
+        // others don't change, and is reallocated by the next get_or_create.
+        void evict(const Entry& entry) override {
+            cache.at(keys[entry.slot]) = CachedArray<Array>(xt::zeros<double>({0}));
+        }
+};
+
+// Same as Cache, but the arrays are indexed by a (quantity, index) pair of
+// integers instead of a string, which avoids formatting keys and map lookups
+// in tight loops. References returned by get_or_create stay valid when further
+// entries are created. entries (quantity, idx) are reported as
+// "{names[quantity]}_{idx}".
+template<class Array>
+class IndexedCache : public RegisteredCache {
+    private:
+        vector<std::deque<CachedArray<Array>>> cache;
+        const char* const* names;
+    public:
+        IndexedCache(int nquantities, const char* const* names, const char* owner, int object_id) :
+            RegisteredCache(owner, object_id), cache(nquantities), names(names) {}
+
+        bool get_status(int quantity, int idx) const {
+            auto& entries = cache[quantity];
+            return idx < int(entries.size()) && entries[idx].status;
+        }
+
+        Array& get_or_create(int quantity, int idx, const vector<int>& dims){
+            auto& entries = cache[quantity];
+            bool allocated = false;
+            while(int(entries.size()) <= idx) { // index not found --> allocate arrays
+                entries.push_back(CachedArray<Array>(first_touch_zeros<Array>(dims)));
+                allocated = true;
+            }
+            auto& entry = entries[idx];
+            if(entry.data.dimension() != dims.size() || entry.data.shape(0) != dims[0]) { // not the right number of points, or evicted
+                entry = CachedArray<Array>(first_touch_zeros<Array>(dims));
+                allocated = true;
+            }
+            entry.status = true;
+            entry.last_used = CacheRegistry::instance().tick();
+            if(allocated)
+                CacheRegistry::instance().allocated();
+            return entry.data;
+        }
+
+        void invalidate_cache(){
+            for (auto& entries : cache)
+                for (auto& entry : entries)
+                    entry.status = false;
+        }
+
+        // Release all arrays.
+        void clear(){
+            for (auto& entries : cache)
+                entries.clear();
+        }
+
+        void entries(vector<Entry>& res) const override {
+            for (int quantity = 0; quantity < int(cache.size()); ++quantity)
+                for (int idx = 0; idx < int(cache[quantity].size()); ++idx)
+                    add_entry(res, cache[quantity][idx], quantity, idx);
+        }
+
+        string key(const Entry& entry) const override {
+            return string(names[entry.slot]) + "_" + std::to_string(entry.idx);
+        }
+
+        // The entry is replaced by an empty array, so that the indices of the
+        // others don't change, and is reallocated by the next get_or_create.
+        void evict(const Entry& entry) override {
+            cache[entry.slot][entry.idx] = CachedArray<Array>(xt::zeros<double>({0}));
+        }
+};
+
+// Counters that a SlotCache collects per slot if enable_cache_stats(true) was
+// called.
+struct CacheStats {
+    int64_t hits = 0;        // number of accesses that returned valid data
+    int64_t recomputes = 0;  // number of accesses that called the impl
+    int64_t allocations = 0; // number of times the array was (re)allocated
+    double seconds = 0.;     // total wall time spent in the impl
+};
+
+// Same as Cache, but for a fixed set of N quantities that are known at compile
+// time, e.g. the ones of a Curve or a Surface. The arrays are stored in a flat
+// array of slots indexed by an enum, so that an access is a plain array
+// lookup instead of a string comparison and map search, and the impl is a
+// template parameter instead of a std::function. names[key] is used to
+// report the statistics and the memory usage.
+template<class Array, int N>
+class SlotCache : public RegisteredCache {
+    private:
+        std::array<std::unique_ptr<CachedArray<Array>>, N> slots;
+        const char* const* names;
+        bool collect_stats = false;
+        std::array<CacheStats, N> stats;
+
+        static bool has_shape(const Array& data, const vector<int>& dims){
+            if(data.dimension() != dims.size())
+                return false;
+            for (size_t i = 0; i < dims.size(); ++i)
+                if(int(data.shape(i)) != dims[i])
+                    return false;
+            return true;
+        }
+
+        CachedArray<Array>& slot(int key, const vector<int>& dims, bool& allocated){
+            auto& entry = slots[key];
+            allocated = !entry || !has_shape(entry->data, dims);
+            if(allocated){ // not allocated yet, evicted, or wrong shape --> allocate array
+                entry.reset(new CachedArray<Array>(first_touch_zeros<Array>(dims)));
+                if(collect_stats)
+                    stats[key].allocations++;
+            }
+            return *entry;
+        }
+
+    public:
+        SlotCache(const char* const* names, const char* owner, int object_id) : RegisteredCache(owner, object_id), names(names) {}
+        SlotCache(const SlotCache& other) = delete;
+
+        bool get_status(int key) const {
+            return slots[key] && slots[key]->status;
+        }
+
+        // Returns the array for key, and calls impl to fill it first if the
+        // array was invalidated since the last call.
+        template<class Impl>
+        Array& get_or_create_and_fill(int key, const vector<int>& dims, Impl&& impl){
+            bool allocated;
+            auto& entry = slot(key, dims, allocated);
+            entry.last_used = CacheRegistry::instance().tick();
+            if(entry.status){
+                if(collect_stats)
+                    stats[key].hits++;
+                return entry.data;
+            }
+            // the impl may access other entries, which can trigger an eviction
+            entry.busy = true;
+            if(collect_stats){
+                auto start = std::chrono::steady_clock::now();
+                impl(entry.data);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                stats[key].recomputes++;
+                stats[key].seconds += elapsed.count();
+            } else {
+                impl(entry.data);
+            }
+            entry.busy = false;
+            entry.status = true;
+            if(allocated)
+                CacheRegistry::instance().allocated();
+            return entry.data;
+        }
+
+        void invalidate_cache(){
+            for (auto& entry : slots)
+                if(entry)
+                    entry->status = false;
+        }
+
+        void enable_stats(bool enabled){
+            collect_stats = enabled;
+        }
+
+        void reset_stats(){
+            stats.fill(CacheStats());
+        }
+
+        // Adds the statistics of every slot that was used to res, keyed by
+        // the name of the slot.
+        void add_stats(std::map<string, CacheStats>& res) const {
+            for (int key = 0; key < N; ++key) {
+                const CacheStats& s = stats[key];
+                if(s.hits == 0 && s.recomputes == 0 && s.allocations == 0)
+                    continue;
+                CacheStats& r = res[names[key]];
+                r.hits += s.hits;
+                r.recomputes += s.recomputes;
+                r.allocations += s.allocations;
+                r.seconds += s.seconds;
+            }
+        }
+
+        // Adds the bytes held by every slot to res, keyed by the name of the
+        // slot.
+        void add_bytes(std::map<string, size_t>& res) const {
+            for (int key = 0; key < N; ++key)
+                if(slots[key])
+                    res[names[key]] += slots[key]->data.size()*sizeof(double);
+        }
+
+        void entries(vector<Entry>& res) const override {
+            for (int key = 0; key < N; ++key)
+                if(slots[key])
+                    add_entry(res, *slots[key], key, 0);
+        }
+
+        string key(const Entry& entry) const override {
+            return names[entry.slot];
+        }
+
+        void evict(const Entry& entry) override {
+            slots[entry.slot].reset();
+        }
 };
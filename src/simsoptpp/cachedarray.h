@@ -1,9 +1,12 @@
 #pragma once
+#include <cstdint>
 
 template<class Array>
 struct CachedArray {
     Array data;
     bool status;
+    uint64_t last_used = 0; // CacheRegistry clock at the last access, for LRU eviction
+    bool busy = false; // true while the array is being filled, it is not evicted then
     CachedArray(Array _data) : data(_data), status(false) {}
 };
 
@@ -14,6 +14,22 @@ class CachedTensor {
         T data = {};
         bool status;
         array<int, rank> dims;
+        // set by exported(), see there
+        bool shared = false;
+
+        // the array that is handed out to be filled with new values. This can
+        // run without the GIL (e.g. in the parallel evaluation of an
+        // interpolated field), so it never replaces a shared array, that is
+        // done in invalidate_cache. A shared array is always invalidated by
+        // set_points before its shape can change.
+        inline void prepare(const array<int, rank>& new_dims) {
+            if(dims != new_dims){
+                data = xt::zeros<double>(new_dims);
+                //fmt::print("Dims ({} != {}) don't match, create a new Tensor.\n", dims, new_dims);
+                dims = new_dims;
+                shared = false;
+            }
+        }
     public:
         using Shape = std::array<int, rank>;
 
@@ -27,11 +43,7 @@ class CachedTensor {
         }
 
         inline T& get_or_create(const Shape& new_dims){
-            if(dims != new_dims){
-                data = xt::zeros<double>(new_dims);
-                //fmt::print("Dims ({} != {}) don't match, create a new Tensor.\n", dims, new_dims);
-                dims = new_dims;
-            }
+            prepare(new_dims);
             status = true;
             return data;
         }
@@ -43,18 +55,29 @@ class CachedTensor {
         inline T& get_or_create_and_fill(const Shape& new_dims, const std::function<void(T&)>& impl){
             if(status)
                 return data;
-            if(dims != new_dims){
-                data = xt::zeros<double>(new_dims);
-                //fmt::print("Dims ({} != {}) don't match, create a new Tensor.\n", dims, new_dims);
-                dims = new_dims;
-            }
+            prepare(new_dims);
             impl(data);
             status = true;
             return data;
         }
 
+        // Called with the GIL held, via set_points or when a dependency
+        // changes.
         inline void invalidate_cache() {
             status = false;
+            if(shared) {
+                data = xt::zeros<double>(dims);
+                shared = false;
+            }
+        }
+
+        // Marks the current array as shared with the caller, e.g. as a read
+        // only view in python. When the cache is invalidated, it switches to a
+        // new array, so the shared array keeps the values it had when it was
+        // handed out.
+        inline T& exported() {
+            shared = true;
+            return data;
         }
 
 };
@@ -0,0 +1,369 @@
+#include "coil_forces.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include "xtensor/xarray.hpp"
+#include "biot_savart_impl.h"
+#include "biot_savart_vjp_impl.h"
+#include "vec3dsimd.h"
+#include "gil.h"
+
+// The kernels run on copies of the coil data in xt::xarray, so that scratch
+// arrays can be created on the OpenMP threads without the GIL.
+typedef xt::xarray<double> CArray;
+
+// The self field is computed for a curve parameter that goes up to 2 pi,
+// simsopt's curves use a parameter that goes up to 1.
+static const double twopi = 2*M_PI;
+
+struct ForceCoil {
+    CArray gamma, gammadash;
+    double current;
+    // only set for the base coils
+    CArray gammadashdash;
+    vector<double> phi;
+    double regularization;
+    AlignedPaddedVec pointsx, pointsy, pointsz;
+};
+
+static vector<ForceCoil> force_coils(vector<Array>& gammas, vector<Array>& gammadashs, vector<Array>& gammadashdashs,
+        vector<Array>& quadpoints, vector<double>& currents, vector<double>& regularizations) {
+    int ncoils = gammas.size();
+    int nbase = regularizations.size();
+    if(gammadashs.size() != ncoils || currents.size() != ncoils)
+        throw std::logic_error("gammas, gammadashs and currents need to be given for all coils.");
+    if(nbase > ncoils || gammadashdashs.size() != nbase || quadpoints.size() != nbase)
+        throw std::logic_error("gammadashdashs, quadpoints and regularizations need to be given for the base coils.");
+    auto coils = vector<ForceCoil>(ncoils);
+    for (int j = 0; j < ncoils; ++j) {
+        coils[j].gamma = gammas[j];
+        coils[j].gammadash = gammadashs[j];
+        coils[j].current = currents[j];
+        if(j >= nbase)
+            continue;
+        int n = gammas[j].shape(0);
+        if(gammadashdashs[j].shape(0) != n || quadpoints[j].shape(0) != n)
+            throw std::logic_error("gamma, gammadashdash and quadpoints of a coil need to have the same number of points.");
+        coils[j].gammadashdash = gammadashdashs[j];
+        coils[j].phi = vector<double>(n);
+        for (int a = 0; a < n; ++a)
+            coils[j].phi[a] = twopi*quadpoints[j](a);
+        coils[j].regularization = regularizations[j];
+        coils[j].pointsx = AlignedPaddedVec(n, 0);
+        coils[j].pointsy = AlignedPaddedVec(n, 0);
+        coils[j].pointsz = AlignedPaddedVec(n, 0);
+        for (int a = 0; a < n; ++a) {
+            coils[j].pointsx[a] = gammas[j](a, 0);
+            coils[j].pointsy[a] = gammas[j](a, 1);
+            coils[j].pointsz[a] = gammas[j](a, 2);
+        }
+    }
+    return coils;
+}
+
+static inline Vec3d row(const CArray& x, int a) {
+    return Vec3d{x(a, 0), x(a, 1), x(a, 2)};
+}
+
+static inline void add_row(CArray& x, int a, const Vec3d& y) {
+    x(a, 0) += y.coeff(0);
+    x(a, 1) += y.coeff(1);
+    x(a, 2) += y.coeff(2);
+}
+
+// The singular term of the self field that has been integrated analytically,
+// L(s) in B = (r' x r'') L(|r'|), and its derivative.
+static inline double singular_term(double s, double regularization) {
+    return 0.5*(-2 + std::log(64*s*s/regularization))/(s*s*s);
+}
+
+static inline double singular_term_ds(double s, double regularization) {
+    return 1/(s*s*s*s) - 3*singular_term(s, regularization)/s;
+}
+
+// Regularized self field of a base coil at its quadrature point a, for unit
+// current. Follows B_regularized_pure in selffield.py.
+static Vec3d self_field(const ForceCoil& c, int a) {
+    int n = c.gamma.shape(0);
+    double dphi = twopi/n;
+    double delta = c.regularization;
+    Vec3d ra = row(c.gamma, a);
+    Vec3d pa = row(c.gammadash, a)/twopi;
+    Vec3d qa = row(c.gammadashdash, a)/(twopi*twopi);
+    double sigma = inner(pa, pa);
+    Vec3d first = Vec3d::Zero();
+    double S = 0.;
+    for (int b = 0; b < n; ++b) {
+        Vec3d D = ra - row(c.gamma, b);
+        Vec3d pb = row(c.gammadash, b)/twopi;
+        double R = inner(D, D) + delta;
+        first += cross(pb, D)/(R*std::sqrt(R));
+        double cfac = 2 - 2*std::cos(c.phi[b] - c.phi[a]);
+        double den = cfac*sigma + delta;
+        S += 0.5*cfac/(den*std::sqrt(den));
+    }
+    Vec3d analytic = cross(pa, qa)*singular_term(std::sqrt(sigma), delta);
+    return 1e-7*(analytic + dphi*(first + cross(qa, pa)*S));
+}
+
+// Adds the vector Jacobian product of the self field of a base coil with h,
+// where h already includes the current and the 1e-7 prefactor.
+static void self_field_vjp(const ForceCoil& c, const CArray& h, CArray& res_gamma, CArray& res_gammadash, CArray& res_gammadashdash) {
+    int n = c.gamma.shape(0);
+    double dphi = twopi/n;
+    double delta = c.regularization;
+    for (int a = 0; a < n; ++a) {
+        Vec3d ha = row(h, a);
+        Vec3d ra = row(c.gamma, a);
+        Vec3d pa = row(c.gammadash, a)/twopi;
+        Vec3d qa = row(c.gammadashdash, a)/(twopi*twopi);
+        double sigma = inner(pa, pa);
+        double s = std::sqrt(sigma);
+        double L = singular_term(s, delta);
+        Vec3d grad_p = cross(qa, ha)*L + pa*(inner(ha, cross(pa, qa))*singular_term_ds(s, delta)/s);
+        Vec3d grad_q = cross(ha, pa)*L;
+        Vec3d grad_ra = Vec3d::Zero();
+        double S = 0., dS = 0.;
+        for (int b = 0; b < n; ++b) {
+            Vec3d D = ra - row(c.gamma, b);
+            Vec3d pb = row(c.gammadash, b)/twopi;
+            double R = inner(D, D) + delta;
+            double R_3_inv = 1/(R*std::sqrt(R));
+            Vec3d u = cross(ha, pb);
+            Vec3d grad_D = (u*R_3_inv - D*(3*inner(u, D)*R_3_inv/R))*dphi;
+            grad_ra += grad_D;
+            add_row(res_gamma, b, -grad_D);
+            add_row(res_gammadash, b, cross(D, ha)*(dphi*R_3_inv/twopi));
+            double cfac = 2 - 2*std::cos(c.phi[b] - c.phi[a]);
+            double den = cfac*sigma + delta;
+            double den_3_inv = 1/(den*std::sqrt(den));
+            S += 0.5*cfac*den_3_inv;
+            dS -= 0.75*cfac*cfac*den_3_inv/den;
+        }
+        grad_q += cross(pa, ha)*(dphi*S);
+        grad_p += (cross(ha, qa)*S + pa*(2*inner(ha, cross(qa, pa))*dS))*dphi;
+        add_row(res_gamma, a, grad_ra);
+        add_row(res_gammadash, a, grad_p/twopi);
+        add_row(res_gammadashdash, a, grad_q/(twopi*twopi));
+    }
+}
+
+// Computes the self field (for unit current) and the total field on the
+// base coils, and for derivs == 1 also the gradient of the mutual field. The
+// mutual field is evaluated with biot_savart_kernel on tiles of the
+// quadrature points of each base coil, so that the work is spread over all
+// threads even if there are only a few base coils.
+template<int derivs>
+static void coil_fields(vector<ForceCoil>& coils, int nbase, vector<CArray>& Bself, vector<CArray>& B, vector<CArray>& dB) {
+#if defined(USE_XSIMD)
+    constexpr int chunk = 8*xsimd::simd_type<double>::size;
+#else
+    constexpr int chunk = 8;
+#endif
+    int ncoils = coils.size();
+    Bself = vector<CArray>(nbase);
+    B = vector<CArray>(nbase);
+    dB = vector<CArray>(nbase);
+    auto tiles = vector<std::array<int, 2>>();
+    for (int i = 0; i < nbase; ++i) {
+        int n = coils[i].gamma.shape(0);
+        Bself[i] = xt::zeros<double>({n, 3});
+        B[i] = xt::zeros<double>({n, 3});
+        if(derivs > 0)
+            dB[i] = xt::zeros<double>({n, 3, 3});
+        for (int start = 0; start < n; start += chunk)
+            tiles.push_back({i, start});
+    }
+    int ntiles = tiles.size();
+#pragma omp parallel
+    {
+        CArray tmpB, tmpdB;
+        CArray dummy = xt::zeros<double>({1, 1, 1, 1});
+        int tmp_coil = -1;
+#pragma omp for schedule(dynamic)
+        for (int t = 0; t < ntiles; ++t) {
+            int i = tiles[t][0];
+            int n = coils[i].gamma.shape(0);
+            int start = tiles[t][1];
+            int end = std::min(start + chunk, n);
+            if(tmp_coil != i) {
+                tmpB = xt::zeros<double>({n, 3});
+                if(derivs > 0)
+                    tmpdB = xt::zeros<double>({n, 3, 3});
+                tmp_coil = i;
+            }
+            for (int j = 0; j < ncoils; ++j) {
+                if(j == i)
+                    continue;
+                biot_savart_kernel<CArray, derivs>(coils[i].pointsx, coils[i].pointsy, coils[i].pointsz,
+                        coils[j].gamma, coils[j].gammadash, tmpB, tmpdB, dummy, start, end);
+                double current = coils[j].current;
+                for (int a = start; a < end; ++a) {
+                    for (int l = 0; l < 3; ++l) {
+                        B[i](a, l) += current*tmpB(a, l);
+                        if(derivs > 0) {
+                            for (int k = 0; k < 3; ++k)
+                                dB[i](a, k, l) += current*tmpdB(a, k, l);
+                        }
+                    }
+                }
+            }
+            for (int a = start; a < end; ++a) {
+                Vec3d b = self_field(coils[i], a);
+                for (int l = 0; l < 3; ++l) {
+                    Bself[i](a, l) = b.coeff(l);
+                    B[i](a, l) += coils[i].current*b.coeff(l);
+                }
+            }
+        }
+    }
+}
+
+Array B_regularized(Array& gamma, Array& gammadash, Array& gammadashdash, Array& quadpoints, double current, double regularization) {
+    auto gammas = vector<Array>{gamma};
+    auto gammadashs = vector<Array>{gammadash};
+    auto gammadashdashs = vector<Array>{gammadashdash};
+    auto quadpointss = vector<Array>{quadpoints};
+    auto currents = vector<double>{current};
+    auto regularizations = vector<double>{regularization};
+    auto coils = force_coils(gammas, gammadashs, gammadashdashs, quadpointss, currents, regularizations);
+    int n = gamma.shape(0);
+    Array B = xt::zeros<double>({n, 3});
+    {
+        ReleaseGIL nogil;
+#pragma omp parallel for
+        for (int a = 0; a < n; ++a) {
+            Vec3d b = self_field(coils[0], a)*current;
+            for (int l = 0; l < 3; ++l)
+                B(a, l) = b.coeff(l);
+        }
+    }
+    return B;
+}
+
+std::tuple<vector<Array>, Array, Array> coil_forces(vector<Array>& gammas, vector<Array>& gammadashs, vector<Array>& gammadashdashs, vector<Array>& quadpoints, vector<double>& currents, vector<double>& regularizations) {
+    auto coils = force_coils(gammas, gammadashs, gammadashdashs, quadpoints, currents, regularizations);
+    int nbase = regularizations.size();
+    auto forces = vector<Array>(nbase);
+    for (int i = 0; i < nbase; ++i)
+        forces[i] = xt::zeros<double>({int(gammas[i].shape(0)), 3});
+    Array net_forces = xt::zeros<double>({nbase, 3});
+    Array net_torques = xt::zeros<double>({nbase, 3});
+
+    {
+        ReleaseGIL nogil;
+        vector<CArray> Bself, B, dB;
+        coil_fields<0>(coils, nbase, Bself, B, dB);
+#pragma omp parallel for
+        for (int i = 0; i < nbase; ++i) {
+            int n = coils[i].gamma.shape(0);
+            Vec3d net_force = Vec3d::Zero();
+            Vec3d net_torque = Vec3d::Zero();
+            for (int a = 0; a < n; ++a) {
+                Vec3d gammadash = row(coils[i].gammadash, a);
+                double arclength = norm(gammadash);
+                Vec3d force = cross(gammadash, row(B[i], a))*(coils[i].current/arclength);
+                for (int l = 0; l < 3; ++l)
+                    forces[i](a, l) = force.coeff(l);
+                net_force += force*(arclength/n);
+                net_torque += cross(row(coils[i].gamma, a), force)*(arclength/n);
+            }
+            for (int l = 0; l < 3; ++l) {
+                net_forces(i, l) = net_force.coeff(l);
+                net_torques(i, l) = net_torque.coeff(l);
+            }
+        }
+    }
+    return std::make_tuple(forces, net_forces, net_torques);
+}
+
+std::tuple<vector<Array>, vector<Array>, vector<Array>, vector<double>> coil_forces_vjp(vector<Array>& gammas, vector<Array>& gammadashs, vector<Array>& gammadashdashs, vector<Array>& quadpoints, vector<double>& currents, vector<double>& regularizations, vector<Array>& v) {
+    auto coils = force_coils(gammas, gammadashs, gammadashdashs, quadpoints, currents, regularizations);
+    int ncoils = coils.size();
+    int nbase = regularizations.size();
+    if(v.size() != nbase)
+        throw std::logic_error("v needs to be given for the base coils.");
+    auto vs = vector<CArray>(nbase);
+    for (int i = 0; i < nbase; ++i)
+        vs[i] = v[i];
+    auto res_gamma = vector<CArray>(ncoils);
+    auto res_gammadash = vector<CArray>(ncoils);
+    auto res_gammadashdash = vector<CArray>(nbase);
+    auto res_current = vector<double>(ncoils, 0.);
+
+    {
+        ReleaseGIL nogil;
+        vector<CArray> Bself, B, dB;
+        coil_fields<1>(coils, nbase, Bself, B, dB);
+
+        // Gradients of the forces with respect to the field, the tangents and
+        // the points at which the mutual field is evaluated.
+        auto grad_B = vector<CArray>(nbase);
+#pragma omp parallel for
+        for (int i = 0; i < nbase; ++i) {
+            int n = coils[i].gamma.shape(0);
+            double current = coils[i].current;
+            grad_B[i] = xt::zeros<double>({n, 3});
+            res_gamma[i] = xt::zeros<double>({n, 3});
+            res_gammadash[i] = xt::zeros<double>({n, 3});
+            res_gammadashdash[i] = xt::zeros<double>({n, 3});
+            for (int a = 0; a < n; ++a) {
+                Vec3d gammadash = row(coils[i].gammadash, a);
+                double arclength = norm(gammadash);
+                Vec3d tangent = gammadash/arclength;
+                Vec3d va = row(vs[i], a);
+                Vec3d Ba = row(B[i], a);
+                Vec3d grad_Ba = cross(va, tangent)*current;
+                Vec3d grad_tangent = cross(Ba, va)*current;
+                add_row(res_gammadash[i], a, (grad_tangent - tangent*inner(tangent, grad_tangent))/arclength);
+                for (int k = 0; k < 3; ++k)
+                    res_gamma[i](a, k) += dB[i](a, k, 0)*grad_Ba.coeff(0) + dB[i](a, k, 1)*grad_Ba.coeff(1) + dB[i](a, k, 2)*grad_Ba.coeff(2);
+                res_current[i] += inner(va, cross(tangent, Ba)) + inner(grad_Ba, row(Bself[i], a));
+                for (int l = 0; l < 3; ++l)
+                    grad_B[i](a, l) = grad_Ba.coeff(l);
+            }
+        }
+
+        // Gradients with respect to the sources, collected per source coil so
+        // that each coil is only written by one thread.
+#pragma omp parallel
+        {
+            CArray dummy = xt::zeros<double>({1, 1, 1});
+#pragma omp for schedule(dynamic)
+            for (int j = 0; j < ncoils; ++j) {
+                int n = coils[j].gamma.shape(0);
+                if(j >= nbase) {
+                    res_gamma[j] = xt::zeros<double>({n, 3});
+                    res_gammadash[j] = xt::zeros<double>({n, 3});
+                }
+                CArray mutual_gamma = xt::zeros<double>({n, 3});
+                CArray mutual_gammadash = xt::zeros<double>({n, 3});
+                for (int i = 0; i < nbase; ++i) {
+                    if(i == j)
+                        continue;
+                    biot_savart_vjp_kernel<CArray, 0>(coils[i].pointsx, coils[i].pointsy, coils[i].pointsz,
+                            coils[j].gamma, coils[j].gammadash, grad_B[i], mutual_gamma, mutual_gammadash, dummy, dummy, dummy);
+                }
+                // the kernel doesn't include the current and the prefactor
+                double fak = 1e-7/n;
+                for (int b = 0; b < n; ++b)
+                    res_current[j] += fak*inner(row(coils[j].gammadash, b), row(mutual_gammadash, b));
+                res_gamma[j] += (coils[j].current*fak)*mutual_gamma;
+                res_gammadash[j] += (coils[j].current*fak)*mutual_gammadash;
+                if(j < nbase) {
+                    CArray h = (1e-7*coils[j].current)*grad_B[j];
+                    self_field_vjp(coils[j], h, res_gamma[j], res_gammadash[j], res_gammadashdash[j]);
+                }
+            }
+        }
+    }
+
+    auto to_array = [](vector<CArray>& x) {
+        auto res = vector<Array>(x.size());
+        for (size_t i = 0; i < x.size(); ++i)
+            res[i] = x[i];
+        return res;
+    };
+    return std::make_tuple(to_array(res_gamma), to_array(res_gammadash), to_array(res_gammadashdash), res_current);
+}
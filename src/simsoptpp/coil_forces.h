@@ -0,0 +1,31 @@
+#pragma once
+
+#include <tuple>
+#include "xtensor-python/pyarray.hpp"     // Numpy bindings
+typedef xt::pyarray<double> Array;
+using std::vector;
+
+// Lorentz forces on coils in the field of all coils, including the
+// regularized self field of Hurwitz, Landreman & Antonsen (see
+// simsopt/field/selffield.py).
+//
+// The first nbase = regularizations.size() coils are the targets, on which
+// the forces are evaluated, and all coils are sources. With coil symmetries,
+// these are the base coils, since the forces on the other coils are rotated
+// and reflected copies of the forces on the base coils. gammas, gammadashs
+// and currents are given for all coils, gammadashdashs, quadpoints and
+// regularizations only for the base coils.
+
+// Regularized self field of a single coil, same as B_regularized_pure.
+Array B_regularized(Array& gamma, Array& gammadash, Array& gammadashdash, Array& quadpoints, double current, double regularization);
+
+// Returns the force per unit length at the quadrature points of each base
+// coil, and the net force and the torque (about the origin) on each base coil,
+// as (nbase, 3) arrays.
+std::tuple<vector<Array>, Array, Array> coil_forces(vector<Array>& gammas, vector<Array>& gammadashs, vector<Array>& gammadashdashs, vector<Array>& quadpoints, vector<double>& currents, vector<double>& regularizations);
+
+// Computes the vector Jacobian product of the forces per unit length on the
+// base coils with v, i.e. the gradient of sum_i sum_a v[i](a, :) . F_i(a, :),
+// with respect to gamma and gammadash of all coils, gammadashdash of the base
+// coils and the currents of all coils.
+std::tuple<vector<Array>, vector<Array>, vector<Array>, vector<double>> coil_forces_vjp(vector<Array>& gammas, vector<Array>& gammadashs, vector<Array>& gammadashdashs, vector<Array>& quadpoints, vector<double>& currents, vector<double>& regularizations, vector<Array>& v);
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "simdhelpers.h"
+#include "coil.h"
+
+using std::vector;
+using std::shared_ptr;
+
+// The quadrature points, tangents and currents of all coils of a BiotSavart
+// object, packed into one structure of arrays. The quadrature points of coil
+// i occupy the entries offsets[i], ..., offsets[i+1]-1 of x, y, z (gamma) and
+// dx, dy, dz (gammadash), and
+//
+//      scales[j]  = 1e-7 / numquadpoints(coil i),
+//      weights[j] = current(coil i) * scales[j],
+//
+// so that the total field is a single sum over all quadrature points,
+//
+//      B(p) = \sum_j weights[j] (dx, dy, dz)_j x (p - (x, y, z)_j) / |p - (x, y, z)_j|^3.
+//
+// Kernels can hence stream over all coils linearly and vectorize across coil
+// boundaries, and backends only need to copy these arrays. The arrays are
+// padded to a multiple of the simd size with quadrature points far away and
+// zero tangents and weights, which don't contribute to any sum.
+//
+// update() only repacks the coils whose curve version has changed since the
+// last call, and recomputes the weights if a current has changed.
+class CoilCollection {
+    public:
+#if defined(USE_XSIMD)
+        static constexpr int simd_size = xsimd::simd_type<double>::size;
+#else
+        static constexpr int simd_size = 1;
+#endif
+        // position of the padding entries
+        static constexpr double far_away = 1e30;
+
+        AlignedPaddedVec x, y, z, dx, dy, dz, scales, weights;
+        vector<int> offsets = vector<int>(1, 0);
+        vector<double> currents;
+
+        int num_coils() const { return int(offsets.size()) - 1; }
+        // number of quadrature points of all coils, without the padding
+        int size() const { return offsets.back(); }
+        int padded_size() const { return int(x.size()); }
+
+        // Returns true if any of the arrays has changed. Needs to be called
+        // in serial, since the currents may be implemented in python.
+        template<class Array>
+        bool update(const vector<shared_ptr<Coil<Array>>>& coils) {
+            int ncoils = coils.size();
+            bool resized = ncoils != num_coils();
+            for (int i = 0; !resized && i < ncoils; ++i)
+                resized = coils[i]->curve->numquadpoints != offsets[i+1] - offsets[i];
+            if(resized) {
+                offsets.assign(ncoils + 1, 0);
+                for (int i = 0; i < ncoils; ++i)
+                    offsets[i+1] = offsets[i] + coils[i]->curve->numquadpoints;
+                int n = (offsets[ncoils] + simd_size - 1)/simd_size*simd_size;
+                for (auto* v : {&x, &y, &z})
+                    v->assign(n, far_away);
+                for (auto* v : {&dx, &dy, &dz, &scales, &weights})
+                    v->assign(n, 0.);
+                versions.assign(ncoils, -1);
+                currents.assign(ncoils, 0.);
+            }
+            bool changed = resized;
+            for (int i = 0; i < ncoils; ++i) {
+                auto& curve = coils[i]->curve;
+                double current = coils[i]->current->get_value();
+                int version = curve->get_version();
+                bool moved = versions[i] != version;
+                if(!moved && currents[i] == current)
+                    continue;
+                changed = true;
+                int start = offsets[i];
+                int n = offsets[i+1] - start;
+                if(moved) {
+                    auto& gamma = curve->gamma();
+                    auto& gammadash = curve->gammadash();
+                    for (int l = 0; l < n; ++l) {
+                        x[start + l] = gamma(l, 0);
+                        y[start + l] = gamma(l, 1);
+                        z[start + l] = gamma(l, 2);
+                        dx[start + l] = gammadash(l, 0);
+                        dy[start + l] = gammadash(l, 1);
+                        dz[start + l] = gammadash(l, 2);
+                    }
+                    versions[i] = version;
+                }
+                std::fill(scales.begin() + start, scales.begin() + start + n, 1e-7/n);
+                std::fill(weights.begin() + start, weights.begin() + start + n, current*1e-7/n);
+                currents[i] = current;
+            }
+            return changed;
+        }
+
+    private:
+        // version of the curve of coil i when it was last packed
+        vector<int> versions;
+};
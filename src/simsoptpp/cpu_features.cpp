@@ -0,0 +1,32 @@
+#include "pybind11/pybind11.h"
+#include "pybind11/stl.h"
+#include <map>
+#include <string>
+#include "xsimd/xsimd.hpp"
+
+namespace py = pybind11;
+
+// A small module that is compiled without any -march flags, so that it can
+// be imported on every CPU, and that reports the instruction sets that are
+// supported by the CPU and the operating system. It is used by
+// src/simsoptpp/simsoptpp.py to select the variant of simsoptpp to import
+// when simsopt is built with SIMSOPT_SIMD_DISPATCH.
+std::map<std::string, bool> cpu_features() {
+    auto arch = xsimd::available_architectures();
+    return {
+        {"sse4_2", bool(arch.sse4_2)},
+        {"avx", bool(arch.avx)},
+        {"avx2", bool(arch.avx2)},
+        {"fma3_avx2", bool(arch.fma3_avx2)},
+        {"avx512f", bool(arch.avx512f)},
+        {"avx512cd", bool(arch.avx512cd)},
+        {"avx512dq", bool(arch.avx512dq)},
+        {"avx512bw", bool(arch.avx512bw)},
+        {"neon64", bool(arch.neon64)},
+    };
+}
+
+PYBIND11_MODULE(simsoptpp_cpu, m) {
+    m.def("cpu_features", &cpu_features,
+            "The instruction sets supported by this CPU, as a dict from the name used by xsimd to a bool.");
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <vector>
 using std::vector;
 
@@ -11,7 +12,7 @@ using std::map;
 using std::logic_error;
 
 #include "xtensor/xarray.hpp"
-#include "cachedarray.h"
+#include "cache.h"
 
 #include <Eigen/QR>
 
@@ -39,6 +40,36 @@ Array curve_vjp_contraction(const Array& mat, const Array& v){
     return res;
 }
 
+// The product mat * w of a (numquadpoints, 3, numdofs) Jacobian with a
+// vector of length numdofs, as a (numquadpoints, 3) array.
+template<class Array>
+Array curve_jvp_contraction(const Array& mat, const Array& w){
+    int numquadpoints = mat.shape(0);
+    int numdofs = mat.shape(2);
+    Array res = xt::zeros<double>({numquadpoints, 3});
+    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_mat(const_cast<double*>(mat.data()), numquadpoints*3, numdofs);
+    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_w(const_cast<double*>(w.data()), numdofs, 1);
+    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_res(const_cast<double*>(res.data()), numquadpoints*3, 1);
+    eigen_res = eigen_mat*eigen_w;
+    return res;
+}
+
+// The quantities that a Curve caches, used as slots of its SlotCache.
+enum CurveQuantity {
+    CURVE_gamma = 0, CURVE_gammadash, CURVE_gammadashdash, CURVE_gammadashdashdash,
+    CURVE_dgamma_by_dcoeff, CURVE_dgammadash_by_dcoeff, CURVE_dgammadashdash_by_dcoeff, CURVE_dgammadashdashdash_by_dcoeff,
+    CURVE_kappa, CURVE_dkappa_by_dcoeff, CURVE_torsion, CURVE_dtorsion_by_dcoeff,
+    CURVE_incremental_arclength, CURVE_dincremental_arclength_by_dcoeff,
+    NUM_CURVE_QUANTITIES
+};
+
+inline const char* const curve_quantity_names[NUM_CURVE_QUANTITIES] = {
+    "gamma", "gammadash", "gammadashdash", "gammadashdashdash",
+    "dgamma_by_dcoeff", "dgammadash_by_dcoeff", "dgammadashdash_by_dcoeff", "dgammadashdashdash_by_dcoeff",
+    "kappa", "dkappa_by_dcoeff", "torsion", "dtorsion_by_dcoeff",
+    "incremental_arclength", "dincremental_arclength_by_dcoeff"
+};
+
 template<class Array>
 class Curve {
     private:
@@ -47,33 +78,25 @@ class Curve {
          * e.g. dgamma_by_dcoeff, since we assume a representation that is
          * linear in the dofs.  For that data we use the cache_persistent
          * object */
-        map<string, CachedArray<Array>> cache;
-        map<string, CachedArray<Array>> cache_persistent;
+        // identifies the curve in CacheRegistry::usage()
+        int cache_id = CacheRegistry::instance().new_object_id();
+        SlotCache<Array, NUM_CURVE_QUANTITIES> cache = SlotCache<Array, NUM_CURVE_QUANTITIES>(curve_quantity_names, "Curve", cache_id);
+        SlotCache<Array, NUM_CURVE_QUANTITIES> cache_persistent = SlotCache<Array, NUM_CURVE_QUANTITIES>(curve_quantity_names, "Curve", cache_id);
+        // Incremented every time the cache is invalidated, i.e. whenever the
+        // dofs (or the dofs of a parent) change. Objects that depend on the
+        // curve can compare this to the value they saw last.
+        int version = 0;
 
 
     protected:
-        Array& check_the_cache(string key, vector<int> dims, std::function<void(Array&)> impl){
-            auto loc = cache.find(key);
-            if(loc == cache.end()){ // Key not found --> allocate array
-                loc = cache.insert(std::make_pair(key, CachedArray<Array>(xt::zeros<double>(dims)))).first; 
-            }
-            if(!((loc->second).status)){ // needs recomputing
-                impl((loc->second).data);
-                (loc->second).status = true;
-            }
-            return (loc->second).data;
+        template<class Impl>
+        Array& check_the_cache(CurveQuantity key, const vector<int>& dims, Impl&& impl){
+            return cache.get_or_create_and_fill(key, dims, impl);
         }
 
-        Array& check_the_persistent_cache(string key, vector<int> dims, std::function<void(Array&)> impl){
-            auto loc = cache_persistent.find(key);
-            if(loc == cache_persistent.end()){ // Key not found --> allocate array
-                loc = cache_persistent.insert(std::make_pair(key, CachedArray<Array>(xt::zeros<double>(dims)))).first; 
-            }
-            if(!((loc->second).status)){ // needs recomputing
-                impl((loc->second).data);
-                (loc->second).status = true;
-            }
-            return (loc->second).data;
+        template<class Impl>
+        Array& check_the_persistent_cache(CurveQuantity key, const vector<int>& dims, Impl&& impl){
+            return cache_persistent.get_or_create_and_fill(key, dims, impl);
         }
 
         std::unique_ptr<Eigen::FullPivHouseholderQR<Eigen::MatrixXd>> qr; //QR factorisation of dgamma_by_dcoeff, for least squares fitting.
@@ -107,9 +130,50 @@ class Curve {
         }
 
         void invalidate_cache() {
-            for (auto it = cache.begin(); it != cache.end(); ++it) {
-                (it->second).status = false;
-            }
+            cache.invalidate_cache();
+            version++;
+        }
+
+        int get_version() const { return version; }
+
+        // Count the hits, recomputes and the time spent recomputing for each
+        // cached quantity. Off by default.
+        void enable_cache_stats(bool enabled) {
+            cache.enable_stats(enabled);
+            cache_persistent.enable_stats(enabled);
+        }
+
+        void reset_cache_stats() {
+            cache.reset_stats();
+            cache_persistent.reset_stats();
+        }
+
+        std::map<string, CacheStats> cache_stats() const {
+            std::map<string, CacheStats> res;
+            cache.add_stats(res);
+            cache_persistent.add_stats(res);
+            return res;
+        }
+
+        int get_cache_id() const { return cache_id; }
+
+        // Whether key is cached and up to date.
+        bool is_cached(CurveQuantity key) const {
+            return cache.get_status(key);
+        }
+
+        // Stores values for key that were computed elsewhere, e.g. for
+        // several curves at once by CurveBatch, unless key is up to date.
+        void set_cached(CurveQuantity key, const vector<int>& dims, const double* values) {
+            check_the_cache(key, dims, [values](Array& A) { std::copy(values, values + A.size(), A.data()); });
+        }
+
+        // The number of bytes held by the cache for each quantity.
+        std::map<string, size_t> cache_bytes() const {
+            std::map<string, size_t> res;
+            cache.add_bytes(res);
+            cache_persistent.add_bytes(res);
+            return res;
         }
 
         virtual void set_dofs(const vector<double>& _dofs) {
@@ -147,29 +211,29 @@ class Curve {
         void dincremental_arclength_by_dcoeff_impl(Array& data);
 
         Array& gamma() {
-            return check_the_cache("gamma", {numquadpoints, 3}, [this](Array& A) { return gamma_impl(A, this->quadpoints);});
+            return check_the_cache(CURVE_gamma, {numquadpoints, 3}, [this](Array& A) { return gamma_impl(A, this->quadpoints);});
         }
         Array& gammadash() {
-            return check_the_cache("gammadash", {numquadpoints, 3}, [this](Array& A) { return gammadash_impl(A);});
+            return check_the_cache(CURVE_gammadash, {numquadpoints, 3}, [this](Array& A) { return gammadash_impl(A);});
         }
         Array& gammadashdash() {
-            return check_the_cache("gammadashdash", {numquadpoints, 3}, [this](Array& A) { return gammadashdash_impl(A);});
+            return check_the_cache(CURVE_gammadashdash, {numquadpoints, 3}, [this](Array& A) { return gammadashdash_impl(A);});
         }
         Array& gammadashdashdash() {
-            return check_the_cache("gammadashdashdash", {numquadpoints, 3}, [this](Array& A) { return gammadashdashdash_impl(A);});
+            return check_the_cache(CURVE_gammadashdashdash, {numquadpoints, 3}, [this](Array& A) { return gammadashdashdash_impl(A);});
         }
 
         virtual Array& dgamma_by_dcoeff() {
-            return check_the_cache("dgamma_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgamma_by_dcoeff_impl(A);});
+            return check_the_cache(CURVE_dgamma_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgamma_by_dcoeff_impl(A);});
         }
         virtual Array& dgammadash_by_dcoeff() {
-            return check_the_cache("dgammadash_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadash_by_dcoeff_impl(A);});
+            return check_the_cache(CURVE_dgammadash_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadash_by_dcoeff_impl(A);});
         }
         virtual Array& dgammadashdash_by_dcoeff() {
-            return check_the_cache("dgammadashdash_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdash_by_dcoeff_impl(A);});
+            return check_the_cache(CURVE_dgammadashdash_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdash_by_dcoeff_impl(A);});
         }
         virtual Array& dgammadashdashdash_by_dcoeff() {
-            return check_the_cache("dgammadashdashdash_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdashdash_by_dcoeff_impl(A);});
+            return check_the_cache(CURVE_dgammadashdashdash_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdashdash_by_dcoeff_impl(A);});
         }
 
         virtual Array dgamma_by_dcoeff_vjp_impl(Array& v) {
@@ -188,28 +252,50 @@ class Curve {
             return curve_vjp_contraction<Array>(dgammadashdashdash_by_dcoeff(), v);
         };
 
+        // The Jacobian vector product d gamma^{(derivative)} / d dofs * w for
+        // derivative = 0, ..., 3, i.e. the derivative of gamma, gammadash,
+        // ... in the direction w. By default this uses the dense
+        // d*_by_dcoeff arrays, curves that are linear in their dofs
+        // override it to apply the Jacobian directly.
+        Array dgamma_by_dcoeff_jvp(Array& w, int derivative) {
+            if(derivative < 0 || derivative > 3)
+                throw std::invalid_argument("derivative has to be 0, 1, 2 or 3.");
+            if((int)w.size() != num_dofs())
+                throw std::invalid_argument("w needs to have one entry per dof.");
+            return dgamma_by_dcoeff_jvp_impl(w, derivative);
+        }
+
+        virtual Array dgamma_by_dcoeff_jvp_impl(Array& w, int derivative) {
+            switch(derivative) {
+                case 0: return curve_jvp_contraction<Array>(dgamma_by_dcoeff(), w);
+                case 1: return curve_jvp_contraction<Array>(dgammadash_by_dcoeff(), w);
+                case 2: return curve_jvp_contraction<Array>(dgammadashdash_by_dcoeff(), w);
+                default: return curve_jvp_contraction<Array>(dgammadashdashdash_by_dcoeff(), w);
+            }
+        }
+
         Array& kappa() {
-            return check_the_cache("kappa", {numquadpoints}, [this](Array& A) { return kappa_impl(A);});
+            return check_the_cache(CURVE_kappa, {numquadpoints}, [this](Array& A) { return kappa_impl(A);});
         }
 
         Array& dkappa_by_dcoeff() {
-            return check_the_cache("dkappa_by_dcoeff", {numquadpoints, num_dofs()}, [this](Array& A) { return dkappa_by_dcoeff_impl(A);});
+            return check_the_cache(CURVE_dkappa_by_dcoeff, {numquadpoints, num_dofs()}, [this](Array& A) { return dkappa_by_dcoeff_impl(A);});
         }
 
         Array& torsion() {
-            return check_the_cache("torsion", {numquadpoints}, [this](Array& A) { return torsion_impl(A);});
+            return check_the_cache(CURVE_torsion, {numquadpoints}, [this](Array& A) { return torsion_impl(A);});
         }
 
         Array& dtorsion_by_dcoeff() {
-            return check_the_cache("dtorsion_by_dcoeff", {numquadpoints, num_dofs()}, [this](Array& A) { return dtorsion_by_dcoeff_impl(A);});
+            return check_the_cache(CURVE_dtorsion_by_dcoeff, {numquadpoints, num_dofs()}, [this](Array& A) { return dtorsion_by_dcoeff_impl(A);});
         }
 
         Array& incremental_arclength() {
-            return check_the_cache("incremental_arclength", {numquadpoints}, [this](Array& A) { return incremental_arclength_impl(A);});
+            return check_the_cache(CURVE_incremental_arclength, {numquadpoints}, [this](Array& A) { return incremental_arclength_impl(A);});
         }
 
         Array& dincremental_arclength_by_dcoeff() {
-            return check_the_cache("dincremental_arclength_by_dcoeff", {numquadpoints, num_dofs()}, [this](Array& A) { return dincremental_arclength_by_dcoeff_impl(A);});
+            return check_the_cache(CURVE_dincremental_arclength_by_dcoeff, {numquadpoints, num_dofs()}, [this](Array& A) { return dincremental_arclength_by_dcoeff_impl(A);});
         }
 
         virtual ~Curve() = default;
@@ -0,0 +1,198 @@
+#include "curvebatch.h"
+#include <cmath>
+#include <Eigen/Dense>
+#include "curvexyzfourier.h"
+#include "curverzfourier.h"
+#include "curveplanarfourier.h"
+#include "gil.h"
+
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+
+static const CurveQuantity derivative_quantities[4] = {
+    CURVE_gamma, CURVE_gammadash, CURVE_gammadashdash, CURVE_gammadashdashdash
+};
+
+template<class Array>
+CurveBatch<Array>::CurveBatch(vector<shared_ptr<Curve<Array>>> curves) : curves(curves) {
+    if(curves.empty())
+        throw std::invalid_argument("CurveBatch needs at least one curve.");
+    Curve<Array>* first = curves[0].get();
+    int nfp = 1;
+    bool stellsym = false;
+    if(auto c = dynamic_cast<CurveXYZFourier<Array>*>(first)) {
+        kind = XYZ_FOURIER;
+        order = c->order;
+    } else if(auto c = dynamic_cast<CurveRZFourier<Array>*>(first)) {
+        kind = RZ_FOURIER;
+        order = c->order;
+        nfp = c->nfp;
+        stellsym = c->stellsym;
+    } else if(auto c = dynamic_cast<CurvePlanarFourier<Array>*>(first)) {
+        kind = PLANAR_FOURIER;
+        order = c->order;
+        nfp = c->nfp;
+        stellsym = c->stellsym;
+    } else {
+        throw std::invalid_argument("CurveBatch only supports CurveXYZFourier, CurveRZFourier and CurvePlanarFourier.");
+    }
+    numquadpoints = first->numquadpoints;
+    for (auto& curve : curves) {
+        bool same = curve->numquadpoints == numquadpoints;
+        for (int k = 0; same && k < numquadpoints; ++k)
+            same = curve->quadpoints[k] == first->quadpoints[k];
+        if(kind == XYZ_FOURIER) {
+            auto c = dynamic_cast<CurveXYZFourier<Array>*>(curve.get());
+            same = same && c && c->order == order;
+        } else if(kind == RZ_FOURIER) {
+            auto c = dynamic_cast<CurveRZFourier<Array>*>(curve.get());
+            same = same && c && c->order == order && c->nfp == nfp && c->stellsym == stellsym;
+        } else {
+            auto c = dynamic_cast<CurvePlanarFourier<Array>*>(curve.get());
+            same = same && c && c->order == order && c->nfp == nfp && c->stellsym == stellsym;
+        }
+        if(!same)
+            throw std::invalid_argument("The curves of a CurveBatch need to have the same type, order, quadrature points, nfp and stellsym.");
+    }
+    int m = 2*order + 1;
+    if(kind == XYZ_FOURIER) {
+        // x, y and z share the basis functions
+        rows = numquadpoints;
+        cols = m;
+        width = 3;
+    } else {
+        rows = 3*numquadpoints;
+        cols = kind == RZ_FOURIER ? first->num_dofs() : m;
+        width = 1;
+    }
+}
+
+// The tables are taken from the Jacobian of a curve of the same type and
+// resolution. For CurvePlanarFourier, the curve is not rotated, so that the
+// Jacobian with respect to the Fourier coefficients is the table of the
+// curve in its plane.
+template<class Array>
+const vector<double>& CurveBatch<Array>::table(int p) {
+    if(!tables[p].empty())
+        return tables[p];
+    Array& quadpoints = curves[0]->quadpoints;
+    shared_ptr<Curve<Array>> probe;
+    if(kind == XYZ_FOURIER) {
+        probe = std::make_shared<CurveXYZFourier<Array>>(quadpoints, order);
+    } else if(kind == RZ_FOURIER) {
+        auto c = dynamic_cast<CurveRZFourier<Array>*>(curves[0].get());
+        probe = std::make_shared<CurveRZFourier<Array>>(quadpoints, order, c->nfp, c->stellsym);
+    } else {
+        auto c = dynamic_cast<CurvePlanarFourier<Array>*>(curves[0].get());
+        probe = std::make_shared<CurvePlanarFourier<Array>>(quadpoints, order, c->nfp, c->stellsym);
+        vector<double> dofs(probe->num_dofs(), 0.);
+        dofs[2*order + 1] = 1.;
+        probe->set_dofs(dofs);
+    }
+    Array* jac;
+    switch(p) {
+        case 0: jac = &probe->dgamma_by_dcoeff(); break;
+        case 1: jac = &probe->dgammadash_by_dcoeff(); break;
+        case 2: jac = &probe->dgammadashdash_by_dcoeff(); break;
+        default: jac = &probe->dgammadashdashdash_by_dcoeff(); break;
+    }
+    auto& T = tables[p];
+    T.resize(rows*cols);
+    for (int k = 0; k < numquadpoints; ++k) {
+        for (int j = 0; j < cols; ++j) {
+            if(kind == XYZ_FOURIER) {
+                T[k*cols + j] = (*jac)(k, 0, j);
+            } else {
+                for (int i = 0; i < 3; ++i)
+                    T[(3*k + i)*cols + j] = (*jac)(k, i, j);
+            }
+        }
+    }
+    return T;
+}
+
+// Writes the coefficients of curve c to the columns col, ..., col + width - 1
+// of C. The dofs are read without the python overrides of get_dofs.
+template<class Array>
+void CurveBatch<Array>::coefficients(int c, double* C, int ldc, int col) {
+    vector<double> dofs;
+    Curve<Array>* curve = curves[c].get();
+    if(kind == XYZ_FOURIER)
+        dofs = static_cast<CurveXYZFourier<Array>*>(curve)->CurveXYZFourier<Array>::get_dofs();
+    else if(kind == RZ_FOURIER)
+        dofs = static_cast<CurveRZFourier<Array>*>(curve)->CurveRZFourier<Array>::get_dofs();
+    else
+        dofs = static_cast<CurvePlanarFourier<Array>*>(curve)->CurvePlanarFourier<Array>::get_dofs();
+    for (int j = 0; j < cols; ++j)
+        for (int l = 0; l < width; ++l)
+            C[j*ldc + col + l] = dofs[l*cols + j];
+}
+
+// Rotates and shifts the planar curves, same as CurvePlanarFourier::gamma_impl.
+template<class Array>
+void CurveBatch<Array>::transform(int c, int p, double* data) {
+    if(kind != PLANAR_FOURIER)
+        return;
+    auto curve = static_cast<CurvePlanarFourier<Array>*>(curves[c].get());
+    double q[4];
+    double qnorm = 0.;
+    for (int i = 0; i < 4; ++i) {
+        q[i] = curve->q[i];
+        qnorm += q[i]*q[i];
+    }
+    qnorm = std::sqrt(qnorm);
+    for (int i = 0; i < 4; ++i)
+        q[i] /= qnorm;
+    double R[3][3] = {
+        {1 - 2*(q[2]*q[2] + q[3]*q[3]), 2*(q[1]*q[2] - q[3]*q[0]), 2*(q[1]*q[3] + q[2]*q[0])},
+        {2*(q[1]*q[2] + q[3]*q[0]), 1 - 2*(q[1]*q[1] + q[3]*q[3]), 2*(q[2]*q[3] - q[1]*q[0])},
+        {2*(q[1]*q[3] - q[2]*q[0]), 2*(q[2]*q[3] + q[1]*q[0]), 1 - 2*(q[1]*q[1] + q[2]*q[2])}
+    };
+    double shift[3] = {0., 0., 0.};
+    if(p == 0) {
+        for (int i = 0; i < 3; ++i)
+            shift[i] = curve->center[i];
+    }
+    for (int k = 0; k < numquadpoints; ++k) {
+        double x[3] = {data[3*k], data[3*k + 1], data[3*k + 2]};
+        for (int i = 0; i < 3; ++i)
+            data[3*k + i] = R[i][0]*x[0] + R[i][1]*x[1] + R[i][2]*x[2] + shift[i];
+    }
+}
+
+template<class Array>
+void CurveBatch<Array>::evaluate(int derivative) {
+    if(derivative < 0 || derivative > 3)
+        throw std::invalid_argument("derivative has to be 0, 1, 2 or 3.");
+    for (int p = 0; p <= derivative; ++p) {
+        CurveQuantity key = derivative_quantities[p];
+        vector<int> stale;
+        for (int c = 0; c < size(); ++c)
+            if(!curves[c]->is_cached(key))
+                stale.push_back(c);
+        if(stale.empty())
+            continue;
+        const vector<double>& T = table(p);
+        int ncols = stale.size()*width;
+        RowMatrix C(cols, ncols);
+        for (int s = 0; s < (int)stale.size(); ++s)
+            coefficients(stale[s], C.data(), ncols, s*width);
+        RowMatrix G(rows, ncols);
+        {
+            ReleaseGIL nogil(rows*cols*ncols > (1 << 16));
+            Eigen::Map<const RowMatrix> Tm(T.data(), rows, cols);
+            G.noalias() = Tm*C;
+        }
+        vector<double> data(3*numquadpoints);
+        for (int s = 0; s < (int)stale.size(); ++s) {
+            for (int r = 0; r < rows; ++r)
+                for (int l = 0; l < width; ++l)
+                    data[r*width + l] = G(r, s*width + l);
+            transform(stale[s], p, data.data());
+            curves[stale[s]]->set_cached(key, {numquadpoints, 3}, data.data());
+        }
+    }
+}
+
+#include "xtensor-python/pyarray.hpp"     // Numpy bindings
+typedef xt::pyarray<double> Array;
+template class CurveBatch<Array>;
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+#include "curve.h"
+
+using std::shared_ptr;
+
+// Evaluates gamma and its derivatives for many curves of the same type and
+// resolution at once, e.g. the base coils of a stage two optimization.
+//
+// The curves all need to be CurveXYZFourier, CurveRZFourier or
+// CurvePlanarFourier with the same order, quadrature points, nfp and
+// stellsym. Then the part of gamma that is linear in the dofs is
+//
+//      gamma^{(p)}(k, :) of curve c = \sum_j T_p(k, :, j) C(j, c)
+//
+// with a table T_p of the basis functions that only depends on the
+// quadrature points and the order, so all curves are evaluated by a single
+// matrix product of T_p with the dofs C of all curves. The tables are
+// computed once, when they are first needed. For CurvePlanarFourier, only
+// the curve in its plane is linear in the dofs, it is then rotated and
+// shifted for every curve.
+//
+// evaluate() stores the results in the caches of the curves, so that
+// subsequent calls to gamma() etc. of the individual curves, e.g. in
+// BiotSavart, don't recompute them. Curves whose cache is up to date are
+// skipped.
+template<class Array>
+class CurveBatch {
+    public:
+        enum Kind { XYZ_FOURIER, RZ_FOURIER, PLANAR_FOURIER };
+
+        CurveBatch(vector<shared_ptr<Curve<Array>>> curves);
+
+        // Fills the cache of gamma, gammadash, ... up to the derivative'th
+        // derivative of all curves.
+        void evaluate(int derivative);
+
+        int size() const { return curves.size(); }
+
+    private:
+        vector<shared_ptr<Curve<Array>>> curves;
+        Kind kind;
+        int order;
+        int numquadpoints;
+        // The table of the p-th derivative is a (rows, cols) matrix in row
+        // major order. Each curve has width columns of coefficients and
+        // result, i.e. the result of a curve is a (rows, width) matrix that
+        // is stored as its (numquadpoints, 3) array.
+        int rows, cols, width;
+        vector<double> tables[4];
+
+        const vector<double>& table(int p);
+        void coefficients(int c, double* C, int ldc, int col);
+        void transform(int c, int p, double* data);
+};
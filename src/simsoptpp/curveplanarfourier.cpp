@@ -1,4 +1,9 @@
 #include "curveplanarfourier.h"
+#include "harmonics.h"
+#include "scratch.h"
+
+// cos(n*phi) and sin(n*phi) are obtained from the angle addition recurrence in
+// harmonics.h, and the quadrature points are distributed over threads.
 
 template<class Array>
 double CurvePlanarFourier<Array>::inv_magnitude() {
@@ -13,26 +18,29 @@ double CurvePlanarFourier<Array>::inv_magnitude() {
 
 template<class Array>
 void CurvePlanarFourier<Array>::gamma_impl(Array& data, Array& quadpoints) {
-    double sinphi, cosphi, siniphi, cosiphi;
     int numquadpoints = quadpoints.size();
     data *= 0;
 
     Array q_norm = q * inv_magnitude();
 
 
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
         double phi = 2 * M_PI * quadpoints[k];
         double cosphi = cos(phi);
         double sinphi = sin(phi);
         data(k, 0) = rc[0] * cosphi;
         data(k, 1) = rc[0] * sinphi;
-        for (int i = 1; i < order+1; ++i) {
-            cosiphi = cos(i*phi);
-            siniphi = sin(i*phi);
+        Harmonics<double> h(phi);
+        h.next();
+        for (int i = 1; i < order+1; ++i, h.next()) {
+            double cosiphi = h.cos();
+            double siniphi = h.sin();
             data(k, 0) += (rc[i] * cosiphi + rs[i-1] * siniphi) * cosphi;
             data(k, 1) += (rc[i] * cosiphi + rs[i-1] * siniphi) * sinphi;
         }
     }
+#pragma omp parallel for
     for (int m = 0; m < numquadpoints; ++m) {
         double i = data(m, 0);
         double j = data(m, 1);
@@ -52,16 +60,18 @@ void CurvePlanarFourier<Array>::gammadash_impl(Array& data) {
     double inv_sqrt_s = inv_magnitude();
     Array q_norm = q * inv_sqrt_s;
 
-    double cosiphi, siniphi;
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
         double phi = 2 * M_PI * quadpoints[k];
         double cosphi = cos(phi);
         double sinphi = sin(phi);
         data(k, 0) = rc[0] * (-sinphi);
         data(k, 1) = rc[0] * (cosphi);
-        for (int i = 1; i < order+1; ++i) {
-            cosiphi = cos(i*phi);
-            siniphi = sin(i*phi);
+        Harmonics<double> h(phi);
+        h.next();
+        for (int i = 1; i < order+1; ++i, h.next()) {
+            double cosiphi = h.cos();
+            double siniphi = h.sin();
             data(k, 0) += rc[i] * ( -(i) * siniphi * cosphi - cosiphi * sinphi) 
                 + rs[i-1] * ( (i) * cosiphi * cosphi - siniphi * sinphi);
             data(k, 1) += rc[i] * ( -(i) * siniphi * sinphi + cosiphi * cosphi)
@@ -70,6 +80,7 @@ void CurvePlanarFourier<Array>::gammadash_impl(Array& data) {
     }
         
     data *= (2*M_PI);
+#pragma omp parallel for
     for (int m = 0; m < numquadpoints; ++m) {
         double i = data(m, 0);
         double j = data(m, 1);
@@ -89,16 +100,18 @@ void CurvePlanarFourier<Array>::gammadashdash_impl(Array& data) {
 
     Array q_norm = q * inv_magnitude();
 
-    double cosiphi, siniphi;
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
         double phi = 2 * M_PI * quadpoints[k];
         double cosphi = cos(phi);
         double sinphi = sin(phi);
         data(k, 0) = rc[0] * (-cosphi);
         data(k, 1) = rc[0] * (-sinphi);
-        for (int i = 1; i < order+1; ++i) {
-            cosiphi = cos(i*phi);
-            siniphi = sin(i*phi);
+        Harmonics<double> h(phi);
+        h.next();
+        for (int i = 1; i < order+1; ++i, h.next()) {
+            double cosiphi = h.cos();
+            double siniphi = h.sin();
             data(k, 0) += rc[i] * (+2*(i)*siniphi*sinphi-(i*i+1)*cosiphi*cosphi)
                 + rs[i-1] * (-(i*i+1)*siniphi*cosphi - 2*(i)*cosiphi*sinphi);
             data(k, 1) += rc[i] * (-2*(i)*siniphi*cosphi-(i*i+1)*cosiphi*sinphi)
@@ -106,6 +119,7 @@ void CurvePlanarFourier<Array>::gammadashdash_impl(Array& data) {
         }
     }
     data *= 2*M_PI*2*M_PI;
+#pragma omp parallel for
     for (int m = 0; m < numquadpoints; ++m) {
         double i = data(m, 0);
         double j = data(m, 1);
@@ -125,7 +139,7 @@ void CurvePlanarFourier<Array>::gammadashdashdash_impl(Array& data) {
 
     Array q_norm = q * inv_magnitude();
 
-    double cosiphi, siniphi;
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
         double phi = 2 * M_PI * quadpoints[k];
         double cosphi = cos(phi);
@@ -133,9 +147,11 @@ void CurvePlanarFourier<Array>::gammadashdashdash_impl(Array& data) {
 
         data(k, 0) = rc[0]*(+sinphi);
         data(k, 1) = rc[0]*(-cosphi);
-        for (int i = 1; i < order+1; ++i) {
-            cosiphi = cos(i*phi);
-            siniphi = sin(i*phi);
+        Harmonics<double> h(phi);
+        h.next();
+        for (int i = 1; i < order+1; ++i, h.next()) {
+            double cosiphi = h.cos();
+            double siniphi = h.sin();
             data(k, 0) += rc[i]*(
                     +(3*i*i + 1)*cosiphi*sinphi
                     +(i*i + 3)*(i)*siniphi*cosphi
@@ -153,6 +169,7 @@ void CurvePlanarFourier<Array>::gammadashdashdash_impl(Array& data) {
         }
     }
     data *= 2*M_PI*2*M_PI*2*M_PI;
+#pragma omp parallel for
     for (int m = 0; m < numquadpoints; ++m) {
         double i = data(m, 0);
         double j = data(m, 1);
@@ -172,9 +189,12 @@ void CurvePlanarFourier<Array>::dgamma_by_dcoeff_impl(Array& data) {
     
     Array q_norm = q * inv_magnitude();
 
-    double cosnphi, sinnphi;
+#pragma omp parallel for
     for (int m = 0; m < numquadpoints; ++m) {
         double phi = 2 * M_PI * quadpoints[m];
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(phi, order, cosines.data(), sines.data());
+        double cosnphi, sinnphi;
         int counter = 0;
         double i;
         double j;
@@ -182,11 +202,9 @@ void CurvePlanarFourier<Array>::dgamma_by_dcoeff_impl(Array& data) {
 
         double cosphi = cos(phi);
         double sinphi = sin(phi);
-        double cosnphi = 0;
-        double sinnphi = 0;
 
         for (int n = 0; n < order+1; ++n) {
-            cosnphi = cos(n * phi);
+            cosnphi = cosines[n];
             i = cosnphi * cosphi;
             j = cosnphi * sinphi;
             k = 0;
@@ -199,7 +217,7 @@ void CurvePlanarFourier<Array>::dgamma_by_dcoeff_impl(Array& data) {
         }
         
         for (int n = 1; n < order+1; ++n) {
-            sinnphi = sin(n * phi);
+            sinnphi = sines[n];
             i = sinnphi * cosphi;
             j = sinnphi * sinphi;
             k = 0;
@@ -216,8 +234,8 @@ void CurvePlanarFourier<Array>::dgamma_by_dcoeff_impl(Array& data) {
         k = 0;
 
         for (int n = 1; n < order+1; ++n) {
-            cosnphi = cos(n * phi);
-            sinnphi = sin(n * phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i += (rc[n] * cosnphi + rs[n-1] * sinnphi) * cosphi;
             j += (rc[n] * cosnphi + rs[n-1] * sinnphi) * sinphi;
         }
@@ -516,9 +534,12 @@ void CurvePlanarFourier<Array>::dgammadash_by_dcoeff_impl(Array& data) {
 
     Array q_norm = q * inv_magnitude();
 
-    double cosnphi, sinnphi;
+#pragma omp parallel for
     for (int m = 0; m < numquadpoints; ++m) {
         double phi = 2 * M_PI * quadpoints[m];
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(phi, order, cosines.data(), sines.data());
+        double cosnphi, sinnphi;
         double cosphi = cos(phi);
         double sinphi = sin(phi);
         int counter = 0;
@@ -526,8 +547,8 @@ void CurvePlanarFourier<Array>::dgammadash_by_dcoeff_impl(Array& data) {
         double j;
         double k;
         for (int n = 0; n < order+1; ++n) {
-            cosnphi = cos(n*phi);
-            sinnphi = sin(n*phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i = ( -(n) * sinnphi * cosphi - cosnphi * sinphi);
             j = ( -(n) * sinnphi * sinphi + cosnphi * cosphi);
             k = 0;
@@ -544,8 +565,8 @@ void CurvePlanarFourier<Array>::dgammadash_by_dcoeff_impl(Array& data) {
         }
         
         for (int n = 1; n < order+1; ++n) {
-            cosnphi = cos(n*phi);
-            sinnphi = sin(n*phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i = ( (n) * cosnphi * cosphi - sinnphi * sinphi);
             j = ( (n) * cosnphi * sinphi + sinnphi * cosphi);
             k = 0;
@@ -565,8 +586,8 @@ void CurvePlanarFourier<Array>::dgammadash_by_dcoeff_impl(Array& data) {
         j = rc[0] * (cosphi);
         k = 0;
         for (int n = 1; n < order+1; ++n) {
-            cosnphi = cos(n*phi);
-            sinnphi = sin(n*phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i += rc[n] * ( -(n) * sinnphi * cosphi - cosnphi * sinphi)
                 + rs[n-1] * ( (n) * cosnphi * cosphi - sinnphi * sinphi);
             j += rc[n] * ( -(n) * sinnphi * sinphi + cosnphi * cosphi)
@@ -869,9 +890,12 @@ void CurvePlanarFourier<Array>::dgammadashdash_by_dcoeff_impl(Array& data) {
 
     Array q_norm = q * inv_magnitude();
 
-    double cosnphi, sinnphi;
+#pragma omp parallel for
     for (int m = 0; m < numquadpoints; ++m) {
         double phi = 2 * M_PI * quadpoints[m];
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(phi, order, cosines.data(), sines.data());
+        double cosnphi, sinnphi;
         double cosphi = cos(phi);
         double sinphi = sin(phi);
         int counter = 0;
@@ -879,8 +903,8 @@ void CurvePlanarFourier<Array>::dgammadashdash_by_dcoeff_impl(Array& data) {
         double j;
         double k;
         for (int n = 0; n < order+1; ++n) {
-            cosnphi = cos(n*phi);
-            sinnphi = sin(n*phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i = (+2*(n)*sinnphi*sinphi-(n*n+1)*cosnphi*cosphi);
             j = (-2*(n)*sinnphi*cosphi-(n*n+1)*cosnphi*sinphi);
             k = 0;
@@ -897,8 +921,8 @@ void CurvePlanarFourier<Array>::dgammadashdash_by_dcoeff_impl(Array& data) {
         }
         
         for (int n = 1; n < order+1; ++n) {
-            cosnphi = cos(n*phi);
-            sinnphi = sin(n*phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i = (-(n*n+1)*sinnphi*cosphi - 2*(n)*cosnphi*sinphi);
             j = (-(n*n+1)*sinnphi*sinphi + 2*(n)*cosnphi*cosphi);
             k = 0;
@@ -918,8 +942,8 @@ void CurvePlanarFourier<Array>::dgammadashdash_by_dcoeff_impl(Array& data) {
         j = rc[0] * (-sinphi);
         k = 0;
         for (int n = 1; n < order+1; ++n) {
-            cosnphi = cos(n*phi);
-            sinnphi = sin(n*phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i += rc[n] * (+2*(n)*sinnphi*sinphi-(n*n+1)*cosnphi*cosphi)
                 + rs[n-1] * (-(n*n+1)*sinnphi*cosphi - 2*(n)*cosnphi*sinphi);
             j += rc[n] * (-2*(n)*sinnphi*cosphi-(n*n+1)*cosnphi*sinphi)
@@ -1222,9 +1246,12 @@ void CurvePlanarFourier<Array>::dgammadashdashdash_by_dcoeff_impl(Array& data) {
 
     Array q_norm = q * inv_magnitude();
 
-    double cosnphi, sinnphi;
+#pragma omp parallel for
     for (int m = 0; m < numquadpoints; ++m) {
         double phi = 2 * M_PI * quadpoints[m];
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(phi, order, cosines.data(), sines.data());
+        double cosnphi, sinnphi;
         double cosphi = cos(phi);
         double sinphi = sin(phi);
         int counter = 0;
@@ -1232,8 +1259,8 @@ void CurvePlanarFourier<Array>::dgammadashdashdash_by_dcoeff_impl(Array& data) {
         double j;
         double k;
         for (int n = 0; n < order+1; ++n) {
-            cosnphi = cos(n*phi);
-            sinnphi = sin(n*phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i = (
                     +(3*n*n + 1)*cosnphi*sinphi
                     +(n*n + 3)*(n)*sinnphi*cosphi
@@ -1256,8 +1283,8 @@ void CurvePlanarFourier<Array>::dgammadashdashdash_by_dcoeff_impl(Array& data) {
         }
         
         for (int n = 1; n < order+1; ++n) {
-            cosnphi = cos(n*phi);
-            sinnphi = sin(n*phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i = (
                     -(n*n+3) * (n) * cosnphi*cosphi
                     +(3*n*n+1) * sinnphi*sinphi
@@ -1283,8 +1310,8 @@ void CurvePlanarFourier<Array>::dgammadashdashdash_by_dcoeff_impl(Array& data) {
         j = rc[0]*(-cosphi);
         k = 0;
         for (int n = 1; n < order+1; ++n) {
-            cosnphi = cos(n*phi);
-            sinnphi = sin(n*phi);
+            cosnphi = cosines[n];
+            sinnphi = sines[n];
             i += rc[n]*(
                     +(3*n*n + 1)*cosnphi*sinphi
                     +(n*n + 3)*(n)*sinnphi*cosphi
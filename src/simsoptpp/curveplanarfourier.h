@@ -94,16 +94,16 @@ class CurvePlanarFourier : public Curve<Array> {
         }
 
         Array& dgamma_by_dcoeff() override {
-            return check_the_persistent_cache("dgamma_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgamma_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(CURVE_dgamma_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgamma_by_dcoeff_impl(A);});
         }
         Array& dgammadash_by_dcoeff() override {
-            return check_the_persistent_cache("dgammadash_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadash_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(CURVE_dgammadash_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadash_by_dcoeff_impl(A);});
         }
         Array& dgammadashdash_by_dcoeff() override {
-            return check_the_persistent_cache("dgammadashdash_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdash_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(CURVE_dgammadashdash_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdash_by_dcoeff_impl(A);});
         }
         Array& dgammadashdashdash_by_dcoeff() override {
-            return check_the_persistent_cache("dgammadashdashdash_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdashdash_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(CURVE_dgammadashdashdash_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdashdash_by_dcoeff_impl(A);});
         }
 
         void gamma_impl(Array& data, Array& quadpoints) override;
@@ -1,180 +1,324 @@
 #include "curverzfourier.h"
+#include "harmonics.h"
+#include "scratch.h"
 
+// The functions below use the angle addition recurrence from harmonics.h to
+// obtain cos(nfp*i*phi) and sin(nfp*i*phi), and evaluate several quadrature
+// points at once using SIMD instructions. The derivatives with respect to the
+// coefficients are computed one quadrature point at a time from tables of
+// these harmonics. For high order curves on uniform quadrature points, r and z
+// are evaluated using an FFT instead. The vector Jacobian products never form
+// the dense dgamma_by_dcoeff tensors.
 
 template<class Array>
-void CurveRZFourier<Array>::gamma_impl(Array& data, Array& quadpoints) {
-    int numquadpoints = quadpoints.size();
-    data *= 0;
-    for (int k = 0; k < numquadpoints; ++k) {
+bool CurveRZFourier<Array>::use_fft(const Array& quadpoints, UniformGrid& grid) {
+    if(!fft_wanted(order))
+        return false;
+    grid = uniform_grid(quadpoints, nfp);
+    return grid.uniform;
+}
+
+template<class Array>
+template<class Series>
+void CurveRZFourier<Array>::gamma_series(Array& data, Array& quadpoints, const Series& series, int derivative, const vector<double>& coeffs) {
+    int N = series.size();
+    // r and z as series in nfp*phi, the coefficients are in the order of get_dofs
+    vector<double> a(2*(order+1), 0.), b(2*(order+1), 0.);
+    int counter = 0;
+    for (int i = 0; i < order+1; ++i)
+        a[i] = coeffs[counter++];
+    if(!stellsym) {
+        for (int i = 1; i < order+1; ++i)
+            b[i] = coeffs[counter++];
+        for (int i = 0; i < order+1; ++i)
+            a[order+1+i] = coeffs[counter++];
+    }
+    for (int i = 1; i < order+1; ++i)
+        b[order+1+i] = coeffs[counter++];
+    // x = r cos(phi), so by the product rule we need all derivatives of r up
+    // to the order of the derivative, but only the highest one of z
+    vector<double> r((derivative+1)*N), z(N), f(2*N);
+    for (int q = 0; q <= derivative; ++q) {
+        series.synthesize(q == derivative ? 2 : 1, a.data(), b.data(), q, f.data());
+        std::copy(f.begin(), f.begin() + N, r.begin() + q*N);
+    }
+    std::copy(f.begin() + N, f.end(), z.begin());
+    double scale = std::pow(2*M_PI, derivative);
+    for (int k = 0; k < N; ++k) {
         double phi = 2 * M_PI * quadpoints[k];
-        for (int i = 0; i < order+1; ++i) {
-            data(k, 0) += rc[i] * cos(nfp*i*phi) * cos(phi);
-            data(k, 1) += rc[i] * cos(nfp*i*phi) * sin(phi);
-        }
-        for (int i = 1; i < order+1; ++i) {
-            data(k, 2) += zs[i-1] * sin(nfp*i*phi);
+        double x = 0, y = 0;
+        for (int q = 0; q <= derivative; ++q) {
+            double c = binomial(derivative, q) * std::pow(nfp, q);
+            x += c * r[q*N + k] * cos(phi + (derivative-q)*M_PI/2);
+            y += c * r[q*N + k] * sin(phi + (derivative-q)*M_PI/2);
         }
+        data(k, 0) = scale * x;
+        data(k, 1) = scale * y;
+        data(k, 2) = scale * std::pow(nfp, derivative) * z[k];
     }
-    if(!stellsym){
-        for (int k = 0; k < numquadpoints; ++k) {
+}
+
+template<class Array>
+template<class Series>
+Array CurveRZFourier<Array>::gamma_series_vjp(Array& v, const Series& series, int derivative) {
+    int N = series.size();
+    double scale = std::pow(2*M_PI, derivative);
+    vector<double> w(2*N), A(2*(order+1)), B(2*(order+1));
+    vector<double> ra(order+1, 0.), rb(order+1, 0.), za(order+1), zb(order+1);
+    for (int q = 0; q <= derivative; ++q) {
+        for (int k = 0; k < N; ++k) {
             double phi = 2 * M_PI * quadpoints[k];
-            for (int i = 1; i < order+1; ++i) {
-                data(k, 0) += rs[i-1] * sin(nfp*i*phi) * cos(phi);
-                data(k, 1) += rs[i-1] * sin(nfp*i*phi) * sin(phi);
-            }
-            for (int i = 0; i < order+1; ++i) {
-                data(k, 2) += zc[i] * cos(nfp*i*phi);
-            }
+            w[k] = v(k, 0) * cos(phi + (derivative-q)*M_PI/2) + v(k, 1) * sin(phi + (derivative-q)*M_PI/2);
+            w[N + k] = v(k, 2);
+        }
+        series.analyze(q == derivative ? 2 : 1, w.data(), q, A.data(), B.data());
+        double c = scale * binomial(derivative, q) * std::pow(nfp, q);
+        for (int i = 0; i < order+1; ++i) {
+            ra[i] += c * A[i];
+            rb[i] += c * B[i];
         }
     }
+    for (int i = 0; i < order+1; ++i) {
+        za[i] = scale * std::pow(nfp, derivative) * A[order+1+i];
+        zb[i] = scale * std::pow(nfp, derivative) * B[order+1+i];
+    }
+    // same order as get_dofs
+    Array res = xt::zeros<double>({num_dofs()});
+    int counter = 0;
+    for (int i = 0; i < order+1; ++i)
+        res[counter++] = ra[i];
+    if(!stellsym) {
+        for (int i = 1; i < order+1; ++i)
+            res[counter++] = rb[i];
+        for (int i = 0; i < order+1; ++i)
+            res[counter++] = za[i];
+    }
+    for (int i = 1; i < order+1; ++i)
+        res[counter++] = zb[i];
+    return res;
 }
 
 template<class Array>
-void CurveRZFourier<Array>::gammadash_impl(Array& data) {
-    data *= 0;
-    for (int k = 0; k < numquadpoints; ++k) {
-        double phi = 2 * M_PI * quadpoints[k];
-        for (int i = 0; i < order+1; ++i) {
-            data(k, 0) += rc[i] * ( -(i*nfp) * sin(nfp*i*phi) * cos(phi) - cos(nfp*i*phi) * sin(phi));
-            data(k, 1) += rc[i] * ( -(i*nfp) * sin(nfp*i*phi) * sin(phi) + cos(nfp*i*phi) * cos(phi));
+Array CurveRZFourier<Array>::jacobian_vjp(Array& v, int derivative) {
+    return with_fourier_series(quadpoints, nfp, order, fft_wanted(order),
+            [&](const auto& series) { return gamma_series_vjp(v, series, derivative); });
+}
+
+template<class Array>
+void CurveRZFourier<Array>::gamma_impl(Array& data, Array& quadpoints) {
+    UniformGrid grid;
+    if(use_fft(quadpoints, grid))
+        return gamma_series(data, quadpoints, UniformFourierSeries(grid, order), 0, get_dofs());
+    int numquadpoints = quadpoints.size();
+#pragma omp parallel for
+    for (int k = 0; k < numquadpoints; k += harmonic_size) {
+        harmonic_t phi = quadpoint_angles(quadpoints, k);
+        harmonic_t sinphi, cosphi;
+        harmonic_sincos(phi, sinphi, cosphi);
+        harmonic_t x(0.), y(0.), z(0.);
+        Harmonics<harmonic_t> h(nfp*phi);
+        for (int i = 0; i < order+1; ++i, h.next()) {
+            x += rc[i] * h.cos() * cosphi;
+            y += rc[i] * h.cos() * sinphi;
+            if(i > 0)
+                z += zs[i-1] * h.sin();
+            if(!stellsym){
+                if(i > 0) {
+                    x += rs[i-1] * h.sin() * cosphi;
+                    y += rs[i-1] * h.sin() * sinphi;
+                }
+                z += zc[i] * h.cos();
+            }
         }
-        for (int i = 1; i < order+1; ++i) {
-            data(k, 2) += zs[i-1] * (nfp*i) * cos(nfp*i*phi);
+        for (int l = 0; l < harmonic_size; ++l) {
+            if(k + l >= numquadpoints)
+                break;
+            data(k+l, 0) = harmonic_lane(x, l);
+            data(k+l, 1) = harmonic_lane(y, l);
+            data(k+l, 2) = harmonic_lane(z, l);
         }
     }
-    if(!stellsym){
-        for (int k = 0; k < numquadpoints; ++k) {
-            double phi = 2 * M_PI * quadpoints[k];
-            for (int i = 1; i < order+1; ++i) {
-                data(k, 0) += rs[i-1] * ( (i*nfp) * cos(nfp*i*phi) * cos(phi) - sin(nfp*i*phi) * sin(phi));
-                data(k, 1) += rs[i-1] * ( (i*nfp) * cos(nfp*i*phi) * sin(phi) + sin(nfp*i*phi) * cos(phi));
-            }
-            for (int i = 0; i < order+1; ++i) {
-                data(k, 2) -= zc[i] * (nfp*i) * sin(nfp*i*phi);
+}
+
+template<class Array>
+void CurveRZFourier<Array>::gammadash_impl(Array& data) {
+    UniformGrid grid;
+    if(use_fft(quadpoints, grid))
+        return gamma_series(data, quadpoints, UniformFourierSeries(grid, order), 1, get_dofs());
+#pragma omp parallel for
+    for (int k = 0; k < numquadpoints; k += harmonic_size) {
+        harmonic_t phi = quadpoint_angles(quadpoints, k);
+        harmonic_t sinphi, cosphi;
+        harmonic_sincos(phi, sinphi, cosphi);
+        harmonic_t x(0.), y(0.), z(0.);
+        Harmonics<harmonic_t> h(nfp*phi);
+        for (int i = 0; i < order+1; ++i, h.next()) {
+            x += rc[i] * ( -(i*nfp) * h.sin() * cosphi - h.cos() * sinphi);
+            y += rc[i] * ( -(i*nfp) * h.sin() * sinphi + h.cos() * cosphi);
+            if(i > 0)
+                z += zs[i-1] * (nfp*i) * h.cos();
+            if(!stellsym){
+                if(i > 0) {
+                    x += rs[i-1] * ( (i*nfp) * h.cos() * cosphi - h.sin() * sinphi);
+                    y += rs[i-1] * ( (i*nfp) * h.cos() * sinphi + h.sin() * cosphi);
+                }
+                z -= zc[i] * (nfp*i) * h.sin();
             }
         }
+        for (int l = 0; l < harmonic_size; ++l) {
+            if(k + l >= numquadpoints)
+                break;
+            data(k+l, 0) = (2*M_PI) * harmonic_lane(x, l);
+            data(k+l, 1) = (2*M_PI) * harmonic_lane(y, l);
+            data(k+l, 2) = (2*M_PI) * harmonic_lane(z, l);
+        }
     }
-    data *= (2*M_PI);
 }
 
 template<class Array>
 void CurveRZFourier<Array>::gammadashdash_impl(Array& data) {
-    data *= 0;
-    for (int k = 0; k < numquadpoints; ++k) {
-        double phi = 2 * M_PI * quadpoints[k];
-        for (int i = 0; i < order+1; ++i) {
-            data(k, 0) += rc[i] * (+2*(nfp*i)*sin(nfp*i*phi)*sin(phi)-(pow(nfp*i, 2)+1)*cos(nfp*i*phi)*cos(phi));
-            data(k, 1) += rc[i] * (-2*(nfp*i)*sin(nfp*i*phi)*cos(phi)-(pow(nfp*i, 2)+1)*cos(nfp*i*phi)*sin(phi));
-        }
-        for (int i = 1; i < order+1; ++i) {
-            data(k, 2) -= zs[i-1] * pow(nfp*i, 2)*sin(nfp*i*phi);
-        }
-    }
-    if(!stellsym){
-        for (int k = 0; k < numquadpoints; ++k) {
-            double phi = 2 * M_PI * quadpoints[k];
-            for (int i = 1; i < order+1; ++i) {
-                data(k, 0) += rs[i-1] * (-(pow(nfp*i,2)+1)*sin(nfp*i*phi)*cos(phi) - 2*(i*nfp)*cos(nfp*i*phi)*sin(phi));
-                data(k, 1) += rs[i-1] * (-(pow(nfp*i,2)+1)*sin(nfp*i*phi)*sin(phi) + 2*(i*nfp)*cos(nfp*i*phi)*cos(phi));
-            }
-            for (int i = 0; i < order+1; ++i) {
-                data(k, 2) -= zc[i] * pow(nfp*i, 2)*cos(nfp*i*phi);
+    UniformGrid grid;
+    if(use_fft(quadpoints, grid))
+        return gamma_series(data, quadpoints, UniformFourierSeries(grid, order), 2, get_dofs());
+#pragma omp parallel for
+    for (int k = 0; k < numquadpoints; k += harmonic_size) {
+        harmonic_t phi = quadpoint_angles(quadpoints, k);
+        harmonic_t sinphi, cosphi;
+        harmonic_sincos(phi, sinphi, cosphi);
+        harmonic_t x(0.), y(0.), z(0.);
+        Harmonics<harmonic_t> h(nfp*phi);
+        for (int i = 0; i < order+1; ++i, h.next()) {
+            double n = nfp*i;
+            x += rc[i] * (+2*n*h.sin()*sinphi-(n*n+1)*h.cos()*cosphi);
+            y += rc[i] * (-2*n*h.sin()*cosphi-(n*n+1)*h.cos()*sinphi);
+            if(i > 0)
+                z -= zs[i-1] * n*n*h.sin();
+            if(!stellsym){
+                if(i > 0) {
+                    x += rs[i-1] * (-(n*n+1)*h.sin()*cosphi - 2*n*h.cos()*sinphi);
+                    y += rs[i-1] * (-(n*n+1)*h.sin()*sinphi + 2*n*h.cos()*cosphi);
+                }
+                z -= zc[i] * n*n*h.cos();
             }
         }
+        for (int l = 0; l < harmonic_size; ++l) {
+            if(k + l >= numquadpoints)
+                break;
+            data(k+l, 0) = (2*M_PI*2*M_PI) * harmonic_lane(x, l);
+            data(k+l, 1) = (2*M_PI*2*M_PI) * harmonic_lane(y, l);
+            data(k+l, 2) = (2*M_PI*2*M_PI) * harmonic_lane(z, l);
+        }
     }
-    data *= 2*M_PI*2*M_PI;
 }
 
 template<class Array>
 void CurveRZFourier<Array>::gammadashdashdash_impl(Array& data) {
-    data *= 0;
-    for (int k = 0; k < numquadpoints; ++k) {
-        double phi = 2 * M_PI * quadpoints[k];
-        for (int i = 0; i < order+1; ++i) {
-            data(k, 0) += rc[i]*(
-                    +(3*pow(nfp*i, 2) + 1)*cos(nfp*i*phi)*sin(phi)
-                    +(pow(nfp*i, 2) + 3)*(nfp*i)*sin(nfp*i*phi)*cos(phi)
+    UniformGrid grid;
+    if(use_fft(quadpoints, grid))
+        return gamma_series(data, quadpoints, UniformFourierSeries(grid, order), 3, get_dofs());
+#pragma omp parallel for
+    for (int k = 0; k < numquadpoints; k += harmonic_size) {
+        harmonic_t phi = quadpoint_angles(quadpoints, k);
+        harmonic_t sinphi, cosphi;
+        harmonic_sincos(phi, sinphi, cosphi);
+        harmonic_t x(0.), y(0.), z(0.);
+        Harmonics<harmonic_t> h(nfp*phi);
+        for (int i = 0; i < order+1; ++i, h.next()) {
+            double n = nfp*i;
+            x += rc[i]*(
+                    +(3*n*n + 1)*h.cos()*sinphi
+                    +(n*n + 3)*n*h.sin()*cosphi
                     );
-            data(k, 1) += rc[i]*(
-                    +(pow(nfp*i, 2) + 3)*(nfp*i)*sin(nfp*i*phi)*sin(phi)
-                    -(3*pow(nfp*i, 2) + 1)*cos(nfp*i*phi)*cos(phi)
+            y += rc[i]*(
+                    +(n*n + 3)*n*h.sin()*sinphi
+                    -(3*n*n + 1)*h.cos()*cosphi
                     );
-        }
-        for (int i = 1; i < order+1; ++i) {
-            data(k, 2) -= zs[i-1] * pow(nfp*i, 3) * cos(nfp*i*phi);
-        }
-    }
-    if(!stellsym){
-        for (int k = 0; k < numquadpoints; ++k) {
-            double phi = 2 * M_PI * quadpoints[k];
-            for (int i = 1; i < order+1; ++i) {
-                data(k, 0) += rs[i-1]*(
-                        -(pow(nfp*i,2)+3) * (nfp*i) * cos(nfp*i*phi)*cos(phi)
-                        +(3*pow(nfp*i,2)+1) * sin(nfp*i*phi)*sin(phi)
-                        );
-                data(k, 1) += rs[i-1]*(
-                        -(pow(nfp*i,2)+3)*(nfp*i)*cos(nfp*i*phi)*sin(phi) 
-                        -(3*pow(nfp*i,2)+1)*sin(nfp*i*phi)*cos(phi) 
-                        );
-            }
-            for (int i = 0; i < order+1; ++i) {
-                data(k, 2) += zc[i] * pow(nfp*i, 3) * sin(nfp*i*phi);
+            if(i > 0)
+                z -= zs[i-1] * n*n*n * h.cos();
+            if(!stellsym){
+                if(i > 0) {
+                    x += rs[i-1]*(
+                            -(n*n+3) * n * h.cos()*cosphi
+                            +(3*n*n+1) * h.sin()*sinphi
+                            );
+                    y += rs[i-1]*(
+                            -(n*n+3) * n * h.cos()*sinphi
+                            -(3*n*n+1) * h.sin()*cosphi
+                            );
+                }
+                z += zc[i] * n*n*n * h.sin();
             }
         }
+        for (int l = 0; l < harmonic_size; ++l) {
+            if(k + l >= numquadpoints)
+                break;
+            data(k+l, 0) = (2*M_PI*2*M_PI*2*M_PI) * harmonic_lane(x, l);
+            data(k+l, 1) = (2*M_PI*2*M_PI*2*M_PI) * harmonic_lane(y, l);
+            data(k+l, 2) = (2*M_PI*2*M_PI*2*M_PI) * harmonic_lane(z, l);
+        }
     }
-    data *= 2*M_PI*2*M_PI*2*M_PI;
 }
 
 template<class Array>
 void CurveRZFourier<Array>::dgamma_by_dcoeff_impl(Array& data) {
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
         double phi = 2 * M_PI * quadpoints[k];
+        double sinphi = sin(phi);
+        double cosphi = cos(phi);
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(nfp*phi, order, cosines.data(), sines.data());
         int counter = 0;
         for (int i = 0; i < order+1; ++i) {
-            data(k, 0, counter) = cos(nfp*i*phi) * cos(phi);
-            data(k, 1, counter) = cos(nfp*i*phi) * sin(phi);
+            data(k, 0, counter) = cosines[i] * cosphi;
+            data(k, 1, counter) = cosines[i] * sinphi;
             counter++;
         }
         if(!stellsym){
             for (int i = 1; i < order+1; ++i) {
-                data(k, 0, counter) = sin(nfp*i*phi) * cos(phi);
-                data(k, 1, counter) = sin(nfp*i*phi) * sin(phi);
+                data(k, 0, counter) = sines[i] * cosphi;
+                data(k, 1, counter) = sines[i] * sinphi;
                 counter++;
             }
             for (int i = 0; i < order+1; ++i) {
-                data(k, 2, counter) = cos(nfp*i*phi);
+                data(k, 2, counter) = cosines[i];
                 counter++;
             }
         }
         for (int i = 1; i < order+1; ++i) {
-            data(k, 2, counter) = sin(nfp*i*phi); counter++;
+            data(k, 2, counter) = sines[i]; counter++;
         }
     }
 }
 
 template<class Array>
 void CurveRZFourier<Array>::dgammadash_by_dcoeff_impl(Array& data) {
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
         double phi = 2 * M_PI * quadpoints[k];
+        double sinphi = sin(phi);
+        double cosphi = cos(phi);
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(nfp*phi, order, cosines.data(), sines.data());
         int counter = 0;
         for (int i = 0; i < order+1; ++i) {
-            data(k, 0, counter) = ( -(i*nfp) * sin(nfp*i*phi) * cos(phi) - cos(nfp*i*phi) * sin(phi));
-            data(k, 1, counter) = ( -(i*nfp) * sin(nfp*i*phi) * sin(phi) + cos(nfp*i*phi) * cos(phi));
+            data(k, 0, counter) = ( -(i*nfp) * sines[i] * cosphi - cosines[i] * sinphi);
+            data(k, 1, counter) = ( -(i*nfp) * sines[i] * sinphi + cosines[i] * cosphi);
             counter++;
         }
         if(!stellsym){
             for (int i = 1; i < order+1; ++i) {
-                data(k, 0, counter) = ( (i*nfp) * cos(nfp*i*phi) * cos(phi) - sin(nfp*i*phi) * sin(phi));
-                data(k, 1, counter) = ( (i*nfp) * cos(nfp*i*phi) * sin(phi) + sin(nfp*i*phi) * cos(phi));
+                data(k, 0, counter) = ( (i*nfp) * cosines[i] * cosphi - sines[i] * sinphi);
+                data(k, 1, counter) = ( (i*nfp) * cosines[i] * sinphi + sines[i] * cosphi);
                 counter++;
             }
             for (int i = 0; i < order+1; ++i) {
-                data(k, 2, counter) = -(nfp*i) * sin(nfp*i*phi);
+                data(k, 2, counter) = -(nfp*i) * sines[i];
                 counter++;
             }
         }
         for (int i = 1; i < order+1; ++i) {
-            data(k, 2, counter) = (nfp*i) * cos(nfp*i*phi);
+            data(k, 2, counter) = (nfp*i) * cosines[i];
             counter++;
         }
     }
@@ -183,27 +327,32 @@ void CurveRZFourier<Array>::dgammadash_by_dcoeff_impl(Array& data) {
 
 template<class Array>
 void CurveRZFourier<Array>::dgammadashdash_by_dcoeff_impl(Array& data) {
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
         double phi = 2 * M_PI * quadpoints[k];
+        double sinphi = sin(phi);
+        double cosphi = cos(phi);
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(nfp*phi, order, cosines.data(), sines.data());
         int counter = 0;
         for (int i = 0; i < order+1; ++i) {
-            data(k, 0, counter) = (+2*(nfp*i)*sin(nfp*i*phi)*sin(phi)-(pow(nfp*i, 2)+1)*cos(nfp*i*phi)*cos(phi));
-            data(k, 1, counter) = (-2*(nfp*i)*sin(nfp*i*phi)*cos(phi)-(pow(nfp*i, 2)+1)*cos(nfp*i*phi)*sin(phi));
+            data(k, 0, counter) = (+2*(nfp*i)*sines[i]*sinphi-(pow(nfp*i, 2)+1)*cosines[i]*cosphi);
+            data(k, 1, counter) = (-2*(nfp*i)*sines[i]*cosphi-(pow(nfp*i, 2)+1)*cosines[i]*sinphi);
             counter++;
         }
         if(!stellsym){
             for (int i = 1; i < order+1; ++i) {
-                data(k, 0, counter) = (-(pow(nfp*i,2)+1)*sin(nfp*i*phi)*cos(phi) - 2*(i*nfp)*cos(nfp*i*phi)*sin(phi));
-                data(k, 1, counter) = (-(pow(nfp*i,2)+1)*sin(nfp*i*phi)*sin(phi) + 2*(i*nfp)*cos(nfp*i*phi)*cos(phi));
+                data(k, 0, counter) = (-(pow(nfp*i,2)+1)*sines[i]*cosphi - 2*(i*nfp)*cosines[i]*sinphi);
+                data(k, 1, counter) = (-(pow(nfp*i,2)+1)*sines[i]*sinphi + 2*(i*nfp)*cosines[i]*cosphi);
                 counter++;
             }
             for (int i = 0; i < order+1; ++i) {
-                data(k, 2, counter) = -pow(nfp*i, 2)*cos(nfp*i*phi);
+                data(k, 2, counter) = -pow(nfp*i, 2)*cosines[i];
                 counter++;
             }
         }
         for (int i = 1; i < order+1; ++i) {
-            data(k, 2, counter) = -pow(nfp*i, 2)*sin(nfp*i*phi);
+            data(k, 2, counter) = -pow(nfp*i, 2)*sines[i];
             counter++;
         }
     }
@@ -212,46 +361,80 @@ void CurveRZFourier<Array>::dgammadashdash_by_dcoeff_impl(Array& data) {
 
 template<class Array>
 void CurveRZFourier<Array>::dgammadashdashdash_by_dcoeff_impl(Array& data) {
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
         double phi = 2 * M_PI * quadpoints[k];
+        double sinphi = sin(phi);
+        double cosphi = cos(phi);
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(nfp*phi, order, cosines.data(), sines.data());
         int counter = 0;
         for (int i = 0; i < order+1; ++i) {
             data(k, 0, counter) = (
-                    +(3*pow(nfp*i, 2) + 1)*cos(nfp*i*phi)*sin(phi)
-                    +(pow(nfp*i, 2) + 3)*(nfp*i)*sin(nfp*i*phi)*cos(phi)
+                    +(3*pow(nfp*i, 2) + 1)*cosines[i]*sinphi
+                    +(pow(nfp*i, 2) + 3)*(nfp*i)*sines[i]*cosphi
                     );
             data(k, 1, counter) = (
-                    +(pow(nfp*i, 2) + 3)*(nfp*i)*sin(nfp*i*phi)*sin(phi)
-                    -(3*pow(nfp*i, 2) + 1)*cos(nfp*i*phi)*cos(phi)
+                    +(pow(nfp*i, 2) + 3)*(nfp*i)*sines[i]*sinphi
+                    -(3*pow(nfp*i, 2) + 1)*cosines[i]*cosphi
                     );
             counter++;
         }
         if(!stellsym){
             for (int i = 1; i < order+1; ++i) {
                 data(k, 0, counter) = (
-                        -(pow(nfp*i,2)+3) * (nfp*i) * cos(nfp*i*phi)*cos(phi)
-                        +(3*pow(nfp*i,2)+1) * sin(nfp*i*phi)*sin(phi)
+                        -(pow(nfp*i,2)+3) * (nfp*i) * cosines[i]*cosphi
+                        +(3*pow(nfp*i,2)+1) * sines[i]*sinphi
                         );
                 data(k, 1, counter) = (
-                        -(pow(nfp*i,2)+3)*(nfp*i)*cos(nfp*i*phi)*sin(phi) 
-                        -(3*pow(nfp*i,2)+1)*sin(nfp*i*phi)*cos(phi) 
+                        -(pow(nfp*i,2)+3)*(nfp*i)*cosines[i]*sinphi 
+                        -(3*pow(nfp*i,2)+1)*sines[i]*cosphi 
                         );
                 counter++;
             }
             for (int i = 0; i < order+1; ++i) {
-                data(k, 2, counter) = pow(nfp*i, 3) * sin(nfp*i*phi);
+                data(k, 2, counter) = pow(nfp*i, 3) * sines[i];
                 counter++;
             }
         }
 
         for (int i = 1; i < order+1; ++i) {
-            data(k, 2, counter) = -pow(nfp*i, 3) * cos(nfp*i*phi);
+            data(k, 2, counter) = -pow(nfp*i, 3) * cosines[i];
             counter++;
         }
     }
     data *= 2*M_PI*2*M_PI*2*M_PI;
 }
 
+template<class Array>
+Array CurveRZFourier<Array>::dgamma_by_dcoeff_vjp_impl(Array& v) {
+    return jacobian_vjp(v, 0);
+}
+
+template<class Array>
+Array CurveRZFourier<Array>::dgammadash_by_dcoeff_vjp_impl(Array& v) {
+    return jacobian_vjp(v, 1);
+}
+
+template<class Array>
+Array CurveRZFourier<Array>::dgammadashdash_by_dcoeff_vjp_impl(Array& v) {
+    return jacobian_vjp(v, 2);
+}
+
+template<class Array>
+Array CurveRZFourier<Array>::dgammadashdashdash_by_dcoeff_vjp_impl(Array& v) {
+    return jacobian_vjp(v, 3);
+}
+
+template<class Array>
+Array CurveRZFourier<Array>::dgamma_by_dcoeff_jvp_impl(Array& w, int derivative) {
+    Array data = xt::zeros<double>({numquadpoints, 3});
+    vector<double> coeffs(w.begin(), w.end());
+    with_fourier_series(quadpoints, nfp, order, fft_wanted(order),
+            [&](const auto& series) { gamma_series(data, quadpoints, series, derivative, coeffs); });
+    return data;
+}
+
 #include "xtensor-python/pyarray.hpp"     // Numpy bindings
 typedef xt::pyarray<double> Array;
 template class CurveRZFourier<Array>;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "curve.h"
+#include "uniformfourier.h"
 
 template<class Array>
 class CurveRZFourier : public Curve<Array> {
@@ -103,16 +104,16 @@ class CurveRZFourier : public Curve<Array> {
         }
 
         Array& dgamma_by_dcoeff() override {
-            return check_the_persistent_cache("dgamma_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgamma_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(CURVE_dgamma_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgamma_by_dcoeff_impl(A);});
         }
         Array& dgammadash_by_dcoeff() override {
-            return check_the_persistent_cache("dgammadash_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadash_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(CURVE_dgammadash_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadash_by_dcoeff_impl(A);});
         }
         Array& dgammadashdash_by_dcoeff() override {
-            return check_the_persistent_cache("dgammadashdash_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdash_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(CURVE_dgammadashdash_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdash_by_dcoeff_impl(A);});
         }
         Array& dgammadashdashdash_by_dcoeff() override {
-            return check_the_persistent_cache("dgammadashdashdash_by_dcoeff", {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdashdash_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(CURVE_dgammadashdashdash_by_dcoeff, {numquadpoints, 3, num_dofs()}, [this](Array& A) { return dgammadashdashdash_by_dcoeff_impl(A);});
         }
 
         void gamma_impl(Array& data, Array& quadpoints) override;
@@ -123,5 +124,23 @@ class CurveRZFourier : public Curve<Array> {
         void dgammadash_by_dcoeff_impl(Array& data) override;
         void dgammadashdash_by_dcoeff_impl(Array& data) override;
         void dgammadashdashdash_by_dcoeff_impl(Array& data) override;
-
+        Array dgamma_by_dcoeff_vjp_impl(Array& v) override;
+        Array dgammadash_by_dcoeff_vjp_impl(Array& v) override;
+        Array dgammadashdash_by_dcoeff_vjp_impl(Array& v) override;
+        Array dgammadashdashdash_by_dcoeff_vjp_impl(Array& v) override;
+
+        Array dgamma_by_dcoeff_jvp_impl(Array& w, int derivative) override;
+
+    private:
+        // The derivative'th derivative of gamma for the dofs `coeffs`, and
+        // the corresponding vector Jacobian product, using one of the series
+        // in uniformfourier.h. Since the curve is linear in its dofs, these
+        // apply the Jacobian and its transpose without forming the dense
+        // dgamma_by_dcoeff tensors.
+        bool use_fft(const Array& quadpoints, UniformGrid& grid);
+        template<class Series>
+        void gamma_series(Array& data, Array& quadpoints, const Series& series, int derivative, const vector<double>& coeffs);
+        template<class Series>
+        Array gamma_series_vjp(Array& v, const Series& series, int derivative);
+        Array jacobian_vjp(Array& v, int derivative);
 };
@@ -1,67 +1,191 @@
 #include "curvexyzfourier.h"
+#include "harmonics.h"
+#include "scratch.h"
+
+// cos(2*pi*j*t) and sin(2*pi*j*t) are obtained from the angle addition
+// recurrence in harmonics.h. The curve and its derivatives are evaluated at
+// several quadrature points at once using SIMD instructions. For high order
+// curves on uniform quadrature points an FFT is used instead. The vector
+// Jacobian products never form the dense dgamma_by_dcoeff tensors.
+
+template<class Array>
+bool CurveXYZFourier<Array>::use_fft(const Array& quadpoints, UniformGrid& grid) {
+    if(!fft_wanted(order))
+        return false;
+    grid = uniform_grid(quadpoints, 1);
+    return grid.uniform;
+}
+
+template<class Array>
+template<class Series>
+void CurveXYZFourier<Array>::gamma_series(Array& data, const Series& series, int derivative, const vector<double>& coeffs) {
+    int N = series.size();
+    vector<double> a(3*(order+1), 0.), b(3*(order+1), 0.), f(3*N);
+    for (int i = 0; i < 3; ++i) {
+        a[i*(order+1)] = coeffs[i*(2*order+1)];
+        for (int j = 1; j < order+1; ++j) {
+            a[i*(order+1) + j] = coeffs[i*(2*order+1) + 2*j];
+            b[i*(order+1) + j] = coeffs[i*(2*order+1) + 2*j-1];
+        }
+    }
+    series.synthesize(3, a.data(), b.data(), derivative, f.data());
+    double scale = std::pow(2*M_PI, derivative);
+    for (int k = 0; k < N; ++k)
+        for (int i = 0; i < 3; ++i)
+            data(k, i) = scale * f[i*N + k];
+}
+
+template<class Array>
+template<class Series>
+Array CurveXYZFourier<Array>::gamma_series_vjp(Array& v, const Series& series, int derivative) {
+    int N = series.size();
+    vector<double> w(3*N), A(3*(order+1)), B(3*(order+1));
+    for (int k = 0; k < N; ++k)
+        for (int i = 0; i < 3; ++i)
+            w[i*N + k] = v(k, i);
+    series.analyze(3, w.data(), derivative, A.data(), B.data());
+    double scale = std::pow(2*M_PI, derivative);
+    Array res = xt::zeros<double>({num_dofs()});
+    for (int i = 0; i < 3; ++i) {
+        res[i*(2*order+1)] = scale * A[i*(order+1)];
+        for (int j = 1; j < order+1; ++j) {
+            res[i*(2*order+1) + 2*j-1] = scale * B[i*(order+1) + j];
+            res[i*(2*order+1) + 2*j  ] = scale * A[i*(order+1) + j];
+        }
+    }
+    return res;
+}
+
+template<class Array>
+Array CurveXYZFourier<Array>::jacobian_vjp(Array& v, int derivative) {
+    return with_fourier_series(quadpoints, 1, order, fft_wanted(order),
+            [&](const auto& series) { return gamma_series_vjp(v, series, derivative); });
+}
 
 template<class Array>
 void CurveXYZFourier<Array>::gamma_impl(Array& data, Array& quadpoints) {
+    UniformGrid grid;
+    if(use_fft(quadpoints, grid))
+        return gamma_series(data, UniformFourierSeries(grid, order), 0, get_dofs());
     int numquadpoints = quadpoints.size();
-    data *= 0;
-    for (int k = 0; k < numquadpoints; ++k) {
-        for (int i = 0; i < 3; ++i) {
-            data(k, i) += dofs[i][0];
-            for (int j = 1; j < order+1; ++j) {
-                data(k, i) += dofs[i][2*j-1]*sin(2*M_PI*j*quadpoints[k]);
-                data(k, i) += dofs[i][2*j]*cos(2*M_PI*j*quadpoints[k]);
+#pragma omp parallel for
+    for (int k = 0; k < numquadpoints; k += harmonic_size) {
+        harmonic_t phi = quadpoint_angles(quadpoints, k);
+        harmonic_t res[3];
+        for (int i = 0; i < 3; ++i)
+            res[i] = harmonic_t(dofs[i][0]);
+        Harmonics<harmonic_t> h(phi);
+        h.next();
+        for (int j = 1; j < order+1; ++j, h.next()) {
+            for (int i = 0; i < 3; ++i) {
+                res[i] += dofs[i][2*j-1]*h.sin();
+                res[i] += dofs[i][2*j]*h.cos();
             }
         }
+        for (int l = 0; l < harmonic_size; ++l) {
+            if(k + l >= numquadpoints)
+                break;
+            for (int i = 0; i < 3; ++i)
+                data(k+l, i) = harmonic_lane(res[i], l);
+        }
     }
 }
 
 template<class Array>
 void CurveXYZFourier<Array>::gammadash_impl(Array& data) {
-    data *= 0;
-    for (int k = 0; k < numquadpoints; ++k) {
-        for (int i = 0; i < 3; ++i) {
-            for (int j = 1; j < order+1; ++j) {
-                data(k, i) += +dofs[i][2*j-1]*2*M_PI*j*cos(2*M_PI*j*quadpoints[k]);
-                data(k, i) += -dofs[i][2*j]*2*M_PI*j*sin(2*M_PI*j*quadpoints[k]);
+    UniformGrid grid;
+    if(use_fft(quadpoints, grid))
+        return gamma_series(data, UniformFourierSeries(grid, order), 1, get_dofs());
+#pragma omp parallel for
+    for (int k = 0; k < numquadpoints; k += harmonic_size) {
+        harmonic_t phi = quadpoint_angles(quadpoints, k);
+        harmonic_t res[3];
+        for (int i = 0; i < 3; ++i)
+            res[i] = harmonic_t(0.);
+        Harmonics<harmonic_t> h(phi);
+        h.next();
+        for (int j = 1; j < order+1; ++j, h.next()) {
+            for (int i = 0; i < 3; ++i) {
+                res[i] += +dofs[i][2*j-1]*2*M_PI*j*h.cos();
+                res[i] += -dofs[i][2*j]*2*M_PI*j*h.sin();
             }
         }
+        for (int l = 0; l < harmonic_size; ++l) {
+            if(k + l >= numquadpoints)
+                break;
+            for (int i = 0; i < 3; ++i)
+                data(k+l, i) = harmonic_lane(res[i], l);
+        }
     }
 }
 
 template<class Array>
 void CurveXYZFourier<Array>::gammadashdash_impl(Array& data) {
-    data *= 0;
-    for (int k = 0; k < numquadpoints; ++k) {
-        for (int i = 0; i < 3; ++i) {
-            for (int j = 1; j < order+1; ++j) {
-                data(k, i) += -dofs[i][2*j-1] * (2*M_PI*j)*(2*M_PI*j)*sin(2*M_PI*j*quadpoints[k]);
-                data(k, i) += -dofs[i][2*j]   * (2*M_PI*j)*(2*M_PI*j)*cos(2*M_PI*j*quadpoints[k]);
+    UniformGrid grid;
+    if(use_fft(quadpoints, grid))
+        return gamma_series(data, UniformFourierSeries(grid, order), 2, get_dofs());
+#pragma omp parallel for
+    for (int k = 0; k < numquadpoints; k += harmonic_size) {
+        harmonic_t phi = quadpoint_angles(quadpoints, k);
+        harmonic_t res[3];
+        for (int i = 0; i < 3; ++i)
+            res[i] = harmonic_t(0.);
+        Harmonics<harmonic_t> h(phi);
+        h.next();
+        for (int j = 1; j < order+1; ++j, h.next()) {
+            for (int i = 0; i < 3; ++i) {
+                res[i] += -dofs[i][2*j-1] * (2*M_PI*j)*(2*M_PI*j)*h.sin();
+                res[i] += -dofs[i][2*j]   * (2*M_PI*j)*(2*M_PI*j)*h.cos();
             }
         }
+        for (int l = 0; l < harmonic_size; ++l) {
+            if(k + l >= numquadpoints)
+                break;
+            for (int i = 0; i < 3; ++i)
+                data(k+l, i) = harmonic_lane(res[i], l);
+        }
     }
 }
 
 template<class Array>
 void CurveXYZFourier<Array>::gammadashdashdash_impl(Array& data) {
-    data *= 0;
-    for (int k = 0; k < numquadpoints; ++k) {
-        for (int i = 0; i < 3; ++i) {
-            for (int j = 1; j < order+1; ++j) {
-                data(k, i) += -dofs[i][2*j-1] * (2*M_PI*j)*(2*M_PI*j)*(2*M_PI*j)*cos(2*M_PI*j*quadpoints[k]);
-                data(k, i) += +dofs[i][2*j]   * (2*M_PI*j)*(2*M_PI*j)*(2*M_PI*j)*sin(2*M_PI*j*quadpoints[k]);
+    UniformGrid grid;
+    if(use_fft(quadpoints, grid))
+        return gamma_series(data, UniformFourierSeries(grid, order), 3, get_dofs());
+#pragma omp parallel for
+    for (int k = 0; k < numquadpoints; k += harmonic_size) {
+        harmonic_t phi = quadpoint_angles(quadpoints, k);
+        harmonic_t res[3];
+        for (int i = 0; i < 3; ++i)
+            res[i] = harmonic_t(0.);
+        Harmonics<harmonic_t> h(phi);
+        h.next();
+        for (int j = 1; j < order+1; ++j, h.next()) {
+            for (int i = 0; i < 3; ++i) {
+                res[i] += -dofs[i][2*j-1] * (2*M_PI*j)*(2*M_PI*j)*(2*M_PI*j)*h.cos();
+                res[i] += +dofs[i][2*j]   * (2*M_PI*j)*(2*M_PI*j)*(2*M_PI*j)*h.sin();
             }
         }
+        for (int l = 0; l < harmonic_size; ++l) {
+            if(k + l >= numquadpoints)
+                break;
+            for (int i = 0; i < 3; ++i)
+                data(k+l, i) = harmonic_lane(res[i], l);
+        }
     }
 }
 
 template<class Array>
 void CurveXYZFourier<Array>::dgamma_by_dcoeff_impl(Array& data) {
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(2*M_PI*quadpoints[k], order, cosines.data(), sines.data());
         for (int i = 0; i < 3; ++i) {
             data(k, i, i*(2*order+1)) = 1.;
             for (int j = 1; j < order+1; ++j) {
-                data(k, i, i*(2*order+1) + 2*j-1) = sin(2*M_PI*j*quadpoints[k]);
-                data(k, i, i*(2*order+1) + 2*j  ) = cos(2*M_PI*j*quadpoints[k]);
+                data(k, i, i*(2*order+1) + 2*j-1) = sines[j];
+                data(k, i, i*(2*order+1) + 2*j  ) = cosines[j];
             }
         }
     }
@@ -69,11 +193,14 @@ void CurveXYZFourier<Array>::dgamma_by_dcoeff_impl(Array& data) {
 
 template<class Array>
 void CurveXYZFourier<Array>::dgammadash_by_dcoeff_impl(Array& data) {
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(2*M_PI*quadpoints[k], order, cosines.data(), sines.data());
         for (int i = 0; i < 3; ++i) {
             for (int j = 1; j < order+1; ++j) {
-                data(k, i, i*(2*order+1) + 2*j-1) = +2*M_PI*j*cos(2*M_PI*j*quadpoints[k]);
-                data(k, i, i*(2*order+1) + 2*j  ) = -2*M_PI*j*sin(2*M_PI*j*quadpoints[k]);
+                data(k, i, i*(2*order+1) + 2*j-1) = +2*M_PI*j*cosines[j];
+                data(k, i, i*(2*order+1) + 2*j  ) = -2*M_PI*j*sines[j];
             }
         }
     }
@@ -81,11 +208,14 @@ void CurveXYZFourier<Array>::dgammadash_by_dcoeff_impl(Array& data) {
 
 template<class Array>
 void CurveXYZFourier<Array>::dgammadashdash_by_dcoeff_impl(Array& data) {
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(2*M_PI*quadpoints[k], order, cosines.data(), sines.data());
         for (int i = 0; i < 3; ++i) {
             for (int j = 1; j < order+1; ++j) {
-                data(k, i, i*(2*order+1) + 2*j-1) = -(2*M_PI*j)*(2*M_PI*j)*sin(2*M_PI*j*quadpoints[k]);
-                data(k, i, i*(2*order+1) + 2*j  ) = -(2*M_PI*j)*(2*M_PI*j)*cos(2*M_PI*j*quadpoints[k]);
+                data(k, i, i*(2*order+1) + 2*j-1) = -(2*M_PI*j)*(2*M_PI*j)*sines[j];
+                data(k, i, i*(2*order+1) + 2*j  ) = -(2*M_PI*j)*(2*M_PI*j)*cosines[j];
             }
         }
     }
@@ -93,16 +223,48 @@ void CurveXYZFourier<Array>::dgammadashdash_by_dcoeff_impl(Array& data) {
 
 template<class Array>
 void CurveXYZFourier<Array>::dgammadashdashdash_by_dcoeff_impl(Array& data) {
+#pragma omp parallel for
     for (int k = 0; k < numquadpoints; ++k) {
+        ScratchBuffer<double> cosines(order+1), sines(order+1);
+        fill_harmonics(2*M_PI*quadpoints[k], order, cosines.data(), sines.data());
         for (int i = 0; i < 3; ++i) {
             for (int j = 1; j < order+1; ++j) {
-                data(k, i, i*(2*order+1) + 2*j-1) = -(2*M_PI*j)*(2*M_PI*j)*(2*M_PI*j)*cos(2*M_PI*j*quadpoints[k]);
-                data(k, i, i*(2*order+1) + 2*j  ) = +(2*M_PI*j)*(2*M_PI*j)*(2*M_PI*j)*sin(2*M_PI*j*quadpoints[k]);
+                data(k, i, i*(2*order+1) + 2*j-1) = -(2*M_PI*j)*(2*M_PI*j)*(2*M_PI*j)*cosines[j];
+                data(k, i, i*(2*order+1) + 2*j  ) = +(2*M_PI*j)*(2*M_PI*j)*(2*M_PI*j)*sines[j];
             }
         }
     }
 }
 
+template<class Array>
+Array CurveXYZFourier<Array>::dgamma_by_dcoeff_vjp_impl(Array& v) {
+    return jacobian_vjp(v, 0);
+}
+
+template<class Array>
+Array CurveXYZFourier<Array>::dgammadash_by_dcoeff_vjp_impl(Array& v) {
+    return jacobian_vjp(v, 1);
+}
+
+template<class Array>
+Array CurveXYZFourier<Array>::dgammadashdash_by_dcoeff_vjp_impl(Array& v) {
+    return jacobian_vjp(v, 2);
+}
+
+template<class Array>
+Array CurveXYZFourier<Array>::dgammadashdashdash_by_dcoeff_vjp_impl(Array& v) {
+    return jacobian_vjp(v, 3);
+}
+
+template<class Array>
+Array CurveXYZFourier<Array>::dgamma_by_dcoeff_jvp_impl(Array& w, int derivative) {
+    Array data = xt::zeros<double>({numquadpoints, 3});
+    vector<double> coeffs(w.begin(), w.end());
+    with_fourier_series(quadpoints, 1, order, fft_wanted(order),
+            [&](const auto& series) { gamma_series(data, series, derivative, coeffs); });
+    return data;
+}
+
 #include "xtensor-python/pyarray.hpp"     // Numpy bindings
 typedef xt::pyarray<double> Array;
 template class CurveXYZFourier<Array>;
@@ -1,6 +1,8 @@
 #include "dipole_field.h"
 #include "simdhelpers.h"
 #include "vec3dsimd.h"
+#include "gil.h"
+#include "threads.h"
 #include <cmath>
 #include <Eigen/Dense>
 
@@ -32,6 +34,7 @@ Array dipole_field_B(Array& points, Array& m_points, Array& m) {
     double* m_ptr = &(m(0, 0));
     double fak = 1e-7;  // mu0 divided by 4 * pi factor
 
+    ReleaseGIL nogil;
     // Loop through the evaluation points by chunks of simd_size
     #pragma omp parallel for schedule(static)
     for(int i = 0; i < num_points; i += simd_size) {
@@ -88,6 +91,7 @@ Array dipole_field_A(Array& points, Array& m_points, Array& m) {
     double* m_ptr = &(m(0, 0));
     double fak = 1e-7;  // mu0 divided by 4 * pi factor
 
+    ReleaseGIL nogil;
     // Loop through the evaluation points by chunks of simd_size
     #pragma omp parallel for schedule(static)
     for(int i = 0; i < num_points; i += simd_size) {
@@ -147,6 +151,7 @@ Array dipole_field_dB(Array& points, Array& m_points, Array& m) {
     double* m_ptr = &(m(0, 0));
     double fak = 1e-7;
     
+    ReleaseGIL nogil;
     #pragma omp parallel for schedule(static)
     for(int i = 0; i < num_points; i += simd_size) {
         auto point_i = Vec3dSimd();
@@ -215,6 +220,7 @@ Array dipole_field_dA(Array& points, Array& m_points, Array& m) {
     double* m_ptr = &(m(0, 0));
     double fak = 1e-7;
     
+    ReleaseGIL nogil;
     #pragma omp parallel for schedule(static)
     for(int i = 0; i < num_points; i += simd_size) {
         auto point_i = Vec3dSimd();
@@ -261,126 +267,6 @@ Array dipole_field_dA(Array& points, Array& m_points, Array& m) {
     return dA;
 }
 
-// Calculate the geometric factor A needed for the permanent magnet optimization
-// Bnormal * n = A * m - b, where n is the unit normal to the plasma surface.
-// A = [g_1, ..., g_num_dipoles]
-// g_i = mu0 / (4 * pi) [3(n_i * r_i)r_i / |r_i|^5 - n_i / |r_i|^3]
-// points: where to evaluate the field
-// m_points: where the dipoles are located
-// unitnormal: unit normal vectors from the plasma surface
-// nfp: field-period symmetry of the plasma surface
-// stellsym: stellarator symmetry (True/False) of the plasma surface
-// b: Bnormal component corresponding to the non-magnet fields (e.g. external coils)
-// coordinate_flag: which coordinate system should be considered "grid-aligned"
-// R0: Major radius of the device, needed if a simple toroidal coordinate system is desired
-// returns the optimization matrix, or inductance, A
-Array dipole_field_Bn(Array& points, Array& m_points, Array& unitnormal, int nfp, int stellsym, Array& b, std::string coordinate_flag, double R0)
-{
-    // warning: row_major checks below do NOT throw an error correctly on a compute node on Cori
-    if(points.layout() != xt::layout_type::row_major)
-          throw std::runtime_error("points needs to be in row-major storage order");
-    if(m_points.layout() != xt::layout_type::row_major)
-          throw std::runtime_error("m_points needs to be in row-major storage order");
-    if(unitnormal.layout() != xt::layout_type::row_major)
-          throw std::runtime_error("unit normal needs to be in row-major storage order");
-    if(b.layout() != xt::layout_type::row_major)
-          throw std::runtime_error("b needs to be in row-major storage order");
-
-    int num_points = points.shape(0);
-    int num_dipoles = m_points.shape(0);
-    constexpr int simd_size = xsimd::simd_type<double>::size;
-    Array A = xt::zeros<double>({num_points, num_dipoles, 3});
-
-    std::string cylindrical_str = "cylindrical";
-    std::string toroidal_str = "toroidal";
-
-    // initialize pointer to the beginning of the dipole grid
-    double* m_points_ptr = &(m_points(0, 0));
-    double fak = 1e-7;  // mu0 divided by 4 * pi factor
-
-    // Loop through the evaluation points by chunks of simd_size
-    #pragma omp parallel for schedule(static)
-    for(int i = 0; i < num_points; i += simd_size) {
-        auto point_i = Vec3dSimd();
-        auto n_i = Vec3dSimd();
-
-        // check that i + k isn't bigger than num_points
-        int klimit = std::min(simd_size, num_points - i);
-        for(int k = 0; k < klimit; k++){
-            for (int d = 0; d < 3; ++d) {
-                point_i[d][k] = points(i + k, d);
-                n_i[d][k] = unitnormal(i + k, d);
-            }
-        }
-        // Loop through all the dipoles, using all the symmetries
-        for (int j = 0; j < num_dipoles; ++j) {
-            Vec3dSimd mp_j = Vec3dSimd(m_points_ptr[3 * j + 0], m_points_ptr[3 * j + 1], m_points_ptr[3 * j + 2]);
-            for (int stell = 0; stell < (stellsym + 1); ++stell) {
-                for(int fp = 0; fp < nfp; ++fp) {
-                    simd_t phi0 = (2 * M_PI / ((simd_t) nfp)) * fp;
-                    simd_t sphi0 = xsimd::sin(phi0);
-                    simd_t cphi0 = xsimd::cos(phi0);
-                    auto G_i = Vec3dSimd();
-
-                    // Calculate new dipole location after accounting for the symmetries
-                    // reflect the y and z-components and then rotate by phi0
-                    simd_t mp_x_new = mp_j.x * cphi0 - mp_j.y * sphi0 * pow(-1, stell);
-                    simd_t mp_y_new = mp_j.x * sphi0 + mp_j.y * cphi0 * pow(-1, stell);
-                    simd_t mp_z_new = mp_j.z * pow(-1, stell);
-                    Vec3dSimd mp_j_new = Vec3dSimd(mp_x_new, mp_y_new, mp_z_new);
-
-                    // Calculate new phi location if switching to cylindrical coordinates
-                    simd_t mp_phi_new = xsimd::atan2(mp_j.y, mp_j.x);
-                    simd_t mp_theta_new = xsimd::atan2(mp_j.z, sqrt(mp_j.x * mp_j.x + mp_j.y * mp_j.y) - R0);
-                    simd_t sphi_new = xsimd::sin(mp_phi_new);
-                    simd_t stheta_new = xsimd::sin(mp_theta_new);
-                    simd_t cphi_new = xsimd::cos(mp_phi_new);
-                    simd_t ctheta_new = xsimd::cos(mp_theta_new);
-
-                    // Compute the unsymmetrized inductance matrix
-                    Vec3dSimd r = point_i - mp_j_new;
-                    simd_t rmag_2 = normsq(r);
-                    simd_t rmag_inv   = rsqrt(rmag_2);
-                    simd_t rmag_inv_3 = rmag_inv * (rmag_inv * rmag_inv);
-                    simd_t rmag_inv_5 = rmag_inv_3 * (rmag_inv * rmag_inv);
-                    simd_t rdotn = inner(r, n_i);
-                    G_i.x = 3.0 * rdotn * r.x * rmag_inv_5 - n_i.x * rmag_inv_3;
-                    G_i.y = 3.0 * rdotn * r.y * rmag_inv_5 - n_i.y * rmag_inv_3;
-                    G_i.z = 3.0 * rdotn * r.z * rmag_inv_5 - n_i.z * rmag_inv_3;
-                    for(int k = 0; k < klimit; k++){
-                        if (coordinate_flag == cylindrical_str) {
-                            double Ax_temp = (G_i.x[k] * cphi0[k] + G_i.y[k] * sphi0[k]) * pow(-1, stell);
-                            double Ay_temp = (- G_i.x[k] * sphi0[k] + G_i.y[k] * cphi0[k]);
-                            A(i + k, j, 0) += fak * (Ax_temp * cphi_new[k] + Ay_temp * sphi_new[k]);
-                            A(i + k, j, 1) += fak * ( - Ax_temp * sphi_new[k] + Ay_temp * cphi_new[k]);
-                            A(i + k, j, 2) += fak * G_i.z[k];
-                        }
-                        else if (coordinate_flag == toroidal_str) {
-
-                            double Ax_temp = (G_i.x[k] * cphi0[k] + G_i.y[k] * sphi0[k]) * pow(-1, stell);
-                            double Ay_temp = (- G_i.x[k] * sphi0[k] + G_i.y[k] * cphi0[k]);
-                            double Az_temp = G_i.z[k];
-                            A(i + k, j, 0) += fak * (Ax_temp * cphi_new[k] * ctheta_new[k] + Ay_temp * sphi_new[k] * ctheta_new[k] + Az_temp * stheta_new[k]);
-                            A(i + k, j, 1) += fak * ( - Ax_temp * sphi_new[k] + Ay_temp * cphi_new[k]);
-                            A(i + k, j, 2) += fak * (- Ax_temp * cphi_new[k] * stheta_new[k] - Ay_temp * sphi_new[k] * stheta_new[k] + Az_temp * ctheta_new[k]);
-                        }
-                        else {
-                            // rotate by -phi0 and then flip x component
-                            // This should be the reverse of what is done to the m vector and the dipole grid
-                            // because A * m = A * R^T * R * m and R is an orthogonal matrix both
-                            // for a reflection and a rotation.
-                            A(i + k, j, 0) += fak * (G_i.x[k] * cphi0[k] + G_i.y[k] * sphi0[k]) * pow(-1, stell);
-                            A(i + k, j, 1) += fak * (- G_i.x[k] * sphi0[k] + G_i.y[k] * cphi0[k]);
-                            A(i + k, j, 2) += fak * G_i.z[k];
-                        }
-                    }
-                }
-            }
-        }
-    }
-    return A;
-}
-
 #else
 // Calculate the B field at a set of evaluation points from N dipoles:
 // B = mu0 / (4 * pi) sum_{i=1}^N 3(m_i * r_i)r_i / |r_i|^5 - m_i / |r_i|^3
@@ -408,6 +294,7 @@ Array dipole_field_B(Array& points, Array& m_points, Array& m) {
     double* m_ptr = &(m(0, 0));
     double fak = 1e-7;  // mu0 divided by 4 * pi factor
 
+    ReleaseGIL nogil;
     // Loop through the evaluation points by chunks of simd_size
     #pragma omp parallel for schedule(static)
     for(int i = 0; i < num_points; i++) {
@@ -457,6 +344,7 @@ Array dipole_field_A(Array& points, Array& m_points, Array& m) {
     double* m_ptr = &(m(0, 0));
     double fak = 1e-7;  // mu0 divided by 4 * pi factor
 
+    ReleaseGIL nogil;
     // Loop through the evaluation points by chunks of simd_size
     #pragma omp parallel for schedule(static)
     for(int i = 0; i < num_points; i++) {
@@ -509,6 +397,7 @@ Array dipole_field_dB(Array& points, Array& m_points, Array& m) {
     double* m_ptr = &(m(0, 0));
     double fak = 1e-7;
 
+    ReleaseGIL nogil;
     #pragma omp parallel for schedule(static)
     for(int i = 0; i < num_points; i++) {
         auto point_i = Vec3dStd();
@@ -571,6 +460,7 @@ Array dipole_field_dA(Array& points, Array& m_points, Array& m) {
     double* m_ptr = &(m(0, 0));
     double fak = 1e-7;
 
+    ReleaseGIL nogil;
     #pragma omp parallel for schedule(static)
     for(int i = 0; i < num_points; i++) {
         auto point_i = Vec3dStd();
@@ -612,121 +502,6 @@ Array dipole_field_dA(Array& points, Array& m_points, Array& m) {
     return dA;
 }
 
-
-// Calculate the geometric factor A needed for the permanent magnet optimization
-// Bnormal * n = A * m - b, where n is the unit normal to the plasma surface.
-// A = [g_1, ..., g_num_dipoles]
-// g_i = mu0 / (4 * pi) [3(n_i * r_i)r_i / |r_i|^5 - n_i / |r_i|^3]
-// points: where to evaluate the field
-// m_points: where the dipoles are located
-// unitnormal: unit normal vectors from the plasma surface
-// nfp: field-period symmetry of the plasma surface
-// stellsym: stellarator symmetry (True/False) of the plasma surface
-// b: Bnormal component corresponding to the non-magnet fields (e.g. external coils)
-// coordinate_flag: which coordinate system should be considered "grid-aligned"
-// R0: Major radius of the device, needed if a simple toroidal coordinate system is desired
-// returns the optimization matrix, or inductance, A
-Array dipole_field_Bn(Array& points, Array& m_points, Array& unitnormal, int nfp, int stellsym, Array& b, std::string coordinate_flag, double R0) 
-{
-    // warning: row_major checks below do NOT throw an error correctly on a compute node on Cori
-    if(points.layout() != xt::layout_type::row_major)
-          throw std::runtime_error("points needs to be in row-major storage order");
-    if(m_points.layout() != xt::layout_type::row_major)
-          throw std::runtime_error("m_points needs to be in row-major storage order");
-    if(unitnormal.layout() != xt::layout_type::row_major)
-          throw std::runtime_error("unit normal needs to be in row-major storage order");
-    if(b.layout() != xt::layout_type::row_major)
-          throw std::runtime_error("b needs to be in row-major storage order");
-    
-    int num_points = points.shape(0);
-    int num_dipoles = m_points.shape(0);
-    Array A = xt::zeros<double>({num_points, num_dipoles, 3});
-  
-    std::string cylindrical_str = "cylindrical"; 
-    std::string toroidal_str = "toroidal"; 
-    
-    // initialize pointer to the beginning of the dipole grid
-    double* m_points_ptr = &(m_points(0, 0));
-    double fak = 1e-7;  // mu0 divided by 4 * pi factor
-
-    // Loop through the evaluation points by chunks of simd_size
-    #pragma omp parallel for schedule(static)
-    for(int i = 0; i < num_points; i++) {
-        auto point_i = Vec3dStd();
-        auto n_i = Vec3dStd();
-        
-        for (int d = 0; d < 3; ++d) {
-            point_i[d] = points(i, d);
-            n_i[d] = unitnormal(i, d);
-        }
-	// Loop through all the dipoles, using all the symmetries
-        for (int j = 0; j < num_dipoles; ++j) {
-            auto mp_j = Vec3dStd(m_points_ptr[3 * j + 0], m_points_ptr[3 * j + 1], m_points_ptr[3 * j + 2]);
-            for (int stell = 0; stell < (stellsym + 1); ++stell) {
-                for(int fp = 0; fp < nfp; ++fp) {
-                    auto phi0 = (2 * M_PI / ((double) nfp)) * fp;
-                    auto sphi0 = std::sin(phi0);
-                    auto cphi0 = std::cos(phi0);
-                    auto G_i = Vec3dStd();
-
-                    // Calculate new dipole location after accounting for the symmetries
-                    // reflect the y and z-components and then rotate by phi0
-                    auto mp_x_new = mp_j.x * cphi0 - mp_j.y * sphi0 * pow(-1, stell);
-                    auto mp_y_new = mp_j.x * sphi0 + mp_j.y * cphi0 * pow(-1, stell);
-                    auto mp_z_new = mp_j.z * pow(-1, stell);
-                    auto mp_j_new = Vec3dStd(mp_x_new, mp_y_new, mp_z_new);
-
-                    // Calculate new phi location if switching to cylindrical coordinates
-                    auto mp_phi_new = std::atan2(mp_j.y, mp_j.x);
-                    auto mp_theta_new = std::atan2(mp_j.z, sqrt(mp_j.x * mp_j.x + mp_j.y * mp_j.y) - R0);
-                    auto sphi_new = std::sin(mp_phi_new);
-                    auto stheta_new = std::sin(mp_theta_new);
-                    auto cphi_new = std::cos(mp_phi_new);
-                    auto ctheta_new = std::cos(mp_theta_new);
-
-                    // Compute the unsymmetrized inductance matrix
-                    auto r = point_i - mp_j_new;
-                    auto rmag_2 = normsq(r);
-                    auto rmag_inv   = rsqrt(rmag_2);
-                    auto rmag_inv_3 = rmag_inv * (rmag_inv * rmag_inv);
-                    auto rmag_inv_5 = rmag_inv_3 * (rmag_inv * rmag_inv);
-                    auto rdotn = inner(r, n_i);
-                    G_i.x = 3.0 * rdotn * r.x * rmag_inv_5 - n_i.x * rmag_inv_3;
-                    G_i.y = 3.0 * rdotn * r.y * rmag_inv_5 - n_i.y * rmag_inv_3;
-                    G_i.z = 3.0 * rdotn * r.z * rmag_inv_5 - n_i.z * rmag_inv_3;
-
-                    if (coordinate_flag == cylindrical_str) {
-                        auto Ax_temp = (G_i.x * cphi0 + G_i.y * sphi0) * pow(-1, stell);
-                        auto Ay_temp = (- G_i.x * sphi0 + G_i.y * cphi0);
-                        A(i, j, 0) += fak * (Ax_temp * cphi_new + Ay_temp * sphi_new);
-                        A(i, j, 1) += fak * (-Ax_temp * sphi_new + Ay_temp * cphi_new);
-                        A(i, j, 2) += fak * G_i.z;
-                    }
-                    else if (coordinate_flag == toroidal_str) {
-
-                        auto Ax_temp = (G_i.x * cphi0 + G_i.y * sphi0) * pow(-1, stell);
-                        auto Ay_temp = (- G_i.x * sphi0 + G_i.y * cphi0);
-                        auto Az_temp = G_i.z;
-                        A(i, j, 0) += fak * (Ax_temp * cphi_new * ctheta_new + Ay_temp * sphi_new * ctheta_new + Az_temp * stheta_new);
-                        A(i, j, 1) += fak * (-Ax_temp * sphi_new + Ay_temp * cphi_new);
-                        A(i, j, 2) += fak * (-Ax_temp * cphi_new * stheta_new - Ay_temp * sphi_new * stheta_new + Az_temp * ctheta_new);
-                    }
-                    else {
-                        // rotate by -phi0 and then flip x component
-                        // This should be the reverse of what is done to the m vector and the dipole grid
-                        // because A * m = A * R^T * R * m and R is an orthogonal matrix both
-                        // for a reflection and a rotation.
-                        A(i, j, 0) += fak * (G_i.x * cphi0 + G_i.y * sphi0) * pow(-1, stell);
-                        A(i, j, 1) += fak * (-G_i.x * sphi0 + G_i.y * cphi0);
-                        A(i, j, 2) += fak * G_i.z;
-                    }
-                }
-            }
-        }
-    }
-    return A;
-}
-
 #endif
 
 // Takes a uniform CARTESIAN grid of dipoles, and loops through
@@ -754,6 +529,7 @@ Array define_a_uniform_cartesian_grid_between_two_toroidal_surfaces(Array& norma
     int num_ray = 2000;
     Array final_grid = xt::zeros<double>({ngrid, 3});
 
+    ReleaseGIL nogil;
     // Loop through every dipole
 #pragma omp parallel for schedule(static)
     for (int i = 0; i < ngrid; i++) {
@@ -842,4 +618,412 @@ Array define_a_uniform_cartesian_grid_between_two_toroidal_surfaces(Array& norma
         }
     }
     return final_grid;
-}
\ No newline at end of file
+}
+// The lanes of DipoleFieldOperator run over consecutive evaluation points,
+// they are either simd vectors or plain doubles.
+#if defined(USE_XSIMD)
+using dipole_lane_t = simd_t;
+constexpr int dipole_simd_size = xsimd::simd_type<double>::size;
+inline dipole_lane_t dipole_load(const double* ptr) { return xs::load_aligned(ptr); }
+inline double dipole_lane(const dipole_lane_t& x, int k) { return x[k]; }
+inline double dipole_lane_sum(const dipole_lane_t& x) { return xsimd::hadd(x); }
+#else
+using dipole_lane_t = double;
+constexpr int dipole_simd_size = 1;
+inline dipole_lane_t dipole_load(const double* ptr) { return *ptr; }
+inline double dipole_lane(const dipole_lane_t& x, int k) { return x; }
+inline double dipole_lane_sum(const dipole_lane_t& x) { return x; }
+#endif
+
+DipoleFieldOperator::DipoleFieldOperator(Array& points, Array& m_points_, Array& unitnormal, int nfp, int stellsym, std::string coordinate_flag, double R0) :
+    num_points(points.shape(0)), num_dipoles(m_points_.shape(0)), nfp(nfp), stellsym(stellsym)
+{
+    if(points.dimension() != 2 || points.shape(1) != 3)
+        throw std::invalid_argument("points needs to be of shape (num_points, 3)");
+    if(m_points_.dimension() != 2 || m_points_.shape(1) != 3)
+        throw std::invalid_argument("m_points needs to be of shape (num_dipoles, 3)");
+    if(unitnormal.dimension() != 2 || unitnormal.shape(0) != points.shape(0) || unitnormal.shape(1) != 3)
+        throw std::invalid_argument("unitnormal needs to be of the same shape as points");
+    if(nfp < 1)
+        throw std::invalid_argument("nfp needs to be positive");
+    if(num_points == 0)
+        throw std::invalid_argument("points must not be empty");
+
+    num_points_padded = ((num_points + dipole_simd_size - 1) / dipole_simd_size) * dipole_simd_size;
+    AlignedPaddedVec* coords[6] = {&px, &py, &pz, &nx, &ny, &nz};
+    for (int d = 0; d < 6; ++d)
+        *coords[d] = AlignedPaddedVec(num_points_padded, 0.);
+    row_weights = AlignedPaddedVec(num_points_padded, 0.);
+    for (int i = 0; i < num_points_padded; ++i) {
+        int ii = std::min(i, num_points - 1);
+        for (int d = 0; d < 3; ++d) {
+            (*coords[d])[i] = points(ii, d);
+            (*coords[3 + d])[i] = unitnormal(ii, d);
+        }
+        row_weights[i] = i < num_points ? 1.0 : 0.0;
+    }
+
+    num_images = (stellsym + 1) * nfp;
+    vector<double> cphi0(nfp), sphi0(nfp);
+    for (int fp = 0; fp < nfp; ++fp) {
+        double phi0 = (2 * M_PI / ((double) nfp)) * fp;
+        cphi0[fp] = std::cos(phi0);
+        sphi0[fp] = std::sin(phi0);
+    }
+
+    double fak = 1e-7;  // mu0 divided by 4 * pi factor
+    vector<double>* table[7] = {&img_x, &img_y, &img_z, &img_xx, &img_xy, &img_yx, &img_yy};
+    for (int t = 0; t < 7; ++t)
+        *table[t] = vector<double>(size_t(num_images) * num_dipoles);
+    frame = vector<double>(9 * num_dipoles, 0.);
+    for (int j = 0; j < num_dipoles; ++j) {
+        double x = m_points_(j, 0);
+        double y = m_points_(j, 1);
+        double z = m_points_(j, 2);
+        for (int stell = 0; stell < (stellsym + 1); ++stell) {
+            double sign = stell ? -1.0 : 1.0;
+            for (int fp = 0; fp < nfp; ++fp) {
+                size_t s = size_t(j) * num_images + stell * nfp + fp;
+                // reflect the y and z-components and then rotate by phi0
+                img_x[s] = x * cphi0[fp] - y * sphi0[fp] * sign;
+                img_y[s] = x * sphi0[fp] + y * cphi0[fp] * sign;
+                img_z[s] = z * sign;
+                // rotate by -phi0 and then flip the x component, the reverse
+                // of what is done to the dipole location
+                img_xx[s] = cphi0[fp] * sign;
+                img_xy[s] = sphi0[fp] * sign;
+                img_yx[s] = -sphi0[fp];
+                img_yy[s] = cphi0[fp];
+            }
+        }
+        double* F = &frame[9 * j];
+        if (coordinate_flag == "cylindrical") {
+            double phi = std::atan2(y, x);
+            double cphi = std::cos(phi), sphi = std::sin(phi);
+            F[0] = cphi;  F[1] = sphi; F[2] = 0.;
+            F[3] = -sphi; F[4] = cphi; F[5] = 0.;
+            F[6] = 0.;    F[7] = 0.;   F[8] = 1.;
+        }
+        else if (coordinate_flag == "toroidal") {
+            double phi = std::atan2(y, x);
+            double theta = std::atan2(z, sqrt(x * x + y * y) - R0);
+            double cphi = std::cos(phi), sphi = std::sin(phi);
+            double ctheta = std::cos(theta), stheta = std::sin(theta);
+            F[0] = cphi * ctheta;   F[1] = sphi * ctheta;   F[2] = stheta;
+            F[3] = -sphi;           F[4] = cphi;            F[5] = 0.;
+            F[6] = -cphi * stheta;  F[7] = -sphi * stheta;  F[8] = ctheta;
+        }
+        else {
+            F[0] = 1.; F[4] = 1.; F[8] = 1.;
+        }
+        for (int c = 0; c < 9; ++c)
+            F[c] *= fak;
+    }
+}
+
+DipoleFieldOperator DipoleFieldOperator::scale_rows(Array& w) const {
+    if(int(w.size()) != num_points)
+        throw std::invalid_argument("w needs to have num_points entries");
+    DipoleFieldOperator res(*this);
+    int i = 0;
+    for (auto wi : w)
+        res.row_weights[i++] *= wi;
+    return res;
+}
+
+DipoleFieldOperator DipoleFieldOperator::scale_columns(Array& w) const {
+    if(int(w.size()) != 3 * num_dipoles)
+        throw std::invalid_argument("w needs to have 3 * num_dipoles entries");
+    DipoleFieldOperator res(*this);
+    int jc = 0;
+    for (auto wjc : w) {
+        for (int d = 0; d < 3; ++d)
+            res.frame[3 * jc + d] *= wjc;
+        ++jc;
+    }
+    return res;
+}
+
+template<class Lane>
+void DipoleFieldOperator::images(int j, const Lane* p, const Lane* n, Lane* a) const {
+    size_t s_end = size_t(j + 1) * num_images;
+    for (size_t s = size_t(j) * num_images; s < s_end; ++s) {
+        Lane rx = p[0] - img_x[s];
+        Lane ry = p[1] - img_y[s];
+        Lane rz = p[2] - img_z[s];
+        Lane rmag_2 = rx * rx + ry * ry + rz * rz;
+        Lane rmag_inv = rsqrt(rmag_2);
+        Lane rmag_inv_3 = rmag_inv * (rmag_inv * rmag_inv);
+        Lane rmag_inv_5 = rmag_inv_3 * (rmag_inv * rmag_inv);
+        Lane rdotn = rx * n[0] + ry * n[1] + rz * n[2];
+        Lane Gx = 3.0 * rdotn * rx * rmag_inv_5 - n[0] * rmag_inv_3;
+        Lane Gy = 3.0 * rdotn * ry * rmag_inv_5 - n[1] * rmag_inv_3;
+        Lane Gz = 3.0 * rdotn * rz * rmag_inv_5 - n[2] * rmag_inv_3;
+        a[0] += Gx * img_xx[s] + Gy * img_xy[s];
+        a[1] += Gx * img_yx[s] + Gy * img_yy[s];
+        a[2] += Gz;
+    }
+}
+
+void DipoleFieldOperator::apply(const double* x, double* y) const {
+    // A x = sum_j a_j . (F_j^T x_j), with a_j the cartesian field of dipole j
+    vector<double> xc(3 * num_dipoles, 0.);
+    for (int j = 0; j < num_dipoles; ++j)
+        for (int c = 0; c < 3; ++c)
+            for (int d = 0; d < 3; ++d)
+                xc[3 * j + d] += frame[9 * j + 3 * c + d] * x[3 * j + c];
+
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < num_points_padded; i += dipole_simd_size) {
+        dipole_lane_t p[3] = {dipole_load(&px[i]), dipole_load(&py[i]), dipole_load(&pz[i])};
+        dipole_lane_t n[3] = {dipole_load(&nx[i]), dipole_load(&ny[i]), dipole_load(&nz[i])};
+        dipole_lane_t acc(0.);
+        for (int j = 0; j < num_dipoles; ++j) {
+            dipole_lane_t a[3] = {dipole_lane_t(0.), dipole_lane_t(0.), dipole_lane_t(0.)};
+            images(j, p, n, a);
+            acc += a[0] * xc[3 * j + 0] + a[1] * xc[3 * j + 1] + a[2] * xc[3 * j + 2];
+        }
+        acc *= dipole_load(&row_weights[i]);
+        int klimit = std::min(dipole_simd_size, num_points - i);
+        for (int k = 0; k < klimit; ++k)
+            y[i + k] = dipole_lane(acc, k);
+    }
+}
+
+void DipoleFieldOperator::apply_transpose(const double* r, double* y, const double* active) const {
+    AlignedPaddedVec wr(num_points_padded, 0.);
+    for (int i = 0; i < num_points; ++i)
+        wr[i] = row_weights[i] * r[i];
+
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int j = 0; j < num_dipoles; ++j) {
+        if (active && !active[3 * j] && !active[3 * j + 1] && !active[3 * j + 2]) {
+            y[3 * j + 0] = y[3 * j + 1] = y[3 * j + 2] = 0.;
+            continue;
+        }
+        dipole_lane_t acc[3] = {dipole_lane_t(0.), dipole_lane_t(0.), dipole_lane_t(0.)};
+        for (int i = 0; i < num_points_padded; i += dipole_simd_size) {
+            dipole_lane_t p[3] = {dipole_load(&px[i]), dipole_load(&py[i]), dipole_load(&pz[i])};
+            dipole_lane_t n[3] = {dipole_load(&nx[i]), dipole_load(&ny[i]), dipole_load(&nz[i])};
+            dipole_lane_t a[3] = {dipole_lane_t(0.), dipole_lane_t(0.), dipole_lane_t(0.)};
+            images(j, p, n, a);
+            dipole_lane_t wri = dipole_load(&wr[i]);
+            for (int d = 0; d < 3; ++d)
+                acc[d] += a[d] * wri;
+        }
+        double s[3] = {dipole_lane_sum(acc[0]), dipole_lane_sum(acc[1]), dipole_lane_sum(acc[2])};
+        const double* F = &frame[9 * j];
+        for (int c = 0; c < 3; ++c)
+            y[3 * j + c] = F[3 * c + 0] * s[0] + F[3 * c + 1] * s[1] + F[3 * c + 2] * s[2];
+    }
+}
+
+void DipoleFieldOperator::column(int jc, double* y) const {
+    int j = jc / 3;
+    const double* F = &frame[9 * j + 3 * (jc % 3)];
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < num_points_padded; i += dipole_simd_size) {
+        dipole_lane_t p[3] = {dipole_load(&px[i]), dipole_load(&py[i]), dipole_load(&pz[i])};
+        dipole_lane_t n[3] = {dipole_load(&nx[i]), dipole_load(&ny[i]), dipole_load(&nz[i])};
+        dipole_lane_t a[3] = {dipole_lane_t(0.), dipole_lane_t(0.), dipole_lane_t(0.)};
+        images(j, p, n, a);
+        dipole_lane_t v = (F[0] * a[0] + F[1] * a[1] + F[2] * a[2]) * dipole_load(&row_weights[i]);
+        int klimit = std::min(dipole_simd_size, num_points - i);
+        for (int k = 0; k < klimit; ++k)
+            y[i + k] = dipole_lane(v, k);
+    }
+}
+
+vector<double> DipoleFieldOperator::column_norms() const {
+    vector<double> norms(3 * num_dipoles);
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int j = 0; j < num_dipoles; ++j) {
+        const double* F = &frame[9 * j];
+        dipole_lane_t acc[3] = {dipole_lane_t(0.), dipole_lane_t(0.), dipole_lane_t(0.)};
+        for (int i = 0; i < num_points_padded; i += dipole_simd_size) {
+            dipole_lane_t p[3] = {dipole_load(&px[i]), dipole_load(&py[i]), dipole_load(&pz[i])};
+            dipole_lane_t n[3] = {dipole_load(&nx[i]), dipole_load(&ny[i]), dipole_load(&nz[i])};
+            dipole_lane_t a[3] = {dipole_lane_t(0.), dipole_lane_t(0.), dipole_lane_t(0.)};
+            images(j, p, n, a);
+            dipole_lane_t w = dipole_load(&row_weights[i]);
+            for (int c = 0; c < 3; ++c) {
+                dipole_lane_t v = (F[3 * c + 0] * a[0] + F[3 * c + 1] * a[1] + F[3 * c + 2] * a[2]) * w;
+                acc[c] += v * v;
+            }
+        }
+        for (int c = 0; c < 3; ++c)
+            norms[3 * j + c] = dipole_lane_sum(acc[c]);
+    }
+    return norms;
+}
+
+Array DipoleFieldOperator::matvec(Array& x) const {
+    if(int(x.size()) != 3 * num_dipoles)
+        throw std::invalid_argument("x needs to have 3 * num_dipoles entries");
+    vector<double> xv(x.begin(), x.end());
+    Array y = xt::zeros<double>({num_points});
+    apply(xv.data(), y.data());
+    return y;
+}
+
+Array DipoleFieldOperator::rmatvec(Array& r) const {
+    if(int(r.size()) != num_points)
+        throw std::invalid_argument("r needs to have num_points entries");
+    vector<double> rv(r.begin(), r.end());
+    Array y = xt::zeros<double>({3 * num_dipoles});
+    apply_transpose(rv.data(), y.data());
+    return y;
+}
+
+void DipoleFieldOperator::dense_rows(int row_start, int nrows, double* out) const {
+    if(row_start < 0 || nrows < 0 || row_start + nrows > num_points)
+        throw std::invalid_argument("rows out of range");
+    int ncols = 3 * num_dipoles;
+    int row_end = row_start + nrows;
+    // the blocks of points start at multiples of the simd size
+    int block_start = (row_start / dipole_simd_size) * dipole_simd_size;
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(static)
+    for (int i = block_start; i < row_end; i += dipole_simd_size) {
+        dipole_lane_t p[3] = {dipole_load(&px[i]), dipole_load(&py[i]), dipole_load(&pz[i])};
+        dipole_lane_t n[3] = {dipole_load(&nx[i]), dipole_load(&ny[i]), dipole_load(&nz[i])};
+        dipole_lane_t w = dipole_load(&row_weights[i]);
+        int kstart = std::max(0, row_start - i);
+        int klimit = std::min(dipole_simd_size, row_end - i);
+        for (int j = 0; j < num_dipoles; ++j) {
+            dipole_lane_t a[3] = {dipole_lane_t(0.), dipole_lane_t(0.), dipole_lane_t(0.)};
+            images(j, p, n, a);
+            const double* F = &frame[9 * j];
+            for (int c = 0; c < 3; ++c) {
+                dipole_lane_t v = (F[3 * c + 0] * a[0] + F[3 * c + 1] * a[1] + F[3 * c + 2] * a[2]) * w;
+                for (int k = kstart; k < klimit; ++k)
+                    out[size_t(i + k - row_start) * ncols + 3 * j + c] = dipole_lane(v, k);
+            }
+        }
+    }
+}
+
+void DipoleFieldOperator::dense_columns(int col_start, int ncols, double* out) const {
+    if(col_start < 0 || ncols < 0 || col_start + ncols > 3 * num_dipoles)
+        throw std::invalid_argument("columns out of range");
+    int col_end = col_start + ncols;
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int j = col_start / 3; j < (col_end + 2) / 3; ++j) {
+        const double* F = &frame[9 * j];
+        for (int i = 0; i < num_points_padded; i += dipole_simd_size) {
+            dipole_lane_t p[3] = {dipole_load(&px[i]), dipole_load(&py[i]), dipole_load(&pz[i])};
+            dipole_lane_t n[3] = {dipole_load(&nx[i]), dipole_load(&ny[i]), dipole_load(&nz[i])};
+            dipole_lane_t a[3] = {dipole_lane_t(0.), dipole_lane_t(0.), dipole_lane_t(0.)};
+            images(j, p, n, a);
+            dipole_lane_t w = dipole_load(&row_weights[i]);
+            int klimit = std::min(dipole_simd_size, num_points - i);
+            for (int c = 0; c < 3; ++c) {
+                int jc = 3 * j + c;
+                if (jc < col_start || jc >= col_end)
+                    continue;
+                dipole_lane_t v = (F[3 * c + 0] * a[0] + F[3 * c + 1] * a[1] + F[3 * c + 2] * a[2]) * w;
+                for (int k = 0; k < klimit; ++k)
+                    out[size_t(jc - col_start) * num_points + i + k] = dipole_lane(v, k);
+            }
+        }
+    }
+}
+
+Array DipoleFieldOperator::todense() const {
+    Array A = first_touch_zeros<Array>(vector<int>{num_points, 3 * num_dipoles});
+    dense_rows(0, num_points, A.data());
+    return A;
+}
+
+// Calculate the geometric factor A needed for the permanent magnet optimization
+// Bnormal * n = A * m - b, where n is the unit normal to the plasma surface.
+// A = [g_1, ..., g_num_dipoles]
+// g_i = mu0 / (4 * pi) [3(n_i * r_i)r_i / |r_i|^5 - n_i / |r_i|^3]
+// points: where to evaluate the field
+// m_points: where the dipoles are located
+// unitnormal: unit normal vectors from the plasma surface
+// nfp: field-period symmetry of the plasma surface
+// stellsym: stellarator symmetry (True/False) of the plasma surface
+// b: Bnormal component corresponding to the non-magnet fields (e.g. external coils)
+// coordinate_flag: which coordinate system should be considered "grid-aligned"
+// R0: Major radius of the device, needed if a simple toroidal coordinate system is desired
+// returns the optimization matrix, or inductance, A
+// The symmetry images are expanded once by DipoleFieldOperator, so A is
+// simply its dense form.
+Array dipole_field_Bn(Array& points, Array& m_points, Array& unitnormal, int nfp, int stellsym, Array& b, std::string coordinate_flag, double R0)
+{
+    // warning: row_major checks below do NOT throw an error correctly on a compute node on Cori
+    if(points.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("points needs to be in row-major storage order");
+    if(m_points.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("m_points needs to be in row-major storage order");
+    if(unitnormal.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("unit normal needs to be in row-major storage order");
+    if(b.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("b needs to be in row-major storage order");
+
+    int num_points = points.shape(0);
+    int num_dipoles = m_points.shape(0);
+    // A is read by all threads in the optimization, see first_touch_zeros
+    Array A = first_touch_zeros<Array>(vector<int>{num_points, num_dipoles, 3});
+    if(num_points == 0 || num_dipoles == 0)
+        return A;
+    DipoleFieldOperator op(points, m_points, unitnormal, nfp, stellsym, coordinate_flag, R0);
+    op.dense_rows(0, num_points, A.data());
+    return A;
+}
+
+static const double* row_major_data(Array& a, const std::string& name) {
+    if(a.layout() != xt::layout_type::row_major)
+          throw std::runtime_error(name + " needs to be in row-major storage order");
+    if(a.dimension() != 2 || a.shape(1) != 3)
+          throw std::invalid_argument(name + " needs to have shape (n, 3).");
+    return a.data();
+}
+
+DipoleFieldTreecode::DipoleFieldTreecode(Array& m_points, Array& m, double theta, int leafsize) :
+    theta(theta), leafsize(leafsize),
+    tree(row_major_data(m_points, "m_points"), row_major_data(m, "m"), m_points.shape(0), leafsize) {
+    if(m.shape(0) != m_points.shape(0))
+        throw std::invalid_argument("m_points and m need to have the same number of dipoles.");
+    if(theta < 0. || theta >= 1.)
+        throw std::invalid_argument("The treecode opening parameter theta needs to be in [0, 1).");
+}
+
+template<int derivs, bool vector_potential>
+Array DipoleFieldTreecode::evaluate(Array& points) const {
+    const double* x = row_major_data(points, "points");
+    int num_points = points.shape(0);
+    Array F = derivs > 0 ? Array(xt::zeros<double>({num_points, 3, 3})) : Array(xt::zeros<double>({num_points, 3}));
+    double* F_ptr = F.data();
+    double fak = 1e-7;  // mu0 divided by 4 * pi factor
+    ReleaseGIL nogil;
+    // the cost per point varies with the distance to the dipoles
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < num_points; ++i) {
+        double F_i[3] = {0., 0., 0.};
+        double dF_i[9] = {0.};
+        if constexpr(vector_potential)
+            tree.evaluate_A<derivs>(&(x[3 * i]), theta, F_i, dF_i);
+        else
+            tree.evaluate_B<derivs>(&(x[3 * i]), theta, F_i, dF_i);
+        if constexpr(derivs > 0) {
+            for (int k = 0; k < 9; ++k)
+                F_ptr[9 * i + k] = fak * dF_i[k];
+        } else {
+            for (int a = 0; a < 3; ++a)
+                F_ptr[3 * i + a] = fak * F_i[a];
+        }
+    }
+    return F;
+}
+
+Array DipoleFieldTreecode::B(Array& points) const { return evaluate<0, false>(points); }
+Array DipoleFieldTreecode::dB(Array& points) const { return evaluate<1, false>(points); }
+Array DipoleFieldTreecode::A(Array& points) const { return evaluate<0, true>(points); }
+Array DipoleFieldTreecode::dA(Array& points) const { return evaluate<1, true>(points); }
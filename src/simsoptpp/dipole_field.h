@@ -5,6 +5,8 @@
 #include <string> // for string class
 #include <iostream>
 #include "xtensor-python/pyarray.hpp"     // Numpy bindings
+#include "simdhelpers.h"
+#include "dipole_field_treecode.h"
 typedef xt::pyarray<double> Array;
 
 Array dipole_field_B(Array& points, Array& m_points, Array& m);
@@ -18,3 +20,98 @@ Array dipole_field_dA(Array& points, Array& m_points, Array& m);
 Array dipole_field_Bn(Array& points, Array& m_points, Array& unitnormal, int nfp, int stellsym, Array& b, std::string coordinate_flag="cartesian", double R0=0.0);
 
 Array define_a_uniform_cartesian_grid_between_two_toroidal_surfaces(Array& normal_inner, Array& normal_outer, Array& xyz_uniform, Array& xyz_inner, Array& xyz_outer);
+
+// Matrix-free version of the (num_points, 3 * num_dipoles) matrix computed by
+// dipole_field_Bn, A(i, 3 * j + c) = row_weights[i] * column_weights[3 * j + c]
+// * dipole_field_Bn(...)(i, j, c), including the nfp and stellarator symmetry
+// images of the dipoles and the cylindrical and toroidal coordinate flags.
+// Only the dipole grid, the evaluation points and the coordinate frames of the
+// dipoles are stored, and the entries of A are recomputed whenever A or A^T
+// is applied, so memory scales with num_points + num_dipoles instead of their
+// product. Every output entry is summed by one thread in a fixed order, so the
+// results don't depend on the number of threads.
+class DipoleFieldOperator {
+    public:
+        using value_type = double;
+
+        DipoleFieldOperator(Array& points, Array& m_points, Array& unitnormal, int nfp, int stellsym, std::string coordinate_flag="cartesian", double R0=0.0);
+
+        int shape(int axis) const { return axis == 0 ? num_points : 3 * num_dipoles; }
+
+        // copies of the operator with the rows or columns multiplied by w
+        DipoleFieldOperator scale_rows(Array& w) const;
+        DipoleFieldOperator scale_columns(Array& w) const;
+
+        // y = A x, y has num_points entries
+        void apply(const double* x, double* y) const;
+        // y = A^T r, y has 3 * num_dipoles entries. If active is given, only
+        // the dipoles with at least one active component are computed.
+        void apply_transpose(const double* r, double* y, const double* active=nullptr) const;
+        // column j of A
+        void column(int j, double* y) const;
+        // squared norms of all columns of A
+        vector<double> column_norms() const;
+
+        // rows [row_start, row_start + nrows) of A, written into the row-major
+        // (nrows, 3 * num_dipoles) buffer out
+        void dense_rows(int row_start, int nrows, double* out) const;
+        // columns [col_start, col_start + ncols) of A, written transposed into
+        // the row-major (ncols, num_points) buffer out, which is the layout the
+        // GPMO algorithms take
+        void dense_columns(int col_start, int ncols, double* out) const;
+
+        Array matvec(Array& x) const;
+        Array rmatvec(Array& r) const;
+        Array todense() const;
+
+    private:
+        int num_points, num_points_padded, num_dipoles, nfp, stellsym;
+        // evaluation points and unit normals, padded to a multiple of the simd
+        // size by repeating the last point with a zero weight
+        AlignedPaddedVec px, py, pz, nx, ny, nz, row_weights;
+        // the num_images = (stellsym + 1) * nfp symmetry images of dipole j
+        // are stored at [j * num_images, (j + 1) * num_images) of the image
+        // table: their locations img_x, img_y, img_z and the inverse symmetry
+        // [[img_xx, img_xy, 0], [img_yx, img_yy, 0], [0, 0, 1]] that maps
+        // their field back
+        int num_images;
+        vector<double> img_x, img_y, img_z, img_xx, img_xy, img_yx, img_yy;
+        // frame[9 * j + 3 * c + d] maps the cartesian field of dipole j to
+        // component c of its coordinate system, times the column weight and
+        // the factor mu0 / (4 pi)
+        vector<double> frame;
+
+        // a[d] += cartesian component d of the field of all symmetry images
+        // of dipole j, mapped back by the inverse symmetry, at the points p
+        // with normals n
+        template<class Lane>
+        void images(int j, const Lane* p, const Lane* n, Lane* a) const;
+};
+
+// Treecode approximation of dipole_field_B, dipole_field_dB, dipole_field_A and
+// dipole_field_dA, see dipole_field_treecode.h. The tree over the dipoles is
+// built once in the constructor, so that the fields can be evaluated
+// repeatedly (e.g. during field line tracing) in O(log(num_dipoles)) per
+// point. The relative error scales as theta^3, and theta = 0 gives the direct
+// sum.
+class DipoleFieldTreecode {
+    public:
+        DipoleFieldTreecode(Array& m_points, Array& m, double theta, int leafsize=16);
+
+        Array B(Array& points) const;
+        Array dB(Array& points) const;
+        Array A(Array& points) const;
+        Array dA(Array& points) const;
+
+        double get_theta() const { return theta; }
+        int get_leafsize() const { return leafsize; }
+        int num_dipoles() const { return tree.m.size() / 3; }
+
+    private:
+        double theta;
+        int leafsize;
+        dipole_treecode::Tree tree;
+
+        template<int derivs, bool vector_potential>
+        Array evaluate(Array& points) const;
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "biot_savart_treecode.h"
+#include <numeric>
+
+// Treecode (Barnes-Hut) approximation of the fields of a large number of point
+// dipoles. The dipoles are split recursively at the median of the longest side
+// of their bounding box, so that every node of the tree holds a contiguous
+// range of the reordered dipoles. For each node we store the center c, the
+// radius and the moments of the dipoles
+//     S_a    = sum_j m_a
+//     M_ab   = sum_j m_a y_b
+//     Q_abc  = sum_j m_a y_b y_c
+// with y = x_j - c. If a target point x is far from a node, i.e.
+// radius < theta * |x-c|, the contribution of the node is approximated by a
+// second order Taylor expansion of the kernel around c, with a relative error
+// of O(theta^3). Nodes that are too close to x are opened, and leaves are
+// evaluated directly.
+//
+// In terms of the derivative tensors D_n of 1/|r| (see
+// biot_savart_treecode.h), the fields of a dipole m at y are
+//     B_a(x) = m_b D_ab(x-y)
+//     A_a(x) = -eps_abc m_b D_c(x-y)
+// and for a node we replace m_b D_K(x-y) by
+//     S_b D_K(r) - M_bd D_Kd(r) + 1/2 Q_bde D_Kde(r).
+
+namespace dipole_treecode {
+
+using biot_savart_treecode::pow3;
+using biot_savart_treecode::InverseDistanceDerivatives;
+
+struct Node {
+    int lo, hi;
+    int left, right;
+    double center[3];
+    double radius;
+    double S[3];
+    double M[9];
+    double Q[27];
+};
+
+class Tree {
+    public:
+        vector<Node> nodes;
+        // dipole positions and moments in the order of the tree
+        vector<double> m_points, m;
+
+        Tree(const double* m_points_, const double* m_, int num_dipoles, int leafsize) :
+            m_points(3*num_dipoles), m(3*num_dipoles) {
+            if(leafsize < 1)
+                throw std::invalid_argument("leafsize needs to be positive.");
+            vector<int> perm(num_dipoles);
+            std::iota(perm.begin(), perm.end(), 0);
+            nodes.reserve(4*(num_dipoles/leafsize + 1));
+            if(num_dipoles > 0)
+                build(perm, m_points_, 0, num_dipoles, leafsize);
+            for (int j = 0; j < num_dipoles; ++j) {
+                for (int d = 0; d < 3; ++d) {
+                    m_points[3*j+d] = m_points_[3*perm[j]+d];
+                    m[3*j+d] = m_[3*perm[j]+d];
+                }
+            }
+            for (auto& node : nodes)
+                compute_moments(node);
+        }
+
+        // Accumulate B and, if derivs > 0, dB/dX at x (without the 1e-7
+        // prefactor) into the arrays B[3] and dB[3*3], dB[3*a+k] = dB_a/dx_k.
+        template<int derivs>
+        void evaluate_B(const double* x, double theta, double* B, double* dB) const {
+            evaluate<derivs, false>(x, theta, B, dB);
+        }
+
+        // Same as evaluate_B for the vector potential, dA[3*a+k] = dA_a/dx_k.
+        template<int derivs>
+        void evaluate_A(const double* x, double theta, double* A, double* dA) const {
+            evaluate<derivs, true>(x, theta, A, dA);
+        }
+
+    private:
+        int build(vector<int>& perm, const double* pos, int lo, int hi, int leafsize) {
+            int idx = nodes.size();
+            nodes.push_back(Node());
+            Node node;
+            node.lo = lo;
+            node.hi = hi;
+            node.left = -1;
+            node.right = -1;
+            int n = hi - lo;
+            if(n > leafsize) {
+                double lower[3], upper[3];
+                for (int d = 0; d < 3; ++d) {
+                    lower[d] = pos[3*perm[lo]+d];
+                    upper[d] = lower[d];
+                }
+                for (int j = lo; j < hi; ++j) {
+                    for (int d = 0; d < 3; ++d) {
+                        lower[d] = std::min(lower[d], pos[3*perm[j]+d]);
+                        upper[d] = std::max(upper[d], pos[3*perm[j]+d]);
+                    }
+                }
+                int axis = 0;
+                for (int d = 1; d < 3; ++d) {
+                    if(upper[d] - lower[d] > upper[axis] - lower[axis])
+                        axis = d;
+                }
+                int mid = lo + n/2;
+                // ties are broken by the index, so the tree does not depend on
+                // the implementation of nth_element
+                std::nth_element(perm.begin() + lo, perm.begin() + mid, perm.begin() + hi, [&](int i, int j) {
+                        return pos[3*i+axis] < pos[3*j+axis] || (pos[3*i+axis] == pos[3*j+axis] && i < j);
+                    });
+                node.left = build(perm, pos, lo, mid, leafsize);
+                node.right = build(perm, pos, mid, hi, leafsize);
+            }
+            nodes[idx] = node;
+            return idx;
+        }
+
+        void compute_moments(Node& node) const {
+            int n = node.hi - node.lo;
+            std::fill(node.center, node.center+3, 0.);
+            std::fill(node.S, node.S+3, 0.);
+            std::fill(node.M, node.M+9, 0.);
+            std::fill(node.Q, node.Q+27, 0.);
+            for (int j = node.lo; j < node.hi; ++j) {
+                for (int d = 0; d < 3; ++d) {
+                    node.center[d] += m_points[3*j+d]/n;
+                    node.S[d] += m[3*j+d];
+                }
+            }
+            node.radius = 0.;
+            for (int j = node.lo; j < node.hi; ++j) {
+                double y[3] = {m_points[3*j+0]-node.center[0], m_points[3*j+1]-node.center[1], m_points[3*j+2]-node.center[2]};
+                node.radius = std::max(node.radius, std::sqrt(y[0]*y[0] + y[1]*y[1] + y[2]*y[2]));
+                for (int a = 0; a < 3; ++a) {
+                    double m_a = m[3*j+a];
+                    for (int b = 0; b < 3; ++b) {
+                        node.M[3*a+b] += m_a*y[b];
+                        for (int c = 0; c < 3; ++c)
+                            node.Q[9*a+3*b+c] += m_a*y[b]*y[c];
+                    }
+                }
+            }
+        }
+
+        template<int derivs, bool vector_potential>
+        void evaluate(const double* x, double theta, double* F, double* dF) const {
+            if(nodes.empty())
+                return;
+            // order of the derivative tensors of the direct sum
+            constexpr int order = (vector_potential ? 1 : 2) + derivs;
+            InverseDistanceDerivatives D;
+            double theta2 = theta*theta;
+            int stack[128];
+            int top = 0;
+            stack[top++] = 0;
+            while(top > 0) {
+                const Node& node = nodes[stack[--top]];
+                double r[3] = {x[0]-node.center[0], x[1]-node.center[1], x[2]-node.center[2]};
+                double dist2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+                if(node.radius*node.radius < theta2*dist2) {
+                    D.compute<order+2>(r);
+                    add<derivs, vector_potential, 2>(D, node.S, node.M, node.Q, F, dF);
+                } else if(node.left < 0) {
+                    for (int j = node.lo; j < node.hi; ++j) {
+                        double rj[3] = {x[0]-m_points[3*j+0], x[1]-m_points[3*j+1], x[2]-m_points[3*j+2]};
+                        D.compute<order>(rj);
+                        add<derivs, vector_potential, 0>(D, &(m[3*j]), nullptr, nullptr, F, dF);
+                    }
+                } else {
+                    stack[top++] = node.left;
+                    stack[top++] = node.right;
+                }
+            }
+        }
+
+        // sum_m (-1)^m/m! Mom_m[b, d...] D_{q+m}[K..., d...], where K is the
+        // multi index of length q with flat index Kflat.
+        template<int morder>
+        static inline double contract(const InverseDistanceDerivatives& D, const double* S, const double* M, const double* Q, int b, int q, int Kflat) {
+            double res = S[b]*D.D[q][Kflat];
+            if constexpr(morder >= 1) {
+                for (int d = 0; d < 3; ++d)
+                    res -= M[3*b+d]*D.D[q+1][3*Kflat + d];
+            }
+            if constexpr(morder >= 2) {
+                for (int d = 0; d < 9; ++d)
+                    res += 0.5*Q[9*b+d]*D.D[q+2][9*Kflat + d];
+            }
+            return res;
+        }
+
+        // Adds S_b D_ab - M_bd D_abd + 1/2 Q_bde D_abde for the field, or
+        // -eps_abc (S_b D_c - M_bd D_cd + 1/2 Q_bde D_cde) for the vector
+        // potential, and its derivatives.
+        template<int derivs, bool vector_potential, int morder>
+        static inline void add(const InverseDistanceDerivatives& D, const double* S, const double* M, const double* Q, double* F, double* dF) {
+            for (int a = 0; a < 3; ++a) {
+                if constexpr(vector_potential) {
+                    int b = (a+1)%3;
+                    int c = (a+2)%3;
+                    F[a] -= contract<morder>(D, S, M, Q, b, 1, c) - contract<morder>(D, S, M, Q, c, 1, b);
+                    if constexpr(derivs > 0) {
+                        for (int k = 0; k < 3; ++k)
+                            dF[3*a+k] -= contract<morder>(D, S, M, Q, b, 2, 3*c+k) - contract<morder>(D, S, M, Q, c, 2, 3*b+k);
+                    }
+                } else {
+                    for (int b = 0; b < 3; ++b) {
+                        F[a] += contract<morder>(D, S, M, Q, b, 2, 3*a+b);
+                        if constexpr(derivs > 0) {
+                            for (int k = 0; k < 3; ++k)
+                                dF[3*a+k] += contract<morder>(D, S, M, Q, b, 3, 9*a+3*b+k);
+                        }
+                    }
+                }
+            }
+        }
+};
+
+}
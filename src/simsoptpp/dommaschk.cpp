@@ -1,7 +1,9 @@
 #include "dommaschk.h"
 #include <math.h>
+#include <map>
+#include "simdhelpers.h"
 
-double alpha(int m,int l) {
+static double alpha(int m,int l) {
 	double y;
     if (l < 0) {
 		y=0;
@@ -12,13 +14,13 @@ double alpha(int m,int l) {
 	return y;
 }
 
-double alphas(int m,int l) {
+static double alphas(int m,int l) {
 	double y;
 	y = (2*l+m)*alpha(m,l);
 	return y;
 }
 
-double beta(int m,int l) {
+static double beta(int m,int l) {
 	double y;
     if (l < 0 || l >=m) {
 		y=0;
@@ -29,13 +31,13 @@ double beta(int m,int l) {
 	return y;
 }
 
-double betas(int m,int l) {
+static double betas(int m,int l) {
 	double y;
 	y = (2*l-m)*beta(m,l);
 	return y;
 }
 
-double gamma1(int m,int l) {
+static double gamma1(int m,int l) {
 	double y;
     if (l <= 0) {
 		y=0;
@@ -51,483 +53,257 @@ double gamma1(int m,int l) {
 	return y;
 }
 
-double gammas(int m,int l) {
+static double gammas(int m,int l) {
 	double y;
 	y = (2*l+m)*gamma1(m,l);
 	return y;
 }
 
-double Dmn(int m, int n, double R, double Z) {
-	double sumD=0.0, y=0.0;
-	int j, k;
-	for (k=0; k<=floor(n/2); k++) {
-		sumD = 0.0;
-		for (j=0;j<k+1;j++) {
-			sumD += -(alpha(m,j)*(alphas(m,k-m-j)*log(R)+gammas(m,k-m-j)-alpha(m,k-m-j))-gamma1(m,j)*alphas(m,k-m-j)+alpha(m,j)*betas(m,k-j))*pow(R,(2*j+m)) + alphas(m,k-j)*beta(m,j)*pow(R,2*j-m);
-		}
-		y += (pow(Z,n-2*k)/tgamma(n-2*k+1))*sumD;
-	}
-	return y;
-}
-
-double Nmn(int m, int n, double R, double Z) {
-	double sumN = 0.0, y = 0.0;
-	int j, k;
-	for (k=0;k<=floor(n/2); k++) {
-		sumN = 0.0;
-		for (j=0;j<k+1;j++) {
-            sumN += +(alpha(m,j)*(alpha(m,k-m-j)*log(R)+gamma1(m,k-m-j))-gamma1(m,j)*alpha(m,k-m-j)+alpha(m,j)*beta(m,k-j))*pow(R,(2*j+m)) - alpha(m,k-j)*beta(m,j)*pow(R,2*j-m);
-		}
-		y += (pow(Z,n-2*k)/tgamma(n-2*k+1))*sumN;
-	}
-	return y;
-}
-
-double dRDmn(int m, int n, double R, double Z) {
-	double sumD= 0.0, y=0.0;
-	int j, k;
-	for (k=0; k<=floor(n/2); k++) {
-		sumD = 0.0;
-		for (j=0;j<k+1;j++) {
-			sumD += -(alpha(m,j)*(alphas(m,k-m-j)*(1.0/(2*j+m)+log(R))+gammas(m,k-m-j)-alpha(m,k-m-j))-gamma1(m,j)*alphas(m,k-m-j)+alpha(m,j)*betas(m,k-j))*pow(R,(2*j+m-1))*(2*j+m) + alphas(m,k-j)*beta(m,j)*pow(R,2*j-m-1)*(2*j-m);
-		}
-		y += (pow(Z,n-2*k)/tgamma(n-2*k+1))*sumD;
-	}
-	return y;
-}
-
-double dZDmn(int m, int n, double R, double Z) {
-	double sumD= 0.0, y=0.0;
-	int j, k;
-	for (k=0;k<=floor(n/2); k++) {
-		sumD = 0.0;
-		for (j=0; j<k+1;j++) {
-			sumD += -(alpha(m,j)*(alphas(m,k-m-j)*log(R)+gammas(m,k-m-j)-alpha(m,k-m-j))-gamma1(m,j)*alphas(m,k-m-j)+alpha(m,j)*betas(m,k-j))*pow(R,(2*j+m)) + alphas(m,k-j)*beta(m,j)*pow(R,2*j-m);
-		}
-        if (n-2*k==0){
-            y += 0;
+// Adds c * Z^p / p! * R^q * (1 or log(R)) of the potentials to the table
+static void add_term(std::map<std::pair<int, int>, std::pair<double, double>>& terms, int p, int q, double c0, double c1) {
+    if (c0 == 0 && c1 == 0)
+        return;
+    auto& t = terms[{p, q}];
+    t.first += c0 / tgamma(p + 1);
+    t.second += c1 / tgamma(p + 1);
+}
+
+DommaschkField::DommaschkField(Array& mArray, Array& nArray, Array& coeffs) {
+    int num_modes = mArray.size();
+    if(int(nArray.size()) != num_modes || coeffs.dimension() != 2 || int(coeffs.shape(0)) != num_modes || coeffs.shape(1) != 2)
+        throw std::invalid_argument("m, n and coeffs need to have the shapes (nmodes,), (nmodes,) and (nmodes, 2)");
+    for (int jm = 0; jm < num_modes; ++jm) {
+        int m = mArray(jm);
+        int n = nArray(jm);
+        Mode mode;
+        mode.m = m;
+        if (n%2 == 0) {
+            mode.a = mode.d = 0;
+            mode.b = coeffs(jm, 0);
+            mode.c = coeffs(jm, 1);
         }
         else {
-		    y += ((n-2*k)*pow(Z,n-2*k-1)/tgamma(n-2*k+1))*sumD;
+            mode.a = coeffs(jm, 0);
+            mode.d = coeffs(jm, 1);
+            mode.b = mode.c = 0;
         }
-	}
-	return y;
-}
-
-double dRRDmn(int m, int n, double R, double Z) {
-	double sumD= 0.0, y=0.0;
-	int j, k;
-	for (k=0;k<=floor(n/2);k++) {
-		sumD = 0.0;
-		for (j=0; j<k+1; j++) {
-			sumD += -(alpha(m,j)*(alphas(m,k-m-j)*(((4.0*j+2*m-1)/((2.0*j+m)*(2.0*j+m-1)))+log(R))+gammas(m,k-m-j)-alpha(m,k-m-j))-gamma1(m,j)*alphas(m,k-m-j)+alpha(m,j)*betas(m,k-j))*pow(R,(2*j+m-2))*(2*j+m)*(2*j+m-1) + alphas(m,k-j)*beta(m,j)*pow(R,2*j-m-2)*(2*j-m)*(2*j-m-1);
-		}
-		y += (pow(Z,n-2*k)/tgamma(n-2*k+1))*sumD;
-	}
-	return y;
-}
-
-double dZZDmn(int m, int n, double R, double Z) {
-	double sumD= 0.0, y=0.0;
-	int j, k;
-	for (k=0;k<=floor(n/2);k++) {
-		sumD = 0.0;
-		for (j=0; j<k+1; j++) {
-			sumD += -(alpha(m,j)*(alphas(m,k-m-j)*log(R)+gammas(m,k-m-j)-alpha(m,k-m-j))-gamma1(m,j)*alphas(m,k-m-j)+alpha(m,j)*betas(m,k-j))*pow(R,(2*j+m)) + alphas(m,k-j)*beta(m,j)*pow(R,2*j-m);
-		}
-        if (n-2*k==0 || n-2*k-1==0){
-            y += 0;
+        // D_mn
+        std::map<std::pair<int, int>, std::pair<double, double>> terms;
+        for (int k = 0; k <= n/2 && n >= 0; k++) {
+            for (int j = 0; j < k+1; j++) {
+                add_term(terms, n-2*k, 2*j+m,
+                        -(alpha(m,j)*(gammas(m,k-m-j)-alpha(m,k-m-j))-gamma1(m,j)*alphas(m,k-m-j)+alpha(m,j)*betas(m,k-j)),
+                        -alpha(m,j)*alphas(m,k-m-j));
+                add_term(terms, n-2*k, 2*j-m, alphas(m,k-j)*beta(m,j), 0.);
+            }
         }
-        else {
-		    y += ((n-2*k-1)*pow(Z,n-2*k-2)/tgamma(n-2*k))*sumD;
-        }
-	}
-	return y;
-}
-
-double dRZDmn(int m, int n, double R, double Z) {
-	double sumD= 0.0, y=0.0;
-	int j, k;
-	for (k=0;k<=floor(n/2);k++) {
-		sumD = 0.0;
-		for (j=0; j<k+1; j++) {
-			sumD += -(alpha(m,j)*(alphas(m,k-m-j)*(1.0/(2*j+m)+log(R))+gammas(m,k-m-j)-alpha(m,k-m-j))-gamma1(m,j)*alphas(m,k-m-j)+alpha(m,j)*betas(m,k-j))*pow(R,(2*j+m-1))*(2*j+m) + alphas(m,k-j)*beta(m,j)*pow(R,2*j-m-1)*(2*j-m);
-		}
-        if (n-2*k==0){
-            y += 0;
-        }
-        else {
-		    y += (pow(Z,n-2*k-1)/tgamma(n-2*k))*sumD;
+        for (auto& t : terms)
+            mode.D.push_back({t.first.first, t.first.second, t.second.first, t.second.second});
+        // N_m,n-1
+        terms.clear();
+        for (int k = 0; k <= (n-1)/2 && n-1 >= 0; k++) {
+            for (int j = 0; j < k+1; j++) {
+                add_term(terms, n-1-2*k, 2*j+m,
+                        alpha(m,j)*gamma1(m,k-m-j)-gamma1(m,j)*alpha(m,k-m-j)+alpha(m,j)*beta(m,k-j),
+                        alpha(m,j)*alpha(m,k-m-j));
+                add_term(terms, n-1-2*k, 2*j-m, -alpha(m,k-j)*beta(m,j), 0.);
+            }
         }
-	}
-	return y;
-}
-
-double dRNmn(int m, int n, double R, double Z) {
-	double sumN= 0.0, y=0.0;
-	int j, k;
-	for (k=0;k<=floor(n/2); k++) {
-		sumN = 0.0;
-		for (j=0; j<k+1; j++) {
-			sumN += +(alpha(m,j)*(alpha(m,k-m-j)*(1.0/(2*j+m)+log(R))+gamma1(m,k-m-j))-gamma1(m,j)*alpha(m,k-m-j)+alpha(m,j)*beta(m,k-j))*pow(R,(2*j+m-1))*(2*j+m) - alpha(m,k-j)*beta(m,j)*pow(R,2*j-m-1)*(2*j-m);
-
-		}	
-	y += (pow(Z,n-2*k)/tgamma(n-2*k+1))*sumN;
-	}
-	return y;
-}
-
-double dZNmn(int m, int n, double R, double Z) {
-	double sumN= 0.0, y=0.0;
-	int j, k;
-	for (k=0;k<=floor(n/2);k++) {
-		sumN = 0.0;
-		for (j=0; j<k+1; j++) {
-			sumN += +(alpha(m,j)*(alpha(m,k-m-j)*log(R)+gamma1(m,k-m-j))-gamma1(m,j)*alpha(m,k-m-j)+alpha(m,j)*beta(m,k-j))*pow(R,(2*j+m)) - alpha(m,k-j)*beta(m,j)*pow(R,2*j-m);
-		}
-        if (n-2*k==0 || n<0) {
-            y += 0;
-        }
-        else {
-		    y += ((n-2*k)*pow(Z,n-2*k-1)/tgamma(n-2*k+1))*sumN;
+        for (auto& t : terms)
+            mode.N.push_back({t.first.first, t.first.second, t.second.first, t.second.second});
+
+        mmax = std::max(mmax, std::abs(m));
+        for (auto* table : {&mode.D, &mode.N}) {
+            for (auto& t : *table) {
+                pmax = std::max(pmax, t.p);
+                qmin = std::min(qmin, t.q - 2);
+                qmax = std::max(qmax, t.q);
+            }
         }
-	}
-	return y;
-}
-
-double dRRNmn(int m, int n, double R, double Z) {
-	double sumN= 0.0, y=0.0;
-	int j, k;
-	for (k=0; k< n/2 + 1; k++) {
-		sumN = 0.0;
-		for (j=0; j< k+1; j++) {
-			sumN += +(alpha(m,j)*(alpha(m,k-m-j)*(((4.0*j+2*m-1)/((2.0*j+m)*(2.0*j+m-1)))+log(R))+gamma1(m,k-m-j))-gamma1(m,j)*alpha(m,k-m-j)+alpha(m,j)*beta(m,k-j))*pow(R,(2*j+m-2))*(2*j+m)*(2*j+m-1) - alpha(m,k-j)*beta(m,j)*pow(R,2*j-m-2)*(2*j-m)*(2*j-m-1);
-		}
-		y += (pow(Z,n-2*k)/tgamma(n-2*k+1))*sumN;
-	}
-	return y;
+        modes.push_back(mode);
+    }
 }
 
-double dZZNmn(int m, int n, double R, double Z) {
-	double sumN= 0.0, y=0.0;
-	int j, k;
-	for (k=0; k< n/2; k++) {
-		sumN = 0.0;
-		for (j =0; j<k+1; j++) {
-			sumN += +(alpha(m,j)*(alpha(m,k-m-j)*log(R)+gamma1(m,k-m-j))-gamma1(m,j)*alpha(m,k-m-j)+alpha(m,j)*beta(m,k-j))*pow(R,(2*j+m)) - alpha(m,k-j)*beta(m,j)*pow(R,2*j-m);
-		}
-        if (n-2*k==0 || n-2*k-1==0 || n<0) {
-            y += 0;
+#if defined(USE_XSIMD)
+using dommaschk_lane_t = simd_t;
+constexpr int dommaschk_simd_size = xsimd::simd_type<double>::size;
+inline dommaschk_lane_t dommaschk_load(const double* ptr) { return xs::load_unaligned(ptr); }
+inline double dommaschk_lane(const dommaschk_lane_t& x, int k) { return x[k]; }
+#else
+using dommaschk_lane_t = double;
+constexpr int dommaschk_simd_size = 1;
+inline dommaschk_lane_t dommaschk_load(const double* ptr) { return *ptr; }
+inline double dommaschk_lane(const dommaschk_lane_t& x, int k) { return x; }
+#endif
+
+// F = [F, dF/dR, dF/dZ, d^2F/dR^2, d^2F/dZ^2, d^2F/dRdZ] of the potential
+// sum_t Z^p R^q (c0 + c1 log(R)). Rpow[q] = R^q and Zpow[p] = Z^p.
+template<class Lane, bool derivs>
+static void potential(const vector<DommaschkField::Term>& terms, const Lane* Rpow, const Lane* Zpow, const Lane& logR, Lane* F) {
+    for (int d = 0; d < 6; ++d)
+        F[d] = Lane(0.);
+    for (auto& t : terms) {
+        int p = t.p, q = t.q;
+        Lane g = t.c0 + t.c1 * logR;
+        // d/dR [R^q (c0 + c1 log(R))] = R^(q-1) gR
+        Lane gR = double(q) * g + t.c1;
+        F[0] += Zpow[p] * Rpow[q] * g;
+        F[1] += Zpow[p] * Rpow[q-1] * gR;
+        if (p >= 1)
+            F[2] += double(p) * Zpow[p-1] * Rpow[q] * g;
+        if (derivs) {
+            F[3] += Zpow[p] * Rpow[q-2] * (double(q-1) * gR + q * t.c1);
+            if (p >= 2)
+                F[4] += double(p * (p-1)) * Zpow[p-2] * Rpow[q] * g;
+            if (p >= 1)
+                F[5] += double(p) * Zpow[p-1] * Rpow[q-1] * gR;
         }
-        else {
-		    y += ((n-2*k-1)*pow(Z,n-2*k-2)/tgamma(n-2*k))*sumN;
-        }
-	}
-	return y;
+    }
 }
 
-double dRZNmn(int m, int n, double R, double Z) {
-	double sumN= 0.0, y=0.0;
-	int j, k;
-	for (k=0;k<=floor(n/2); k++) {
-		sumN = 0.0;
-		for (j=0; j< k+1; j++) {
-			sumN += +(alpha(m,j)*(alpha(m,k-m-j)*(1.0/(2*j+m)+log(R))+gamma1(m,k-m-j))-gamma1(m,j)*alpha(m,k-m-j)+alpha(m,j)*beta(m,k-j))*pow(R,(2*j+m-1))*(2*j+m) - alpha(m,k-j)*beta(m,j)*pow(R,2*j-m-1)*(2*j-m);
-		}
-        if (n-2*k==0 || n<0) {
-            y += 0;
+template<bool derivs, bool sum_modes>
+void DommaschkField::evaluate(const double* points, int num_points, double* res) const {
+    using Lane = dommaschk_lane_t;
+    constexpr int simd_size = dommaschk_simd_size;
+    int nmodes = modes.size();
+    constexpr int nout = derivs ? 9 : 3;
+
+    // a few points, e.g. a single point during tracing, are not worth the
+    // threads
+#pragma omp parallel if(num_points > 16 * simd_size)
+    {
+        vector<Lane> Rpow_storage(qmax - qmin + 1), Zpow(pmax + 1), cm(mmax + 1), sm(mmax + 1);
+        Lane* Rpow = Rpow_storage.data() - qmin;
+#pragma omp for schedule(static)
+        for (int i = 0; i < num_points; i += simd_size) {
+            int klimit = std::min(simd_size, num_points - i);
+            double buf[3][simd_size];
+            for (int k = 0; k < simd_size; ++k)
+                for (int d = 0; d < 3; ++d)
+                    buf[d][k] = points[3 * std::min(i + k, num_points - 1) + d];
+            Lane x = dommaschk_load(buf[0]);
+            Lane y = dommaschk_load(buf[1]);
+            Lane z = dommaschk_load(buf[2]);
+            using std::sqrt;
+            using std::log;
+            Lane R = sqrt(x * x + y * y);
+            Lane Rinv = 1. / R;
+            Lane logR = log(R);
+            Lane cosphi = x * Rinv;
+            Lane sinphi = y * Rinv;
+
+            Rpow[0] = Lane(1.);
+            for (int q = 1; q <= qmax; ++q)
+                Rpow[q] = Rpow[q-1] * R;
+            for (int q = -1; q >= qmin; --q)
+                Rpow[q] = Rpow[q+1] * Rinv;
+            Zpow[0] = Lane(1.);
+            for (int p = 1; p <= pmax; ++p)
+                Zpow[p] = Zpow[p-1] * z;
+            cm[0] = Lane(1.);
+            sm[0] = Lane(0.);
+            for (int m = 1; m <= mmax; ++m) {
+                cm[m] = cm[m-1] * cosphi - sm[m-1] * sinphi;
+                sm[m] = sm[m-1] * cosphi + cm[m-1] * sinphi;
+            }
+
+            Lane acc[nout];
+            for (int l = 0; l < nout; ++l)
+                acc[l] = Lane(0.);
+            for (int jm = 0; jm < nmodes; ++jm) {
+                const Mode& mode = modes[jm];
+                int m = mode.m;
+                Lane D[6], N[6];
+                potential<Lane, derivs>(mode.D, Rpow, Zpow.data(), logR, D);
+                potential<Lane, derivs>(mode.N, Rpow, Zpow.data(), logR, N);
+                // cos(m phi) and sin(m phi) for negative m too
+                Lane cmp = cm[std::abs(m)];
+                Lane smp = m < 0 ? -sm[-m] : sm[std::abs(m)];
+                Lane U = mode.a * cmp + mode.b * smp;
+                Lane V = mode.c * cmp + mode.d * smp;
+                // derivatives of U and V with respect to phi
+                Lane Up = double(m) * (-mode.a * smp + mode.b * cmp);
+                Lane Vp = double(m) * (-mode.c * smp + mode.d * cmp);
+
+                Lane BR = U * D[1] + V * N[1];
+                Lane BZ = U * D[2] + V * N[2];
+                Lane Bphi = (Up * D[0] + Vp * N[0]) * Rinv;
+                Lane out[nout];
+                out[0] = BR * cosphi - Bphi * sinphi;
+                out[1] = BR * sinphi + Bphi * cosphi;
+                out[2] = BZ;
+                if (derivs) {
+                    Lane dphiBR = Up * D[1] + Vp * N[1];
+                    Lane dphiBZ = Up * D[2] + Vp * N[2];
+                    Lane dphiBphi = -double(m * m) * (U * D[0] + V * N[0]) * Rinv;
+                    Lane dRBR = U * D[3] + V * N[3];
+                    Lane dZBZ = U * D[4] + V * N[4];
+                    Lane dRBZ = U * D[5] + V * N[5];
+                    Lane dZBR = dRBZ;
+                    Lane dRBphi = (dphiBR - Bphi) * Rinv;
+                    Lane dZBphi = dphiBZ * Rinv;
+                    Lane cc = cosphi * cosphi, ss = sinphi * sinphi, cs = cosphi * sinphi;
+                    // out[3 * k + l] = dB_l/dx_k
+                    out[0] = dRBR*cc - (dphiBR - Bphi + dRBphi*R)*cs*Rinv + ss*(dphiBphi + BR)*Rinv;
+                    out[1] = cs*(dRBR*R - dphiBphi - BR)*Rinv + ss*(Bphi - dphiBR)*Rinv + cc*dRBphi;
+                    out[2] = dRBZ*cosphi - dphiBZ*sinphi*Rinv;
+                    out[3] = cs*(dRBR*R - dphiBphi - BR)*Rinv + cc*(dphiBR - Bphi)*Rinv - ss*dRBphi;
+                    out[4] = dRBR*ss + (dphiBR - Bphi + dRBphi*R)*cs*Rinv + cc*(dphiBphi + BR)*Rinv;
+                    out[5] = dRBZ*sinphi + dphiBZ*cosphi*Rinv;
+                    out[6] = dZBR*cosphi - dZBphi*sinphi;
+                    out[7] = dZBR*sinphi + dZBphi*cosphi;
+                    out[8] = dZBZ;
+                }
+                if (sum_modes) {
+                    for (int l = 0; l < nout; ++l)
+                        acc[l] += out[l];
+                }
+                else {
+                    for (int k = 0; k < klimit; ++k)
+                        for (int l = 0; l < nout; ++l)
+                            res[(size_t(jm) * num_points + i + k) * nout + l] = dommaschk_lane(out[l], k);
+                }
+            }
+            if (sum_modes)
+                for (int k = 0; k < klimit; ++k)
+                    for (int l = 0; l < nout; ++l)
+                        res[size_t(i + k) * nout + l] = dommaschk_lane(acc[l], k);
         }
-        else {
-		    y += ((n-2*k)*pow(Z,n-2*k-1)/tgamma(n-2*k+1))*sumN;
-        }
-	}
-	return y;
-}
-
-double Phi(int m, int nn, double R, double Z, double phi,double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (nn%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1; 
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = (a*cos(m*phi) + b*sin(m*phi))*Dmn(m,nn,R,Z) + (c*cos(m*phi) + d*sin(m*phi))*Nmn(m,nn-1,R,Z);
-	return y;
-}
-
-double BR(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = (a*cos(m*phi) + b*sin(m*phi))*dRDmn(m,n,R,Z) + (c*cos(m*phi) + d*sin(m*phi))*dRNmn(m,n-1,R,Z);
-	return y;
-}
-
-double BZ(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = (a*cos(m*phi) + b*sin(m*phi))*dZDmn(m,n,R,Z) + (c*cos(m*phi) + d*sin(m*phi))*dZNmn(m,n-1,R,Z);
-	return y;
-}
-
-double Bphi(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = m*(-a*sin(m*phi) + b*cos(m*phi))*Dmn(m,n,R,Z)/R + m*(-c*sin(m*phi) + d*cos(m*phi))*Nmn(m,n-1,R,Z)/R;
-	return y;
-}
-
-double dphiBR(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = m*((-a*sin(m*phi) + b*cos(m*phi))*dRDmn(m,n,R,Z) + (-c*sin(m*phi) + d*cos(m*phi))*dRNmn(m,n-1,R,Z));
-	return y;
-}
-
-double dphiBZ(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = m*((-a*sin(m*phi) + b*cos(m*phi))*dZDmn(m,n,R,Z) + (-c*sin(m*phi) + d*cos(m*phi))*dZNmn(m,n-1,R,Z));
-	return y;
-}
-
-double dphiBphi(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = m*(m*(-a*cos(m*phi) - b*sin(m*phi))*Dmn(m,n,R,Z)/R + m*(-c*cos(m*phi) - d*sin(m*phi))*Nmn(m,n-1,R,Z)/R);
-	return y;
-}
-
-double dRBR(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = (a*cos(m*phi) + b*sin(m*phi))*dRRDmn(m,n,R,Z) + (c*cos(m*phi) + d*sin(m*phi))*dRRNmn(m,n-1,R,Z);
-	return y;
-}
-
-double dZBZ(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = (a*cos(m*phi) + b*sin(m*phi))*dZZDmn(m,n,R,Z) + (c*cos(m*phi) + d*sin(m*phi))*dZZNmn(m,n-1,R,Z);
-	return y;
-}
-
-double dRBZ(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = (a*cos(m*phi) + b*sin(m*phi))*dRZDmn(m,n,R,Z) + (c*cos(m*phi) + d*sin(m*phi))*dRZNmn(m,n-1,R,Z);
-	return y;
-}
-
-double dZBR(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0; 
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1;
-		d = coeff2; 
-		b = c = 0;
-	}
-	y = (a*cos(m*phi) + b*sin(m*phi))*dRZDmn(m,n,R,Z) + (c*cos(m*phi) + d*sin(m*phi))*dRZNmn(m,n-1,R,Z);
-	return y;
-}
-
-double dRBphi(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0) {
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1; 
-		d = coeff2;
-		b = c = 0;
-	}
-	y =  m*(-a*sin(m*phi) + b*cos(m*phi))*dRDmn(m,n,R,Z)/R + m*(-c*sin(m*phi) + d*cos(m*phi))*dRNmn(m,n-1,R,Z)/R - m*(-a*sin(m*phi) + b*cos(m*phi))*Dmn(m,n,R,Z)/pow(R,2) - m*(-c*sin(m*phi) + d*cos(m*phi))*Nmn(m,n-1,R,Z)/pow(R,2);
-	return y;
-}
-
-double dZBphi(int m, int n, double R, double Z, double phi, double coeff1, double coeff2) {
-	double y;
-	double a, b, c, d;
-	if (n%2 == 0){
-		a = d = 0;
-		b = coeff1;
-		c = coeff2;
-	}
-	else {
-		a = coeff1; 
-		d = coeff2;
-		b = c = 0;
-	}
-	y = m*(-a*sin(m*phi) + b*cos(m*phi))*dZDmn(m,n,R,Z)/R + m*(-c*sin(m*phi) + d*cos(m*phi))*dZNmn(m,n-1,R,Z)/R;
-	return y;
+    }
 }
 
-#include "xtensor-python/pyarray.hpp"
-typedef xt::pyarray<double> Array;
+template<bool derivs, bool sum_modes>
+Array DommaschkField::evaluate(Array& points) const {
+    if(points.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("points needs to be in row-major storage order");
+    if(points.dimension() != 2 || points.shape(1) != 3)
+          throw std::invalid_argument("points needs to have shape (npoints, 3)");
+    int num_points = points.shape(0);
+    int nmodes = modes.size();
+    Array res;
+    if (sum_modes && derivs)
+        res = xt::zeros<double>({num_points, 3, 3});
+    else if (sum_modes)
+        res = xt::zeros<double>({num_points, 3});
+    else if (derivs)
+        res = xt::zeros<double>({nmodes, num_points, 3, 3});
+    else
+        res = xt::zeros<double>({nmodes, num_points, 3});
+    evaluate<derivs, sum_modes>(points.data(), num_points, res.data());
+    return res;
+}
+
+void DommaschkField::B(const double* points, int num_points, double* B) const { evaluate<false, true>(points, num_points, B); }
+void DommaschkField::dB(const double* points, int num_points, double* dB) const { evaluate<true, true>(points, num_points, dB); }
+Array DommaschkField::B(Array& points) const { return evaluate<false, true>(points); }
+Array DommaschkField::dB(Array& points) const { return evaluate<true, true>(points); }
+Array DommaschkField::B_modes(Array& points) const { return evaluate<false, false>(points); }
+Array DommaschkField::dB_modes(Array& points) const { return evaluate<true, false>(points); }
 
 Array DommaschkB(Array& mArray, Array& nArray, Array& coeffs, Array& points){
-    int num_points = points.shape(0);
-    int num_coeffs = coeffs.shape(0);
-    Array B        = xt::zeros<double>({coeffs.shape(0), points.shape(0), points.shape(1)});
-    double x,y,z,R,phi,cosphi,sinphi,coeff1,coeff2;
-    int m,n;
-    for (int j=0; j < num_coeffs; ++j) {
-        m      = mArray(j);
-        n      = nArray(j);
-        coeff1 = coeffs(j,0);
-        coeff2 = coeffs(j,1);
-        #pragma omp parallel for
-        for (int i = 0; i < num_points; ++i) {
-            x    = points(i, 0);
-            y    = points(i, 1);
-            z    = points(i, 2);
-            R    = sqrt(x*x+y*y);
-            phi  = atan2(y,x);
-            cosphi = x/R;
-            sinphi = y/R;
-            B(j,i,0) = BR(m,n,R,z,phi,coeff1,coeff2)*cosphi-Bphi(m,n,R,z,phi,coeff1,coeff2)*sinphi;
-            B(j,i,1) = BR(m,n,R,z,phi,coeff1,coeff2)*sinphi+Bphi(m,n,R,z,phi,coeff1,coeff2)*cosphi;
-            B(j,i,2) = BZ(m,n,R,z,phi,coeff1,coeff2);
-        }
-    }
-    return B;
+    return DommaschkField(mArray, nArray, coeffs).B_modes(points);
 }
 
 Array DommaschkdB(Array& mArray, Array& nArray, Array& coeffs, Array& points){
-    int num_points = points.shape(0);
-    int num_coeffs = coeffs.shape(0);
-    Array dB       = xt::zeros<double>({coeffs.shape(0), points.shape(0), points.shape(1), points.shape(1)});
-    double x,y,z,R,phi,cosphi,sinphi,coeff1,coeff2;
-    int m,n;
-    for (int j=0; j < num_coeffs; ++j) {
-        m      = mArray(j);
-        n      = nArray(j);
-        coeff1 = coeffs(j,0);
-        coeff2 = coeffs(j,1);
-        #pragma omp parallel for
-        for (int i = 0; i < num_points; ++i) {
-            x    = points(i, 0);
-            y    = points(i, 1);
-            z    = points(i, 2);
-            R    = sqrt(x*x+y*y);
-            phi  = atan2(y,x);
-            cosphi = x/R;
-            sinphi = y/R;
-            dB(j,i,0,0) = dRBR(m,n,R,z,phi,coeff1,coeff2)*cosphi*cosphi-(dphiBR(m,n,R,z,phi,coeff1,coeff2)-Bphi(m,n,R,z,phi,coeff1,coeff2)+dRBphi(m,n,R,z,phi,coeff1,coeff2)*R)*cosphi*sinphi/R+sinphi*sinphi*(dphiBphi(m,n,R,z,phi,coeff1,coeff2)+BR(m,n,R,z,phi,coeff1,coeff2))/R;
-            dB(j,i,0,1) = sinphi*cosphi*(dRBR(m,n,R,z,phi,coeff1,coeff2)*R-dphiBphi(m,n,R,z,phi,coeff1,coeff2)-BR(m,n,R,z,phi,coeff1,coeff2))/R+sinphi*sinphi*(Bphi(m,n,R,z,phi,coeff1,coeff2)-dphiBR(m,n,R,z,phi,coeff1,coeff2))/R+cosphi*cosphi*dRBphi(m,n,R,z,phi,coeff1,coeff2);
-            dB(j,i,0,2) = dRBZ(m,n,R,z,phi,coeff1,coeff2)*cosphi-dphiBZ(m,n,R,z,phi,coeff1,coeff2)*sinphi/R;
-            dB(j,i,1,0) = sinphi*cosphi*(dRBR(m,n,R,z,phi,coeff1,coeff2)*R-dphiBphi(m,n,R,z,phi,coeff1,coeff2)-BR(m,n,R,z,phi,coeff1,coeff2))/R+cosphi*cosphi*(dphiBR(m,n,R,z,phi,coeff1,coeff2)-Bphi(m,n,R,z,phi,coeff1,coeff2))/R-sinphi*sinphi*dRBphi(m,n,R,z,phi,coeff1,coeff2);
-            dB(j,i,1,1) = dRBR(m,n,R,z,phi,coeff1,coeff2)*sinphi*sinphi+(dphiBR(m,n,R,z,phi,coeff1,coeff2)-Bphi(m,n,R,z,phi,coeff1,coeff2)+dRBphi(m,n,R,z,phi,coeff1,coeff2)*R)*cosphi*sinphi/R+cosphi*cosphi*(dphiBphi(m,n,R,z,phi,coeff1,coeff2)+BR(m,n,R,z,phi,coeff1,coeff2))/R;
-            dB(j,i,1,2) = dRBZ(m,n,R,z,phi,coeff1,coeff2)*sinphi+dphiBZ(m,n,R,z,phi,coeff1,coeff2)*cosphi/R;
-            dB(j,i,2,0) = dZBR(m,n,R,z,phi,coeff1,coeff2)*cosphi-dZBphi(m,n,R,z,phi,coeff1,coeff2)*sinphi;
-            dB(j,i,2,1) = dZBR(m,n,R,z,phi,coeff1,coeff2)*sinphi+dZBphi(m,n,R,z,phi,coeff1,coeff2)*cosphi;
-            dB(j,i,2,2) = dZBZ(m,n,R,z,phi,coeff1,coeff2);
-
-
-        }
-    }
-    return dB;
+    return DommaschkField(mArray, nArray, coeffs).dB_modes(points);
 }
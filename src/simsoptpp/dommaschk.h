@@ -1,5 +1,55 @@
+#pragma once
+
 #include "xtensor-python/pyarray.hpp"
 typedef xt::pyarray<double> Array;
+#include <vector>
+using std::vector;
+
+// The Dommaschk potentials D_mn(R, Z) and N_m,n-1(R, Z) are polynomials in Z,
+// R, 1/R and log(R). DommaschkField expands them once into tables of
+// monomials Z^p R^q (c0 + c1 log(R)) per mode, so that evaluating the field
+// only takes a few powers of R and Z per point. The points are evaluated in
+// simd vectors and distributed over the OpenMP threads.
+class DommaschkField {
+    public:
+        DommaschkField(Array& mArray, Array& nArray, Array& coeffs);
+
+        int num_modes() const { return modes.size(); }
+
+        // field and gradient summed over all modes, of shape (npoints, 3) and
+        // (npoints, 3, 3) with dB(i, k, l) = dB_l/dx_k
+        Array B(Array& points) const;
+        Array dB(Array& points) const;
+        // as above, for a row-major (npoints, 3) array of points, writing to
+        // arrays of the same shapes
+        void B(const double* points, int npoints, double* B) const;
+        void dB(const double* points, int npoints, double* dB) const;
+        // the field and gradient of every mode, of shape (nmodes, npoints, 3)
+        // and (nmodes, npoints, 3, 3)
+        Array B_modes(Array& points) const;
+        Array dB_modes(Array& points) const;
+
+        // the monomial Z^p R^q (c0 + c1 log(R)) of a potential
+        struct Term {
+            int p, q;
+            double c0, c1;
+        };
+
+    private:
+        struct Mode {
+            int m;
+            // coefficients of cos(m phi) and sin(m phi) in front of D and N
+            double a, b, c, d;
+            vector<Term> D, N;
+        };
+        vector<Mode> modes;
+        int mmax = 0, pmax = 0, qmin = 0, qmax = 0;
+
+        template<bool derivs, bool sum_modes>
+        void evaluate(const double* points, int npoints, double* res) const;
+        template<bool derivs, bool sum_modes>
+        Array evaluate(Array& points) const;
+};
 
 Array DommaschkB(Array& mArray, Array& nArray, Array& coeffs, Array& points);
 Array DommaschkdB(Array& mArray, Array& nArray, Array& coeffs, Array& points);
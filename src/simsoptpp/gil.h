@@ -0,0 +1,39 @@
+#pragma once
+
+#include <optional>
+#include "pybind11/pybind11.h"
+
+// The functions of simsoptpp are called from python with the GIL held. Long
+// running kernels release it while they don't touch any python objects, so
+// that other python threads can run in the meantime, e.g. to evaluate several
+// BiotSavart objects concurrently from a thread pool.
+//
+// ReleaseGIL releases the GIL for its lifetime if the calling thread holds it,
+// and does nothing otherwise, e.g. if it is nested in another ReleaseGIL or
+// runs on an OpenMP thread. While the GIL is released, numpy arrays
+// (xt::pyarray, xt::pytensor) must not be created, copied or destroyed, and
+// python code may only be called through the pybind11 trampolines
+// (PYBIND11_OVERRIDE) and std::function wrappers of python functions, which
+// reacquire the GIL themselves. Callbacks that create arrays have to
+// reacquire it with pybind11::gil_scoped_acquire, see InterpolatedField.
+class ReleaseGIL {
+    private:
+        std::optional<pybind11::gil_scoped_release> release;
+
+    public:
+        // release can be set to false if the kernel may create arrays, or
+        // for small problems, for which waiting for the GIL afterwards may
+        // take longer than the kernel itself
+        explicit ReleaseGIL(bool release=true) {
+            if(release && PyGILState_Check())
+                this->release.emplace();
+        }
+        ReleaseGIL(const ReleaseGIL&) = delete;
+        ReleaseGIL& operator=(const ReleaseGIL&) = delete;
+
+        // reacquires the GIL before the end of the scope, e.g. to copy the
+        // arrays that are returned
+        void reacquire() {
+            release.reset();
+        }
+};
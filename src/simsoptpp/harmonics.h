@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cmath>
+#include "simdhelpers.h"
+
+// Fourier series in an angle phi require cos(j*phi) and sin(j*phi) for many
+// values of j. Since trigonometric functions are expensive, we avoid calling
+// them for every j and instead use the rules
+//          sin((j+1)*phi) = cos(phi) sin(j*phi) + cos(j*phi) sin(phi)
+//          cos((j+1)*phi) = cos(j*phi) cos(phi) - sin(j*phi) sin(phi)
+// Every ANGLE_RECOMPUTE steps the angle is recomputed from scratch, to avoid
+// accumulating floating point error. This is the same technique as used in
+// surfacerzfourier.cpp.
+//
+// The angles can either be doubles or simd vectors, so that Fourier curves
+// can be evaluated at several quadrature points at once.
+
+#ifndef ANGLE_RECOMPUTE
+#define ANGLE_RECOMPUTE 5
+#endif
+
+#if defined(USE_XSIMD)
+using harmonic_t = simd_t;
+constexpr int harmonic_size = xsimd::simd_type<double>::size;
+
+inline void harmonic_sincos(const simd_t& angle, simd_t& s, simd_t& c) {
+    xsimd::sincos(angle, s, c);
+}
+
+inline double harmonic_lane(const simd_t& x, int l) {
+    return x[l];
+}
+
+// harmonic_size consecutive values from an aligned pointer
+inline simd_t harmonic_load(const double* ptr) {
+    return xsimd::load_aligned(ptr);
+}
+#else
+using harmonic_t = double;
+constexpr int harmonic_size = 1;
+
+inline double harmonic_lane(double x, int) {
+    return x;
+}
+
+inline double harmonic_load(const double* ptr) {
+    return *ptr;
+}
+#endif
+
+inline void harmonic_sincos(double angle, double& s, double& c) {
+    s = std::sin(angle);
+    c = std::cos(angle);
+}
+
+// The angles 2*pi*quadpoints[k], ..., 2*pi*quadpoints[k+harmonic_size-1].
+// Lanes beyond the last quadrature point are set to zero.
+template<class Array>
+inline harmonic_t quadpoint_angles(const Array& quadpoints, int k) {
+    harmonic_t angle(0.);
+#if defined(USE_XSIMD)
+    int numquadpoints = quadpoints.size();
+    for (int l = 0; l < harmonic_size; ++l) {
+        if(k + l >= numquadpoints)
+            break;
+        angle[l] = 2 * M_PI * quadpoints[k+l];
+    }
+#else
+    angle = 2 * M_PI * quadpoints[k];
+#endif
+    return angle;
+}
+
+// Iterates over j = 0, 1, 2, ... and provides cos(j*angle) and sin(j*angle).
+template<class T>
+class Harmonics {
+    private:
+        T angle;
+        T sin1, cos1;
+        T s, c;
+        int j = 0;
+    public:
+        Harmonics(const T& angle) : angle(angle), s(0.), c(1.) {
+            harmonic_sincos(angle, sin1, cos1);
+        }
+
+        inline const T& sin() const { return s; }
+        inline const T& cos() const { return c; }
+
+        inline void next() {
+            ++j;
+            if(j % ANGLE_RECOMPUTE == 0) {
+                harmonic_sincos(double(j) * angle, s, c);
+            } else {
+                T s_old = s;
+                T c_old = c;
+                s = cos1 * s_old + c_old * sin1;
+                c = c_old * cos1 - s_old * sin1;
+            }
+        }
+};
+
+// Fills cosines[j] = cos(j*angle) and sines[j] = sin(j*angle) for j = 0, ..., n.
+inline void fill_harmonics(double angle, int n, double* cosines, double* sines) {
+    Harmonics<double> h(angle);
+    for (int j = 0; j <= n; ++j, h.next()) {
+        cosines[j] = h.cos();
+        sines[j] = h.sin();
+    }
+}
@@ -143,6 +143,7 @@ class MagneticField {
         CachedTensor<T, 3> data_dB, data_dA;
         CachedTensor<T, 4> data_ddB, data_ddA;
         int npoints;
+        Tensor2 single_point = Tensor2({{0., 0., 0.}});
 
     public:
         MagneticField() {
@@ -193,6 +194,37 @@ class MagneticField {
             return set_points_cart(p);
         }
 
+        // Returns a field that evaluates to the same values as this one, but
+        // has its own cache, so that the two can be evaluated concurrently on
+        // different threads. Expensive data such as interpolation tables is
+        // shared. Fields that do not support this return nullptr.
+        virtual shared_ptr<MagneticField<T>> thread_copy() {
+            return nullptr;
+        }
+
+        // Evaluates B and, unless GradAbsB is null, the gradient of |B| at the
+        // single point (x, y, z), writing three values each. This is used by
+        // the right hand sides in tracing, so fields that can evaluate a point
+        // cheaply override it to skip the cache and avoid any allocation. The
+        // default implementation goes through set_points_cyl, so it changes
+        // the points of the field.
+        virtual void evaluate_point(double x, double y, double z, double* B, double* GradAbsB) {
+            single_point(0, 0) = std::sqrt(x*x+y*y);
+            single_point(0, 1) = std::atan2(y, x);
+            if(single_point(0, 1) < 0)
+                single_point(0, 1) += 2*M_PI;
+            single_point(0, 2) = z;
+            this->set_points_cyl(single_point);
+            Tensor2& B_ = this->B_ref();
+            for (int l = 0; l < 3; ++l)
+                B[l] = B_(0, l);
+            if(GradAbsB) {
+                Tensor2& GradAbsB_ = this->GradAbsB_ref();
+                for (int l = 0; l < 3; ++l)
+                    GradAbsB[l] = GradAbsB_(0, l);
+            }
+        }
+
         Tensor2 get_points_cyl() {
             return get_points_cyl_ref();
         }
@@ -277,6 +309,20 @@ class MagneticField {
             return data_GradAbsBcyl.get_or_create_and_fill({npoints, 3}, [this](Tensor2& GradAbsB_cyl) { return _GradAbsB_cyl_impl(GradAbsB_cyl);});
         }
 
+        // As the _ref methods, but the array is marked as shared, so that the
+        // field writes its next values to a new array instead of overwriting
+        // this one, see CachedTensor::exported. These are exposed to python
+        // as read only arrays that don't copy the cache.
+        Tensor2& get_points_cart_view() { get_points_cart_ref(); return points_cart.exported(); }
+        Tensor2& B_view() { B_ref(); return data_B.exported(); }
+        Tensor3& dB_by_dX_view() { dB_by_dX_ref(); return data_dB.exported(); }
+        Tensor4& d2B_by_dXdX_view() { d2B_by_dXdX_ref(); return data_ddB.exported(); }
+        Tensor2& A_view() { A_ref(); return data_A.exported(); }
+        Tensor3& dA_by_dX_view() { dA_by_dX_ref(); return data_dA.exported(); }
+        Tensor2& AbsB_view() { AbsB_ref(); return data_AbsB.exported(); }
+        Tensor2& GradAbsB_view() { GradAbsB_ref(); return data_GradAbsB.exported(); }
+        Tensor2& B_cyl_view() { B_cyl_ref(); return data_Bcyl.exported(); }
+
 };
 
 
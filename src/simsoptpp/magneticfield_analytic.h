@@ -0,0 +1,113 @@
+#pragma once
+
+#include "magneticfield.h"
+#include "dommaschk.h"
+#include "reiman.h"
+
+// Base class for fields that are given by a formula that can be evaluated at
+// any point. Subclasses implement evaluate, which computes B and its gradient
+// at a set of points. evaluate_point uses it directly for a single point, so
+// tracing in these fields never touches the cache or Python.
+template<template<class, std::size_t, xt::layout_type> class T>
+class AnalyticMagneticField : public MagneticField<T> {
+    public:
+        using typename MagneticField<T>::Tensor2;
+        using typename MagneticField<T>::Tensor3;
+
+    protected:
+        // writes B and dB(i, k, l) = dB_l/dx_k at the row-major (npoints, 3)
+        // array of points to B and dB, either of which may be null
+        virtual void evaluate(const double* points, int npoints, double* B, double* dB) const = 0;
+
+        void _B_impl(Tensor2& B) override {
+            evaluate(this->get_points_cart_ref().data(), this->npoints, B.data(), nullptr);
+        }
+
+        void _dB_by_dX_impl(Tensor3& dB) override {
+            evaluate(this->get_points_cart_ref().data(), this->npoints, nullptr, dB.data());
+        }
+
+    public:
+        void evaluate_point(double x, double y, double z, double* B, double* GradAbsB) override {
+            double xyz[3] = {x, y, z};
+            if(!GradAbsB) {
+                evaluate(xyz, 1, B, nullptr);
+                return;
+            }
+            double dB[9];
+            evaluate(xyz, 1, B, dB);
+            double AbsB = std::sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+            for (int k = 0; k < 3; ++k)
+                GradAbsB[k] = (B[0]*dB[3*k+0] + B[1]*dB[3*k+1] + B[2]*dB[3*k+2])/AbsB;
+        }
+};
+
+// The field of the Dommaschk potentials, see DommaschkField, plus the
+// toroidal field 1/R e_phi.
+template<template<class, std::size_t, xt::layout_type> class T>
+class DommaschkMagneticField : public AnalyticMagneticField<T> {
+    private:
+        shared_ptr<const DommaschkField> potentials;
+
+    protected:
+        void evaluate(const double* points, int npoints, double* B, double* dB) const override {
+            if(B)
+                potentials->B(points, npoints, B);
+            if(dB)
+                potentials->dB(points, npoints, dB);
+            for (int i = 0; i < npoints; ++i) {
+                double x = points[3*i+0];
+                double y = points[3*i+1];
+                double R2 = x*x + y*y;
+                if(B) {
+                    B[3*i+0] -= y/R2;
+                    B[3*i+1] += x/R2;
+                }
+                if(dB) {
+                    double R4 = R2*R2;
+                    dB[9*i+0] += 2*x*y/R4;
+                    dB[9*i+1] += (y*y - x*x)/R4;
+                    dB[9*i+3] += (y*y - x*x)/R4;
+                    dB[9*i+4] -= 2*x*y/R4;
+                }
+            }
+        }
+
+    public:
+        DommaschkMagneticField(Array& m, Array& n, Array& coeffs) :
+            AnalyticMagneticField<T>(), potentials(make_shared<DommaschkField>(m, n, coeffs)) { }
+
+        DommaschkMagneticField(shared_ptr<const DommaschkField> potentials) :
+            AnalyticMagneticField<T>(), potentials(potentials) { }
+
+        shared_ptr<MagneticField<T>> thread_copy() override {
+            return make_shared<DommaschkMagneticField<T>>(potentials);
+        }
+};
+
+// The field of Reiman and Greenside, see reiman_B.
+template<template<class, std::size_t, xt::layout_type> class T>
+class ReimanMagneticField : public AnalyticMagneticField<T> {
+    protected:
+        void evaluate(const double* points, int npoints, double* B, double* dB) const override {
+            if(B)
+                reiman_B(iota0, iota1, k_theta, epsilon, m0_symmetry, points, npoints, B);
+            if(dB)
+                reiman_dB(iota0, iota1, k_theta, epsilon, m0_symmetry, points, npoints, dB);
+        }
+
+    public:
+        const double iota0, iota1;
+        const vector<double> k_theta, epsilon;
+        const int m0_symmetry;
+
+        ReimanMagneticField(double iota0, double iota1, vector<double> k_theta, vector<double> epsilon, int m0_symmetry) :
+            AnalyticMagneticField<T>(), iota0(iota0), iota1(iota1), k_theta(k_theta), epsilon(epsilon), m0_symmetry(m0_symmetry) {
+            if(k_theta.size() != epsilon.size())
+                throw std::invalid_argument("k_theta and epsilon need to have the same length.");
+        }
+
+        shared_ptr<MagneticField<T>> thread_copy() override {
+            return make_shared<ReimanMagneticField<T>>(iota0, iota1, k_theta, epsilon, m0_symmetry);
+        }
+};
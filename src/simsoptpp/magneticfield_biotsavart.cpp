@@ -1,89 +1,338 @@
 #include "magneticfield_biotsavart.h"
 #include "biot_savart_impl.h"
+#include "biot_savart_treecode.h"
+#include "biot_savart_mixed_impl.h"
+#include "biot_savart_vjp_impl.h"
+#include "biot_savart_soa_impl.h"
+#include "scratch.h"
+#include "perf_counters.h"
+#include "gil.h"
 #include <fmt/core.h>
 #include <fmt/format.h>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <limits>
+#include <cmath>
 
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+inline int biot_savart_num_threads() {
+#if defined(_OPENMP)
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+inline int biot_savart_thread_num() {
+#if defined(_OPENMP)
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+// Number of points per (coil, point-chunk) tile in BiotSavart::compute. The
+// per coil output written by one tile should fit into the L2 cache, and there
+// should be enough tiles to keep all threads busy, even when there are fewer
+// coils than threads. Chunks are a multiple of the simd size, since the
+// kernels require aligned start indices.
+int biot_savart_chunk_size(int npoints, int ncoils, int derivatives) {
+#if defined(USE_XSIMD)
+    constexpr int simd_size = xsimd::simd_type<double>::size;
+#else
+    constexpr int simd_size = 1;
+#endif
+    constexpr int l2_cache_bytes = 256*1024;
+    constexpr int min_chunk = 8*simd_size;
+    int doubles_per_point = 6 + (derivatives >= 1 ? 9 : 0) + (derivatives >= 2 ? 27 : 0);
+    int chunk = l2_cache_bytes/(doubles_per_point*sizeof(double));
+    int nthreads = biot_savart_num_threads();
+    // aim for about four tiles per thread to allow for load balancing
+    // there may be no coils at all, e.g. for BiotSavart([])
+    ncoils = std::max(ncoils, 1);
+    int target_chunks_per_coil = (4*nthreads + ncoils - 1)/ncoils;
+    chunk = std::min(chunk, (npoints + target_chunks_per_coil - 1)/target_chunks_per_coil);
+    chunk = std::max(chunk, min_chunk);
+    return ((chunk + simd_size - 1)/simd_size)*simd_size;
+}
+
+// The treecode trees of the given coils, or nullptr for the other coils and
+// if the treecode is not used (theta == 0). A tree only depends on the coil,
+// so it is built once per evaluation and shared by all tiles of that coil.
 template<class Array>
-void set_array_to_zero(Array& data){
-    std::fill(data.begin(), data.end(), 0.);
+vector<std::unique_ptr<biot_savart_treecode::Tree>> biot_savart_trees(const ScratchBuffer<Array*>& gammas, const ScratchBuffer<Array*>& gammadashs,
+        const vector<int>& coils, double theta, int leafsize) {
+    vector<std::unique_ptr<biot_savart_treecode::Tree>> trees(gammas.size());
+    if(theta == 0.)
+        return trees;
+    for (int i : coils)
+        trees[i] = std::make_unique<biot_savart_treecode::Tree>(biot_savart_treecode_tree(*gammas[i], *gammadashs[i], leafsize));
+    return trees;
 }
 
+// Evaluates the field (or the potential, if `vector_potential` is true) of
+// one coil at the points [start, end). If `tree` is not null, the treecode
+// approximation with opening parameter `theta` is used.
+template<class Array, bool vector_potential, int derivs>
+void biot_savart_tile_impl(AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+        Array& gamma, Array& gammadash, Array& F, Array& dF, Array& ddF, const biot_savart_treecode::Tree* tree, double theta, bool mixed_precision, int start, int end) {
+    if(tree) {
+        int num_quad_points = gamma.shape(0);
+        if constexpr(vector_potential)
+            biot_savart_treecode_kernel_A<Array, derivs>(pointsx, pointsy, pointsz, *tree, num_quad_points, F, dF, ddF, theta, start, end);
+        else
+            biot_savart_treecode_kernel<Array, derivs>(pointsx, pointsy, pointsz, *tree, num_quad_points, F, dF, ddF, theta, start, end);
+    } else if(mixed_precision) {
+        if constexpr(vector_potential)
+            biot_savart_kernel_A_mixed<Array, derivs>(pointsx, pointsy, pointsz, gamma, gammadash, F, dF, ddF, start, end);
+        else
+            biot_savart_kernel_mixed<Array, derivs>(pointsx, pointsy, pointsz, gamma, gammadash, F, dF, ddF, start, end);
+    } else {
+        if constexpr(vector_potential)
+            biot_savart_kernel_A<Array, derivs>(pointsx, pointsy, pointsz, gamma, gammadash, F, dF, ddF, start, end);
+        else
+            biot_savart_kernel<Array, derivs>(pointsx, pointsy, pointsz, gamma, gammadash, F, dF, ddF, start, end);
+    }
+}
+
+template<class Array, bool vector_potential>
+void biot_savart_tile(int derivatives, AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+        Array& gamma, Array& gammadash, Array& F, Array& dF, Array& ddF, const biot_savart_treecode::Tree* tree, double theta, bool mixed_precision, int start, int end) {
+    if(derivatives == 0)
+        biot_savart_tile_impl<Array, vector_potential, 0>(pointsx, pointsy, pointsz, gamma, gammadash, F, dF, ddF, tree, theta, mixed_precision, start, end);
+    else if(derivatives == 1)
+        biot_savart_tile_impl<Array, vector_potential, 1>(pointsx, pointsy, pointsz, gamma, gammadash, F, dF, ddF, tree, theta, mixed_precision, start, end);
+    else
+        biot_savart_tile_impl<Array, vector_potential, 2>(pointsx, pointsy, pointsz, gamma, gammadash, F, dF, ddF, tree, theta, mixed_precision, start, end);
+}
+
+template<class Array, int derivs_B>
+void biot_savart_fused_tile_B(int derivatives_A, AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+        Array& gamma, Array& gammadash, Array& B, Array& dB, Array& ddB, Array& A, Array& dA, Array& ddA, int start, int end) {
+    if(derivatives_A == 0)
+        biot_savart_kernel_BA<Array, derivs_B, 0>(pointsx, pointsy, pointsz, gamma, gammadash, B, dB, ddB, A, dA, ddA, start, end);
+    else if(derivatives_A == 1)
+        biot_savart_kernel_BA<Array, derivs_B, 1>(pointsx, pointsy, pointsz, gamma, gammadash, B, dB, ddB, A, dA, ddA, start, end);
+    else
+        biot_savart_kernel_BA<Array, derivs_B, 2>(pointsx, pointsy, pointsz, gamma, gammadash, B, dB, ddB, A, dA, ddA, start, end);
+}
+
+// Evaluates the field and the potential of one coil at the points [start, end).
+template<class Array>
+void biot_savart_fused_tile(int derivatives_B, int derivatives_A, AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+        Array& gamma, Array& gammadash, Array& B, Array& dB, Array& ddB, Array& A, Array& dA, Array& ddA, int start, int end) {
+    if(derivatives_B == 0)
+        biot_savart_fused_tile_B<Array, 0>(derivatives_A, pointsx, pointsy, pointsz, gamma, gammadash, B, dB, ddB, A, dA, ddA, start, end);
+    else if(derivatives_B == 1)
+        biot_savart_fused_tile_B<Array, 1>(derivatives_A, pointsx, pointsy, pointsz, gamma, gammadash, B, dB, ddB, A, dA, ddA, start, end);
+    else
+        biot_savart_fused_tile_B<Array, 2>(derivatives_A, pointsx, pointsy, pointsz, gamma, gammadash, B, dB, ddB, A, dA, ddA, start, end);
+}
+
+// Hierarchy of coarsened quadratures of a closed curve for the distance
+// adaptive evaluation. Level l uses every 2^l-th quadrature point, i.e. the
+// trapezoidal rule with a 2^l times larger step. For a target at distance d
+// from the curve, the error of level l decays like exp(-2 pi d / h_l), where
+// h_l is the largest distance between consecutive points on that level.
+template<class Array>
+struct QuadratureHierarchy {
+    Array* gamma;
+    Array* gammadash;
+    vector<Array> coarse_gammas, coarse_gammadashs;
+    vector<double> spacings;
+    double lower[3], upper[3];
+
+    QuadratureHierarchy(Array& gamma, Array& gammadash, int min_quadpoints=32) : gamma(&gamma), gammadash(&gammadash) {
+        int n = gamma.shape(0);
+        for (int l = 0; l < 3; ++l) {
+            lower[l] = std::numeric_limits<double>::infinity();
+            upper[l] = -std::numeric_limits<double>::infinity();
+        }
+        for (int j = 0; j < n; ++j) {
+            for (int l = 0; l < 3; ++l) {
+                lower[l] = std::min(lower[l], gamma(j, l));
+                upper[l] = std::max(upper[l], gamma(j, l));
+            }
+        }
+        for (int step = 1; n % step == 0 && n/step >= min_quadpoints; step *= 2) {
+            int m = n/step;
+            double h = 0.;
+            for (int j = 0; j < n; j += step) {
+                int k = (j + step) % n;
+                double d2 = 0.;
+                for (int l = 0; l < 3; ++l)
+                    d2 += (gamma(k, l) - gamma(j, l))*(gamma(k, l) - gamma(j, l));
+                h = std::max(h, std::sqrt(d2));
+            }
+            spacings.push_back(h);
+            if(step == 1)
+                continue;
+            Array g = xt::zeros<double>({m, 3});
+            Array gd = xt::zeros<double>({m, 3});
+            for (int j = 0; j < m; ++j) {
+                for (int l = 0; l < 3; ++l) {
+                    g(j, l) = gamma(j*step, l);
+                    gd(j, l) = gammadash(j*step, l);
+                }
+            }
+            coarse_gammas.push_back(g);
+            coarse_gammadashs.push_back(gd);
+        }
+    }
+
+    int num_levels() const { return spacings.size(); }
+    Array& gamma_on(int level) { return level == 0 ? *gamma : coarse_gammas[level-1]; }
+    Array& gammadash_on(int level) { return level == 0 ? *gammadash : coarse_gammadashs[level-1]; }
+
+    // Coarsest level that satisfies dist >= eta * h_level.
+    int level_for(double dist, double eta) const {
+        for (int level = num_levels() - 1; level > 0; --level)
+            if(dist >= eta * spacings[level])
+                return level;
+        return 0;
+    }
+};
+
+// Same as biot_savart_tile, but the points are split into blocks and each
+// block is evaluated with the coarsest quadrature of the coil that is
+// admissible for the distance between the bounding boxes of the block and of
+// the coil.
+template<class Array, bool vector_potential>
+void biot_savart_tile_adaptive(int derivatives, AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz,
+        QuadratureHierarchy<Array>& quadrature, Array& F, Array& dF, Array& ddF, double eta, bool mixed_precision, int start, int end) {
+    constexpr int block_size = 32;
+    for (int bstart = start; bstart < end; bstart += block_size) {
+        int bend = std::min(bstart + block_size, end);
+        double d2 = 0.;
+        double* coords[3] = {pointsx.data(), pointsy.data(), pointsz.data()};
+        for (int l = 0; l < 3; ++l) {
+            auto minmax = std::minmax_element(coords[l] + bstart, coords[l] + bend);
+            double gap = std::max({quadrature.lower[l] - *minmax.second, *minmax.first - quadrature.upper[l], 0.});
+            d2 += gap*gap;
+        }
+        int level = quadrature.level_for(std::sqrt(d2), eta);
+        biot_savart_tile<Array, vector_potential>(derivatives, pointsx, pointsy, pointsz,
+                quadrature.gamma_on(level), quadrature.gammadash_on(level),
+                F, dF, ddF, nullptr, 0., mixed_precision, bstart, bend);
+    }
+}
+
+// total = sum_i currents[i] * fields[i], parallelized over chunks of points.
+template<class Tensor, class Array>
+void sum_coil_contributions(Tensor& total, const ScratchBuffer<Array*>& fields, const ScratchBuffer<double>& currents, int npoints, int chunk) {
+    if(npoints == 0)
+        return;
+    int ncoils = fields.size();
+    int stride = total.size()/npoints;
+    int nchunks = (npoints + chunk - 1)/chunk;
+    double* total_ptr = total.data();
+    ReleaseGIL nogil;
+#pragma omp parallel for
+    for (int c = 0; c < nchunks; ++c) {
+        int start = c*chunk*stride;
+        int end = std::min((c+1)*chunk, npoints)*stride;
+        std::fill(total_ptr + start, total_ptr + end, 0.);
+        for (int i = 0; i < ncoils; ++i) {
+            double current = currents[i];
+            double* field_ptr = fields[i]->data();
+            for (int j = start; j < end; ++j)
+                total_ptr[j] += current * field_ptr[j];
+        }
+    }
+}
 
 template<template<class, std::size_t, xt::layout_type> class T, class Array>
 void BiotSavart<T, Array>::compute(int derivatives) {
     //fmt::print("Calling compute({})\n", derivatives);
-    auto points = this->get_points_cart_ref();
+    if(derivatives > 2)
+        throw logic_error("Only two derivatives of Biot Savart implemented");
+    SIMSOPT_PERF_SCOPE(biot_savart_B, npoints);
+    if(totals_only) {
+        compute_totals<false>(derivatives);
+        return;
+    }
+    auto& points = this->get_points_cart_ref();
     this->fill_points(points);
-    Array dummyjac = xt::zeros<double>({1, 1, 1});
-    Array dummyhess = xt::zeros<double>({1, 1, 1, 1});
-    Tensor3 _dummyjac = xt::zeros<double>({1, 1, 1});
-    Tensor4 _dummyhess = xt::zeros<double>({1, 1, 1, 1});
+    Array& dummyjac = placeholder_array<Array>(3);
+    Array& dummyhess = placeholder_array<Array>(4);
     int ncoils = this->coils.size();
     Tensor2& B = data_B.get_or_create({npoints, 3});
-    Tensor3& dB = derivatives >= 1 ? data_dB.get_or_create({npoints, 3, 3}) : _dummyjac;
-    Tensor4& ddB = derivatives >= 2 ? data_ddB.get_or_create({npoints, 3, 3, 3}) : _dummyhess;
+    // only the coils whose curve has changed need to be evaluated again
+    vector<int> stale = stale_coils(COIL_B, derivatives);
+    int nstale = stale.size();
 
-    set_array_to_zero(B);
-    set_array_to_zero(dB);
-    set_array_to_zero(ddB);
-
-    std::vector<double> currents(ncoils, 0.);
     // Creating new xtensor arrays from an openmp thread doesn't appear
     // to be safe. so we do that here in serial.
+    // We also acquire all currents here. The reason for that is that some
+    // coils point at the same current in the background, and if the
+    // `get_value` function for that is implemented in python, then this will
+    // freeze in parallel.
+    ScratchBuffer<double> currents(ncoils, 0.);
+    ScratchBuffer<Array*> gammas(ncoils), gammadashs(ncoils);
+    ScratchBuffer<Array*> Bs(ncoils), dBs(ncoils, &dummyjac), ddBs(ncoils, &dummyhess);
     for (int i = 0; i < ncoils; ++i) {
-        this->coils[i]->curve->gamma();
-        this->coils[i]->curve->gammadash();
-        field_cache.get_or_create(fmt::format("B_{}", i), {npoints, 3});
+        gammas[i] = &(this->coils[i]->curve->gamma());
+        gammadashs[i] = &(this->coils[i]->curve->gammadash());
+        Bs[i] = &(coil_fields.get_or_create(COIL_B, i, {npoints, 3}));
         if(derivatives > 0)
-            field_cache.get_or_create(fmt::format("dB_{}", i), {npoints, 3, 3});
+            dBs[i] = &(coil_fields.get_or_create(COIL_dB, i, {npoints, 3, 3}));
         if(derivatives > 1)
-            field_cache.get_or_create(fmt::format("ddB_{}", i), {npoints, 3, 3, 3});
+            ddBs[i] = &(coil_fields.get_or_create(COIL_ddB, i, {npoints, 3, 3, 3}));
         currents[i] = this->coils[i]->current->get_value();
     }
 
-#pragma omp parallel for
-    for (int i = 0; i < ncoils; ++i) {
-        Array& Bi = field_cache.get_or_create(fmt::format("B_{}", i), {npoints, 3});
-        set_array_to_zero(Bi);
-        Array& gamma = this->coils[i]->curve->gamma();
-        Array& gammadash = this->coils[i]->curve->gammadash();
-        double current = currents[i];
-        if(derivatives == 0){
-            biot_savart_kernel<Array, 0>(pointsx, pointsy, pointsz, gamma, gammadash, Bi, dummyjac, dummyhess);
-        } else {
-            Array& dBi = field_cache.get_or_create(fmt::format("dB_{}", i), {npoints, 3, 3});
-            set_array_to_zero(dBi);
-            if(derivatives == 1) {
-                biot_savart_kernel<Array, 1>(pointsx, pointsy, pointsz, gamma, gammadash, Bi, dBi, dummyhess);
-            } else {
-                Array& ddBi = field_cache.get_or_create(fmt::format("ddB_{}", i), {npoints, 3, 3, 3});
-                set_array_to_zero(ddBi);
-                if (derivatives == 2) {
-                    biot_savart_kernel<Array, 2>(pointsx, pointsy, pointsz, gamma, gammadash, Bi, dBi, ddBi);
-                } else {
-                    throw logic_error("Only two derivatives of Biot Savart implemented");
-                }
-            }
+    int chunk = biot_savart_chunk_size(npoints, ncoils, derivatives);
+#if defined(SIMSOPT_WITH_CUDA)
+    if(biot_savart_cuda::enabled() && treecode_theta == 0.) {
+        if(!device_state)
+            device_state = std::make_unique<biot_savart_cuda::DeviceState>();
+        for (int i : stale) {
+            device_state->B(i, points.data(), npoints, gammas[i]->data(), gammadashs[i]->data(), gammas[i]->shape(0),
+                    derivatives, Bs[i]->data(), dBs[i]->data(), ddBs[i]->data());
+        }
+    } else
+#endif
+    {
+        // The work is split into (coil, point-chunk) tiles, so that we can use
+        // more threads than there are coils. Each tile writes to a disjoint part
+        // of the per coil field, hence no synchronization is required.
+        int tile_chunk = biot_savart_chunk_size(npoints, std::max(nstale, 1), derivatives);
+        int nchunks = (npoints + tile_chunk - 1)/tile_chunk;
+        bool adaptive = adaptive_eta > 0. && treecode_theta == 0.;
+        vector<QuadratureHierarchy<Array>> quadratures;
+        for (int i = 0; adaptive && i < ncoils; ++i)
+            quadratures.emplace_back(*gammas[i], *gammadashs[i]);
+        auto trees = biot_savart_trees(gammas, gammadashs, stale, treecode_theta, treecode_leafsize);
+        ReleaseGIL nogil;
+#pragma omp parallel for schedule(dynamic)
+        for (int tile = 0; tile < nstale*nchunks; ++tile) {
+            int i = stale[tile / nchunks];
+            int start = (tile % nchunks) * tile_chunk;
+            int end = std::min(start + tile_chunk, npoints);
+            if(adaptive)
+                biot_savart_tile_adaptive<Array, false>(derivatives, pointsx, pointsy, pointsz, quadratures[i],
+                        *Bs[i], *dBs[i], *ddBs[i], adaptive_eta, mixed_precision, start, end);
+            else
+                biot_savart_tile<Array, false>(derivatives, pointsx, pointsy, pointsz, *gammas[i], *gammadashs[i],
+                        *Bs[i], *dBs[i], *ddBs[i], trees[i].get(), treecode_theta, mixed_precision, start, end);
         }
     }
-    for (int i = 0; i < ncoils; ++i) {
-        Array& Bi = field_cache.get_or_create(fmt::format("B_{}", i), {npoints, 3});
-        double current = this->coils[i]->current->get_value();
-        xt::noalias(B) = B + current * Bi;
-    }
+    mark_coils_current(COIL_B, derivatives, stale);
+
+    sum_coil_contributions(B, Bs, currents, npoints, chunk);
     if(derivatives>=1) {
-        for (int i = 0; i < ncoils; ++i) {
-            Array& dBi = field_cache.get_or_create(fmt::format("dB_{}", i), {npoints, 3, 3});
-            double current = this->coils[i]->current->get_value();
-            xt::noalias(dB) = dB + current * dBi;
-        }
+        Tensor3& dB = data_dB.get_or_create({npoints, 3, 3});
+        sum_coil_contributions(dB, dBs, currents, npoints, chunk);
     }
     if(derivatives>=2) {
-        for (int i = 0; i < ncoils; ++i) {
-            Array& ddBi = field_cache.get_or_create(fmt::format("ddB_{}", i), {npoints, 3, 3, 3});
-            double current = this->coils[i]->current->get_value();
-            xt::noalias(ddB) = ddB + current * ddBi;
-        }
+        Tensor4& ddB = data_ddB.get_or_create({npoints, 3, 3, 3});
+        sum_coil_contributions(ddB, ddBs, currents, npoints, chunk);
     }
 }
 
@@ -91,20 +340,21 @@ void BiotSavart<T, Array>::compute(int derivatives) {
 template<template<class, std::size_t, xt::layout_type> class T, class Array>
 void BiotSavart<T, Array>::compute_A(int derivatives) {
     //fmt::print("Calling compute({})\n", derivatives);
-    auto points = this->get_points_cart_ref();
+    if(derivatives > 2)
+        throw logic_error("Only two derivatives of Biot Savart vector potential implemented");
+    SIMSOPT_PERF_SCOPE(biot_savart_A, npoints);
+    if(totals_only) {
+        compute_totals<true>(derivatives);
+        return;
+    }
+    auto& points = this->get_points_cart_ref();
     this->fill_points(points);
-    Array dummyjac = xt::zeros<double>({1, 1, 1});
-    Array dummyhess = xt::zeros<double>({1, 1, 1, 1});
-    Tensor3 _dummyjac = xt::zeros<double>({1, 1, 1});
-    Tensor4 _dummyhess = xt::zeros<double>({1, 1, 1, 1});
+    Array& dummyjac = placeholder_array<Array>(3);
+    Array& dummyhess = placeholder_array<Array>(4);
     int ncoils = this->coils.size();
     Tensor2& A = data_A.get_or_create({npoints, 3});
-    Tensor3& dA = derivatives >= 1 ? data_dA.get_or_create({npoints, 3, 3}) : _dummyjac;
-    Tensor4& ddA = derivatives >= 2 ? data_ddA.get_or_create({npoints, 3, 3, 3}) : _dummyhess;
-
-    set_array_to_zero(A);
-    set_array_to_zero(dA);
-    set_array_to_zero(ddA);
+    vector<int> stale = stale_coils(COIL_A, derivatives);
+    int nstale = stale.size();
 
     // Creating new xtensor arrays from an openmp thread doesn't appear
     // to be safe. so we do that here in serial.
@@ -112,62 +362,939 @@ void BiotSavart<T, Array>::compute_A(int derivatives) {
     // coils point at the same current in the background, and if the
     // `get_value` function for that is implemented in python, then this will
     // freeze in parallel.
-    std::vector<double> currents(ncoils, 0.);
+    ScratchBuffer<double> currents(ncoils, 0.);
+    ScratchBuffer<Array*> gammas(ncoils), gammadashs(ncoils);
+    ScratchBuffer<Array*> As(ncoils), dAs(ncoils, &dummyjac), ddAs(ncoils, &dummyhess);
     for (int i = 0; i < ncoils; ++i) {
-        this->coils[i]->curve->gamma();
-        this->coils[i]->curve->gammadash();
-        field_cache.get_or_create(fmt::format("A_{}", i), {npoints, 3});
+        gammas[i] = &(this->coils[i]->curve->gamma());
+        gammadashs[i] = &(this->coils[i]->curve->gammadash());
+        As[i] = &(coil_fields.get_or_create(COIL_A, i, {npoints, 3}));
         if(derivatives > 0)
-            field_cache.get_or_create(fmt::format("dA_{}", i), {npoints, 3, 3});
+            dAs[i] = &(coil_fields.get_or_create(COIL_dA, i, {npoints, 3, 3}));
         if(derivatives > 1)
-            field_cache.get_or_create(fmt::format("ddA_{}", i), {npoints, 3, 3, 3});
+            ddAs[i] = &(coil_fields.get_or_create(COIL_ddA, i, {npoints, 3, 3, 3}));
+        currents[i] = this->coils[i]->current->get_value();
+    }
+
+    int chunk = biot_savart_chunk_size(npoints, ncoils, derivatives);
+    int tile_chunk = biot_savart_chunk_size(npoints, std::max(nstale, 1), derivatives);
+    int nchunks = (npoints + tile_chunk - 1)/tile_chunk;
+    bool adaptive = adaptive_eta > 0. && treecode_theta == 0.;
+    vector<QuadratureHierarchy<Array>> quadratures;
+    for (int i = 0; adaptive && i < ncoils; ++i)
+        quadratures.emplace_back(*gammas[i], *gammadashs[i]);
+    auto trees = biot_savart_trees(gammas, gammadashs, stale, treecode_theta, treecode_leafsize);
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < nstale*nchunks; ++tile) {
+        int i = stale[tile / nchunks];
+        int start = (tile % nchunks) * tile_chunk;
+        int end = std::min(start + tile_chunk, npoints);
+        if(adaptive)
+            biot_savart_tile_adaptive<Array, true>(derivatives, pointsx, pointsy, pointsz, quadratures[i],
+                    *As[i], *dAs[i], *ddAs[i], adaptive_eta, mixed_precision, start, end);
+        else
+            biot_savart_tile<Array, true>(derivatives, pointsx, pointsy, pointsz, *gammas[i], *gammadashs[i],
+                    *As[i], *dAs[i], *ddAs[i], trees[i].get(), treecode_theta, mixed_precision, start, end);
+    }
+    nogil.reacquire();
+    mark_coils_current(COIL_A, derivatives, stale);
+
+    sum_coil_contributions(A, As, currents, npoints, chunk);
+    if(derivatives>=1) {
+        Tensor3& dA = data_dA.get_or_create({npoints, 3, 3});
+        sum_coil_contributions(dA, dAs, currents, npoints, chunk);
+    }
+    if(derivatives>=2) {
+        Tensor4& ddA = data_ddA.get_or_create({npoints, 3, 3, 3});
+        sum_coil_contributions(ddA, ddAs, currents, npoints, chunk);
+    }
+}
+
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+void BiotSavart<T, Array>::compute_all(int derivatives_B, int derivatives_A) {
+    if(derivatives_B > 2 || derivatives_A > 2)
+        throw logic_error("Only two derivatives of Biot Savart implemented");
+    bool gpu = false;
+#if defined(SIMSOPT_WITH_CUDA)
+    gpu = biot_savart_cuda::enabled();
+#endif
+    // the fused kernel is only implemented for the direct sum in double
+    // precision with all quadrature points, storing the per coil fields
+    if(treecode_theta > 0. || mixed_precision || gpu || totals_only || adaptive_eta > 0.) {
+        compute(derivatives_B);
+        compute_A(derivatives_A);
+        return;
+    }
+    auto& points = this->get_points_cart_ref();
+    this->fill_points(points);
+    Array& dummyjac = placeholder_array<Array>(3);
+    Array& dummyhess = placeholder_array<Array>(4);
+    int ncoils = this->coils.size();
+    Tensor2& B = data_B.get_or_create({npoints, 3});
+    Tensor2& A = data_A.get_or_create({npoints, 3});
+    // a coil is evaluated again if either its field or its potential is out of date
+    vector<int> stale_B = stale_coils(COIL_B, derivatives_B);
+    vector<int> stale_A = stale_coils(COIL_A, derivatives_A);
+    vector<int> stale;
+    std::set_union(stale_B.begin(), stale_B.end(), stale_A.begin(), stale_A.end(), std::back_inserter(stale));
+    int nstale = stale.size();
+
+    // See compute() for why this is done in serial.
+    ScratchBuffer<double> currents(ncoils, 0.);
+    ScratchBuffer<Array*> gammas(ncoils), gammadashs(ncoils);
+    ScratchBuffer<Array*> Bs(ncoils), dBs(ncoils, &dummyjac), ddBs(ncoils, &dummyhess);
+    ScratchBuffer<Array*> As(ncoils), dAs(ncoils, &dummyjac), ddAs(ncoils, &dummyhess);
+    for (int i = 0; i < ncoils; ++i) {
+        gammas[i] = &(this->coils[i]->curve->gamma());
+        gammadashs[i] = &(this->coils[i]->curve->gammadash());
+        Bs[i] = &(coil_fields.get_or_create(COIL_B, i, {npoints, 3}));
+        As[i] = &(coil_fields.get_or_create(COIL_A, i, {npoints, 3}));
+        if(derivatives_B > 0)
+            dBs[i] = &(coil_fields.get_or_create(COIL_dB, i, {npoints, 3, 3}));
+        if(derivatives_B > 1)
+            ddBs[i] = &(coil_fields.get_or_create(COIL_ddB, i, {npoints, 3, 3, 3}));
+        if(derivatives_A > 0)
+            dAs[i] = &(coil_fields.get_or_create(COIL_dA, i, {npoints, 3, 3}));
+        if(derivatives_A > 1)
+            ddAs[i] = &(coil_fields.get_or_create(COIL_ddA, i, {npoints, 3, 3, 3}));
         currents[i] = this->coils[i]->current->get_value();
     }
 
+    int chunk = biot_savart_chunk_size(npoints, ncoils, std::max(derivatives_B, derivatives_A));
+    int tile_chunk = biot_savart_chunk_size(npoints, std::max(nstale, 1), std::max(derivatives_B, derivatives_A));
+    int nchunks = (npoints + tile_chunk - 1)/tile_chunk;
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < nstale*nchunks; ++tile) {
+        int i = stale[tile / nchunks];
+        int start = (tile % nchunks) * tile_chunk;
+        int end = std::min(start + tile_chunk, npoints);
+        biot_savart_fused_tile<Array>(derivatives_B, derivatives_A, pointsx, pointsy, pointsz, *gammas[i], *gammadashs[i],
+                *Bs[i], *dBs[i], *ddBs[i], *As[i], *dAs[i], *ddAs[i], start, end);
+    }
+    nogil.reacquire();
+    mark_coils_current(COIL_B, derivatives_B, stale);
+    mark_coils_current(COIL_A, derivatives_A, stale);
+
+    sum_coil_contributions(B, Bs, currents, npoints, chunk);
+    sum_coil_contributions(A, As, currents, npoints, chunk);
+    if(derivatives_B>=1) {
+        Tensor3& dB = data_dB.get_or_create({npoints, 3, 3});
+        sum_coil_contributions(dB, dBs, currents, npoints, chunk);
+    }
+    if(derivatives_B>=2) {
+        Tensor4& ddB = data_ddB.get_or_create({npoints, 3, 3, 3});
+        sum_coil_contributions(ddB, ddBs, currents, npoints, chunk);
+    }
+    if(derivatives_A>=1) {
+        Tensor3& dA = data_dA.get_or_create({npoints, 3, 3});
+        sum_coil_contributions(dA, dAs, currents, npoints, chunk);
+    }
+    if(derivatives_A>=2) {
+        Tensor4& ddA = data_ddA.get_or_create({npoints, 3, 3, 3});
+        sum_coil_contributions(ddA, ddAs, currents, npoints, chunk);
+    }
+}
+
+// F = sum_i currents[i] * F_i on the points (pointsx, pointsy, pointsz)[:npoints],
+// where F_i is the field (or the potential) of coil i. dF and ddF are only
+// written if derivatives > 0 resp. > 1. Each task owns a chunk of the points
+// and loops over all coils: the field of one coil on the chunk is written to
+// a per thread scratch buffer and is then added to the total, so no per coil
+// fields are kept.
+template<class Array, bool vector_potential>
+void biot_savart_accumulate(int derivatives, AlignedPaddedVec& pointsx, AlignedPaddedVec& pointsy, AlignedPaddedVec& pointsz, int npoints,
+        const ScratchBuffer<Array*>& gammas, const ScratchBuffer<Array*>& gammadashs, const ScratchBuffer<double>& currents,
+        double* F_ptr, double* dF_ptr, double* ddF_ptr, double theta, int leafsize, bool mixed_precision) {
+    int ncoils = gammas.size();
+    Array& dummyjac = placeholder_array<Array>(3);
+    Array& dummyhess = placeholder_array<Array>(4);
+    int chunk = biot_savart_chunk_size(npoints, 1, derivatives);
+    int nchunks = (npoints + chunk - 1)/chunk;
+    int nthreads = biot_savart_num_threads();
+    std::vector<AlignedPaddedVec> px(nthreads, AlignedPaddedVec(chunk, 0.));
+    std::vector<AlignedPaddedVec> py(nthreads, AlignedPaddedVec(chunk, 0.));
+    std::vector<AlignedPaddedVec> pz(nthreads, AlignedPaddedVec(chunk, 0.));
+    std::vector<Array> tmpF, tmpdF, tmpddF;
+    for (int t = 0; t < nthreads; ++t) {
+        tmpF.push_back(xt::zeros<double>({chunk, 3}));
+        tmpdF.push_back(derivatives > 0 ? Array(xt::zeros<double>({chunk, 3, 3})) : dummyjac);
+        tmpddF.push_back(derivatives > 1 ? Array(xt::zeros<double>({chunk, 3, 3, 3})) : dummyhess);
+    }
+    vector<int> all_coils(ncoils);
+    std::iota(all_coils.begin(), all_coils.end(), 0);
+    auto trees = biot_savart_trees(gammas, gammadashs, all_coils, theta, leafsize);
+
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < nchunks; ++c) {
+        int t = biot_savart_thread_num();
+        int start = c*chunk;
+        int m = std::min(start + chunk, npoints) - start;
+        std::copy(pointsx.begin() + start, pointsx.begin() + start + m, px[t].begin());
+        std::copy(pointsy.begin() + start, pointsy.begin() + start + m, py[t].begin());
+        std::copy(pointsz.begin() + start, pointsz.begin() + start + m, pz[t].begin());
+        std::fill(F_ptr + 3*start, F_ptr + 3*(start+m), 0.);
+        if(derivatives > 0)
+            std::fill(dF_ptr + 9*start, dF_ptr + 9*(start+m), 0.);
+        if(derivatives > 1)
+            std::fill(ddF_ptr + 27*start, ddF_ptr + 27*(start+m), 0.);
+        for (int i = 0; i < ncoils; ++i) {
+            biot_savart_tile<Array, vector_potential>(derivatives, px[t], py[t], pz[t], *gammas[i], *gammadashs[i],
+                    tmpF[t], tmpdF[t], tmpddF[t], trees[i].get(), theta, mixed_precision, 0, m);
+            double current = currents[i];
+            const double* f = tmpF[t].data();
+            for (int j = 0; j < 3*m; ++j)
+                F_ptr[3*start + j] += current * f[j];
+            if(derivatives > 0) {
+                const double* df = tmpdF[t].data();
+                for (int j = 0; j < 9*m; ++j)
+                    dF_ptr[9*start + j] += current * df[j];
+            }
+            if(derivatives > 1) {
+                const double* ddf = tmpddF[t].data();
+                for (int j = 0; j < 27*m; ++j)
+                    ddF_ptr[27*start + j] += current * ddf[j];
+            }
+        }
+    }
+}
+
+// F = B (or A if vector_potential) of all coils in the collection and its
+// first `derivatives` derivatives on the points (pointsx, pointsy,
+// pointsz)[:npoints], using a single sweep over the packed quadrature points
+// per evaluation point.
+template<bool vector_potential>
+void biot_savart_soa(int derivatives, const AlignedPaddedVec& pointsx, const AlignedPaddedVec& pointsy, const AlignedPaddedVec& pointsz,
+        int npoints, const CoilCollection& coils, double* F_ptr, double* dF_ptr, double* ddF_ptr) {
+    constexpr int block = 8;
+    int nblocks = (npoints + block - 1)/block;
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(static)
+    for (int b = 0; b < nblocks; ++b) {
+        int start = b*block;
+        int end = std::min(start + block, npoints);
+        if(derivatives == 0)
+            biot_savart_kernel_soa<vector_potential, 0>(pointsx, pointsy, pointsz, coils, F_ptr, dF_ptr, ddF_ptr, start, end);
+        else if(derivatives == 1)
+            biot_savart_kernel_soa<vector_potential, 1>(pointsx, pointsy, pointsz, coils, F_ptr, dF_ptr, ddF_ptr, start, end);
+        else
+            biot_savart_kernel_soa<vector_potential, 2>(pointsx, pointsy, pointsz, coils, F_ptr, dF_ptr, ddF_ptr, start, end);
+    }
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+vector<double> BiotSavart<T, Array>::B_vjp_graph(Array& v, vector<Array>& res_gamma, vector<Array>& res_gammadash) {
+    if(v.dimension() != 2 || int(v.shape(0)) != npoints || v.shape(1) != 3)
+        throw std::invalid_argument("v needs to have shape (npoints, 3).");
+    auto& points = this->get_points_cart_ref();
+    this->fill_points(points);
+    coil_collection.update(this->coils);
+    return B_vjp_graph_impl(v, res_gamma, res_gammadash);
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+template<class V>
+vector<double> BiotSavart<T, Array>::B_vjp_graph_impl(V& v, vector<Array>& res_gamma, vector<Array>& res_gammadash) {
+    SIMSOPT_PERF_SCOPE(biot_savart_vjp, npoints);
+    int ncoils = this->coils.size();
+    if(int(res_gamma.size()) != ncoils || int(res_gammadash.size()) != ncoils)
+        throw std::invalid_argument("res_gamma and res_gammadash need to contain one array per coil.");
+    for (int i = 0; i < ncoils; ++i) {
+        int nquad = this->coils[i]->curve->numquadpoints;
+        if(int(res_gamma[i].size()) != 3*nquad || int(res_gammadash[i].size()) != 3*nquad)
+            throw std::invalid_argument("res_gamma[i] and res_gammadash[i] need to have shape (numquadpoints, 3).");
+    }
+#if defined(SIMSOPT_WITH_CUDA)
+    if(biot_savart_cuda::enabled()) {
+        // the direct sum on the device, as in biot_savart_vjp_graph
+        if(!device_state)
+            device_state = std::make_unique<biot_savart_cuda::DeviceState>();
+        const double* points = this->get_points_cart_ref().data();
+        vector<double> res_current(ncoils, 0.);
+        for (int i = 0; i < ncoils; ++i) {
+            Array& gamma = this->coils[i]->curve->gamma();
+            Array& gammadash = this->coils[i]->curve->gammadash();
+            int nquad = gamma.shape(0);
+            res_gamma[i].fill(0.);
+            res_gammadash[i].fill(0.);
+            device_state->B_vjp(i, points, npoints, gamma.data(), gammadash.data(), nquad, v.data(), nullptr,
+                    res_gamma[i].data(), res_gammadash[i].data(), nullptr, nullptr);
+            // the derivative with respect to the current as below
+            double scale = 1e-7/nquad;
+            const double* t = gammadash.data();
+            const double* rgd = res_gammadash[i].data();
+            for (int j = 0; j < 3*nquad; ++j)
+                res_current[i] += scale * t[j] * rgd[j];
+            double fak = this->coils[i]->current->get_value() * scale;
+            res_gamma[i] *= fak;
+            res_gammadash[i] *= fak;
+        }
+        return res_current;
+    }
+#endif
+    const CoilCollection& coils = coil_collection;
+    int n = coils.padded_size();
+    int simd_size = CoilCollection::simd_size;
+
+    // The quadrature points are split into blocks, each of which sweeps over
+    // all evaluation points and owns its part of the result.
+    AlignedPaddedVec rg(3*n, 0.), rgd(3*n, 0.);
+    int block = 4*simd_size;
+    int nblocks = (n + block - 1)/block;
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < nblocks; ++b) {
+        int start = b*block;
+        int end = std::min(start + block, n);
+        biot_savart_vjp_kernel_soa(pointsx, pointsy, pointsz, npoints, v, coils, rg.data(), rgd.data(), start, end);
+    }
+
+    // Since v . (t x diff) = t . (diff x v), the derivative with respect to
+    // the current of a coil follows from res_gammadash as well.
+    vector<double> res_current(ncoils, 0.);
 #pragma omp parallel for
     for (int i = 0; i < ncoils; ++i) {
-        Array& Ai = field_cache.get_or_create(fmt::format("A_{}", i), {npoints, 3});
-        set_array_to_zero(Ai);
-        Array& gamma = this->coils[i]->curve->gamma();
-        Array& gammadash = this->coils[i]->curve->gammadash();
-        double current = currents[i];
-        if(derivatives == 0){
-            biot_savart_kernel_A<Array, 0>(pointsx, pointsy, pointsz, gamma, gammadash, Ai, dummyjac, dummyhess);
-        } else {
-            Array& dAi = field_cache.get_or_create(fmt::format("dA_{}", i), {npoints, 3, 3});
-            set_array_to_zero(dAi);
-            if(derivatives == 1) {
-                biot_savart_kernel_A<Array, 1>(pointsx, pointsy, pointsz, gamma, gammadash, Ai, dAi, dummyhess);
-            } else {
-                Array& ddAi = field_cache.get_or_create(fmt::format("ddA_{}", i), {npoints, 3, 3, 3});
-                set_array_to_zero(ddAi);
-                if (derivatives == 2) {
-                    biot_savart_kernel_A<Array, 2>(pointsx, pointsy, pointsz, gamma, gammadash, Ai, dAi, ddAi);
-                } else {
-                    throw logic_error("Only two derivatives of Biot Savart vector potential implemented");
-                }
+        double* res_g = res_gamma[i].data();
+        double* res_gd = res_gammadash[i].data();
+        for (int j = coils.offsets[i]; j < coils.offsets[i+1]; ++j) {
+            int l = j - coils.offsets[i];
+            double t[3] = {coils.dx[j], coils.dy[j], coils.dz[j]};
+            for (int c = 0; c < 3; ++c) {
+                res_g[3*l + c] = coils.weights[j] * rg[c*n + j];
+                res_gd[3*l + c] = coils.weights[j] * rgd[c*n + j];
+                res_current[i] += coils.scales[j] * t[c] * rgd[c*n + j];
+            }
+        }
+    }
+    return res_current;
+}
+
+// The objectives of SquaredFlux, see integral_BdotN.
+enum SquaredFluxDefinition { SQUARED_FLUX_QUADRATIC, SQUARED_FLUX_NORMALIZED, SQUARED_FLUX_LOCAL };
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+std::tuple<double, vector<double>> BiotSavart<T, Array>::squared_flux(Array& normal, Array& target, const std::string& definition, bool derivatives,
+        vector<Array>& res_gamma, vector<Array>& res_gammadash) {
+    SquaredFluxDefinition def;
+    if(definition == "quadratic flux")
+        def = SQUARED_FLUX_QUADRATIC;
+    else if(definition == "normalized")
+        def = SQUARED_FLUX_NORMALIZED;
+    else if(definition == "local")
+        def = SQUARED_FLUX_LOCAL;
+    else
+        throw std::invalid_argument("Unrecognized value for 'definition'.");
+    if(normal.layout() != xt::layout_type::row_major)
+        throw std::invalid_argument("normal needs to be in row-major storage order.");
+    if(normal.dimension() != 2 || int(normal.shape(0)) != npoints || normal.shape(1) != 3)
+        throw std::invalid_argument("normal needs to have shape (npoints, 3).");
+    if(target.size() > 0 && (target.layout() != xt::layout_type::row_major || int(target.size()) != npoints))
+        throw std::invalid_argument("target needs to be empty or contain one value per point.");
+    auto& points = this->get_points_cart_ref();
+    this->fill_points(points);
+    coil_collection.update(this->coils);
+    const CoilCollection& coils = coil_collection;
+
+    bool gpu = false;
+#if defined(SIMSOPT_WITH_CUDA)
+    gpu = biot_savart_cuda::enabled();
+#endif
+    // B is computed block by block below only for the direct sum in double
+    // precision with all quadrature points
+    bool direct = !data_B.get_status() && treecode_theta == 0. && !mixed_precision && !gpu && adaptive_eta == 0.;
+    double* B = direct ? data_B.get_or_create({npoints, 3}).data() : this->B_ref().data();
+    // the direct evaluation is fused with the reduction below, so it is
+    // counted without a time of its own
+    if(direct)
+        SIMSOPT_PERF_COUNT(biot_savart_B, 1, npoints);
+    const double* n_ptr = normal.data();
+    const double* target_ptr = target.size() > 0 ? target.data() : nullptr;
+
+    // v holds dJ/dB, except for the normalized objective, which is only
+    // known after the reduction: there v holds the derivative of the
+    // numerator and w that of the denominator (both without the factor 2).
+    vector<double> v(derivatives ? 3*npoints : 0);
+    vector<double> w(derivatives && def == SQUARED_FLUX_NORMALIZED ? 3*npoints : 0);
+    double numerator_sum = 0., denominator_sum = 0.;
+    constexpr int block = 8;
+    int nblocks = (npoints + block - 1)/block;
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(static) reduction(+:numerator_sum, denominator_sum)
+    for (int b = 0; b < nblocks; ++b) {
+        int start = b*block;
+        int end = std::min(start + block, npoints);
+        if(direct)
+            biot_savart_kernel_soa<false, 0>(pointsx, pointsy, pointsz, coils, B, nullptr, nullptr, start, end);
+        for (int i = start; i < end; ++i) {
+            const double* B_i = B + 3*i;
+            double normN = std::sqrt(n_ptr[3*i+0]*n_ptr[3*i+0] + n_ptr[3*i+1]*n_ptr[3*i+1] + n_ptr[3*i+2]*n_ptr[3*i+2]);
+            double N[3] = {n_ptr[3*i+0]/normN, n_ptr[3*i+1]/normN, n_ptr[3*i+2]/normN};
+            double Bn = B_i[0]*N[0] + B_i[1]*N[1] + B_i[2]*N[2];
+            if(target_ptr)
+                Bn -= target_ptr[i];
+            double mod_B_squared = B_i[0]*B_i[0] + B_i[1]*B_i[1] + B_i[2]*B_i[2];
+            if(def == SQUARED_FLUX_LOCAL)
+                numerator_sum += Bn*Bn/mod_B_squared*normN;
+            else
+                numerator_sum += Bn*Bn*normN;
+            if(def == SQUARED_FLUX_NORMALIZED)
+                denominator_sum += mod_B_squared*normN;
+            if(!derivatives)
+                continue;
+            double scale = normN/npoints;
+            for (int a = 0; a < 3; ++a) {
+                if(def == SQUARED_FLUX_LOCAL)
+                    v[3*i+a] = Bn/mod_B_squared*(N[a] - Bn/mod_B_squared*B_i[a])*scale;
+                else
+                    v[3*i+a] = Bn*N[a]*scale;
+                if(def == SQUARED_FLUX_NORMALIZED)
+                    w[3*i+a] = B_i[a]*scale;
             }
         }
     }
+
+    double J = def == SQUARED_FLUX_NORMALIZED ? 0.5*numerator_sum/denominator_sum : 0.5*numerator_sum/npoints;
+    if(!derivatives)
+        return std::make_tuple(J, vector<double>());
+    if(def == SQUARED_FLUX_NORMALIZED) {
+        // J = num/(2 den) with num = mean(Bn^2 |n|) and den = mean(|B|^2 |n|)
+        double num = numerator_sum/npoints;
+        double den = denominator_sum/npoints;
+        for (int l = 0; l < 3*npoints; ++l)
+            v[l] = v[l]/den - num*w[l]/(den*den);
+    }
+    vector<double> res_current = B_vjp_graph_impl(v, res_gamma, res_gammadash);
+    return std::make_tuple(J, res_current);
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+vector<double> BiotSavart<T, Array>::compute_and_vjp(Array& v, int derivatives, vector<Array>& res_gamma, vector<Array>& res_gammadash) {
+    if(derivatives > 1)
+        throw logic_error("Only one derivative of Biot Savart implemented for the fused forward and vjp pass");
+    SIMSOPT_PERF_SCOPE(biot_savart_vjp, npoints);
+    if(totals_only)
+        throw logic_error("The vector Jacobian product needs the per coil fields, call set_totals_only(false) first.");
+    int ncoils = this->coils.size();
+    if(int(res_gamma.size()) != ncoils || int(res_gammadash.size()) != ncoils)
+        throw std::invalid_argument("res_gamma and res_gammadash need to contain one array per coil.");
+    if(v.dimension() != 2 || int(v.shape(0)) != npoints || v.shape(1) != 3)
+        throw std::invalid_argument("v needs to have shape (npoints, 3).");
+    bool gpu = false;
+#if defined(SIMSOPT_WITH_CUDA)
+    gpu = biot_savart_cuda::enabled();
+#endif
+    // the fused kernel uses all quadrature points in double precision
+    bool fused = treecode_theta == 0. && !mixed_precision && !gpu && adaptive_eta == 0.;
+    if(!fused)
+        compute(derivatives);
+    auto& points = this->get_points_cart_ref();
+    this->fill_points(points);
+    Array& dummyjac = placeholder_array<Array>(3);
+    Tensor2& B = data_B.get_or_create({npoints, 3});
+
+    // See compute() for why this is done in serial.
+    ScratchBuffer<double> currents(ncoils, 0.);
+    ScratchBuffer<Array*> gammas(ncoils), gammadashs(ncoils);
+    ScratchBuffer<Array*> Bs(ncoils), dBs(ncoils, &dummyjac);
     for (int i = 0; i < ncoils; ++i) {
-        Array& Ai = field_cache.get_or_create(fmt::format("A_{}", i), {npoints, 3});
-        double current = this->coils[i]->current->get_value();
-        xt::noalias(A) = A + current * Ai;
+        gammas[i] = &(this->coils[i]->curve->gamma());
+        gammadashs[i] = &(this->coils[i]->curve->gammadash());
+        Bs[i] = &(coil_fields.get_or_create(COIL_B, i, {npoints, 3}));
+        if(derivatives > 0)
+            dBs[i] = &(coil_fields.get_or_create(COIL_dB, i, {npoints, 3, 3}));
+        currents[i] = this->coils[i]->current->get_value();
+        res_gamma[i].fill(0.);
+        res_gammadash[i].fill(0.);
     }
-    if(derivatives>=1) {
+
+    // The vjp of a tile is accumulated in a buffer that belongs to the tile
+    // and the buffers of a coil are summed up afterwards, so that we can use
+    // (coil, point-chunk) tiles as in compute().
+    int chunk = biot_savart_chunk_size(npoints, ncoils, derivatives);
+    int nchunks = (npoints + chunk - 1)/chunk;
+    int ntiles = ncoils*nchunks;
+    std::vector<Array> tile_res_gamma, tile_res_gammadash;
+    for (int tile = 0; tile < ntiles; ++tile) {
+        int nquad = gammas[tile / nchunks]->shape(0);
+        tile_res_gamma.push_back(xt::zeros<double>({nquad, 3}));
+        tile_res_gammadash.push_back(xt::zeros<double>({nquad, 3}));
+    }
+    ReleaseGIL nogil;
+    if(fused) {
+#pragma omp parallel for schedule(dynamic)
+        for (int tile = 0; tile < ntiles; ++tile) {
+            int i = tile / nchunks;
+            int start = (tile % nchunks) * chunk;
+            int end = std::min(start + chunk, npoints);
+            if(derivatives == 0)
+                biot_savart_kernel_and_vjp<Array, 0>(pointsx, pointsy, pointsz, *gammas[i], *gammadashs[i], v,
+                        *Bs[i], *dBs[i], tile_res_gamma[tile], tile_res_gammadash[tile], start, end);
+            else
+                biot_savart_kernel_and_vjp<Array, 1>(pointsx, pointsy, pointsz, *gammas[i], *gammadashs[i], v,
+                        *Bs[i], *dBs[i], tile_res_gamma[tile], tile_res_gammadash[tile], start, end);
+        }
+        vector<int> all_coils(ncoils);
+        std::iota(all_coils.begin(), all_coils.end(), 0);
+        mark_coils_current(COIL_B, derivatives, all_coils);
+    } else {
+        // the field has been computed above, so we only need the vjp
+#pragma omp parallel for schedule(dynamic)
         for (int i = 0; i < ncoils; ++i) {
-            Array& dAi = field_cache.get_or_create(fmt::format("dA_{}", i), {npoints, 3, 3});
-            double current = this->coils[i]->current->get_value();
-            xt::noalias(dA) = dA + current * dAi;
+            biot_savart_vjp_kernel<Array, 0>(pointsx, pointsy, pointsz, *gammas[i], *gammadashs[i], v,
+                    tile_res_gamma[i*nchunks], tile_res_gammadash[i*nchunks], dummyjac, dummyjac, dummyjac);
         }
     }
-    if(derivatives>=2) {
+
+    vector<double> res_current(ncoils, 0.);
+#pragma omp parallel for
+    for (int i = 0; i < ncoils; ++i) {
+        double fak = currents[i] * 1e-7/gammas[i]->shape(0);
+        int n = 3*gammas[i]->shape(0);
+        double* rg = res_gamma[i].data();
+        double* rgd = res_gammadash[i].data();
+        for (int c = 0; c < nchunks; ++c) {
+            const double* trg = tile_res_gamma[i*nchunks + c].data();
+            const double* trgd = tile_res_gammadash[i*nchunks + c].data();
+            for (int j = 0; j < n; ++j) {
+                rg[j] += fak * trg[j];
+                rgd[j] += fak * trgd[j];
+            }
+        }
+        const double* Bi = Bs[i]->data();
+        const double* vptr = v.data();
+        for (int j = 0; j < 3*npoints; ++j)
+            res_current[i] += vptr[j] * Bi[j];
+    }
+
+    nogil.reacquire();
+    sum_coil_contributions(B, Bs, currents, npoints, chunk);
+    if(derivatives>=1) {
+        Tensor3& dB = data_dB.get_or_create({npoints, 3, 3});
+        sum_coil_contributions(dB, dBs, currents, npoints, chunk);
+    }
+    return res_current;
+}
+
+using RowMatrix = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using ConstRowMatrixMap = Eigen::Map<const RowMatrix>;
+using VectorMap = Eigen::Map<Eigen::VectorXd>;
+using ConstVectorMap = Eigen::Map<const Eigen::VectorXd>;
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+Array& BiotSavart<T, Array>::response_matrix() {
+    if(totals_only)
+        throw logic_error("The response matrix needs the per coil fields, call set_totals_only(false) first.");
+    int ncoils = this->coils.size();
+    if(!stale_coils(COIL_B, 0).empty())
+        compute(0);
+    bool reassemble = int(response_versions.size()) != ncoils || response.dimension() != 3
+        || int(response.shape(0)) != ncoils || int(response.shape(1)) != npoints;
+    if(reassemble) {
+        response = xt::zeros<double>({ncoils, npoints, 3});
+        response_versions = vector<int>(ncoils, -1);
+    }
+    for (int i = 0; i < ncoils; ++i) {
+        int version = this->coils[i]->curve->get_version();
+        if(response_versions[i] == version)
+            continue;
+        Array& Bi = coil_fields.get_or_create(COIL_B, i, {npoints, 3});
+        std::copy(Bi.data(), Bi.data() + 3*npoints, response.data() + 3*npoints*i);
+        response_versions[i] = version;
+        normal_response_valid = false;
+    }
+    return response;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+Array& BiotSavart<T, Array>::normal_response_matrix(Array& normal) {
+    if(normal.dimension() != 2 || int(normal.shape(0)) != npoints || normal.shape(1) != 3)
+        throw std::invalid_argument("normal needs to have shape (npoints, 3).");
+    Array& R = response_matrix();
+    int ncoils = this->coils.size();
+    if(normal_response_valid && std::equal(normal.data(), normal.data() + 3*npoints, response_normal.data()))
+        return normal_response;
+    response_normal = xt::zeros<double>({npoints, 3});
+    std::copy(normal.data(), normal.data() + 3*npoints, response_normal.data());
+    normal_response = xt::zeros<double>({ncoils, npoints});
+    const double* r = R.data();
+    const double* n = normal.data();
+    double* rn = normal_response.data();
+    ReleaseGIL nogil;
+#pragma omp parallel for
+    for (int i = 0; i < ncoils; ++i) {
+        for (int j = 0; j < npoints; ++j) {
+            const double* rij = r + 3*(npoints*i + j);
+            rn[npoints*i + j] = rij[0]*n[3*j+0] + rij[1]*n[3*j+1] + rij[2]*n[3*j+2];
+        }
+    }
+    normal_response_valid = true;
+    return normal_response;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+Array BiotSavart<T, Array>::B_from_currents(Array& currents) {
+    int ncoils = this->coils.size();
+    if(int(currents.size()) != ncoils)
+        throw std::invalid_argument("currents needs to contain one value per coil.");
+    Array& R = response_matrix();
+    Array B = xt::zeros<double>({npoints, 3});
+    ConstRowMatrixMap eigen_R(R.data(), ncoils, 3*npoints);
+    VectorMap(B.data(), 3*npoints).noalias() = eigen_R.transpose() * ConstVectorMap(currents.data(), ncoils);
+    return B;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+Array BiotSavart<T, Array>::Bn_from_currents(Array& normal, Array& currents) {
+    int ncoils = this->coils.size();
+    if(int(currents.size()) != ncoils)
+        throw std::invalid_argument("currents needs to contain one value per coil.");
+    Array& Rn = normal_response_matrix(normal);
+    Array Bn = xt::zeros<double>({npoints});
+    ConstRowMatrixMap eigen_Rn(Rn.data(), ncoils, npoints);
+    VectorMap(Bn.data(), npoints).noalias() = eigen_Rn.transpose() * ConstVectorMap(currents.data(), ncoils);
+    return Bn;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+Array BiotSavart<T, Array>::B_vjp_currents(Array& v) {
+    if(int(v.size()) != 3*npoints)
+        throw std::invalid_argument("v needs to have shape (npoints, 3).");
+    int ncoils = this->coils.size();
+    Array& R = response_matrix();
+    Array res = xt::zeros<double>({ncoils});
+    ConstRowMatrixMap eigen_R(R.data(), ncoils, 3*npoints);
+    VectorMap(res.data(), ncoils).noalias() = eigen_R * ConstVectorMap(v.data(), 3*npoints);
+    return res;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+Array BiotSavart<T, Array>::Bn_vjp_currents(Array& normal, Array& w) {
+    if(int(w.size()) != npoints)
+        throw std::invalid_argument("w needs to have shape (npoints,).");
+    int ncoils = this->coils.size();
+    Array& Rn = normal_response_matrix(normal);
+    Array res = xt::zeros<double>({ncoils});
+    ConstRowMatrixMap eigen_Rn(Rn.data(), ncoils, npoints);
+    VectorMap(res.data(), ncoils).noalias() = eigen_Rn * ConstVectorMap(w.data(), npoints);
+    return res;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+Array BiotSavart<T, Array>::B_cyl_groups(Array& weights) {
+    if(totals_only)
+        throw logic_error("The fields of coil groups need the per coil fields, call set_totals_only(false) first.");
+    int ncoils = this->coils.size();
+    if(weights.dimension() != 2 || int(weights.shape(1)) != ncoils)
+        throw std::invalid_argument("weights needs to have shape (ngroups, ncoils).");
+    int ngroups = weights.shape(0);
+    if(!stale_coils(COIL_B, 0).empty())
+        compute(0);
+    auto& points = this->get_points_cart_ref();
+    ScratchBuffer<const double*> Bs(ncoils);
+    for (int i = 0; i < ncoils; ++i)
+        Bs[i] = coil_fields.get_or_create(COIL_B, i, {npoints, 3}).data();
+    Array res = xt::zeros<double>({ngroups, npoints, 3});
+    {
+        ReleaseGIL nogil;
+#pragma omp parallel for
+        for (int j = 0; j < npoints; ++j) {
+            double phi = std::atan2(points(j, 1), points(j, 0));
+            double c = std::cos(phi);
+            double s = std::sin(phi);
+            for (int g = 0; g < ngroups; ++g) {
+                double bx = 0., by = 0., bz = 0.;
+                for (int i = 0; i < ncoils; ++i) {
+                    double wgi = weights(g, i);
+                    if(wgi == 0.)
+                        continue;
+                    bx += wgi*Bs[i][3*j+0];
+                    by += wgi*Bs[i][3*j+1];
+                    bz += wgi*Bs[i][3*j+2];
+                }
+                res(g, j, 0) = c*bx + s*by;
+                res(g, j, 1) = -s*bx + c*by;
+                res(g, j, 2) = bz;
+            }
+        }
+    }
+    return res;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+template<bool vector_potential>
+void BiotSavart<T, Array>::compute_totals(int derivatives) {
+    auto& points = this->get_points_cart_ref();
+    this->fill_points(points);
+    int ncoils = this->coils.size();
+    Tensor2& F = vector_potential ? data_A.get_or_create({npoints, 3}) : data_B.get_or_create({npoints, 3});
+    double* dF_ptr = nullptr;
+    double* ddF_ptr = nullptr;
+    if(derivatives > 0)
+        dF_ptr = (vector_potential ? data_dA.get_or_create({npoints, 3, 3}) : data_dB.get_or_create({npoints, 3, 3})).data();
+    if(derivatives > 1)
+        ddF_ptr = (vector_potential ? data_ddA.get_or_create({npoints, 3, 3, 3}) : data_ddB.get_or_create({npoints, 3, 3, 3})).data();
+    double* F_ptr = F.data();
+
+    // See compute() for why this is done in serial.
+    ScratchBuffer<double> currents(ncoils, 0.);
+    ScratchBuffer<Array*> gammas(ncoils), gammadashs(ncoils);
+    for (int i = 0; i < ncoils; ++i) {
+        gammas[i] = &(this->coils[i]->curve->gamma());
+        gammadashs[i] = &(this->coils[i]->curve->gammadash());
+        currents[i] = this->coils[i]->current->get_value();
+    }
+
+#if defined(SIMSOPT_WITH_CUDA)
+    if(!vector_potential && biot_savart_cuda::enabled() && treecode_theta == 0.) {
+        if(!device_state)
+            device_state = std::make_unique<biot_savart_cuda::DeviceState>();
+        Array& dummyjac = placeholder_array<Array>(3);
+        Array& dummyhess = placeholder_array<Array>(4);
+        Array tmpF = xt::zeros<double>({npoints, 3});
+        Array tmpdF = derivatives > 0 ? Array(xt::zeros<double>({npoints, 3, 3})) : dummyjac;
+        Array tmpddF = derivatives > 1 ? Array(xt::zeros<double>({npoints, 3, 3, 3})) : dummyhess;
+        F.fill(0.);
+        if(derivatives > 0)
+            std::fill(dF_ptr, dF_ptr + 9*npoints, 0.);
+        if(derivatives > 1)
+            std::fill(ddF_ptr, ddF_ptr + 27*npoints, 0.);
         for (int i = 0; i < ncoils; ++i) {
-            Array& ddAi = field_cache.get_or_create(fmt::format("ddA_{}", i), {npoints, 3, 3, 3});
-            double current = this->coils[i]->current->get_value();
-            xt::noalias(ddA) = ddA + current * ddAi;
+            device_state->B(i, points.data(), npoints, gammas[i]->data(), gammadashs[i]->data(), gammas[i]->shape(0),
+                    derivatives, tmpF.data(), tmpdF.data(), tmpddF.data());
+            for (int j = 0; j < 3*npoints; ++j)
+                F_ptr[j] += currents[i] * tmpF.data()[j];
+            for (int j = 0; derivatives > 0 && j < 9*npoints; ++j)
+                dF_ptr[j] += currents[i] * tmpdF.data()[j];
+            for (int j = 0; derivatives > 1 && j < 27*npoints; ++j)
+                ddF_ptr[j] += currents[i] * tmpddF.data()[j];
+        }
+        return;
+    }
+#endif
+
+    if(treecode_theta == 0. && !mixed_precision) {
+        coil_collection.update(this->coils);
+        biot_savart_soa<vector_potential>(derivatives, pointsx, pointsy, pointsz, npoints, coil_collection, F_ptr, dF_ptr, ddF_ptr);
+        return;
+    }
+    biot_savart_accumulate<Array, vector_potential>(derivatives, pointsx, pointsy, pointsz, npoints, gammas, gammadashs, currents,
+            F_ptr, dF_ptr, ddF_ptr, treecode_theta, treecode_leafsize, mixed_precision);
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+void BiotSavart<T, Array>::compute_batch(vector<Array>& points, int derivatives, vector<Array>& B, vector<Array>& dB) {
+    if(derivatives > 1)
+        throw logic_error("Only one derivative of Biot Savart implemented for batched evaluations");
+    int nsets = points.size();
+    vector<int> offsets(nsets + 1, 0);
+    for (int s = 0; s < nsets; ++s) {
+        if(points[s].dimension() != 2 || points[s].shape(1) != 3)
+            throw std::invalid_argument("Each point set needs to have shape (n, 3).");
+        offsets[s+1] = offsets[s] + points[s].shape(0);
+    }
+    int ntotal = offsets[nsets];
+    SIMSOPT_PERF_SCOPE(biot_savart_B, ntotal);
+    int ncoils = this->coils.size();
+
+    // All point sets are concatenated and evaluated in one parallel region.
+    // This doesn't touch the points or the cache of the field itself.
+    AlignedPaddedVec px(ntotal, 0.), py(ntotal, 0.), pz(ntotal, 0.);
+    for (int s = 0; s < nsets; ++s) {
+        for (int j = 0; j < offsets[s+1] - offsets[s]; ++j) {
+            px[offsets[s] + j] = points[s](j, 0);
+            py[offsets[s] + j] = points[s](j, 1);
+            pz[offsets[s] + j] = points[s](j, 2);
+        }
+    }
+    ScratchBuffer<double> currents(ncoils, 0.);
+    ScratchBuffer<Array*> gammas(ncoils), gammadashs(ncoils);
+    for (int i = 0; i < ncoils; ++i) {
+        gammas[i] = &(this->coils[i]->curve->gamma());
+        gammadashs[i] = &(this->coils[i]->curve->gammadash());
+        currents[i] = this->coils[i]->current->get_value();
+    }
+    vector<double> Bs(3*ntotal), dBs(derivatives > 0 ? 9*ntotal : 0);
+    if(treecode_theta == 0. && !mixed_precision) {
+        coil_collection.update(this->coils);
+        biot_savart_soa<false>(derivatives, px, py, pz, ntotal, coil_collection, Bs.data(), dBs.data(), nullptr);
+    } else {
+        biot_savart_accumulate<Array, false>(derivatives, px, py, pz, ntotal, gammas, gammadashs, currents,
+                Bs.data(), dBs.data(), nullptr, treecode_theta, treecode_leafsize, mixed_precision);
+    }
+
+    B.clear();
+    dB.clear();
+    for (int s = 0; s < nsets; ++s) {
+        int n = offsets[s+1] - offsets[s];
+        Array Bset = xt::zeros<double>({n, 3});
+        std::copy(Bs.begin() + 3*offsets[s], Bs.begin() + 3*offsets[s+1], Bset.data());
+        B.push_back(Bset);
+        if(derivatives > 0) {
+            Array dBset = xt::zeros<double>({n, 3, 3});
+            std::copy(dBs.begin() + 9*offsets[s], dBs.begin() + 9*offsets[s+1], dBset.data());
+            dB.push_back(dBset);
+        }
+    }
+}
+
+// out += s * (G x G x ... x G) in, applied to all `rank` indices of the 3 x
+// ... x 3 tensor `in`.
+inline void add_transformed(const std::array<double, 9>& G, double s, int rank, const double* in, double* out) {
+    if(rank == 1) {
+        for (int a = 0; a < 3; ++a)
+            out[a] += s * (G[3*a+0]*in[0] + G[3*a+1]*in[1] + G[3*a+2]*in[2]);
+        return;
+    }
+    // contract the leading index and recurse on the remaining ones
+    int stride = rank == 2 ? 3 : 9;
+    double tmp[27];
+    for (int j = 0; j < 3*stride; ++j)
+        tmp[j] = 0.;
+    for (int k = 0; k < 3; ++k)
+        for (int m = 0; m < 3; ++m)
+            add_transformed(G, s*G[3*k+m], rank-1, in + m*stride, tmp + k*stride);
+    for (int j = 0; j < 3*stride; ++j)
+        out[j] += tmp[j];
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+template<bool vector_potential>
+void BiotSavartSymmetric<T, Array>::compute_impl(int derivatives) {
+    if(derivatives > 2)
+        throw logic_error("Only two derivatives of Biot Savart implemented");
+#if defined(USE_XSIMD)
+    constexpr int simd_size = xsimd::simd_type<double>::size;
+#else
+    constexpr int simd_size = 1;
+#endif
+#if defined(SIMSOPT_PERF_COUNTERS)
+    PerfScope perf_scope(vector_potential ? PerfCounter::biot_savart_A : PerfCounter::biot_savart_B, npoints);
+#endif
+    int nthreads = biot_savart_num_threads();
+    auto& points = this->get_points_cart_ref();
+    int ncoils = this->coils.size();
+    int nsym = this->num_symmetries();
+    int q0 = vector_potential ? COIL_A : COIL_B;
+    Tensor2& F = vector_potential ? data_A.get_or_create({npoints, 3}) : data_B.get_or_create({npoints, 3});
+
+    // See BiotSavart::compute for why the arrays and currents are acquired in
+    // serial.
+    Array& dummyjac = placeholder_array<Array>(3);
+    Array& dummyhess = placeholder_array<Array>(4);
+    ScratchBuffer<double> currents(ncoils, 0.);
+    ScratchBuffer<Array*> gammas(ncoils), gammadashs(ncoils);
+    ScratchBuffer<Array*> Fs(ncoils), dFs(ncoils, &dummyjac), ddFs(ncoils, &dummyhess);
+    for (int i = 0; i < ncoils; ++i) {
+        gammas[i] = &(this->coils[i]->curve->gamma());
+        gammadashs[i] = &(this->coils[i]->curve->gammadash());
+        Fs[i] = &(coil_fields.get_or_create(q0, i, {npoints, 3}));
+        if(derivatives > 0)
+            dFs[i] = &(coil_fields.get_or_create(q0 + 1, i, {npoints, 3, 3}));
+        if(derivatives > 1)
+            ddFs[i] = &(coil_fields.get_or_create(q0 + 2, i, {npoints, 3, 3, 3}));
+        currents[i] = this->coils[i]->current->get_value();
+    }
+
+    // Each tile evaluates one base coil at the nsym images of a chunk of
+    // points, stored contiguously in per thread scratch buffers. The images of
+    // the g-th symmetry start at g*chunk, which is a multiple of the simd size.
+    int chunk = biot_savart_chunk_size(npoints, ncoils, derivatives)/nsym;
+    chunk = std::max(simd_size, (chunk/simd_size)*simd_size);
+    int nchunks = (npoints + chunk - 1)/chunk;
+    int nscratch = nsym*chunk;
+    std::vector<AlignedPaddedVec> imx(nthreads, AlignedPaddedVec(nscratch, 0.));
+    std::vector<AlignedPaddedVec> imy(nthreads, AlignedPaddedVec(nscratch, 0.));
+    std::vector<AlignedPaddedVec> imz(nthreads, AlignedPaddedVec(nscratch, 0.));
+    std::vector<Array> tmpF, tmpdF, tmpddF;
+    for (int t = 0; t < nthreads; ++t) {
+        tmpF.push_back(xt::zeros<double>({nscratch, 3}));
+        tmpdF.push_back(derivatives > 0 ? Array(xt::zeros<double>({nscratch, 3, 3})) : dummyjac);
+        tmpddF.push_back(derivatives > 1 ? Array(xt::zeros<double>({nscratch, 3, 3, 3})) : dummyhess);
+    }
+
+    ReleaseGIL nogil;
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < ncoils*nchunks; ++tile) {
+        int t = biot_savart_thread_num();
+        int i = tile / nchunks;
+        int start = (tile % nchunks) * chunk;
+        int m = std::min(start + chunk, npoints) - start;
+        // the field of the copy G*gamma at x is s G B(G^T x)
+        for (int g = 0; g < nsym; ++g) {
+            auto& G = symmetry_matrices[g];
+            for (int p = 0; p < m; ++p) {
+                double x = points(start+p, 0), y = points(start+p, 1), z = points(start+p, 2);
+                imx[t][g*chunk+p] = G[0]*x + G[3]*y + G[6]*z;
+                imy[t][g*chunk+p] = G[1]*x + G[4]*y + G[7]*z;
+                imz[t][g*chunk+p] = G[2]*x + G[5]*y + G[8]*z;
+            }
+            biot_savart_tile<Array, vector_potential>(derivatives, imx[t], imy[t], imz[t], *gammas[i], *gammadashs[i],
+                    tmpF[t], tmpdF[t], tmpddF[t], nullptr, 0., false, g*chunk, g*chunk+m);
+        }
+        std::fill(Fs[i]->data() + 3*start, Fs[i]->data() + 3*(start+m), 0.);
+        if(derivatives > 0)
+            std::fill(dFs[i]->data() + 9*start, dFs[i]->data() + 9*(start+m), 0.);
+        if(derivatives > 1)
+            std::fill(ddFs[i]->data() + 27*start, ddFs[i]->data() + 27*(start+m), 0.);
+        for (int g = 0; g < nsym; ++g) {
+            for (int p = 0; p < m; ++p) {
+                int q = g*chunk + p;
+                add_transformed(symmetry_matrices[g], symmetry_signs[g], 1, tmpF[t].data() + 3*q, Fs[i]->data() + 3*(start+p));
+                if(derivatives > 0)
+                    add_transformed(symmetry_matrices[g], symmetry_signs[g], 2, tmpdF[t].data() + 9*q, dFs[i]->data() + 9*(start+p));
+                if(derivatives > 1)
+                    add_transformed(symmetry_matrices[g], symmetry_signs[g], 3, tmpddF[t].data() + 27*q, ddFs[i]->data() + 27*(start+p));
+            }
         }
     }
+    nogil.reacquire();
+
+    int sumchunk = biot_savart_chunk_size(npoints, ncoils, derivatives);
+    sum_coil_contributions(F, Fs, currents, npoints, sumchunk);
+    if(derivatives>=1) {
+        Tensor3& dF = vector_potential ? data_dA.get_or_create({npoints, 3, 3}) : data_dB.get_or_create({npoints, 3, 3});
+        sum_coil_contributions(dF, dFs, currents, npoints, sumchunk);
+    }
+    if(derivatives>=2) {
+        Tensor4& ddF = vector_potential ? data_ddA.get_or_create({npoints, 3, 3, 3}) : data_ddB.get_or_create({npoints, 3, 3, 3});
+        sum_coil_contributions(ddF, ddFs, currents, npoints, sumchunk);
+    }
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+typename MagneticField<T>::Tensor2 BiotSavartSymmetric<T, Array>::symmetric_images_of_points() {
+    auto& points = this->get_points_cart_ref();
+    int nsym = this->num_symmetries();
+    Tensor2 res = xt::zeros<double>({nsym*npoints, 3});
+    for (int g = 0; g < nsym; ++g)
+        for (int p = 0; p < npoints; ++p)
+            add_transformed(symmetry_matrices[g], 1., 1, &(points(p, 0)), &(res(g*npoints+p, 0)));
+    return res;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+typename MagneticField<T>::Tensor2 BiotSavartSymmetric<T, Array>::B_on_symmetric_images() {
+    auto& B = this->B_ref();
+    int nsym = this->num_symmetries();
+    Tensor2 res = xt::zeros<double>({nsym*npoints, 3});
+    for (int g = 0; g < nsym; ++g)
+        for (int p = 0; p < npoints; ++p)
+            add_transformed(symmetry_matrices[g], symmetry_signs[g], 1, &(B(p, 0)), &(res(g*npoints+p, 0)));
+    return res;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+typename MagneticField<T>::Tensor3 BiotSavartSymmetric<T, Array>::dB_by_dX_on_symmetric_images() {
+    auto& dB = this->dB_by_dX_ref();
+    int nsym = this->num_symmetries();
+    Tensor3 res = xt::zeros<double>({nsym*npoints, 3, 3});
+    for (int g = 0; g < nsym; ++g)
+        for (int p = 0; p < npoints; ++p)
+            add_transformed(symmetry_matrices[g], symmetry_signs[g], 2, &(dB(p, 0, 0)), &(res(g*npoints+p, 0, 0)));
+    return res;
 }
 
 
@@ -175,3 +1302,4 @@ void BiotSavart<T, Array>::compute_A(int derivatives) {
 #include "xtensor-python/pytensor.hpp"     // Numpy bindings
 typedef xt::pyarray<double> PyArray;
 template class BiotSavart<xt::pytensor, PyArray>;
+template class BiotSavartSymmetric<xt::pytensor, PyArray>;
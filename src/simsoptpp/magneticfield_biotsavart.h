@@ -1,11 +1,47 @@
 #pragma once 
 
 #include <vector>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <cctype>
+#include <string>
+#include <tuple>
 #include "xtensor/xarray.hpp"
 #include "xtensor/xlayout.hpp"
 #include "simdhelpers.h"
 #include "magneticfield.h"
 #include "coil.h"
+#include "coilcollection.h"
+#include "biot_savart_cuda.h"
+
+// Per coil quantities stored by BiotSavart and BiotSavartSymmetric. They are
+// indexed by quantity and coil number, but can also be accessed with the
+// string keys "B_{i}", "dB_{i}", "ddB_{i}", "A_{i}", "dA_{i}" and "ddA_{i}"
+// via fieldcache_get_or_create.
+enum CoilField { COIL_B = 0, COIL_dB, COIL_ddB, COIL_A, COIL_dA, COIL_ddA, NUM_COIL_FIELDS };
+
+inline const char* const coil_field_names[NUM_COIL_FIELDS] = {"B", "dB", "ddB", "A", "dA", "ddA"};
+
+// Splits a key of the form "dB_3" into the quantity and the coil number.
+// Returns false for keys that don't have this form.
+inline bool parse_coil_field_key(const string& key, int& quantity, int& idx) {
+    const char* const* names = coil_field_names;
+    auto pos = key.rfind('_');
+    if(pos == string::npos || pos + 1 == key.size())
+        return false;
+    for (size_t c = pos + 1; c < key.size(); ++c)
+        if(!std::isdigit(key[c]))
+            return false;
+    for (int q = 0; q < NUM_COIL_FIELDS; ++q) {
+        if(key.compare(0, pos, names[q]) == 0) {
+            quantity = q;
+            idx = std::stoi(key.substr(pos + 1));
+            return true;
+        }
+    }
+    return false;
+}
 
 template<template<class, std::size_t, xt::layout_type> class T, class Array>
 class BiotSavart : public MagneticField<T> {
@@ -18,7 +54,100 @@ class BiotSavart : public MagneticField<T> {
         const vector<shared_ptr<Coil<Array>>> coils;
 
     private:
-        Cache<Array> field_cache;
+        // identifies the field in CacheRegistry::usage()
+        int cache_id = CacheRegistry::instance().new_object_id();
+        IndexedCache<Array> coil_fields = IndexedCache<Array>(NUM_COIL_FIELDS, coil_field_names, "BiotSavart", cache_id);
+        // any other entries created via fieldcache_get_or_create
+        Cache<Array> field_cache = Cache<Array>("BiotSavart", cache_id);
+        // If true, only the total field is computed and the per coil fields
+        // are not stored.
+        bool totals_only = false;
+        // Version of coils[i]->curve for which the entry (quantity, i) of
+        // coil_fields was computed, so that compute() only has to rerun the
+        // kernel for coils whose curve has changed. A change of the currents
+        // only requires summing up the per coil fields again.
+        vector<vector<int>> coil_versions;
+
+        bool coil_field_valid(int quantity, int i) {
+            return this->coil_fields.get_status(quantity, i) && coil_versions[quantity][i] == this->coils[i]->curve->get_version();
+        }
+
+        // Returns the coils for which any of the first `derivatives` + 1
+        // quantities starting at `quantity` (e.g. COIL_B, COIL_dB, COIL_ddB)
+        // has to be recomputed.
+        vector<int> stale_coils(int quantity, int derivatives) {
+            vector<int> stale;
+            for (int i = 0; i < int(this->coils.size()); ++i) {
+                for (int q = quantity; q <= quantity + derivatives; ++q) {
+                    if(!coil_field_valid(q, i)) {
+                        stale.push_back(i);
+                        break;
+                    }
+                }
+            }
+            return stale;
+        }
+
+        void mark_coils_current(int quantity, int derivatives, const vector<int>& updated) {
+            for (int i : updated)
+                for (int q = quantity; q <= quantity + derivatives; ++q)
+                    coil_versions[q][i] = this->coils[i]->curve->get_version();
+        }
+
+        // Per unit current fields of all coils in one contiguous array of
+        // shape (ncoils, npoints, 3), and their normal components of shape
+        // (ncoils, npoints) for the normal `response_normal`, see
+        // response_matrix(). response_versions[i] is the version of the curve
+        // of coil i for which row i was assembled.
+        Array response = Array();
+        Array normal_response = Array();
+        Array response_normal = Array();
+        vector<int> response_versions;
+        bool normal_response_valid = false;
+
+        // The per coil fields only depend on the geometry, so they are
+        // discarded when the points change, but not on invalidate_cache().
+        void invalidate_coil_fields() {
+            this->coil_fields.invalidate_cache();
+            response_versions.clear();
+            normal_response_valid = false;
+        }
+
+        template<bool vector_potential>
+        void compute_totals(int derivatives);
+
+        // B_vjp_graph() for a v of shape (npoints, 3) that has already been
+        // checked, once the points and the coil collection are up to date.
+        template<class V>
+        vector<double> B_vjp_graph_impl(V& v, vector<Array>& res_gamma, vector<Array>& res_gammadash);
+
+        // The quadrature points, tangents and currents of all coils packed
+        // into one structure of arrays. Used by the direct sum in totals only
+        // mode, compute_batch() and B_vjp_graph(), and repacked lazily when a
+        // curve or a current changes.
+        CoilCollection coil_collection;
+
+        // Opening parameter of the treecode approximation, see
+        // biot_savart_treecode.h. A value of zero means that the direct
+        // Biot-Savart sum is used.
+        double treecode_theta = 0.;
+        int treecode_leafsize = 16;
+        // Whether the direct sum uses the mixed precision kernels, see
+        // biot_savart_mixed_impl.h.
+        bool mixed_precision = false;
+        // Safety factor of the distance adaptive quadrature: a block of
+        // points at distance d from a coil uses the coarsest quadrature whose
+        // point spacing h satisfies d >= adaptive_eta * h. A value of zero
+        // means that all quadrature points are used.
+        double adaptive_eta = 0.;
+#if defined(SIMSOPT_WITH_CUDA)
+        // Device copies of the points and coils, see biot_savart_cuda.h.
+        std::unique_ptr<biot_savart_cuda::DeviceState> device_state;
+#endif
+
+        // Whether pointsx, pointsy and pointsz hold the current points. They
+        // are only filled again after set_points, not on every evaluation.
+        bool points_filled = false;
 
         #if defined(USE_XSIMD)
         // this vectors are aligned in memory for fast simd usage.
@@ -27,6 +156,8 @@ class BiotSavart : public MagneticField<T> {
         AlignedPaddedVec pointsz = AlignedPaddedVec(xsimd::simd_type<double>::size, 0.);
 
         inline void fill_points(const Tensor2& points) {
+            if(points_filled)
+                return;
             // allocating these aligned vectors is not super cheap, so reuse
             // whenever possible.
             if(pointsx.size() != npoints)
@@ -40,6 +171,7 @@ class BiotSavart : public MagneticField<T> {
                 pointsy[i] = points(i, 1);
                 pointsz[i] = points(i, 2);
             }
+            points_filled = true;
         }
         #else
         AlignedPaddedVec pointsx;
@@ -47,6 +179,8 @@ class BiotSavart : public MagneticField<T> {
         AlignedPaddedVec pointsz;
 
         inline void fill_points(const Tensor2& points) {
+            if(points_filled)
+                return;
             // allocating these aligned vectors is not super cheap, so reuse
             // whenever possible.
             if(pointsx.size() != npoints){
@@ -66,6 +200,7 @@ class BiotSavart : public MagneticField<T> {
                 pointsy[i] = points(i, 1);
                 pointsz[i] = points(i, 2);
             }
+            points_filled = true;
         }
         #endif
 
@@ -107,24 +242,302 @@ class BiotSavart : public MagneticField<T> {
         using MagneticField<T>::data_ddA;
 
 
-        BiotSavart(vector<shared_ptr<Coil<Array>>> coils) : MagneticField<T>(), coils(coils) {
+        BiotSavart(vector<shared_ptr<Coil<Array>>> coils) : MagneticField<T>(), coils(coils),
+            coil_versions(NUM_COIL_FIELDS, vector<int>(coils.size(), -1)) {
 
         }
 
         void compute(int derivatives);
         void compute_A(int derivatives);
+        // Computes B and A (and their first derivatives_B resp. derivatives_A
+        // derivatives) with a single pass over the quadrature points.
+        void compute_all(int derivatives_B, int derivatives_A);
+
+        // For fixed geometry and points, B depends linearly on the currents,
+        // B = sum_i I_i B_i. response_matrix() returns the per unit current
+        // fields B_i as one (ncoils, npoints, 3) array, and
+        // normal_response_matrix(normal) returns B_i . normal as one
+        // (ncoils, npoints) array. Both are kept until the points or the
+        // curves change, so that the field for new currents and the
+        // derivatives with respect to the currents are a single matrix
+        // vector product, see B_from_currents() etc.
+        Array& response_matrix();
+        Array& normal_response_matrix(Array& normal);
+        // sum_i currents[i] * B_i, shape (npoints, 3)
+        Array B_from_currents(Array& currents);
+        // sum_i currents[i] * B_i . normal, shape (npoints,)
+        Array Bn_from_currents(Array& normal, Array& currents);
+        // d/dI_i sum(v * B) = sum(v * B_i), shape (ncoils,)
+        Array B_vjp_currents(Array& v);
+        // d/dI_i sum(w * B.normal) = sum(w * B_i . normal), shape (ncoils,)
+        Array Bn_vjp_currents(Array& normal, Array& w);
+        // Cylindrical components (B_r, B_phi, B_z) of the fields of several
+        // coil groups, sum_i weights(g, i) * B_i for group g, at the points.
+        // The per coil fields are computed once for all groups, and the
+        // result has shape (ngroups, npoints, 3). Used to write mgrid files,
+        // where weights(g, i) is the current of coil i if it belongs to
+        // group g and zero otherwise.
+        Array B_cyl_groups(Array& weights);
+
+        // Computes B (and dB_by_dX if derivatives == 1) like compute() and,
+        // in the same sweep over the pairs of points and quadrature points,
+        // the vector Jacobian product for the given v: res_gamma[i] and
+        // res_gammadash[i] are overwritten with the derivatives of
+        // sum(v * B) with respect to the gamma and gammadash of coil i, and
+        // the derivatives with respect to the currents are returned. This
+        // requires v to be known before B is computed, e.g. for a fixed
+        // weighting of the field or when reusing v from a previous
+        // iteration.
+        vector<double> compute_and_vjp(Array& v, int derivatives, vector<Array>& res_gamma, vector<Array>& res_gammadash);
+
+        // The vector Jacobian product of B with respect to the gamma and
+        // gammadash of all coils, computed in one sweep over the packed
+        // quadrature points of all coils: res_gamma[i] and res_gammadash[i]
+        // are overwritten with the derivatives of sum(v * B) with respect to
+        // the gamma and gammadash of coil i, and the derivatives with respect
+        // to the currents are returned. Unlike compute_and_vjp(), this
+        // doesn't need the per coil fields and is also available in totals
+        // only mode. This always uses the direct Biot-Savart sum, on the
+        // device if biot_savart_cuda::enabled().
+        vector<double> B_vjp_graph(Array& v, vector<Array>& res_gamma, vector<Array>& res_gammadash);
+
+        // The objective of SquaredFlux (see integral_BdotN) for the field at
+        // the points, which are the quadrature points of a surface with the
+        // given (npoints, 3) normals and target values of B . n (or an empty
+        // target). With the direct sum, B is evaluated for one block of
+        // points at a time and reduced to the objective right away; it is
+        // also stored in the cache, and taken from there if it is already
+        // available. If derivatives is true, the weights v = dJ/dB are
+        // formed in the same pass and res_gamma, res_gammadash and the
+        // returned derivatives with respect to the currents are those of
+        // B_vjp_graph(v).
+        std::tuple<double, vector<double>> squared_flux(Array& normal, Array& target, const std::string& definition, bool derivatives,
+                vector<Array>& res_gamma, vector<Array>& res_gammadash);
+
+        // Evaluates B (and dB_by_dX if derivatives == 1) on several
+        // independent sets of points in a single parallel region, without
+        // changing the points or the cache of this object.
+        void compute_batch(vector<Array>& points, int derivatives, vector<Array>& B, vector<Array>& dB);
+
+        vector<Array> B_batch(vector<Array>& points) {
+            vector<Array> B, dB;
+            compute_batch(points, 0, B, dB);
+            return B;
+        }
+
+        vector<Array> dB_by_dX_batch(vector<Array>& points) {
+            vector<Array> B, dB;
+            compute_batch(points, 1, B, dB);
+            return dB;
+        }
         virtual void invalidate_cache() override {
             MagneticField<T>::invalidate_cache();
             this->field_cache.invalidate_cache();
         }
 
+        virtual void _set_points_cb() override {
+            points_filled = false;
+            invalidate_coil_fields();
+        }
+
         Array& fieldcache_get_or_create(string key, vector<int> dims){
+            int quantity, idx;
+            if(parse_coil_field_key(key, quantity, idx)) {
+                if(totals_only)
+                    throw std::logic_error("Per coil fields are not stored in totals only mode, call set_totals_only(false) first.");
+                return this->coil_fields.get_or_create(quantity, idx, dims);
+            }
             return this->field_cache.get_or_create(key, dims);
         }
 
+        int get_cache_id() const { return cache_id; }
+
         bool fieldcache_get_status(string key){
+            int quantity, idx;
+            if(parse_coil_field_key(key, quantity, idx))
+                return idx < int(this->coils.size()) && coil_field_valid(quantity, idx);
             return this->field_cache.get_status(key);
         }
 
+        // In totals only mode, compute() and compute_A() accumulate
+        // current * B_i directly and don't store the per coil fields.  This
+        // saves a lot of memory for many coils and points, but quantities that
+        // need the per coil fields (e.g. B_vjp) are not available.
+        void set_totals_only(bool flag) {
+            totals_only = flag;
+            if(totals_only)
+                this->coil_fields.clear();
+            invalidate_coil_fields();
+            this->invalidate_cache();
+        }
+
+        bool get_totals_only() const { return totals_only; }
+
+        void set_treecode(double theta, int leafsize) {
+            if(theta < 0. || theta >= 1.)
+                throw std::invalid_argument("The treecode opening parameter theta needs to be in [0, 1).");
+            if(leafsize < 1)
+                throw std::invalid_argument("The treecode leafsize needs to be positive.");
+            treecode_theta = theta;
+            treecode_leafsize = leafsize;
+            invalidate_coil_fields();
+            this->invalidate_cache();
+        }
+
+        double get_treecode_theta() const { return treecode_theta; }
+        int get_treecode_leafsize() const { return treecode_leafsize; }
+
+        void set_mixed_precision(bool mixed) {
+            mixed_precision = mixed;
+            invalidate_coil_fields();
+            this->invalidate_cache();
+        }
+
+        bool get_mixed_precision() const { return mixed_precision; }
+
+        void set_adaptive_quadrature(double eta) {
+            if(eta < 0.)
+                throw std::invalid_argument("The safety factor of the adaptive quadrature needs to be non-negative.");
+            adaptive_eta = eta;
+            invalidate_coil_fields();
+            this->invalidate_cache();
+        }
+
+        double get_adaptive_quadrature() const { return adaptive_eta; }
+
 };
 
+
+template<template<class, std::size_t, xt::layout_type> class T, class Array>
+class BiotSavartSymmetric : public MagneticField<T> {
+     // This class describes the magnetic field induced by a list of base coils
+     // and their copies under the nfp-fold rotational symmetry and (optionally)
+     // stellarator symmetry, i.e. the same field as
+     // BiotSavart(coils_via_symmetries(curves, currents, nfp, stellsym)).
+     // Instead of evaluating every copy of a coil at the target points, we
+     // evaluate the base coils at the transformed target points and transform
+     // the result back: for a copy G*gamma of a coil with current s*I (s = -1
+     // for the flipped copies) we have
+     //     B_copy(x) = s G B(G^T x)
+     // and similarly for A and all derivatives. The per coil field cache
+     // entries `B_i` etc. contain the field of base coil i and all its copies
+     // per unit current.
+    public:
+        using typename MagneticField<T>::Tensor2;
+        using typename MagneticField<T>::Tensor3;
+        using typename MagneticField<T>::Tensor4;
+        const vector<shared_ptr<Coil<Array>>> coils;
+        const int nfp;
+        const bool stellsym;
+
+    private:
+        int cache_id = CacheRegistry::instance().new_object_id();
+        IndexedCache<Array> coil_fields = IndexedCache<Array>(NUM_COIL_FIELDS, coil_field_names, "BiotSavartSymmetric", cache_id);
+        Cache<Array> field_cache = Cache<Array>("BiotSavartSymmetric", cache_id);
+        // row-major matrices G and current signs s of the symmetry group
+        vector<std::array<double, 9>> symmetry_matrices;
+        vector<double> symmetry_signs;
+
+        template<bool vector_potential>
+        void compute_impl(int derivatives);
+
+    protected:
+
+        void _B_impl(Tensor2& B) override {
+            this->compute(0);
+        }
+        
+        void _dB_by_dX_impl(Tensor3& dB_by_dX) override {
+            this->compute(1);
+        }
+
+        void _d2B_by_dXdX_impl(Tensor4& d2B_by_dXdX) override {
+            this->compute(2);
+        }
+        
+        void _A_impl(Tensor2& A) override {
+            this->compute_A(0);
+        }
+        
+        void _dA_by_dX_impl(Tensor3& dA_by_dX) override {
+            this->compute_A(1);
+        }
+
+        void _d2A_by_dXdX_impl(Tensor4& d2A_by_dXdX) override {
+            this->compute_A(2);
+        }
+
+    public:
+        using MagneticField<T>::npoints;
+        using MagneticField<T>::data_B;
+        using MagneticField<T>::data_dB;
+        using MagneticField<T>::data_ddB;
+        using MagneticField<T>::data_A;
+        using MagneticField<T>::data_dA;
+        using MagneticField<T>::data_ddA;
+
+        BiotSavartSymmetric(vector<shared_ptr<Coil<Array>>> coils, int nfp, bool stellsym) :
+            MagneticField<T>(), coils(coils), nfp(nfp), stellsym(stellsym) {
+            if(nfp < 1)
+                throw std::invalid_argument("nfp needs to be positive.");
+            for (int k = 0; k < nfp; ++k) {
+                double c = std::cos(2*M_PI*k/nfp);
+                double s = std::sin(2*M_PI*k/nfp);
+                symmetry_matrices.push_back({c, -s, 0., s, c, 0., 0., 0., 1.});
+                symmetry_signs.push_back(1.);
+                if(stellsym) {
+                    // rotation followed by the flip (x, y, z) -> (x, -y, -z)
+                    symmetry_matrices.push_back({c, -s, 0., -s, -c, 0., 0., 0., -1.});
+                    symmetry_signs.push_back(-1.);
+                }
+            }
+        }
+
+        int num_symmetries() const { return symmetry_matrices.size(); }
+
+        // The matrices G as an array of shape (num_symmetries, 3, 3).
+        Array get_symmetry_matrices() {
+            int nsym = num_symmetries();
+            Array res = xt::zeros<double>({nsym, 3, 3});
+            for (int g = 0; g < nsym; ++g)
+                std::copy(symmetry_matrices[g].begin(), symmetry_matrices[g].end(), &(res(g, 0, 0)));
+            return res;
+        }
+
+        vector<double> get_symmetry_signs() { return symmetry_signs; }
+
+        void compute(int derivatives) { compute_impl<false>(derivatives); }
+        void compute_A(int derivatives) { compute_impl<true>(derivatives); }
+
+        virtual void invalidate_cache() override {
+            MagneticField<T>::invalidate_cache();
+            this->coil_fields.invalidate_cache();
+            this->field_cache.invalidate_cache();
+        }
+
+        Array& fieldcache_get_or_create(string key, vector<int> dims){
+            int quantity, idx;
+            if(parse_coil_field_key(key, quantity, idx))
+                return this->coil_fields.get_or_create(quantity, idx, dims);
+            return this->field_cache.get_or_create(key, dims);
+        }
+
+        int get_cache_id() const { return cache_id; }
+
+        bool fieldcache_get_status(string key){
+            int quantity, idx;
+            if(parse_coil_field_key(key, quantity, idx))
+                return this->coil_fields.get_status(quantity, idx);
+            return this->field_cache.get_status(key);
+        }
+
+        // If the target points are symmetric, then it suffices to evaluate the
+        // field on one field period (or half period for stellarator
+        // symmetry). The functions below return the images G x_i of the
+        // current points, and the field B(G x_i) = s G B(x_i) at those images,
+        // as arrays of shape (num_symmetries * npoints, ...), ordered by
+        // symmetry first.
+        Tensor2 symmetric_images_of_points();
+        Tensor2 B_on_symmetric_images();
+        Tensor3 dB_by_dX_on_symmetric_images();
+};
@@ -3,6 +3,11 @@
 #include "magneticfield.h"
 #include "xtensor/xlayout.hpp"
 #include "regular_grid_interpolant_3d.h"
+#include "adaptive_interpolant_3d.h"
+#include "gil.h"
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 template<template<class, std::size_t, xt::layout_type> class T>
 class InterpolatedField : public MagneticField<T> {
@@ -14,18 +19,58 @@ class InterpolatedField : public MagneticField<T> {
         std::function<Vec(Vec, Vec, Vec)> fbatch_B;
         std::function<Vec(Vec, Vec, Vec)> fbatch_GradAbsB;
         std::function<std::vector<bool>(Vec, Vec, Vec)> skip;
-        shared_ptr<RegularGridInterpolant3D<Tensor2>> interp_B, interp_GradAbsB;
+        shared_ptr<Interpolant3D<Tensor2>> interp_B, interp_GradAbsB;
         bool status_B = false;
         bool status_GradAbsB = false;
         const bool extrapolate;
         const bool stellsym = false;
         const int nfp = 1;
         vector<bool> symmetries = vector<bool>(1, false);
+        std::string cache_prefix;
+        double adaptive_tol = 0.;
+        int max_refinement = 0;
+        size_t max_build_memory = size_t(1) << 30;
+        int value_bits = 64;
+        bool lazy = false;
+        bool analytic_gradient = false;
+        // copies of field for the additional threads that build the regular
+        // grid interpolants, see set_build_options
+        vector<shared_ptr<MagneticField<T>>> build_fields;
+
+        // the field that evaluates fbatch_B and fbatch_GradAbsB on the calling thread
+        MagneticField<T>& build_field() {
+#if defined(_OPENMP)
+            int thread = omp_get_thread_num();
+            if(thread > 0 && thread <= int(build_fields.size()))
+                return *build_fields[thread-1];
+#endif
+            return *field;
+        }
+
+        shared_ptr<Interpolant3D<Tensor2>> make_interpolant(const std::string& name) {
+            if(adaptive_tol > 0)
+                return std::make_shared<AdaptiveInterpolant3D<Tensor2>>(rule, r_range, phi_range, z_range, 3, extrapolate, adaptive_tol, max_refinement, skip);
+            auto interp = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, r_range, phi_range, z_range, 3, extrapolate, skip);
+            interp->set_build_options(max_build_memory, build_fields.size() + 1);
+            interp->set_value_bits(value_bits);
+            interp->set_lazy(lazy);
+            if(!cache_prefix.empty())
+                interp->set_cache_file(cache_prefix + "_" + name + ".rgi");
+            return interp;
+        }
+
+        // Evaluates the interpolant without the GIL. The cells of lazy
+        // interpolants are filled by fbatch_B and fbatch_GradAbsB, which
+        // reacquire it.
+        void evaluate_batch(Interpolant3D<Tensor2>& interp, Tensor2& rphiz, Tensor2& out) {
+            ReleaseGIL nogil;
+            interp.evaluate_batch(rphiz, out);
+        }
 
     protected:
         void _B_cyl_impl(Tensor2& B_cyl) override {
             if(!interp_B)
-                interp_B = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, r_range, phi_range, z_range, 3, extrapolate, skip);
+                interp_B = make_interpolant("B");
             if(!status_B) {
                 Tensor2 old_points = this->field->get_points_cart();
                 interp_B->interpolate_batch(fbatch_B);
@@ -36,16 +81,69 @@ class InterpolatedField : public MagneticField<T> {
                 Tensor2& rphiz = this->get_points_cyl_ref();
                 Tensor2& rphiz_sym = points_cyl_sym.get_or_create({npoints, 3});
                 exploit_symmetries_points(rphiz, rphiz_sym);
-                interp_B->evaluate_batch(rphiz_sym, B_cyl);
+                evaluate_batch(*interp_B, rphiz_sym, B_cyl);
                 apply_symmetries_to_B_cyl(B_cyl);
             } else {
-                interp_B->evaluate_batch(this->get_points_cyl_ref(), B_cyl);
+                evaluate_batch(*interp_B, this->get_points_cyl_ref(), B_cyl);
+            }
+        }
+
+        void build_B() {
+            if(!interp_B)
+                interp_B = make_interpolant("B");
+            if(!status_B) {
+                Tensor2 old_points = this->field->get_points_cart();
+                interp_B->interpolate_batch(fbatch_B);
+                this->field->set_points_cart(old_points);
+                status_B = true;
+            }
+        }
+
+        // the gradient of |B| in cylindrical components, given B_cyl and its
+        // derivatives with respect to r, phi and z at radius r
+        static void GradAbsB_cyl_from_dB(double r, const double* B_cyl, const double* dB_cyl, double* GradAbsB_cyl) {
+            double AbsB = std::sqrt(B_cyl[0]*B_cyl[0] + B_cyl[1]*B_cyl[1] + B_cyl[2]*B_cyl[2]);
+            double AbsBinv = AbsB > 0 ? 1./AbsB : 0.;
+            for (int d = 0; d < 3; ++d)
+                GradAbsB_cyl[d] = (B_cyl[0]*dB_cyl[d] + B_cyl[1]*dB_cyl[3+d] + B_cyl[2]*dB_cyl[6+d])*AbsBinv;
+            GradAbsB_cyl[1] /= r;
+        }
+
+        // computes GradAbsB_cyl by differentiating the interpolant of B, see
+        // set_analytic_gradient, and fills the cache of B_cyl with the values
+        // from the same lookup
+        void _GradAbsB_cyl_from_B(Tensor2& GradAbsB_cyl) {
+            build_B();
+            Tensor2& rphiz = this->get_points_cyl_ref();
+            bool symmetric = nfp > 1 || stellsym;
+            Tensor2& rphiz_sym = points_cyl_sym.get_or_create({npoints, 3});
+            if(symmetric)
+                exploit_symmetries_points(rphiz, rphiz_sym);
+            Tensor2& rphiz_eval = symmetric ? rphiz_sym : rphiz;
+            Tensor2* B_cyl_out = this->data_Bcyl.get_status() ? nullptr : &this->data_Bcyl.get_or_create({npoints, 3});
+            ReleaseGIL nogil;
+            for (int i = 0; i < npoints; ++i) {
+                double B_cyl[3] = {0., 0., 0.};
+                double dB_cyl[9] = {0., 0., 0., 0., 0., 0., 0., 0., 0.};
+                interp_B->evaluate_with_gradient_inplace(rphiz_eval(i, 0), rphiz_eval(i, 1), rphiz_eval(i, 2), B_cyl, dB_cyl);
+                GradAbsB_cyl_from_dB(rphiz(i, 0), B_cyl, dB_cyl, &GradAbsB_cyl(i, 0));
+                if(B_cyl_out) {
+                    for (int d = 0; d < 3; ++d)
+                        (*B_cyl_out)(i, d) = B_cyl[d];
+                }
+            }
+            if(symmetric) {
+                apply_symmetries_to_GradAbsB_cyl(GradAbsB_cyl);
+                if(B_cyl_out)
+                    apply_symmetries_to_B_cyl(*B_cyl_out);
             }
         }
 
         void _GradAbsB_cyl_impl(Tensor2& GradAbsB_cyl) override {
+            if(analytic_gradient)
+                return _GradAbsB_cyl_from_B(GradAbsB_cyl);
             if(!interp_GradAbsB)
-                interp_GradAbsB = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, r_range, phi_range, z_range, 3, extrapolate, skip);
+                interp_GradAbsB = make_interpolant("GradAbsB");
             if(!status_GradAbsB) {
                 Tensor2 old_points = this->field->get_points_cart();
                 interp_GradAbsB->interpolate_batch(fbatch_GradAbsB);
@@ -56,10 +154,10 @@ class InterpolatedField : public MagneticField<T> {
                 Tensor2& rphiz = this->get_points_cyl_ref();
                 Tensor2& rphiz_sym = points_cyl_sym.get_or_create({npoints, 3});
                 exploit_symmetries_points(rphiz, rphiz_sym);
-                interp_GradAbsB->evaluate_batch(rphiz_sym, GradAbsB_cyl);
+                evaluate_batch(*interp_GradAbsB, rphiz_sym, GradAbsB_cyl);
                 apply_symmetries_to_GradAbsB_cyl(GradAbsB_cyl);
             } else {
-                interp_GradAbsB->evaluate_batch(this->get_points_cyl_ref(), GradAbsB_cyl);
+                evaluate_batch(*interp_GradAbsB, this->get_points_cyl_ref(), GradAbsB_cyl);
             }
         }
 
@@ -150,7 +248,16 @@ class InterpolatedField : public MagneticField<T> {
             skip(skip)
              
         {
+            // In lazy mode, these are called while the interpolant is
+            // evaluated, with the GIL already acquired by LazyFillLock, so
+            // acquiring it here is a no-op.
+            // Otherwise they are called from interpolate_batch, whose
+            // additional threads must not wait for the GIL of the calling
+            // thread.
             fbatch_B = [this](Vec r, Vec phi, Vec z) {
+                std::optional<pybind11::gil_scoped_acquire> gil;
+                if(lazy)
+                    gil.emplace();
                 int npoints = r.size();
                 Tensor2 points = xt::zeros<double>({npoints, 3});
                 for(int i=0; i<npoints; i++) {
@@ -158,14 +265,18 @@ class InterpolatedField : public MagneticField<T> {
                     points(i, 1) = phi[i];
                     points(i, 2) = z[i];
                 }
-                this->field->set_points_cyl(points);
-                auto B_cyl = this->field->B_cyl();
+                MagneticField<T>& thread_field = this->build_field();
+                thread_field.set_points_cyl(points);
+                auto B_cyl = thread_field.B_cyl();
                 //fmt::print("B: Actual size: ({}, {}), 3*npoints={}\n", B.shape(0), B.shape(1), 3*npoints);
                 auto res = Vec(B_cyl.data(), B_cyl.data()+3*npoints);
                 return res;
             };
 
             fbatch_GradAbsB = [this](Vec r, Vec phi, Vec z) {
+                std::optional<pybind11::gil_scoped_acquire> gil;
+                if(lazy)
+                    gil.emplace();
                 int npoints = r.size();
                 Tensor2 points = xt::zeros<double>({npoints, 3});
                 for(int i=0; i<npoints; i++) {
@@ -173,8 +284,9 @@ class InterpolatedField : public MagneticField<T> {
                     points(i, 1) = phi[i];
                     points(i, 2) = z[i];
                 }
-                this->field->set_points_cyl(points);
-                auto GradAbsB_cyl = this->field->GradAbsB_cyl();
+                MagneticField<T>& thread_field = this->build_field();
+                thread_field.set_points_cyl(points);
+                auto GradAbsB_cyl = thread_field.GradAbsB_cyl();
                 //fmt::print("GradAbsB: Actual size: ({}, {}), 3*npoints={}\n", GradAbsB.shape(0), GradAbsB.shape(1), 3*npoints);
                 auto res = Vec(GradAbsB_cyl.data(), GradAbsB_cyl.data() + 3*npoints);
                 return res;
@@ -186,9 +298,175 @@ class InterpolatedField : public MagneticField<T> {
                 RangeTriplet r_range, RangeTriplet phi_range, RangeTriplet z_range,
                 bool extrapolate, int nfp, bool stellsym, std::function<std::vector<bool>(Vec, Vec, Vec)> skip) : InterpolatedField(field, UniformInterpolationRule(degree), r_range, phi_range, z_range, extrapolate, nfp, stellsym, skip) {}
 
+        // Caches the interpolants in the files prefix + "_B.rgi" and
+        // prefix + "_GradAbsB.rgi", see RegularGridInterpolant3D::set_cache_file.
+        // Only affects the interpolants that are created afterwards, so
+        // this has to be called before the field is evaluated.
+        void set_cache(const std::string& prefix) {
+            cache_prefix = prefix;
+        }
+
+        // Bounds the temporary memory for building each regular grid
+        // interpolant, and builds it on nthreads threads if the underlying
+        // field supports thread_copy, see
+        // RegularGridInterpolant3D::set_build_options. Otherwise the tiles are
+        // built one after another, and only the field itself may be parallel.
+        // Only affects the interpolants that are created afterwards.
+        void set_build_options(size_t max_memory, int nthreads) {
+            if(nthreads < 1)
+                throw std::invalid_argument("nthreads has to be positive.");
+            max_build_memory = max_memory;
+            build_fields.clear();
+            for (int i = 1; i < nthreads; ++i) {
+                auto copy = field->thread_copy();
+                if(!copy) {
+                    build_fields.clear();
+                    break;
+                }
+                build_fields.push_back(copy);
+            }
+        }
+
+        // Stores the values of the regular grid interpolants with 64, 32 or
+        // 16 bits, see RegularGridInterpolant3D::set_value_bits. Only affects
+        // the interpolants that are created afterwards.
+        void set_value_bits(int bits) {
+            if(bits != 64 && bits != 32 && bits != 16)
+                throw std::invalid_argument("bits has to be 64, 32 or 16.");
+            value_bits = bits;
+        }
+
+        // Only computes the cells of the regular grid interpolants that are
+        // actually evaluated, see RegularGridInterpolant3D::set_lazy. The
+        // underlying field is then evaluated, and its points are changed,
+        // whenever new cells are reached, also by the copies made by
+        // thread_copy. Only affects the interpolants that are created
+        // afterwards.
+        void set_lazy(bool lazy) {
+            this->lazy = lazy;
+        }
+
+        // Writes the regular grid interpolants to their cache files, see
+        // set_cache. In lazy mode, this persists the cells that are filled so
+        // far, and later instances with the same cache continue from there.
+        void save_cache() {
+            if(cache_prefix.empty())
+                throw std::runtime_error("No cache is set, see set_cache.");
+            auto save = [this](shared_ptr<Interpolant3D<Tensor2>>& interp, const std::string& name) {
+                auto regular = std::dynamic_pointer_cast<RegularGridInterpolant3D<Tensor2>>(interp);
+                if(regular && regular->num_filled() > 0)
+                    regular->save(cache_prefix + "_" + name + ".rgi");
+            };
+            save(interp_B, "B");
+            save(interp_GradAbsB, "GradAbsB");
+        }
+
+        // Computes GradAbsB from the derivatives of the interpolant of B, see
+        // RegularGridInterpolant3D::evaluate_with_gradient_inplace, instead of
+        // interpolating it separately. This halves the time and memory for
+        // building the interpolants, and B and GradAbsB are evaluated with a
+        // single lookup, but GradAbsB is one order less accurate and jumps
+        // across the faces of the cells. Only supported by the regular grid.
+        void set_analytic_gradient(bool analytic_gradient) {
+            this->analytic_gradient = analytic_gradient;
+        }
+
+        // Use an AdaptiveInterpolant3D instead of the regular grid: the cells
+        // given by r_range, phi_range and z_range are refined up to
+        // max_refinement times, until the estimated error is below tol
+        // relative to the largest value on the initial grid. The adaptive
+        // interpolants are not cached. As set_cache, this only affects the
+        // interpolants that are created afterwards.
+        void set_adaptive(double tol, int max_refinement) {
+            if(tol <= 0)
+                throw std::invalid_argument("tol has to be positive.");
+            this->adaptive_tol = tol;
+            this->max_refinement = max_refinement;
+        }
+
+        shared_ptr<MagneticField<T>> thread_copy() override {
+            // build the interpolants now, so that all copies share them and
+            // never have to evaluate the underlying field
+            if(!interp_B)
+                interp_B = make_interpolant("B");
+            if(!status_B) {
+                Tensor2 old_points = this->field->get_points_cart();
+                interp_B->interpolate_batch(fbatch_B);
+                this->field->set_points_cart(old_points);
+                status_B = true;
+            }
+            if(!interp_GradAbsB && !analytic_gradient)
+                interp_GradAbsB = make_interpolant("GradAbsB");
+            if(!status_GradAbsB && !analytic_gradient) {
+                Tensor2 old_points = this->field->get_points_cart();
+                interp_GradAbsB->interpolate_batch(fbatch_GradAbsB);
+                this->field->set_points_cart(old_points);
+                status_GradAbsB = true;
+            }
+            auto copy = std::make_shared<InterpolatedField<T>>(field, rule, r_range, phi_range, z_range, extrapolate, nfp, stellsym, skip);
+            copy->adaptive_tol = adaptive_tol;
+            copy->max_refinement = max_refinement;
+            copy->analytic_gradient = analytic_gradient;
+            copy->interp_B = interp_B;
+            copy->interp_GradAbsB = interp_GradAbsB;
+            copy->status_B = true;
+            copy->status_GradAbsB = status_GradAbsB;
+            return copy;
+        }
+
+        void evaluate_point(double x, double y, double z, double* B, double* GradAbsB) override {
+            // the first evaluation builds the interpolants through the cache
+            if(!status_B || (GradAbsB && !analytic_gradient && !status_GradAbsB))
+                return MagneticField<T>::evaluate_point(x, y, z, B, GradAbsB);
+            double r = std::sqrt(x*x+y*y);
+            double phi = std::atan2(y, x);
+            if(phi < 0)
+                phi += 2*M_PI;
+            phi = std::fmod(phi, 2*M_PI);
+            // same reduction to the fundamental domain as in exploit_symmetries_points
+            double period = (2*M_PI)/nfp;
+            double phi_sym = phi;
+            double z_sym = z;
+            bool symmetric = z < 0 && stellsym;
+            if(symmetric) {
+                z_sym = -z;
+                phi_sym = 2*M_PI-phi;
+            }
+            int phi_mult = int(phi_sym/period);
+            phi_sym = phi_sym - phi_mult * period;
+            double cosphi = std::cos(phi);
+            double sinphi = std::sin(phi);
+
+            double B_cyl[3] = {0., 0., 0.};
+            double GradAbsB_cyl[3] = {0., 0., 0.};
+            if(GradAbsB && analytic_gradient) {
+                double dB_cyl[9] = {0., 0., 0., 0., 0., 0., 0., 0., 0.};
+                interp_B->evaluate_with_gradient_inplace(r, phi_sym, z_sym, B_cyl, dB_cyl);
+                GradAbsB_cyl_from_dB(r, B_cyl, dB_cyl, GradAbsB_cyl);
+            } else {
+                interp_B->evaluate_inplace(r, phi_sym, z_sym, B_cyl);
+                if(GradAbsB)
+                    interp_GradAbsB->evaluate_inplace(r, phi_sym, z_sym, GradAbsB_cyl);
+            }
+            if(symmetric)
+                B_cyl[0] = -B_cyl[0];
+            B[0] = cosphi*B_cyl[0] - sinphi*B_cyl[1];
+            B[1] = sinphi*B_cyl[0] + cosphi*B_cyl[1];
+            B[2] = B_cyl[2];
+            if(GradAbsB) {
+                if(symmetric) {
+                    GradAbsB_cyl[1] = -GradAbsB_cyl[1];
+                    GradAbsB_cyl[2] = -GradAbsB_cyl[2];
+                }
+                GradAbsB[0] = cosphi*GradAbsB_cyl[0] - sinphi*GradAbsB_cyl[1];
+                GradAbsB[1] = sinphi*GradAbsB_cyl[0] + cosphi*GradAbsB_cyl[1];
+                GradAbsB[2] = GradAbsB_cyl[2];
+            }
+        }
+
         std::pair<double, double> estimate_error_B(int samples) {
             if(!interp_B)
-                interp_B = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, r_range, phi_range, z_range, 3, extrapolate, skip);
+                interp_B = make_interpolant("B");
             if(!status_B) {
                 Tensor2 old_points = this->field->get_points_cart();
                 interp_B->interpolate_batch(fbatch_B);
@@ -199,7 +477,7 @@ class InterpolatedField : public MagneticField<T> {
         }
         std::pair<double, double> estimate_error_GradAbsB(int samples) {
             if(!interp_GradAbsB)
-                interp_GradAbsB = std::make_shared<RegularGridInterpolant3D<Tensor2>>(rule, r_range, phi_range, z_range, 3, extrapolate, skip);
+                interp_GradAbsB = make_interpolant("GradAbsB");
             if(!status_GradAbsB) {
                 Tensor2 old_points = this->field->get_points_cart();
                 interp_GradAbsB->interpolate_batch(fbatch_GradAbsB);
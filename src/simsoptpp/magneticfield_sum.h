@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include "magneticfield.h"
+
+// Sum of magnetic fields. The points are passed on to all fields, and B, A
+// and their derivatives are the sums of the values of the fields.
+template<template<class, std::size_t, xt::layout_type> class T>
+class MagneticFieldSum : public MagneticField<T> {
+    public:
+        using typename MagneticField<T>::Tensor2;
+        using typename MagneticField<T>::Tensor3;
+        using typename MagneticField<T>::Tensor4;
+
+    private:
+        template<class Tensor, class Get>
+        void sum(Tensor& res, Get get) {
+            double* res_ptr = res.data();
+            std::fill(res_ptr, res_ptr + res.size(), 0.);
+            for (auto& field : fields) {
+                Tensor& val = get(*field);
+                if(val.size() != res.size())
+                    throw logic_error("The fields of the sum were evaluated at different points.");
+                const double* val_ptr = val.data();
+                for (size_t i = 0; i < res.size(); ++i)
+                    res_ptr[i] += val_ptr[i];
+            }
+        }
+
+    protected:
+        void _set_points_cb() override {
+            Tensor2& points = this->get_points_cart_ref();
+            for (auto& field : fields)
+                field->set_points_cart(points);
+        }
+
+        void _B_impl(Tensor2& B) override { sum(B, [](MagneticField<T>& f) -> Tensor2& { return f.B_ref(); }); }
+        void _dB_by_dX_impl(Tensor3& dB) override { sum(dB, [](MagneticField<T>& f) -> Tensor3& { return f.dB_by_dX_ref(); }); }
+        void _d2B_by_dXdX_impl(Tensor4& ddB) override { sum(ddB, [](MagneticField<T>& f) -> Tensor4& { return f.d2B_by_dXdX_ref(); }); }
+        void _A_impl(Tensor2& A) override { sum(A, [](MagneticField<T>& f) -> Tensor2& { return f.A_ref(); }); }
+        void _dA_by_dX_impl(Tensor3& dA) override { sum(dA, [](MagneticField<T>& f) -> Tensor3& { return f.dA_by_dX_ref(); }); }
+        void _d2A_by_dXdX_impl(Tensor4& ddA) override { sum(ddA, [](MagneticField<T>& f) -> Tensor4& { return f.d2A_by_dXdX_ref(); }); }
+
+    public:
+        const vector<shared_ptr<MagneticField<T>>> fields;
+
+        MagneticFieldSum(vector<shared_ptr<MagneticField<T>>> fields) : MagneticField<T>(), fields(fields) { }
+
+        shared_ptr<MagneticField<T>> thread_copy() override {
+            vector<shared_ptr<MagneticField<T>>> copies;
+            for (auto& field : fields) {
+                auto copy = field->thread_copy();
+                if(!copy)
+                    return nullptr;
+                copies.push_back(copy);
+            }
+            return make_shared<MagneticFieldSum<T>>(copies);
+        }
+};
+
+// A magnetic field multiplied by a scalar.
+template<template<class, std::size_t, xt::layout_type> class T>
+class MagneticFieldMultiply : public MagneticField<T> {
+    public:
+        using typename MagneticField<T>::Tensor2;
+        using typename MagneticField<T>::Tensor3;
+        using typename MagneticField<T>::Tensor4;
+
+    private:
+        template<class Tensor>
+        void scale(Tensor& res, const Tensor& val) {
+            if(val.size() != res.size())
+                throw logic_error("The field was evaluated at different points.");
+            double* res_ptr = res.data();
+            const double* val_ptr = val.data();
+            for (size_t i = 0; i < res.size(); ++i)
+                res_ptr[i] = scalar * val_ptr[i];
+        }
+
+    protected:
+        void _set_points_cb() override {
+            field->set_points_cart(this->get_points_cart_ref());
+        }
+
+        void _B_impl(Tensor2& B) override { scale(B, field->B_ref()); }
+        void _dB_by_dX_impl(Tensor3& dB) override { scale(dB, field->dB_by_dX_ref()); }
+        void _d2B_by_dXdX_impl(Tensor4& ddB) override { scale(ddB, field->d2B_by_dXdX_ref()); }
+        void _A_impl(Tensor2& A) override { scale(A, field->A_ref()); }
+        void _dA_by_dX_impl(Tensor3& dA) override { scale(dA, field->dA_by_dX_ref()); }
+        void _d2A_by_dXdX_impl(Tensor4& ddA) override { scale(ddA, field->d2A_by_dXdX_ref()); }
+
+    public:
+        const double scalar;
+        const shared_ptr<MagneticField<T>> field;
+
+        MagneticFieldMultiply(double scalar, shared_ptr<MagneticField<T>> field) : MagneticField<T>(), scalar(scalar), field(field) { }
+
+        shared_ptr<MagneticField<T>> thread_copy() override {
+            auto copy = field->thread_copy();
+            if(!copy)
+                return nullptr;
+            return make_shared<MagneticFieldMultiply<T>>(scalar, copy);
+        }
+};
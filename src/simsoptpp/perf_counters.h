@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Counters for the time spent in the major kernels of simsoptpp, so that a
+// breakdown can be logged from python without an external profiler, see
+// simsoptpp.perf_counters().
+//
+// Every counter records the number of calls, the number of items processed
+// (e.g. points, steps or iterations, see perf_counter_units) and the wall
+// time. Every thread writes to its own counters, so recording a call is a
+// few loads and stores without synchronisation. The counters of all threads
+// are summed when they are read, and the counters of threads that have
+// exited are kept in a separate total.
+//
+// Timers nest: the time of a call that is made from within another timed
+// call is included in both. The counters should be read and reset between
+// calls of the kernels, e.g. once per iteration of an optimisation, since
+// updates that happen concurrently with a reset may be lost.
+//
+// The instrumentation is compiled in if SIMSOPT_PERF_COUNTERS is defined
+// (the CMake option of the same name), otherwise SIMSOPT_PERF_SCOPE and
+// SIMSOPT_PERF_COUNT expand to nothing.
+
+enum class PerfCounter : int {
+    biot_savart_B,
+    biot_savart_A,
+    biot_savart_vjp,
+    interpolant_evaluate,
+    tracing,
+    tracing_rhs,
+    boozer_residual,
+    gpmo,
+    count
+};
+
+constexpr int num_perf_counters = int(PerfCounter::count);
+
+constexpr std::array<const char*, num_perf_counters> perf_counter_names = {
+    "biot_savart_B", "biot_savart_A", "biot_savart_vjp", "interpolant_evaluate",
+    "tracing", "tracing_rhs", "boozer_residual", "gpmo"
+};
+
+constexpr std::array<const char*, num_perf_counters> perf_counter_units = {
+    "points", "points", "points", "points",
+    "steps", "evaluations", "points", "iterations"
+};
+
+struct PerfValues {
+    int64_t calls = 0;
+    int64_t items = 0;
+    int64_t nanoseconds = 0;
+};
+
+using PerfSnapshot = std::array<PerfValues, num_perf_counters>;
+
+class PerfRegistry;
+
+// The counters of one thread. Only the owning thread adds to them, other
+// threads read and reset them, hence the relaxed atomics.
+class PerfThreadCounters {
+    private:
+        std::array<std::atomic<int64_t>, 3*num_perf_counters> values;
+
+        static void bump(std::atomic<int64_t>& value, int64_t n) {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+    public:
+        const int thread;
+
+        PerfThreadCounters();
+        ~PerfThreadCounters();
+        PerfThreadCounters(const PerfThreadCounters&) = delete;
+        PerfThreadCounters& operator=(const PerfThreadCounters&) = delete;
+
+        void add(PerfCounter counter, int64_t calls, int64_t items, int64_t nanoseconds) {
+            int c = int(counter);
+            bump(values[3*c], calls);
+            bump(values[3*c+1], items);
+            bump(values[3*c+2], nanoseconds);
+        }
+
+        void add_to(PerfSnapshot& snapshot) const {
+            for (int c = 0; c < num_perf_counters; ++c) {
+                snapshot[c].calls += values[3*c].load(std::memory_order_relaxed);
+                snapshot[c].items += values[3*c+1].load(std::memory_order_relaxed);
+                snapshot[c].nanoseconds += values[3*c+2].load(std::memory_order_relaxed);
+            }
+        }
+
+        void reset() {
+            for (auto& value : values)
+                value.store(0, std::memory_order_relaxed);
+        }
+};
+
+class PerfRegistry {
+    private:
+        std::mutex mutex;
+        std::vector<PerfThreadCounters*> threads;
+        PerfSnapshot exited = {};
+        int next_thread = 0;
+
+    public:
+        // never destroyed, since the threads of the OpenMP pool may exit
+        // after the static objects have been destroyed
+        static PerfRegistry& instance() {
+            static PerfRegistry* registry = new PerfRegistry();
+            return *registry;
+        }
+
+        int add(PerfThreadCounters* counters) {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(counters);
+            return next_thread++;
+        }
+
+        void remove(PerfThreadCounters* counters) {
+            std::lock_guard<std::mutex> lock(mutex);
+            counters->add_to(exited);
+            threads.erase(std::find(threads.begin(), threads.end(), counters));
+        }
+
+        // the counters of all threads that have recorded a call, by the
+        // number of the thread in the order of their first call, and the
+        // total of the threads that have exited under the number -1
+        std::vector<std::pair<int, PerfSnapshot>> per_thread() {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<std::pair<int, PerfSnapshot>> res;
+            for (auto counters : threads) {
+                PerfSnapshot snapshot = {};
+                counters->add_to(snapshot);
+                res.push_back({counters->thread, snapshot});
+            }
+            res.push_back({-1, exited});
+            return res;
+        }
+
+        PerfSnapshot total() {
+            PerfSnapshot res = {};
+            for (auto& [thread, snapshot] : per_thread()) {
+                for (int c = 0; c < num_perf_counters; ++c) {
+                    res[c].calls += snapshot[c].calls;
+                    res[c].items += snapshot[c].items;
+                    res[c].nanoseconds += snapshot[c].nanoseconds;
+                }
+            }
+            return res;
+        }
+
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto counters : threads)
+                counters->reset();
+            exited = {};
+        }
+};
+
+inline PerfThreadCounters::PerfThreadCounters() : values(), thread(PerfRegistry::instance().add(this)) {}
+
+inline PerfThreadCounters::~PerfThreadCounters() { PerfRegistry::instance().remove(this); }
+
+inline PerfThreadCounters& perf_thread_counters() {
+    thread_local PerfThreadCounters counters;
+    return counters;
+}
+
+inline void perf_count(PerfCounter counter, int64_t calls, int64_t items) {
+    perf_thread_counters().add(counter, calls, items, 0);
+}
+
+// Records one call with the given number of items and the time until the end
+// of the scope.
+class PerfScope {
+    private:
+        using clock = std::chrono::steady_clock;
+        PerfCounter counter;
+        int64_t items;
+        clock::time_point start;
+
+    public:
+        PerfScope(PerfCounter counter, int64_t items) : counter(counter), items(items), start(clock::now()) {}
+        PerfScope(const PerfScope&) = delete;
+        PerfScope& operator=(const PerfScope&) = delete;
+        ~PerfScope() {
+            int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+            perf_thread_counters().add(counter, 1, items, ns);
+        }
+};
+
+#define SIMSOPT_PERF_CONCAT_(a, b) a##b
+#define SIMSOPT_PERF_CONCAT(a, b) SIMSOPT_PERF_CONCAT_(a, b)
+
+#if defined(SIMSOPT_PERF_COUNTERS)
+// SIMSOPT_PERF_SCOPE(counter, items) times the rest of the enclosing scope as
+// one call of PerfCounter::counter, SIMSOPT_PERF_COUNT(counter, calls, items)
+// adds calls and items without a time.
+#define SIMSOPT_PERF_SCOPE(counter, items) PerfScope SIMSOPT_PERF_CONCAT(perf_scope_, __LINE__)(PerfCounter::counter, items)
+#define SIMSOPT_PERF_COUNT(counter, calls, items) perf_count(PerfCounter::counter, calls, items)
+constexpr bool perf_counters_enabled = true;
+#else
+#define SIMSOPT_PERF_SCOPE(counter, items) ((void)0)
+#define SIMSOPT_PERF_COUNT(counter, calls, items) ((void)0)
+constexpr bool perf_counters_enabled = false;
+#endif
@@ -1,10 +1,18 @@
 #include "permanent_magnet_optimization.h"
+#include "dipole_field.h"
 #include <Eigen/Dense>
 #include "simdhelpers.h"
 #include "vec3dsimd.h"
+#include "perf_counters.h"
+#include "gil.h"
 #include "xtensor/xsort.hpp"
 #include "xtensor/xview.hpp"
+#include "xtensor/xnoalias.hpp"
 #include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <type_traits>
 #include <vector>
 #include <math.h>
 
@@ -94,7 +102,206 @@ double find_max_alphaf(double x1, double x2, double x3, double p1, double p2, do
 
 // print out all the possible loss terms in the objective function
 // and record histories of the dipole moments, objective values, etc.
-void print_MwPGP(Array& A_obj, Array& b_obj, Array& x_k1, Array& m_proxy, Array& m_maxima, Array& m_history, Array& objective_history, Array& R2_history, int print_iter, int k, double nu, double reg_l0, double reg_l1, double reg_l2)
+// y = A x for the row-major (nrows, ncols) matrix A. A may be stored in single
+// precision to halve the memory traffic of the solvers, the products are
+// always accumulated in double precision.
+using PMRowMatrix = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+template<class T>
+void pm_matvec(const T* A, int nrows, int ncols, const double* x, double* y)
+{
+    if constexpr (std::is_same<T, double>::value) {
+        Eigen::Map<const PMRowMatrix> eigen_mat(A, nrows, ncols);
+        Eigen::Map<const PMRowMatrix> eigen_v(x, ncols, 1);
+        Eigen::Map<PMRowMatrix> eigen_res(y, nrows, 1);
+        eigen_res = eigen_mat*eigen_v;
+    } else {
+#pragma omp parallel for schedule(static)
+        for (int r = 0; r < nrows; ++r) {
+            const T* row = A + size_t(r) * ncols;
+            double acc = 0.0;
+            for (int c = 0; c < ncols; ++c)
+                acc += double(row[c]) * x[c];
+            y[r] = acc;
+        }
+    }
+}
+
+// The same product for A_obj, which is either a dense array or a
+// DipoleFieldOperator
+template<class AArray>
+void pm_apply(const AArray& A_obj, int nrows, int ncols, const double* x, double* y)
+{
+    pm_matvec(A_obj.data(), nrows, ncols, x, y);
+}
+
+void pm_apply(const DipoleFieldOperator& A_obj, int nrows, int ncols, const double* x, double* y)
+{
+    A_obj.apply(x, y);
+}
+
+// MwPGP works on blocks of mwpgp_block dipoles. The partial sums of every
+// block are computed by one thread and added up in order afterwards, so the
+// iterates don't depend on the number of threads.
+static constexpr int mwpgp_block = 256;
+
+// Partial sums of a block of dipoles in an iteration of MwPGP
+struct MwPGPSums {
+    double norm_g_alpha_p = 0.0;
+    double norm_phi_temp = 0.0;
+    double gp = 0.0;
+    double pATAp = 0.0;
+    double alpha_f = std::numeric_limits<double>::infinity();
+    double gamma = 0.0;
+    double x_sum = 0.0;
+
+    void add(const MwPGPSums& other) {
+        norm_g_alpha_p += other.norm_g_alpha_p;
+        norm_phi_temp += other.norm_phi_temp;
+        gp += other.gp;
+        pATAp += other.pATAp;
+        alpha_f = std::min(alpha_f, other.alpha_f);
+        gamma += other.gamma;
+        x_sum += other.x_sum;
+    }
+};
+
+MwPGPSums mwpgp_total(const vector<MwPGPSums>& block_sums)
+{
+    MwPGPSums total;
+    for (auto& sums : block_sums)
+        total.add(sums);
+    return total;
+}
+
+// Branch-free versions of projection_L2_balls, phi_MwPGP,
+// g_reduced_projected_gradient and find_max_alphaf for the 3-vectors of one
+// dipole, stored contiguously in the (N, 3) arrays. They are inlined into the
+// loops over the dipoles of MwPGP_algorithm, which can then be vectorized.
+static inline void mwpgp_projection(const double* y, double m_maxima, double* res)
+{
+    double denom = std::max(1.0, std::sqrt(y[0] * y[0] + y[1] * y[1] + y[2] * y[2]) / m_maxima);
+    for (int d = 0; d < 3; ++d)
+        res[d] = y[d] / denom;
+}
+
+static inline void mwpgp_phi(const double* x, const double* g, double m_maxima, double* res)
+{
+    double mmax2 = m_maxima * m_maxima;
+    double xmag2 = x[0] * x[0] + x[1] * x[1] + x[2] * x[2];
+    bool off_ball = std::abs(xmag2 - mmax2) > 1.0e-8 + 1.0e-5 * mmax2;
+    for (int d = 0; d < 3; ++d)
+        res[d] = off_ball ? g[d] : 0.0;
+}
+
+static inline void mwpgp_reduced_projected_gradient(const double* x, const double* g, double alpha, double m_maxima, double* res)
+{
+    double mmax2 = m_maxima * m_maxima;
+    double dist = x[0] * x[0] + x[1] * x[1] + x[2] * x[2];
+    double tol = 1.0e-8 + 1.0e-5 * mmax2;
+    // phi is g off the ball, beta_tilde is g or the reduced gradient on it
+    bool off_ball = std::abs(dist - mmax2) > tol;
+    bool on_ball = std::abs(dist - mmax2) < tol;
+    bool outward = (x[0] * g[0] + x[1] * g[1] + x[2] * g[2]) / std::sqrt(dist) > 0;
+    double y[3] = {x[0] - alpha * g[0], x[1] - alpha * g[1], x[2] - alpha * g[2]};
+    double proj[3];
+    mwpgp_projection(y, m_maxima, proj);
+    for (int d = 0; d < 3; ++d) {
+        double beta = outward ? g[d] : (x[d] - proj[d]) / alpha;
+        res[d] = (off_ball ? g[d] : 0.0) + (on_ball ? beta : 0.0);
+    }
+}
+
+static inline double mwpgp_max_alphaf(const double* x, const double* p, double m_maxima)
+{
+    double a = p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+    double c = x[0] * x[0] + x[1] * x[1] + x[2] * x[2] - m_maxima * m_maxima;
+    double b = - 2 * (x[0] * p[0] + x[1] * p[1] + x[2] * p[2]);
+    return a > 1e-20 ? (-b + std::sqrt(b * b - 4 * a * c)) / (2 * a) : 1e100;
+}
+
+// y = A^T (A x) for the row-major dense (nrows, ncols = 3N) matrix A, computed
+// by the threads of the enclosing parallel region, or by the calling thread
+// alone outside of one. The rows of Ax = A x are split between the threads,
+// then the 3 * mwpgp_block columns of every block b of dipoles are summed by
+// one thread streaming over the rows, which calls epilogue(b) right away
+// while that part of y is still in cache. Both passes work on four rows of A
+// at a time, which reuses the loads of x and y.
+template<class T, class F>
+void mwpgp_normal_matvec(const T* A, int nrows, int ncols, const double* x, double* Ax, double* y, F&& epilogue)
+{
+    int nquads = (nrows + 3) / 4;
+#pragma omp for schedule(static)
+    for (int q = 0; q < nquads; ++q) {
+        int r0 = 4 * q;
+        int nr = std::min(4, nrows - r0);
+        const T* rows[4];
+        for (int r = 0; r < 4; ++r)
+            rows[r] = A + size_t(r0 + std::min(r, nr - 1)) * ncols;
+        double acc0 = 0.0, acc1 = 0.0, acc2 = 0.0, acc3 = 0.0;
+#pragma omp simd reduction(+: acc0, acc1, acc2, acc3)
+        for (int c = 0; c < ncols; ++c) {
+            acc0 += double(rows[0][c]) * x[c];
+            acc1 += double(rows[1][c]) * x[c];
+            acc2 += double(rows[2][c]) * x[c];
+            acc3 += double(rows[3][c]) * x[c];
+        }
+        double acc[4] = {acc0, acc1, acc2, acc3};
+        for (int r = 0; r < nr; ++r)
+            Ax[r0 + r] = acc[r];
+    }
+    int chunk = 3 * mwpgp_block;
+    int nblocks = (ncols + chunk - 1) / chunk;
+#pragma omp for schedule(dynamic)
+    for (int b = 0; b < nblocks; ++b) {
+        int c0 = b * chunk;
+        int c1 = std::min(ncols, c0 + chunk);
+        for (int c = c0; c < c1; ++c)
+            y[c] = 0.0;
+        int r = 0;
+        for (; r + 4 <= nrows; r += 4) {
+            const T* row0 = A + size_t(r) * ncols;
+            const T* row1 = row0 + ncols;
+            const T* row2 = row1 + ncols;
+            const T* row3 = row2 + ncols;
+            double Ax0 = Ax[r], Ax1 = Ax[r + 1], Ax2 = Ax[r + 2], Ax3 = Ax[r + 3];
+#pragma omp simd
+            for (int c = c0; c < c1; ++c)
+                y[c] += double(row0[c]) * Ax0 + double(row1[c]) * Ax1 + double(row2[c]) * Ax2 + double(row3[c]) * Ax3;
+        }
+        for (; r < nrows; ++r) {
+            const T* row = A + size_t(r) * ncols;
+            double Axr = Ax[r];
+#pragma omp simd
+            for (int c = c0; c < c1; ++c)
+                y[c] += double(row[c]) * Axr;
+        }
+        epilogue(b);
+    }
+}
+
+// The same product for A_obj, which is either a dense array or a
+// DipoleFieldOperator. The products of the operator run in parallel regions
+// of their own, so MwPGP_algorithm calls them from outside of a parallel
+// region and the epilogues run on the calling thread.
+template<class AArray, class F>
+void mwpgp_normal_apply(const AArray& A_obj, int nrows, int ncols, const double* x, double* Ax, double* y, F&& epilogue)
+{
+    mwpgp_normal_matvec(A_obj.data(), nrows, ncols, x, Ax, y, epilogue);
+}
+
+template<class F>
+void mwpgp_normal_apply(const DipoleFieldOperator& A_obj, int nrows, int ncols, const double* x, double* Ax, double* y, F&& epilogue)
+{
+    A_obj.apply(x, Ax);
+    A_obj.apply_transpose(Ax, y);
+    int nblocks = (ncols / 3 + mwpgp_block - 1) / mwpgp_block;
+    for (int b = 0; b < nblocks; ++b)
+        epilogue(b);
+}
+
+template<class AArray>
+void print_MwPGP(AArray& A_obj, Array& b_obj, Array& x_k1, Array& m_proxy, Array& m_maxima, Array& m_history, Array& objective_history, Array& R2_history, int print_iter, int k, double nu, double reg_l0, double reg_l1, double reg_l2)
 {
     int ngrid = A_obj.shape(0);
     int N = m_maxima.shape(0);
@@ -105,7 +312,7 @@ void print_MwPGP(Array& A_obj, Array& b_obj, Array& x_k1, Array& m_proxy, Array&
     double L0 = 0.0;
     double cost = 0.0;
     double l0_tol = 1e-20;
-    Array R2_temp = xt::zeros<double>({ngrid});
+    vector<double> R2_temp(ngrid);
 #pragma omp parallel for reduction(+: N2, L2, L1, L0)
     for(int i = 0; i < N; ++i) {
 	for(int ii = 0; ii < 3; ++ii) {
@@ -119,13 +326,10 @@ void print_MwPGP(Array& A_obj, Array& b_obj, Array& x_k1, Array& m_proxy, Array&
 
     // Computation of R2 takes more work than the other loss terms... need to compute
     // the linear least-squares term.
-    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_mat(const_cast<double*>(A_obj.data()), ngrid, 3*N);
-    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_v(const_cast<double*>(x_k1.data()), 3*N, 1);
-    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_res(const_cast<double*>(R2_temp.data()), ngrid, 1);
-    eigen_res = eigen_mat*eigen_v;
+    pm_apply(A_obj, ngrid, 3*N, x_k1.data(), R2_temp.data());
 #pragma omp parallel for reduction(+: R2)
     for(int i = 0; i < ngrid; ++i) {
-	R2 += (R2_temp(i) - b_obj(i)) * (R2_temp(i) - b_obj(i));
+	R2 += (R2_temp[i] - b_obj(i)) * (R2_temp[i] - b_obj(i));
     }
 
     // rescale loss terms by the hyperparameters
@@ -149,25 +353,19 @@ void print_MwPGP(Array& A_obj, Array& b_obj, Array& x_k1, Array& m_proxy, Array&
 // See Bouchala, Jiří, et al.On the solution of convex QPQC
 // problems with elliptic and other separable constraints with
 // strong curvature. Applied Mathematics and Computation 247 (2014): 848-864.
-std::tuple<Array, Array, Array, Array> MwPGP_algorithm(Array& A_obj, Array& b_obj, Array& ATb, Array& m_proxy, Array& m0, Array& m_maxima, double alpha, double nu, double epsilon, double reg_l0, double reg_l1, double reg_l2, int max_iter, double min_fb, bool verbose)
+template<class AArray>
+std::tuple<Array, Array, Array, Array> MwPGP_algorithm(AArray& A_obj, Array& b_obj, Array& ATb, Array& m_proxy, Array& m0, Array& m_maxima, double alpha, double nu, double epsilon, double reg_l0, double reg_l1, double reg_l2, int max_iter, double min_fb, bool verbose)
 {
     // Needs ATb in shape (N, 3)
     int ngrid = A_obj.shape(0);
     int N = ATb.shape(0);
+    int nblocks = (N + mwpgp_block - 1) / mwpgp_block;
     int print_iter = 0;
-    double x_sum;
+    bool below_min_fb = false;
     Array g = xt::zeros<double>({N, 3});
     Array p = xt::zeros<double>({N, 3});
     Array ATAp = xt::zeros<double>({N, 3});
-
-    // define bunch of doubles, mostly for setting the std::tuples correctly
-    double norm_g_alpha_p, norm_phi_temp, gamma, gp, pATAp;
-    double g_alpha_p1, g_alpha_p2, g_alpha_p3, phi_temp1, phi_temp2, phi_temp3;
-    double phig1, phig2, phig3, p_temp1, p_temp2, p_temp3;
-    double alpha_cg, alpha_f;
-    vector<double> alpha_fs(N);
     Array x_k1 = m0;
-    Array x_k_prev;
 
     // record the history of the algorithm iterations
     Array m_history = xt::zeros<double>({N, 3, 21});
@@ -177,154 +375,281 @@ std::tuple<Array, Array, Array, Array> MwPGP_algorithm(Array& A_obj, Array& b_ob
     // Add contribution from relax-and-split term
     Array ATb_rs = ATb + m_proxy / nu;
 
-    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_mat(const_cast<double*>(A_obj.data()), ngrid, 3*N);
-
-    // Set up initial g and p Arrays
-    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_v(const_cast<double*>(m0.data()), 1, 3*N);
-    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_res(const_cast<double*>(g.data()), 1, 3*N);
-
-    // A^TA * m + contributions from L2 and relax-and-split terms
-    eigen_res = eigen_v*eigen_mat.transpose()*eigen_mat + 2 * eigen_v * (reg_l2 + 1.0 / (2.0 * nu));
+    double reg_nu = 2 * (reg_l2 + 1.0 / (2.0 * nu));
 
-    // subtract off A^T * b + m_proxy / nu for fully initialized g
-    g -= ATb_rs;
-
-    // initialize p as phi(m0, g)
-#pragma omp parallel for
-    for (int i = 0; i < N; ++i) {
-        std::tie(p(i, 0), p(i, 1), p(i, 2)) = phi_MwPGP(m0(i, 0), m0(i, 1), m0(i, 2), g(i, 0), g(i, 1), g(i, 2), m_maxima(i));
-    }
+    double* x_ptr = x_k1.data();
+    double* g_ptr = g.data();
+    double* p_ptr = p.data();
+    double* ATAp_ptr = ATAp.data();
+    const double* ATb_rs_ptr = ATb_rs.data();
+    vector<double> mmax(m_maxima.begin(), m_maxima.end());
+    // A p or A x, and the partial sums of the blocks of dipoles
+    vector<double> Ap(ngrid);
+    vector<MwPGPSums> step_sums(nblocks), update_sums(nblocks);
 
     // print out the names of the error columns
     if (verbose)
         printf("Iteration ... |Am - b|^2 ... |m-w|^2/v ...   a|m|^2 ...  b|m-1|^2 ...   c|m|_1 ...   d|m|_0 ... Total Error:\n");
 
-    // Main loop over the optimization iterations
-    for (int k = 0; k < max_iter; ++k) {
-
-	      x_k_prev = x_k1;
+    // Run by every thread of the parallel region below. All threads take the
+    // same steps, since they decide on them from the same sums.
+    auto iterate = [&]() {
+        // g = A^T A x + contributions from L2 and relax-and-split terms
+        // - (A^T * b + m_proxy / nu) and p = phi(x, g) on block b, once
+        // A^T A x has been written to g
+        auto update_gradient = [&](int b) {
+            int i1 = std::min(N, (b + 1) * mwpgp_block);
+#pragma omp simd
+            for (int i = b * mwpgp_block; i < i1; ++i) {
+                for (int d = 0; d < 3; ++d)
+                    g_ptr[3 * i + d] = (g_ptr[3 * i + d] + reg_nu * x_ptr[3 * i + d]) - ATb_rs_ptr[3 * i + d];
+                mwpgp_phi(&x_ptr[3 * i], &g_ptr[3 * i], mmax[i], &p_ptr[3 * i]);
+            }
+        };
 
         // compute L2 norm of reduced g and L2 norm of phi(x, g)
-        // as well as some dot products needed for the algorithm
-        norm_g_alpha_p = 0.0;
-        norm_phi_temp = 0.0;
-        gp = 0.0;
-        pATAp = 0.0;
-        ATAp = xt::zeros<double>({N, 3});
-        Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_v(const_cast<double*>(p.data()), 1, 3*N);
-        Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_res(const_cast<double*>(ATAp.data()), 1, 3*N);
-        eigen_res = eigen_v*eigen_mat.transpose()*eigen_mat + 2 * eigen_v * (reg_l2 + 1.0 / (2.0 * nu));
-#pragma omp parallel for reduction(+: norm_g_alpha_p, norm_phi_temp, gp, pATAp) private(phi_temp1, phi_temp2, phi_temp3, g_alpha_p1, g_alpha_p2, g_alpha_p3)
-        for(int i = 0; i < N; ++i) {
-            std::tie(g_alpha_p1, g_alpha_p2, g_alpha_p3) = g_reduced_projected_gradient(x_k1(i, 0), x_k1(i, 1), x_k1(i, 2), g(i, 0), g(i, 1), g(i, 2), alpha, m_maxima(i));
-            std::tie(phi_temp1, phi_temp2, phi_temp3) = phi_MwPGP(x_k1(i, 0), x_k1(i, 1), x_k1(i, 2), g(i, 0), g(i, 1), g(i, 2), m_maxima(i));
-	    norm_g_alpha_p += g_alpha_p1 * g_alpha_p1 + g_alpha_p2 * g_alpha_p2 + g_alpha_p3 * g_alpha_p3;
-            norm_phi_temp += phi_temp1 * phi_temp1 + phi_temp2 * phi_temp2 + phi_temp3 * phi_temp3;
-	    gp += g(i, 0) * p(i, 0) + g(i, 1) * p(i, 1) + g(i, 2) * p(i, 2);
-            alpha_fs[i] = find_max_alphaf(x_k1(i, 0), x_k1(i, 1), x_k1(i, 2), p(i, 0), p(i, 1), p(i, 2), m_maxima(i));
-            pATAp += p(i, 0) * ATAp(i, 0) + p(i, 1) * ATAp(i, 1) + p(i, 2) * ATAp(i, 2);
-        }
-
-        // compute step sizes for different descent step types
-	auto max_i = std::min_element(alpha_fs.begin(), alpha_fs.end());
-        alpha_f = *max_i;
-        alpha_cg = gp / pATAp;
-
-        // based on these norms, decide what kind of a descent step to take
-        if (norm_g_alpha_p <= norm_phi_temp) {
-            if (alpha_cg < alpha_f) {
-                // Take a conjugate gradient step
-#pragma omp parallel for
-                for (int i = 0; i < N; ++i) {
-                    for (int ii = 0; ii < 3; ++ii) {
-                        x_k1(i, ii) += - alpha_cg * p(i, ii);
-                        g(i, ii) += - alpha_cg * ATAp(i, ii);
-                    }
+        // as well as some dot products needed for the algorithm on block b,
+        // once A^T A p has been written to ATAp
+        auto step_sizes = [&](int b) {
+            int i1 = std::min(N, (b + 1) * mwpgp_block);
+            double norm_g_alpha_p = 0.0, norm_phi_temp = 0.0, gp = 0.0, pATAp = 0.0;
+            double alpha_f = std::numeric_limits<double>::infinity();
+#pragma omp simd reduction(+: norm_g_alpha_p, norm_phi_temp, gp, pATAp) reduction(min: alpha_f)
+            for (int i = b * mwpgp_block; i < i1; ++i) {
+                const double* xi = &x_ptr[3 * i];
+                const double* gi = &g_ptr[3 * i];
+                const double* pi = &p_ptr[3 * i];
+                double* ATApi = &ATAp_ptr[3 * i];
+                double g_alpha_p[3], phi_temp[3];
+                for (int d = 0; d < 3; ++d)
+                    ATApi[d] += reg_nu * pi[d];
+                mwpgp_reduced_projected_gradient(xi, gi, alpha, mmax[i], g_alpha_p);
+                mwpgp_phi(xi, gi, mmax[i], phi_temp);
+                for (int d = 0; d < 3; ++d) {
+                    norm_g_alpha_p += g_alpha_p[d] * g_alpha_p[d];
+                    norm_phi_temp += phi_temp[d] * phi_temp[d];
+                    gp += gi[d] * pi[d];
+                    pATAp += pi[d] * ATApi[d];
                 }
-
-                // compute gamma step size
-                gamma = 0.0;
-#pragma omp parallel for reduction(+: gamma) private(phig1, phig2, phig3)
-                for (int i = 0; i < N; ++i) {
-                    std::tie(phig1, phig2, phig3) = phi_MwPGP(x_k1(i, 0), x_k1(i, 1), x_k1(i, 2), g(i, 0), g(i, 1), g(i, 2), m_maxima(i));
-                    gamma += (phig1 * ATAp(i, 0) + phig2 * ATAp(i, 1) + phig3 * ATAp(i, 2));
+                alpha_f = std::min(alpha_f, mwpgp_max_alphaf(xi, pi, mmax[i]));
+            }
+            MwPGPSums& sums = step_sums[b];
+            sums.norm_g_alpha_p = norm_g_alpha_p;
+            sums.norm_phi_temp = norm_phi_temp;
+            sums.gp = gp;
+            sums.pATAp = pATAp;
+            sums.alpha_f = alpha_f;
+        };
+
+        // Set up initial g and p Arrays
+        mwpgp_normal_apply(A_obj, ngrid, 3*N, x_ptr, Ap.data(), g_ptr, update_gradient);
+
+        for (int k = 0; k < max_iter; ++k) {
+            mwpgp_normal_apply(A_obj, ngrid, 3*N, p_ptr, Ap.data(), ATAp_ptr, step_sizes);
+            MwPGPSums sums = mwpgp_total(step_sums);
+
+            // compute step sizes for different descent step types
+            double alpha_f = sums.alpha_f;
+            double alpha_cg = sums.gp / sums.pATAp;
+
+            // based on these norms, decide what kind of a descent step to take.
+            // The change of x is summed up for the convergence check.
+            if (sums.norm_g_alpha_p <= sums.norm_phi_temp && alpha_cg < alpha_f) {
+                // Take a conjugate gradient step and compute gamma step size
+#pragma omp for schedule(static)
+                for (int b = 0; b < nblocks; ++b) {
+                    int i1 = std::min(N, (b + 1) * mwpgp_block);
+                    double gamma = 0.0, x_sum = 0.0;
+#pragma omp simd reduction(+: gamma, x_sum)
+                    for (int i = b * mwpgp_block; i < i1; ++i) {
+                        double phig[3];
+                        for (int d = 0; d < 3; ++d) {
+                            double x_prev = x_ptr[3 * i + d];
+                            x_ptr[3 * i + d] += - alpha_cg * p_ptr[3 * i + d];
+                            g_ptr[3 * i + d] += - alpha_cg * ATAp_ptr[3 * i + d];
+                            x_sum += std::abs(x_ptr[3 * i + d] - x_prev);
+                        }
+                        mwpgp_phi(&x_ptr[3 * i], &g_ptr[3 * i], mmax[i], phig);
+                        for (int d = 0; d < 3; ++d)
+                            gamma += phig[d] * ATAp_ptr[3 * i + d];
+                    }
+                    update_sums[b].gamma = gamma;
+                    update_sums[b].x_sum = x_sum;
                 }
-                gamma = gamma / pATAp;
+                double gamma = mwpgp_total(update_sums).gamma / sums.pATAp;
 
                 // update p
-#pragma omp parallel for private(p_temp1, p_temp2, p_temp3)
-                for (int i = 0; i < N; ++i) {
-                    std::tie(p_temp1, p_temp2, p_temp3) = phi_MwPGP(x_k1(i, 0), x_k1(i, 1), x_k1(i, 2), g(i, 0), g(i, 1), g(i, 2), m_maxima(i));
-                    p(i, 0) = p_temp1 - gamma * p(i, 0);
-                    p(i, 1) = p_temp2 - gamma * p(i, 1);
-                    p(i, 2) = p_temp3 - gamma * p(i, 2);
+#pragma omp for schedule(static)
+                for (int b = 0; b < nblocks; ++b) {
+                    int i1 = std::min(N, (b + 1) * mwpgp_block);
+#pragma omp simd
+                    for (int i = b * mwpgp_block; i < i1; ++i) {
+                        double p_temp[3];
+                        mwpgp_phi(&x_ptr[3 * i], &g_ptr[3 * i], mmax[i], p_temp);
+                        for (int d = 0; d < 3; ++d)
+                            p_ptr[3 * i + d] = p_temp[d] - gamma * p_ptr[3 * i + d];
+                    }
                 }
             }
             else {
-                // Take a mixed projected gradient step
-#pragma omp parallel for
-                for (int i = 0; i < N; ++i) {
-                    std::tie(x_k1(i, 0), x_k1(i, 1), x_k1(i, 2)) = projection_L2_balls((x_k1(i, 0) - alpha_f * p(i, 0)) - alpha * (g(i, 0) - alpha_f * ATAp(i, 0)), (x_k1(i, 1) - alpha_f * p(i, 1)) - alpha * (g(i, 1) - alpha_f * ATAp(i, 1)), (x_k1(i, 2) - alpha_f * p(i, 2)) - alpha * (g(i, 2) - alpha_f * ATAp(i, 2)), m_maxima(i));
+                // Take a mixed projected gradient step, or a projected
+                // gradient descent step if the norm of the reduced gradient
+                // is larger
+                bool mixed = sums.norm_g_alpha_p <= sums.norm_phi_temp;
+#pragma omp for schedule(static)
+                for (int b = 0; b < nblocks; ++b) {
+                    int i1 = std::min(N, (b + 1) * mwpgp_block);
+                    double x_sum = 0.0;
+#pragma omp simd reduction(+: x_sum)
+                    for (int i = b * mwpgp_block; i < i1; ++i) {
+                        double y[3], x_new[3];
+                        for (int d = 0; d < 3; ++d) {
+                            int id = 3 * i + d;
+                            y[d] = mixed ? (x_ptr[id] - alpha_f * p_ptr[id]) - alpha * (g_ptr[id] - alpha_f * ATAp_ptr[id]) : x_ptr[id] - alpha * g_ptr[id];
+                        }
+                        mwpgp_projection(y, mmax[i], x_new);
+                        for (int d = 0; d < 3; ++d) {
+                            x_sum += std::abs(x_new[d] - x_ptr[3 * i + d]);
+                            x_ptr[3 * i + d] = x_new[d];
+                        }
+                    }
+                    update_sums[b].x_sum = x_sum;
                 }
 
                 // update g and p
-                Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_v(const_cast<double*>(x_k1.data()), 1, 3*N);
-                Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_res(const_cast<double*>(g.data()), 1, 3*N);
-                eigen_res = eigen_v*eigen_mat.transpose()*eigen_mat + 2 * eigen_v * (reg_l2 + 1.0 / (2.0 * nu));
-#pragma omp parallel for
-                for (int i = 0; i < N; ++i) {
-                    for (int jj = 0; jj < 3; ++jj) {
-                        g(i, jj) += - ATb_rs(i, jj);
-                    }
-                    std::tie(p(i, 0), p(i, 1), p(i, 2)) = phi_MwPGP(x_k1(i, 0), x_k1(i, 1), x_k1(i, 2), g(i, 0), g(i, 1), g(i, 2), m_maxima(i));
-                }
-            }
-        }
-        else {
-            // projected gradient descent method
-#pragma omp parallel for
-            for (int i = 0; i < N; ++i) {
-                std::tie(x_k1(i, 0), x_k1(i, 1), x_k1(i, 2)) = projection_L2_balls(x_k1(i, 0) - alpha * g(i, 0), x_k1(i, 1) - alpha * g(i, 1), x_k1(i, 2) - alpha * g(i, 2), m_maxima(i));
+                mwpgp_normal_apply(A_obj, ngrid, 3*N, x_ptr, Ap.data(), g_ptr, update_gradient);
             }
 
-            // update g and p
-            Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_v(const_cast<double*>(x_k1.data()), 1, 3*N);
-            Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_res(const_cast<double*>(g.data()), 1, 3*N);
-            eigen_res = eigen_v*eigen_mat.transpose()*eigen_mat + 2 * eigen_v * (reg_l2 + 1.0 / (2.0 * nu));
-#pragma omp parallel for
-            for (int i = 0; i < N; ++i) {
-                for (int jj = 0; jj < 3; ++jj) {
-                    g(i, jj) += - ATb_rs(i, jj);
+            // fairly convoluted way to print every ~ max_iter / 20 iterations
+            if (verbose && ((k % (int(max_iter / 5.0)) == 0) || k == 0 || k == max_iter - 1)) {
+#pragma omp single
+                {
+                    print_MwPGP(A_obj, b_obj, x_k1, m_proxy, m_maxima, m_history, objective_history, R2_history, print_iter, k, nu, reg_l0, reg_l1, reg_l2);
+                    below_min_fb = R2_history(print_iter) < min_fb;
+                    if (!below_min_fb)
+                        print_iter += 1;
                 }
-                std::tie(p(i, 0), p(i, 1), p(i, 2)) = phi_MwPGP(x_k1(i, 0), x_k1(i, 1), x_k1(i, 2), g(i, 0), g(i, 1), g(i, 2), m_maxima(i));
+                if (below_min_fb) break;
             }
-        }
 
-	// fairly convoluted way to print every ~ max_iter / 20 iterations
-        if (verbose && ((k % (int(max_iter / 5.0)) == 0) || k == 0 || k == max_iter - 1)) {
-	    print_MwPGP(A_obj, b_obj, x_k1, m_proxy, m_maxima, m_history, objective_history, R2_history, print_iter, k, nu, reg_l0, reg_l1, reg_l2);
-	    if (R2_history(print_iter) < min_fb) break;
-            print_iter += 1;
-	}
-
-	// check if converged
-	x_sum = 0;
-#pragma omp parallel for
-        for (int i = 0; i < N; ++i) {
-            for (int ii = 0; ii < 3; ++ii) {
-                x_sum += abs(x_k1(i, ii) - x_k_prev(i, ii));
-	    }
-	}
-	if (x_sum < epsilon) {
-            printf("MwPGP algorithm ended early, at iteration %d\n", k);
-	    break;
-	}
+            // check if converged
+            if (mwpgp_total(update_sums).x_sum < epsilon) {
+#pragma omp master
+                printf("MwPGP algorithm ended early, at iteration %d\n", k);
+                break;
+            }
+        }
+    };
+
+    // Main loop over the optimization iterations, which doesn't create any
+    // arrays, so that the GIL can be released. For a dense A_obj the whole
+    // solve runs in a single parallel region, the threads only synchronize
+    // at the end of the worksharing loops over the rows and blocks. The
+    // matrix-free DipoleFieldOperator parallelizes its own products, which
+    // take far longer than the O(N) updates of the vectors, so those run on
+    // the calling thread.
+    ReleaseGIL nogil;
+    if constexpr (std::is_same<AArray, DipoleFieldOperator>::value) {
+        iterate();
+    } else {
+#pragma omp parallel
+        iterate();
     }
+    // the returned tuple copies the arrays
+    nogil.reacquire();
     return std::make_tuple(objective_history, R2_history, m_history, x_k1);
 }
 
 
 // fairly convoluted way to print every ~ K / nhistory iterations
+// Adds the squared residuals sum_i (Aij_mj_i +- A_ij)^2 of placing dipole
+// component j with either orientation to R2 and R2minus. In double precision
+// the sums are evaluated strictly in order, as they always have been. If
+// A_obj is stored in single precision the conversion would otherwise keep
+// the loop from vectorizing, so the reduction is vectorized instead; the sums
+// are still accumulated in double precision.
+template<class T>
+inline void gpmo_candidate_R2(const double* Aij_mj_ptr, const T* Aj_ptr, int ngrid, double& R2, double& R2minus)
+{
+    if constexpr (std::is_same<T, double>::value) {
+        for(int i = 0; i < ngrid; ++i) {
+            R2 += (Aij_mj_ptr[i] + Aj_ptr[i]) * (Aij_mj_ptr[i] + Aj_ptr[i]);
+            R2minus += (Aij_mj_ptr[i] - Aj_ptr[i]) * (Aij_mj_ptr[i] - Aj_ptr[i]);
+        }
+    } else {
+        double sum = 0.0, sum_minus = 0.0;
+#pragma omp simd reduction(+: sum, sum_minus)
+        for(int i = 0; i < ngrid; ++i) {
+            double a = Aj_ptr[i];
+            sum += (Aij_mj_ptr[i] + a) * (Aij_mj_ptr[i] + a);
+            sum_minus += (Aij_mj_ptr[i] - a) * (Aij_mj_ptr[i] - a);
+        }
+        R2 += sum;
+        R2minus += sum_minus;
+    }
+}
+
+// GPMO works on the rows A_j of A_obj in the transposed layout, with shape
+// (3N, ngrid). A DipoleFieldOperator always represents the (ngrid, 3N) matrix
+// of dipole_field_Bn and has no stored rows, they are computed on the fly and
+// the candidates are only scored with the incremental bookkeeping below.
+template<class AArray>
+int gpmo_ngrid(AArray& A_obj) { return A_obj.shape(1); }
+
+int gpmo_ngrid(DipoleFieldOperator& A_obj) { return A_obj.shape(0); }
+
+template<class AArray>
+int gpmo_N3(AArray& A_obj) { return A_obj.shape(0); }
+
+int gpmo_N3(DipoleFieldOperator& A_obj) { return A_obj.shape(1); }
+
+template<class AArray>
+const typename AArray::value_type* gpmo_rows(AArray& A_obj) { return &(A_obj(0, 0)); }
+
+const double* gpmo_rows(DipoleFieldOperator& A_obj) { return nullptr; }
+
+// y += sign * A_j
+template<class AArray>
+void gpmo_add_row(AArray& A_obj, int j, double sign, double* y, int ngrid)
+{
+    const auto* Aj = gpmo_rows(A_obj) + size_t(j) * ngrid;
+#pragma omp parallel for schedule(static)
+    for(int i = 0; i < ngrid; ++i) {
+        y[i] += sign * Aj[i];
+    }
+}
+
+void gpmo_add_row(DipoleFieldOperator& A_obj, int j, double sign, double* y, int ngrid)
+{
+    vector<double> Aj(ngrid);
+    A_obj.column(j, Aj.data());
+    for(int i = 0; i < ngrid; ++i) {
+        y[i] += sign * Aj[i];
+    }
+}
+
+// y -= sign1 * A_j1 + sign2 * A_j2
+template<class AArray>
+void gpmo_subtract_rows(AArray& A_obj, int j1, double sign1, int j2, double sign2, double* y, int ngrid)
+{
+    const auto* Aj1 = gpmo_rows(A_obj) + size_t(j1) * ngrid;
+    const auto* Aj2 = gpmo_rows(A_obj) + size_t(j2) * ngrid;
+#pragma omp parallel for schedule(static)
+    for(int i = 0; i < ngrid; ++i) {
+        y[i] -= sign1 * Aj1[i] + sign2 * Aj2[i];
+    }
+}
+
+void gpmo_subtract_rows(DipoleFieldOperator& A_obj, int j1, double sign1, int j2, double sign2, double* y, int ngrid)
+{
+    vector<double> Aj1(ngrid), Aj2(ngrid);
+    A_obj.column(j1, Aj1.data());
+    A_obj.column(j2, Aj2.data());
+    for(int i = 0; i < ngrid; ++i) {
+        y[i] -= sign1 * Aj1[i] + sign2 * Aj2[i];
+    }
+}
+
 void print_GPMO(int k, int ngrid, int& print_iter, Array& x, double* Aij_mj_ptr, Array& objective_history, Array& Bn_history, Array& m_history, double mmax_sum, double* normal_norms_ptr) 
 {	
     int N = x.shape(0);
@@ -350,40 +675,347 @@ void print_GPMO(int k, int ngrid, int& print_iter, Array& x, double* Aij_mj_ptr,
     return;
 }
 
+// k-d tree over the dipole grid for the nearest neighbour search in
+// connectivity_matrix. The dipoles are split at the median of the coordinate
+// with the largest extent, and every node stores the bounding box of its
+// dipoles, which is used to skip nodes that are farther away than the
+// current Nneighbors-th closest dipole.
+class DipoleKDTree {
+    private:
+        struct Node {
+            int lo, hi;
+            int left, right;
+            double lower[3], upper[3];
+        };
+        static constexpr int leafsize = 8;
+        const double* xyz;
+        vector<int> perm;
+        vector<Node> nodes;
+
+        int build(int lo, int hi) {
+            Node node;
+            node.lo = lo;
+            node.hi = hi;
+            node.left = -1;
+            node.right = -1;
+            for (int d = 0; d < 3; ++d) {
+                node.lower[d] = xyz[3 * perm[lo] + d];
+                node.upper[d] = node.lower[d];
+            }
+            for (int i = lo; i < hi; ++i) {
+                for (int d = 0; d < 3; ++d) {
+                    node.lower[d] = std::min(node.lower[d], xyz[3 * perm[i] + d]);
+                    node.upper[d] = std::max(node.upper[d], xyz[3 * perm[i] + d]);
+                }
+            }
+            int idx = nodes.size();
+            nodes.push_back(node);
+            if (hi - lo > leafsize) {
+                int axis = 0;
+                for (int d = 1; d < 3; ++d) {
+                    if (node.upper[d] - node.lower[d] > node.upper[axis] - node.lower[axis])
+                        axis = d;
+                }
+                int mid = lo + (hi - lo) / 2;
+                std::nth_element(perm.begin() + lo, perm.begin() + mid, perm.begin() + hi, [&](int i, int j) {
+                        return xyz[3 * i + axis] < xyz[3 * j + axis];
+                    });
+                int left = build(lo, mid);
+                int right = build(mid, hi);
+                nodes[idx].left = left;
+                nodes[idx].right = right;
+            }
+            return idx;
+        }
+
+        // lower bound for the distance between dipole j and the dipoles in node
+        double box_distance(const Node& node, int j) const {
+            double dist2 = 0.0;
+            for (int d = 0; d < 3; ++d) {
+                double xj = xyz[3 * j + d];
+                double delta = 0.0;
+                if (xj < node.lower[d]) delta = node.lower[d] - xj;
+                else if (xj > node.upper[d]) delta = xj - node.upper[d];
+                dist2 += delta * delta;
+            }
+            return sqrt(dist2);
+        }
+
+    public:
+        DipoleKDTree(const double* xyz, int Ndipole) : xyz(xyz), perm(Ndipole) {
+            for (int i = 0; i < Ndipole; ++i)
+                perm[i] = i;
+            nodes.reserve(4 * (Ndipole / leafsize + 1));
+            if (Ndipole > 0)
+                build(0, Ndipole);
+        }
+
+        // Writes the indices of the k dipoles closest to dipole j (including
+        // j itself) into out, sorted by distance with ties broken by the index
+        // as in a brute force search. heap and stack are scratch space.
+        void nearest(int j, int k, int* out, vector<std::pair<double, int>>& heap, vector<int>& stack) const {
+            heap.clear();
+            stack.clear();
+            stack.push_back(0);
+            while (!stack.empty()) {
+                const Node& node = nodes[stack.back()];
+                stack.pop_back();
+                // nodes at the same distance may contain dipoles with a smaller index
+                if ((int) heap.size() == k && box_distance(node, j) > heap.front().first)
+                    continue;
+                if (node.left < 0) {
+                    for (int ii = node.lo; ii < node.hi; ++ii) {
+                        int i = perm[ii];
+                        std::pair<double, int> candidate(sqrt((xyz[3 * i] - xyz[3 * j]) * (xyz[3 * i] - xyz[3 * j]) + (xyz[3 * i + 1] - xyz[3 * j + 1]) * (xyz[3 * i + 1] - xyz[3 * j + 1]) + (xyz[3 * i + 2] - xyz[3 * j + 2]) * (xyz[3 * i + 2] - xyz[3 * j + 2])), i);
+                        if ((int) heap.size() < k) {
+                            heap.push_back(candidate);
+                            std::push_heap(heap.begin(), heap.end());
+                        }
+                        else if (candidate < heap.front()) {
+                            std::pop_heap(heap.begin(), heap.end());
+                            heap.back() = candidate;
+                            std::push_heap(heap.begin(), heap.end());
+                        }
+                    }
+                }
+                else {
+                    // visit the closer child first
+                    double dleft = box_distance(nodes[node.left], j);
+                    double dright = box_distance(nodes[node.right], j);
+                    if (dleft <= dright) {
+                        stack.push_back(node.right);
+                        stack.push_back(node.left);
+                    }
+                    else {
+                        stack.push_back(node.left);
+                        stack.push_back(node.right);
+                    }
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end());
+            for (int c = 0; c < (int) heap.size(); ++c)
+                out[c] = heap[c].second;
+        }
+};
+
 // compute which dipoles are directly adjacent to every dipole
-Array connectivity_matrix(Array& dipole_grid_xyz, int Nadjacent)
+Array connectivity_matrix(Array& dipole_grid_xyz, int Nadjacent, int Nneighbors)
 {
+    if (dipole_grid_xyz.layout() != xt::layout_type::row_major)
+        throw std::runtime_error("dipole_grid_xyz needs to be in row-major storage order");
+    if (Nneighbors < Nadjacent)
+        throw std::invalid_argument("Nneighbors needs to be at least Nadjacent.");
     int Ndipole = dipole_grid_xyz.shape(0);
-    Array connectivity_inds = xt::zeros<int>({Ndipole, 2000});
-    
-    // Compute distances between dipole j and all other dipoles
-    // By default computes distance between dipole j and itself
-#pragma omp parallel for schedule(static)
-    for (int j = 0; j < Ndipole; ++j) {
-	vector<double> dist_ij(Ndipole, 1e10);
-        for (int i = 0; i < Ndipole; ++i) {
-	     dist_ij[i] = sqrt((dipole_grid_xyz(i, 0) - dipole_grid_xyz(j, 0)) * (dipole_grid_xyz(i, 0) - dipole_grid_xyz(j, 0)) + (dipole_grid_xyz(i, 1) - dipole_grid_xyz(j, 1)) * (dipole_grid_xyz(i, 1) - dipole_grid_xyz(j, 1)) + (dipole_grid_xyz(i, 2) - dipole_grid_xyz(j, 2)) * (dipole_grid_xyz(i, 2) - dipole_grid_xyz(j, 2)));
-	}
-        for (int k = 0; k < 2000; ++k) {
-	    auto result = std::min_element(dist_ij.begin(), dist_ij.end());
-            int dist_ind = std::distance(dist_ij.begin(), result);
-	    connectivity_inds(j, k) = dist_ind;
-	    //printf("%d %d %d %f %d\n", j, k, Nadjacent, dist_ij[dist_ind], dist_ind);
-            dist_ij[dist_ind] = 1e10; // eliminate the min to get the next min
-	}
+    Array connectivity_inds = xt::zeros<int>({Ndipole, Nneighbors});
+    if (Ndipole == 0)
+        return connectivity_inds;
+    // by default the closest dipole to dipole j is j itself, and if there are
+    // fewer than Nneighbors dipoles the remaining columns are zero
+    int k = std::min(Nneighbors, Ndipole);
+    DipoleKDTree tree(&(dipole_grid_xyz(0, 0)), Ndipole);
+    double* connectivity_ptr = &(connectivity_inds(0, 0));
+    ReleaseGIL nogil;
+#pragma omp parallel
+    {
+        vector<std::pair<double, int>> heap;
+        vector<int> stack;
+        vector<int> inds(k);
+        heap.reserve(k);
+#pragma omp for schedule(dynamic, 64)
+        for (int j = 0; j < Ndipole; ++j) {
+            tree.nearest(j, k, inds.data(), heap, stack);
+            for (int c = 0; c < k; ++c)
+                connectivity_ptr[(size_t) Nneighbors * j + c] = inds[c];
+        }
     }
     return connectivity_inds;
 }
 
+// connectivity passed in from a previous call, or computed for the first
+// Nadjacent neighbours, which is all the backtracking variants look at
+const Array& gpmo_connectivity(const std::optional<Array>& connectivity, std::optional<Array>& computed, Array& dipole_grid_xyz, int N, int Nadjacent)
+{
+    if (!connectivity)
+        return computed.emplace(connectivity_matrix(dipole_grid_xyz, Nadjacent, Nadjacent));
+    if (connectivity->dimension() != 2 || int(connectivity->shape(0)) != N || int(connectivity->shape(1)) < Nadjacent)
+        throw std::invalid_argument("connectivity needs to have shape (ndipoles, n) with n >= Nadjacent.");
+    return *connectivity;
+}
+
+// Warm start of GPMO_baseline, GPMO_multi and GPMO_backtracking from a
+// previous solution x_init of shape (N, 3) with entries in {-1, 0, 1}, e.g.
+// from a checkpoint of an interrupted run. The nonzero components are placed
+// and their dipoles are removed from Gamma_complement as if they had been
+// chosen by the algorithm. Returns the indices 3 * j + c of the placed
+// components.
+template<class AArray>
+vector<int> gpmo_warm_start(AArray& A_obj, const std::optional<Array>& x_init, Array& x, Array& Gamma_complement, double* Aij_mj_ptr, int ngrid)
+{
+    vector<int> placed;
+    if (!x_init)
+        return placed;
+    int N = x.shape(0);
+    if (x_init->dimension() != 2 || int(x_init->shape(0)) != N || x_init->shape(1) != 3)
+        throw std::invalid_argument("x_init needs to have shape (ndipoles, 3).");
+    for (int j = 0; j < N; ++j) {
+        int nonzero = 0;
+        for (int c = 0; c < 3; ++c) {
+            double xjc = (*x_init)(j, c);
+            if (xjc == 0.0)
+                continue;
+            if (xjc != 1.0 && xjc != -1.0)
+                throw std::invalid_argument("The entries of x_init need to be -1, 0 or 1.");
+            nonzero += 1;
+            x(j, c) = xjc;
+            placed.push_back(3 * j + c);
+            gpmo_add_row(A_obj, 3 * j + c, xjc, Aij_mj_ptr, ngrid);
+        }
+        if (nonzero > 1)
+            throw std::invalid_argument("x_init can only have one nonzero component per dipole.");
+        if (nonzero > 0) {
+            for (int c = 0; c < 3; ++c)
+                Gamma_complement(j, c) = false;
+        }
+    }
+    return placed;
+}
+
+// Incremental bookkeeping for the GPMO algorithms, used if incremental is
+// true. With the residual r = sum_j m_j A_j - b, where A_j is row j of A_obj,
+//
+//      ||r +- A_j||^2 = ||r||^2 +- 2 A_j . r + ||A_j||^2,
+//
+// so given the squared row norms and the vector g = A_obj r, the change of
+// the least-squares term is available in O(1) for every candidate. After a
+// dipole component j is placed or removed, g changes by +- A_obj A_j, i.e.
+// one column of the Gram matrix A_obj A_obj^T. If the Gram matrix is not
+// much larger than A_obj itself and enough iterations are run to pay for
+// its computation, it is precomputed with Eigen and every iteration only
+// costs O(N); otherwise the column is computed on the fly, which takes one
+// pass over A_obj instead of the two sums of squares per candidate. All of
+// these are accumulated in double precision, also if A_obj is stored in
+// single precision.
+template<class AArray>
+class GPMOIncremental {
+    private:
+        using T = typename AArray::value_type;
+        const T* A;
+        int N3, ngrid;
+        vector<double> norms, g;
+        PMRowMatrix gram;
+        bool use_gram;
+
+    public:
+        GPMOIncremental(AArray& A_obj, int N3, int ngrid, const double* r, int K) :
+            A(gpmo_rows(A_obj)), N3(N3), ngrid(ngrid), norms(N3), g(N3) {
+#pragma omp parallel for schedule(static)
+            for (int j = 0; j < N3; ++j) {
+                const T* Aj = A + size_t(j) * ngrid;
+                double norm = 0.0;
+                double gj = 0.0;
+                for (int i = 0; i < ngrid; ++i) {
+                    norm += double(Aj[i]) * Aj[i];
+                    gj += double(Aj[i]) * r[i];
+                }
+                norms[j] = norm;
+                g[j] = gj;
+            }
+            size_t gram_size = size_t(N3) * N3;
+            use_gram = gram_size <= std::max(size_t(N3) * ngrid, size_t(1) << 24) && 8 * size_t(K) >= size_t(N3);
+            if (!use_gram)
+                return;
+            gram.resize(N3, N3);
+            if constexpr (std::is_same<T, double>::value) {
+                Eigen::Map<const PMRowMatrix> eigen_mat(A, N3, ngrid);
+                gram.noalias() = eigen_mat * eigen_mat.transpose();
+            } else {
+                // convert blocks of rows to double precision, and use the symmetry
+                using TRowMatrix = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+                Eigen::Map<const TRowMatrix> eigen_mat(A, N3, ngrid);
+                int block = 256;
+                for (int r0 = 0; r0 < N3; r0 += block) {
+                    int nr = std::min(block, N3 - r0);
+                    PMRowMatrix Ar = eigen_mat.middleRows(r0, nr).template cast<double>();
+                    for (int c0 = 0; c0 <= r0; c0 += block) {
+                        int nc = std::min(block, N3 - c0);
+                        PMRowMatrix Ac = eigen_mat.middleRows(c0, nc).template cast<double>();
+                        gram.block(r0, c0, nr, nc).noalias() = Ar * Ac.transpose();
+                        if (c0 != r0)
+                            gram.block(c0, r0, nc, nr) = gram.block(r0, c0, nr, nc).transpose();
+                    }
+                }
+            }
+        }
+
+        // ||r + sign A_j||^2 - ||r||^2
+        inline double dR2(int j, double sign) const {
+            return 2.0 * sign * g[j] + norms[j];
+        }
+
+        // r -> r + sign A_j. Only the entries of g with active[l] != 0 are
+        // updated, or all of them if active is nullptr.
+        void update(int j, double sign, const double* active) {
+            if (use_gram) {
+                const double* Gj = gram.data() + size_t(j) * N3;
+#pragma omp parallel for schedule(static)
+                for (int l = 0; l < N3; ++l)
+                    g[l] += sign * Gj[l];
+                return;
+            }
+            const T* Aj = A + size_t(j) * ngrid;
+#pragma omp parallel for schedule(static)
+            for (int l = 0; l < N3; ++l) {
+                if (active && !active[l])
+                    continue;
+                const T* Al = A + size_t(l) * ngrid;
+                double dot = 0.0;
+                for (int i = 0; i < ngrid; ++i)
+                    dot += double(Al[i]) * Aj[i];
+                g[l] += sign * dot;
+            }
+        }
+};
+
+// For a DipoleFieldOperator the squared row norms are computed once, and
+// every update applies the transposed operator to the new row, which costs
+// as many kernel evaluations as one pass over the dense matrix.
+template<>
+class GPMOIncremental<DipoleFieldOperator> {
+    private:
+        const DipoleFieldOperator& A;
+        int N3;
+        vector<double> norms, g, Aj, dg;
+
+    public:
+        GPMOIncremental(DipoleFieldOperator& A_obj, int N3, int ngrid, const double* r, int K) :
+            A(A_obj), N3(N3), norms(A_obj.column_norms()), g(N3), Aj(ngrid), dg(N3) {
+            A.apply_transpose(r, g.data());
+        }
+
+        inline double dR2(int j, double sign) const {
+            return 2.0 * sign * g[j] + norms[j];
+        }
+
+        void update(int j, double sign, const double* active) {
+            A.column(j, Aj.data());
+            A.apply_transpose(Aj.data(), dg.data(), active);
+            for (int l = 0; l < N3; ++l) {
+                if (active && !active[l])
+                    continue;
+                g[l] += sign * dg[l];
+            }
+        }
+};
+
 // GPMO algorithm with backtracking to fix wyrms -- close cancellations between
 // two nearby, oppositely oriented magnets. 
-std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int backtracking, Array& dipole_grid_xyz, int single_direction, int Nadjacent, int max_nMagnets)
+template<class AArray>
+std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking(AArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int backtracking, Array& dipole_grid_xyz, int single_direction, int Nadjacent, int max_nMagnets, bool incremental, const std::optional<Array>& connectivity, const std::optional<Array>& x_init)
 {
-    int ngrid = A_obj.shape(1);
-    int N = int(A_obj.shape(0) / 3);
+    int ngrid = gpmo_ngrid(A_obj);
+    int N = int(gpmo_N3(A_obj) / 3);
     int N3 = 3 * N;
     int print_iter = 0;
-    int skj_inds;
 
     Array x = xt::zeros<double>({N, 3});
 
@@ -409,7 +1041,7 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking(Array& A_obj, Ar
     vector<double> sk_sign_fac(N);
 
     double* R2s_ptr = &(R2s[0]);
-    double* Aij_ptr = &(A_obj(0, 0));
+    auto* Aij_ptr = gpmo_rows(A_obj);
     double* Gamma_ptr = &(Gamma_complement(0, 0));
 
     // initialize running matrix-vector product
@@ -420,31 +1052,52 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking(Array& A_obj, Ar
     double* mmax_ptr = &(mmax(0));
     
     // get indices for dipoles that are adjacent to dipole j
-    Array Connect = connectivity_matrix(dipole_grid_xyz, Nadjacent);
+    std::optional<Array> Connect_computed;
+    const Array& Connect = gpmo_connectivity(connectivity, Connect_computed, dipole_grid_xyz, N, Nadjacent);
 
     // if using a single direction, increase j by 3 each iteration
     int j_update = 1;
     if (single_direction >= 0) j_update = 3;
+
+    // continue from a previous solution, whose dipoles are also candidates
+    // for the backtracking
+    vector<int> skj_init;
+    for (int jc : gpmo_warm_start(A_obj, x_init, x, Gamma_complement, Aij_mj_ptr, ngrid)) {
+        skj_init.push_back(jc / 3);
+        skjj_ind[jc / 3] = jc % 3;
+        sk_sign_fac[jc / 3] = x(jc / 3, jc % 3);
+        mmax_sum += mmax_ptr[jc / 3] * mmax_ptr[jc / 3];
+    }
+
+    // incremental bookkeeping of A_obj * (Aij_mj_sum), see GPMOIncremental
+    // which is always used for a DipoleFieldOperator
+    std::unique_ptr<GPMOIncremental<AArray>> state;
+    if (incremental || !Aij_ptr)
+        state = std::make_unique<GPMOIncremental<AArray>>(A_obj, N3, ngrid, Aij_mj_ptr, K);
     Array num_nonzeros = xt::zeros<int>({nhistory + 1});
     int num_nonzero = 0;
     int k = 0;
 
     // Main loop over the optimization iterations
+    ReleaseGIL nogil;
+    SIMSOPT_PERF_SCOPE(gpmo, 0);
     for (int k = 0; k < K; ++k) {
+        SIMSOPT_PERF_COUNT(gpmo, 0, 1);
 #pragma omp parallel for schedule(static)
 	for (int j = std::max(0, single_direction); j < N3; j += j_update) {
 
 	    // Check all the allowed dipole positions
-	    if (Gamma_ptr[j]) {
+	    if (Gamma_ptr[j] && state) {
+		R2s_ptr[j] = state->dR2(j, 1.0) + (mmax_ptr[j] * mmax_ptr[j]);
+		R2s_ptr[j + N3] = state->dR2(j, -1.0) + (mmax_ptr[j] * mmax_ptr[j]);
+	    }
+	    else if (Gamma_ptr[j]) {
 		double R2 = 0.0;
 		double R2minus = 0.0;
 		int nj = ngrid * j;
 
 		// Compute contribution of jth dipole component, either with +- orientation
-		for(int i = 0; i < ngrid; ++i) {
-		    R2 += (Aij_mj_ptr[i] + Aij_ptr[i + nj]) * (Aij_mj_ptr[i] + Aij_ptr[i + nj]); 
-		    R2minus += (Aij_mj_ptr[i] - Aij_ptr[i + nj]) * (Aij_mj_ptr[i] - Aij_ptr[i + nj]); 
-		}
+		gpmo_candidate_R2(Aij_mj_ptr, Aij_ptr + nj, ngrid, R2, R2minus);
 		R2s_ptr[j] = R2 + (mmax_ptr[j] * mmax_ptr[j]);
 		R2s_ptr[j + N3] = R2minus + (mmax_ptr[j] * mmax_ptr[j]);
 	    }
@@ -471,23 +1124,23 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking(Array& A_obj, Ar
 
 	// Add binary magnet and get rid of the magnet (all three components)
         // from the complement of Gamma
-	skj_inds = (3 * skj[k] + skjj[k]) * ngrid;
-#pragma omp parallel for schedule(static)
-	for(int i = 0; i < ngrid; ++i) {
-            Aij_mj_ptr[i] += sign_fac[k] * Aij_ptr[i + skj_inds];
-	}
+	gpmo_add_row(A_obj, 3 * skj[k] + skjj[k], sign_fac[k], Aij_mj_ptr, ngrid);
         for (int j = 0; j < 3; ++j) {
             Gamma_complement(skj[k], j) = false;
 	    R2s[3 * skj[k] + j] = 1e50;
 	    R2s[N3 + 3 * skj[k] + j] = 1e50;
 	}
+	// placed and removed dipoles can become candidates again, so update all of A_obj r
+	if (state)
+	    state->update(3 * skj[k] + skjj[k], sign_fac[k], nullptr);
 
 	// backtrack by removing adjacent dipoles that are equal and opposite
 	if ((k >= backtracking) and ((k % backtracking) == 0)) {
-	    // Loop over all dipoles placed so far
+	    // Loop over all dipoles placed so far, starting with those of x_init
             int wyrm_sum = 0;
-	    for (int j = 0; j < k; j++) {
-		int jk = skj[j];
+	    int ninit = skj_init.size();
+	    for (int j = -ninit; j < k; j++) {
+		int jk = (j < 0) ? skj_init[ninit + j] : skj[j];
 		// find adjacent dipoles to dipole at skj[j]
 		// Loop over adjacent dipoles and check if have equal and opposite one
 	        for(int jj = 0; jj < Nadjacent; ++jj) {
@@ -506,11 +1159,10 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking(Array& A_obj, Ar
 		         }
 
 	                 // Subtract off this pair's contribution to Aij * mj
-			 int skj_ind1 = (3 * jk + skjj_ind[jk]) * ngrid;
-	                 int skj_ind2 = (3 * cj + skjj_ind[cj]) * ngrid;
-#pragma omp parallel for schedule(static)
-			 for(int i = 0; i < ngrid; ++i) {
-		             Aij_mj_ptr[i] -= sk_sign_fac[jk] * Aij_ptr[i + skj_ind1] + sk_sign_fac[cj] * Aij_ptr[i + skj_ind2];
+			 gpmo_subtract_rows(A_obj, 3 * jk + skjj_ind[jk], sk_sign_fac[jk], 3 * cj + skjj_ind[cj], sk_sign_fac[cj], Aij_mj_ptr, ngrid);
+			 if (state) {
+			     state->update(3 * jk + skjj_ind[jk], -sk_sign_fac[jk], nullptr);
+			     state->update(3 * cj + skjj_ind[cj], -sk_sign_fac[cj], nullptr);
 			 }
 	                 mmax_sum -= mmax_ptr[jk] * mmax_ptr[jk];
 	                 mmax_sum -= mmax_ptr[cj] * mmax_ptr[cj];
@@ -575,15 +1227,17 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking(Array& A_obj, Ar
         }
     }
 
+    nogil.reacquire();
     return std::make_tuple(objective_history, Bn_history, m_history, num_nonzeros, x);
 }
 
 // Run the GPMO algorithm, placing a dipole and all of the closest Nadjacent dipoles down
 // all at once each iteration. All of these dipoles are aligned in the same way by assumption 
-std::tuple<Array, Array, Array, Array> GPMO_multi(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, Array& dipole_grid_xyz, int single_direction, int Nadjacent)
+template<class AArray>
+std::tuple<Array, Array, Array, Array> GPMO_multi(AArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, Array& dipole_grid_xyz, int single_direction, int Nadjacent, bool incremental, const std::optional<Array>& x_init)
 {
-    int ngrid = A_obj.shape(1);
-    int N = int(A_obj.shape(0) / 3);
+    int ngrid = gpmo_ngrid(A_obj);
+    int N = int(gpmo_N3(A_obj) / 3);
     int N3 = 3 * N;
     int print_iter = 0;
 
@@ -608,7 +1262,7 @@ std::tuple<Array, Array, Array, Array> GPMO_multi(Array& A_obj, Array& b_obj, Ar
     vector<double> sign_fac(K);
     
     double* R2s_ptr = &(R2s[0]);
-    double* Aij_ptr = &(A_obj(0, 0));
+    auto* Aij_ptr = gpmo_rows(A_obj);
     double* Gamma_ptr = &(Gamma_complement(0, 0));
     
     // initialize running matrix-vector product
@@ -624,9 +1278,22 @@ std::tuple<Array, Array, Array, Array> GPMO_multi(Array& A_obj, Array& b_obj, Ar
     // if using a single direction, increase j by 3 each iteration
     int j_update = 1;
     if (single_direction >= 0) j_update = 3;
+
+    // continue from a previous solution
+    for (int jc : gpmo_warm_start(A_obj, x_init, x, Gamma_complement, Aij_mj_ptr, ngrid))
+        mmax_sum += mmax_ptr[jc / 3] * mmax_ptr[jc / 3];
+
+    // incremental bookkeeping of A_obj * (Aij_mj_sum), see GPMOIncremental
+    // which is always used for a DipoleFieldOperator
+    std::unique_ptr<GPMOIncremental<AArray>> state;
+    if (incremental || !Aij_ptr)
+        state = std::make_unique<GPMOIncremental<AArray>>(A_obj, N3, ngrid, Aij_mj_ptr, K);
     
     // Main loop over the optimization iterations
+    ReleaseGIL nogil;
+    SIMSOPT_PERF_SCOPE(gpmo, 0);
     for (int k = 0; k < K; ++k) {
+        SIMSOPT_PERF_COUNT(gpmo, 0, 1);
 #pragma omp parallel for schedule(static)
 	for (int j = std::max(0, single_direction); j < N3; j += j_update) {
 	    // Check all the allowed dipole positions
@@ -654,9 +1321,12 @@ std::tuple<Array, Array, Array, Array> GPMO_multi(Array& A_obj, Array& b_obj, Ar
 		    nj = ngrid * cj_ind; // index j and all its neighbors
 	    
 	    	    // Compute contribution of jth dipole component, either with +- orientation
-		    for(int i = 0; i < ngrid; ++i) {
-		        R2 += (Aij_mj_ptr[i] + Aij_ptr[i + nj]) * (Aij_mj_ptr[i] + Aij_ptr[i + nj]);
-		        R2minus += (Aij_mj_ptr[i] - Aij_ptr[i + nj]) * (Aij_mj_ptr[i] - Aij_ptr[i + nj]); 
+		    if (state) {
+		        R2 += state->dR2(cj_ind, 1.0);
+		        R2minus += state->dR2(cj_ind, -1.0);
+		    }
+		    else {
+		        gpmo_candidate_R2(Aij_mj_ptr, Aij_ptr + nj, ngrid, R2, R2minus);
 		    }
 		    mmax_partial_sum += mmax_ptr[cj] * mmax_ptr[cj];
 		}
@@ -694,20 +1364,20 @@ std::tuple<Array, Array, Array, Array> GPMO_multi(Array& A_obj, Array& b_obj, Ar
 	    }
 	    x(cj, skjj[k]) = sign_fac[k];	
 	    mmax_sum += mmax_ptr[cj] * mmax_ptr[cj];
-	    int skj_inds = cj_ind * ngrid;
-	    for(int i = 0; i < ngrid; ++i) {
-                Aij_mj_ptr[i] += sign_fac[k] * Aij_ptr[i + skj_inds];
-	    }
+	    gpmo_add_row(A_obj, cj_ind, sign_fac[k], Aij_mj_ptr, ngrid);
             for (int j = 0; j < 3; ++j) {
                 Gamma_complement(cj, j) = false;
 	        R2s[3 * cj + j] = 1e50;
 	        R2s[N3 + 3 * cj + j] = 1e50;
 	    }
+	    if (state)
+	        state->update(cj_ind, sign_fac[k], Gamma_ptr);
 	}
 	if (verbose && (((k % int(K / nhistory)) == 0) || k == 0 || k == K - 1)) {
             print_GPMO(k, ngrid, print_iter, x, Aij_mj_ptr, objective_history, Bn_history, m_history, mmax_sum, normal_norms_ptr);
 	}
     }
+    nogil.reacquire();
     return std::make_tuple(objective_history, Bn_history, m_history, x);
 }
 
@@ -726,11 +1396,12 @@ std::tuple<Array, Array, Array, Array> GPMO_multi(Array& A_obj, Array& b_obj, Ar
 //
 // The A matrix should be rescaled by m_maxima since we are assuming all ones 
 // in m.
+template<class AArray>
 std::tuple<Array, Array, Array, Array, Array> GPMO_ArbVec_backtracking(
-    Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, 
+    AArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, 
     Array& pol_vectors, int K, bool verbose, int nhistory, int backtracking, 
     Array& dipole_grid_xyz, int Nadjacent, double thresh_angle, 
-    int max_nMagnets, Array& x_init)
+    int max_nMagnets, Array& x_init, const std::optional<Array>& connectivity)
 {
     int ngrid = A_obj.shape(1);
     int nPolVecs = pol_vectors.shape(1);
@@ -765,7 +1436,7 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_ArbVec_backtracking(
     vector<double> sign_fac(K);
     
     double* R2s_ptr = &(R2s[0]);
-    double* Aij_ptr = &(A_obj(0, 0));
+    auto* Aij_ptr = &(A_obj(0, 0));
     double* Gamma_ptr = &(Gamma_complement(0));
     double* pol_vec_ptr = &(pol_vectors(0,0,0));
     
@@ -777,7 +1448,8 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_ArbVec_backtracking(
     double* mmax_ptr = &(mmax(0));
 
     // Get indices for dipoles that are adjacent to dipole j
-    Array Connect = connectivity_matrix(dipole_grid_xyz, Nadjacent);
+    std::optional<Array> Connect_computed;
+    const Array& Connect = gpmo_connectivity(connectivity, Connect_computed, dipole_grid_xyz, N, Nadjacent);
 
     int num_nonzero = 0;
     Array num_nonzeros = xt::zeros<int>({nhistory + 2});
@@ -792,7 +1464,10 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_ArbVec_backtracking(
         Bn_history, m_history, mmax_sum, normal_norms_ptr);
 
     // Main loop over the optimization iterations
+    ReleaseGIL nogil;
+    SIMSOPT_PERF_SCOPE(gpmo, 0);
     for (int k = 0; k < K; ++k) {
+        SIMSOPT_PERF_COUNT(gpmo, 0, 1);
 
 #pragma omp parallel for schedule(static)
 	for (int j = 0; j < N; j += 1) {
@@ -982,6 +1657,7 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_ArbVec_backtracking(
 
     }
 
+    nogil.reacquire();
     return std::make_tuple(objective_history, Bn_history, m_history, 
                            num_nonzeros, x);
 }
@@ -991,9 +1667,10 @@ std::tuple<Array, Array, Array, Array, Array> GPMO_ArbVec_backtracking(
  *  user-input initial guess supplied to the GPMO algorithm with arbitrary
  *  vectors.
  */
+template<class AArray>
 void initialize_GPMO_ArbVec(Array& x_init, Array& pol_vectors, 
          Array& x, vector<int>& x_vec, vector<int>& x_sign, 
-         Array& A_obj, Array& Aij_mj_sum, vector<double>& R2s, 
+         AArray& A_obj, Array& Aij_mj_sum, vector<double>& R2s, 
 	 Array& Gamma_complement, int& num_nonzero) {
 
     // Ensure that size of initialization vector agrees with that of solution
@@ -1015,7 +1692,7 @@ void initialize_GPMO_ArbVec(Array& x_init, Array& pol_vectors,
     int n_OutOfTol = 0;
     double tol = (double) 4*std::numeric_limits<float>::epsilon();
 
-    double* Aij_ptr = &(A_obj(0, 0));
+    auto* Aij_ptr = &(A_obj(0, 0));
     double* Aij_mj_ptr = &(Aij_mj_sum(0));
     double* pol_vec_ptr = &(pol_vectors(0,0,0));
 
@@ -1120,7 +1797,8 @@ void initialize_GPMO_ArbVec(Array& x_init, Array& pol_vectors,
 // problem in which the user has the option to specify arbitrary allowable 
 // polarization vectors for each dipole. The A matrix should be rescaled by 
 // m_maxima since we are assuming all ones in m.
-std::tuple<Array, Array, Array, Array> GPMO_ArbVec(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, Array& pol_vectors, int K, bool verbose, int nhistory)
+template<class AArray>
+std::tuple<Array, Array, Array, Array> GPMO_ArbVec(AArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, Array& pol_vectors, int K, bool verbose, int nhistory)
 {
     int ngrid = A_obj.shape(1);
     int nPolVecs = pol_vectors.shape(1);
@@ -1152,7 +1830,7 @@ std::tuple<Array, Array, Array, Array> GPMO_ArbVec(Array& A_obj, Array& b_obj, A
     vector<double> sign_fac(K);
     
     double* R2s_ptr = &(R2s[0]);
-    double* Aij_ptr = &(A_obj(0, 0));
+    auto* Aij_ptr = &(A_obj(0, 0));
     double* Gamma_ptr = &(Gamma_complement(0));
     double* pol_vec_ptr = &(pol_vectors(0,0,0));
     
@@ -1164,7 +1842,10 @@ std::tuple<Array, Array, Array, Array> GPMO_ArbVec(Array& A_obj, Array& b_obj, A
     double* mmax_ptr = &(mmax(0));
 
     // Main loop over the optimization iterations
+    ReleaseGIL nogil;
+    SIMSOPT_PERF_SCOPE(gpmo, 0);
     for (int k = 0; k < K; ++k) {
+        SIMSOPT_PERF_COUNT(gpmo, 0, 1);
 #pragma omp parallel for schedule(static)
 	for (int j = 0; j < N; j += 1) {
 
@@ -1228,16 +1909,18 @@ std::tuple<Array, Array, Array, Array> GPMO_ArbVec(Array& A_obj, Array& b_obj, A
             print_GPMO(k, ngrid, print_iter, x, Aij_mj_ptr, objective_history, Bn_history, m_history, mmax_sum, normal_norms_ptr);
 	}
     }
+    nogil.reacquire();
     return std::make_tuple(objective_history, Bn_history, m_history, x);
 }
 
 // Run the GPMO algorithm for solving 
 // the permanent magnet optimization problem.
 // The A matrix should be rescaled by m_maxima since we are assuming all ones in m.
-std::tuple<Array, Array, Array, Array> GPMO_baseline(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int single_direction) 
+template<class AArray>
+std::tuple<Array, Array, Array, Array> GPMO_baseline(AArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int single_direction, bool incremental, const std::optional<Array>& x_init)
 {
-    int ngrid = A_obj.shape(1);
-    int N = int(A_obj.shape(0) / 3);
+    int ngrid = gpmo_ngrid(A_obj);
+    int N = int(gpmo_N3(A_obj) / 3);
     int N3 = 3 * N;
     int print_iter = 0;
 
@@ -1262,7 +1945,7 @@ std::tuple<Array, Array, Array, Array> GPMO_baseline(Array& A_obj, Array& b_obj,
     vector<double> sign_fac(K);
     
     double* R2s_ptr = &(R2s[0]);
-    double* Aij_ptr = &(A_obj(0, 0));
+    auto* Aij_ptr = gpmo_rows(A_obj);
     double* Gamma_ptr = &(Gamma_complement(0, 0));
     
     // initialize running matrix-vector product
@@ -1275,23 +1958,36 @@ std::tuple<Array, Array, Array, Array> GPMO_baseline(Array& A_obj, Array& b_obj,
     // if using a single direction, increase j by 3 each iteration
     int j_update = 1;
     if (single_direction >= 0) j_update = 3;
+
+    // continue from a previous solution
+    gpmo_warm_start(A_obj, x_init, x, Gamma_complement, Aij_mj_ptr, ngrid);
+
+    // incremental bookkeeping of A_obj * (Aij_mj_sum), see GPMOIncremental
+    // which is always used for a DipoleFieldOperator
+    std::unique_ptr<GPMOIncremental<AArray>> state;
+    if (incremental || !Aij_ptr)
+        state = std::make_unique<GPMOIncremental<AArray>>(A_obj, N3, ngrid, Aij_mj_ptr, K);
     
     // Main loop over the optimization iterations
+    ReleaseGIL nogil;
+    SIMSOPT_PERF_SCOPE(gpmo, 0);
     for (int k = 0; k < K; ++k) {
+        SIMSOPT_PERF_COUNT(gpmo, 0, 1);
 #pragma omp parallel for schedule(static)
 	for (int j = std::max(0, single_direction); j < N3; j += j_update) {
 
 	    // Check all the allowed dipole positions
-	    if (Gamma_ptr[j]) {
+	    if (Gamma_ptr[j] && state) {
+		R2s_ptr[j] = state->dR2(j, 1.0) + (mmax_ptr[j] * mmax_ptr[j]);
+		R2s_ptr[j + N3] = state->dR2(j, -1.0) + (mmax_ptr[j] * mmax_ptr[j]);
+	    }
+	    else if (Gamma_ptr[j]) {
 		double R2 = 0.0;
 		double R2minus = 0.0;
 		int nj = ngrid * j;
 
 		// Compute contribution of jth dipole component, either with +- orientation
-		for(int i = 0; i < ngrid; ++i) {
-		    R2 += (Aij_mj_ptr[i] + Aij_ptr[i + nj]) * (Aij_mj_ptr[i] + Aij_ptr[i + nj]);
-		    R2minus += (Aij_mj_ptr[i] - Aij_ptr[i + nj]) * (Aij_mj_ptr[i] - Aij_ptr[i + nj]); 
-		}
+		gpmo_candidate_R2(Aij_mj_ptr, Aij_ptr + nj, ngrid, R2, R2minus);
 		R2s_ptr[j] = R2 + (mmax_ptr[j] * mmax_ptr[j]);
 		R2s_ptr[j + N3] = R2minus + (mmax_ptr[j] * mmax_ptr[j]);
 	    }
@@ -1312,20 +2008,39 @@ std::tuple<Array, Array, Array, Array> GPMO_baseline(Array& A_obj, Array& b_obj,
 
 	// Add binary magnet and get rid of the magnet (all three components)
         // from the complement of Gamma 
-	int skj_inds = (3 * skj[k] + skjj[k]) * ngrid;
-#pragma omp parallel for schedule(static)
-	for(int i = 0; i < ngrid; ++i) {
-            Aij_mj_ptr[i] += sign_fac[k] * Aij_ptr[i + skj_inds];
-	}
+	gpmo_add_row(A_obj, 3 * skj[k] + skjj[k], sign_fac[k], Aij_mj_ptr, ngrid);
         for (int j = 0; j < 3; ++j) {
             Gamma_complement(skj[k], j) = false;
 	    R2s[3 * skj[k] + j] = 1e50;
 	    R2s[N3 + 3 * skj[k] + j] = 1e50;
         }
+        if (state)
+            state->update(3 * skj[k] + skjj[k], sign_fac[k], Gamma_ptr);
 
 	if (verbose && (((k % int(K / nhistory)) == 0) || k == 0 || k == K - 1)) {
             print_GPMO(k, ngrid, print_iter, x, Aij_mj_ptr, objective_history, Bn_history, m_history, mmax_sum, normal_norms_ptr);
 	}
     }
+    nogil.reacquire();
     return std::make_tuple(objective_history, Bn_history, m_history, x);
 }
+
+// A_obj can be stored in double or single precision
+template std::tuple<Array, Array, Array, Array> MwPGP_algorithm<Array>(Array& A_obj, Array& b_obj, Array& ATb, Array& m_proxy, Array& m0, Array& m_maxima, double alpha, double nu, double epsilon, double reg_l0, double reg_l1, double reg_l2, int max_iter, double min_fb, bool verbose);
+template std::tuple<Array, Array, Array, Array> MwPGP_algorithm<FloatArray>(FloatArray& A_obj, Array& b_obj, Array& ATb, Array& m_proxy, Array& m0, Array& m_maxima, double alpha, double nu, double epsilon, double reg_l0, double reg_l1, double reg_l2, int max_iter, double min_fb, bool verbose);
+template std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking<Array>(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int backtracking, Array& dipole_grid_xyz, int single_direction, int Nadjacent, int max_nMagnets, bool incremental, const std::optional<Array>& connectivity, const std::optional<Array>& x_init);
+template std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking<FloatArray>(FloatArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int backtracking, Array& dipole_grid_xyz, int single_direction, int Nadjacent, int max_nMagnets, bool incremental, const std::optional<Array>& connectivity, const std::optional<Array>& x_init);
+template std::tuple<Array, Array, Array, Array> GPMO_multi<Array>(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, Array& dipole_grid_xyz, int single_direction, int Nadjacent, bool incremental, const std::optional<Array>& x_init);
+template std::tuple<Array, Array, Array, Array> GPMO_multi<FloatArray>(FloatArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, Array& dipole_grid_xyz, int single_direction, int Nadjacent, bool incremental, const std::optional<Array>& x_init);
+template std::tuple<Array, Array, Array, Array> GPMO_ArbVec<Array>(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, Array& pol_vectors, int K, bool verbose, int nhistory);
+template std::tuple<Array, Array, Array, Array> GPMO_ArbVec<FloatArray>(FloatArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, Array& pol_vectors, int K, bool verbose, int nhistory);
+template std::tuple<Array, Array, Array, Array, Array> GPMO_ArbVec_backtracking<Array>(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, Array& pol_vectors, int K, bool verbose, int nhistory, int backtracking, Array& dipole_grid_xyz, int Nadjacent, double thresh_angle, int max_nMagnets, Array& x_init, const std::optional<Array>& connectivity);
+template std::tuple<Array, Array, Array, Array, Array> GPMO_ArbVec_backtracking<FloatArray>(FloatArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, Array& pol_vectors, int K, bool verbose, int nhistory, int backtracking, Array& dipole_grid_xyz, int Nadjacent, double thresh_angle, int max_nMagnets, Array& x_init, const std::optional<Array>& connectivity);
+template std::tuple<Array, Array, Array, Array> GPMO_baseline<Array>(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int single_direction, bool incremental, const std::optional<Array>& x_init);
+template std::tuple<Array, Array, Array, Array> GPMO_baseline<FloatArray>(FloatArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int single_direction, bool incremental, const std::optional<Array>& x_init);
+
+// A_obj can also be a matrix-free DipoleFieldOperator, see dipole_field.h
+template std::tuple<Array, Array, Array, Array> MwPGP_algorithm<DipoleFieldOperator>(DipoleFieldOperator& A_obj, Array& b_obj, Array& ATb, Array& m_proxy, Array& m0, Array& m_maxima, double alpha, double nu, double epsilon, double reg_l0, double reg_l1, double reg_l2, int max_iter, double min_fb, bool verbose);
+template std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking<DipoleFieldOperator>(DipoleFieldOperator& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int backtracking, Array& dipole_grid_xyz, int single_direction, int Nadjacent, int max_nMagnets, bool incremental, const std::optional<Array>& connectivity, const std::optional<Array>& x_init);
+template std::tuple<Array, Array, Array, Array> GPMO_multi<DipoleFieldOperator>(DipoleFieldOperator& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, Array& dipole_grid_xyz, int single_direction, int Nadjacent, bool incremental, const std::optional<Array>& x_init);
+template std::tuple<Array, Array, Array, Array> GPMO_baseline<DipoleFieldOperator>(DipoleFieldOperator& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int single_direction, bool incremental, const std::optional<Array>& x_init);
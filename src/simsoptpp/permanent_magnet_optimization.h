@@ -3,8 +3,16 @@
 #include <cmath>  // pow function
 #include <tuple>  // c++ tuples
 #include <algorithm>  // std::min_element function
+#include <optional>
 #include "xtensor-python/pyarray.hpp"     // Numpy bindings
 typedef xt::pyarray<double> Array;
+// The solvers take A_obj either in double or in single precision, which halves
+// the memory footprint and traffic of the dense matrix. All sums are
+// accumulated in double precision in both cases. They are instantiated for
+// Array and FloatArray in permanent_magnet_optimization.cpp. MwPGP and all
+// GPMO variants but the ArbVec ones also take the matrix-free
+// DipoleFieldOperator from dipole_field.h.
+typedef xt::pyarray<float> FloatArray;
 using std::vector;
 
 // helper functions for convex MwPGP algorithm
@@ -14,26 +22,42 @@ std::tuple<double, double, double> beta_tilde(double x1, double x2, double x3, d
 std::tuple<double, double, double> g_reduced_gradient(double x1, double x2, double x3, double g1, double g2, double g3, double alpha, double m_maxima);
 std::tuple<double, double, double> g_reduced_projected_gradient(double x1, double x2, double x3, double g1, double g2, double g3, double alpha, double m_maxima);
 double find_max_alphaf(double x1, double x2, double x3, double p1, double p2, double p3, double m_maxima);
-void print_MwPGP(Array& A_obj, Array& b_obj, Array& x_k1, Array& m_proxy, Array& m_maxima, Array& m_history, Array& objective_history, Array& R2_history, int print_iter, int k, double nu, double reg_l0, double reg_l1, double reg_l2);
+template<class AArray>
+void print_MwPGP(AArray& A_obj, Array& b_obj, Array& x_k1, Array& m_proxy, Array& m_maxima, Array& m_history, Array& objective_history, Array& R2_history, int print_iter, int k, double nu, double reg_l0, double reg_l1, double reg_l2);
 
 // the hyperparameters all have default values if they are left unspecified -- see python.cpp
-std::tuple<Array, Array, Array, Array> MwPGP_algorithm(Array& A_obj, Array& b_obj, Array& ATb, Array& m_proxy, Array& m0, Array& m_maxima, double alpha, double nu=1.0e100, double epsilon=1.0e-4, double reg_l0=0.0, double reg_l1=0.0, double reg_l2=0.0, int max_iter=500, double min_fb=1.0e-20, bool verbose=false);
+template<class AArray>
+std::tuple<Array, Array, Array, Array> MwPGP_algorithm(AArray& A_obj, Array& b_obj, Array& ATb, Array& m_proxy, Array& m0, Array& m_maxima, double alpha, double nu=1.0e100, double epsilon=1.0e-4, double reg_l0=0.0, double reg_l1=0.0, double reg_l2=0.0, int max_iter=500, double min_fb=1.0e-20, bool verbose=false);
 
-// variants of the GPMO algorithm
-std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int backtracking, Array& dipole_grid_xyz, int single_direction, int Nadjacent, int max_nMagnets);
-std::tuple<Array, Array, Array, Array> GPMO_multi(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, Array& dipole_grid_xyz, int single_direction, int Nadjacent);
-std::tuple<Array, Array, Array, Array> GPMO_ArbVec(Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, Array& pol_vectors, int K, bool verbose, int nhistory);
+// variants of the GPMO algorithm. If x_init (entries in {-1, 0, 1}) is given,
+// baseline, multi and backtracking continue from that solution, e.g. to
+// resume an interrupted run from a checkpoint.
+template<class AArray>
+std::tuple<Array, Array, Array, Array, Array> GPMO_backtracking(AArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, int backtracking, Array& dipole_grid_xyz, int single_direction, int Nadjacent, int max_nMagnets, bool incremental=false, const std::optional<Array>& connectivity=std::nullopt, const std::optional<Array>& x_init=std::nullopt);
+template<class AArray>
+std::tuple<Array, Array, Array, Array> GPMO_multi(AArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, int K, bool verbose, int nhistory, Array& dipole_grid_xyz, int single_direction, int Nadjacent, bool incremental=false, const std::optional<Array>& x_init=std::nullopt);
+template<class AArray>
+std::tuple<Array, Array, Array, Array> GPMO_ArbVec(AArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, Array& pol_vectors, int K, bool verbose, int nhistory);
+template<class AArray>
 std::tuple<Array, Array, Array, Array, Array> GPMO_ArbVec_backtracking(
-    Array& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, 
+    AArray& A_obj, Array& b_obj, Array& mmax, Array& normal_norms, 
     Array& pol_vectors, int K, bool verbose, int nhistory, int backtracking, 
     Array& dipole_grid_xyz, int Nadjacent, double thresh_angle, 
-    int max_nMagnets, Array& x_init);
-std::tuple<Array, Array, Array, Array> GPMO_baseline(Array& A_obj, Array& b_obj, Array&mmax, Array& normal_norms, int K, bool verbose, int nhistory, int single_direction);
+    int max_nMagnets, Array& x_init,
+    const std::optional<Array>& connectivity=std::nullopt);
+template<class AArray>
+std::tuple<Array, Array, Array, Array> GPMO_baseline(AArray& A_obj, Array& b_obj, Array&mmax, Array& normal_norms, int K, bool verbose, int nhistory, int single_direction, bool incremental=false, const std::optional<Array>& x_init=std::nullopt);
 
 // helper functions for GPMO algorithm
 void print_GPMO(int k, int ngrid, int& print_iter, Array& x, double* Aij_mj_ptr, Array& objective_history, Array& Bn_history, Array& m_history, double mmax_sum, double* normal_norms_ptr); 
-Array connectivity_matrix(Array& dipole_grid_xyz, int Nadjacent);
+// Indices of the Nneighbors dipoles closest to every dipole (starting with the
+// dipole itself), sorted by distance with ties broken by the index. Uses a k-d
+// tree, so it costs O(Ndipole * Nneighbors * log(Ndipole)) instead of
+// O(Ndipole^2). The result can be passed as connectivity to the backtracking
+// variants to reuse it across calls with Nadjacent <= Nneighbors.
+Array connectivity_matrix(Array& dipole_grid_xyz, int Nadjacent, int Nneighbors=2000);
+template<class AArray>
 void initialize_GPMO_ArbVec(Array& x_init, Array& pol_vectors, 
          Array& x, vector<int>& x_vec, vector<int>& x_sign, 
-         Array& A_obj, Array& Aij_mj_sum, vector<double>& R2s, 
+         AArray& A_obj, Array& Aij_mj_sum, vector<double>& R2s, 
 	 Array& Gamma_complement, int& num_nonzero);
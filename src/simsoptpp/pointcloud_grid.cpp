@@ -0,0 +1,186 @@
+#include "pointcloud_grid.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+PointCloudGrid::PointCloudGrid(double threshold) : threshold(threshold), threshold_squared(threshold * threshold) {
+    if(!(threshold > 0))
+        throw std::invalid_argument("threshold needs to be positive");
+}
+
+void PointCloudGrid::cell(const double* x, int64_t* c) const {
+    for (int d = 0; d < 3; ++d)
+        c[d] = int64_t(std::floor(x[d] / threshold));
+}
+
+// Distinct cells may share a key, that only costs a few distance evaluations
+// since the points of a cell are always compared by their distance.
+uint64_t PointCloudGrid::key(int64_t i, int64_t j, int64_t k) {
+    auto mix = [](uint64_t h) {
+        h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    };
+    return mix(mix(mix(uint64_t(i)) ^ uint64_t(j)) ^ uint64_t(k));
+}
+
+void PointCloudGrid::fill(Cloud& cloud, const double* points, int npoints) {
+    cloud.points = vector<double>(points, points + 3 * npoints);
+    vector<std::pair<uint64_t, int>> keyed(npoints);
+    for (int l = 0; l < npoints; ++l) {
+        int64_t c[3];
+        cell(&points[3 * l], c);
+        keyed[l] = {key(c[0], c[1], c[2]), l};
+    }
+    std::sort(keyed.begin(), keyed.end());
+    cloud.keys.resize(npoints);
+    cloud.order.resize(npoints);
+    for (int l = 0; l < npoints; ++l) {
+        cloud.keys[l] = keyed[l].first;
+        cloud.order[l] = keyed[l].second;
+    }
+}
+
+void PointCloudGrid::insert_cells(int p) {
+    const vector<uint64_t>& keys = clouds[p].keys;
+    for (size_t l = 0; l < keys.size(); ++l)
+        if (l == 0 || keys[l] != keys[l - 1])
+            cells[keys[l]].push_back(p);
+}
+
+void PointCloudGrid::remove_cells(int p) {
+    const vector<uint64_t>& keys = clouds[p].keys;
+    for (size_t l = 0; l < keys.size(); ++l) {
+        if (l > 0 && keys[l] == keys[l - 1])
+            continue;
+        auto it = cells.find(keys[l]);
+        vector<int>& c = it->second;
+        c.erase(std::find(c.begin(), c.end(), p));
+        if (c.empty())
+            cells.erase(it);
+    }
+}
+
+void PointCloudGrid::add_cloud(const double* points, int npoints) {
+    int p = clouds.size();
+    clouds.emplace_back();
+    fill(clouds[p], points, npoints);
+    insert_cells(p);
+    pair_state.resize(size_t(p + 1) * p / 2, -1);
+}
+
+void PointCloudGrid::set_cloud(int p, const double* points, int npoints) {
+    if (p < 0 || p >= size())
+        throw std::out_of_range("cloud index out of range");
+    remove_cells(p);
+    fill(clouds[p], points, npoints);
+    insert_cells(p);
+    for (int j = 0; j < p; ++j)
+        pair_state[size_t(p) * (p - 1) / 2 + j] = -1;
+    for (int i = p + 1; i < size(); ++i)
+        pair_state[size_t(i) * (i - 1) / 2 + p] = -1;
+}
+
+bool PointCloudGrid::close_in_cell(const double* x, int q, uint64_t key) const {
+    const Cloud& cloud = clouds[q];
+    auto range = std::equal_range(cloud.keys.begin(), cloud.keys.end(), key);
+    for (auto it = range.first; it != range.second; ++it) {
+        const double* y = &cloud.points[3 * cloud.order[it - cloud.keys.begin()]];
+        double dist = (x[0] - y[0]) * (x[0] - y[0]) + (x[1] - y[1]) * (x[1] - y[1]) + (x[2] - y[2]) * (x[2] - y[2]);
+        if (dist < threshold_squared)
+            return true;
+    }
+    return false;
+}
+
+template<class Visit>
+void PointCloudGrid::neighbours(const double* points, int npoints, Visit visit) const {
+    for (int l = 0; l < npoints; ++l) {
+        const double* x = &points[3 * l];
+        int64_t c[3];
+        cell(x, c);
+        for (int ii = -1; ii <= 1; ++ii) {
+            for (int jj = -1; jj <= 1; ++jj) {
+                for (int kk = -1; kk <= 1; ++kk) {
+                    uint64_t k = key(c[0] + ii, c[1] + jj, c[2] + kk);
+                    auto it = cells.find(k);
+                    if (it == cells.end())
+                        continue;
+                    for (int q : it->second)
+                        if (!visit(x, q, k))
+                            return;
+                }
+            }
+        }
+    }
+}
+
+vector<tuple<int, int>> PointCloudGrid::close_pairs(int num_base) {
+    int n = size();
+    vector<int> todo;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < std::min(i, num_base); ++j) {
+            if (pair_state[size_t(i) * (i - 1) / 2 + j] < 0) {
+                todo.push_back(i);
+                break;
+            }
+        }
+    }
+
+    // every cloud i only writes the pairs (i, j) with j < i
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int t = 0; t < int(todo.size()); ++t) {
+        int i = todo[t];
+        signed char* state = &pair_state[size_t(i) * (i - 1) / 2];
+        int jmax = std::min(i, num_base);
+        vector<char> pending(jmax, 0);
+        int npending = 0;
+        for (int j = 0; j < jmax; ++j) {
+            if (state[j] < 0) {
+                pending[j] = 1;
+                state[j] = 0;
+                ++npending;
+            }
+        }
+        const Cloud& cloud = clouds[i];
+        neighbours(cloud.points.data(), cloud.order.size(), [&](const double* x, int q, uint64_t k) {
+            if (q < jmax && pending[q] && close_in_cell(x, q, k)) {
+                pending[q] = 0;
+                state[q] = 1;
+                --npending;
+            }
+            return npending > 0;
+        });
+    }
+
+    vector<tuple<int, int>> pairs;
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < std::min(i, num_base); ++j)
+            if (pair_state[size_t(i) * (i - 1) / 2 + j] > 0)
+                pairs.push_back({i, j});
+    return pairs;
+}
+
+vector<tuple<int, int>> PointCloudGrid::close_pairs_to(const vector<const double*>& points, const vector<int>& npoints) const {
+    int nq = points.size();
+    int n = size();
+    vector<vector<char>> close(nq, vector<char>(n, 0));
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < nq; ++i) {
+        int nremaining = n;
+        neighbours(points[i], npoints[i], [&](const double* x, int q, uint64_t k) {
+            if (!close[i][q] && close_in_cell(x, q, k)) {
+                close[i][q] = 1;
+                --nremaining;
+            }
+            return nremaining > 0;
+        });
+    }
+
+    vector<tuple<int, int>> pairs;
+    for (int i = 0; i < nq; ++i)
+        for (int j = 0; j < n; ++j)
+            if (close[i][j])
+                pairs.push_back({i, j});
+    return pairs;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+using std::vector;
+using std::tuple;
+
+// Spatial hash over a collection of point clouds (e.g. the quadrature points of
+// a set of coils) with cell size threshold. It finds all pairs of clouds that
+// have two points less than threshold apart: every point only needs to be
+// compared with the points in the 27 cells around it, so all pairs are found
+// in one pass over the points instead of comparing all pairs of clouds.
+//
+// The pairs found by close_pairs are cached. After set_cloud has replaced some
+// of the clouds (e.g. because only those coils moved in an optimizer step),
+// the next call to close_pairs only recomputes the pairs that involve them.
+class PointCloudGrid {
+    public:
+        PointCloudGrid(double threshold);
+
+        int size() const { return clouds.size(); }
+        double get_threshold() const { return threshold; }
+
+        // adds a cloud of npoints points at the end of the collection, points
+        // is a row-major (npoints, 3) array
+        void add_cloud(const double* points, int npoints);
+        // replaces cloud p of the collection
+        void set_cloud(int p, const double* points, int npoints);
+
+        // all pairs (i, j) with j < i and j < num_base of clouds in this
+        // collection that are closer than threshold, sorted
+        vector<tuple<int, int>> close_pairs(int num_base);
+        // all pairs (i, j) of a cloud i of the given clouds and a cloud j in
+        // this collection that are closer than threshold, sorted
+        vector<tuple<int, int>> close_pairs_to(const vector<const double*>& points, const vector<int>& npoints) const;
+
+    private:
+        struct Cloud {
+            vector<double> points;
+            // the cells of the points, sorted, and the indices of the points
+            // in the same order
+            vector<uint64_t> keys;
+            vector<int> order;
+        };
+        double threshold, threshold_squared;
+        vector<Cloud> clouds;
+        // the clouds with at least one point in a cell
+        std::unordered_map<uint64_t, vector<int>> cells;
+        // pair_state[i * (i - 1) / 2 + j] for j < i is 1 if the clouds i and
+        // j are close, 0 if not and -1 if not computed yet
+        vector<signed char> pair_state;
+
+        void cell(const double* x, int64_t* c) const;
+        static uint64_t key(int64_t i, int64_t j, int64_t k);
+        void fill(Cloud& cloud, const double* points, int npoints);
+        void insert_cells(int p);
+        void remove_cells(int p);
+        // whether any point of the cloud at points is closer than threshold to
+        // a point of cloud q that has the cell key
+        bool close_in_cell(const double* x, int q, uint64_t key) const;
+        // calls visit(x, q, key) for every point x of the given points and
+        // every cloud q of this collection with a point in one of the cells
+        // around x, until visit returns false
+        template<class Visit>
+        void neighbours(const double* points, int npoints, Visit visit) const;
+};
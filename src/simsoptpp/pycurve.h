@@ -74,6 +74,10 @@ template <class CurveBase = PyCurve> class PyCurveTrampoline : public CurveBase
             PYBIND11_OVERLOAD(PyArray, CurveBase, dgammadashdashdash_by_dcoeff_vjp_impl, v);
         }
 
+        virtual PyArray dgamma_by_dcoeff_jvp_impl(PyArray& w, int derivative) override {
+            PYBIND11_OVERLOAD(PyArray, CurveBase, dgamma_by_dcoeff_jvp_impl, w, derivative);
+        }
+
         virtual void kappa_impl(PyArray& data) override {
             PYBIND11_OVERLOAD(void, CurveBase, kappa_impl, data);
         }
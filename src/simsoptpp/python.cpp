@@ -14,7 +14,10 @@ typedef xt::pytensor<double, 2, xt::layout_type::row_major> PyTensor;
 
 #include "biot_savart_py.h"
 #include "biot_savart_vjp_py.h"
+#include "biot_savart_cuda.h"
 #include "boozerradialinterpolant.h"
+#include "coil_forces.h"
+#include "virtual_casing.h"
 #include "dipole_field.h"
 #include "dommaschk.h"
 #include "integral_BdotN.h"
@@ -22,6 +25,9 @@ typedef xt::pytensor<double, 2, xt::layout_type::row_major> PyTensor;
 #include "reiman.h"
 #include "simdhelpers.h"
 #include "boozerresidual_py.h"
+#include "scratch.h"
+#include "perf_counters.h"
+#include "threads.h"
 
 namespace py = pybind11;
 
@@ -36,8 +42,38 @@ void init_tracing(py::module_ &);
 void init_distance(py::module_ &);
 
 
+// Permanent magnet optimization algorithms have many default arguments. They
+// are registered for A_obj in double and in single precision. pybind11 first
+// tries all overloads without implicit conversions, so float32 matrices use the
+// single precision versions and everything else is converted to double. The
+// matrix-free DipoleFieldOperator is supported by all but the ArbVec variants.
+template<class AArray>
+void register_permanent_magnet_solvers(py::module_& m) {
+    m.def("MwPGP_algorithm", &MwPGP_algorithm<AArray>, py::arg("A_obj"), py::arg("b_obj"), py::arg("ATb"), py::arg("m_proxy"), py::arg("m0"), py::arg("m_maxima"), py::arg("alpha"), py::arg("nu") = 1.0e100, py::arg("epsilon") = 1.0e-3, py::arg("reg_l0") = 0.0, py::arg("reg_l1") = 0.0, py::arg("reg_l2") = 0.0, py::arg("max_iter") = 500, py::arg("min_fb") = 1.0e-20, py::arg("verbose") = false);
+    // variants of GPMO algorithm
+    m.def("GPMO_backtracking", &GPMO_backtracking<AArray>, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100, py::arg("backtracking") = 100, py::arg("dipole_grid_xyz"), py::arg("single_direction") = -1, py::arg("Nadjacent") = 7, py::arg("max_nMagnets"), py::arg("incremental") = false, py::arg("connectivity") = py::none(), py::arg("x_init") = py::none());
+    m.def("GPMO_multi", &GPMO_multi<AArray>, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100, py::arg("dipole_grid_xyz"), py::arg("single_direction") = -1, py::arg("Nadjacent") = 7, py::arg("incremental") = false, py::arg("x_init") = py::none());
+    if constexpr (!std::is_same<AArray, DipoleFieldOperator>::value) {
+        m.def("GPMO_ArbVec", &GPMO_ArbVec<AArray>, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("pol_vectors"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100);
+        m.def("GPMO_ArbVec_backtracking", &GPMO_ArbVec_backtracking<AArray>, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("pol_vectors"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100, py::arg("backtracking") = 100, py::arg("dipole_grid_xyz"), py::arg("Nadjacent") = 7, py::arg("thresh_angle") = 3.1415926535897931, py::arg("max_nMagnets"), py::arg("x_init"), py::arg("connectivity") = py::none());
+    }
+    m.def("GPMO_baseline", &GPMO_baseline<AArray>, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100, py::arg("single_direction") = -1, py::arg("incremental") = false, py::arg("x_init") = py::none());
+}
+
+// With SIMSOPT_SIMD_DISPATCH the module is built once per instruction set as
+// simsoptpp_sse4_2, simsoptpp_avx2 etc. and imported as simsoptpp by
+// src/simsoptpp/simsoptpp.py, see CMakeLists.txt.
+#if !defined(SIMSOPTPP_MODULE_NAME)
+#define SIMSOPTPP_MODULE_NAME simsoptpp
+#endif
+#if !defined(SIMSOPT_SIMD_VARIANT)
+#define SIMSOPT_SIMD_VARIANT "native"
+#endif
 
-PYBIND11_MODULE(simsoptpp, m) {
+PYBIND11_MODULE(SIMSOPTPP_MODULE_NAME, m) {
+    // the classes are registered as simsoptpp.Curve etc. for all variants, so
+    // that objects serialized with one variant can be loaded with another one
+    m.attr("__name__") = "simsoptpp";
     xt::import_numpy();
 
     init_curves(m);
@@ -49,8 +85,19 @@ PYBIND11_MODULE(simsoptpp, m) {
 
 #if defined(USE_XSIMD)
     m.attr("using_xsimd") = true;
+    m.attr("simd_architecture") = xs::default_arch::name();
 #else
     m.attr("using_xsimd") = false;
+    m.attr("simd_architecture") = "none";
+#endif
+    // the instruction set the module was compiled for, "native" if it was
+    // built without SIMSOPT_SIMD_DISPATCH for the flags in CMakeLists.txt
+    m.attr("simd_variant") = SIMSOPT_SIMD_VARIANT;
+    m.attr("simd_variants") = std::vector<std::string>{SIMSOPT_SIMD_VARIANT};
+#if defined(SIMSOPT_WITH_CUDA)
+    m.attr("using_cuda") = true;
+#else
+    m.attr("using_cuda") = false;
 #endif
 
     m.def("biot_savart", &biot_savart);
@@ -58,6 +105,19 @@ PYBIND11_MODULE(simsoptpp, m) {
     m.def("biot_savart_vjp", &biot_savart_vjp);
     m.def("biot_savart_vjp_graph", &biot_savart_vjp_graph);
     m.def("biot_savart_vector_potential_vjp_graph", &biot_savart_vector_potential_vjp_graph);
+    m.def("gpu_available", &biot_savart_cuda::device_available, "Whether simsoptpp was compiled with CUDA support and a GPU is available.");
+    m.def("set_gpu_enabled", &biot_savart_cuda::set_enabled, py::arg("enable"),
+            "Run the direct Biot-Savart sum in `BiotSavart.compute`, `BiotSavart.B_vjp_graph` and `biot_savart_vjp_graph` on the GPU.");
+    m.def("gpu_enabled", &biot_savart_cuda::enabled);
+
+    // Lorentz forces on coils, see simsopt.field.force.coil_forces
+    m.def("B_regularized", &B_regularized, py::arg("gamma"), py::arg("gammadash"), py::arg("gammadashdash"), py::arg("quadpoints"), py::arg("current"), py::arg("regularization"));
+    m.def("coil_forces", &coil_forces, py::arg("gammas"), py::arg("gammadashs"), py::arg("gammadashdashs"), py::arg("quadpoints"), py::arg("currents"), py::arg("regularizations"),
+            "Forces per unit length on the first len(regularizations) coils, and their net forces and torques.");
+    m.def("coil_forces_vjp", &coil_forces_vjp, py::arg("gammas"), py::arg("gammadashs"), py::arg("gammadashdashs"), py::arg("quadpoints"), py::arg("currents"), py::arg("regularizations"), py::arg("v"));
+
+    // see simsopt.mhd.virtual_casing.VirtualCasing.B_external_from_surface
+    m.def("virtual_casing_B_external", &virtual_casing_B_external, py::arg("gamma"), py::arg("normal"), py::arg("B"), py::arg("targets"), py::arg("B_targets"), py::arg("nfp"), py::arg("eta")=0.);
 
     // Functions below are implemented for permanent magnet optimization
     m.def("dipole_field_B" , &dipole_field_B);
@@ -65,19 +125,72 @@ PYBIND11_MODULE(simsoptpp, m) {
     m.def("dipole_field_dB", &dipole_field_dB);
     m.def("dipole_field_dA" , &dipole_field_dA);
     m.def("dipole_field_Bn" , &dipole_field_Bn, py::arg("points"), py::arg("m_points"), py::arg("unitnormal"), py::arg("nfp"), py::arg("stellsym"), py::arg("b"), py::arg("coordinate_flag") = "cartesian", py::arg("R0") = 0.0);
+    m.def("connectivity_matrix", &connectivity_matrix, py::arg("dipole_grid_xyz"), py::arg("Nadjacent"), py::arg("Nneighbors") = 2000,
+            "Indices of the Nneighbors closest dipoles to every dipole, sorted by distance. "
+            "Can be passed as connectivity to GPMO_backtracking and GPMO_ArbVec_backtracking.");
     m.def("define_a_uniform_cartesian_grid_between_two_toroidal_surfaces" , &define_a_uniform_cartesian_grid_between_two_toroidal_surfaces);
 
-    // Permanent magnet optimization algorithms have many default arguments
-    m.def("MwPGP_algorithm", &MwPGP_algorithm, py::arg("A_obj"), py::arg("b_obj"), py::arg("ATb"), py::arg("m_proxy"), py::arg("m0"), py::arg("m_maxima"), py::arg("alpha"), py::arg("nu") = 1.0e100, py::arg("epsilon") = 1.0e-3, py::arg("reg_l0") = 0.0, py::arg("reg_l1") = 0.0, py::arg("reg_l2") = 0.0, py::arg("max_iter") = 500, py::arg("min_fb") = 1.0e-20, py::arg("verbose") = false);
-    // variants of GPMO algorithm
-    m.def("GPMO_backtracking", &GPMO_backtracking, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100, py::arg("backtracking") = 100, py::arg("dipole_grid_xyz"), py::arg("single_direction") = -1, py::arg("Nadjacent") = 7, py::arg("max_nMagnets"));
-    m.def("GPMO_multi", &GPMO_multi, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100, py::arg("dipole_grid_xyz"), py::arg("single_direction") = -1, py::arg("Nadjacent") = 7);
-    m.def("GPMO_ArbVec", &GPMO_ArbVec, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("pol_vectors"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100);
-    m.def("GPMO_ArbVec_backtracking", &GPMO_ArbVec_backtracking, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("pol_vectors"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100, py::arg("backtracking") = 100, py::arg("dipole_grid_xyz"), py::arg("Nadjacent") = 7, py::arg("thresh_angle") = 3.1415926535897931, py::arg("max_nMagnets"), py::arg("x_init"));
-    m.def("GPMO_baseline", &GPMO_baseline, py::arg("A_obj"), py::arg("b_obj"), py::arg("mmax"), py::arg("normal_norms"), py::arg("K") = 1000, py::arg("verbose") = false, py::arg("nhistory") = 100, py::arg("single_direction") = -1);
+    py::class_<DipoleFieldOperator>(m, "DipoleFieldOperator",
+            "Matrix-free version of the matrix computed by dipole_field_Bn, reshaped to (num_points, 3 * num_dipoles). "
+            "It can be passed to MwPGP_algorithm and the GPMO variants instead of the dense A_obj.")
+        .def(py::init<Array&, Array&, Array&, int, int, std::string, double>(), py::arg("points"), py::arg("m_points"), py::arg("unitnormal"), py::arg("nfp"), py::arg("stellsym"), py::arg("coordinate_flag") = "cartesian", py::arg("R0") = 0.0)
+        .def_property_readonly("shape", [](const DipoleFieldOperator& op) { return std::make_tuple(op.shape(0), op.shape(1)); })
+        .def("scale_rows", &DipoleFieldOperator::scale_rows, py::arg("w"), "Copy of the operator with row i multiplied by w[i].")
+        .def("scale_columns", &DipoleFieldOperator::scale_columns, py::arg("w"), "Copy of the operator with column j multiplied by w[j].")
+        .def("matvec", &DipoleFieldOperator::matvec, py::arg("x"), "A @ x")
+        .def("rmatvec", &DipoleFieldOperator::rmatvec, py::arg("r"), "A.T @ r")
+        .def("todense", &DipoleFieldOperator::todense)
+        // the block writers only write into out if that doesn't require a conversion, so that out can be
+        // a slice of a np.memmap and the dense matrix is never held in memory as a whole
+        .def("dense_rows", [](const DipoleFieldOperator& op, int row_start, py::object out) {
+                if(!py::isinstance<py::array_t<double, py::array::c_style>>(out))
+                    throw std::invalid_argument("out needs to be a C contiguous array of doubles.");
+                PyArray res = out.cast<PyArray>();
+                if(res.dimension() != 2 || int(res.shape(1)) != op.shape(1))
+                    throw std::invalid_argument("out needs to have shape (nrows, 3 * num_dipoles).");
+                op.dense_rows(row_start, res.shape(0), res.data());
+                return out;
+            }, py::arg("row_start"), py::arg("out"),
+            "Write the rows row_start, ..., row_start + out.shape[0] - 1 of the dense matrix into out and return out.")
+        .def("dense_columns", [](const DipoleFieldOperator& op, int col_start, py::object out) {
+                if(!py::isinstance<py::array_t<double, py::array::c_style>>(out))
+                    throw std::invalid_argument("out needs to be a C contiguous array of doubles.");
+                PyArray res = out.cast<PyArray>();
+                if(res.dimension() != 2 || int(res.shape(1)) != op.shape(0))
+                    throw std::invalid_argument("out needs to have shape (ncols, num_points).");
+                op.dense_columns(col_start, res.shape(0), res.data());
+                return out;
+            }, py::arg("col_start"), py::arg("out"),
+            "Write the columns col_start, ..., col_start + out.shape[0] - 1 of the dense matrix as rows into out and return out, "
+            "i.e. a row block of the transposed matrix that the GPMO algorithms take.");
+
+    py::class_<DipoleFieldTreecode>(m, "DipoleFieldTreecode",
+            "Treecode approximation of dipole_field_B, dipole_field_dB, dipole_field_A and dipole_field_dA. "
+            "The tree is built once, the relative error scales as `theta**3` and `theta=0` gives the direct sum.")
+        .def(py::init<Array&, Array&, double, int>(), py::arg("m_points"), py::arg("m"), py::arg("theta"), py::arg("leafsize") = 16)
+        .def("B", &DipoleFieldTreecode::B, py::arg("points"))
+        .def("dB", &DipoleFieldTreecode::dB, py::arg("points"))
+        .def("A", &DipoleFieldTreecode::A, py::arg("points"))
+        .def("dA", &DipoleFieldTreecode::dA, py::arg("points"))
+        .def_property_readonly("theta", &DipoleFieldTreecode::get_theta)
+        .def_property_readonly("leafsize", &DipoleFieldTreecode::get_leafsize)
+        .def_property_readonly("num_dipoles", &DipoleFieldTreecode::num_dipoles);
+
+    register_permanent_magnet_solvers<Array>(m);
+    register_permanent_magnet_solvers<FloatArray>(m);
+    register_permanent_magnet_solvers<DipoleFieldOperator>(m);
 
     m.def("DommaschkB" , &DommaschkB);
     m.def("DommaschkdB", &DommaschkdB);
+    py::class_<DommaschkField>(m, "DommaschkField",
+            "Dommaschk field of the modes (m, n) with the given coefficients. The potentials are expanded into monomial tables once, "
+            "B and dB return the field summed over the modes, B_modes and dB_modes the field of every mode.")
+        .def(py::init<Array&, Array&, Array&>(), py::arg("m"), py::arg("n"), py::arg("coeffs"))
+        .def("B", py::overload_cast<Array&>(&DommaschkField::B, py::const_), py::arg("points"))
+        .def("dB", py::overload_cast<Array&>(&DommaschkField::dB, py::const_), py::arg("points"))
+        .def("B_modes", &DommaschkField::B_modes, py::arg("points"))
+        .def("dB_modes", &DommaschkField::dB_modes, py::arg("points"))
+        .def_property_readonly("num_modes", &DommaschkField::num_modes);
 
     m.def("integral_BdotN", &integral_BdotN);
 
@@ -94,39 +207,77 @@ PYBIND11_MODULE(simsoptpp, m) {
     // the computation below is used in boozer_surface_residual.
     //
     // G*dB_dc - 2*np.sum(B[..., None]*dB_dc, axis=2)[:, :, None, :] * tang[..., None] - B2[..., None, None] * (dxphi_dc + iota * dxtheta_dc)
-    m.def("boozer_dresidual_dc", [](double G, PyArray& dB_dc, PyArray& B, PyArray& tang, PyArray& B2, PyArray& dxphi_dc, double iota, PyArray& dxtheta_dc) {
-            int nphi = dB_dc.shape(0);
-            int ntheta = dB_dc.shape(1);
-            int ndofs = dB_dc.shape(3);
-            PyArray res = xt::zeros<double>({nphi, ntheta, 3, ndofs});
-            double* B_dB_dc = new double[ndofs];
-            for(int i=0; i<nphi; i++){
-                for(int j=0; j<ntheta; j++){
-                    for (int m = 0; m < ndofs; ++m) {
-                        B_dB_dc[m] = B(i, j, 0)*dB_dc(i, j, 0, m) + B(i, j, 1)*dB_dc(i, j, 1, m) + B(i, j, 2)*dB_dc(i, j, 2, m);
-                    }
-                    double B2ij = B2(i, j);
-                    for (int d = 0; d < 3; ++d) {
-                        auto dB_dc_ptr = &(dB_dc(i, j, d, 0));
-                        auto res_ptr = &(res(i, j, d, 0));
-                        auto dxphi_dc_ptr = &(dxphi_dc(i, j, d, 0));
-                        auto dxtheta_dc_ptr = &(dxtheta_dc(i, j, d, 0));
-                        auto tangijd = tang(i, j, d);
-                        for (int m = 0; m < ndofs; ++m) {
-                            res_ptr[m] = G*dB_dc_ptr[m]
-                            - 2*B_dB_dc[m]*tangijd
-                            - B2ij * (dxphi_dc_ptr[m] + iota*dxtheta_dc_ptr[m]);
-                        }
-                    }
+    m.def("boozer_dresidual_dc", [](double G, PyArray& dB_dc, PyArray& B, PyArray& tang, PyArray& B2, PyArray& dxphi_dc, double iota, PyArray& dxtheta_dc, py::object out) {
+            if(out.is_none()) {
+                PyArray res = xt::zeros<double>({dB_dc.shape(0), dB_dc.shape(1), size_t(3), dB_dc.shape(3)});
+                boozer_dresidual_dc(G, dB_dc, B, tang, B2, dxphi_dc, iota, dxtheta_dc, res);
+                return py::object(py::cast(res));
+            }
+            // only write into out if that doesn't require a conversion
+            if(!py::isinstance<py::array_t<double, py::array::c_style>>(out))
+                throw std::invalid_argument("out needs to be a C contiguous array of doubles.");
+            PyArray res = out.cast<PyArray>();
+            boozer_dresidual_dc(G, dB_dc, B, tang, B2, dxphi_dc, iota, dxtheta_dc, res);
+            return out;
+        }, py::arg("G"), py::arg("dB_dc"), py::arg("B"), py::arg("tang"), py::arg("B2"), py::arg("dxphi_dc"), py::arg("iota"), py::arg("dxtheta_dc"), py::arg("out")=py::none(),
+        "Derivative of the Boozer residual with respect to the surface dofs. If out is given, the result is written into it and out is returned.");
+    m.def("boozer_dresidual_dc_vjp", &boozer_dresidual_dc_vjp,
+        py::arg("G"), py::arg("dB_dc"), py::arg("B"), py::arg("tang"), py::arg("B2"), py::arg("dxphi_dc"), py::arg("iota"), py::arg("dxtheta_dc"), py::arg("v"),
+        "Contraction of boozer_dresidual_dc with v of shape (nphi, ntheta, 3), i.e. J^T v, without forming the derivative.");
+
+    m.def("scratch_heap_allocations", &scratch_heap_allocations,
+            "Number of memory chunks that the per thread scratch arenas for temporaries in hot C++ routines have allocated so far. "
+            "Repeated calls of a routine with the same sizes should leave this unchanged.");
+    m.def("scratch_capacity", []() { return scratch_arena().capacity(); }, "Bytes reserved by the scratch arena of the calling thread.");
+
+    m.def("get_num_threads", &get_num_threads, "Number of threads that the kernels called from this thread use.");
+    m.def("set_num_threads", &set_num_threads, py::arg("nthreads"),
+            "Sets the number of threads of the kernels that are called from this thread afterwards. Other threads keep their setting, "
+            "so independent optimizations can be run side by side from several python threads without oversubscription.");
+    m.def("bind_threads", &bind_threads, py::arg("cpus"),
+            "Restricts this thread and the threads of the kernels that it calls to the given cpus, e.g. to those of one socket. "
+            "Only supported on Linux.");
+
+    m.attr("perf_counters_enabled") = perf_counters_enabled;
+    m.def("perf_counters", [](bool per_thread) {
+            auto values = [](const PerfValues& v, const char* unit) {
+                py::dict d;
+                d["calls"] = v.calls;
+                d["items"] = v.items;
+                if(unit)
+                    d["unit"] = unit;
+                d["time"] = 1e-9 * v.nanoseconds;
+                return d;
+            };
+            PerfRegistry& registry = PerfRegistry::instance();
+            PerfSnapshot total = registry.total();
+            auto threads = per_thread ? registry.per_thread() : vector<std::pair<int, PerfSnapshot>>();
+            py::dict res;
+            for (int c = 0; c < num_perf_counters; ++c) {
+                py::dict d = values(total[c], perf_counter_units[c]);
+                if(per_thread) {
+                    py::dict t;
+                    for (auto& [thread, snapshot] : threads)
+                        t[py::int_(thread)] = values(snapshot[c], nullptr);
+                    d["threads"] = t;
                 }
+                res[perf_counter_names[c]] = d;
             }
-            delete[] B_dB_dc;
             return res;
-        });
+        }, py::arg("per_thread")=false,
+        "The number of calls, the number of items processed (in the given unit) and the time in seconds spent in the major kernels "
+        "since the last call of reset_perf_counters(), summed over all threads. If per_thread is true, the values of every thread "
+        "are also returned under 'threads', with the threads that have exited summed under -1. All values are zero unless "
+        "simsoptpp was built with SIMSOPT_PERF_COUNTERS, see perf_counters_enabled.");
+    m.def("reset_perf_counters", []() { PerfRegistry::instance().reset(); },
+        "Sets all performance counters to zero. Should not be called while a kernel is running on another thread.");
 
     m.def("boozer_residual", &boozer_residual);
     m.def("boozer_residual_ds", &boozer_residual_ds);
     m.def("boozer_residual_ds2", &boozer_residual_ds2);
+    m.def("boozer_residual_hvp", &boozer_residual_hvp, py::arg("G"), py::arg("iota"), py::arg("B"), py::arg("dB_dx"), py::arg("d2B_dx2"),
+            py::arg("xphi"), py::arg("xtheta"), py::arg("dx_ds"), py::arg("dxphi_ds"), py::arg("dxtheta_ds"), py::arg("v"), py::arg("weight_inv_modB"),
+            "Product of the Hessian of boozer_residual_ds2 with the vector v of length ndofs+2, computed without forming the Hessian.");
 
     m.def("matmult", [](PyArray& A, PyArray&B) {
             // Product of an lxm matrix with an mxn matrix, results in an l x n matrix
@@ -11,9 +11,11 @@ using std::vector;
 namespace py = pybind11;
 #include "boozermagneticfield.h"
 #include "boozermagneticfield_interpolated.h"
+#include "boozermagneticfield_radial.h"
 #include "pyboozermagneticfield.h"
 #include "regular_grid_interpolant_3d.h"
 typedef InterpolatedBoozerField<xt::pytensor> PyInterpolatedBoozerField;
+typedef BoozerRadialInterpolant<xt::pytensor> PyBoozerRadialInterpolant;
 typedef BoozerMagneticField<xt::pytensor> PyBoozerMagneticField;
 
 template <typename T, typename S> void register_common_field_methods(S &c) {
@@ -110,9 +112,20 @@ void init_boozermagneticfields(py::module_ &m){
       .def("estimate_error_G", &PyInterpolatedBoozerField::estimate_error_G)
       .def("estimate_error_I", &PyInterpolatedBoozerField::estimate_error_I)
       .def("estimate_error_iota", &PyInterpolatedBoozerField::estimate_error_iota)
+      .def("set_cache", &PyInterpolatedBoozerField::set_cache, py::arg("prefix"))
+      .def("set_value_bits", &PyInterpolatedBoozerField::set_value_bits, py::arg("bits"))
+      .def("set_fused", &PyInterpolatedBoozerField::set_fused, py::arg("names"))
+      .def("get_fused", &PyInterpolatedBoozerField::get_fused)
       .def_readonly("s_range", &PyInterpolatedBoozerField::s_range)
       .def_readonly("theta_range", &PyInterpolatedBoozerField::theta_range)
       .def_readonly("zeta_range", &PyInterpolatedBoozerField::zeta_range)
       .def_readonly("rule", &PyInterpolatedBoozerField::rule);
 
+  py::class_<PyBoozerRadialInterpolant, shared_ptr<PyBoozerRadialInterpolant>, PyBoozerMagneticField>(m, "BoozerRadialInterpolant")
+      .def(py::init<double, const vector<double>&, const vector<double>&, bool, bool>(),
+              py::arg("psi0"), py::arg("xm"), py::arg("xn"), py::arg("stellsym"), py::arg("no_K"))
+      .def("set_splines", &PyBoozerRadialInterpolant::set_splines, py::arg("name"), py::arg("knots"), py::arg("coeffs"))
+      .def("set_fused", &PyBoozerRadialInterpolant::set_fused, py::arg("names"))
+      .def("get_fused", &PyBoozerRadialInterpolant::get_fused);
+
 }
@@ -15,6 +15,9 @@ typedef CurveXYZFourier<PyArray> PyCurveXYZFourier;
 typedef CurveRZFourier<PyArray> PyCurveRZFourier; 
 #include "curveplanarfourier.h"
 typedef CurvePlanarFourier<PyArray> PyCurvePlanarFourier;
+#include "uniformfourier.h"
+#include "curvebatch.h"
+typedef CurveBatch<PyArray> PyCurveBatch;
 
 template <class PyCurveXYZFourierBase = PyCurveXYZFourier> class PyCurveXYZFourierTrampoline : public PyCurveTrampoline<PyCurveXYZFourierBase> {
     public:
@@ -94,6 +97,10 @@ template <typename T, typename S> void register_common_curve_methods(S &c) {
      .def("dgammadash_by_dcoeff_vjp_impl", &T::dgammadash_by_dcoeff_vjp_impl)
      .def("dgammadashdash_by_dcoeff_vjp_impl", &T::dgammadashdash_by_dcoeff_vjp_impl)
      .def("dgammadashdashdash_by_dcoeff_vjp_impl", &T::dgammadashdashdash_by_dcoeff_vjp_impl)
+     .def("dgamma_by_dcoeff_jvp", &T::dgamma_by_dcoeff_jvp, py::arg("w"), py::arg("derivative") = 0,
+             "Returns the derivative of gamma (derivative = 0), gammadash (1), gammadashdash (2) or gammadashdashdash (3) in the direction `w` of the dofs, "
+             "without forming the `d*_by_dcoeff` arrays for Fourier curves.")
+     .def("dgamma_by_dcoeff_jvp_impl", &T::dgamma_by_dcoeff_jvp_impl)
 
      .def("incremental_arclength", &T::incremental_arclength)
      .def("dincremental_arclength_by_dcoeff", &T::dincremental_arclength_by_dcoeff)
@@ -102,6 +109,11 @@ template <typename T, typename S> void register_common_curve_methods(S &c) {
      .def("torsion", &T::torsion)
      .def("dtorsion_by_dcoeff", &T::dtorsion_by_dcoeff)
      .def("invalidate_cache", &T::invalidate_cache)
+     .def("enable_cache_stats", &T::enable_cache_stats, py::arg("enabled"), "Count cache hits, recomputes and the time spent recomputing for each cached quantity.")
+     .def("reset_cache_stats", &T::reset_cache_stats)
+     .def("cache_stats", &T::cache_stats, "Returns a dict from the name of each cached quantity that was accessed since the last reset to its `CacheStats`.")
+     .def("cache_bytes", &T::cache_bytes, "Returns a dict from the name of each cached quantity to the number of bytes it holds.")
+     .def("cache_id", &T::get_cache_id, "Identifies the object in `simsoptpp.cache_usage()`.")
      .def("least_squares_fit", &T::least_squares_fit)
 
      .def("set_dofs", &T::set_dofs)
@@ -112,6 +124,43 @@ template <typename T, typename S> void register_common_curve_methods(S &c) {
 }
 
 void init_curves(py::module_ &m) {
+    py::class_<CacheStats>(m, "CacheStats")
+        .def_readonly("hits", &CacheStats::hits)
+        .def_readonly("recomputes", &CacheStats::recomputes)
+        .def_readonly("allocations", &CacheStats::allocations)
+        .def_readonly("seconds", &CacheStats::seconds)
+        .def("__repr__", [](const CacheStats& s) {
+            return "CacheStats(hits=" + std::to_string(s.hits) + ", recomputes=" + std::to_string(s.recomputes)
+                + ", allocations=" + std::to_string(s.allocations) + ", seconds=" + std::to_string(s.seconds) + ")";
+        });
+
+    // the CacheRegistry that keeps track of the caches of all curves,
+    // surfaces and Biot-Savart fields
+    m.def("set_cache_budget", [](size_t bytes) { CacheRegistry::instance().set_budget(bytes); }, py::arg("bytes"),
+            "Limit the memory held by the caches of all curves, surfaces and Biot-Savart fields to `bytes`, 0 means unlimited. "
+            "Stale entries, i.e. ones that would be recomputed on their next access anyway, are freed automatically, least recently used first, whenever a cache allocates. "
+            "Entries that hold valid data are only freed by `cache_trim()`.");
+    m.def("get_cache_budget", []() { return CacheRegistry::instance().get_budget(); });
+    m.def("cache_trim", []() { return CacheRegistry::instance().trim(); },
+            "Free stale and then least recently used valid entries until the caches are within the budget, and return the number of bytes freed. "
+            "The freed quantities are recomputed on their next access. Must not be called while C++ code is using the caches, e.g. from a callback.");
+    m.def("cache_free_stale", []() { return CacheRegistry::instance().free_stale(); },
+            "Free all stale entries regardless of the budget, and return the number of bytes freed.");
+    m.def("cache_total_bytes", []() { return CacheRegistry::instance().total_bytes(); });
+    m.def("cache_evictions", []() { return CacheRegistry::instance().evictions(); }, "Total number of entries freed so far.");
+    m.def("cache_usage", []() {
+                vector<std::tuple<string, int, string, size_t, bool>> res;
+                for (auto& u : CacheRegistry::instance().usage())
+                    res.push_back({u.owner, u.object_id, u.key, u.bytes, u.valid});
+                return res;
+            },
+            "Returns a list of `(owner, id, key, bytes, valid)` tuples, one for every cache entry that holds memory, where `id` is the `cache_id()` of the owning object.");
+
+    m.def("set_fft_mode", &set_fft_mode, py::arg("mode"),
+            "Choose when Fourier curves and surfaces are evaluated with FFTs: 'auto' (the default) uses them on uniform quadrature points once there are at least 8 modes, "
+            "'always' on all uniform quadrature points and 'never' disables them. Quantities that are already cached are not recomputed.");
+    m.def("get_fft_mode", &get_fft_mode);
+
     auto pycurve = py::class_<PyCurve, shared_ptr<PyCurve>, PyCurveTrampoline<PyCurve>>(m, "Curve")
         .def(py::init<vector<double>>());
     register_common_curve_methods<PyCurve>(pycurve);
@@ -144,4 +193,10 @@ void init_curves(py::module_ &m) {
         .def_readonly("stellsym", &PyCurvePlanarFourier::stellsym)
         .def_readonly("nfp", &PyCurvePlanarFourier::nfp);
     register_common_curve_methods<PyCurvePlanarFourier>(pycurveplanarfourier);
+
+    py::class_<PyCurveBatch>(m, "CurveBatch")
+        .def(py::init<vector<shared_ptr<PyCurve>>>(), py::arg("curves"))
+        .def("evaluate", &PyCurveBatch::evaluate, py::arg("derivative") = 1,
+                "Compute gamma, gammadash, ... up to the `derivative`-th derivative of all curves whose cache is not up to date, and store them in their caches.")
+        .def("__len__", &PyCurveBatch::size);
 }
@@ -3,215 +3,436 @@
 namespace py = pybind11;
 #include "xtensor-python/pyarray.hpp"     // Numpy bindings
 typedef xt::pyarray<double> PyArray;
-using std::vector;
-using std::tuple;
-using std::set;
-using std::floor;
-
-
-template<class T>
-bool empty_intersection(const set<T>& x, const set<T>& y)
-{
-    auto i = x.begin();
-    auto j = y.begin();
-    while (i != x.end() && j != y.end())
-    {
-        if (*i == *j)
-            return false;
-        else if (*i < *j)
-            ++i;
-        else
-            ++j;
+#include "xtensor-python/pytensor.hpp"     // Numpy bindings
+typedef xt::pytensor<double, 2, xt::layout_type::row_major> PyTensor;
+#include "pointcloud_grid.h"
+#include "surface_distance.h"
+#include "regular_grid_interpolant_3d.h"
+#include "simdhelpers.h"
+
+static const double* cloud_data(const PyArray& points) {
+    if(points.layout() != xt::layout_type::row_major)
+        throw std::runtime_error("point clouds need to be in row-major storage order");
+    if(points.dimension() != 2 || points.shape(1) != 3)
+        throw std::invalid_argument("point clouds need to have shape (n, 3)");
+    return points.data();
+}
+
+static PointCloudGrid make_grid(const vector<PyArray>& pointClouds, double threshold) {
+    PointCloudGrid grid(threshold);
+    for (auto& points : pointClouds)
+        grid.add_cloud(cloud_data(points), points.shape(0));
+    return grid;
+}
+
+vector<tuple<int, int>> get_close_candidates_pdist(vector<PyArray>& pointClouds, double threshold, int num_base_curves) {
+    /*
+       Returns all pairings (i, j) with j < i and j < num_base_curves of the
+       given pointClouds that have two points that are less than `threshold`
+       away, see PointCloudGrid.
+       */
+    return make_grid(pointClouds, threshold).close_pairs(num_base_curves);
+}
+
+vector<tuple<int, int>> get_close_candidates_cdist(vector<PyArray>& pointCloudsA, vector<PyArray>& pointCloudsB, double threshold) {
+    /*
+       Returns all pairings (i, j) of pointCloudsA[i] and pointCloudsB[j] that
+       have two points that are less than `threshold` away.
+       */
+    PointCloudGrid grid = make_grid(pointCloudsB, threshold);
+    vector<const double*> points;
+    vector<int> npoints;
+    for (auto& p : pointCloudsA) {
+        points.push_back(cloud_data(p));
+        npoints.push_back(p.shape(0));
     }
-    return true;
+    return grid.close_pairs_to(points, npoints);
 }
 
-bool two_points_too_close_exist(PyArray& XA, PyArray& XB, double threshold_squared){
-    for (int k = 0; k < XA.shape(0); ++k) {
-        for (int l = 0; l < XB.shape(0); ++l) {
-            double dist = std::pow(XA(k, 0) - XB(l, 0), 2) + std::pow(XA(k, 1) - XB(l, 1), 2) + std::pow(XA(k, 2) - XB(l, 2), 2);
-            if(dist < threshold_squared)
-                return true;
+// The lanes of the linking number and distance kernels run over consecutive
+// points of a curve or surface, they are either simd vectors or plain doubles.
+#if defined(USE_XSIMD)
+using distance_lane_t = simd_t;
+constexpr int distance_simd_size = xsimd::simd_type<double>::size;
+inline distance_lane_t distance_load(const double* ptr) { return xs::load_aligned(ptr); }
+inline void distance_store(double* ptr, const distance_lane_t& x) { x.store_aligned(ptr); }
+inline distance_lane_t distance_max(const distance_lane_t& x, double y) { return xsimd::max(x, distance_lane_t(y)); }
+inline double distance_lane_sum(const distance_lane_t& x) { return xsimd::hadd(x); }
+#else
+using distance_lane_t = double;
+constexpr int distance_simd_size = 1;
+inline distance_lane_t distance_load(const double* ptr) { return *ptr; }
+inline void distance_store(double* ptr, const distance_lane_t& x) { *ptr = x; }
+inline distance_lane_t distance_max(const distance_lane_t& x, double y) { return std::max(x, y); }
+inline double distance_lane_sum(const distance_lane_t& x) { return x; }
+#endif
+
+// A curve of compute_linking_number, every downsample-th quadrature point in
+// structure-of-arrays layout. The arrays are padded to a multiple of the simd
+// size with points far away from all curves and zero tangents, which add
+// nothing to the Gauss integral.
+struct LinkingCurve {
+    AlignedPaddedVec x, y, z, dx, dy, dz;
+    int n;
+    double lo[3], hi[3];
+};
+
+// oint_c1 oint_c2 (r1 - r2) . (dr1 x dr2) / |r1 - r2|^3, without the
+// quadrature weights
+static double gauss_linking_integral(const LinkingCurve& c1, const LinkingCurve& c2) {
+    distance_lane_t total(0.);
+    for (int i = 0; i < c1.n; ++i) {
+        double x1 = c1.x[i], y1 = c1.y[i], z1 = c1.z[i];
+        double dx1 = c1.dx[i], dy1 = c1.dy[i], dz1 = c1.dz[i];
+        for (int j = 0; j < c2.n; j += distance_simd_size) {
+            distance_lane_t rx = x1 - distance_load(&c2.x[j]);
+            distance_lane_t ry = y1 - distance_load(&c2.y[j]);
+            distance_lane_t rz = z1 - distance_load(&c2.z[j]);
+            distance_lane_t dx2 = distance_load(&c2.dx[j]);
+            distance_lane_t dy2 = distance_load(&c2.dy[j]);
+            distance_lane_t dz2 = distance_load(&c2.dz[j]);
+            distance_lane_t det = dx1 * (dy2 * rz - dz2 * ry) - dy1 * (dx2 * rz - dz2 * rx) + dz1 * (dx2 * ry - dy2 * rx);
+            distance_lane_t rinv = rsqrt(rx * rx + ry * ry + rz * rz);
+            total += det * (rinv * (rinv * rinv));
         }
     }
-    return false;
+    return distance_lane_sum(total);
 }
 
-vector<tuple<int, int>> get_close_candidates_pdist(vector<PyArray>& pointClouds, double threshold, int num_base_curves) {
+int compute_linking_number(const vector<PyArray>& gammas, const vector<PyArray>& gammadashs, const PyArray& dphis, int downsample) {
     /*
-       Returns all pairings of the given pointClouds that have two points that
-       are less than `threshold` away. The estimate is approximate (for
-       speed), so this function may return too many (but not too few!)
-       pairings.
-
-       The basic idea of this function is the following:
-       - Assume we want to compare pointcloud A and B.
-       - We create a uniform grid of cell size threshold.
-       - Loop over points in cloud A, mark all cells that have a point in it (via the `set` variables below).
-       - Loop over points in cloud B, mark all cells that have a point in it and also all cells in the 8 neighbouring cells around it.
-       - Check whether the intersection between the two sets is non-empty.
+       Sum over all pairs of curves of the rounded absolute Gauss linking
+       number, using every downsample-th quadrature point.
+
+       Two closed curves whose bounding boxes are disjoint lie on both sides
+       of a plane, so they cannot be linked and their pair is skipped. The
+       remaining pairs are distributed over the threads one at a time, since
+       their costs vary, and the inner loop runs over simd vectors of points
+       of the second curve.
        */
-    vector<set<tuple<int, int, int>>> sets(pointClouds.size());
-    vector<set<tuple<int, int, int>>> sets_extended(pointClouds.size());
-#pragma omp parallel for
-    for (int p = 0; p < pointClouds.size(); ++p) {
-        PyArray& points = pointClouds[p];
-        for (int l = 0; l < points.shape(0); ++l) {
-            int i = floor(points(l, 0)/threshold);
-            int j = floor(points(l, 1)/threshold);
-            int k = floor(points(l, 2)/threshold);
-            sets[p].insert({i, j, k});
-            for (int ii = -1; ii <= 1; ++ii) {
-                for (int jj = -1; jj <= 1; ++jj) {
-                    for (int kk = -1; kk <= 1; ++kk) {
-                        sets_extended[p].insert({i + ii, j + jj, k + kk});
-                    }
-                }
+    int ncurves = gammas.size();
+    if(int(gammadashs.size()) != ncurves || int(dphis.size()) != ncurves)
+        throw std::invalid_argument("gammas, gammadashs and dphis need to have the same length");
+    if(downsample < 1)
+        throw std::invalid_argument("downsample needs to be positive");
+
+    double scale = 1.;
+    for (auto& gamma : gammas)
+        for (auto v : gamma)
+            scale = std::max(scale, std::abs(v));
+    double far = 4 * scale;
+
+    vector<LinkingCurve> curves(ncurves);
+    for (int p = 0; p < ncurves; ++p) {
+        const PyArray& gamma = gammas[p];
+        const PyArray& gammadash = gammadashs[p];
+        LinkingCurve& c = curves[p];
+        c.n = (int(gamma.shape(0)) + downsample - 1) / downsample;
+        int npadded = ((c.n + distance_simd_size - 1) / distance_simd_size) * distance_simd_size;
+        AlignedPaddedVec* coords[6] = {&c.x, &c.y, &c.z, &c.dx, &c.dy, &c.dz};
+        for (int d = 0; d < 3; ++d) {
+            *coords[d] = AlignedPaddedVec(npadded, far);
+            *coords[3 + d] = AlignedPaddedVec(npadded, 0.);
+            c.lo[d] = std::numeric_limits<double>::infinity();
+            c.hi[d] = -std::numeric_limits<double>::infinity();
+        }
+        for (int i = 0; i < c.n; ++i) {
+            for (int d = 0; d < 3; ++d) {
+                (*coords[d])[i] = gamma(i * downsample, d);
+                (*coords[3 + d])[i] = gammadash(i * downsample, d);
+            }
+        }
+        for (int i = 0; i < int(gamma.shape(0)); ++i) {
+            for (int d = 0; d < 3; ++d) {
+                c.lo[d] = std::min(c.lo[d], gamma(i, d));
+                c.hi[d] = std::max(c.hi[d], gamma(i, d));
             }
         }
     }
 
-
-    vector<tuple<int, int>> candidates_1;
-    for (int i = 0; i < pointClouds.size(); ++i) {
-        for (int j = 0; j < i; ++j) {
-            if(j < num_base_curves)
-                candidates_1.push_back({i, j});
+    vector<tuple<int, int>> pairs;
+    for (int p = 1; p < ncurves; ++p) {
+        for (int q = 0; q < p; ++q) {
+            bool separated = false;
+            for (int d = 0; d < 3; ++d)
+                separated = separated || curves[p].hi[d] < curves[q].lo[d] || curves[q].hi[d] < curves[p].lo[d];
+            if (!separated)
+                pairs.push_back({p, q});
         }
     }
-    vector<tuple<int, int>> candidates_2;
-#pragma omp parallel for
-    for (int k = 0; k < candidates_1.size(); ++k) {
-        int i = std::get<0>(candidates_1[k]);
-        int j = std::get<1>(candidates_1[k]);
-        bool check = empty_intersection(sets_extended[i], sets[j]);
-#pragma omp critical
-        if(!check)
-            candidates_2.push_back({i, j});
-    }
 
-    double t2 = threshold*threshold;
-    vector<tuple<int, int>> candidates_3;
-#pragma omp parallel for
-    for (int k = 0; k < candidates_2.size(); ++k) {
-        int i = std::get<0>(candidates_2[k]);
-        int j = std::get<1>(candidates_2[k]);
-        bool check = two_points_too_close_exist(pointClouds[i], pointClouds[j], t2);
-#pragma omp critical
-        if(check)
-            candidates_3.push_back({i, j});
+    int linking_number = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:linking_number)
+    for (int k = 0; k < int(pairs.size()); ++k) {
+        int p = std::get<0>(pairs[k]);
+        int q = std::get<1>(pairs[k]);
+        double total = gauss_linking_integral(curves[p], curves[q]);
+        linking_number += std::round(std::abs(total * dphis[p] * dphis[q]) / (4 * M_PI));
     }
-    return candidates_3;
+    return linking_number;
 }
 
-vector<tuple<int, int>> get_close_candidates_cdist(vector<PyArray>& pointCloudsA, vector<PyArray>& pointCloudsB, double threshold) {
-    /*
-       */
-    vector<set<tuple<int, int, int>>> sets_A(pointCloudsA.size());
-    vector<set<tuple<int, int, int>>> sets_B_extended(pointCloudsB.size());
-#pragma omp parallel for
-    for (int p = 0; p < pointCloudsA.size(); ++p) {
-        PyArray& points = pointCloudsA[p];
-        for (int l = 0; l < points.shape(0); ++l) {
-            int i = floor(points(l, 0)/threshold);
-            int j = floor(points(l, 1)/threshold);
-            int k = floor(points(l, 2)/threshold);
-            sets_A[p].insert({i, j, k});
+// Points of a curve or surface for the distance penalties in structure-of-arrays
+// layout: positions, tangents (or normals) and the norms of the tangents. The
+// arrays are padded to a multiple of the simd size with points far away from
+// everything and zero tangents, which add nothing to the penalty.
+struct PenaltyPoints {
+    AlignedPaddedVec x, y, z, lx, ly, lz, lnorm;
+    int n;
+};
+
+static PenaltyPoints penalty_points(const PyArray& gamma, const PyArray& l) {
+    if(gamma.dimension() != 2 || gamma.shape(1) != 3 || l.dimension() != 2 || l.shape(1) != 3 || l.shape(0) != gamma.shape(0))
+        throw std::invalid_argument("points and tangents need to have the same shape (n, 3)");
+    PenaltyPoints P;
+    P.n = gamma.shape(0);
+    int npadded = ((P.n + distance_simd_size - 1) / distance_simd_size) * distance_simd_size;
+    AlignedPaddedVec* coords[7] = {&P.x, &P.y, &P.z, &P.lx, &P.ly, &P.lz, &P.lnorm};
+    for (int d = 0; d < 3; ++d)
+        *coords[d] = AlignedPaddedVec(npadded, 1e30);
+    for (int d = 3; d < 7; ++d)
+        *coords[d] = AlignedPaddedVec(npadded, 0.);
+    for (int i = 0; i < P.n; ++i) {
+        for (int d = 0; d < 3; ++d) {
+            (*coords[d])[i] = gamma(i, d);
+            (*coords[3 + d])[i] = l(i, d);
         }
+        P.lnorm[i] = std::sqrt(l(i, 0) * l(i, 0) + l(i, 1) * l(i, 1) + l(i, 2) * l(i, 2));
     }
-    for (int p = 0; p < pointCloudsB.size(); ++p) {
-        set<tuple<int, int, int>> s;
-        set<tuple<int, int, int>> s_extended;
-        PyArray& points = pointCloudsB[p];
-        for (int l = 0; l < points.shape(0); ++l) {
-            int i = floor(points(l, 0)/threshold);
-            int j = floor(points(l, 1)/threshold);
-            int k = floor(points(l, 2)/threshold);
-            for (int ii = -1; ii <= 1; ++ii) {
-                for (int jj = -1; jj <= 1; ++jj) {
-                    for (int kk = -1; kk <= 1; ++kk) {
-                        sets_B_extended[p].insert({i + ii, j + jj, k + kk});
-                    }
+    return P;
+}
+
+// J = sum_{a, b} |l_A,a| |l_B,b| max(dmin - |A_a - B_b|, 0)^2 / (n_A n_B)
+// and, if the gradient pointers are not null, its gradient with respect to the
+// points and tangents of A and B, which is added to the row-major (n, 3)
+// arrays dA, dlA, dB and dlB. The gradients with respect to B are only
+// computed if gradB is true. The inner loop runs over simd vectors of points
+// of B.
+template<bool derivatives, bool gradB>
+static double distance_penalty(const PenaltyPoints& A, const PenaltyPoints& B, double dmin, double* dA, double* dlA, double* dB, double* dlB) {
+    int npadded = B.x.size();
+    AlignedPaddedVec gB[4];
+    if (derivatives && gradB)
+        for (int d = 0; d < 4; ++d)
+            gB[d] = AlignedPaddedVec(npadded, 0.);
+    double scale = 1. / (double(A.n) * B.n);
+    double J = 0.;
+    for (int a = 0; a < A.n; ++a) {
+        double ax = A.x[a], ay = A.y[a], az = A.z[a], la = A.lnorm[a];
+        distance_lane_t Ja(0.), gx(0.), gy(0.), gz(0.), gl(0.);
+        for (int j = 0; j < npadded; j += distance_simd_size) {
+            distance_lane_t rx = ax - distance_load(&B.x[j]);
+            distance_lane_t ry = ay - distance_load(&B.y[j]);
+            distance_lane_t rz = az - distance_load(&B.z[j]);
+            distance_lane_t d2 = rx * rx + ry * ry + rz * rz;
+            distance_lane_t dinv = rsqrt(d2);
+            distance_lane_t s = distance_max(dmin - d2 * dinv, 0.);
+            distance_lane_t lb = distance_load(&B.lnorm[j]);
+            distance_lane_t ls2 = lb * (s * s);
+            Ja += ls2;
+            if (derivatives) {
+                // dJ/dA_a = -2 |l_A,a| |l_B,b| max(...) r / |r|
+                distance_lane_t c = -2. * la * lb * s * dinv;
+                gx += c * rx;
+                gy += c * ry;
+                gz += c * rz;
+                gl += ls2;
+                if (gradB) {
+                    distance_store(&gB[0][j], distance_load(&gB[0][j]) - c * rx);
+                    distance_store(&gB[1][j], distance_load(&gB[1][j]) - c * ry);
+                    distance_store(&gB[2][j], distance_load(&gB[2][j]) - c * rz);
+                    distance_store(&gB[3][j], distance_load(&gB[3][j]) + la * (s * s));
                 }
             }
         }
+        J += la * distance_lane_sum(Ja);
+        if (derivatives) {
+            dA[3 * a + 0] += scale * distance_lane_sum(gx);
+            dA[3 * a + 1] += scale * distance_lane_sum(gy);
+            dA[3 * a + 2] += scale * distance_lane_sum(gz);
+            double fl = scale * distance_lane_sum(gl) / la;
+            dlA[3 * a + 0] += fl * A.lx[a];
+            dlA[3 * a + 1] += fl * A.ly[a];
+            dlA[3 * a + 2] += fl * A.lz[a];
+        }
+    }
+    if (derivatives && gradB) {
+        for (int b = 0; b < B.n; ++b) {
+            for (int d = 0; d < 3; ++d)
+                dB[3 * b + d] += scale * gB[d][b];
+            double fl = scale * gB[3][b] / B.lnorm[b];
+            dlB[3 * b + 0] += fl * B.lx[b];
+            dlB[3 * b + 1] += fl * B.ly[b];
+            dlB[3 * b + 2] += fl * B.lz[b];
+        }
     }
+    return scale * J;
+}
 
+static vector<PyArray> zeros_like(const vector<PyArray>& arrays) {
+    vector<PyArray> res;
+    for (auto& a : arrays)
+        res.push_back(xt::zeros<double>({a.shape(0), a.shape(1)}));
+    return res;
+}
 
-    vector<tuple<int, int>> candidates_1;
-    for (int i = 0; i < pointCloudsA.size(); ++i) {
-        for (int j = 0; j < pointCloudsB.size(); ++j) {
-            candidates_1.push_back({i, j});
-        }
+tuple<double, vector<PyArray>, vector<PyArray>> curve_curve_distance_penalty(
+        const vector<PyArray>& gammas, const vector<PyArray>& gammadashs, const vector<tuple<int, int>>& candidates,
+        double minimum_distance, bool derivatives) {
+    /*
+       The penalty of CurveCurveDistance summed over the candidate pairs of
+       curves, and its gradient with respect to gamma and gammadash of every
+       curve if derivatives is true. The pairs are distributed over the
+       threads, each pair adds its gradients under a lock.
+       */
+    int ncurves = gammas.size();
+    if(int(gammadashs.size()) != ncurves)
+        throw std::invalid_argument("gammas and gammadashs need to have the same length");
+    vector<PenaltyPoints> curves(ncurves);
+    for (int i = 0; i < ncurves; ++i)
+        curves[i] = penalty_points(gammas[i], gammadashs[i]);
+    vector<PyArray> dgamma, dgammadash;
+    if (derivatives) {
+        dgamma = zeros_like(gammas);
+        dgammadash = zeros_like(gammadashs);
     }
-    vector<tuple<int, int>> candidates_2;
-#pragma omp parallel for
-    for (int k = 0; k < candidates_1.size(); ++k) {
-        int i = std::get<0>(candidates_1[k]);
-        int j = std::get<1>(candidates_1[k]);
-        bool check = empty_intersection(sets_A[i], sets_B_extended[j]);
+
+    double J = 0.;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:J)
+    for (int k = 0; k < int(candidates.size()); ++k) {
+        int i = std::get<0>(candidates[k]);
+        int j = std::get<1>(candidates[k]);
+        if (!derivatives) {
+            J += distance_penalty<false, false>(curves[i], curves[j], minimum_distance, nullptr, nullptr, nullptr, nullptr);
+            continue;
+        }
+        vector<double> g(6 * (curves[i].n + curves[j].n), 0.);
+        double* dA = g.data();
+        double* dlA = dA + 3 * curves[i].n;
+        double* dB = dlA + 3 * curves[i].n;
+        double* dlB = dB + 3 * curves[j].n;
+        J += distance_penalty<true, true>(curves[i], curves[j], minimum_distance, dA, dlA, dB, dlB);
 #pragma omp critical
-        if(!check)
-            candidates_2.push_back({i, j});
+        {
+            for (int l = 0; l < 3 * curves[i].n; ++l) {
+                dgamma[i].data()[l] += dA[l];
+                dgammadash[i].data()[l] += dlA[l];
+            }
+            for (int l = 0; l < 3 * curves[j].n; ++l) {
+                dgamma[j].data()[l] += dB[l];
+                dgammadash[j].data()[l] += dlB[l];
+            }
+        }
+    }
+    return {J, dgamma, dgammadash};
+}
+
+tuple<double, vector<PyArray>, vector<PyArray>> curve_surface_distance_penalty(
+        const vector<PyArray>& gammas, const vector<PyArray>& gammadashs, PyArray& xyz_surf, PyArray& normal_surf,
+        const vector<int>& candidates, double minimum_distance, bool derivatives) {
+    /*
+       The penalty of CurveSurfaceDistance summed over the candidate curves,
+       and its gradient with respect to gamma and gammadash of every curve if
+       derivatives is true.
+       */
+    int ncurves = gammas.size();
+    if(int(gammadashs.size()) != ncurves)
+        throw std::invalid_argument("gammas and gammadashs need to have the same length");
+    PenaltyPoints surface = penalty_points(xyz_surf, normal_surf);
+    vector<PyArray> dgamma, dgammadash;
+    if (derivatives) {
+        dgamma = zeros_like(gammas);
+        dgammadash = zeros_like(gammadashs);
     }
 
-    double t2 = threshold*threshold;
-    vector<tuple<int, int>> candidates_3;
-#pragma omp parallel for
-    for (int k = 0; k < candidates_2.size(); ++k) {
-        int i = std::get<0>(candidates_2[k]);
-        int j = std::get<1>(candidates_2[k]);
-        bool check = two_points_too_close_exist(pointCloudsA[i], pointCloudsB[j], t2);
+    double J = 0.;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:J)
+    for (int k = 0; k < int(candidates.size()); ++k) {
+        int i = candidates[k];
+        PenaltyPoints curve = penalty_points(gammas[i], gammadashs[i]);
+        if (!derivatives) {
+            J += distance_penalty<false, false>(curve, surface, minimum_distance, nullptr, nullptr, nullptr, nullptr);
+            continue;
+        }
+        vector<double> g(6 * curve.n, 0.);
+        J += distance_penalty<true, false>(curve, surface, minimum_distance, g.data(), g.data() + 3 * curve.n, nullptr, nullptr);
 #pragma omp critical
-        if(check)
-            candidates_3.push_back({i, j});
+        for (int l = 0; l < 3 * curve.n; ++l) {
+            dgamma[i].data()[l] += g[l];
+            dgammadash[i].data()[l] += g[3 * curve.n + l];
+        }
     }
-    return candidates_3;
+    return {J, dgamma, dgammadash};
 }
 
 void init_distance(py::module_ &m){
 
     m.def("get_pointclouds_closer_than_threshold_within_collection", &get_close_candidates_pdist, "In a list of point clouds, get all pairings that are closer than threshold to each other.", py::arg("pointClouds"), py::arg("threshold"), py::arg("num_base_curves"));
     m.def("get_pointclouds_closer_than_threshold_between_two_collections", &get_close_candidates_cdist, "Between two lists of pointclouds, get all pairings that are closer than threshold to each other.", py::arg("pointCloudsA"), py::arg("pointCloudsB"), py::arg("threshold"));
-    m.def("compute_linking_number", [](const vector<PyArray>& gammas, const vector<PyArray>& gammadashs, const PyArray& dphis, const double downsample) {
-        int ncurves = gammas.size();
-        // assert(dphis.size() == ncurves);
-        // assert(gammadashs.size() == ncurves);
-
-        int linking_number = 0;
-        #pragma omp parallel for reduction(+:linking_number)
-        for (int p = 1; p < ncurves; p++) {
-            int linknphi1 = gammas[p].shape(0);
-            const double *curve1_ptr = gammas[p].data();
-            const double *curve1dash_ptr = gammadashs[p].data();
-            // assert(gammas[p].size() == gammadashs[p].size());
-            for (int q = 0; q < p; q++) {
-                // assert(gammas[q].size() == gammadashs[q].size());
-                int linknphi2 = gammas[q].shape(0);
-                const double *curve2_ptr = gammas[q].data();
-                const double *curve2dash_ptr = gammadashs[q].data();
-                double difference[3] = { 0 };
-                double total = 0;
-                double dr, det;
-                for (int i=0; i < linknphi1; i += downsample){
-                    for (int j=0; j < linknphi2; j += downsample){
-                        difference[0] = (curve1_ptr[3*i+0] - curve2_ptr[3*j+0]);
-                        difference[1] = (curve1_ptr[3*i+1] - curve2_ptr[3*j+1]);
-                        difference[2] = (curve1_ptr[3*i+2] - curve2_ptr[3*j+2]);
-                        dr = std::sqrt(difference[0]*difference[0] + difference[1]*difference[1] + difference[2]*difference[2]);
-                        det = curve1dash_ptr[3*i+0]*(curve2dash_ptr[3*j+1]*difference[2] 
-                            - curve2dash_ptr[3*j+2]*difference[1]) 
-                            - curve1dash_ptr[3*i+1]*(curve2dash_ptr[3*j+0]*difference[2] 
-                            - curve2dash_ptr[3*j+2]*difference[0]) 
-                            + curve1dash_ptr[3*i+2]*(curve2dash_ptr[3*j+0]*difference[1] 
-                            - curve2dash_ptr[3*j+1]*difference[0]);
-                        total += det / (dr * dr * dr);
+
+    py::class_<PointCloudGrid>(m, "PointCloudGrid", "Spatial hash over a list of point clouds that finds the pairings closer than threshold to each other, and recomputes only the pairings of the clouds that changed.")
+        .def(py::init([](const vector<PyArray>& pointClouds, double threshold) { return make_grid(pointClouds, threshold); }), py::arg("pointClouds"), py::arg("threshold"))
+        .def("set_cloud", [](PointCloudGrid& grid, int p, const PyArray& points) { grid.set_cloud(p, cloud_data(points), points.shape(0)); },
+                "Replace point cloud p.", py::arg("p"), py::arg("points"))
+        .def("close_pairs", &PointCloudGrid::close_pairs,
+                "All pairings (i, j) with j < i and j < num_base_curves that are closer than threshold to each other.", py::arg("num_base_curves"))
+        .def("close_pairs_to", [](const PointCloudGrid& grid, const vector<PyArray>& pointClouds) {
+                    vector<const double*> points;
+                    vector<int> npoints;
+                    for (auto& p : pointClouds) {
+                        points.push_back(cloud_data(p));
+                        npoints.push_back(p.shape(0));
                     }
-                }
-                linking_number += std::round(std::abs(total * dphis[p] * dphis[q]) / (4 * M_PI));
-            }
-        }
-        return linking_number;
-    });
+                    return grid.close_pairs_to(points, npoints);
+                },
+                "All pairings (i, j) of pointClouds[i] and cloud j of the grid that are closer than threshold to each other.", py::arg("pointClouds"))
+        .def("__len__", &PointCloudGrid::size)
+        .def_property_readonly("threshold", &PointCloudGrid::get_threshold);
+
+    py::class_<SurfaceDistance, std::shared_ptr<SurfaceDistance>>(m, "SurfaceDistance", "Signed distance to a closed surface given on a (nphi, ntheta) grid of the full torus, positive inside. The closest point on the triangulated grid is found with a bounding volume hierarchy.")
+        .def(py::init([](const PyArray& gamma) {
+                    if(gamma.layout() != xt::layout_type::row_major || gamma.dimension() != 3 || gamma.shape(2) != 3)
+                        throw std::invalid_argument("gamma needs to be a row-major (nphi, ntheta, 3) array");
+                    return std::make_shared<SurfaceDistance>(gamma.data(), gamma.shape(0), gamma.shape(1));
+                }), py::arg("gamma"))
+        .def("signed_distance", [](const SurfaceDistance& dist, const PyArray& xyz) {
+                    const double* x = cloud_data(xyz);
+                    int n = xyz.shape(0);
+                    PyArray res = xt::zeros<double>({n});
+                    double* r = res.data();
+                    {
+                        py::gil_scoped_release release;
+                        dist.signed_distance(x, n, r);
+                    }
+                    return res;
+                },
+                "Signed distances of the points xyz of shape (n, 3), computed in parallel.", py::arg("xyz"))
+        .def("interpolate", [](std::shared_ptr<SurfaceDistance> dist, RegularGridInterpolant3D<PyTensor>& interpolant) {
+                    // the function is kept by lazy interpolants, so it holds on to dist
+                    std::function<Vec(Vec, Vec, Vec)> f = [dist](Vec r, Vec phi, Vec z) {
+                        int n = r.size();
+                        vector<double> xyz(3*n);
+                        for (int i = 0; i < n; ++i) {
+                            xyz[3*i + 0] = r[i]*std::cos(phi[i]);
+                            xyz[3*i + 1] = r[i]*std::sin(phi[i]);
+                            xyz[3*i + 2] = z[i];
+                        }
+                        Vec res(n);
+                        dist->signed_distance(xyz.data(), n, res.data());
+                        return res;
+                    };
+                    interpolant.interpolate_batch(f);
+                },
+                py::call_guard<py::gil_scoped_release>(),
+                "Interpolate the signed distance with a `RegularGridInterpolant3D` in cylindrical coordinates (r, phi, z), without calling back into python.", py::arg("interpolant"))
+        .def("__len__", &SurfaceDistance::size);
+    m.def("curve_curve_distance_penalty", &curve_curve_distance_penalty,
+            "Penalty of CurveCurveDistance summed over the candidate pairs of curves, and its gradient with respect to gamma and gammadash of every curve.",
+            py::arg("gammas"), py::arg("gammadashs"), py::arg("candidates"), py::arg("minimum_distance"), py::arg("derivatives")=true);
+    m.def("curve_surface_distance_penalty", &curve_surface_distance_penalty,
+            "Penalty of CurveSurfaceDistance summed over the candidate curves, and its gradient with respect to gamma and gammadash of every curve.",
+            py::arg("gammas"), py::arg("gammadashs"), py::arg("xyz_surf"), py::arg("normal_surf"), py::arg("candidates"), py::arg("minimum_distance"), py::arg("derivatives")=true);
+    m.def("compute_linking_number", &compute_linking_number, "Sum of the absolute Gauss linking numbers of all pairs of curves.",
+            py::arg("gammas"), py::arg("gammadashs"), py::arg("dphis"), py::arg("downsample"));
 
 }
@@ -12,15 +12,31 @@ namespace py = pybind11;
 #include "magneticfield.h"
 #include "magneticfield_biotsavart.h"
 #include "magneticfield_interpolated.h"
+#include "magneticfield_analytic.h"
+#include "magneticfield_sum.h"
 #include "pymagneticfield.h"
 #include "regular_grid_interpolant_3d.h"
+#include "adaptive_interpolant_3d.h"
 #include "pycurrent.h"
 typedef MagneticField<xt::pytensor> PyMagneticField;
 typedef BiotSavart<xt::pytensor, PyArray> PyBiotSavart;
+typedef BiotSavartSymmetric<xt::pytensor, PyArray> PyBiotSavartSymmetric;
 typedef InterpolatedField<xt::pytensor> PyInterpolatedField;
+typedef DommaschkMagneticField<xt::pytensor> PyDommaschk;
+typedef ReimanMagneticField<xt::pytensor> PyReiman;
+typedef MagneticFieldSum<xt::pytensor> PyMagneticFieldSum;
+typedef MagneticFieldMultiply<xt::pytensor> PyMagneticFieldMultiply;
 
 
 
+// A read only numpy array that shares the memory of a cache entry, see
+// MagneticField::B_view.
+template <typename Tensor> py::array read_only_view(Tensor& t) {
+    py::array view = py::reinterpret_borrow<py::array>(t.ptr()).attr("view")();
+    view.attr("setflags")(py::arg("write")=false);
+    return view;
+}
+
 template <typename T, typename S> void register_common_field_methods(S &c) {
     c
      .def("B", py::overload_cast<>(&T::B), "Returns a `(npoints, 3)` array containing the magnetic field (in cartesian coordinates). Denoting the indices by `i` and `l`, the result contains  `B_l(x_i)`.")
@@ -44,6 +60,15 @@ template <typename T, typename S> void register_common_field_methods(S &c) {
      .def("A_ref", py::overload_cast<>(&T::A_ref), "As `A`, but returns a reference to the array (this array should be read only).")
      .def("dA_by_dX_ref", py::overload_cast<>(&T::dA_by_dX_ref), "As `dA_by_dX`, but returns a reference to the array (this array should be read only).")
      .def("d2A_by_dXdX_ref", py::overload_cast<>(&T::d2A_by_dXdX_ref), "As `d2A_by_dXdX`, but returns a reference to the array (this array should be read only).")
+     .def("B_view", [](T& f) { return read_only_view(f.B_view()); }, "As `B_ref`, but the array is read only and keeps its values when the field is evaluated again, e.g. after `set_points`.")
+     .def("dB_by_dX_view", [](T& f) { return read_only_view(f.dB_by_dX_view()); }, "As `B_view`, for `dB_by_dX`.")
+     .def("d2B_by_dXdX_view", [](T& f) { return read_only_view(f.d2B_by_dXdX_view()); }, "As `B_view`, for `d2B_by_dXdX`.")
+     .def("A_view", [](T& f) { return read_only_view(f.A_view()); }, "As `B_view`, for `A`.")
+     .def("dA_by_dX_view", [](T& f) { return read_only_view(f.dA_by_dX_view()); }, "As `B_view`, for `dA_by_dX`.")
+     .def("AbsB_view", [](T& f) { return read_only_view(f.AbsB_view()); }, "As `B_view`, for `AbsB`.")
+     .def("GradAbsB_view", [](T& f) { return read_only_view(f.GradAbsB_view()); }, "As `B_view`, for `GradAbsB`.")
+     .def("B_cyl_view", [](T& f) { return read_only_view(f.B_cyl_view()); }, "As `B_view`, for `B_cyl`.")
+     .def("get_points_cart_view", [](T& f) { return read_only_view(f.get_points_cart_view()); }, "As `B_view`, for `get_points_cart`.")
      .def("invalidate_cache", &T::invalidate_cache, "Clear the cache. Called automatically after each call to `set_points[...]`.")
      .def("get_points_cart", &T::get_points_cart, "Get the point where the field should be evaluated in cartesian coordinates.")
      .def("get_points_cyl", &T::get_points_cyl, "Get the point where the field should be evaluated in cylindrical coordinates (the order is :math:`(r, \\phi, z)`).")
@@ -55,6 +80,8 @@ template <typename T, typename S> void register_common_field_methods(S &c) {
 }
 
 void init_magneticfields(py::module_ &m){
+    // lazy interpolants acquire the GIL before they fill cells, see LazyFillLock
+    lazy_fill_gil_hook() = []() { return std::shared_ptr<void>(std::make_shared<py::gil_scoped_acquire>()); };
 
     py::class_<InterpolationRule, shared_ptr<InterpolationRule>>(m, "InterpolationRule", "Abstract class for interpolation rules on an interval.")
         .def_readonly("degree", &InterpolationRule::degree, "The degree of the polynomial. The number of interpolation points in `degree+1`.");
@@ -73,9 +100,38 @@ void init_magneticfields(py::module_ &m){
             )pbdoc")
         .def(py::init<InterpolationRule, RangeTriplet, RangeTriplet, RangeTriplet, int, bool, std::function<std::vector<bool>(Vec, Vec, Vec)>>())
         .def(py::init<InterpolationRule, RangeTriplet, RangeTriplet, RangeTriplet, int, bool>())
-        .def("interpolate_batch", &RegularGridInterpolant3D<PyTensor>::interpolate_batch, "Interpolate a function by evaluating the function on all interpolation nodes simultanuously.")
+        .def("interpolate_batch", &RegularGridInterpolant3D<PyTensor>::interpolate_batch,
+                // a python function reacquires the GIL for every tile, so
+                // that the tiles can be handed to several threads
+                py::call_guard<py::gil_scoped_release>(),
+                "Interpolate a function by evaluating the function on all interpolation nodes of a tile of cells simultanuously.")
+        .def("set_build_options", &RegularGridInterpolant3D<PyTensor>::set_build_options, py::arg("max_memory"), py::arg("nthreads"), "Bound the temporary memory of `interpolate_batch` by `max_memory` bytes and evaluate `nthreads` tiles concurrently. The function has to be thread safe if `nthreads > 1`.")
         .def("evaluate", &RegularGridInterpolant3D<PyTensor>::evaluate, "Evaluate the interpolant at a point.")
-        .def("evaluate_batch", &RegularGridInterpolant3D<PyTensor>::evaluate_batch, "Evaluate the interpolant at multiple points (faster than `evaluate` as it uses prefetching).");
+        // the batched evaluations only call python for the function of a
+        // lazy interpolant, which reacquires the GIL
+        .def("evaluate_batch", &RegularGridInterpolant3D<PyTensor>::evaluate_batch, py::call_guard<py::gil_scoped_release>(), "Evaluate the interpolant at multiple points (faster than `evaluate` as it uses prefetching).")
+        .def("evaluate_batch_with_gradient", &RegularGridInterpolant3D<PyTensor>::evaluate_batch_with_gradient, py::arg("xyz"), py::arg("fxyz"), py::arg("dfxyz"), py::call_guard<py::gil_scoped_release>(), "Evaluate the interpolant and its derivatives at multiple points. `dfxyz[i, 3*l+d]` is the derivative of the `l`-th output in the `d`-th direction.")
+        .def("save", &RegularGridInterpolant3D<PyTensor>::save, py::arg("filename"), "Write the interpolant to a binary file.")
+        .def("load", &RegularGridInterpolant3D<PyTensor>::load, py::arg("filename"), "Map an interpolant written by `save` into memory. Returns False if the file does not exist or does not match this interpolant.")
+        .def("set_cache_file", &RegularGridInterpolant3D<PyTensor>::set_cache_file, py::arg("filename"), "Load the interpolant from this file in `interpolate_batch` if possible, and save it there otherwise.")
+        .def("set_value_bits", &RegularGridInterpolant3D<PyTensor>::set_value_bits, py::arg("bits"), "Store the values with 64 (double), 32 (float) or 16 (integers scaled per cell) bits. Evaluation always accumulates in double precision.")
+        .def("set_lazy", &RegularGridInterpolant3D<PyTensor>::set_lazy, py::arg("lazy"), "Only keep the function in `interpolate_batch`, and compute the values of each cell the first time the interpolant is evaluated in it.")
+        .def("num_filled", &RegularGridInterpolant3D<PyTensor>::num_filled, "Number of cells whose values have been computed.");
+
+    py::class_<AdaptiveInterpolant3D<PyTensor>, shared_ptr<AdaptiveInterpolant3D<PyTensor>>>(m, "AdaptiveInterpolant3D",
+            R"pbdoc(
+            Interpolates a (vector valued) function on an adaptively refined grid.
+            Each cell of the initial uniform grid is split into eight children, up to `max_depth` times, until the error estimated at a few points in between the interpolation nodes is below `tol` relative to the largest value of the function on the initial grid. This reaches the accuracy of `RegularGridInterpolant3D` with far fewer dofs for functions that vary rapidly only in parts of the domain.
+            )pbdoc")
+        .def(py::init<InterpolationRule, RangeTriplet, RangeTriplet, RangeTriplet, int, bool, double, int, std::function<std::vector<bool>(Vec, Vec, Vec)>>())
+        .def(py::init<InterpolationRule, RangeTriplet, RangeTriplet, RangeTriplet, int, bool, double, int>())
+        .def("interpolate_batch", &AdaptiveInterpolant3D<PyTensor>::interpolate_batch, "Interpolate a function, refining the grid level by level. The function is evaluated on all interpolation nodes of a level simultanuously.")
+        .def("evaluate", &AdaptiveInterpolant3D<PyTensor>::evaluate, "Evaluate the interpolant at a point.")
+        .def("evaluate_batch", &AdaptiveInterpolant3D<PyTensor>::evaluate_batch, py::call_guard<py::gil_scoped_release>(), "Evaluate the interpolant at multiple points.")
+        .def("estimate_error", &AdaptiveInterpolant3D<PyTensor>::estimate_error, py::arg("f"), py::arg("samples"), "Mean error -/+ its standard deviation at randomly sampled points.")
+        .def("num_cells", &AdaptiveInterpolant3D<PyTensor>::num_cells, "Number of cells of the refined grid that are not skipped.")
+        .def("num_dofs", &AdaptiveInterpolant3D<PyTensor>::num_dofs, "Number of interpolation nodes over all cells, i.e. `num_cells()*(degree+1)**3`.")
+        .def("depth", &AdaptiveInterpolant3D<PyTensor>::depth, "Deepest level of refinement that was created.");
 
 
     py::class_<CurrentBase<PyArray>, shared_ptr<CurrentBase<PyArray>>, PyCurrentBaseTrampoline>(m, "CurrentBase")
@@ -101,20 +157,102 @@ void init_magneticfields(py::module_ &m){
     auto bs = py::class_<PyBiotSavart, PyMagneticFieldTrampoline<PyBiotSavart>, shared_ptr<PyBiotSavart>, PyMagneticField>(m, "BiotSavart")
         .def(py::init<vector<shared_ptr<Coil<PyArray>>>>())
         .def("compute", &PyBiotSavart::compute)
+        .def("compute_all", &PyBiotSavart::compute_all, py::arg("derivatives_B"), py::arg("derivatives_A"),
+                "Compute B and A (and the requested number of derivatives of each) in a single pass and fill the caches for both.")
         .def("fieldcache_get_or_create", &PyBiotSavart::fieldcache_get_or_create)
         .def("fieldcache_get_status", &PyBiotSavart::fieldcache_get_status)
+        .def("cache_id", &PyBiotSavart::get_cache_id, "Identifies the field in `simsoptpp.cache_usage()`.")
+        .def("set_treecode", &PyBiotSavart::set_treecode, py::arg("theta"), py::arg("leafsize") = 16,
+                "Use a treecode approximation of the Biot-Savart law with opening parameter `theta` (relative error scales as `theta**3`) and at most `leafsize` quadrature points per leaf. `theta=0` restores the direct summation.")
+        .def_property_readonly("treecode_theta", &PyBiotSavart::get_treecode_theta)
+        .def_property_readonly("treecode_leafsize", &PyBiotSavart::get_treecode_leafsize)
+        .def("set_mixed_precision", &PyBiotSavart::set_mixed_precision, py::arg("mixed"),
+                "Evaluate the direct Biot-Savart sum in single precision with double precision accumulation (relative error around `1e-6`).")
+        .def_property_readonly("mixed_precision", &PyBiotSavart::get_mixed_precision)
+        .def("response_matrix", &PyBiotSavart::response_matrix,
+                "The fields of all coils per unit current as an array of shape `(ncoils, npoints, 3)`. The array is kept until the points or the curves change.")
+        .def("normal_response_matrix", &PyBiotSavart::normal_response_matrix, py::arg("normal"),
+                "The normal components `B_i . normal` of the fields of all coils per unit current as an array of shape `(ncoils, npoints)`.")
+        .def("B_from_currents", &PyBiotSavart::B_from_currents, py::arg("currents"),
+                "The field for the given coil currents, using the response matrix.")
+        .def("Bn_from_currents", &PyBiotSavart::Bn_from_currents, py::arg("normal"), py::arg("currents"),
+                "The normal component of the field for the given coil currents, using the normal response matrix.")
+        .def("B_vjp_currents", &PyBiotSavart::B_vjp_currents, py::arg("v"),
+                "The derivatives of `sum(v * B)` with respect to the coil currents.")
+        .def("Bn_vjp_currents", &PyBiotSavart::Bn_vjp_currents, py::arg("normal"), py::arg("w"),
+                "The derivatives of `sum(w * B.normal)` with respect to the coil currents.")
+        .def("B_cyl_groups", &PyBiotSavart::B_cyl_groups, py::arg("weights"),
+                "The cylindrical components of the fields `sum_i weights[g, i] * B_i` of several coil groups as an array of shape `(ngroups, npoints, 3)`, computed from the fields of the individual coils.")
+        .def("compute_and_vjp", &PyBiotSavart::compute_and_vjp, py::arg("v"), py::arg("derivatives"), py::arg("res_gamma"), py::arg("res_gammadash"),
+                "Compute the field and, in the same pass, the vector Jacobian product for `v`. The results for the curves are written to `res_gamma` and `res_gammadash`, the results for the currents are returned.")
+        .def("B_vjp_graph", &PyBiotSavart::B_vjp_graph, py::arg("v"), py::arg("res_gamma"), py::arg("res_gammadash"),
+                "The vector Jacobian product of the field for `v`, computed in one sweep over the quadrature points of all coils. The results for the curves are written to `res_gamma` and `res_gammadash`, the results for the currents are returned. Doesn't require the per coil fields.")
+        .def("squared_flux_graph", &PyBiotSavart::squared_flux, py::arg("normal"), py::arg("target"), py::arg("definition"), py::arg("derivatives"), py::arg("res_gamma"), py::arg("res_gammadash"),
+                "The objective of `SquaredFlux` for the `(npoints, 3)` normals and the target values of B.n (or an empty array) at the points, reducing B.n per block of points without materializing intermediate arrays. If `derivatives` is true, the vector Jacobian product of the objective is computed in the same pass, written to `res_gamma` and `res_gammadash` as in `B_vjp_graph`, and the derivatives with respect to the currents are returned together with the objective.")
+        .def("B_batch", &PyBiotSavart::B_batch, py::arg("points"),
+                "Evaluate the field on a list of point arrays of shape `(n_k, 3)` in one pass. The points and the cache of the field are not modified.")
+        .def("dB_by_dX_batch", &PyBiotSavart::dB_by_dX_batch, py::arg("points"),
+                "Evaluate the gradient of the field on a list of point arrays of shape `(n_k, 3)` in one pass. The points and the cache of the field are not modified.")
+        .def("set_adaptive_quadrature", &PyBiotSavart::set_adaptive_quadrature, py::arg("eta"),
+                "Evaluate blocks of points that are far from a coil with a decimated quadrature of that coil, using the coarsest level whose point spacing `h` satisfies `distance >= eta * h`. `eta=0` uses all quadrature points.")
+        .def_property_readonly("adaptive_quadrature", &PyBiotSavart::get_adaptive_quadrature)
+        .def("set_totals_only", &PyBiotSavart::set_totals_only, py::arg("totals_only"),
+                "Only compute the total field (and potential) and don't store the fields of the individual coils. The derivatives with respect to the coil currents and the vector Jacobian products are not available in this mode.")
+        .def_property_readonly("totals_only", &PyBiotSavart::get_totals_only)
         .def_readonly("coils", &PyBiotSavart::coils);
     register_common_field_methods<PyBiotSavart>(bs);
 
+    auto bss = py::class_<PyBiotSavartSymmetric, PyMagneticFieldTrampoline<PyBiotSavartSymmetric>, shared_ptr<PyBiotSavartSymmetric>, PyMagneticField>(m, "BiotSavartSymmetric")
+        .def(py::init<vector<shared_ptr<Coil<PyArray>>>, int, bool>())
+        .def("compute", &PyBiotSavartSymmetric::compute)
+        .def("compute_A", &PyBiotSavartSymmetric::compute_A)
+        .def("fieldcache_get_or_create", &PyBiotSavartSymmetric::fieldcache_get_or_create)
+        .def("fieldcache_get_status", &PyBiotSavartSymmetric::fieldcache_get_status)
+        .def("cache_id", &PyBiotSavartSymmetric::get_cache_id, "Identifies the field in `simsoptpp.cache_usage()`.")
+        .def("num_symmetries", &PyBiotSavartSymmetric::num_symmetries)
+        .def("symmetry_matrices", &PyBiotSavartSymmetric::get_symmetry_matrices, "Returns a `(num_symmetries, 3, 3)` array containing the matrices `G` that map the base coils onto their copies.")
+        .def("symmetry_signs", &PyBiotSavartSymmetric::get_symmetry_signs, "Returns the sign of the current of each copy.")
+        .def("symmetric_images_of_points", &PyBiotSavartSymmetric::symmetric_images_of_points, "Returns a `(num_symmetries*npoints, 3)` array containing the images `G x_i` of the points.")
+        .def("B_on_symmetric_images", &PyBiotSavartSymmetric::B_on_symmetric_images, "Returns the magnetic field at `symmetric_images_of_points()`, computed from the field at the points only.")
+        .def("dB_by_dX_on_symmetric_images", &PyBiotSavartSymmetric::dB_by_dX_on_symmetric_images, "As `B_on_symmetric_images`, but for the gradient of the magnetic field.")
+        .def_readonly("coils", &PyBiotSavartSymmetric::coils)
+        .def_readonly("nfp", &PyBiotSavartSymmetric::nfp)
+        .def_readonly("stellsym", &PyBiotSavartSymmetric::stellsym);
+    register_common_field_methods<PyBiotSavartSymmetric>(bss);
+
     auto ifield = py::class_<PyInterpolatedField, shared_ptr<PyInterpolatedField>, PyMagneticField>(m, "InterpolatedField")
         .def(py::init<shared_ptr<PyMagneticField>, InterpolationRule, RangeTriplet, RangeTriplet, RangeTriplet, bool, int, bool, std::function<std::vector<bool>(Vec, Vec, Vec)>>())
         .def(py::init<shared_ptr<PyMagneticField>, int, RangeTriplet, RangeTriplet, RangeTriplet, bool, int, bool, std::function<std::vector<bool>(Vec, Vec, Vec)>>())
         .def("estimate_error_B", &PyInterpolatedField::estimate_error_B)
         .def("estimate_error_GradAbsB", &PyInterpolatedField::estimate_error_GradAbsB)
+        .def("set_cache", &PyInterpolatedField::set_cache, py::arg("prefix"))
+        .def("set_adaptive", &PyInterpolatedField::set_adaptive, py::arg("tol"), py::arg("max_refinement"))
+        .def("set_build_options", &PyInterpolatedField::set_build_options, py::arg("max_memory"), py::arg("nthreads"))
+        .def("set_value_bits", &PyInterpolatedField::set_value_bits, py::arg("bits"))
+        .def("set_lazy", &PyInterpolatedField::set_lazy, py::arg("lazy"))
+        .def("set_analytic_gradient", &PyInterpolatedField::set_analytic_gradient, py::arg("analytic_gradient"))
+        .def("save_cache", &PyInterpolatedField::save_cache)
         .def_readonly("r_range", &PyInterpolatedField::r_range)
         .def_readonly("phi_range", &PyInterpolatedField::phi_range)
         .def_readonly("z_range", &PyInterpolatedField::z_range)
         .def_readonly("rule", &PyInterpolatedField::rule);
     //register_common_field_methods<PyInterpolatedField>(ifield);
+
+    // the following fields are evaluated entirely in C++, so they have no
+    // trampoline that would look for python overrides of _B_impl etc.
+    py::class_<PyDommaschk, shared_ptr<PyDommaschk>, PyMagneticField>(m, "Dommaschk")
+        .def(py::init<PyArray&, PyArray&, PyArray&>(), py::arg("m"), py::arg("n"), py::arg("coeffs"));
+
+    py::class_<PyReiman, shared_ptr<PyReiman>, PyMagneticField>(m, "Reiman")
+        .def(py::init<double, double, vector<double>, vector<double>, int>(), py::arg("iota0"), py::arg("iota1"), py::arg("k"), py::arg("epsilonk"), py::arg("m0"));
+
+    py::class_<PyMagneticFieldSum, shared_ptr<PyMagneticFieldSum>, PyMagneticField>(m, "MagneticFieldSum")
+        .def(py::init<vector<shared_ptr<PyMagneticField>>>(), py::arg("fields"))
+        .def_readonly("fields", &PyMagneticFieldSum::fields);
+
+    py::class_<PyMagneticFieldMultiply, shared_ptr<PyMagneticFieldMultiply>, PyMagneticField>(m, "MagneticFieldMultiply")
+        .def(py::init<double, shared_ptr<PyMagneticField>>(), py::arg("scalar"), py::arg("field"))
+        .def_readonly("scalar", &PyMagneticFieldMultiply::scalar)
+        .def_readonly("field", &PyMagneticFieldMultiply::field);
  
 }
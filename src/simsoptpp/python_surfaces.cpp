@@ -132,6 +132,9 @@ template <typename T, typename S> void register_common_surface_methods(S &s) {
      .def("second_fund_form", &T::second_fund_form, "Returns a `(n_phi, n_theta, 3)` array containing [n(phi_i, theta_j) cdot partial^2_{phi,phi} Gamma(phi_i, theta_j), n(phi_i, theta_j) cdot partial^2_{phi,theta} Gamma(phi_i, theta_j), n(phi_i, theta_j) cdot partial^2_{theta,theta} Gamma(phi_i, theta_j)] for i in {1, ..., n_phi}, j in {1, ..., n_theta} where n is the unit normal.")
      .def("dsecond_fund_form_by_dcoeff", &T::dsecond_fund_form_by_dcoeff, "Returns a `(n_phi, n_theta, 3, ndofs)` array containing the derivatives of `second_fund_form` wrt the surface coefficients.")
      .def("dgammadash2_by_dcoeff_vjp", &T::dgammadash2_by_dcoeff_vjp)
+     .def("dgamma_by_dcoeff_jvp", &T::dgamma_by_dcoeff_jvp, py::arg("w"), py::arg("dphi") = 0, py::arg("dtheta") = 0,
+             "Returns the derivative of d^(dphi+dtheta) gamma / dphi^dphi dtheta^dtheta in the direction `w` of the dofs, "
+             "without forming the `d*_by_dcoeff` arrays for SurfaceRZFourier and SurfaceXYZTensorFourier.")
      .def("normal", &T::normal)
      .def("dnormal_by_dcoeff", &T::dnormal_by_dcoeff)
      .def("dnormal_by_dcoeff_vjp", &T::dnormal_by_dcoeff_vjp)
@@ -142,16 +145,25 @@ template <typename T, typename S> void register_common_surface_methods(S &s) {
      .def("darea_by_dcoeff", &T::darea_by_dcoeff)
      .def("darea", &T::darea_by_dcoeff) // shorthand
      .def("d2area_by_dcoeffdcoeff", &T::d2area_by_dcoeffdcoeff)
+     .def("d2area_by_dcoeffdcoeff_hvp", &T::d2area_by_dcoeffdcoeff_hvp, py::arg("w"),
+             "Returns the product of `d2area_by_dcoeffdcoeff` with the vector `w`, without forming the Hessian.")
      .def("volume", &T::volume)
      .def("dvolume_by_dcoeff", &T::dvolume_by_dcoeff)
      .def("dvolume", &T::dvolume_by_dcoeff) // shorthand
      .def("d2volume_by_dcoeffdcoeff", &T::d2volume_by_dcoeffdcoeff)
+     .def("d2volume_by_dcoeffdcoeff_hvp", &T::d2volume_by_dcoeffdcoeff_hvp, py::arg("w"),
+             "Returns the product of `d2volume_by_dcoeffdcoeff` with the vector `w`, without forming the Hessian.")
      .def("fit_to_curve", &T::fit_to_curve, py::arg("curve"), py::arg("radius"), py::arg("flip_theta") = false)
      .def("scale", &T::scale)
      .def("extend_via_normal", &T::extend_via_normal, "This function takes as input a number, and then uses the plasma normal vectors at all quadrature points to extend the surface in question. Args: scale: double. Value to use for extending the plasma normal vectors")
      .def("extend_via_projected_normal", &T::extend_via_projected_normal, "This function takes as input a number, and then uses the plasma normal vectors at all quadrature points to extend the surface in question. Unlike the extend_via_normal function, this function uses the (R, phi, Z) normal vectors, zeros the phi components, and then extends the vectors. This results in a new surface with the same toroidal angle locations as the original surface. Args: scale: double. Value to use for extending the plasma normal vectors")
      .def("least_squares_fit", &T::least_squares_fit)
      .def("invalidate_cache", &T::invalidate_cache)
+     .def("enable_cache_stats", &T::enable_cache_stats, py::arg("enabled"), "Count cache hits, recomputes and the time spent recomputing for each cached quantity.")
+     .def("reset_cache_stats", &T::reset_cache_stats)
+     .def("cache_stats", &T::cache_stats, "Returns a dict from the name of each cached quantity that was accessed since the last reset to its `CacheStats`.")
+     .def("cache_bytes", &T::cache_bytes, "Returns a dict from the name of each cached quantity to the number of bytes it holds.")
+     .def("cache_id", &T::get_cache_id, "Identifies the object in `simsoptpp.cache_usage()`.")
      .def("set_dofs", &T::set_dofs)
      .def("set_dofs_impl", &T::set_dofs_impl)
      .def("get_dofs", &T::get_dofs)
@@ -1,6 +1,7 @@
 #include "pybind11/pybind11.h"
 #include "pybind11/stl.h"
 #include "pybind11/functional.h"
+#include "pybind11/numpy.h"
 namespace py = pybind11;
 #include "xtensor-python/pyarray.hpp"     // Numpy bindings
 typedef xt::pyarray<double> PyArray;
@@ -10,6 +11,39 @@ using std::shared_ptr;
 using std::vector;
 #include "tracing.h"
 
+// The tracing functions return the trajectories as vectors of fixed size
+// rows. These are moved into numpy arrays that take ownership of the memory,
+// which avoids converting them to nested python lists and copying them again.
+template<std::size_t n>
+py::array_t<double> rows_to_numpy(vector<array<double, n>>&& rows) {
+    if(rows.size() == 0)
+        return py::array_t<double>({py::ssize_t(0), py::ssize_t(n)});
+    auto data = new vector<array<double, n>>(std::move(rows));
+    py::capsule owner(data, [](void* ptr) { delete reinterpret_cast<vector<array<double, n>>*>(ptr); });
+    return py::array_t<double>({py::ssize_t(data->size()), py::ssize_t(n)}, data->data()->data(), owner);
+}
+
+template<std::size_t n, std::size_t k>
+py::tuple rows_to_numpy(tuple<vector<array<double, n>>, vector<array<double, k>>>&& res) {
+    return py::make_tuple(rows_to_numpy(std::move(std::get<0>(res))), rows_to_numpy(std::move(std::get<1>(res))));
+}
+
+template<std::size_t n, std::size_t k>
+py::list rows_to_numpy(vector<tuple<vector<array<double, n>>, vector<array<double, k>>>>&& res) {
+    py::list result;
+    for (auto& r : res)
+        result.append(rows_to_numpy(std::move(r)));
+    return result;
+}
+
+// Wraps a tracing function so that it returns numpy arrays, see rows_to_numpy.
+template<class Result, class... Args>
+std::function<py::object(Args...)> returning_numpy(Result (*f)(Args...)) {
+    return [f](Args... args) {
+        return py::object(rows_to_numpy(f(std::move(args)...)));
+    };
+}
+
 
 void init_tracing(py::module_ &m){
 
@@ -32,9 +66,47 @@ void init_tracing(py::module_ &m){
     py::class_<ToroidalTransitStoppingCriterion, shared_ptr<ToroidalTransitStoppingCriterion>, StoppingCriterion>(m, "ToroidalTransitStoppingCriterion")
         .def(py::init<int,bool>());
     py::class_<LevelsetStoppingCriterion<PyTensor>, shared_ptr<LevelsetStoppingCriterion<PyTensor>>, StoppingCriterion>(m, "LevelsetStoppingCriterion")
-        .def(py::init<shared_ptr<RegularGridInterpolant3D<PyTensor>>>());
+        .def(py::init<shared_ptr<RegularGridInterpolant3D<PyTensor>>, int, bool>(), py::arg("levelset"), py::arg("nfp")=1, py::arg("stellsym")=false);
+
+    py::class_<TrajectoryOutput> trajectory_output(m, "TrajectoryOutput");
+    py::enum_<TrajectoryOutput::Mode>(trajectory_output, "Mode")
+        .value("full", TrajectoryOutput::full)
+        .value("every_n", TrajectoryOutput::every_n)
+        .value("sampled", TrajectoryOutput::sampled)
+        .value("hits_only", TrajectoryOutput::hits_only)
+        .value("none", TrajectoryOutput::none);
+    trajectory_output
+        .def(py::init<>())
+        .def(py::init<TrajectoryOutput::Mode, int, double>(), py::arg("mode"), py::arg("every")=1, py::arg("dt")=0.)
+        .def_readwrite("mode", &TrajectoryOutput::mode)
+        .def_readwrite("every", &TrajectoryOutput::every)
+        .def_readwrite("dt", &TrajectoryOutput::dt);
+
+    py::class_<Integrator> integrator(m, "Integrator");
+    py::enum_<Integrator::Method>(integrator, "Method")
+        .value("dopri5", Integrator::dopri5)
+        .value("rk4", Integrator::rk4)
+        .value("boris", Integrator::boris);
+    integrator
+        .def(py::init<>())
+        .def(py::init<Integrator::Method, double>(), py::arg("method"), py::arg("dt")=0.)
+        .def_readwrite("method", &Integrator::method)
+        .def_readwrite("dt", &Integrator::dt);
+
+    py::class_<TracingState, shared_ptr<TracingState>>(m, "TracingState")
+        .def(py::init<>())
+        .def_readwrite("started", &TracingState::started)
+        .def_readwrite("finished", &TracingState::finished)
+        .def_readwrite("max_walltime", &TracingState::max_walltime)
+        .def_readwrite("t", &TracingState::t)
+        .def_readwrite("dt", &TracingState::dt)
+        .def_readwrite("iter", &TracingState::iter)
+        .def_readwrite("nsample", &TracingState::nsample)
+        .def_readwrite("y", &TracingState::y)
+        .def_readwrite("phi", &TracingState::phi)
+        .def_readwrite("criteria", &TracingState::criteria);
 
-    m.def("particle_guiding_center_boozer_tracing", &particle_guiding_center_boozer_tracing<xt::pytensor>,
+    m.def("particle_guiding_center_boozer_tracing", returning_numpy(&particle_guiding_center_boozer_tracing<xt::pytensor>),
         py::arg("field"),
         py::arg("stz_init"),
         py::arg("m"),
@@ -46,10 +118,13 @@ void init_tracing(py::module_ &m){
         py::arg("vacuum"),
         py::arg("noK"),
         py::arg("zetas")=vector<double>{},
-        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{}
+        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{},
+        py::arg("output")=TrajectoryOutput(),
+        py::arg("integrator")=Integrator(),
+        py::arg("state")=nullptr
         );
 
-    m.def("particle_guiding_center_tracing", &particle_guiding_center_tracing<xt::pytensor>,
+    m.def("particle_guiding_center_tracing", returning_numpy(&particle_guiding_center_tracing<xt::pytensor>),
         py::arg("field"),
         py::arg("xyz_init"),
         py::arg("m"),
@@ -60,10 +135,27 @@ void init_tracing(py::module_ &m){
         py::arg("tol"),
         py::arg("vacuum"),
         py::arg("phis")=vector<double>{},
-        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{}
+        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{},
+        py::arg("output")=TrajectoryOutput(),
+        py::arg("integrator")=Integrator(),
+        py::arg("state")=nullptr
         );
 
-    m.def("particle_fullorbit_tracing", &particle_fullorbit_tracing<xt::pytensor>,
+    m.def("particle_guiding_center_tracing_batch", returning_numpy(&particle_guiding_center_tracing_batch<xt::pytensor>),
+        py::arg("field"),
+        py::arg("xyz_inits"),
+        py::arg("m"),
+        py::arg("q"),
+        py::arg("vtotal"),
+        py::arg("vtangs"),
+        py::arg("tmax"),
+        py::arg("tol"),
+        py::arg("phis")=vector<double>{},
+        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{},
+        py::arg("output")=TrajectoryOutput()
+        );
+
+    m.def("particle_fullorbit_tracing", returning_numpy(&particle_fullorbit_tracing<xt::pytensor>),
         py::arg("field"),
         py::arg("xyz_init"),
         py::arg("v_init"),
@@ -72,16 +164,82 @@ void init_tracing(py::module_ &m){
         py::arg("tmax"),
         py::arg("tol"),
         py::arg("phis")=vector<double>{},
-        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{}
+        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{},
+        py::arg("output")=TrajectoryOutput(),
+        py::arg("integrator")=Integrator(),
+        py::arg("state")=nullptr
         );
 
-    m.def("fieldline_tracing", &fieldline_tracing<xt::pytensor>,
+    m.def("fieldline_tracing", returning_numpy(&fieldline_tracing<xt::pytensor>),
             py::arg("field"),
             py::arg("xyz_init"),
             py::arg("tmax"),
             py::arg("tol"),
             py::arg("phis")=vector<double>{},
-            py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{});
+            py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{},
+            py::arg("output")=TrajectoryOutput(),
+            py::arg("integrator")=Integrator());
+
+    m.def("particle_guiding_center_tracing_many", returning_numpy(&particle_guiding_center_tracing_many<xt::pytensor>),
+        py::arg("field"),
+        py::arg("xyz_inits"),
+        py::arg("m"),
+        py::arg("q"),
+        py::arg("vtotal"),
+        py::arg("vtangs"),
+        py::arg("tmax"),
+        py::arg("tol"),
+        py::arg("vacuum"),
+        py::arg("phis")=vector<double>{},
+        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{},
+        py::arg("nthreads")=0,
+        py::arg("output")=TrajectoryOutput(),
+        py::arg("integrator")=Integrator()
+        );
+
+    m.def("particle_guiding_center_boozer_tracing_many", returning_numpy(&particle_guiding_center_boozer_tracing_many<xt::pytensor>),
+        py::arg("field"),
+        py::arg("stz_inits"),
+        py::arg("m"),
+        py::arg("q"),
+        py::arg("vtotal"),
+        py::arg("vtangs"),
+        py::arg("tmax"),
+        py::arg("tol"),
+        py::arg("vacuum"),
+        py::arg("noK"),
+        py::arg("zetas")=vector<double>{},
+        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{},
+        py::arg("nthreads")=0,
+        py::arg("output")=TrajectoryOutput(),
+        py::arg("integrator")=Integrator()
+        );
+
+    m.def("particle_fullorbit_tracing_many", returning_numpy(&particle_fullorbit_tracing_many<xt::pytensor>),
+        py::arg("field"),
+        py::arg("xyz_inits"),
+        py::arg("v_inits"),
+        py::arg("m"),
+        py::arg("q"),
+        py::arg("tmax"),
+        py::arg("tol"),
+        py::arg("phis")=vector<double>{},
+        py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{},
+        py::arg("nthreads")=0,
+        py::arg("output")=TrajectoryOutput(),
+        py::arg("integrator")=Integrator()
+        );
+
+    m.def("fieldline_tracing_many", returning_numpy(&fieldline_tracing_many<xt::pytensor>),
+            py::arg("field"),
+            py::arg("xyz_inits"),
+            py::arg("tmax"),
+            py::arg("tol"),
+            py::arg("phis")=vector<double>{},
+            py::arg("stopping_criteria")=vector<shared_ptr<StoppingCriterion>>{},
+            py::arg("nthreads")=0,
+            py::arg("output")=TrajectoryOutput(),
+            py::arg("integrator")=Integrator());
 
     m.def("get_phi", &get_phi);
 }
@@ -1,7 +1,7 @@
 #pragma once
 #include "simdhelpers.h"
-#include <unordered_map>
 #include <algorithm>
+#include <atomic>
 #include <fmt/core.h>
 #include <fmt/ranges.h>
 #include <functional>
@@ -11,6 +11,14 @@
 #include <stdint.h>
 #include <tuple>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using Vec = std::vector<double>;
 using RangeTriplet = std::tuple<double, double, int>;
@@ -50,6 +58,22 @@ class InterpolationRule {
             }
             return res;
         }
+        double basis_fun_deriv(int idx, double x) const {
+            // evaluate the derivative of the basisfunction p_idx at location
+            // x, i.e. the sum over m of the products of (x-nodes[i]) for all
+            // i except idx and m
+            double res = 0.;
+            for(int m = 0; m < degree+1; ++m) {
+                if(m == idx) continue;
+                double prod = 1.;
+                for(int i = 0; i < degree+1; ++i) {
+                    if(i == idx || i == m) continue;
+                    prod *= (x-nodes[i]);
+                }
+                res += prod;
+            }
+            return scalings[idx]*res;
+        }
         #if defined(USE_XSIMD)
         simd_t basis_fun(int idx, simd_t x) const {
             // evaluate the basisfunction p_idx at multiple locations stored in x
@@ -63,8 +87,96 @@ class InterpolationRule {
         #endif
 };
 
+// up to this degree, the interpolants evaluate the basis functions without
+// allocating
+constexpr int lagrange_max_stack_degree = 15;
+
+// A file mapped read-only into memory. The pages are shared by all processes
+// that map the same file.
+class MappedFile {
+    public:
+        MappedFile(const std::string& filename) {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if(fd < 0)
+                throw std::runtime_error(fmt::format("Could not open {}", filename));
+            struct stat st;
+            if(fstat(fd, &st) != 0 || st.st_size == 0) {
+                close(fd);
+                throw std::runtime_error(fmt::format("Could not read {}", filename));
+            }
+            length = st.st_size;
+            void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if(addr == MAP_FAILED)
+                throw std::runtime_error(fmt::format("Could not map {}", filename));
+            ptr = static_cast<const char*>(addr);
+        }
+        ~MappedFile() { munmap(const_cast<char*>(ptr), length); }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        const char* data() const { return ptr; }
+        size_t size() const { return length; }
+    private:
+        const char* ptr;
+        size_t length;
+};
+
+// Serializes the evaluation of the interpolated functions when cells of lazy
+// interpolants are filled, see RegularGridInterpolant3D::set_lazy. It is
+// shared by all interpolants, since several of them usually interpolate
+// quantities of the same underlying field.
+inline std::mutex& lazy_fill_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+// The functions that fill the cells usually call into python. To take the
+// locks in the same order on all threads, the GIL is acquired before
+// lazy_fill_mutex: a thread that holds the GIL and waits for the mutex would
+// otherwise block the thread that holds the mutex and waits for the GIL. The
+// python module sets this hook to a function that acquires the GIL and
+// returns a handle that releases it again, see init_magneticfields.
+inline std::function<std::shared_ptr<void>()>& lazy_fill_gil_hook() {
+    static std::function<std::shared_ptr<void>()> hook;
+    return hook;
+}
+
+// Holds the GIL (if the hook is set) and lazy_fill_mutex for its lifetime.
+class LazyFillLock {
+    private:
+        std::shared_ptr<void> gil;
+        std::unique_lock<std::mutex> lock;
+
+    public:
+        LazyFillLock() : gil(lazy_fill_gil_hook() ? lazy_fill_gil_hook()() : nullptr), lock(lazy_fill_mutex()) { }
+};
+
 template<class Array>
-class RegularGridInterpolant3D {
+class Interpolant3D {
+    /* Common interface of the piecewise polynomial interpolants in three
+     * dimensions, so that e.g. InterpolatedField can use either the regular
+     * grid or the adaptively refined one.
+     */
+    public:
+        virtual ~Interpolant3D() = default;
+        // build the interpolant
+        virtual void interpolate_batch(std::function<Vec(Vec, Vec, Vec)> &f) = 0;
+        // evaluate the interpolant at one location and write the results to
+        // res, see RegularGridInterpolant3D::evaluate_inplace
+        virtual void evaluate_inplace(double x, double y, double z, double* res) = 0;
+        // evaluate the interpolant at multiple locations
+        virtual void evaluate_batch(Array& xyz, Array& fxyz) = 0;
+        // evaluate the interpolant and its gradient at one location, see
+        // RegularGridInterpolant3D::evaluate_with_gradient_inplace
+        virtual void evaluate_with_gradient_inplace(double x, double y, double z, double* res, double* grad) {
+            throw std::logic_error("This interpolant does not support the evaluation of gradients.");
+        }
+        // mean error -/+ standard deviation at randomly sampled points
+        virtual std::pair<double, double> estimate_error(std::function<Vec(Vec, Vec, Vec)> &f, int samples) = 0;
+};
+
+template<class Array>
+class RegularGridInterpolant3D : public Interpolant3D<Array> {
     /* This class implements a vector-valued piecewise polynomial interpolant
      * on a regular grid in three dimensions.  There are many ways to
      * implemented interpolants, the implementation here is done to favour
@@ -98,21 +210,39 @@ class RegularGridInterpolant3D {
         // location of the mesh nodes in [xmin, xmax], [ymin, ymax], and [zmin, zmax]. superset of xmesh, ymesh, zmesh
         // has size nx*degree + 1, ny*degree + 1, and nz*degree + 1 respectively
         Vec xdof, ydof, zdof;
-        // subset of the tensor product of the dof locations. if none of the dofs are skipped, these all have size
-        // (nx*degree + 1) * (ny*degree + 1) * (nz*degree + 1), but now they have size dofs_to_keep
-        Vec xdoftensor_reduced, ydoftensor_reduced, zdoftensor_reduced;
 
-        Vec vals; // contains the values of the function to be interpolated at the dofs, of size dofs_to_keep * value_size
-        std::unordered_map<int, AlignedPaddedVec> all_local_vals_map; // maps each cell to an array of size (degree+1)**3 * padded_value_size
+        // the values at the dofs of each cell that is kept, local_vals_size
+        // values per cell, either in all_local_vals or in mapped_file. they
+        // are stored as double, float or int16_t, depending on value_bits
+        AlignedPaddedVector<char> all_local_vals;
+        std::shared_ptr<MappedFile> mapped_file;
+        size_t mapped_offset = 0;
+        int value_bits = 64;
+        // for value_bits == 16, the values of each kept cell and output
+        // dimension are stored as multiples of these scales, of size
+        // cells_to_keep * value_size
+        Vec cell_scales;
+        // maps each cell to its position in the values, -1 for skipped cells.
+        // empty until the interpolant is built
+        std::vector<int32_t> cell_to_local;
+        // if set, interpolate_batch loads the interpolant from this file, or
+        // builds it and writes it to this file, see set_cache_file
+        std::string cache_file;
         std::vector<bool> skip_cell; // whether to skip each cell or not
-        // since we are skipping some dofs, we need mappings into the list of
-        // reduced dofs, e.g. if we skip dofs 3, then reduced to full would
-        // look like [0, 1, 2, 4, 5, ...]
-        std::vector<uint32_t> reduced_to_full_map, full_to_reduced_map;
 
-        uint32_t cells_to_skip, cells_to_keep, dofs_to_skip, dofs_to_keep; // which cells and dofs we skip and keep
+        uint32_t cells_to_skip, cells_to_keep; // how many cells we skip and keep
+        // in lazy mode, the function passed to interpolate_batch, and for
+        // each kept cell whether its values have been computed. cell_filled
+        // is null if all cells are filled
+        bool lazy = false;
+        std::function<Vec(Vec, Vec, Vec)> lazy_f;
+        std::unique_ptr<std::atomic<uint8_t>[]> cell_filled;
+        // bound on the temporary memory used by interpolate_batch, and the
+        // number of threads that evaluate tiles concurrently, see
+        // set_build_options
+        size_t max_build_memory = size_t(1) << 30;
+        int build_threads = 1;
         int local_vals_size;
-        Vec pkxs, pkys, pkzs;
 
         #if defined(USE_XSIMD)
         static const int simdcount = xsimd::simd_type<double>::size; // vector width for simd instructions
@@ -121,11 +251,6 @@ class RegularGridInterpolant3D {
         #endif
         int padded_value_size; // smallest multiple of simdcount that is larger than value_size
 
-        inline int idx_dof(int i, int j, int k){
-            int degree = rule.degree;
-            return i*(ny*degree+1)*(nz*degree+1) + j*(nz*degree+1) + k;
-        }
-
         inline int idx_cell(int i, int j, int k){
             return i*ny*nz + j*nz + k;
         }
@@ -140,8 +265,45 @@ class RegularGridInterpolant3D {
         }
 
         int locate_unsafe(double x, double y, double z);
-        void evaluate_inplace(double x, double y, double z, double* res);
-        void evaluate_local(double x, double y, double z, int cell_idx, double* res);
+        // returns the index of the cell containing (x, y, z) and writes the
+        // coordinates of the point relative to the cell, scaled to [0, 1], to
+        // local. Returns -1 for points outside of the grid if out_of_bounds_ok
+        // is true, and throws otherwise.
+        int locate(double x, double y, double z, int* idxs, double* local);
+        // the position of the values of a cell, or -1 for a skipped cell if
+        // out_of_bounds_ok is true
+        int32_t cell_local_idx(int cell_idx);
+        const char* local_vals_data() const {
+            return mapped_file ? mapped_file->data() + mapped_offset : all_local_vals.data();
+        }
+        size_t value_bytes() const { return value_bits/8; }
+        template<class Storage>
+        const Storage* cell_values(int32_t local_idx) const {
+            return reinterpret_cast<const Storage*>(local_vals_data()) + size_t(local_idx) * local_vals_size;
+        }
+        const double* scales_of(int32_t local_idx) const {
+            return value_bits == 16 ? cell_scales.data() + size_t(local_idx) * value_size : nullptr;
+        }
+        // converts the values at the dofs of a cell, in double precision, to
+        // the storage of the cell at local_idx
+        void store_cell(int32_t local_idx, const double* vals_local);
+        // in lazy mode, evaluates lazy_f on the nodes of those of the given
+        // cells that are not filled yet, in one batch
+        void fill_cells(const std::vector<int>& cell_idxs);
+        inline bool is_filled(int32_t local_idx) const {
+            return !cell_filled || cell_filled[local_idx].load(std::memory_order_acquire);
+        }
+        void evaluate_local(double x, double y, double z, int32_t local_idx, double* res);
+        #if defined(USE_XSIMD)
+        // evaluates the interpolant at simdcount points in the cell at
+        // local_idx, vectorized over the points instead of over the values,
+        // and writes the results to res + value_size*points[p]. acc has to
+        // provide space for value_size simd vectors.
+        void evaluate_local_simd(const double* local, const int* points, int32_t local_idx, simd_t* acc, double* res);
+        template<class Storage>
+        void evaluate_local_simd(const double* local, const int* points, const Storage* vals_local, const double* scales, simd_t* acc, double* res);
+        #endif
+        static constexpr int max_stack_degree = lagrange_max_stack_degree;
 
     public:
 
@@ -153,9 +315,6 @@ class RegularGridInterpolant3D {
             value_size(value_size), out_of_bounds_ok(out_of_bounds_ok)
         {
             int degree = rule.degree;
-            pkxs = Vec(degree+1, 0.);
-            pkys = Vec(degree+1, 0.);
-            pkzs = Vec(degree+1, 0.);
             hx = (xmax-xmin)/nx;
             hy = (ymax-ymin)/ny;
             hz = (zmax-zmin)/nz;
@@ -225,87 +384,110 @@ class RegularGridInterpolant3D {
                     zdof[i*degree+j] = zmesh[i] + rule.nodes[j]*hz;
                 }
             }
-            uint32_t n =  (nx*degree+1)*(ny*degree+1)*(nz*degree+1);
-            // turn these into a tensor product grid
-            Vec xdoftensor(n, 0.);
-            Vec ydoftensor(n, 0.);
-            Vec zdoftensor(n, 0.);
-            for (int i = 0; i <= nx*degree; ++i) {
-                for (int j = 0; j <= ny*degree; ++j) {
-                    for (int k = 0; k <= nz*degree; ++k) {
-                        uint32_t offset = idx_dof(i, j, k);
-                        xdoftensor[offset] = xdof[i];
-                        ydoftensor[offset] = ydof[j];
-                        zdoftensor[offset] = zdof[k];
-                    }
-                }
-            }
-            // Now we need to figure out which of these dofs we keep, and which
-            // to discard.  To do this, we loop over the cells, and for each
-            // cell that shouldn't be skipped, we mark all dofs in that cell.
-
-            std::vector<bool> skip_dof(n, true);
-            for (int i = 0; i < nx; ++i) {
-                for (int j = 0; j < ny; ++j) {
-                    for (int k = 0; k < nz; ++k) {
-                        if(!skip_cell[idx_cell(i, j, k)]){
-                            for (int ii = 0; ii <= degree; ++ii) {
-                                for (int jj = 0; jj <= degree; ++jj) {
-                                    for (int kk = 0; kk <= degree; ++kk) {
-                                        skip_dof[idx_dof(i*degree + ii, j*degree + jj, k*degree + kk)] = false;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-            // Count how many dofs are skipped in total, and how many to keep
-            dofs_to_skip = 0;
-            for (uint32_t i = 0; i < n; ++i) {
-                dofs_to_skip += skip_dof[i];
-            }
-            dofs_to_keep = n - dofs_to_skip;
-            // Build a map that maps indices from the reduced set of interpolation
-            // points to the full set, and its inverse
-            reduced_to_full_map = std::vector<uint32_t>(dofs_to_keep, 0);
-            full_to_reduced_map = std::vector<uint32_t>(n, 0);
-            uint32_t ctr = 0;
-            for (uint32_t i = 0; i < n; ++i) {
-                full_to_reduced_map[i] = i - ctr;
-                if(skip_dof[i])
-                    ctr++;
-                else {
-                    reduced_to_full_map[i-ctr] = i;
-                }
-            }
-
-            // build the reduced list of interpolation points
-            xdoftensor_reduced = Vec(dofs_to_keep, 0.);
-            ydoftensor_reduced = Vec(dofs_to_keep, 0.);
-            zdoftensor_reduced = Vec(dofs_to_keep, 0.);
-            for (long i = 0; i < dofs_to_keep; ++i) {
-                xdoftensor_reduced[i] = xdoftensor[reduced_to_full_map[i]];
-                ydoftensor_reduced[i] = ydoftensor[reduced_to_full_map[i]];
-                zdoftensor_reduced[i] = zdoftensor[reduced_to_full_map[i]];
-            }
-            vals = Vec(dofs_to_keep * value_size, 0.);
+            // the tensor product of these points is never formed. Instead,
+            // interpolate_batch evaluates the function on one tile of cells
+            // at a time, see set_build_options.
 
             // round up value_size to nearest multiple of simdcount
             padded_value_size = (value_size % simdcount) ? (value_size + simdcount) - (value_size % simdcount) : value_size;
-            int nnodes = (nx*degree+1)*(ny*degree+1)*(nz*degree+1);
             local_vals_size = (degree+1)*(degree+1)*(degree+1)*padded_value_size;
         }
         RegularGridInterpolant3D(InterpolationRule rule, RangeTriplet xrange, RangeTriplet yrange, RangeTriplet zrange, int value_size, bool out_of_bounds_ok) :
             RegularGridInterpolant3D(rule, xrange, yrange, zrange, value_size, out_of_bounds_ok, [](Vec x, Vec y, Vec z){ return std::vector<bool>(x.size(), false); })
             {}
 
-        void interpolate_batch(std::function<Vec(Vec, Vec, Vec)> &f); // build the interpolant
+        // build the interpolant. The cells are split into tiles, and f is
+        // called for the nodes of one tile at a time, so that only the
+        // values of the finished interpolant and of build_threads tiles are
+        // kept in memory.
+        void interpolate_batch(std::function<Vec(Vec, Vec, Vec)> &f) override;
+        // Bounds the memory for the coordinates and values of the tiles in
+        // interpolate_batch by max_memory bytes, in addition to the memory of
+        // the interpolant itself. If nthreads > 1, that many tiles are
+        // evaluated concurrently with OpenMP, so f has to be thread safe.
+        // Nodes on the faces between tiles are evaluated once per tile.
+        void set_build_options(size_t max_memory, int nthreads) {
+            if(nthreads < 1)
+                throw std::invalid_argument("nthreads has to be positive.");
+            max_build_memory = max_memory;
+            build_threads = nthreads;
+        }
 
-        Vec evaluate(double x, double y, double z); // evaluate the interpolant at one location
-        void evaluate_batch(Array& xyz, Array& fxyz); // evluate the interpolant at multiple locations
+        // In lazy mode, interpolate_batch only keeps a copy of f, and the
+        // values of each cell are computed the first time the interpolant is
+        // evaluated in it. This avoids evaluating f in the parts of the
+        // domain that are never visited. Cells are filled at most once, also
+        // when several threads evaluate the interpolant concurrently: the
+        // calls to f are serialized by lazy_fill_mutex, so f does not have to
+        // be thread safe, but it has to outlive the interpolant. save()
+        // writes the cells that are filled so far, and load() continues from
+        // such a partially filled file in lazy mode.
+        void set_lazy(bool lazy) { this->lazy = lazy; }
+        // number of cells whose values have been computed
+        uint32_t num_filled() const {
+            if(cell_to_local.empty())
+                return 0;
+            if(!cell_filled)
+                return cells_to_keep;
+            uint32_t filled = 0;
+            for (uint32_t i = 0; i < cells_to_keep; ++i)
+                filled += is_filled(i);
+            return filled;
+        }
 
-        std::pair<double, double> estimate_error(std::function<Vec(Vec, Vec, Vec)> &f, int samples);
+        // Writes the built interpolant to a versioned binary file. The file is
+        // written under a temporary name first and then renamed, so that
+        // other processes never see a partially written file.
+        void save(const std::string& filename);
+        // Maps an interpolant written by save() into memory read-only, so that
+        // all processes on a node share a single copy. Returns false (and
+        // leaves the interpolant unchanged) if the file does not exist or was
+        // written for a different grid, rule, value size or set of skipped
+        // cells, or if some of its cells are not filled and the interpolant
+        // is not lazy. Partially filled files are copied into memory instead
+        // of mapped, so that the remaining cells can be filled.
+        bool load(const std::string& filename);
+        // Caches the interpolant in filename: interpolate_batch loads it from
+        // there if possible, and otherwise builds it and saves it there. The
+        // file has to be unique to the interpolated function.
+        void set_cache_file(const std::string& filename) { cache_file = filename; }
+        // Stores the values at the dofs with value_bits bits: 64 for double,
+        // 32 for float, and 16 for integers that are scaled by the largest
+        // absolute value of each output dimension in the cell, which are
+        // accurate to about 2e-5 relative to that value. The evaluation always
+        // accumulates in double precision. Only affects interpolants that are
+        // built afterwards.
+        void set_value_bits(int bits) {
+            if(bits != 64 && bits != 32 && bits != 16)
+                throw std::invalid_argument("bits has to be 64, 32 or 16.");
+            value_bits = bits;
+        }
+
+        Vec evaluate(double x, double y, double z); // evaluate the interpolant at one location
+        // evaluate the interpolant at one location and write the value_size
+        // results to res, without allocating. res is left untouched in
+        // skipped cells if out_of_bounds_ok is true. This may be called
+        // concurrently from several threads.
+        void evaluate_inplace(double x, double y, double z, double* res) override;
+        // evaluate the interpolant at multiple locations. For larger batches,
+        // the points are sorted along a Z-order curve through the cells, so
+        // that the points in a cell are evaluated together and the values of
+        // each cell are only loaded once.
+        void evaluate_batch(Array& xyz, Array& fxyz) override;
+        // evaluate the interpolant and its derivatives in x, y and z at one
+        // location by differentiating the Lagrange polynomial of the cell.
+        // The value_size results are written to res, and the derivatives to
+        // grad, with grad[3*l + d] the derivative of the l-th output in the
+        // d-th direction. The derivatives are one order less accurate than
+        // the values and jump across the faces of the cells. As
+        // evaluate_inplace, this leaves res and grad untouched in skipped
+        // cells and may be called concurrently.
+        void evaluate_with_gradient_inplace(double x, double y, double z, double* res, double* grad) override;
+        // evaluate_with_gradient_inplace at multiple locations, dfxyz has
+        // shape (npoints, 3*value_size)
+        void evaluate_batch_with_gradient(Array& xyz, Array& fxyz, Array& dfxyz);
+
+        std::pair<double, double> estimate_error(std::function<Vec(Vec, Vec, Vec)> &f, int samples) override;
 };
 
 
@@ -1,8 +1,14 @@
+#pragma once
 #include "regular_grid_interpolant_3d.h"
+#include "perf_counters.h"
 #include <xtensor/xarray.hpp>
 #include "xtensor/xlayout.hpp"
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <unordered_map>
 
 
 #define _EPS_ 1e-13
@@ -10,49 +16,593 @@
 template<class Array>
 const int RegularGridInterpolant3D<Array>::simdcount;
 
-template<class Array>
-void RegularGridInterpolant3D<Array>::interpolate_batch(std::function<Vec(Vec, Vec, Vec)> &f) {
-    int BATCH_SIZE = 16384;
-    int NUM_BATCHES = dofs_to_keep/BATCH_SIZE + (dofs_to_keep % BATCH_SIZE != 0);
-    for (int i = 0; i < NUM_BATCHES; ++i) {
-        uint32_t first = i * BATCH_SIZE;
-        uint32_t last = std::min((uint32_t)((i+1) * BATCH_SIZE), dofs_to_keep);
-        Vec xsub(xdoftensor_reduced.begin() + first, xdoftensor_reduced.begin() + last);
-        Vec ysub(ydoftensor_reduced.begin() + first, ydoftensor_reduced.begin() + last);
-        Vec zsub(zdoftensor_reduced.begin() + first, zdoftensor_reduced.begin() + last);
-        Vec fxyzsub  = f(xsub, ysub, zsub);
-        for (int j = 0; j < last-first; ++j) {
-            for (int l = 0; l < value_size; ++l) {
-                vals[first * value_size + j * value_size + l] = fxyzsub[j * value_size + l];
+#if defined(USE_XSIMD)
+// loads simd_t::size values and converts them to double
+inline simd_t load_as_double(const double* ptr) {
+    return xsimd::load_aligned(ptr);
+}
+
+template<class Storage>
+inline simd_t load_as_double(const Storage* ptr) {
+    alignas(XSIMD_DEFAULT_ALIGNMENT) double temp[xsimd::simd_type<double>::size];
+    for (int i = 0; i < xsimd::simd_type<double>::size; ++i)
+        temp[i] = ptr[i];
+    return xsimd::load_aligned(temp);
+}
+#endif
+
+// Evaluates the tensor product Lagrange interpolant on a cell at the point
+// (x, y, z), given relative to the cell and scaled to [0, 1]. vals_local
+// contains the values at the (degree+1)^3 nodes of the cell, each padded to
+// padded_value_size. The values may be stored in reduced precision, in which
+// case they are multiplied by scales (one per output dimension) unless that
+// is null. The sums are always accumulated in double precision.
+template<class Storage>
+inline void evaluate_lagrange_3d(const InterpolationRule& rule, int value_size, int padded_value_size, double x, double y, double z, const Storage* vals_local, const double* scales, double* res)
+{
+    #if defined(USE_XSIMD)
+    constexpr int simdcount = xsimd::simd_type<double>::size;
+    #else
+    constexpr int simdcount = 1;
+    #endif
+    constexpr int max_stack_degree = lagrange_max_stack_degree;
+    int degree = rule.degree;
+    // the values of the basis functions are kept on the stack (for the usual
+    // low degrees), so that the interpolant can be evaluated concurrently
+    double pk_stack[3*(max_stack_degree+1)];
+    Vec pk_heap;
+    double* pkxs = pk_stack;
+    if(degree > max_stack_degree) {
+        pk_heap = Vec(3*(degree+1), 0.);
+        pkxs = pk_heap.data();
+    }
+    double* pkys = pkxs + (degree+1);
+    double* pkzs = pkxs + 2*(degree+1);
+    #if defined(USE_XSIMD)
+    if(xsimd::simd_type<double>::size >= 3){
+        simd_t xyz;
+        xyz[0] = x;
+        xyz[1] = y;
+        xyz[2] = z;
+        for (int k = 0; k < degree+1; ++k) {
+            simd_t temp = rule.basis_fun(k, xyz);
+            pkxs[k] = temp[0];
+            pkys[k] = temp[1];
+            pkzs[k] = temp[2];
+        }
+    } else {
+        for (int k = 0; k < degree+1; ++k) {
+            pkxs[k] = rule.basis_fun(k, x);
+            pkys[k] = rule.basis_fun(k, y);
+            pkzs[k] = rule.basis_fun(k, z);
+        }
+    }
+
+    // Potential optimization: use barycentric interpolation here right now the
+    // implementation in O(degree^3) in memory and O(degree^4) in computation,
+    // using Barycentric interpolation this could be reduced to O(degree^3) in
+    // memory and O(degree^3) in computation.
+    for(int l=0; l<padded_value_size; l += simdcount) {
+        simd_t sumi(0.);
+        int offset_local = l;
+        const Storage* val_ptr = &(vals_local[offset_local]);
+        for (int i = 0; i < degree+1; ++i) {
+            simd_t sumj(0.); 
+            for (int j = 0; j < degree+1; ++j) {
+                simd_t sumk(0.);
+                for (int k = 0; k < degree+1; ++k) {
+                    double pkz = pkzs[k];
+                    sumk = xsimd::fma(load_as_double(val_ptr), simd_t(pkz), sumk);
+                    val_ptr += padded_value_size;
+                }
+                double pjy = pkys[j];
+                sumj = xsimd::fma(sumk, simd_t(pjy), sumj);
+            }
+            double pix = pkxs[i];
+            sumi = xsimd::fma(sumj, simd_t(pix), sumi);
+        }
+        for (int ll = 0; ll < std::min(simdcount, value_size-l); ++ll) {
+            res[l+ll] = scales ? sumi[ll]*scales[l+ll] : sumi[ll];
+        }
+    }
+    #else
+    for (int k = 0; k < degree+1; ++k) {
+        pkxs[k] = rule.basis_fun(k, x);
+        pkys[k] = rule.basis_fun(k, y);
+        pkzs[k] = rule.basis_fun(k, z);
+    }
+    for(int l=0; l<padded_value_size; l += simdcount) {
+        double sumi(0.);
+        int offset_local = l;
+        const Storage* val_ptr = &(vals_local[offset_local]);
+        for (int i = 0; i < degree+1; ++i) {
+            double sumj(0.);
+            for (int j = 0; j < degree+1; ++j) {
+                double sumk(0.);
+                for (int k = 0; k < degree+1; ++k) {
+                    double pkz = pkzs[k];
+                    sumk += (*val_ptr) * pkz;
+                    val_ptr += padded_value_size;
+                }
+                double pjy = pkys[j];
+                sumj += sumk * pjy;
             }
+            double pix = pkxs[i];
+            sumi += sumj * pix;
         }
+        res[l] = scales ? sumi*scales[l] : sumi;
     }
+    #endif
+}
+
+#if defined(USE_XSIMD)
+inline double simd_lane(const simd_t& v, int lane) { return v[lane]; }
+#endif
+inline double simd_lane(double v, int lane) { return v; }
+
+// As evaluate_lagrange_3d, but also computes the derivatives with respect to
+// the local coordinates x, y and z, and writes them to grad[3*l + d]. The
+// sums over the nodes in z are shared by the value and the derivatives in x
+// and y, so this costs about twice as much as the values alone.
+template<class Storage>
+inline void evaluate_lagrange_3d_with_gradient(const InterpolationRule& rule, int value_size, int padded_value_size, double x, double y, double z, const Storage* vals_local, const double* scales, double* res, double* grad)
+{
+    #if defined(USE_XSIMD)
+    constexpr int simdcount = xsimd::simd_type<double>::size;
+    using acc_t = simd_t;
+    auto load = [](const Storage* ptr) { return load_as_double(ptr); };
+    #else
+    constexpr int simdcount = 1;
+    using acc_t = double;
+    auto load = [](const Storage* ptr) { return double(*ptr); };
+    #endif
+    constexpr int max_stack_degree = lagrange_max_stack_degree;
     int degree = rule.degree;
-    all_local_vals_map = std::unordered_map<int, AlignedPaddedVec>();
-    all_local_vals_map.reserve(cells_to_keep);
-
-    for (int xidx = 0; xidx < nx; ++xidx) {
-        for (int yidx = 0; yidx < ny; ++yidx) {
-            for (int zidx = 0; zidx < nz; ++zidx) {
-                int meshidx = idx_cell(xidx, yidx, zidx);
-                if(skip_cell[meshidx])
-                    continue;
-                AlignedPaddedVec local_vals(local_vals_size, 0.);
-                for (int i = 0; i < degree+1; ++i) {
-                    for (int j = 0; j < degree+1; ++j) {
-                        for (int k = 0; k < degree+1; ++k) {
-                            int offset = value_size*full_to_reduced_map[idx_dof(xidx*degree+i, yidx*degree+j, zidx*degree+k)];
-                            int offset_local = padded_value_size * idx_dof_local(i, j, k);
-                            for (int l = 0; l < value_size; ++l) {
-                                local_vals[offset_local + l] = vals[offset + l];
+    double p_stack[6*(max_stack_degree+1)];
+    Vec p_heap;
+    double* pkxs = p_stack;
+    if(degree > max_stack_degree) {
+        p_heap = Vec(6*(degree+1), 0.);
+        pkxs = p_heap.data();
+    }
+    double* pkys = pkxs + (degree+1);
+    double* pkzs = pkxs + 2*(degree+1);
+    double* dpkxs = pkxs + 3*(degree+1);
+    double* dpkys = pkxs + 4*(degree+1);
+    double* dpkzs = pkxs + 5*(degree+1);
+    for (int k = 0; k < degree+1; ++k) {
+        pkxs[k] = rule.basis_fun(k, x);
+        pkys[k] = rule.basis_fun(k, y);
+        pkzs[k] = rule.basis_fun(k, z);
+        dpkxs[k] = rule.basis_fun_deriv(k, x);
+        dpkys[k] = rule.basis_fun_deriv(k, y);
+        dpkzs[k] = rule.basis_fun_deriv(k, z);
+    }
+    for(int l=0; l<padded_value_size; l += simdcount) {
+        acc_t sumi(0.), sumi_dx(0.), sumi_dy(0.), sumi_dz(0.);
+        const Storage* val_ptr = &(vals_local[l]);
+        for (int i = 0; i < degree+1; ++i) {
+            acc_t sumj(0.), sumj_dy(0.), sumj_dz(0.);
+            for (int j = 0; j < degree+1; ++j) {
+                acc_t sumk(0.), sumk_dz(0.);
+                for (int k = 0; k < degree+1; ++k) {
+                    acc_t val = load(val_ptr);
+                    sumk += val * acc_t(pkzs[k]);
+                    sumk_dz += val * acc_t(dpkzs[k]);
+                    val_ptr += padded_value_size;
+                }
+                sumj += sumk * acc_t(pkys[j]);
+                sumj_dy += sumk * acc_t(dpkys[j]);
+                sumj_dz += sumk_dz * acc_t(pkys[j]);
+            }
+            sumi += sumj * acc_t(pkxs[i]);
+            sumi_dx += sumj * acc_t(dpkxs[i]);
+            sumi_dy += sumj_dy * acc_t(pkxs[i]);
+            sumi_dz += sumj_dz * acc_t(pkxs[i]);
+        }
+        for (int ll = 0; ll < std::min(simdcount, value_size-l); ++ll) {
+            double scale = scales ? scales[l+ll] : 1.;
+            res[l+ll] = simd_lane(sumi, ll)*scale;
+            grad[3*(l+ll) + 0] = simd_lane(sumi_dx, ll)*scale;
+            grad[3*(l+ll) + 1] = simd_lane(sumi_dy, ll)*scale;
+            grad[3*(l+ll) + 2] = simd_lane(sumi_dz, ll)*scale;
+        }
+    }
+}
+
+template<class Array>
+void RegularGridInterpolant3D<Array>::interpolate_batch(std::function<Vec(Vec, Vec, Vec)> &f) {
+    if(lazy)
+        lazy_f = f;
+    if(!cache_file.empty() && load(cache_file))
+        return;
+    int degree = rule.degree;
+    mapped_file = nullptr;
+    all_local_vals = AlignedPaddedVector<char>(size_t(cells_to_keep) * local_vals_size * value_bytes(), 0);
+    cell_scales = Vec(value_bits == 16 ? size_t(cells_to_keep) * value_size : 0, 0.);
+    cell_to_local = std::vector<int32_t>(nx*ny*nz, -1);
+    int32_t ctr = 0;
+    for (int meshidx = 0; meshidx < nx*ny*nz; ++meshidx) {
+        if(!skip_cell[meshidx])
+            cell_to_local[meshidx] = ctr++;
+    }
+    cell_filled = nullptr;
+    if(lazy) {
+        // the cells are filled by fill_cells once they are evaluated
+        cell_filled.reset(new std::atomic<uint8_t>[cells_to_keep]);
+        for (uint32_t i = 0; i < cells_to_keep; ++i)
+            cell_filled[i].store(0, std::memory_order_relaxed);
+        return;
+    }
+
+    int nthreads = build_threads;
+#if !defined(_OPENMP)
+    nthreads = 1;
+#endif
+    // choose the tiles by halving their longest side until the nodes of
+    // nthreads tiles fit into max_build_memory, and until there are a few
+    // tiles per thread to balance the load
+    int tx = nx, ty = ny, tz = nz;
+    size_t bytes_per_node = sizeof(double)*(3 + value_size) + sizeof(int32_t);
+    auto nodes_per_tile = [&]() { return size_t(tx*degree+1)*(ty*degree+1)*(tz*degree+1); };
+    auto number_of_tiles = [&]() { return size_t((nx+tx-1)/tx)*((ny+ty-1)/ty)*((nz+tz-1)/tz); };
+    while(tx*ty*tz > 1 && (nthreads*nodes_per_tile()*bytes_per_node > max_build_memory || (nthreads > 1 && number_of_tiles() < 4*size_t(nthreads)))) {
+        if(tx >= ty && tx >= tz)
+            tx = (tx+1)/2;
+        else if(ty >= tz)
+            ty = (ty+1)/2;
+        else
+            tz = (tz+1)/2;
+    }
+    int ntx = (nx+tx-1)/tx, nty = (ny+ty-1)/ty, ntz = (nz+tz-1)/tz;
+    int ntiles = ntx*nty*ntz;
+
+    auto build_tile = [&](int tile) {
+        int i0 = (tile/(nty*ntz))*tx, j0 = ((tile/ntz) % nty)*ty, k0 = (tile % ntz)*tz;
+        int i1 = std::min(i0+tx, nx), j1 = std::min(j0+ty, ny), k1 = std::min(k0+tz, nz);
+        int my = (j1-j0)*degree+1, mz = (k1-k0)*degree+1;
+        // the position of each node of the tile in xs, ys, zs, -1 for nodes
+        // that only belong to skipped cells
+        std::vector<int32_t> node_idx(size_t((i1-i0)*degree+1)*my*mz, -1);
+        auto tile_node = [&](int i, int j, int k) {
+            return (size_t(i-i0*degree)*my + (j-j0*degree))*mz + (k-k0*degree);
+        };
+        Vec xs, ys, zs;
+        for (int xidx = i0; xidx < i1; ++xidx) {
+            for (int yidx = j0; yidx < j1; ++yidx) {
+                for (int zidx = k0; zidx < k1; ++zidx) {
+                    if(skip_cell[idx_cell(xidx, yidx, zidx)])
+                        continue;
+                    for (int i = xidx*degree; i < (xidx+1)*degree+1; ++i) {
+                        for (int j = yidx*degree; j < (yidx+1)*degree+1; ++j) {
+                            for (int k = zidx*degree; k < (zidx+1)*degree+1; ++k) {
+                                int32_t& idx = node_idx[tile_node(i, j, k)];
+                                if(idx >= 0)
+                                    continue;
+                                idx = xs.size();
+                                xs.push_back(xdof[i]);
+                                ys.push_back(ydof[j]);
+                                zs.push_back(zdof[k]);
                             }
                         }
                     }
                 }
-                all_local_vals_map.insert({meshidx, local_vals});
+            }
+        }
+        size_t npoints = xs.size();
+        if(npoints == 0)
+            return;
+        Vec vals(npoints*value_size, 0.);
+        size_t BATCH_SIZE = 16384;
+        for (size_t first = 0; first < npoints; first += BATCH_SIZE) {
+            size_t last = std::min(first + BATCH_SIZE, npoints);
+            Vec xsub(xs.begin() + first, xs.begin() + last);
+            Vec ysub(ys.begin() + first, ys.begin() + last);
+            Vec zsub(zs.begin() + first, zs.begin() + last);
+            Vec fxyzsub  = f(xsub, ysub, zsub);
+            std::copy(fxyzsub.begin(), fxyzsub.begin() + (last-first)*value_size, vals.begin() + first*value_size);
+        }
+        AlignedPaddedVec local_vals(local_vals_size, 0.);
+        for (int xidx = i0; xidx < i1; ++xidx) {
+            for (int yidx = j0; yidx < j1; ++yidx) {
+                for (int zidx = k0; zidx < k1; ++zidx) {
+                    int32_t local_idx = cell_to_local[idx_cell(xidx, yidx, zidx)];
+                    if(local_idx < 0)
+                        continue;
+                    for (int i = 0; i < degree+1; ++i) {
+                        for (int j = 0; j < degree+1; ++j) {
+                            for (int k = 0; k < degree+1; ++k) {
+                                size_t offset = size_t(value_size)*node_idx[tile_node(xidx*degree+i, yidx*degree+j, zidx*degree+k)];
+                                int offset_local = padded_value_size * idx_dof_local(i, j, k);
+                                for (int l = 0; l < value_size; ++l) {
+                                    local_vals[offset_local + l] = vals[offset + l];
+                                }
+                            }
+                        }
+                    }
+                    store_cell(local_idx, local_vals.data());
+                }
+            }
+        }
+    };
+
+    if(nthreads > 1) {
+        // the tiles write to disjoint parts of all_local_vals. exceptions
+        // cannot leave the parallel region, so the first one is rethrown
+        // afterwards
+        std::exception_ptr error = nullptr;
+        #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+        for (int tile = 0; tile < ntiles; ++tile) {
+            try {
+                build_tile(tile);
+            } catch(...) {
+                #pragma omp critical
+                if(!error)
+                    error = std::current_exception();
+            }
+        }
+        if(error)
+            std::rethrow_exception(error);
+    } else {
+        for (int tile = 0; tile < ntiles; ++tile)
+            build_tile(tile);
+    }
+    if(!cache_file.empty())
+        save(cache_file);
+}
+
+template<class Array>
+void RegularGridInterpolant3D<Array>::store_cell(int32_t local_idx, const double* vals_local) {
+    char* dest = all_local_vals.data() + size_t(local_idx) * local_vals_size * value_bytes();
+    if(value_bits == 64) {
+        std::memcpy(dest, vals_local, sizeof(double)*local_vals_size);
+    } else if(value_bits == 32) {
+        float* vals = reinterpret_cast<float*>(dest);
+        for (int i = 0; i < local_vals_size; ++i)
+            vals[i] = float(vals_local[i]);
+    } else {
+        int16_t* vals = reinterpret_cast<int16_t*>(dest);
+        double* scales = cell_scales.data() + size_t(local_idx) * value_size;
+        int npoints_local = local_vals_size/padded_value_size;
+        for (int l = 0; l < value_size; ++l) {
+            double maxabs = 0.;
+            for (int i = 0; i < npoints_local; ++i)
+                maxabs = std::max(maxabs, std::abs(vals_local[i*padded_value_size + l]));
+            scales[l] = maxabs/32767;
+            double inv = maxabs > 0 ? 32767/maxabs : 0.;
+            for (int i = 0; i < npoints_local; ++i)
+                vals[i*padded_value_size + l] = int16_t(std::lround(vals_local[i*padded_value_size + l]*inv));
+        }
+    }
+}
+
+template<class Array>
+void RegularGridInterpolant3D<Array>::fill_cells(const std::vector<int>& cell_idxs) {
+    LazyFillLock lock;
+    // another thread may have filled some of the cells in the meantime
+    std::vector<int> cells;
+    for (int cell_idx : cell_idxs) {
+        int32_t local_idx = cell_to_local[cell_idx];
+        if(local_idx >= 0 && !is_filled(local_idx))
+            cells.push_back(cell_idx);
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    if(cells.empty())
+        return;
+    if(!lazy_f)
+        throw std::runtime_error("The interpolant is not completely filled and has no function to fill the remaining cells.");
+
+    // collect the nodes of all cells, the nodes shared by neighbouring cells
+    // are evaluated only once
+    int degree = rule.degree;
+    int npoints_local = (degree+1)*(degree+1)*(degree+1);
+    int64_t my = ny*degree+1, mz = nz*degree+1;
+    std::unordered_map<int64_t, int32_t> node_idx;
+    std::vector<int32_t> cell_nodes(cells.size()*npoints_local);
+    Vec xs, ys, zs;
+    for (size_t c = 0; c < cells.size(); ++c) {
+        int xidx = cells[c]/(ny*nz), yidx = (cells[c]/nz) % ny, zidx = cells[c] % nz;
+        for (int i = 0; i < degree+1; ++i) {
+            for (int j = 0; j < degree+1; ++j) {
+                for (int k = 0; k < degree+1; ++k) {
+                    int ii = xidx*degree+i, jj = yidx*degree+j, kk = zidx*degree+k;
+                    auto inserted = node_idx.insert({(ii*my + jj)*mz + kk, int32_t(xs.size())});
+                    if(inserted.second) {
+                        xs.push_back(xdof[ii]);
+                        ys.push_back(ydof[jj]);
+                        zs.push_back(zdof[kk]);
+                    }
+                    cell_nodes[c*npoints_local + idx_dof_local(i, j, k)] = inserted.first->second;
+                }
             }
         }
     }
+    size_t npoints = xs.size();
+    Vec vals(npoints*value_size, 0.);
+    size_t BATCH_SIZE = 16384;
+    for (size_t first = 0; first < npoints; first += BATCH_SIZE) {
+        size_t last = std::min(first + BATCH_SIZE, npoints);
+        Vec xsub(xs.begin() + first, xs.begin() + last);
+        Vec ysub(ys.begin() + first, ys.begin() + last);
+        Vec zsub(zs.begin() + first, zs.begin() + last);
+        Vec fxyzsub = lazy_f(xsub, ysub, zsub);
+        std::copy(fxyzsub.begin(), fxyzsub.begin() + (last-first)*value_size, vals.begin() + first*value_size);
+    }
+    AlignedPaddedVec local_vals(local_vals_size, 0.);
+    for (size_t c = 0; c < cells.size(); ++c) {
+        for (int idx = 0; idx < npoints_local; ++idx) {
+            size_t offset = size_t(value_size)*cell_nodes[c*npoints_local + idx];
+            for (int l = 0; l < value_size; ++l)
+                local_vals[idx*padded_value_size + l] = vals[offset + l];
+        }
+        int32_t local_idx = cell_to_local[cells[c]];
+        store_cell(local_idx, local_vals.data());
+        // readers that see the flag also see the values
+        cell_filled[local_idx].store(1, std::memory_order_release);
+    }
+}
+
+// Layout of the files written by save(), all in the native byte order:
+//     char[8]  magic "SOPPRGI"
+//     uint32   version
+//     int32    degree, value_size, padded_value_size, nx, ny, nz, value_bits
+//     uint32   cells_to_keep
+//     double   xmin, xmax, ymin, ymax, zmin, zmax
+//     double   nodes[degree+1]
+//     int32    cell_to_local[nx*ny*nz]
+//     uint8    filled[cells_to_keep], whether the values of each cell are
+//              computed, see set_lazy
+//     padding to a multiple of 64 bytes
+//     values[cells_to_keep*(degree+1)^3*padded_value_size], as double,
+//              float or int16 depending on value_bits
+//     double   scales[cells_to_keep*value_size], only if value_bits == 16
+static const char rgi_magic[8] = "SOPPRGI";
+static const uint32_t rgi_version = 3;
+static const size_t rgi_alignment = 64;
+
+template<class Array>
+void RegularGridInterpolant3D<Array>::save(const std::string& filename) {
+    if(cell_to_local.empty())
+        throw std::runtime_error("The interpolant has to be built before it can be saved.");
+    // no cells are filled while the values are written
+    std::optional<LazyFillLock> lock;
+    if(cell_filled)
+        lock.emplace();
+    std::vector<uint8_t> filled(cells_to_keep);
+    for (uint32_t i = 0; i < cells_to_keep; ++i)
+        filled[i] = is_filled(i);
+    std::string tmp = filename + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if(!out)
+            throw std::runtime_error(fmt::format("Could not write {}", tmp));
+        auto write = [&out](const void* data, size_t size) { out.write(static_cast<const char*>(data), size); };
+        int32_t ints[7] = {rule.degree, value_size, padded_value_size, nx, ny, nz, value_bits};
+        double ranges[6] = {xmin, xmax, ymin, ymax, zmin, zmax};
+        write(rgi_magic, sizeof(rgi_magic));
+        write(&rgi_version, sizeof(rgi_version));
+        write(ints, sizeof(ints));
+        write(&cells_to_keep, sizeof(cells_to_keep));
+        write(ranges, sizeof(ranges));
+        write(rule.nodes.data(), sizeof(double)*rule.nodes.size());
+        write(cell_to_local.data(), sizeof(int32_t)*cell_to_local.size());
+        write(filled.data(), filled.size());
+        size_t pos = out.tellp();
+        std::vector<char> padding((rgi_alignment - pos % rgi_alignment) % rgi_alignment, 0);
+        write(padding.data(), padding.size());
+        write(local_vals_data(), value_bytes()*size_t(cells_to_keep)*local_vals_size);
+        write(cell_scales.data(), sizeof(double)*cell_scales.size());
+        if(!out)
+            throw std::runtime_error(fmt::format("Could not write {}", tmp));
+    }
+    if(std::rename(tmp.c_str(), filename.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error(fmt::format("Could not write {}", filename));
+    }
+}
+
+template<class Array>
+bool RegularGridInterpolant3D<Array>::load(const std::string& filename) {
+    std::shared_ptr<MappedFile> file;
+    try {
+        file = std::make_shared<MappedFile>(filename);
+    } catch(const std::runtime_error&) {
+        return false;
+    }
+    const char* data = file->data();
+    size_t pos = 0;
+    auto read = [&](void* dest, size_t size) {
+        if(pos + size > file->size())
+            return false;
+        std::memcpy(dest, data + pos, size);
+        pos += size;
+        return true;
+    };
+    char magic[8];
+    uint32_t version, ncells;
+    int32_t ints[7];
+    double ranges[6];
+    if(!read(magic, sizeof(magic)) || std::memcmp(magic, rgi_magic, sizeof(magic)) != 0)
+        return false;
+    if(!read(&version, sizeof(version)) || version != rgi_version)
+        return false;
+    if(!read(ints, sizeof(ints)) || !read(&ncells, sizeof(ncells)) || !read(ranges, sizeof(ranges)))
+        return false;
+    int file_padded_value_size = ints[2];
+    if(ints[0] != rule.degree || ints[1] != value_size || ints[3] != nx || ints[4] != ny || ints[5] != nz || ints[6] != value_bits || ncells != cells_to_keep)
+        return false;
+    if(ranges[0] != xmin || ranges[1] != xmax || ranges[2] != ymin || ranges[3] != ymax || ranges[4] != zmin || ranges[5] != zmax)
+        return false;
+    Vec nodes(rule.degree+1);
+    if(!read(nodes.data(), sizeof(double)*nodes.size()) || nodes != rule.nodes)
+        return false;
+    std::vector<int32_t> cells(nx*ny*nz);
+    if(!read(cells.data(), sizeof(int32_t)*cells.size()))
+        return false;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if((cells[i] < 0) != bool(skip_cell[i]) || cells[i] >= int32_t(cells_to_keep))
+            return false;
+    }
+    std::vector<uint8_t> filled(cells_to_keep);
+    if(!read(filled.data(), filled.size()))
+        return false;
+    uint32_t unfilled = std::count(filled.begin(), filled.end(), 0);
+    if(unfilled > 0 && !lazy)
+        return false;
+    pos += (rgi_alignment - pos % rgi_alignment) % rgi_alignment;
+    int npoints_local = (rule.degree+1)*(rule.degree+1)*(rule.degree+1);
+    size_t nvalues = size_t(cells_to_keep)*npoints_local*file_padded_value_size;
+    size_t nscales = value_bits == 16 ? size_t(cells_to_keep)*value_size : 0;
+    if(pos + value_bytes()*nvalues + sizeof(double)*nscales != file->size())
+        return false;
+
+    cell_to_local = cells;
+    cell_scales = Vec(nscales, 0.);
+    std::memcpy(cell_scales.data(), data + pos + value_bytes()*nvalues, sizeof(double)*nscales);
+    cell_filled = nullptr;
+    if(file_padded_value_size == padded_value_size && unfilled == 0) {
+        // use the values in the file directly
+        mapped_file = file;
+        mapped_offset = pos;
+        all_local_vals = AlignedPaddedVector<char>();
+    } else {
+        // the file was written with a different simd width, or the
+        // remaining cells are filled later, so copy the values into memory
+        const char* file_vals = data + pos;
+        size_t bytes = value_bytes();
+        mapped_file = nullptr;
+        all_local_vals = AlignedPaddedVector<char>(size_t(cells_to_keep) * local_vals_size * bytes, 0);
+        if(file_padded_value_size == padded_value_size) {
+            std::memcpy(all_local_vals.data(), file_vals, bytes*nvalues);
+        } else {
+            for (size_t c = 0; c < size_t(cells_to_keep)*npoints_local; ++c)
+                std::memcpy(all_local_vals.data() + c*padded_value_size*bytes, file_vals + c*file_padded_value_size*bytes, value_size*bytes);
+        }
+        if(unfilled > 0) {
+            cell_filled.reset(new std::atomic<uint8_t>[cells_to_keep]);
+            for (uint32_t i = 0; i < cells_to_keep; ++i)
+                cell_filled[i].store(filled[i] != 0, std::memory_order_relaxed);
+        }
+    }
+    return true;
+}
+
+// spreads the lower 21 bits of v so that there are two zero bits in between
+// any two of them
+inline uint64_t spread_bits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+
+// key of the cell (i, j, k) along a Z-order (Morton) curve
+inline uint64_t morton_key(int i, int j, int k) {
+    return (spread_bits(i) << 2) | (spread_bits(j) << 1) | spread_bits(k);
 }
 
 template<class Array>
@@ -60,8 +610,69 @@ void RegularGridInterpolant3D<Array>::evaluate_batch(Array& xyz, Array& fxyz){
     if(fxyz.layout() != xt::layout_type::row_major)
           throw std::runtime_error("fxyz needs to be in row-major storage order");
     int npoints = xyz.shape(0);
+    SIMSOPT_PERF_SCOPE(interpolant_evaluate, npoints);
+    double* res = fxyz.data();
+    // for a few points, sorting them does not pay off
+    if(npoints < 64) {
+        for (int i = 0; i < npoints; ++i) {
+            evaluate_inplace(xyz(i, 0), xyz(i, 1), xyz(i, 2), res + value_size*i);
+        }
+        return;
+    }
+
+    Vec local(3*npoints, 0.);
+    std::vector<int> cells(npoints, -1);
+    std::vector<std::pair<uint64_t, int>> order;
+    order.reserve(npoints);
     for (int i = 0; i < npoints; ++i) {
-        evaluate_inplace(xyz(i, 0), xyz(i, 1), xyz(i, 2), fxyz.data() + value_size*i);
+        int idxs[3];
+        cells[i] = locate(xyz(i, 0), xyz(i, 1), xyz(i, 2), idxs, &local[3*i]);
+        if(cells[i] >= 0)
+            order.push_back({morton_key(idxs[0], idxs[1], idxs[2]), i});
+    }
+    std::sort(order.begin(), order.end());
+    if(cell_filled) {
+        // fill all missing cells of the batch with a single call of lazy_f
+        std::vector<int> missing;
+        for (auto& o : order) {
+            int32_t local_idx = cell_to_local[cells[o.second]];
+            if(local_idx >= 0 && !is_filled(local_idx) && (missing.empty() || missing.back() != cells[o.second]))
+                missing.push_back(cells[o.second]);
+        }
+        if(!missing.empty())
+            fill_cells(missing);
+    }
+
+    #if defined(USE_XSIMD)
+    std::vector<simd_t, xs::aligned_allocator<simd_t, XSIMD_DEFAULT_ALIGNMENT>> acc(value_size);
+    alignas(XSIMD_DEFAULT_ALIGNMENT) double local_simd[3*simdcount];
+    int points[simdcount];
+    #endif
+    for (size_t first = 0; first < order.size(); ) {
+        size_t last = first + 1;
+        while(last < order.size() && order[last].first == order[first].first)
+            last++;
+        int32_t local_idx = cell_local_idx(cells[order[first].second]);
+        size_t l = first;
+        if(local_idx >= 0) {
+            #if defined(USE_XSIMD)
+            if(rule.degree <= max_stack_degree) {
+                for (; l + simdcount <= last; l += simdcount) {
+                    for (int p = 0; p < simdcount; ++p) {
+                        points[p] = order[l+p].second;
+                        for (int d = 0; d < 3; ++d)
+                            local_simd[d*simdcount + p] = local[3*points[p] + d];
+                    }
+                    evaluate_local_simd(local_simd, points, local_idx, acc.data(), res);
+                }
+            }
+            #endif
+            for (; l < last; ++l) {
+                int i = order[l].second;
+                evaluate_local(local[3*i], local[3*i+1], local[3*i+2], local_idx, res + value_size*i);
+            }
+        }
+        first = last;
     }
 }
 
@@ -82,7 +693,7 @@ int RegularGridInterpolant3D<Array>::locate_unsafe(double x, double y, double z)
 }
 
 template<class Array>
-void RegularGridInterpolant3D<Array>::evaluate_inplace(double x, double y, double z, double* res){
+int RegularGridInterpolant3D<Array>::locate(double x, double y, double z, int* idxs, double* local){
 
     // to avoid funny business when the data is just a tiny bit out of bounds
     // due to machine precision, we perform this check and shift
@@ -96,112 +707,157 @@ void RegularGridInterpolant3D<Array>::evaluate_inplace(double x, double y, doubl
     int xidx = int(nx*(x-xmin)/(xmax-xmin)); // find idx so that xmesh[xidx] <= x <= xs[xidx+1]
     int yidx = int(ny*(y-ymin)/(ymax-ymin));
     int zidx = int(nz*(z-zmin)/(zmax-zmin));
+    bool xout = xidx < 0 || xidx >= nx;
+    bool yout = yidx < 0 || yidx >= ny;
+    bool zout = zidx < 0 || zidx >= nz;
     if(!out_of_bounds_ok){
-        if(xidx < 0 || xidx >= nx)
+        if(xout)
             throw std::runtime_error(fmt::format("xidxs={} not within [0, {}]", xidx, nx-1));
-        if(yidx < 0 || yidx >= ny)
+        if(yout)
             throw std::runtime_error(fmt::format("yidxs={} not within [0, {}]", yidx, ny-1));
-        if(zidx < 0 || zidx >= nz)
+        if(zout)
             throw std::runtime_error(fmt::format("zidxs={} not within [0, {}]", zidx, nz-1));
     }
-    double xlocal = (x-xmesh[xidx])/hx;
-    double ylocal = (y-ymesh[yidx])/hy;
-    double zlocal = (z-zmesh[zidx])/hz;
-    return evaluate_local(xlocal, ylocal, zlocal, idx_cell(xidx, yidx, zidx), res);
+    if(xout || yout || zout)
+        return -1;
+    idxs[0] = xidx;
+    idxs[1] = yidx;
+    idxs[2] = zidx;
+    local[0] = (x-xmesh[xidx])/hx;
+    local[1] = (y-ymesh[yidx])/hy;
+    local[2] = (z-zmesh[zidx])/hz;
+    return idx_cell(xidx, yidx, zidx);
+}
+
+template<class Array>
+int32_t RegularGridInterpolant3D<Array>::cell_local_idx(int cell_idx){
+    int32_t local_idx = cell_to_local.empty() ? -1 : cell_to_local[cell_idx];
+    if (local_idx < 0 && !out_of_bounds_ok)
+        throw std::runtime_error(fmt::format("cell_idx={} is skipped or the interpolant has not been built", cell_idx));
+    return local_idx;
 }
 
 template<class Array>
-void RegularGridInterpolant3D<Array>::evaluate_local(double x, double y, double z, int cell_idx, double* res)
+void RegularGridInterpolant3D<Array>::evaluate_inplace(double x, double y, double z, double* res){
+    int idxs[3];
+    double local[3];
+    int cell_idx = locate(x, y, z, idxs, local);
+    if(cell_idx < 0)
+        return;
+    int32_t local_idx = cell_local_idx(cell_idx);
+    if(local_idx < 0)
+        return;
+    if(!is_filled(local_idx))
+        fill_cells({cell_idx});
+    evaluate_local(local[0], local[1], local[2], local_idx, res);
+}
+
+template<class Array>
+void RegularGridInterpolant3D<Array>::evaluate_with_gradient_inplace(double x, double y, double z, double* res, double* grad){
+    int idxs[3];
+    double local[3];
+    int cell_idx = locate(x, y, z, idxs, local);
+    if(cell_idx < 0)
+        return;
+    int32_t local_idx = cell_local_idx(cell_idx);
+    if(local_idx < 0)
+        return;
+    if(!is_filled(local_idx))
+        fill_cells({cell_idx});
+    if(value_bits == 64)
+        evaluate_lagrange_3d_with_gradient(rule, value_size, padded_value_size, local[0], local[1], local[2], cell_values<double>(local_idx), (const double*) nullptr, res, grad);
+    else if(value_bits == 32)
+        evaluate_lagrange_3d_with_gradient(rule, value_size, padded_value_size, local[0], local[1], local[2], cell_values<float>(local_idx), (const double*) nullptr, res, grad);
+    else
+        evaluate_lagrange_3d_with_gradient(rule, value_size, padded_value_size, local[0], local[1], local[2], cell_values<int16_t>(local_idx), scales_of(local_idx), res, grad);
+    // the local coordinates are scaled by the size of the cells
+    double hinv[3] = {1./hx, 1./hy, 1./hz};
+    for (int l = 0; l < value_size; ++l)
+        for (int d = 0; d < 3; ++d)
+            grad[3*l + d] *= hinv[d];
+}
+
+template<class Array>
+void RegularGridInterpolant3D<Array>::evaluate_batch_with_gradient(Array& xyz, Array& fxyz, Array& dfxyz){
+    if(fxyz.layout() != xt::layout_type::row_major || dfxyz.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("fxyz and dfxyz need to be in row-major storage order");
+    int npoints = xyz.shape(0);
+    SIMSOPT_PERF_SCOPE(interpolant_evaluate, npoints);
+    double* res = fxyz.data();
+    double* grad = dfxyz.data();
+    for (int i = 0; i < npoints; ++i)
+        evaluate_with_gradient_inplace(xyz(i, 0), xyz(i, 1), xyz(i, 2), res + value_size*i, grad + 3*value_size*i);
+}
+
+template<class Array>
+void RegularGridInterpolant3D<Array>::evaluate_local(double x, double y, double z, int32_t local_idx, double* res)
 {
-    int degree = rule.degree;
-    auto got = all_local_vals_map.find(cell_idx);
-    if (got == all_local_vals_map.end()) {
-        if(out_of_bounds_ok)
-            return;
-        else
-            throw std::runtime_error(fmt::format("cell_idx={} not in all_local_vals_map", cell_idx));
-    }
+    if(value_bits == 64)
+        evaluate_lagrange_3d(rule, value_size, padded_value_size, x, y, z, cell_values<double>(local_idx), (const double*) nullptr, res);
+    else if(value_bits == 32)
+        evaluate_lagrange_3d(rule, value_size, padded_value_size, x, y, z, cell_values<float>(local_idx), (const double*) nullptr, res);
+    else
+        evaluate_lagrange_3d(rule, value_size, padded_value_size, x, y, z, cell_values<int16_t>(local_idx), scales_of(local_idx), res);
+}
 
-    double* vals_local = got->second.data();
-    #if defined(USE_XSIMD)
-    if(xsimd::simd_type<double>::size >= 3){
-        simd_t xyz;
-        xyz[0] = x;
-        xyz[1] = y;
-        xyz[2] = z;
-        for (int k = 0; k < degree+1; ++k) {
-            simd_t temp = this->rule.basis_fun(k, xyz);
-            pkxs[k] = temp[0];
-            pkys[k] = temp[1];
-            pkzs[k] = temp[2];
-        }
-    } else {
-        for (int k = 0; k < degree+1; ++k) {
-            pkxs[k] = this->rule.basis_fun(k, x);
-            pkys[k] = this->rule.basis_fun(k, y);
-            pkzs[k] = this->rule.basis_fun(k, z);
-        }
-    }
+#if defined(USE_XSIMD)
+template<class Array>
+void RegularGridInterpolant3D<Array>::evaluate_local_simd(const double* local, const int* points, int32_t local_idx, simd_t* acc, double* res)
+{
+    if(value_bits == 64)
+        evaluate_local_simd(local, points, cell_values<double>(local_idx), (const double*) nullptr, acc, res);
+    else if(value_bits == 32)
+        evaluate_local_simd(local, points, cell_values<float>(local_idx), (const double*) nullptr, acc, res);
+    else
+        evaluate_local_simd(local, points, cell_values<int16_t>(local_idx), scales_of(local_idx), acc, res);
+}
 
-    // Potential optimization: use barycentric interpolation here right now the
-    // implementation in O(degree^3) in memory and O(degree^4) in computation,
-    // using Barycentric interpolation this could be reduced to O(degree^3) in
-    // memory and O(degree^3) in computation.
-    for(int l=0; l<padded_value_size; l += simdcount) {
-        simd_t sumi(0.);
-        int offset_local = l;
-        double* val_ptr = &(vals_local[offset_local]);
-        for (int i = 0; i < degree+1; ++i) {
-            simd_t sumj(0.); 
-            for (int j = 0; j < degree+1; ++j) {
-                simd_t sumk(0.);
-                for (int k = 0; k < degree+1; ++k) {
-                    double pkz = pkzs[k];
-                    sumk = xsimd::fma(xsimd::load_aligned(val_ptr), simd_t(pkz), sumk);
-                    val_ptr += padded_value_size;
-                }
-                double pjy = pkys[j];
-                sumj = xsimd::fma(sumk, simd_t(pjy), sumj);
-            }
-            double pix = pkxs[i];
-            sumi = xsimd::fma(sumj, simd_t(pix), sumi);
-        }
-        for (int ll = 0; ll < std::min(simdcount, value_size-l); ++ll) {
-            res[l+ll] = sumi[ll];
-        }
-    }
-    #else
+template<class Array>
+template<class Storage>
+void RegularGridInterpolant3D<Array>::evaluate_local_simd(const double* local, const int* points, const Storage* vals_local, const double* scales, simd_t* acc, double* res)
+{
+    int degree = rule.degree;
+    simd_t x = xsimd::load_aligned(local);
+    simd_t y = xsimd::load_aligned(local + simdcount);
+    simd_t z = xsimd::load_aligned(local + 2*simdcount);
+    simd_t pkxs[max_stack_degree+1], pkys[max_stack_degree+1], pkzs[max_stack_degree+1];
     for (int k = 0; k < degree+1; ++k) {
         pkxs[k] = this->rule.basis_fun(k, x);
         pkys[k] = this->rule.basis_fun(k, y);
         pkzs[k] = this->rule.basis_fun(k, z);
     }
-    for(int l=0; l<padded_value_size; l += simdcount) {
-        double sumi(0.);
-        int offset_local = l;
-        double* val_ptr = &(vals_local[offset_local]);
-        for (int i = 0; i < degree+1; ++i) {
-            double sumj(0.);
-            for (int j = 0; j < degree+1; ++j) {
-                double sumk(0.);
-                for (int k = 0; k < degree+1; ++k) {
-                    double pkz = pkzs[k];
-                    sumk += (*val_ptr) * pkz;
-                    val_ptr += padded_value_size;
-                }
-                double pjy = pkys[j];
-                sumj += sumk * pjy;
+    for (int l = 0; l < value_size; ++l)
+        acc[l] = simd_t(0.);
+    // every value at a dof is multiplied with the weights of all points, so
+    // unlike in evaluate_local no lanes are wasted for small value_size
+    const Storage* val_ptr = vals_local;
+    for (int i = 0; i < degree+1; ++i) {
+        for (int j = 0; j < degree+1; ++j) {
+            simd_t pij = pkxs[i] * pkys[j];
+            for (int k = 0; k < degree+1; ++k) {
+                simd_t w = pij * pkzs[k];
+                for (int l = 0; l < value_size; ++l)
+                    acc[l] = xsimd::fma(simd_t(double(val_ptr[l])), w, acc[l]);
+                val_ptr += padded_value_size;
             }
-            double pix = pkxs[i];
-            sumi += sumj * pix;
         }
-        res[l] = sumi;
     }
-    #endif
+    alignas(XSIMD_DEFAULT_ALIGNMENT) double temp[simdcount];
+    for (int l = 0; l < value_size; ++l) {
+        if(scales)
+            acc[l] *= simd_t(scales[l]);
+        acc[l].store_aligned(temp);
+        for (int p = 0; p < simdcount; ++p)
+            res[value_size*points[p] + l] = temp[p];
+    }
 }
+#endif
 
+// Compares the interpolant with f at samples random points in the box
+// [xmin, xmax] x [ymin, ymax] x [zmin, zmax] and returns the mean error -/+
+// its standard deviation.
 template<class Array>
-std::pair<double, double> RegularGridInterpolant3D<Array>::estimate_error(std::function<Vec(Vec, Vec, Vec)> &f, int samples) {
+std::pair<double, double> estimate_interpolation_error(Interpolant3D<Array>& interpolant, std::function<Vec(Vec, Vec, Vec)> &f, int samples, int value_size, double xmin, double xmax, double ymin, double ymax, double zmin, double zmax) {
     std::default_random_engine generator;
     std::uniform_real_distribution<double> distribution(0.0, +1.0);
     double err = 0;
@@ -220,7 +876,7 @@ std::pair<double, double> RegularGridInterpolant3D<Array>::estimate_error(std::f
         xyz(i, 2) = zs[i];
     }
     Vec fx = f(xs, ys, zs);
-    this->evaluate_batch(xyz, fhxyz);
+    interpolant.evaluate_batch(xyz, fhxyz);
     for (int i = 0; i < samples; ++i) {
         double diff = 0.;
         for (int l = 0; l < value_size; ++l) {
@@ -237,6 +893,11 @@ std::pair<double, double> RegularGridInterpolant3D<Array>::estimate_error(std::f
 
 
 
+template<class Array>
+std::pair<double, double> RegularGridInterpolant3D<Array>::estimate_error(std::function<Vec(Vec, Vec, Vec)> &f, int samples) {
+    return estimate_interpolation_error<Array>(*this, f, samples, value_size, xmin, xmax, ymin, ymax, zmin, zmax);
+}
+
 Vec linspace(double min, double max, int n, bool endpoint) {
     Vec res(n, 0.);
     if(endpoint) {
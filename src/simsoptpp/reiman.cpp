@@ -2,19 +2,18 @@
 #include <stdlib.h>
 #include <math.h>
 #include <time.h>
+#include <stdexcept>
 
-#include "xtensor-python/pyarray.hpp"
-typedef xt::pyarray<double> Array;
-Array ReimanB(double& iota0, double& iota1, Array& k_theta, Array& epsilon, int& m0_symmetry, Array& points){
-    int num_points = points.shape(0);
-    int num_coeffs = k_theta.shape(0);
-    Array B        = xt::zeros<double>({points.shape(0), points.shape(1)});
+#include "reiman.h"
+
+void reiman_B(double iota0, double iota1, const vector<double>& k_theta, const vector<double>& epsilon, int m0_symmetry, const double* points, int num_points, double* B){
+    int num_coeffs = k_theta.size();
     double x,y,ZZ,RR,varphi,cosphi,sinphi,BR,BZ,Bphi;
     double R_axis = 1.0, theta, rmin, combo, combo1;
     for (int i = 0; i < num_points; ++i) {
-        x      = points(i, 0);
-        y      = points(i, 1);
-        ZZ     = points(i, 2);
+        x      = points[3*i+0];
+        y      = points[3*i+1];
+        ZZ     = points[3*i+2];
         RR     = sqrt(x*x+y*y);
         cosphi = x/RR;
         sinphi = y/RR;
@@ -34,23 +33,20 @@ Array ReimanB(double& iota0, double& iota1, Array& k_theta, Array& epsilon, int&
         BZ   = -( (RR - R_axis)/RR)*combo  + (ZZ/RR)*combo1;
         Bphi = -1.0;
 
-        B(i,0) = BR*cosphi-Bphi*sinphi;
-        B(i,1) = BR*sinphi+Bphi*cosphi;
-        B(i,2) = BZ;
+        B[3*i+0] = BR*cosphi-Bphi*sinphi;
+        B[3*i+1] = BR*sinphi+Bphi*cosphi;
+        B[3*i+2] = BZ;
     }
-    return B;
 }
 
-Array ReimandB(double& iota0, double& iota1, Array& k_theta, Array& epsilon, int& m0_symmetry, Array& points){
-    int num_points = points.shape(0);
-    int num_coeffs = k_theta.shape(0);
-    Array dB       = xt::zeros<double>({points.shape(0), points.shape(1), points.shape(1)});
+void reiman_dB(double iota0, double iota1, const vector<double>& k_theta, const vector<double>& epsilon, int m0_symmetry, const double* points, int num_points, double* dB){
+    int num_coeffs = k_theta.size();
     double x,y,ZZ,RR,varphi,cosphi,sinphi,BR,BZ,Bphi,dRBR,dZBR,dphiBR,dRBZ,dZBZ,dphiBZ,dRBphi,dZBphi,dphiBphi;
     double R_axis = 1.0, theta, rmin, combo, combo1, dcombodR, dcombodZ, dcombodphi, dcombo1dR, dcombo1dZ, dcombo1dphi;
     for (int i = 0; i < num_points; ++i) {
-        x      = points(i, 0);
-        y      = points(i, 1);
-        ZZ     = points(i, 2);
+        x      = points[3*i+0];
+        y      = points[3*i+1];
+        ZZ     = points[3*i+2];
         RR     = sqrt(x*x+y*y);
         cosphi = x/RR;
         sinphi = y/RR;
@@ -93,15 +89,41 @@ Array ReimandB(double& iota0, double& iota1, Array& k_theta, Array& epsilon, int
         dZBphi   = 0.0;
         dphiBphi = 0.0;
 
-        dB(i,0,0) = dRBR*cosphi*cosphi-(dphiBR-Bphi+dRBphi*RR)*cosphi*sinphi/RR+sinphi*sinphi*(dphiBphi+BR)/RR;
-        dB(i,0,1) = sinphi*cosphi*(dRBR*RR-dphiBphi-BR)/RR+sinphi*sinphi*(Bphi-dphiBR)/RR+cosphi*cosphi*dRBphi;
-        dB(i,0,2) = dRBZ*cosphi-dphiBZ*sinphi/RR;
-        dB(i,1,0) = sinphi*cosphi*(dRBR*RR-dphiBphi-BR)/RR+cosphi*cosphi*(dphiBR-Bphi)/RR-sinphi*sinphi*dRBphi;
-        dB(i,1,1) = dRBR*sinphi*sinphi+(dphiBR-Bphi+dRBphi*RR)*cosphi*sinphi/RR+cosphi*cosphi*(dphiBphi+BR)/RR;
-        dB(i,1,2) = dRBZ*sinphi+dphiBZ*cosphi/RR;
-        dB(i,2,0) = dZBR*cosphi-dZBphi*sinphi;
-        dB(i,2,1) = dZBR*sinphi+dZBphi*cosphi;
-        dB(i,2,2) = dZBZ;
+        dB[9*i+0] = dRBR*cosphi*cosphi-(dphiBR-Bphi+dRBphi*RR)*cosphi*sinphi/RR+sinphi*sinphi*(dphiBphi+BR)/RR;
+        dB[9*i+1] = sinphi*cosphi*(dRBR*RR-dphiBphi-BR)/RR+sinphi*sinphi*(Bphi-dphiBR)/RR+cosphi*cosphi*dRBphi;
+        dB[9*i+2] = dRBZ*cosphi-dphiBZ*sinphi/RR;
+        dB[9*i+3] = sinphi*cosphi*(dRBR*RR-dphiBphi-BR)/RR+cosphi*cosphi*(dphiBR-Bphi)/RR-sinphi*sinphi*dRBphi;
+        dB[9*i+4] = dRBR*sinphi*sinphi+(dphiBR-Bphi+dRBphi*RR)*cosphi*sinphi/RR+cosphi*cosphi*(dphiBphi+BR)/RR;
+        dB[9*i+5] = dRBZ*sinphi+dphiBZ*cosphi/RR;
+        dB[9*i+6] = dZBR*cosphi-dZBphi*sinphi;
+        dB[9*i+7] = dZBR*sinphi+dZBphi*cosphi;
+        dB[9*i+8] = dZBZ;
     }
+}
+
+static vector<double> to_vector(Array& a) {
+    return vector<double>(a.data(), a.data() + a.size());
+}
+
+static void check_points(Array& points) {
+    if(points.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("points needs to be in row-major storage order");
+    if(points.dimension() != 2 || points.shape(1) != 3)
+          throw std::invalid_argument("points needs to have shape (npoints, 3)");
+}
+
+Array ReimanB(double& iota0, double& iota1, Array& k_theta, Array& epsilon, int& m0_symmetry, Array& points){
+    check_points(points);
+    int num_points = points.shape(0);
+    Array B = xt::zeros<double>({num_points, 3});
+    reiman_B(iota0, iota1, to_vector(k_theta), to_vector(epsilon), m0_symmetry, points.data(), num_points, B.data());
+    return B;
+}
+
+Array ReimandB(double& iota0, double& iota1, Array& k_theta, Array& epsilon, int& m0_symmetry, Array& points){
+    check_points(points);
+    int num_points = points.shape(0);
+    Array dB = xt::zeros<double>({num_points, 3, 3});
+    reiman_dB(iota0, iota1, to_vector(k_theta), to_vector(epsilon), m0_symmetry, points.data(), num_points, dB.data());
     return dB;
-}
\ No newline at end of file
+}
@@ -1,4 +1,15 @@
+#pragma once
+
 #include "xtensor-python/pyarray.hpp"
 typedef xt::pyarray<double> Array;
+#include <vector>
+using std::vector;
+
+// The field and its gradient dB(i, k, l) = dB_l/dx_k at a row-major
+// (npoints, 3) array of points, written to arrays of shape (npoints, 3) and
+// (npoints, 3, 3).
+void reiman_B(double iota0, double iota1, const vector<double>& k_theta, const vector<double>& epsilon, int m0_symmetry, const double* points, int num_points, double* B);
+void reiman_dB(double iota0, double iota1, const vector<double>& k_theta, const vector<double>& epsilon, int m0_symmetry, const double* points, int num_points, double* dB);
+
 Array ReimanB(double& iota0, double& iota1, Array& k_theta, Array& epsilon, int& m0_symmetry, Array& points);
 Array ReimandB(double& iota0, double& iota1, Array& k_theta, Array& epsilon, int& m0_symmetry, Array& points);
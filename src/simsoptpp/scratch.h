@@ -0,0 +1,172 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <xtensor/xarray.hpp>
+
+// Scratch memory for temporaries in hot routines that are called repeatedly,
+// e.g. once per iteration of an optimisation.
+//
+// Every thread owns a ScratchArena, a stack of memory chunks from which
+// ScratchBuffers are carved out and to which they are returned in reverse
+// order when they go out of scope. When a request doesn't fit, a new chunk is
+// allocated, and once all buffers have been returned the chunks are merged
+// into a single one that is large enough for the high water mark. Hence
+// after the first call (per thread) of a routine, further calls with the same
+// sizes don't allocate.
+//
+// scratch_heap_allocations() counts the chunks that were allocated over all
+// threads, so that this can be verified.
+
+inline std::atomic<int64_t>& scratch_heap_allocations_counter() {
+    static std::atomic<int64_t> counter(0);
+    return counter;
+}
+
+inline int64_t scratch_heap_allocations() {
+    return scratch_heap_allocations_counter().load();
+}
+
+class ScratchArena {
+    private:
+        // 64 bytes so that buffers can be used with aligned simd loads
+        static constexpr size_t alignment = 64;
+        struct Chunk {
+            char* data;
+            size_t size;
+            size_t used;
+        };
+        std::vector<Chunk> chunks;
+        size_t in_use = 0; // number of buffers that have not been returned
+
+        static char* allocate(size_t bytes) {
+            scratch_heap_allocations_counter()++;
+            return static_cast<char*>(::operator new(bytes, std::align_val_t(alignment)));
+        }
+
+        static void deallocate(char* data) {
+            ::operator delete(data, std::align_val_t(alignment));
+        }
+
+        static size_t round_up(size_t bytes) {
+            return (bytes + alignment - 1) / alignment * alignment;
+        }
+
+    public:
+        ScratchArena() { chunks.reserve(16); }
+        ScratchArena(const ScratchArena&) = delete;
+        ScratchArena& operator=(const ScratchArena&) = delete;
+        ~ScratchArena() {
+            for (auto& chunk : chunks)
+                deallocate(chunk.data);
+        }
+
+        void* acquire(size_t bytes) {
+            bytes = round_up(std::max(bytes, size_t(1)));
+            in_use++;
+            if(!chunks.empty()) {
+                Chunk& last = chunks.back();
+                if(last.size - last.used >= bytes) {
+                    void* res = last.data + last.used;
+                    last.used += bytes;
+                    return res;
+                }
+            }
+            size_t total = 0;
+            for (auto& chunk : chunks)
+                total += chunk.size;
+            size_t size = std::max(bytes, total);
+            chunks.push_back({allocate(size), size, bytes});
+            return chunks.back().data;
+        }
+
+        // Buffers have to be returned in the reverse order in which they
+        // were acquired.
+        void release(void* ptr, size_t bytes) {
+            bytes = round_up(std::max(bytes, size_t(1)));
+            in_use--;
+            for (auto it = chunks.rbegin(); it != chunks.rend(); ++it) {
+                if(it->used == 0)
+                    continue;
+                if(static_cast<char*>(ptr) == it->data + it->used - bytes)
+                    it->used -= bytes;
+                break;
+            }
+            if(in_use == 0 && chunks.size() > 1) {
+                size_t total = 0;
+                for (auto& chunk : chunks) {
+                    total += chunk.size;
+                    deallocate(chunk.data);
+                }
+                chunks.clear();
+                chunks.push_back({allocate(total), total, 0});
+            } else if(in_use == 0 && !chunks.empty()) {
+                chunks.back().used = 0;
+            }
+        }
+
+        // Bytes currently reserved by the arena of this thread.
+        size_t capacity() const {
+            size_t total = 0;
+            for (auto& chunk : chunks)
+                total += chunk.size;
+            return total;
+        }
+};
+
+inline ScratchArena& scratch_arena() {
+    thread_local ScratchArena arena;
+    return arena;
+}
+
+// A buffer of n elements of the trivial type T from the scratch arena of the
+// calling thread. It must not outlive the scope in which it is created, and
+// must be destroyed on the thread that created it.
+template<class T>
+class ScratchBuffer {
+    static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_destructible<T>::value,
+            "ScratchBuffer only holds trivial types");
+    private:
+        T* ptr;
+        size_t n;
+    public:
+        explicit ScratchBuffer(size_t n) : ptr(static_cast<T*>(scratch_arena().acquire(n*sizeof(T)))), n(n) {}
+        ScratchBuffer(size_t n, const T& value) : ScratchBuffer(n) {
+            std::fill(ptr, ptr + n, value);
+        }
+        ScratchBuffer(const ScratchBuffer&) = delete;
+        ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+        ~ScratchBuffer() {
+            scratch_arena().release(ptr, n*sizeof(T));
+        }
+
+        T* data() { return ptr; }
+        const T* data() const { return ptr; }
+        size_t size() const { return n; }
+        T& operator[](size_t i) { return ptr[i]; }
+        const T& operator[](size_t i) const { return ptr[i]; }
+        T* begin() { return ptr; }
+        T* end() { return ptr + n; }
+        const T* begin() const { return ptr; }
+        const T* end() const { return ptr + n; }
+};
+
+// An array of shape (1, ..., 1) with `dimension` entries, to be passed for
+// the derivative arguments of kernels that are called with fewer derivatives
+// and never touch them. It is created on first use, and never destroyed since
+// python arrays cannot be freed after the interpreter has shut down.
+template<class Array>
+Array& placeholder_array(int dimension) {
+    static Array* placeholders[4] = {
+        new Array(xt::zeros<double>({1})),
+        new Array(xt::zeros<double>({1, 1})),
+        new Array(xt::zeros<double>({1, 1, 1})),
+        new Array(xt::zeros<double>({1, 1, 1, 1}))
+    };
+    return *placeholders[dimension - 1];
+}
@@ -49,7 +49,9 @@ class aligned_padded_allocator : public xs::aligned_allocator<T, Align> {
         }
 };
 
-using AlignedPaddedVec = std::vector<double, aligned_padded_allocator<double, XSIMD_DEFAULT_ALIGNMENT>>;
+template<class T>
+using AlignedPaddedVector = std::vector<T, aligned_padded_allocator<T, XSIMD_DEFAULT_ALIGNMENT>>;
+using AlignedPaddedVec = AlignedPaddedVector<double>;
 using simd_t = xs::simd_type<double>;
 
 #else
@@ -124,7 +126,9 @@ public:
     }
 };
 
-using AlignedPaddedVec = std::vector<double, AlignedPaddedAllocator<double>>;
+template<class T>
+using AlignedPaddedVector = std::vector<T, AlignedPaddedAllocator<T>>;
+using AlignedPaddedVec = AlignedPaddedVector<double>;
 
 #endif
 
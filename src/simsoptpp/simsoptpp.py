@@ -0,0 +1,51 @@
+"""
+Selects the build of the compiled extension for the instruction sets of this
+CPU. This file is only installed if simsopt is built with
+SIMSOPT_SIMD_DISPATCH, in which case the extension is compiled once per
+instruction set as simsoptpp_avx512, simsoptpp_avx2, ... (see CMakeLists.txt)
+and ``import simsoptpp`` imports the fastest variant that the CPU supports.
+
+The variant can be chosen explicitly by setting the environment variable
+SIMSOPT_SIMD_VARIANT, e.g. to compare the variants on the same machine. The
+selected variant is reported by ``simsoptpp.simd_variant``, and the variants
+that can be used on this CPU by ``simsoptpp.simd_variants``.
+"""
+import importlib
+import importlib.util
+import os
+import sys
+
+from simsoptpp_cpu import cpu_features
+
+# The variants in order of preference and the xsimd instruction sets that
+# they require, see SIMSOPT_SIMD_VARIANTS in CMakeLists.txt.
+_VARIANTS = [
+    ("avx512", ("avx512f", "avx512cd", "avx512dq", "avx512bw", "fma3_avx2")),
+    ("avx2", ("avx2", "fma3_avx2")),
+    ("sse4_2", ("sse4_2",)),
+    ("neon", ("neon64",)),
+]
+
+
+def _select():
+    features = cpu_features()
+    supported = [name for name, required in _VARIANTS
+                 if all(features[f] for f in required)
+                 and importlib.util.find_spec("simsoptpp_" + name) is not None]
+    requested = os.environ.get("SIMSOPT_SIMD_VARIANT")
+    if requested:
+        if requested not in supported:
+            raise ImportError(f"SIMSOPT_SIMD_VARIANT={requested} was requested, but the variants of simsoptpp "
+                              f"that are installed and supported by this CPU are {supported}.")
+        variant = requested
+    elif supported:
+        variant = supported[0]
+    else:
+        raise ImportError("None of the variants of simsoptpp is supported by this CPU. "
+                          "Build simsopt from source without SIMSOPT_SIMD_DISPATCH.")
+    module = importlib.import_module("simsoptpp_" + variant)
+    module.simd_variants = supported
+    return module
+
+
+sys.modules[__name__] = _select()
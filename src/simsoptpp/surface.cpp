@@ -2,6 +2,7 @@
 #include <Eigen/Dense>
 #include "simdhelpers.h"
 #include "vec3dsimd.h"
+#include "scratch.h"
 
 
 template<class Array>
@@ -39,6 +40,21 @@ Array surface_vjp_contraction(const Array& mat, const Array& v){
     return res;
 }
 
+template<class Array>
+Array surface_jvp_contraction(const Array& mat, const Array& w){
+    if(mat.layout() != xt::layout_type::row_major)
+          throw std::runtime_error("mat needs to be in row-major storage order");
+    int numquadpoints_phi = mat.shape(0);
+    int numquadpoints_theta = mat.shape(1);
+    int numdofs = mat.shape(3);
+    Array res = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta, 3});
+    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_mat(const_cast<double*>(mat.data()), numquadpoints_phi*numquadpoints_theta*3, numdofs);
+    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_w(const_cast<double*>(w.data()), numdofs, 1);
+    Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor>> eigen_res(const_cast<double*>(res.data()), numquadpoints_phi*numquadpoints_theta*3, 1);
+    eigen_res = eigen_mat*eigen_w;
+    return res;
+}
+
 template<class Array>
 void Surface<Array>::least_squares_fit(Array& target_values) {
     if(target_values.shape(0) != numquadpoints_phi)
@@ -561,38 +577,140 @@ Array Surface<Array>::dnormal_by_dcoeff_vjp(Array& v) {
     return dgammadash1_by_dcoeff_vjp(res_dgammadash1) + dgammadash2_by_dcoeff_vjp(res_dgammadash2);
 }
 
+// The Hessians of the area and the volume are sums over the quadrature points
+// of symmetric matrices of the form
+//
+//      \sum_k l_k r_k^T,
+//
+// with a handful of vectors l_k, r_k of length ndofs per quadrature point.
+// symmetric_hessian calls fill(i, j, l, r) to write the rows l_k and r_k for
+// the quadrature point (i, j) to l[k*ndofs + m] and r[k*ndofs + m], and sums
+// the outer products. Only the lower triangle is computed, the quadrature
+// points are distributed over the threads with a thread local accumulator,
+// and the columns are processed in tiles so that the rows r_k of a tile stay
+// in cache while they are reused for all rows of the Hessian.
+template<class Array, class F>
+void symmetric_hessian(Array& data, int numquadpoints_phi, int numquadpoints_theta, int nrows, F fill) {
+    int ndofs = data.shape(0);
+    int numquadpoints = numquadpoints_phi*numquadpoints_theta;
+    // number of quadrature points whose rows are accumulated at once
+    constexpr int block = 4;
+    constexpr int tile = 128;
+    data *= 0.;
+    double* H = &(data(0, 0));
+#pragma omp parallel
+    {
+        vector<double> H_private(size_t(ndofs)*ndofs, 0.);
+        ScratchBuffer<double> l(size_t(block)*nrows*ndofs);
+        ScratchBuffer<double> r(size_t(block)*nrows*ndofs);
+#pragma omp for schedule(static)
+        for (int q0 = 0; q0 < numquadpoints; q0 += block) {
+            int nq = std::min(block, numquadpoints - q0);
+            for (int q = 0; q < nq; ++q)
+                fill((q0+q)/numquadpoints_theta, (q0+q)%numquadpoints_theta, &l[size_t(q)*nrows*ndofs], &r[size_t(q)*nrows*ndofs]);
+            int nk = nq*nrows;
+            for (int n0 = 0; n0 < ndofs; n0 += tile) {
+                for (int m = n0; m < ndofs; ++m) {
+                    int n1 = std::min(n0 + tile, m + 1);
+                    double* Hm = &H_private[size_t(m)*ndofs];
+                    for (int k = 0; k < nk; ++k) {
+                        double lkm = l[size_t(k)*ndofs + m];
+                        const double* rk = &r[size_t(k)*ndofs];
+                        for (int n = n0; n < n1; ++n)
+                            Hm[n] += lkm * rk[n];
+                    }
+                }
+            }
+        }
+#pragma omp critical
+        for (int m = 0; m < ndofs; ++m)
+            for (int n = 0; n <= m; ++n)
+                H[size_t(m)*ndofs + n] += H_private[size_t(m)*ndofs + n];
+    }
+    double scale = 1./numquadpoints;
+    for (int m = 0; m < ndofs; ++m) {
+        for (int n = 0; n <= m; ++n) {
+            H[size_t(m)*ndofs + n] *= scale;
+            H[size_t(n)*ndofs + m] = H[size_t(m)*ndofs + n];
+        }
+    }
+}
+
 template<class Array>
 void Surface<Array>::d2area_by_dcoeffdcoeff_impl(Array& data) {
-    data *= 0.;
-    double norm, dnorm_dcoeffn;
-    auto nor = this->normal();
-    auto dnor_dc = this->dnormal_by_dcoeff();
-    auto d2nor_dcdc = this->d2normal_by_dcoeffdcoeff();
+    // With the unit normal u = n/|n| and d2n_mn = dg1_m x dg2_n + dg1_n x dg2_m,
+    //
+    //      d2|n|/dc_m dc_n = (dn_m . dn_n - (u . dn_m) (u . dn_n)) / |n| + dg1_m . (dg2_n x u) + dg1_n . (dg2_m x u),
+    //
+    // so that the second derivative of the normal is never formed.
+    auto& nor = this->normal();
+    auto& dnor_dc = this->dnormal_by_dcoeff();
+    auto& dg1_dc = this->dgammadash1_by_dcoeff();
+    auto& dg2_dc = this->dgammadash2_by_dcoeff();
     int ndofs = num_dofs();
+    symmetric_hessian(data, numquadpoints_phi, numquadpoints_theta, 10, [&](int i, int j, double* l, double* r) {
+        double norm = std::sqrt(nor(i,j,0)*nor(i,j,0) + nor(i,j,1)*nor(i,j,1) + nor(i,j,2)*nor(i,j,2));
+        double u[3] = {nor(i,j,0)/norm, nor(i,j,1)/norm, nor(i,j,2)/norm};
+        double s = 1./std::sqrt(norm);
+        const double* dn[3] = {&dnor_dc(i,j,0,0), &dnor_dc(i,j,1,0), &dnor_dc(i,j,2,0)};
+        const double* dg1[3] = {&dg1_dc(i,j,0,0), &dg1_dc(i,j,1,0), &dg1_dc(i,j,2,0)};
+        const double* dg2[3] = {&dg2_dc(i,j,0,0), &dg2_dc(i,j,1,0), &dg2_dc(i,j,2,0)};
+        for (int m = 0; m < ndofs; ++m) {
+            double udn = u[0]*dn[0][m] + u[1]*dn[1][m] + u[2]*dn[2][m];
+            double b[3] = {
+                dg2[1][m]*u[2] - dg2[2][m]*u[1],
+                dg2[2][m]*u[0] - dg2[0][m]*u[2],
+                dg2[0][m]*u[1] - dg2[1][m]*u[0]
+            };
+            for (int c = 0; c < 3; ++c) {
+                l[c*ndofs + m] = r[c*ndofs + m] = s*dn[c][m];
+                l[(4+c)*ndofs + m] = r[(7+c)*ndofs + m] = dg1[c][m];
+                l[(7+c)*ndofs + m] = r[(4+c)*ndofs + m] = b[c];
+            }
+            l[3*ndofs + m] = s*udn;
+            r[3*ndofs + m] = -s*udn;
+        }
+    });
+}
+
+template<class Array>
+Array Surface<Array>::d2area_by_dcoeffdcoeff_hvp(Array& w) {
+    // The derivative of darea_by_dcoeff = dgammadash1_by_dcoeff_vjp(g2 x u) + dgammadash2_by_dcoeff_vjp(u x g1)
+    // in the direction w. Since gamma is linear in the dofs, only the arguments
+    // of the vjps depend on the dofs.
+    if(int(w.size()) != num_dofs())
+        throw std::invalid_argument("w needs to have one entry per dof.");
+    auto& nor = this->normal();
+    auto& dg1 = this->gammadash1();
+    auto& dg2 = this->gammadash2();
+    Array dg1_w = dgamma_by_dcoeff_jvp(w, 1, 0);
+    Array dg2_w = dgamma_by_dcoeff_jvp(w, 0, 1);
+    Array res_dgammadash1 = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta, 3});
+    Array res_dgammadash2 = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta, 3});
+    double scale = 1./(numquadpoints_phi*numquadpoints_theta);
+#pragma omp parallel for
     for (int i = 0; i < numquadpoints_phi; ++i) {
         for (int j = 0; j < numquadpoints_theta; ++j) {
-            for (int m = 0; m < ndofs; ++m) {
-                for (int n = 0; n < ndofs; ++n) {
-                    norm = sqrt(nor(i,j,0)*nor(i,j,0)
-                            + nor(i,j,1)*nor(i,j,1)
-                            + nor(i,j,2)*nor(i,j,2));
-                    dnorm_dcoeffn = (dnor_dc(i,j,0,n)*nor(i,j,0)
-                            + dnor_dc(i,j,1,n)*nor(i,j,1)
-                            + dnor_dc(i,j,2,n)*nor(i,j,2)) / norm;
-                    data(m,n) +=  dnor_dc(i,j,0,m) * (dnor_dc(i,j,0,n) * norm - dnorm_dcoeffn * nor(i,j,0)) / (norm*norm)
-                        + dnor_dc(i,j,1,m) * (dnor_dc(i,j,1,n) * norm - dnorm_dcoeffn * nor(i,j,1)) / (norm*norm)
-                        + dnor_dc(i,j,2,m) * (dnor_dc(i,j,2,n) * norm - dnorm_dcoeffn * nor(i,j,2)) / (norm*norm)
-                        + d2nor_dcdc(i,j,0,m,n) * nor(i,j,0) / norm
-                        + d2nor_dcdc(i,j,1,m,n) * nor(i,j,1) / norm
-                        + d2nor_dcdc(i,j,2,m,n) * nor(i,j,2) / norm;
-                }
+            Vec3d g1{dg1(i,j,0), dg1(i,j,1), dg1(i,j,2)};
+            Vec3d g2{dg2(i,j,0), dg2(i,j,1), dg2(i,j,2)};
+            Vec3d g1_w{dg1_w(i,j,0), dg1_w(i,j,1), dg1_w(i,j,2)};
+            Vec3d g2_w{dg2_w(i,j,0), dg2_w(i,j,1), dg2_w(i,j,2)};
+            Vec3d n{nor(i,j,0), nor(i,j,1), nor(i,j,2)};
+            double norm = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            Vec3d u = n/norm;
+            Vec3d n_w = cross(g1_w, g2) + cross(g1, g2_w);
+            Vec3d u_w = (n_w - inner(u, n_w)*u)/norm;
+            Vec3d r1 = scale*(cross(g2_w, u) + cross(g2, u_w));
+            Vec3d r2 = scale*(cross(u_w, g1) + cross(u, g1_w));
+            for (int d = 0; d < 3; ++d) {
+                res_dgammadash1(i, j, d) = r1[d];
+                res_dgammadash2(i, j, d) = r2[d];
             }
         }
     }
-    data *= 1./ (numquadpoints_phi*numquadpoints_theta);
+    return dgammadash1_by_dcoeff_vjp(res_dgammadash1) + dgammadash2_by_dcoeff_vjp(res_dgammadash2);
 }
 
-
 template<class Array>
 double Surface<Array>::volume() {
     double volume = 0.;
@@ -646,166 +764,80 @@ void Surface<Array>::dvolume_by_dcoeff_impl(Array& data) {
     }
 }
 
-#if defined(USE_XSIMD)
-
 template<class Array>
 void Surface<Array>::d2volume_by_dcoeffdcoeff_impl(Array& data) {
-    // this vectorized version of d2volume_by_dcoeffdcoeff computes the second derivative of
-    // the surface normal on the fly, which alleviates memory requirements.
-    constexpr int simd_size = xsimd::simd_type<double>::size;
-    data *= 0.;
-    auto nor = this->normal();
-    auto xyz = this->gamma();
-    auto dxyz_dc = this->dgamma_by_dcoeff();
-    auto dnor_dc = this->dnormal_by_dcoeff();
-    auto dg1_dc = this->dgammadash1_by_dcoeff();
-    auto dg2_dc = this->dgammadash2_by_dcoeff();
+    // With d2n_mn = dg1_m x dg2_n + dg1_n x dg2_m,
+    //
+    //      d2(x . n)/dc_m dc_n = dx_m . dn_n + dx_n . dn_m + dg1_m . (dg2_n x x) + dg1_n . (dg2_m x x),
+    //
+    // so that the second derivative of the normal is never formed.
+    auto& xyz = this->gamma();
+    auto& dxyz_dc = this->dgamma_by_dcoeff();
+    auto& dnor_dc = this->dnormal_by_dcoeff();
+    auto& dg1_dc = this->dgammadash1_by_dcoeff();
+    auto& dg2_dc = this->dgammadash2_by_dcoeff();
     int ndofs = num_dofs();
-    
-    auto dg1x_dc = AlignedPaddedVec(ndofs, 0);
-    auto dg1y_dc = AlignedPaddedVec(ndofs, 0);
-    auto dg1z_dc = AlignedPaddedVec(ndofs, 0);
-
-    auto dg2x_dc = AlignedPaddedVec(ndofs, 0);
-    auto dg2y_dc = AlignedPaddedVec(ndofs, 0);
-    auto dg2z_dc = AlignedPaddedVec(ndofs, 0);
-
-    auto dnorx_dc = AlignedPaddedVec(ndofs, 0);
-    auto dnory_dc = AlignedPaddedVec(ndofs, 0);
-    auto dnorz_dc = AlignedPaddedVec(ndofs, 0);
-
-    auto dxyzx_dc = AlignedPaddedVec(ndofs, 0);
-    auto dxyzy_dc = AlignedPaddedVec(ndofs, 0);
-    auto dxyzz_dc = AlignedPaddedVec(ndofs, 0);
-
-    for (int i = 0; i < numquadpoints_phi; ++i) {
-        for (int j = 0; j < numquadpoints_theta; ++j) {
-            simd_t xyzij0(xyz(i,j,0));
-            simd_t xyzij1(xyz(i,j,1));
-            simd_t xyzij2(xyz(i,j,2));
-            
-            // load the tangents, normals, and derivatives wrt to surface coeffs into aligned and padded memory
-            for (int n = 0; n < ndofs; ++n) {
-                dg1x_dc[n] = dg1_dc(i, j, 0, n);
-                dg1y_dc[n] = dg1_dc(i, j, 1, n);
-                dg1z_dc[n] = dg1_dc(i, j, 2, n);
-
-                dg2x_dc[n] = dg2_dc(i, j, 0, n);
-                dg2y_dc[n] = dg2_dc(i, j, 1, n);
-                dg2z_dc[n] = dg2_dc(i, j, 2, n);
-
-                dnorx_dc[n] = dnor_dc(i, j, 0, n);
-                dnory_dc[n] = dnor_dc(i, j, 1, n);
-                dnorz_dc[n] = dnor_dc(i, j, 2, n);
- 
-                dxyzx_dc[n] = dxyz_dc(i, j, 0, n);
-                dxyzy_dc[n] = dxyz_dc(i, j, 1, n);
-                dxyzz_dc[n] = dxyz_dc(i, j, 2, n);
-            }
-
-            for (int m = 0; m < ndofs; ++m){ 
-                simd_t dg1_dc_ij0m(dg1_dc(i, j, 0, m));
-                simd_t dg1_dc_ij1m(dg1_dc(i, j, 1, m));
-                simd_t dg1_dc_ij2m(dg1_dc(i, j, 2, m));
-                
-                simd_t dg2_dc_ij0m(dg2_dc(i, j, 0, m));
-                simd_t dg2_dc_ij1m(dg2_dc(i, j, 1, m));
-                simd_t dg2_dc_ij2m(dg2_dc(i, j, 2, m));
-                
-                simd_t dxyz_dc_ij0m(dxyz_dc(i, j, 0, m));
-                simd_t dxyz_dc_ij1m(dxyz_dc(i, j, 1, m));
-                simd_t dxyz_dc_ij2m(dxyz_dc(i, j, 2, m));
-                
-                simd_t dnor_dc_ij0m(dnor_dc(i, j, 0, m));
-                simd_t dnor_dc_ij1m(dnor_dc(i, j, 1, m));
-                simd_t dnor_dc_ij2m(dnor_dc(i, j, 2, m));
-
-                for (int n = 0; n < ndofs; n+=simd_size){ 
-                    // load into aligned and padded memory into batches
-                    simd_t dg1_dc_ij0n = xs::load_aligned(&dg1x_dc[n]);
-                    simd_t dg1_dc_ij1n = xs::load_aligned(&dg1y_dc[n]);
-                    simd_t dg1_dc_ij2n = xs::load_aligned(&dg1z_dc[n]);
-                    
-                    simd_t dg2_dc_ij0n = xs::load_aligned(&dg2x_dc[n]);
-                    simd_t dg2_dc_ij1n = xs::load_aligned(&dg2y_dc[n]);
-                    simd_t dg2_dc_ij2n = xs::load_aligned(&dg2z_dc[n]);
-                    
-                    simd_t dnor_dc_ij0n = xs::load_aligned(&dnorx_dc[n]);
-                    simd_t dnor_dc_ij1n = xs::load_aligned(&dnory_dc[n]);
-                    simd_t dnor_dc_ij2n = xs::load_aligned(&dnorz_dc[n]);
-
-                    simd_t dxyz_dc_ij0n = xs::load_aligned(&dxyzx_dc[n]);
-                    simd_t dxyz_dc_ij1n = xs::load_aligned(&dxyzy_dc[n]);
-                    simd_t dxyz_dc_ij2n = xs::load_aligned(&dxyzz_dc[n]);
-
-                    // compute d2nor_dcdc on the fly
-                    //data(i, j, 0, m, n) =  dg1_dc(i, j, 1, m)*dg2_dc(i, j, 2, n) - dg1_dc(i, j, 2, m)*dg2_dc(i, j, 1, n);
-                    //data(i, j, 0, m, n) += dg1_dc(i, j, 1, n)*dg2_dc(i, j, 2, m) - dg1_dc(i, j, 2, n)*dg2_dc(i, j, 1, m);
-                    //data(i, j, 1, m, n) =  dg1_dc(i, j, 2, m)*dg2_dc(i, j, 0, n) - dg1_dc(i, j, 0, m)*dg2_dc(i, j, 2, n);
-                    //data(i, j, 1, m, n) += dg1_dc(i, j, 2, n)*dg2_dc(i, j, 0, m) - dg1_dc(i, j, 0, n)*dg2_dc(i, j, 2, m);
-                    //data(i, j, 2, m, n) =  dg1_dc(i, j, 0, m)*dg2_dc(i, j, 1, n) - dg1_dc(i, j, 1, m)*dg2_dc(i, j, 0, n);
-                    //data(i, j, 2, m, n) += dg1_dc(i, j, 0, n)*dg2_dc(i, j, 1, m) - dg1_dc(i, j, 1, n)*dg2_dc(i, j, 0, m);
-                    auto d2nor_dcdc_ij0mn =  xsimd::fms(dg1_dc_ij1m, dg2_dc_ij2n,  dg1_dc_ij2m*dg2_dc_ij1n);
-                         d2nor_dcdc_ij0mn += xsimd::fms(dg1_dc_ij1n, dg2_dc_ij2m,  dg1_dc_ij2n*dg2_dc_ij1m);
-                    auto d2nor_dcdc_ij1mn =  xsimd::fms(dg1_dc_ij2m, dg2_dc_ij0n,  dg1_dc_ij0m*dg2_dc_ij2n);
-                         d2nor_dcdc_ij1mn += xsimd::fms(dg1_dc_ij2n, dg2_dc_ij0m,  dg1_dc_ij0n*dg2_dc_ij2m);
-                    auto d2nor_dcdc_ij2mn =  xsimd::fms(dg1_dc_ij0m, dg2_dc_ij1n,  dg1_dc_ij1m*dg2_dc_ij0n);
-                         d2nor_dcdc_ij2mn += xsimd::fms(dg1_dc_ij0n, dg2_dc_ij1m,  dg1_dc_ij1n*dg2_dc_ij0m);
-                    
-                    // now compute d2volume_by_dcoeffdcoeff
-                    //data(m,n) += (1./3) * (dxyz_dc(i,j,0,m)*dnor_dc(i,j,0,n)
-                    //        +dxyz_dc(i,j,1,m)*dnor_dc(i,j,1,n)
-                    //        +dxyz_dc(i,j,2,m)*dnor_dc(i,j,2,n));
-                    //data(m,n) += (1./3) * (xyz(i,j,0)*d2nor_dcdc(i,j,0,m,n) + dxyz_dc(i,j,0,n) * dnor_dc(i,j,0,m)
-                    //        +xyz(i,j,1)*d2nor_dcdc(i,j,1,m,n) + dxyz_dc(i,j,1,n) * dnor_dc(i,j,1,m)
-                    //        +xyz(i,j,2)*d2nor_dcdc(i,j,2,m,n) + dxyz_dc(i,j,2,n) * dnor_dc(i,j,2,m));
-                    auto temp = xsimd::fma(dxyz_dc_ij0m, dnor_dc_ij0n, dxyz_dc_ij1m*dnor_dc_ij1n);
-                    auto data1  = (1./3) * xsimd::fma(dxyz_dc_ij2m, dnor_dc_ij2n, temp);
-                    auto data2  = (1./3) * (xsimd::fma(xyzij0, d2nor_dcdc_ij0mn , dxyz_dc_ij0n * dnor_dc_ij0m)
-                                           +xsimd::fma(xyzij1, d2nor_dcdc_ij1mn , dxyz_dc_ij1n * dnor_dc_ij1m)
-                                           +xsimd::fma(xyzij2, d2nor_dcdc_ij2mn , dxyz_dc_ij2n * dnor_dc_ij2m) );
-
-                    int jjlimit = std::min(simd_size, ndofs-n);
-                    for(int jj=0; jj<jjlimit; jj++){
-                        data(m, n+jj) += data1[jj]+data2[jj];
-                    }
-                }
+    symmetric_hessian(data, numquadpoints_phi, numquadpoints_theta, 12, [&](int i, int j, double* l, double* r) {
+        double x[3] = {xyz(i,j,0), xyz(i,j,1), xyz(i,j,2)};
+        const double* dx[3] = {&dxyz_dc(i,j,0,0), &dxyz_dc(i,j,1,0), &dxyz_dc(i,j,2,0)};
+        const double* dn[3] = {&dnor_dc(i,j,0,0), &dnor_dc(i,j,1,0), &dnor_dc(i,j,2,0)};
+        const double* dg1[3] = {&dg1_dc(i,j,0,0), &dg1_dc(i,j,1,0), &dg1_dc(i,j,2,0)};
+        const double* dg2[3] = {&dg2_dc(i,j,0,0), &dg2_dc(i,j,1,0), &dg2_dc(i,j,2,0)};
+        for (int m = 0; m < ndofs; ++m) {
+            double b[3] = {
+                (dg2[1][m]*x[2] - dg2[2][m]*x[1])/3.,
+                (dg2[2][m]*x[0] - dg2[0][m]*x[2])/3.,
+                (dg2[0][m]*x[1] - dg2[1][m]*x[0])/3.
+            };
+            for (int c = 0; c < 3; ++c) {
+                l[c*ndofs + m] = r[(3+c)*ndofs + m] = dx[c][m]/3.;
+                l[(3+c)*ndofs + m] = r[c*ndofs + m] = dn[c][m];
+                l[(6+c)*ndofs + m] = r[(9+c)*ndofs + m] = dg1[c][m];
+                l[(9+c)*ndofs + m] = r[(6+c)*ndofs + m] = b[c];
             }
         }
-    }
-    data *= 1./ (numquadpoints_phi*numquadpoints_theta);
+    });
 }
 
-#else
-
 template<class Array>
-void Surface<Array>::d2volume_by_dcoeffdcoeff_impl(Array& data) {
-    data *= 0.;
-    auto nor = this->normal();
-    auto dnor_dc = this->dnormal_by_dcoeff();
-    auto d2nor_dcdc = this->d2normal_by_dcoeffdcoeff(); // uses a lot of memory for moderate surface complexity
-    auto xyz = this->gamma();
-    auto dxyz_dc = this->dgamma_by_dcoeff();
-    int ndofs = num_dofs();
+Array Surface<Array>::d2volume_by_dcoeffdcoeff_hvp(Array& w) {
+    // The derivative of
+    //      dvolume_by_dcoeff = (dgammadash1_by_dcoeff_vjp(g2 x x) + dgammadash2_by_dcoeff_vjp(x x g1) + dgamma_by_dcoeff_vjp(n))/3
+    // in the direction w.
+    if(int(w.size()) != num_dofs())
+        throw std::invalid_argument("w needs to have one entry per dof.");
+    auto& xyz = this->gamma();
+    auto& dg1 = this->gammadash1();
+    auto& dg2 = this->gammadash2();
+    Array x_w = dgamma_by_dcoeff_jvp(w, 0, 0);
+    Array dg1_w = dgamma_by_dcoeff_jvp(w, 1, 0);
+    Array dg2_w = dgamma_by_dcoeff_jvp(w, 0, 1);
+    Array res_dgamma = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta, 3});
+    Array res_dgammadash1 = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta, 3});
+    Array res_dgammadash2 = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta, 3});
+    double scale = 1./(3.*numquadpoints_phi*numquadpoints_theta);
+#pragma omp parallel for
     for (int i = 0; i < numquadpoints_phi; ++i) {
         for (int j = 0; j < numquadpoints_theta; ++j) {
-            for (int m = 0; m < ndofs; ++m){
-                for (int n = 0; n < ndofs; ++n){
-                    data(m,n) += (1./3) * (dxyz_dc(i,j,0,m)*dnor_dc(i,j,0,n)
-                            +dxyz_dc(i,j,1,m)*dnor_dc(i,j,1,n)
-                            +dxyz_dc(i,j,2,m)*dnor_dc(i,j,2,n));
-                    data(m,n) += (1./3) * (xyz(i,j,0)*d2nor_dcdc(i,j,0,m,n) + dxyz_dc(i,j,0,n) * dnor_dc(i,j,0,m)
-                            +xyz(i,j,1)*d2nor_dcdc(i,j,1,m,n) + dxyz_dc(i,j,1,n) * dnor_dc(i,j,1,m)
-                            +xyz(i,j,2)*d2nor_dcdc(i,j,2,m,n) + dxyz_dc(i,j,2,n) * dnor_dc(i,j,2,m));
-                }
+            Vec3d x{xyz(i,j,0), xyz(i,j,1), xyz(i,j,2)};
+            Vec3d g1{dg1(i,j,0), dg1(i,j,1), dg1(i,j,2)};
+            Vec3d g2{dg2(i,j,0), dg2(i,j,1), dg2(i,j,2)};
+            Vec3d xw{x_w(i,j,0), x_w(i,j,1), x_w(i,j,2)};
+            Vec3d g1_w{dg1_w(i,j,0), dg1_w(i,j,1), dg1_w(i,j,2)};
+            Vec3d g2_w{dg2_w(i,j,0), dg2_w(i,j,1), dg2_w(i,j,2)};
+            Vec3d r0 = scale*(cross(g1_w, g2) + cross(g1, g2_w));
+            Vec3d r1 = scale*(cross(g2_w, x) + cross(g2, xw));
+            Vec3d r2 = scale*(cross(xw, g1) + cross(x, g1_w));
+            for (int d = 0; d < 3; ++d) {
+                res_dgamma(i, j, d) = r0[d];
+                res_dgammadash1(i, j, d) = r1[d];
+                res_dgammadash2(i, j, d) = r2[d];
             }
         }
     }
-    data *= 1./ (numquadpoints_phi*numquadpoints_theta);
+    return dgamma_by_dcoeff_vjp(res_dgamma) + dgammadash1_by_dcoeff_vjp(res_dgammadash1) + dgammadash2_by_dcoeff_vjp(res_dgammadash2);
 }
 
-#endif
-
 #include "xtensor-python/pyarray.hpp"     // Numpy bindings
 typedef xt::pyarray<double> Array;
 template class Surface<Array>;
@@ -11,12 +11,32 @@ using std::map;
 using std::logic_error;
 
 #include "xtensor/xarray.hpp"
-#include "cachedarray.h"
+#include "cache.h"
 #include "curve.h"
 #include <Eigen/Dense>
 
 template<class Array>
 Array surface_vjp_contraction(const Array& mat, const Array& v);
+template<class Array>
+Array surface_jvp_contraction(const Array& mat, const Array& w);
+
+// The quantities that a Surface caches, used as slots of its SlotCache.
+enum SurfaceQuantity {
+    SURFACE_gamma = 0, SURFACE_gammadash1, SURFACE_gammadash2, SURFACE_gammadash1dash1, SURFACE_gammadash1dash2, SURFACE_gammadash2dash2,
+    SURFACE_dgamma_by_dcoeff, SURFACE_dgammadash1_by_dcoeff, SURFACE_dgammadash2_by_dcoeff, SURFACE_dgammadash1dash1_by_dcoeff, SURFACE_dgammadash1dash2_by_dcoeff, SURFACE_dgammadash2dash2_by_dcoeff,
+    SURFACE_surface_curvatures, SURFACE_dsurface_curvatures_by_dcoeff, SURFACE_first_fund_form, SURFACE_dfirst_fund_form_by_dcoeff, SURFACE_second_fund_form, SURFACE_dsecond_fund_form_by_dcoeff,
+    SURFACE_normal, SURFACE_dnormal_by_dcoeff, SURFACE_d2normal_by_dcoeffdcoeff, SURFACE_unitnormal, SURFACE_dunitnormal_by_dcoeff,
+    SURFACE_darea_by_dcoeff, SURFACE_d2area_by_dcoeffdcoeff, SURFACE_dvolume_by_dcoeff, SURFACE_d2volume_by_dcoeffdcoeff,
+    NUM_SURFACE_QUANTITIES
+};
+
+inline const char* const surface_quantity_names[NUM_SURFACE_QUANTITIES] = {
+    "gamma", "gammadash1", "gammadash2", "gammadash1dash1", "gammadash1dash2", "gammadash2dash2",
+    "dgamma_by_dcoeff", "dgammadash1_by_dcoeff", "dgammadash2_by_dcoeff", "dgammadash1dash1_by_dcoeff", "dgammadash1dash2_by_dcoeff", "dgammadash2dash2_by_dcoeff",
+    "surface_curvatures", "dsurface_curvatures_by_dcoeff", "first_fund_form", "dfirst_fund_form_by_dcoeff", "second_fund_form", "dsecond_fund_form_by_dcoeff",
+    "normal", "dnormal_by_dcoeff", "d2normal_by_dcoeffdcoeff", "unitnormal", "dunitnormal_by_dcoeff",
+    "darea_by_dcoeff", "d2area_by_dcoeffdcoeff", "dvolume_by_dcoeff", "d2volume_by_dcoeffdcoeff"
+};
 
 template<class Array>
 class Surface {
@@ -26,32 +46,20 @@ class Surface {
          * e.g. dgamma_by_dcoeff, since we assume a representation that is
          * linear in the dofs.  For that data we use the cache_persistent
          * object */
-        map<string, CachedArray<Array>> cache;
-        map<string, CachedArray<Array>> cache_persistent;
+        // identifies the surface in CacheRegistry::usage()
+        int cache_id = CacheRegistry::instance().new_object_id();
+        SlotCache<Array, NUM_SURFACE_QUANTITIES> cache = SlotCache<Array, NUM_SURFACE_QUANTITIES>(surface_quantity_names, "Surface", cache_id);
+        SlotCache<Array, NUM_SURFACE_QUANTITIES> cache_persistent = SlotCache<Array, NUM_SURFACE_QUANTITIES>(surface_quantity_names, "Surface", cache_id);
 
 
-        Array& check_the_cache(string key, vector<int> dims, std::function<void(Array&)> impl){
-            auto loc = cache.find(key);
-            if(loc == cache.end()){ // Key not found --> allocate array
-                loc = cache.insert(std::make_pair(key, CachedArray<Array>(xt::zeros<double>(dims)))).first;
-            }
-            if(!((loc->second).status)){ // needs recomputing
-                impl((loc->second).data);
-                (loc->second).status = true;
-            }
-            return (loc->second).data;
+        template<class Impl>
+        Array& check_the_cache(SurfaceQuantity key, const vector<int>& dims, Impl&& impl){
+            return cache.get_or_create_and_fill(key, dims, impl);
         }
 
-        Array& check_the_persistent_cache(string key, vector<int> dims, std::function<void(Array&)> impl){
-            auto loc = cache_persistent.find(key);
-            if(loc == cache_persistent.end()){ // Key not found --> allocate array
-                loc = cache_persistent.insert(std::make_pair(key, CachedArray<Array>(xt::zeros<double>(dims)))).first;
-            }
-            if(!((loc->second).status)){ // needs recomputing
-                impl((loc->second).data);
-                (loc->second).status = true;
-            }
-            return (loc->second).data;
+        template<class Impl>
+        Array& check_the_persistent_cache(SurfaceQuantity key, const vector<int>& dims, Impl&& impl){
+            return cache_persistent.get_or_create_and_fill(key, dims, impl);
         }
 
         std::unique_ptr<Eigen::FullPivHouseholderQR<Eigen::MatrixXd>> qr; //QR factorisation of dgamma_by_dcoeff, for least squares fitting.
@@ -87,10 +95,36 @@ class Surface {
         void extend_via_projected_normal(double scale);
 
         void invalidate_cache() {
+            cache.invalidate_cache();
+        }
 
-            for (auto it = cache.begin(); it != cache.end(); ++it) {
-                (it->second).status = false;
-            }
+        // Count the hits, recomputes and the time spent recomputing for each
+        // cached quantity. Off by default.
+        void enable_cache_stats(bool enabled) {
+            cache.enable_stats(enabled);
+            cache_persistent.enable_stats(enabled);
+        }
+
+        void reset_cache_stats() {
+            cache.reset_stats();
+            cache_persistent.reset_stats();
+        }
+
+        std::map<string, CacheStats> cache_stats() const {
+            std::map<string, CacheStats> res;
+            cache.add_stats(res);
+            cache_persistent.add_stats(res);
+            return res;
+        }
+
+        int get_cache_id() const { return cache_id; }
+
+        // The number of bytes held by the cache for each quantity.
+        std::map<string, size_t> cache_bytes() const {
+            std::map<string, size_t> res;
+            cache.add_bytes(res);
+            cache_persistent.add_bytes(res);
+            return res;
         }
 
         virtual void set_dofs(const vector<double>& _dofs) {
@@ -129,6 +163,34 @@ class Surface {
             return surface_vjp_contraction<Array>(dgammadash2_by_dcoeff(), v);
         };
 
+        // The Jacobian vector product of d^(dphi+dtheta) gamma / dphi^dphi
+        // dtheta^dtheta with respect to the dofs and w, i.e. the derivative
+        // of gamma, gammadash1, ..., gammadash2dash2 in the direction w. By
+        // default this uses the dense d*_by_dcoeff arrays, surfaces that are
+        // linear in their dofs override it to apply the Jacobian directly.
+        Array dgamma_by_dcoeff_jvp(Array& w, int dphi, int dtheta) {
+            if(dphi < 0 || dtheta < 0 || dphi + dtheta > 2)
+                throw std::invalid_argument("Only derivatives up to second order are supported.");
+            if((int)w.size() != num_dofs())
+                throw std::invalid_argument("w needs to have one entry per dof.");
+            return dgamma_by_dcoeff_jvp_impl(w, dphi, dtheta);
+        }
+
+        virtual Array dgamma_by_dcoeff_jvp_impl(Array& w, int dphi, int dtheta) {
+            if(dphi == 0 && dtheta == 0)
+                return surface_jvp_contraction<Array>(dgamma_by_dcoeff(), w);
+            else if(dphi == 1 && dtheta == 0)
+                return surface_jvp_contraction<Array>(dgammadash1_by_dcoeff(), w);
+            else if(dphi == 0 && dtheta == 1)
+                return surface_jvp_contraction<Array>(dgammadash2_by_dcoeff(), w);
+            else if(dphi == 2)
+                return surface_jvp_contraction<Array>(dgammadash1dash1_by_dcoeff(), w);
+            else if(dphi == 1)
+                return surface_jvp_contraction<Array>(dgammadash1dash2_by_dcoeff(), w);
+            else
+                return surface_jvp_contraction<Array>(dgammadash2dash2_by_dcoeff(), w);
+        }
+
         void surface_curvatures_impl(Array& data);
         void dsurface_curvatures_by_dcoeff_impl(Array& data);
         void first_fund_form_impl(Array& data);
@@ -146,91 +208,93 @@ class Surface {
         double area();
         void darea_by_dcoeff_impl(Array& data);
         void d2area_by_dcoeffdcoeff_impl(Array& data);
+        Array d2area_by_dcoeffdcoeff_hvp(Array& w);
 
         double volume();
         void dvolume_by_dcoeff_impl(Array& data);
         void d2volume_by_dcoeffdcoeff_impl(Array& data);
+        Array d2volume_by_dcoeffdcoeff_hvp(Array& w);
 
         Array& gamma() {
-            return check_the_cache("gamma", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gamma_impl(A, this->quadpoints_phi, this->quadpoints_theta);});
+            return check_the_cache(SURFACE_gamma, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gamma_impl(A, this->quadpoints_phi, this->quadpoints_theta);});
         }
         Array& gammadash1() {
-            return check_the_cache("gammadash1", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash1_impl(A);});
+            return check_the_cache(SURFACE_gammadash1, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash1_impl(A);});
         }
         Array& gammadash2() {
-            return check_the_cache("gammadash2", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash2_impl(A);});
+            return check_the_cache(SURFACE_gammadash2, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash2_impl(A);});
         }
         Array& gammadash1dash1() {
-            return check_the_cache("gammadash1dash1", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash1dash1_impl(A);});
+            return check_the_cache(SURFACE_gammadash1dash1, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash1dash1_impl(A);});
         }
         Array& gammadash1dash2() {
-            return check_the_cache("gammadash1dash2", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash1dash2_impl(A);});
+            return check_the_cache(SURFACE_gammadash1dash2, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash1dash2_impl(A);});
         }
         Array& gammadash2dash2() {
-            return check_the_cache("gammadash2dash2", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash2dash2_impl(A);});
+            return check_the_cache(SURFACE_gammadash2dash2, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return gammadash2dash2_impl(A);});
         }
         Array& dgammadash1dash1_by_dcoeff() {
-            return check_the_cache("dgammadash1dash1_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash1dash1_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_dgammadash1dash1_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash1dash1_by_dcoeff_impl(A);});
         }
         Array& dgammadash1dash2_by_dcoeff() {
-            return check_the_cache("dgammadash1dash2_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash1dash2_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_dgammadash1dash2_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash1dash2_by_dcoeff_impl(A);});
         }
         Array& dgammadash2dash2_by_dcoeff() {
-            return check_the_cache("dgammadash2dash2_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash2dash2_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_dgammadash2dash2_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash2dash2_by_dcoeff_impl(A);});
         }
         Array& surface_curvatures() {
-            return check_the_cache("surface_curvatures", {numquadpoints_phi, numquadpoints_theta,4}, [this](Array& A) { return surface_curvatures_impl(A);});
+            return check_the_cache(SURFACE_surface_curvatures, {numquadpoints_phi, numquadpoints_theta,4}, [this](Array& A) { return surface_curvatures_impl(A);});
         }
         Array& dsurface_curvatures_by_dcoeff() {
-            return check_the_cache("dsurface_curvatures_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,4,num_dofs()}, [this](Array& A) { return dsurface_curvatures_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_dsurface_curvatures_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,4,num_dofs()}, [this](Array& A) { return dsurface_curvatures_by_dcoeff_impl(A);});
         }
         Array& first_fund_form() {
-            return check_the_cache("first_fund_form", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return first_fund_form_impl(A);});
+            return check_the_cache(SURFACE_first_fund_form, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return first_fund_form_impl(A);});
         }
         Array& dfirst_fund_form_by_dcoeff() {
-            return check_the_cache("dfirst_fund_form_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dfirst_fund_form_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_dfirst_fund_form_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dfirst_fund_form_by_dcoeff_impl(A);});
         }
         Array& second_fund_form() {
-            return check_the_cache("second_fund_form", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return second_fund_form_impl(A);});
+            return check_the_cache(SURFACE_second_fund_form, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return second_fund_form_impl(A);});
         }
         Array& dsecond_fund_form_by_dcoeff() {
-            return check_the_cache("dsecond_fund_form_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dsecond_fund_form_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_dsecond_fund_form_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dsecond_fund_form_by_dcoeff_impl(A);});
         }
         Array& dgamma_by_dcoeff() {
-            return check_the_persistent_cache("dgamma_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgamma_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(SURFACE_dgamma_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgamma_by_dcoeff_impl(A);});
         }
         Array& dgammadash1_by_dcoeff() {
-            return check_the_persistent_cache("dgammadash1_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash1_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(SURFACE_dgammadash1_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash1_by_dcoeff_impl(A);});
         }
         Array& dgammadash2_by_dcoeff() {
-            return check_the_persistent_cache("dgammadash2_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash2_by_dcoeff_impl(A);});
+            return check_the_persistent_cache(SURFACE_dgammadash2_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,3,num_dofs()}, [this](Array& A) { return dgammadash2_by_dcoeff_impl(A);});
         }
         Array& normal() {
-            return check_the_cache("normal", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return normal_impl(A);});
+            return check_the_cache(SURFACE_normal, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return normal_impl(A);});
         }
         Array& dnormal_by_dcoeff() {
-            return check_the_cache("dnormal_by_dcoeff", {numquadpoints_phi, numquadpoints_theta,3, num_dofs()}, [this](Array& A) { return dnormal_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_dnormal_by_dcoeff, {numquadpoints_phi, numquadpoints_theta,3, num_dofs()}, [this](Array& A) { return dnormal_by_dcoeff_impl(A);});
         }
         Array& d2normal_by_dcoeffdcoeff() {
-            return check_the_cache("d2normal_by_dcoeffdcoeff", {numquadpoints_phi, numquadpoints_theta,3, num_dofs(), num_dofs() }, [this](Array& A) { return d2normal_by_dcoeffdcoeff_impl(A);});
+            return check_the_cache(SURFACE_d2normal_by_dcoeffdcoeff, {numquadpoints_phi, numquadpoints_theta,3, num_dofs(), num_dofs() }, [this](Array& A) { return d2normal_by_dcoeffdcoeff_impl(A);});
         }
         Array& unitnormal() {
-            return check_the_cache("unitnormal", {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return unitnormal_impl(A);});
+            return check_the_cache(SURFACE_unitnormal, {numquadpoints_phi, numquadpoints_theta,3}, [this](Array& A) { return unitnormal_impl(A);});
         }
         Array& dunitnormal_by_dcoeff() {
-            return check_the_cache("dunitnormal_by_dcoeff", {numquadpoints_phi, numquadpoints_theta, 3, num_dofs()}, [this](Array& A) { return dunitnormal_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_dunitnormal_by_dcoeff, {numquadpoints_phi, numquadpoints_theta, 3, num_dofs()}, [this](Array& A) { return dunitnormal_by_dcoeff_impl(A);});
         }
         Array& darea_by_dcoeff() {
-            return check_the_cache("darea_by_dcoeff", {num_dofs()}, [this](Array& A) { return darea_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_darea_by_dcoeff, {num_dofs()}, [this](Array& A) { return darea_by_dcoeff_impl(A);});
         }
         Array& d2area_by_dcoeffdcoeff() {
-            return check_the_cache("d2area_by_dcoeffdcoeff", {num_dofs(), num_dofs()}, [this](Array& A) { return d2area_by_dcoeffdcoeff_impl(A);});
+            return check_the_cache(SURFACE_d2area_by_dcoeffdcoeff, {num_dofs(), num_dofs()}, [this](Array& A) { return d2area_by_dcoeffdcoeff_impl(A);});
         }
         Array& dvolume_by_dcoeff() {
-            return check_the_cache("dvolume_by_dcoeff", {num_dofs()}, [this](Array& A) { return dvolume_by_dcoeff_impl(A);});
+            return check_the_cache(SURFACE_dvolume_by_dcoeff, {num_dofs()}, [this](Array& A) { return dvolume_by_dcoeff_impl(A);});
         }
         Array& d2volume_by_dcoeffdcoeff() {
-            return check_the_cache("d2volume_by_dcoeffdcoeff", {num_dofs(), num_dofs()}, [this](Array& A) { return d2volume_by_dcoeffdcoeff_impl(A);});
+            return check_the_cache(SURFACE_d2volume_by_dcoeffdcoeff, {num_dofs(), num_dofs()}, [this](Array& A) { return d2volume_by_dcoeffdcoeff_impl(A);});
         }
 
 
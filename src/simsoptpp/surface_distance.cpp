@@ -0,0 +1,237 @@
+#include "surface_distance.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include "vec3dsimd.h"
+
+// largest number of triangles in a leaf of the hierarchy
+static constexpr int leaf_size = 4;
+
+static inline Vec3d load(const double* p) {
+    return Vec3d{p[0], p[1], p[2]};
+}
+
+SurfaceDistance::SurfaceDistance(const double* gamma, int nphi, int ntheta) {
+    if(nphi < 3 || ntheta < 3)
+        throw std::invalid_argument("The surface needs to be given on a grid of at least 3 x 3 points.");
+    points.assign(gamma, gamma + 3*nphi*ntheta);
+    auto vertex = [nphi, ntheta](int i, int j) {
+        return (i % nphi)*ntheta + (j % ntheta);
+    };
+    auto point = [this](int v) {
+        return load(&points[3*v]);
+    };
+
+    std::unordered_map<uint64_t, int> edge_ids;
+    auto edge = [&edge_ids](int a, int b) {
+        uint64_t key = (uint64_t(std::min(a, b)) << 32) | uint64_t(std::max(a, b));
+        auto it = edge_ids.emplace(key, int(edge_ids.size())).first;
+        return it->second;
+    };
+    for (int i = 0; i < nphi; ++i) {
+        for (int j = 0; j < ntheta; ++j) {
+            int a = vertex(i, j), b = vertex(i + 1, j), c = vertex(i + 1, j + 1), d = vertex(i, j + 1);
+            for (auto v : {std::array<int, 3>{a, b, c}, std::array<int, 3>{a, c, d}}) {
+                Triangle t;
+                t.vertices = v;
+                t.edges = {edge(v[0], v[1]), edge(v[1], v[2]), edge(v[2], v[0])};
+                triangles.push_back(t);
+            }
+        }
+    }
+
+    int ntriangles = triangles.size();
+    face_normals.assign(3*ntriangles, 0.);
+    edge_normals.assign(3*edge_ids.size(), 0.);
+    vertex_normals.assign(points.size(), 0.);
+    vector<double> centroids(3*ntriangles);
+    double volume = 0.;
+    for (int t = 0; t < ntriangles; ++t) {
+        auto& v = triangles[t].vertices;
+        Vec3d p[3] = {point(v[0]), point(v[1]), point(v[2])};
+        Vec3d n = cross(p[1] - p[0], p[2] - p[0]);
+        volume += inner(p[0], cross(p[1], p[2]));
+        double area = norm(n);
+        if(area > 0)
+            n /= area;
+        for (int d = 0; d < 3; ++d) {
+            face_normals[3*t + d] = n.coeff(d);
+            centroids[3*t + d] = (p[0].coeff(d) + p[1].coeff(d) + p[2].coeff(d))/3;
+        }
+        for (int k = 0; k < 3; ++k) {
+            for (int d = 0; d < 3; ++d)
+                edge_normals[3*triangles[t].edges[k] + d] += n.coeff(d);
+            Vec3d e1 = p[(k + 1) % 3] - p[k];
+            Vec3d e2 = p[(k + 2) % 3] - p[k];
+            double l = norm(e1)*norm(e2);
+            double angle = l > 0 ? std::acos(std::max(-1., std::min(1., inner(e1, e2)/l))) : 0.;
+            for (int d = 0; d < 3; ++d)
+                vertex_normals[3*v[k] + d] += angle*n.coeff(d);
+        }
+        // triangles of zero area, e.g. from a grid that repeats its first
+        // row, are covered by their neighbours
+        if(area > 0)
+            order.push_back(t);
+    }
+    if(order.empty())
+        throw std::invalid_argument("The surface has zero area.");
+    orientation = volume > 0 ? 1. : -1.;
+
+    nodes.reserve(2*order.size()/leaf_size + 2);
+    nodes.emplace_back();
+    build(0, 0, order.size(), centroids);
+}
+
+// Splits the triangles at the median of their centroids along the longest
+// side of the bounding box of the centroids.
+void SurfaceDistance::build(int node, int first, int count, const vector<double>& centroids) {
+    double lower[3], upper[3], clower[3], cupper[3];
+    for (int d = 0; d < 3; ++d) {
+        lower[d] = clower[d] = std::numeric_limits<double>::infinity();
+        upper[d] = cupper[d] = -std::numeric_limits<double>::infinity();
+    }
+    for (int k = first; k < first + count; ++k) {
+        int t = order[k];
+        for (int v : triangles[t].vertices) {
+            for (int d = 0; d < 3; ++d) {
+                lower[d] = std::min(lower[d], points[3*v + d]);
+                upper[d] = std::max(upper[d], points[3*v + d]);
+            }
+        }
+        for (int d = 0; d < 3; ++d) {
+            clower[d] = std::min(clower[d], centroids[3*t + d]);
+            cupper[d] = std::max(cupper[d], centroids[3*t + d]);
+        }
+    }
+    for (int d = 0; d < 3; ++d) {
+        nodes[node].lower[d] = lower[d];
+        nodes[node].upper[d] = upper[d];
+    }
+    if(count <= leaf_size) {
+        nodes[node].first = first;
+        nodes[node].count = count;
+        return;
+    }
+    int axis = 0;
+    for (int d = 1; d < 3; ++d)
+        if(cupper[d] - clower[d] > cupper[axis] - clower[axis])
+            axis = d;
+    int half = count/2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+            [&centroids, axis](int a, int b) { return centroids[3*a + axis] < centroids[3*b + axis]; });
+    int children = nodes.size();
+    nodes[node].first = children;
+    nodes[node].count = 0;
+    nodes.emplace_back();
+    nodes.emplace_back();
+    build(children, first, half, centroids);
+    build(children + 1, first + half, count - half, centroids);
+}
+
+// Closest point on a triangle (Ericson, Real-Time Collision Detection, 5.1.5),
+// which also tells whether it lies on a vertex, an edge or inside the face.
+double SurfaceDistance::closest(int t, const double* x, double* c, const double** normal) const {
+    const Triangle& tri = triangles[t];
+    Vec3d p = load(x);
+    Vec3d a = load(&points[3*tri.vertices[0]]);
+    Vec3d b = load(&points[3*tri.vertices[1]]);
+    Vec3d cc = load(&points[3*tri.vertices[2]]);
+    Vec3d ab = b - a, ac = cc - a;
+    Vec3d q;
+    Vec3d ap = p - a;
+    double d1 = inner(ab, ap), d2 = inner(ac, ap);
+    Vec3d bp = p - b;
+    double d3 = inner(ab, bp), d4 = inner(ac, bp);
+    Vec3d cp = p - cc;
+    double d5 = inner(ab, cp), d6 = inner(ac, cp);
+    double va = d3*d6 - d5*d4, vb = d5*d2 - d1*d6, vc = d1*d4 - d3*d2;
+    if(d1 <= 0 && d2 <= 0) {
+        q = a;
+        *normal = &vertex_normals[3*tri.vertices[0]];
+    } else if(d3 >= 0 && d4 <= d3) {
+        q = b;
+        *normal = &vertex_normals[3*tri.vertices[1]];
+    } else if(vc <= 0 && d1 >= 0 && d3 <= 0) {
+        q = a + (d1/(d1 - d3))*ab;
+        *normal = &edge_normals[3*tri.edges[0]];
+    } else if(d6 >= 0 && d5 <= d6) {
+        q = cc;
+        *normal = &vertex_normals[3*tri.vertices[2]];
+    } else if(vb <= 0 && d2 >= 0 && d6 <= 0) {
+        q = a + (d2/(d2 - d6))*ac;
+        *normal = &edge_normals[3*tri.edges[2]];
+    } else if(va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+        q = b + ((d4 - d3)/((d4 - d3) + (d5 - d6)))*(cc - b);
+        *normal = &edge_normals[3*tri.edges[1]];
+    } else {
+        double denom = 1./(va + vb + vc);
+        q = a + (vb*denom)*ab + (vc*denom)*ac;
+        *normal = &face_normals[3*t];
+    }
+    for (int d = 0; d < 3; ++d)
+        c[d] = q.coeff(d);
+    Vec3d diff = p - q;
+    return inner(diff, diff);
+}
+
+static inline double box_distance_squared(const double* lower, const double* upper, const double* x) {
+    double res = 0.;
+    for (int d = 0; d < 3; ++d) {
+        double e = std::max(0., std::max(lower[d] - x[d], x[d] - upper[d]));
+        res += e*e;
+    }
+    return res;
+}
+
+double SurfaceDistance::signed_distance(const double* x) const {
+    double best = std::numeric_limits<double>::infinity();
+    double cbest[3] = {x[0], x[1], x[2]};
+    const double* nbest = nullptr;
+    double c[3];
+    const double* n;
+    // nodes to visit, the closer child is on top
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while(top > 0) {
+        const Node& node = nodes[stack[--top]];
+        if(box_distance_squared(node.lower, node.upper, x) >= best)
+            continue;
+        if(node.count > 0) {
+            for (int k = node.first; k < node.first + node.count; ++k) {
+                double d2 = closest(order[k], x, c, &n);
+                if(d2 < best) {
+                    best = d2;
+                    std::copy(c, c + 3, cbest);
+                    nbest = n;
+                }
+            }
+        } else {
+            int near = node.first, far = node.first + 1;
+            double dnear = box_distance_squared(nodes[near].lower, nodes[near].upper, x);
+            double dfar = box_distance_squared(nodes[far].lower, nodes[far].upper, x);
+            if(dfar < dnear) {
+                std::swap(near, far);
+                std::swap(dnear, dfar);
+            }
+            if(dfar < best)
+                stack[top++] = far;
+            if(dnear < best)
+                stack[top++] = near;
+        }
+    }
+    double side = 0.;
+    for (int d = 0; d < 3; ++d)
+        side += (x[d] - cbest[d])*nbest[d];
+    double dist = std::sqrt(best);
+    return side*orientation > 0 ? -dist : dist;
+}
+
+void SurfaceDistance::signed_distance(const double* xyz, int n, double* res) const {
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < n; ++i)
+        res[i] = signed_distance(xyz + 3*i);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <vector>
+using std::vector;
+
+// Signed distance to a closed toroidal surface that is given by its points on
+// a periodic (nphi, ntheta) grid of the full torus, e.g. Surface.gamma() with
+// range "full torus". Each cell of the grid is split into two triangles, and
+// the closest point on this triangle mesh is found with a bounding volume
+// hierarchy of the triangles, so a query only visits a few leaves instead of
+// all quadrature points.
+//
+// The sign is taken from the angle weighted pseudo normal of the face, edge or
+// vertex that contains the closest point (Baerentzen and Aanaes, IEEE TVCG 11,
+// 2005), which is correct for any point of a closed mesh, in contrast to the
+// normal of the closest quadrature point. The distance is positive inside the
+// surface, independently of the orientation of the grid.
+//
+// The queries only read the mesh and are thread safe.
+class SurfaceDistance {
+    public:
+        // gamma is a row-major (nphi, ntheta, 3) array
+        SurfaceDistance(const double* gamma, int nphi, int ntheta);
+
+        int size() const { return triangles.size(); }
+
+        double signed_distance(const double* x) const;
+        // signed distances of the n points of the row-major (n, 3) array xyz,
+        // computed in parallel
+        void signed_distance(const double* xyz, int n, double* res) const;
+
+    private:
+        struct Triangle {
+            // the vertices, and the edges opposite to vertex 2, 0 and 1,
+            // i.e. the edges (0, 1), (1, 2) and (2, 0)
+            std::array<int, 3> vertices;
+            std::array<int, 3> edges;
+        };
+        // A node of the hierarchy is either a leaf with the triangles
+        // order[first], ..., order[first + count - 1], or, for count == 0,
+        // has the children first and first + 1.
+        struct Node {
+            double lower[3], upper[3];
+            int first, count;
+        };
+
+        vector<double> points;
+        vector<Triangle> triangles;
+        // pseudo normals of the faces, edges and vertices, in the same
+        // orientation as the faces
+        vector<double> face_normals, edge_normals, vertex_normals;
+        // +1 if the faces are oriented outwards, -1 otherwise
+        double orientation;
+        vector<Node> nodes;
+        vector<int> order;
+
+        void build(int node, int first, int count, const vector<double>& centroids);
+        // closest point c on triangle t to x and the pseudo normal at c
+        double closest(int t, const double* x, double* c, const double** normal) const;
+};
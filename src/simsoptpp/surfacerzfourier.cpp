@@ -1,5 +1,6 @@
 #include "surfacerzfourier.h"
 #include "simdhelpers.h"
+#include "scratch.h"
 
 // Optimization notes:
 // We use two "tricks" in this part of the code to speed up some of the functions.
@@ -16,12 +17,199 @@
 //    In our code we loop over n. So we start with n=-ntor, and then we always
 //    just increase the angle by -nfp*phi.
 
+// 3) For large mpol and ntor on uniform quadrature points, the Fourier series
+//    are evaluated using FFTs instead, first in phi for every m and then in
+//    theta for every phi, see rz_series below. The same is used with direct
+//    sums on other quadrature points for the Jacobian vector products.
+
 #define ANGLE_RECOMPUTE 5
 
+template<class Array>
+bool SurfaceRZFourier<Array>::use_fft(const Array& quadpoints_phi, const Array& quadpoints_theta, UniformGrid& grid_phi, UniformGrid& grid_theta) {
+    if(!fft_wanted(std::max(mpol, ntor)))
+        return false;
+    grid_phi = uniform_grid(quadpoints_phi, nfp);
+    grid_theta = uniform_grid(quadpoints_theta, 1);
+    return grid_phi.uniform && grid_theta.uniform;
+}
+
+// The derivatives d^dphi/d(nfp*phi)^dphi d^dtheta/dtheta^dtheta of r and z,
+// stored as res[(l*numquadpoints_phi + k1)*numquadpoints_theta + k2] with
+// l = 0 for r and l = 1 for z.
+template<class Array>
+template<class SeriesPhi, class SeriesTheta>
+vector<double> SurfaceRZFourier<Array>::rz_series(const SeriesPhi& series_phi, const SeriesTheta& series_theta, int dphi, int dtheta, const Array* coeffs) {
+    int nphi = series_phi.size();
+    int ntheta = series_theta.size();
+    // Since cos(m*theta-n*nfp*phi) = cos(m*theta)cos(n*nfp*phi) + sin(m*theta)sin(n*nfp*phi)
+    // and sin(m*theta-n*nfp*phi) = sin(m*theta)cos(n*nfp*phi) - cos(m*theta)sin(n*nfp*phi),
+    // we can write r = \sum_m cos(m*theta) A_m + sin(m*theta) B_m, where A_m
+    // and B_m are real Fourier series in nfp*phi, and the same for z.
+    int nseries = 4*(mpol+1);
+    vector<double> a(nseries*(ntor+1), 0.), b(nseries*(ntor+1), 0.);
+    for (int l = 0; l < 2; ++l) {
+        const Array& c = coeffs[2*l];
+        const Array& s = coeffs[2*l+1];
+        for (int m = 0; m <= mpol; ++m) {
+            int A = 2*(l*(mpol+1) + m)*(ntor+1);
+            int B = A + ntor + 1;
+            a[A] = c(m, ntor);
+            a[B] = s(m, ntor);
+            for (int j = 1; j <= ntor; ++j) {
+                a[A+j] = c(m, ntor+j) + c(m, ntor-j);
+                b[A+j] = -(s(m, ntor+j) - s(m, ntor-j));
+                a[B+j] = s(m, ntor+j) + s(m, ntor-j);
+                b[B+j] = c(m, ntor+j) - c(m, ntor-j);
+            }
+        }
+    }
+    vector<double> g(nseries*nphi);
+    series_phi.synthesize(nseries, a.data(), b.data(), dphi, g.data());
+    // for every phi, r and z are Fourier series in theta with coefficients A_m and B_m
+    vector<double> a2(2*nphi*(mpol+1)), b2(2*nphi*(mpol+1));
+    for (int l = 0; l < 2; ++l) {
+        for (int k1 = 0; k1 < nphi; ++k1) {
+            for (int m = 0; m <= mpol; ++m) {
+                a2[(l*nphi + k1)*(mpol+1) + m] = g[(2*(l*(mpol+1) + m))*nphi + k1];
+                b2[(l*nphi + k1)*(mpol+1) + m] = g[(2*(l*(mpol+1) + m) + 1)*nphi + k1];
+            }
+        }
+    }
+    vector<double> res(2*nphi*ntheta);
+    series_theta.synthesize(2*nphi, a2.data(), b2.data(), dtheta, res.data());
+    return res;
+}
+
+template<class Array>
+template<class SeriesPhi, class SeriesTheta>
+void SurfaceRZFourier<Array>::gamma_series(Array& data, Array& quadpoints_phi, const SeriesPhi& series_phi, const SeriesTheta& series_theta, int dphi, int dtheta, const Array* coeffs) {
+    int nphi = series_phi.size();
+    int ntheta = series_theta.size();
+    // x = r cos(phi), so by the product rule we need all derivatives of r in
+    // phi up to dphi, see the curves.
+    vector<vector<double>> rz(dphi+1);
+    for (int q = 0; q <= dphi; ++q)
+        rz[q] = rz_series(series_phi, series_theta, q, dtheta, coeffs);
+    double scale = std::pow(2*M_PI, dphi + dtheta);
+#pragma omp parallel for
+    for (int k1 = 0; k1 < nphi; ++k1) {
+        double phi = 2*M_PI*quadpoints_phi[k1];
+        for (int k2 = 0; k2 < ntheta; ++k2) {
+            double x = 0, y = 0;
+            for (int q = 0; q <= dphi; ++q) {
+                double c = binomial(dphi, q) * std::pow(nfp, q) * rz[q][k1*ntheta + k2];
+                x += c * cos(phi + (dphi-q)*M_PI/2);
+                y += c * sin(phi + (dphi-q)*M_PI/2);
+            }
+            data(k1, k2, 0) = scale * x;
+            data(k1, k2, 1) = scale * y;
+            data(k1, k2, 2) = scale * std::pow(nfp, dphi) * rz[dphi][(nphi + k1)*ntheta + k2];
+        }
+    }
+}
+
+template<class Array>
+void SurfaceRZFourier<Array>::gamma_fft(Array& data, Array& quadpoints_phi, const UniformGrid& grid_phi, const UniformGrid& grid_theta, int dphi, int dtheta) {
+    Array coeffs[4] = {rc, rs, zc, zs};
+    gamma_series(data, quadpoints_phi, UniformFourierSeries(grid_phi, ntor), UniformFourierSeries(grid_theta, mpol), dphi, dtheta, coeffs);
+}
+
+template<class Array>
+Array SurfaceRZFourier<Array>::dgamma_by_dcoeff_jvp_impl(Array& w, int dphi, int dtheta) {
+    // the coefficients rc, rs, zc and zs for the dofs w, see set_dofs_impl
+    Array coeffs[4];
+    for (int l = 0; l < 4; ++l)
+        coeffs[l] = xt::zeros<double>({mpol+1, 2*ntor+1});
+    int shift = (mpol+1)*(2*ntor+1);
+    int counter = 0;
+    for (int l = 0; l < 4; ++l) {
+        if(stellsym && (l == 1 || l == 2))
+            continue;
+        for (int i = l % 2 == 0 ? ntor : ntor+1; i < shift; ++i)
+            coeffs[l].data()[i] = w[counter++];
+    }
+    Array data = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta, 3});
+    bool fft = fft_wanted(std::max(mpol, ntor));
+    with_fourier_series(quadpoints_phi, nfp, ntor, fft, [&](const auto& series_phi) {
+        with_fourier_series(quadpoints_theta, 1, mpol, fft, [&](const auto& series_theta) {
+            gamma_series(data, quadpoints_phi, series_phi, series_theta, dphi, dtheta, coeffs);
+        });
+    });
+    return data;
+}
+
+template<class Array>
+Array SurfaceRZFourier<Array>::gamma_fft_vjp(Array& v, const UniformGrid& grid_phi, const UniformGrid& grid_theta, int dphi, int dtheta) {
+    int nphi = grid_phi.N;
+    int ntheta = grid_theta.N;
+    UniformFourierSeries series_phi(grid_phi, ntor);
+    UniformFourierSeries series_theta(grid_theta, mpol);
+    int nseries = 4*(mpol+1);
+    vector<double> w(2*nphi*ntheta), C(2*nphi*(mpol+1)), S(2*nphi*(mpol+1));
+    vector<double> cs(nseries*nphi), A(nseries*(ntor+1)), B(nseries*(ntor+1));
+    // the gradients with respect to rc, rs, zc and zs
+    int size = (mpol+1)*(2*ntor+1);
+    vector<double> grad(4*size, 0.);
+    double scale = std::pow(2*M_PI, dphi + dtheta);
+    for (int q = 0; q <= dphi; ++q) {
+        // the adjoint of the transforms in rz_series, in reverse order
+        for (int k1 = 0; k1 < nphi; ++k1) {
+            double phi = 2*M_PI*quadpoints_phi[k1];
+            double cosphi = cos(phi + (dphi-q)*M_PI/2);
+            double sinphi = sin(phi + (dphi-q)*M_PI/2);
+            for (int k2 = 0; k2 < ntheta; ++k2) {
+                w[k1*ntheta + k2] = v(k1, k2, 0) * cosphi + v(k1, k2, 1) * sinphi;
+                w[(nphi + k1)*ntheta + k2] = q == dphi ? v(k1, k2, 2) : 0.;
+            }
+        }
+        series_theta.analyze(2*nphi, w.data(), dtheta, C.data(), S.data());
+        for (int l = 0; l < 2; ++l) {
+            for (int k1 = 0; k1 < nphi; ++k1) {
+                for (int m = 0; m <= mpol; ++m) {
+                    cs[(2*(l*(mpol+1) + m))*nphi + k1] = C[(l*nphi + k1)*(mpol+1) + m];
+                    cs[(2*(l*(mpol+1) + m) + 1)*nphi + k1] = S[(l*nphi + k1)*(mpol+1) + m];
+                }
+            }
+        }
+        series_phi.analyze(nseries, cs.data(), q, A.data(), B.data());
+        double c = scale * binomial(dphi, q) * std::pow(nfp, q);
+        for (int l = 0; l < 2; ++l) {
+            for (int m = 0; m <= mpol; ++m) {
+                // sums against cos(m*theta) and sin(m*theta), and then against cos(j*nfp*phi) and sin(j*nfp*phi)
+                int Cm = 2*(l*(mpol+1) + m)*(ntor+1);
+                int Sm = Cm + ntor + 1;
+                for (int n = -ntor; n <= ntor; ++n) {
+                    int j = std::abs(n);
+                    int sign = (n > 0) - (n < 0);
+                    grad[(2*l)*size + m*(2*ntor+1) + n + ntor] += c * (A[Cm+j] + sign * B[Sm+j]);
+                    grad[(2*l+1)*size + m*(2*ntor+1) + n + ntor] += c * (A[Sm+j] - sign * B[Cm+j]);
+                }
+            }
+        }
+    }
+    // same order as get_dofs
+    Array res = xt::zeros<double>({num_dofs()});
+    int counter = 0;
+    for (int i = ntor; i < size; ++i)
+        res[counter++] = grad[i];
+    if(!stellsym) {
+        for (int i = ntor+1; i < size; ++i)
+            res[counter++] = grad[size + i];
+        for (int i = ntor; i < size; ++i)
+            res[counter++] = grad[2*size + i];
+    }
+    for (int i = ntor+1; i < size; ++i)
+        res[counter++] = grad[3*size + i];
+    return res;
+}
+
 #if defined(USE_XSIMD)
 
 template<class Array>
 void SurfaceRZFourier<Array>::gamma_impl(Array& data, Array& quadpoints_phi, Array& quadpoints_theta) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 0, 0);
     int numquadpoints_phi = quadpoints_phi.size();
     int numquadpoints_theta = quadpoints_theta.size();
     constexpr int simd_size = xsimd::simd_type<double>::size;
@@ -78,6 +266,9 @@ void SurfaceRZFourier<Array>::gamma_impl(Array& data, Array& quadpoints_phi, Arr
 
 template<class Array>
 void SurfaceRZFourier<Array>::gamma_impl(Array& data, Array& quadpoints_phi, Array& quadpoints_theta) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 0, 0);
     int numquadpoints_phi = quadpoints_phi.size();
     int numquadpoints_theta = quadpoints_theta.size();
     constexpr int simd_size = 1;
@@ -156,6 +347,9 @@ void SurfaceRZFourier<Array>::gamma_lin(Array& data, Array& quadpoints_phi, Arra
 
 template<class Array>
 void SurfaceRZFourier<Array>::gammadash1_impl(Array& data) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 1, 0);
     constexpr int simd_size = xsimd::simd_type<double>::size;
 #pragma omp parallel for
     for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
@@ -214,6 +408,9 @@ void SurfaceRZFourier<Array>::gammadash1_impl(Array& data) {
 
 template<class Array>
 void SurfaceRZFourier<Array>::gammadash1_impl(Array& data) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 1, 0);
     constexpr int simd_size = 1;
     #pragma omp parallel for
     for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
@@ -265,6 +462,9 @@ void SurfaceRZFourier<Array>::gammadash1_impl(Array& data) {
 
 template<class Array>
 void SurfaceRZFourier<Array>::gammadash1dash1_impl(Array& data) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 2, 0);
     for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
         double phi  = 2*M_PI*quadpoints_phi[k1];
         for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
@@ -297,6 +497,9 @@ void SurfaceRZFourier<Array>::gammadash1dash1_impl(Array& data) {
 
 template<class Array>
 void SurfaceRZFourier<Array>::gammadash1dash2_impl(Array& data) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 1, 1);
     for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
         double phi  = 2*M_PI*quadpoints_phi[k1];
         for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
@@ -326,6 +529,9 @@ void SurfaceRZFourier<Array>::gammadash1dash2_impl(Array& data) {
 
 template<class Array>
 void SurfaceRZFourier<Array>::gammadash2dash2_impl(Array& data) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 0, 2);
     for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
         double phi  = 2*M_PI*quadpoints_phi[k1];
         for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
@@ -360,6 +566,9 @@ void SurfaceRZFourier<Array>::gammadash2dash2_impl(Array& data) {
 
 template<class Array>
 void SurfaceRZFourier<Array>::gammadash2_impl(Array& data) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 0, 1);
     constexpr int simd_size = xsimd::simd_type<double>::size;
 #pragma omp parallel for
     for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
@@ -415,6 +624,9 @@ void SurfaceRZFourier<Array>::gammadash2_impl(Array& data) {
 
 template<class Array>
 void SurfaceRZFourier<Array>::gammadash2_impl(Array& data) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 0, 1);
     constexpr int simd_size = 1;
     #pragma omp parallel for
     for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
@@ -464,12 +676,15 @@ void SurfaceRZFourier<Array>::gammadash2_impl(Array& data) {
 #if defined(USE_XSIMD)
 template<class Array>
 Array SurfaceRZFourier<Array>::dgamma_by_dcoeff_vjp(Array& v) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft_vjp(v, grid_phi, grid_theta, 0, 0);
     Array res = xt::zeros<double>({num_dofs()});
     constexpr int simd_size = xsimd::simd_type<double>::size;
     auto resptr = &(res(0));
 #pragma omp parallel
     {
-        double* resptr_private = new double[num_dofs()];
+        ScratchBuffer<double> resptr_private(num_dofs());
         for (int i = 0; i < num_dofs(); ++i) {
             resptr_private[i] = 0.;
         }
@@ -545,12 +760,15 @@ Array SurfaceRZFourier<Array>::dgamma_by_dcoeff_vjp(Array& v) {
 #else
 template<class Array>
 Array SurfaceRZFourier<Array>::dgamma_by_dcoeff_vjp(Array& v) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft_vjp(v, grid_phi, grid_theta, 0, 0);
     Array res = xt::zeros<double>({num_dofs()});
     constexpr int simd_size = 1;
     auto resptr = &(res(0));
     #pragma omp parallel
     {
-        double* resptr_private = new double[num_dofs()];
+        ScratchBuffer<double> resptr_private(num_dofs());
         for (int i = 0; i < num_dofs(); ++i) {
             resptr_private[i] = 0.;
         }
@@ -672,12 +890,15 @@ void SurfaceRZFourier<Array>::dgamma_by_dcoeff_impl(Array& data) {
 
 template<class Array>
 Array SurfaceRZFourier<Array>::dgammadash1_by_dcoeff_vjp(Array& v) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft_vjp(v, grid_phi, grid_theta, 1, 0);
     Array res = xt::zeros<double>({num_dofs()});
     constexpr int simd_size = xsimd::simd_type<double>::size;
     auto resptr = &(res(0));
 #pragma omp parallel
     {
-        double* resptr_private = new double[num_dofs()];
+        ScratchBuffer<double> resptr_private(num_dofs());
         for (int i = 0; i < num_dofs(); ++i) {
             resptr_private[i] = 0.;
         }
@@ -756,12 +977,15 @@ Array SurfaceRZFourier<Array>::dgammadash1_by_dcoeff_vjp(Array& v) {
 
 template<class Array>
 Array SurfaceRZFourier<Array>::dgammadash1_by_dcoeff_vjp(Array& v) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft_vjp(v, grid_phi, grid_theta, 1, 0);
     Array res = xt::zeros<double>({num_dofs()});
     constexpr int simd_size = 1;
     auto resptr = &(res(0));
     #pragma omp parallel
     {
-        double* resptr_private = new double[num_dofs()];
+        ScratchBuffer<double> resptr_private(num_dofs());
         for (int i = 0; i < num_dofs(); ++i) {
             resptr_private[i] = 0.;
         }
@@ -996,12 +1220,15 @@ void SurfaceRZFourier<Array>::dgammadash1dash1_by_dcoeff_impl(Array& data) {
 
 template<class Array>
 Array SurfaceRZFourier<Array>::dgammadash2_by_dcoeff_vjp(Array& v) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft_vjp(v, grid_phi, grid_theta, 0, 1);
     Array res = xt::zeros<double>({num_dofs()});
     constexpr int simd_size = xsimd::simd_type<double>::size;
     auto resptr = &(res(0));
 #pragma omp parallel
     {
-        double* resptr_private = new double[num_dofs()];
+        ScratchBuffer<double> resptr_private(num_dofs());
         for (int i = 0; i < num_dofs(); ++i) {
             resptr_private[i] = 0.;
         }
@@ -1080,12 +1307,15 @@ Array SurfaceRZFourier<Array>::dgammadash2_by_dcoeff_vjp(Array& v) {
 
 template<class Array>
 Array SurfaceRZFourier<Array>::dgammadash2_by_dcoeff_vjp(Array& v) {
+    UniformGrid grid_phi, grid_theta;
+    if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+        return gamma_fft_vjp(v, grid_phi, grid_theta, 0, 1);
     Array res = xt::zeros<double>({num_dofs()});
     constexpr int simd_size = 1;
     auto resptr = &(res(0));
     #pragma omp parallel
     {
-        double* resptr_private = new double[num_dofs()];
+        ScratchBuffer<double> resptr_private(num_dofs());
         for (int i = 0; i < num_dofs(); ++i) {
             resptr_private[i] = 0.;
         }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "surface.h"
+#include "uniformfourier.h"
 
 template<class Array>
 class SurfaceRZFourier : public Surface<Array> {
@@ -117,4 +118,19 @@ class SurfaceRZFourier : public Surface<Array> {
         Array dgamma_by_dcoeff_vjp(Array& v) override;
         Array dgammadash1_by_dcoeff_vjp(Array& v) override;
         Array dgammadash2_by_dcoeff_vjp(Array& v) override;
+
+        Array dgamma_by_dcoeff_jvp_impl(Array& w, int dphi, int dtheta) override;
+
+    private:
+        // Evaluation of the derivatives of gamma for the coefficients
+        // coeffs = {rc, rs, zc, zs} using one of the series in
+        // uniformfourier.h in each angle, and of the vector Jacobian products
+        // on uniform quadrature points using FFTs.
+        bool use_fft(const Array& quadpoints_phi, const Array& quadpoints_theta, UniformGrid& grid_phi, UniformGrid& grid_theta);
+        template<class SeriesPhi, class SeriesTheta>
+        vector<double> rz_series(const SeriesPhi& series_phi, const SeriesTheta& series_theta, int dphi, int dtheta, const Array* coeffs);
+        template<class SeriesPhi, class SeriesTheta>
+        void gamma_series(Array& data, Array& quadpoints_phi, const SeriesPhi& series_phi, const SeriesTheta& series_theta, int dphi, int dtheta, const Array* coeffs);
+        void gamma_fft(Array& data, Array& quadpoints_phi, const UniformGrid& grid_phi, const UniformGrid& grid_theta, int dphi, int dtheta);
+        Array gamma_fft_vjp(Array& v, const UniformGrid& grid_phi, const UniformGrid& grid_theta, int dphi, int dtheta);
 };
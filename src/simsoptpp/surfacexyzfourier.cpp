@@ -1,34 +1,195 @@
 #include "surfacexyzfourier.h"
+#include "uniformfourier.h"
+
+// The Fourier series in m*theta - n*nfp*phi are split using
+//      cos(m*theta - n*nfp*phi) = cos(m*theta) cos(n*nfp*phi) + sin(m*theta) sin(n*nfp*phi)
+//      sin(m*theta - n*nfp*phi) = sin(m*theta) cos(n*nfp*phi) - cos(m*theta) sin(n*nfp*phi).
+// For every phi, the sums over n are computed once, so that xhat, yhat and z
+// are Fourier series in theta, which are evaluated at several quadrature
+// points at once using SIMD instructions. cos(m*theta) and sin(m*theta) (and
+// the same in n*nfp*phi) are obtained from the recurrence in harmonics.h, so
+// that no trigonometric function is evaluated per mode.
+
+// The coefficients (c', s') with c cos^{(d)}(a) + s sin^{(d)}(a) = c' cos(a) + s' sin(a).
+static inline void rotate_derivative(int d, double c, double s, double& cr, double& sr) {
+    switch(d % 4) {
+        case 0: cr = c; sr = s; break;
+        case 1: cr = s; sr = -c; break;
+        case 2: cr = -c; sr = -s; break;
+        default: cr = -s; sr = c; break;
+    }
+}
+
+// cos(n*angle) and sin(n*angle) for n = -ntor, ..., ntor at index n + ntor.
+static inline void fill_signed_harmonics(double angle, int ntor, double* cosines, double* sines) {
+    Harmonics<double> h(angle);
+    for (int n = 0; n <= ntor; ++n, h.next()) {
+        cosines[ntor + n] = cosines[ntor - n] = h.cos();
+        sines[ntor + n] = h.sin();
+        sines[ntor - n] = -h.sin();
+    }
+}
 
 template<class Array>
-void SurfaceXYZFourier<Array>::gamma_impl(Array& data, Array& quadpoints_phi, Array& quadpoints_theta) {
-    int numquadpoints_phi = quadpoints_phi.size();
-    int numquadpoints_theta = quadpoints_theta.size();
-#pragma omp parallel for
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            double x = 0;
-            double y = 0;
-            double z = 0;
-            for (int m = 0; m <= mpol; ++m) {
-                for (int i = 0; i < 2*ntor+1; ++i) {
-                    int n  = i - ntor;
-                    double xhat = get_coeff(0, true, m, i) * cos(m*theta-n*nfp*phi) + get_coeff(0, false, m, i) * sin(m*theta-n*nfp*phi);
-                    double yhat = get_coeff(1, true, m, i) * cos(m*theta-n*nfp*phi) + get_coeff(1, false, m, i) * sin(m*theta-n*nfp*phi);
-                    x += xhat * cos(phi) - yhat * sin(phi);
-                    y += xhat * sin(phi) + yhat * cos(phi);
-                    z += get_coeff(2, true , m, i) * cos(m*theta-n*nfp*phi) + get_coeff(2, false, m, i) * sin(m*theta-n*nfp*phi);
+void SurfaceXYZFourier<Array>::gamma_direct(Array& data, const Array& quadpoints_phi, const Array& quadpoints_theta, int dphi, int dtheta, const Array* coeffs) {
+    int nphi = quadpoints_phi.size();
+    int ntheta = quadpoints_theta.size();
+    double scale = std::pow(2*M_PI, dphi + dtheta);
+#pragma omp parallel
+    {
+        // xhat, yhat and z and their first dphi derivatives in phi are
+        //      \sum_m A[(dim*(dphi+1) + p)*(mpol+1) + m] cos(m*theta) + B[...] sin(m*theta)
+        // for the current phi, already differentiated dtheta times in theta.
+        vector<double> A(3*(dphi+1)*(mpol+1)), B(3*(dphi+1)*(mpol+1));
+        vector<double> cosn(2*ntor+1), sinn(2*ntor+1);
+        double cosphi[3], sinphi[3];
+#pragma omp for
+        for (int k1 = 0; k1 < nphi; ++k1) {
+            double phi = 2*M_PI*quadpoints_phi[k1];
+            fill_signed_harmonics(nfp*phi, ntor, cosn.data(), sinn.data());
+            for (int r = 0; r <= dphi; ++r) {
+                cosphi[r] = cos(phi + r*M_PI/2);
+                sinphi[r] = sin(phi + r*M_PI/2);
+            }
+            for (int dim = 0; dim < 3; ++dim) {
+                const Array& c = coeffs[2*dim];
+                const Array& s = coeffs[2*dim+1];
+                for (int p = 0; p <= dphi; ++p) {
+                    for (int m = 0; m <= mpol; ++m) {
+                        double a = 0, b = 0;
+                        for (int i = 0; i < 2*ntor+1; ++i) {
+                            double cr, sr;
+                            rotate_derivative(p + dtheta, c(m, i), s(m, i), cr, sr);
+                            double w = std::pow(-(i - ntor)*nfp, p);
+                            a += w * (cr*cosn[i] - sr*sinn[i]);
+                            b += w * (cr*sinn[i] + sr*cosn[i]);
+                        }
+                        double mq = std::pow(m, dtheta);
+                        A[(dim*(dphi+1) + p)*(mpol+1) + m] = mq * a;
+                        B[(dim*(dphi+1) + p)*(mpol+1) + m] = mq * b;
+                    }
+                }
+            }
+            for (int k2 = 0; k2 < ntheta; k2 += harmonic_size) {
+                harmonic_t hat[3][3];
+                for (int dim = 0; dim < 3; ++dim)
+                    for (int p = 0; p <= dphi; ++p)
+                        hat[dim][p] = harmonic_t(0.);
+                Harmonics<harmonic_t> h(quadpoint_angles(quadpoints_theta, k2));
+                for (int m = 0; m <= mpol; ++m, h.next()) {
+                    for (int dim = 0; dim < 3; ++dim) {
+                        for (int p = 0; p <= dphi; ++p) {
+                            int idx = (dim*(dphi+1) + p)*(mpol+1) + m;
+                            hat[dim][p] += A[idx] * h.cos() + B[idx] * h.sin();
+                        }
+                    }
+                }
+                // product rule for x = xhat cos(phi) - yhat sin(phi) and y = xhat sin(phi) + yhat cos(phi)
+                harmonic_t x(0.), y(0.);
+                for (int p = 0; p <= dphi; ++p) {
+                    double bin = binomial(dphi, p);
+                    x += bin * (hat[0][p] * cosphi[dphi-p] - hat[1][p] * sinphi[dphi-p]);
+                    y += bin * (hat[0][p] * sinphi[dphi-p] + hat[1][p] * cosphi[dphi-p]);
+                }
+                for (int l = 0; l < harmonic_size && k2 + l < ntheta; ++l) {
+                    data(k1, k2+l, 0) = scale * harmonic_lane(x, l);
+                    data(k1, k2+l, 1) = scale * harmonic_lane(y, l);
+                    data(k1, k2+l, 2) = scale * harmonic_lane(hat[2][dphi], l);
                 }
             }
-            data(k1, k2, 0) = x;
-            data(k1, k2, 1) = y;
-            data(k1, k2, 2) = z;
         }
     }
 }
 
+template<class Array>
+void SurfaceXYZFourier<Array>::dgamma_by_dcoeff_direct(Array& data, int dphi, int dtheta) {
+    int ndofs = num_dofs();
+    int nmodes = (mpol+1)*(2*ntor+1);
+    double scale = std::pow(2*M_PI, dphi + dtheta);
+#pragma omp parallel
+    {
+        vector<double> cosn(2*ntor+1), sinn(2*ntor+1), cosm(mpol+1), sinm(mpol+1);
+        // the derivatives d^p/dphi^p d^dtheta/dtheta^dtheta of cos(m*theta - n*nfp*phi)
+        // and sin(m*theta - n*nfp*phi) at [p*nmodes + m*(2*ntor+1) + n + ntor]
+        vector<double> fc((dphi+1)*nmodes), fs((dphi+1)*nmodes);
+        double cosphi[3], sinphi[3];
+#pragma omp for
+        for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
+            double phi = 2*M_PI*quadpoints_phi[k1];
+            fill_signed_harmonics(nfp*phi, ntor, cosn.data(), sinn.data());
+            for (int r = 0; r <= dphi; ++r) {
+                cosphi[r] = cos(phi + r*M_PI/2);
+                sinphi[r] = sin(phi + r*M_PI/2);
+            }
+            for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
+                fill_harmonics(2*M_PI*quadpoints_theta[k2], mpol, cosm.data(), sinm.data());
+                for (int m = 0; m <= mpol; ++m) {
+                    double mq = std::pow(m, dtheta);
+                    for (int i = 0; i < 2*ntor+1; ++i) {
+                        double ca = cosm[m]*cosn[i] + sinm[m]*sinn[i];
+                        double sa = sinm[m]*cosn[i] - cosm[m]*sinn[i];
+                        for (int p = 0; p <= dphi; ++p) {
+                            double w = mq * std::pow(-(i - ntor)*nfp, p);
+                            double cc, cs, sc, ss;
+                            // cos^{(d)}(a) = c' cos(a) + s' sin(a), and the same for sin^{(d)}(a)
+                            rotate_derivative(p + dtheta, 1., 0., cc, cs);
+                            rotate_derivative(p + dtheta, 0., 1., sc, ss);
+                            fc[p*nmodes + m*(2*ntor+1) + i] = w * (cc*ca + cs*sa);
+                            fs[p*nmodes + m*(2*ntor+1) + i] = w * (sc*ca + ss*sa);
+                        }
+                    }
+                }
+                double* dx = &(data(k1, k2, 0, 0));
+                double* dy = &(data(k1, k2, 1, 0));
+                double* dz = &(data(k1, k2, 2, 0));
+                std::fill(dx, dx + ndofs, 0.);
+                std::fill(dy, dy + ndofs, 0.);
+                std::fill(dz, dz + ndofs, 0.);
+                int counter = 0;
+                for (int d = 0; d < 3; ++d) {
+                    for (int t = 0; t < 2; ++t) {
+                        // with stellarator symmetry only xc, ys and zs are dofs
+                        if(stellsym && ((d == 0) == (t == 1)))
+                            continue;
+                        const vector<double>& f = t == 0 ? fc : fs;
+                        for (int m = 0; m <= mpol; ++m) {
+                            for (int n = -ntor; n <= ntor; ++n) {
+                                if(m == 0 && (t == 0 ? n < 0 : n <= 0))
+                                    continue;
+                                int idx = m*(2*ntor+1) + n + ntor;
+                                if(d == 2) {
+                                    dz[counter] = scale * f[dphi*nmodes + idx];
+                                } else {
+                                    double x = 0, y = 0;
+                                    for (int p = 0; p <= dphi; ++p) {
+                                        double bf = binomial(dphi, p) * f[p*nmodes + idx];
+                                        if(d == 0) {
+                                            x += bf * cosphi[dphi-p];
+                                            y += bf * sinphi[dphi-p];
+                                        } else {
+                                            x -= bf * sinphi[dphi-p];
+                                            y += bf * cosphi[dphi-p];
+                                        }
+                                    }
+                                    dx[counter] = scale * x;
+                                    dy[counter] = scale * y;
+                                }
+                                counter++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+template<class Array>
+void SurfaceXYZFourier<Array>::gamma_impl(Array& data, Array& quadpoints_phi, Array& quadpoints_theta) {
+    Array coeffs[6] = {xc, xs, yc, ys, zc, zs};
+    gamma_direct(data, quadpoints_phi, quadpoints_theta, 0, 0, coeffs);
+}
+
 template<class Array>
 void SurfaceXYZFourier<Array>::gamma_lin(Array& data, Array& quadpoints_phi, Array& quadpoints_theta) {
     int numquadpoints = quadpoints_phi.size();
@@ -59,494 +220,81 @@ void SurfaceXYZFourier<Array>::gamma_lin(Array& data, Array& quadpoints_phi, Arr
 
 template<class Array>
 void SurfaceXYZFourier<Array>::gammadash1_impl(Array& data) {
-    data *= 0.;
-#pragma omp parallel for
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            double xdash = 0;
-            double ydash = 0;
-            double zdash = 0;
-            for (int m = 0; m <= mpol; ++m) {
-                for (int i = 0; i < 2*ntor+1; ++i) {
-                    int n  = i - ntor;
-                    double xhat = get_coeff(0, true, m, i) * cos(m*theta-n*nfp*phi) + get_coeff(0, false, m, i) * sin(m*theta-n*nfp*phi);
-                    double yhat = get_coeff(1, true, m, i) * cos(m*theta-n*nfp*phi) + get_coeff(1, false, m, i) * sin(m*theta-n*nfp*phi);
-                    double xhatdash = get_coeff(0, true, m, i) * (n*nfp)*sin(m*theta-n*nfp*phi) + get_coeff(0, false, m, i) * (-n*nfp)*cos(m*theta-n*nfp*phi);
-                    double yhatdash = get_coeff(1, true, m, i) * (n*nfp)*sin(m*theta-n*nfp*phi) + get_coeff(1, false, m, i) * (-n*nfp)*cos(m*theta-n*nfp*phi);
-                    xdash += xhatdash * cos(phi) - yhatdash * sin(phi) - xhat * sin(phi) - yhat * cos(phi);
-                    ydash += xhatdash * sin(phi) + yhatdash * cos(phi) + xhat * cos(phi) - yhat * sin(phi);
-                    zdash += get_coeff(2, true , m, i) * (n*nfp)*sin(m*theta-n*nfp*phi) + get_coeff(2, false, m, i) * (-n*nfp)*cos(m*theta-n*nfp*phi);
-                }
-            }
-            data(k1, k2, 0) = 2*M_PI*xdash;
-            data(k1, k2, 1) = 2*M_PI*ydash;
-            data(k1, k2, 2) = 2*M_PI*zdash;
-        }
-    }
+    Array coeffs[6] = {xc, xs, yc, ys, zc, zs};
+    gamma_direct(data, quadpoints_phi, quadpoints_theta, 1, 0, coeffs);
 }
 
 template<class Array>
 void SurfaceXYZFourier<Array>::gammadash2_impl(Array& data) {
-    data *= 0.;
-#pragma omp parallel for
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            double xdash = 0;
-            double ydash = 0;
-            double zdash = 0;
-            for (int m = 0; m <= mpol; ++m) {
-                for (int i = 0; i < 2*ntor+1; ++i) {
-                    int n  = i - ntor;
-                    double xhatdash = get_coeff(0, true, m, i) * (-m)* sin(m*theta-n*nfp*phi) + get_coeff(0, false, m, i) * m * cos(m*theta-n*nfp*phi);
-                    double yhatdash = get_coeff(1, true, m, i) * (-m)* sin(m*theta-n*nfp*phi) + get_coeff(1, false, m, i) * m * cos(m*theta-n*nfp*phi);
-                    xdash += xhatdash * cos(phi) - yhatdash * sin(phi);
-                    ydash += xhatdash * sin(phi) + yhatdash * cos(phi);
-                    zdash += get_coeff(2, true , m, i) * (-m) * sin(m*theta-n*nfp*phi) + get_coeff(2, false, m, i) * m * cos(m*theta-n*nfp*phi);
-                }
-            }
-            data(k1, k2, 0) = 2*M_PI*xdash;
-            data(k1, k2, 1) = 2*M_PI*ydash;
-            data(k1, k2, 2) = 2*M_PI*zdash;
-        }
-    }
+    Array coeffs[6] = {xc, xs, yc, ys, zc, zs};
+    gamma_direct(data, quadpoints_phi, quadpoints_theta, 0, 1, coeffs);
 }
 
 template<class Array>
 void SurfaceXYZFourier<Array>::gammadash1dash1_impl(Array& data) {
-    data *= 0.;
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            double xdd = 0;
-            double ydd = 0;
-            double zdd = 0;
-            for (int m = 0; m <= mpol; ++m) {
-                for (int i = 0; i < 2*ntor+1; ++i) {
-                    int n  = i - ntor;
-                    double xhat = get_coeff(0, true, m, i) * cos(m*theta-n*nfp*phi) + get_coeff(0, false, m, i) * sin(m*theta-n*nfp*phi);
-                    double yhat = get_coeff(1, true, m, i) * cos(m*theta-n*nfp*phi) + get_coeff(1, false, m, i) * sin(m*theta-n*nfp*phi);
-                    double xhatd = -get_coeff(0, true, m, i) * (-n*nfp)*sin(m*theta-n*nfp*phi) + get_coeff(0, false, m, i) * (-n*nfp)*cos(m*theta-n*nfp*phi);
-                    double yhatd = -get_coeff(1, true, m, i) * (-n*nfp)*sin(m*theta-n*nfp*phi) + get_coeff(1, false, m, i) * (-n*nfp)*cos(m*theta-n*nfp*phi);
-                    double xhatdd = -get_coeff(0, true, m, i) * (-n*nfp)*(-n*nfp)*cos(m*theta-n*nfp*phi) - get_coeff(0, false, m, i) * (-n*nfp) * (-n*nfp)*sin(m*theta-n*nfp*phi);
-                    double yhatdd = -get_coeff(1, true, m, i) * (-n*nfp)*(-n*nfp)*cos(m*theta-n*nfp*phi) - get_coeff(1, false, m, i) * (-n*nfp) * (-n*nfp)*sin(m*theta-n*nfp*phi);
-
-                    xdd += xhatdd * cos(phi) - 2*xhatd * sin(phi) - xhat * cos(phi)
-                         - yhatdd * sin(phi) - 2*yhatd * cos(phi) + yhat * sin(phi);
-                    ydd += xhatdd * sin(phi) + 2*xhatd * cos(phi) - xhat * sin(phi)
-                         + yhatdd * cos(phi) - 2*yhatd * sin(phi) - yhat * cos(phi);
-                    zdd += -get_coeff(2, true , m, i) * (-n*nfp) * (-n*nfp) * cos(m*theta-n*nfp*phi) - get_coeff(2, false, m, i) * (-n*nfp) * (-n*nfp) * sin(m*theta-n*nfp*phi);
-                }
-            }
-            data(k1, k2, 0) = 4*M_PI*M_PI*xdd;
-            data(k1, k2, 1) = 4*M_PI*M_PI*ydd;
-            data(k1, k2, 2) = 4*M_PI*M_PI*zdd;
-        }
-    }
+    Array coeffs[6] = {xc, xs, yc, ys, zc, zs};
+    gamma_direct(data, quadpoints_phi, quadpoints_theta, 2, 0, coeffs);
 }
 
 template<class Array>
 void SurfaceXYZFourier<Array>::gammadash1dash2_impl(Array& data) {
-    data *= 0.;
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            double xd1d2 = 0;
-            double yd1d2 = 0;
-            double zd1d2 = 0;
-            for (int m = 0; m <= mpol; ++m) {
-                for (int i = 0; i < 2*ntor+1; ++i) {
-                    int n  = i - ntor;
-                    double xhat = get_coeff(0, true, m, i) * cos(m*theta-n*nfp*phi) + get_coeff(0, false, m, i) * sin(m*theta-n*nfp*phi);
-                    double yhat = get_coeff(1, true, m, i) * cos(m*theta-n*nfp*phi) + get_coeff(1, false, m, i) * sin(m*theta-n*nfp*phi);
-                    double xhatd2 = -get_coeff(0, true, m, i) * (m)*sin(m*theta-n*nfp*phi) + get_coeff(0, false, m, i) * (m)*cos(m*theta-n*nfp*phi);
-                    double yhatd2 = -get_coeff(1, true, m, i) * (m)*sin(m*theta-n*nfp*phi) + get_coeff(1, false, m, i) * (m)*cos(m*theta-n*nfp*phi);
-                    double xhatd1d2 = -get_coeff(0, true, m, i) * (-n*nfp)*(m)*cos(m*theta-n*nfp*phi) - get_coeff(0, false, m, i) * (-n*nfp) * (m)*sin(m*theta-n*nfp*phi);
-                    double yhatd1d2 = -get_coeff(1, true, m, i) * (-n*nfp)*(m)*cos(m*theta-n*nfp*phi) - get_coeff(1, false, m, i) * (-n*nfp) * (m)*sin(m*theta-n*nfp*phi);
-
-                    xd1d2 += xhatd1d2 * cos(phi) - xhatd2 * sin(phi)
-                           - yhatd1d2 * sin(phi) - yhatd2 * cos(phi);
-                    yd1d2 += xhatd1d2 * sin(phi) + xhatd2 * cos(phi)
-                           + yhatd1d2 * cos(phi) - yhatd2 * sin(phi);
-                    zd1d2 += -get_coeff(2, true , m, i) * (-n*nfp) * (m) * cos(m*theta-n*nfp*phi) - get_coeff(2, false, m, i) * (-n*nfp) * (m) * sin(m*theta-n*nfp*phi);
-                }
-            }
-            data(k1, k2, 0) = 4*M_PI*M_PI*xd1d2;
-            data(k1, k2, 1) = 4*M_PI*M_PI*yd1d2;
-            data(k1, k2, 2) = 4*M_PI*M_PI*zd1d2;
-        }
-    }
+    Array coeffs[6] = {xc, xs, yc, ys, zc, zs};
+    gamma_direct(data, quadpoints_phi, quadpoints_theta, 1, 1, coeffs);
 }
 
 template<class Array>
 void SurfaceXYZFourier<Array>::gammadash2dash2_impl(Array& data) {
-    data *= 0.;
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            double xdd = 0;
-            double ydd = 0;
-            double zdd = 0;
-            for (int m = 0; m <= mpol; ++m) {
-                for (int i = 0; i < 2*ntor+1; ++i) {
-                    int n  = i - ntor;
-                    double xhatdd = -get_coeff(0, true, m, i) * (m) * (m) * cos(m*theta-n*nfp*phi) - get_coeff(0, false, m, i) * m * m * sin(m*theta-n*nfp*phi);
-                    double yhatdd = -get_coeff(1, true, m, i) * (m) * (m) * cos(m*theta-n*nfp*phi) - get_coeff(1, false, m, i) * m * m * sin(m*theta-n*nfp*phi);
-                    xdd += xhatdd * cos(phi) - yhatdd * sin(phi);
-                    ydd += xhatdd * sin(phi) + yhatdd * cos(phi);
-                    zdd += -get_coeff(2, true , m, i) * (m) * (m) * cos(m*theta-n*nfp*phi) - get_coeff(2, false, m, i) * m * m * sin(m*theta-n*nfp*phi);
-                }
-            }
-            data(k1, k2, 0) = 4*M_PI*M_PI*xdd;
-            data(k1, k2, 1) = 4*M_PI*M_PI*ydd;
-            data(k1, k2, 2) = 4*M_PI*M_PI*zdd;
-        }
-    }
+    Array coeffs[6] = {xc, xs, yc, ys, zc, zs};
+    gamma_direct(data, quadpoints_phi, quadpoints_theta, 0, 2, coeffs);
 }
 
+template<class Array>
+Array SurfaceXYZFourier<Array>::dgamma_by_dcoeff_jvp_impl(Array& w, int dphi, int dtheta) {
+    // the coefficients xc, xs, yc, ys, zc and zs for the dofs w, see set_dofs_impl
+    Array coeffs[6];
+    for (int l = 0; l < 6; ++l)
+        coeffs[l] = xt::zeros<double>({mpol+1, 2*ntor+1});
+    int shift = (mpol+1)*(2*ntor+1);
+    int counter = 0;
+    for (int l = 0; l < 6; ++l) {
+        if(stellsym && (l == 1 || l == 2 || l == 4))
+            continue;
+        for (int i = l % 2 == 0 ? ntor : ntor+1; i < shift; ++i)
+            coeffs[l].data()[i] = w[counter++];
+    }
+    Array data = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta, 3});
+    gamma_direct(data, quadpoints_phi, quadpoints_theta, dphi, dtheta, coeffs);
+    return data;
+}
 
 template<class Array>
 void SurfaceXYZFourier<Array>::dgamma_by_dcoeff_impl(Array& data) {
-#pragma omp parallel for
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            int counter = 0;
-            for (int d = 0; d < 3; ++d) {
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<0) continue;
-                        if(d == 0) {
-                            data(k1, k2, 0, counter) = cos(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = cos(m*theta-n*nfp*phi) * sin(phi);
-                        }else if(d == 1) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = -cos(m*theta-n*nfp*phi) * sin(phi);
-                            data(k1, k2, 1, counter) =  cos(m*theta-n*nfp*phi) * cos(phi);
-                        }
-                        else if(d == 2) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 2, counter) =  cos(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<=0) continue;
-                        if(d == 0) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = sin(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = sin(m*theta-n*nfp*phi) * sin(phi);
-                        }else if(d == 1) {
-                            data(k1, k2, 0, counter) = -sin(m*theta-n*nfp*phi) * sin(phi);
-                            data(k1, k2, 1, counter) =  sin(m*theta-n*nfp*phi) * cos(phi);
-                        }
-                        else if(d == 2) {
-                            data(k1, k2, 2, counter) =  sin(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-            }
-        }
-    }
+    dgamma_by_dcoeff_direct(data, 0, 0);
 }
 
 template<class Array>
 void SurfaceXYZFourier<Array>::dgammadash1_by_dcoeff_impl(Array& data) {
-#pragma omp parallel for
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            int counter = 0;
-            for (int d = 0; d < 3; ++d) {
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<0) continue;
-                        if(d == 0) {
-                            data(k1, k2, 0, counter) = (n*nfp)*sin(m*theta-n*nfp*phi) * cos(phi) - cos(m*theta-n*nfp*phi) * sin(phi);
-                            data(k1, k2, 1, counter) = (n*nfp)*sin(m*theta-n*nfp*phi) * sin(phi) + cos(m*theta-n*nfp*phi) * cos(phi);
-                        } else if(d == 1) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = -(n*nfp)*sin(m*theta-n*nfp*phi) * sin(phi) - cos(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) =  (n*nfp)*sin(m*theta-n*nfp*phi) * cos(phi) - cos(m*theta-n*nfp*phi) * sin(phi);
-                        }
-                        else if(d == 2) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 2, counter) =  (n*nfp)*sin(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<=0) continue;
-                        if(d == 0) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = -(n*nfp)*cos(m*theta-n*nfp*phi) * cos(phi) - sin(m*theta-n*nfp*phi) * sin(phi);
-                            data(k1, k2, 1, counter) = -(n*nfp)*cos(m*theta-n*nfp*phi) * sin(phi) + sin(m*theta-n*nfp*phi) * cos(phi);
-                        }else if(d == 1) {
-                            data(k1, k2, 0, counter) = (n*nfp)*cos(m*theta-n*nfp*phi) * sin(phi)  - sin(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = (-n*nfp)*cos(m*theta-n*nfp*phi) * cos(phi) - sin(m*theta-n*nfp*phi) * sin(phi);
-                        }
-                        else if(d == 2) {
-                            data(k1, k2, 2, counter) = (-n*nfp)*cos(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-            }
-        }
-    }
-    data *= 2 * M_PI;
+    dgamma_by_dcoeff_direct(data, 1, 0);
 }
 
 template<class Array>
 void SurfaceXYZFourier<Array>::dgammadash2_by_dcoeff_impl(Array& data) {
-#pragma omp parallel for
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            int counter = 0;
-            for (int d = 0; d < 3; ++d) {
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<0) continue;
-                        if(d == 0) {
-                            data(k1, k2, 0, counter) = (-m)* sin(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = (-m)* sin(m*theta-n*nfp*phi) * sin(phi);
-                        }else if(d == 1) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = (-m)* sin(m*theta-n*nfp*phi) * (-1) * sin(phi);
-                            data(k1, k2, 1, counter) = (-m)* sin(m*theta-n*nfp*phi) * cos(phi);
-                        }
-                        else if(d == 2) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 2, counter) = (-m) * sin(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<=0) continue;
-                        if(d == 0) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = m * cos(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = m * cos(m*theta-n*nfp*phi) * sin(phi);
-                        }else if(d == 1) {
-                            data(k1, k2, 0, counter) = m * cos(m*theta-n*nfp*phi) * (-1) * sin(phi);
-                            data(k1, k2, 1, counter) = m * cos(m*theta-n*nfp*phi) * cos(phi);
-                        }
-                        else if(d == 2) {
-                            data(k1, k2, 2, counter) = m * cos(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-            }
-        }
-    }
-    data *= 2*M_PI;
+    dgamma_by_dcoeff_direct(data, 0, 1);
 }
 
 template<class Array>
 void SurfaceXYZFourier<Array>::dgammadash1dash1_by_dcoeff_impl(Array& data) {
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            int counter = 0;
-            for (int d = 0; d < 3; ++d) {
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<0) continue;
-                        if(d == 0) {
-                            data(k1, k2, 0, counter) = (n*nfp) * (-n*nfp) * cos(m*theta-n*nfp*phi) * cos(phi) \
-                                                      - 2*(n*nfp)*sin(m*theta-n*nfp*phi) * sin(phi) \
-                                                      - cos(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = (n*nfp)*(-n*nfp)*cos(m*theta-n*nfp*phi)*sin(phi) \
-                                                     + 2*(n*nfp)*sin(m*theta-n*nfp*phi) * cos(phi) \
-                                                     - cos(m*theta-n*nfp*phi) * sin(phi);
-                        } else if(d == 1) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = -(n*nfp)*(-n*nfp)*cos(m*theta-n*nfp*phi) * sin(phi) \
-                                                       - 2*(n*nfp)*      sin(m*theta-n*nfp*phi) * cos(phi) \
-                                                                 +       cos(m*theta-n*nfp*phi) * sin(phi);
-                            data(k1, k2, 1, counter) = (n*nfp)*(-n*nfp)*cos(m*theta-n*nfp*phi)*cos(phi) \
-                                                     - 2*(n*nfp)*sin(m*theta-n*nfp*phi) * sin(phi) \
-                                                     - cos(m*theta-n*nfp*phi) * cos(phi);
-                        }
-                        else if (d == 2) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 2, counter) = (n*nfp)*(-n*nfp)*cos(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<=0) continue;
-                        if(d == 0) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = (n*nfp)*(-n*nfp)*sin(m*theta-n*nfp*phi) * cos(phi) \
-                                                      +       2*(n*nfp)*cos(m*theta-n*nfp*phi) * sin(phi) \
-                                                      -                 sin(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = (n*nfp)*(-n*nfp)*sin(m*theta-n*nfp*phi) * sin(phi) \
-                                                      - 2*(n*nfp)*cos(m*theta-n*nfp*phi) * cos(phi) \
-                                                      - sin(m*theta-n*nfp*phi) * sin(phi);
-                        } else if(d == 1) {
-                            data(k1, k2, 0, counter) = -(n*nfp)*(-n*nfp)*sin(m*theta-n*nfp*phi) * sin(phi) \
-                                                       + 2*(n*nfp)*cos(m*theta-n*nfp*phi) * cos(phi) \
-                                                       + sin(m*theta-n*nfp*phi) * sin(phi);
-                            data(k1, k2, 1, counter) = -(-n*nfp)*(-n*nfp)*sin(m*theta-n*nfp*phi) * cos(phi) \
-                                                       - 2*(-n*nfp)*cos(m*theta-n*nfp*phi) * sin(phi) \
-                                                       - sin(m*theta-n*nfp*phi) * cos(phi);
-                        }
-                        else if(d == 2) {
-                            data(k1, k2, 2, counter) = -(-n*nfp)*(-n*nfp)*sin(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-            }
-        }
-    }
-    data *= 4 * M_PI * M_PI;
+    dgamma_by_dcoeff_direct(data, 2, 0);
 }
 
 template<class Array>
 void SurfaceXYZFourier<Array>::dgammadash1dash2_by_dcoeff_impl(Array& data) {
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            int counter = 0;
-            for (int d = 0; d < 3; ++d) {
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<0) continue;
-                        if(d == 0) {
-                            data(k1, k2, 0, counter) = (n*nfp) * m * cos(m*theta-n*nfp*phi) * cos(phi) \
-                                                      + m * sin(m*theta-n*nfp*phi) * sin(phi);
-                            data(k1, k2, 1, counter) = (n*nfp)*m*cos(m*theta-n*nfp*phi) * sin(phi) \
-                                                      - m * sin(m*theta-n*nfp*phi) * cos(phi);
-                        }else if(d == 1) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = -(n*nfp)*m*cos(m*theta-n*nfp*phi) * sin(phi) \
-                                                       + m * sin(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = (n*nfp)*m*cos(m*theta-n*nfp*phi) * cos(phi) \
-                                                       + m * sin(m*theta-n*nfp*phi) * sin(phi);
-                        }
-                        else if(d == 2) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 2, counter) = (n*nfp)*m*cos(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<=0) continue;
-                        if(d == 0) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = (n*nfp)*m*sin(m*theta-n*nfp*phi) * cos(phi) \
-                                                      - m * cos(m*theta-n*nfp*phi) * sin(phi);
-                            data(k1, k2, 1, counter) = (n*nfp) * m * sin(m*theta-n*nfp*phi) * sin(phi) \
-                                                      + m * cos(m*theta-n*nfp*phi) * cos(phi);
-                        }else if(d == 1) {
-                            data(k1, k2, 0, counter) = -(n*nfp)*m*sin(m*theta-n*nfp*phi) * sin(phi) \
-                                                       - m * cos(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = -(-n*nfp)*m*sin(m*theta-n*nfp*phi) * cos(phi) \
-                                                       - m * cos(m*theta-n*nfp*phi) * sin(phi);
-                        }
-                        else if(d == 2) {
-                            data(k1, k2, 2, counter) = -(-n*nfp)*(m)*sin(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-            }
-        }
-    }
-    data *= 4 * M_PI * M_PI;
+    dgamma_by_dcoeff_direct(data, 1, 1);
 }
 
 template<class Array>
 void SurfaceXYZFourier<Array>::dgammadash2dash2_by_dcoeff_impl(Array& data) {
-    for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-        double phi  = 2*M_PI*quadpoints_phi[k1];
-        for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-            double theta  = 2*M_PI*quadpoints_theta[k2];
-            int counter = 0;
-            for (int d = 0; d < 3; ++d) {
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<0) continue;
-                        if(d == 0) {
-                            data(k1, k2, 0, counter) = (-m) * m * cos(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = (-m) * m * cos(m*theta-n*nfp*phi) * sin(phi);
-                        }else if(d == 1) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = (-m)* m * cos(m*theta-n*nfp*phi) * (-1) * sin(phi);
-                            data(k1, k2, 1, counter) = (-m) *m * cos(m*theta-n*nfp*phi) * cos(phi);
-                        }
-                        else if(d == 2) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 2, counter) = (-m) * m * cos(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-                for (int m = 0; m <= mpol; ++m) {
-                    for (int n = -ntor; n <= ntor; ++n) {
-                        if(m==0 && n<=0) continue;
-                        if(d == 0) {
-                            if(stellsym)
-                                continue;
-                            data(k1, k2, 0, counter) = - m * m * sin(m*theta-n*nfp*phi) * cos(phi);
-                            data(k1, k2, 1, counter) = - m * m * sin(m*theta-n*nfp*phi) * sin(phi);
-                        }else if(d == 1) {
-                            data(k1, k2, 0, counter) = - m * m * sin(m*theta-n*nfp*phi) * (-1) * sin(phi);
-                            data(k1, k2, 1, counter) = - m * m * sin(m*theta-n*nfp*phi) * cos(phi);
-                        }
-                        else if(d == 2) {
-                            data(k1, k2, 2, counter) = - m * m * sin(m*theta-n*nfp*phi);
-                        }
-                        counter++;
-                    }
-                }
-            }
-        }
-    }
-    data *= 4*M_PI*M_PI;
+    dgamma_by_dcoeff_direct(data, 0, 2);
 }
 
 #include "xtensor-python/pyarray.hpp"     // Numpy bindings
@@ -154,4 +154,12 @@ class SurfaceXYZFourier : public Surface<Array> {
         void dgammadash1dash2_by_dcoeff_impl(Array& data) override;
         void dgammadash2dash2_by_dcoeff_impl(Array& data) override;
 
+        Array dgamma_by_dcoeff_jvp_impl(Array& w, int dphi, int dtheta) override;
+
+    private:
+        // d^dphi/dphi^dphi d^dtheta/dtheta^dtheta gamma for the coefficients
+        // coeffs = {xc, xs, yc, ys, zc, zs}, with dphi, dtheta <= 2.
+        void gamma_direct(Array& data, const Array& quadpoints_phi, const Array& quadpoints_theta, int dphi, int dtheta, const Array* coeffs);
+        // the derivative of the above with respect to the dofs
+        void dgamma_by_dcoeff_direct(Array& data, int dphi, int dtheta);
 };
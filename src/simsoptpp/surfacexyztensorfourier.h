@@ -1,6 +1,7 @@
 #pragma once
 
 #include "surface.h"
+#include "uniformfourier.h"
 
 template<class Array>
 class SurfaceXYZTensorFourier : public Surface<Array> {
@@ -38,17 +39,6 @@ class SurfaceXYZTensorFourier : public Surface<Array> {
         Array x;
         Array y;
         Array z;
-        Array cache_basis_fun_phi;
-        Array cache_basis_fun_phi_dash;
-        Array cache_basis_fun_phi_dashdash;
-        Array cache_basis_fun_theta;
-        Array cache_basis_fun_theta_dash;
-        Array cache_basis_fun_theta_dashdash;
-        Array cache_enforcer;
-        Array cache_enforcer_dphi;
-        Array cache_enforcer_dtheta;
-        Array cache_enforcer_dphidphi;
-        Array cache_enforcer_dthetadtheta;
         int nfp;
         int mpol;
         int ntor;
@@ -60,7 +50,7 @@ class SurfaceXYZTensorFourier : public Surface<Array> {
                 x = xt::zeros<double>({2*mpol+1, 2*ntor+1});
                 y = xt::zeros<double>({2*mpol+1, 2*ntor+1});
                 z = xt::zeros<double>({2*mpol+1, 2*ntor+1});
-                build_cache();
+                tables = BasisTables(*this, this->quadpoints_phi, this->quadpoints_theta);
             }
 
         int num_dofs() override {
@@ -117,33 +107,14 @@ class SurfaceXYZTensorFourier : public Surface<Array> {
         }
 
         void gamma_impl(Array& data, Array& quadpoints_phi, Array& quadpoints_theta) override {
-            int numquadpoints_phi = quadpoints_phi.size();
-            int numquadpoints_theta = quadpoints_theta.size();
-            data *= 0.;
-#pragma omp parallel for
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    double xhat = 0;
-                    double yhat = 0;
-                    double z = 0;
-                    for (int m = 0; m <= 2*mpol; ++m) {
-                        for (int n = 0; n <= 2*ntor; ++n) {
-                            xhat += get_coeff(0, m, n) * basis_fun(0, n, k1, m, k2);
-                            yhat += get_coeff(1, m, n) * basis_fun(1, n, k1, m, k2);
-                            z += get_coeff(2, m, n) * basis_fun(2, n, k1, m, k2);
-                            //xhat += get_coeff(0, m, n) * basis_fun(0, n, phi, m, theta);
-                            //yhat += get_coeff(1, m, n) * basis_fun(1, n, phi, m, theta);
-                            //z += get_coeff(2, m, n) * basis_fun(2, n, phi, m, theta);
-                        }
-                    }
-                    data(k1, k2, 0) = xhat * cos(phi) - yhat * sin(phi);
-                    data(k1, k2, 1) = xhat * sin(phi) + yhat * cos(phi);
-                    data(k1, k2, 2) = z;
-                }
-            }
+            UniformGrid grid_phi, grid_theta;
+            if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+                return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 0, 0);
+            if(&quadpoints_phi == &this->quadpoints_phi && &quadpoints_theta == &this->quadpoints_theta)
+                return gamma_direct(data, tables, 0, 0);
+            gamma_direct(data, BasisTables(*this, quadpoints_phi, quadpoints_theta), 0, 0);
         }
+
         void gamma_lin(Array& data, Array& quadpoints_phi, Array& quadpoints_theta) override {
             int numquadpoints_phi = quadpoints_phi.size();
 #pragma omp parallel for
@@ -168,427 +139,485 @@ class SurfaceXYZTensorFourier : public Surface<Array> {
 
 
         void gammadash1_impl(Array& data) override {
-#pragma omp parallel for
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                double sinphi = sin(phi);
-                double cosphi = cos(phi);
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    double xhat = 0;
-                    double yhat = 0;
-                    double xhatdash = 0;
-                    double yhatdash = 0;
-                    double zdash = 0;
-                    for (int m = 0; m <= 2*mpol; ++m) {
-                        for (int n = 0; n <= 2*ntor; ++n) {
-                            xhat += get_coeff(0, m, n) * basis_fun(0, n, k1, m, k2);
-                            yhat += get_coeff(1, m, n) * basis_fun(1, n, k1, m, k2);
-                            xhatdash += get_coeff(0, m, n) * basis_fun_dphi(0, n, k1, m, k2);
-                            yhatdash += get_coeff(1, m, n) * basis_fun_dphi(1, n, k1, m, k2);
-                            zdash += get_coeff(2, m, n) * basis_fun_dphi(2, n, k1, m, k2);
-                            //xhat += get_coeff(0, m, n) * basis_fun(0, n, phi, m, theta);
-                            //yhat += get_coeff(1, m, n) * basis_fun(1, n, phi, m, theta);
-                            //xhatdash += get_coeff(0, m, n) * basis_fun_dphi(0, n, phi, m, theta);
-                            //yhatdash += get_coeff(1, m, n) * basis_fun_dphi(1, n, phi, m, theta);
-                            //zdash += get_coeff(2, m, n) * basis_fun_dphi(2, n, phi, m, theta);
-                        }
-                    }
-                    double xdash = xhatdash * cosphi - yhatdash * sinphi - xhat * sinphi - yhat * cosphi;
-                    double ydash = xhatdash * sinphi + yhatdash * cosphi + xhat * cosphi - yhat * sinphi;
-                    data(k1, k2, 0) = 2*M_PI*xdash;
-                    data(k1, k2, 1) = 2*M_PI*ydash;
-                    data(k1, k2, 2) = 2*M_PI*zdash;
-                }
-            }
+            UniformGrid grid_phi, grid_theta;
+            if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+                return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 1, 0);
+            gamma_direct(data, tables, 1, 0);
         }
 
         void gammadash2_impl(Array& data) override {
-#pragma omp parallel for
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                double sinphi = sin(phi);
-                double cosphi = cos(phi);
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    double xhat = 0;
-                    double yhat = 0;
-                    double xhatdash = 0;
-                    double yhatdash = 0;
-                    double zdash = 0;
-                    for (int m = 0; m <= 2*mpol; ++m) {
-                        for (int n = 0; n <= 2*ntor; ++n) {
-                            xhatdash += get_coeff(0, m, n) * basis_fun_dtheta(0, n, k1, m, k2);
-                            yhatdash += get_coeff(1, m, n) * basis_fun_dtheta(1, n, k1, m, k2);
-                            zdash += get_coeff(2, m, n) * basis_fun_dtheta(2, n, k1, m, k2);
-                            //xhatdash += get_coeff(0, m, n) * basis_fun_dtheta(0, n, phi, m, theta);
-                            //yhatdash += get_coeff(1, m, n) * basis_fun_dtheta(1, n, phi, m, theta);
-                            //zdash += get_coeff(2, m, n) * basis_fun_dtheta(2, n, phi, m, theta);
-                        }
-                    }
-                    double xdash = xhatdash * cosphi - yhatdash * sinphi;
-                    double ydash = xhatdash * sinphi + yhatdash * cosphi;
-                    data(k1, k2, 0) = 2*M_PI*xdash;
-                    data(k1, k2, 1) = 2*M_PI*ydash;
-                    data(k1, k2, 2) = 2*M_PI*zdash;
-                }
-            }
+            UniformGrid grid_phi, grid_theta;
+            if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+                return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 0, 1);
+            gamma_direct(data, tables, 0, 1);
         }
 
         void gammadash2dash2_impl(Array& data) override {
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                double sinphi = sin(phi);
-                double cosphi = cos(phi);
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    double xhatdd = 0;
-                    double yhatdd = 0;
-                    double zdd = 0;
-                    for (int m = 0; m <= 2*mpol; ++m) {
-                        for (int n = 0; n <= 2*ntor; ++n) {
-                            xhatdd += get_coeff(0, m, n) * basis_fun_dthetadtheta(0, n, k1, m, k2);
-                            yhatdd += get_coeff(1, m, n) * basis_fun_dthetadtheta(1, n, k1, m, k2);
-                            zdd += get_coeff(2, m, n) * basis_fun_dthetadtheta(2, n, k1, m, k2);
-                        }
-                    }
-                    double xdd = xhatdd * cosphi - yhatdd * sinphi;
-                    double ydd = xhatdd * sinphi + yhatdd * cosphi;
-                    data(k1, k2, 0) = 4*M_PI*M_PI*xdd;
-                    data(k1, k2, 1) = 4*M_PI*M_PI*ydd;
-                    data(k1, k2, 2) = 4*M_PI*M_PI*zdd;
-                }
-            }
+            UniformGrid grid_phi, grid_theta;
+            if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+                return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 0, 2);
+            gamma_direct(data, tables, 0, 2);
         }
 
         void gammadash1dash2_impl(Array& data) override {
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                double sinphi = sin(phi);
-                double cosphi = cos(phi);
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    double xhatd2 = 0;
-                    double yhatd2 = 0;
-                    double xhatd1d2 = 0;
-                    double yhatd1d2 = 0;
-                    double zd1d2 = 0;
-                    for (int m = 0; m <= 2*mpol; ++m) {
-                        for (int n = 0; n <= 2*ntor; ++n) {
-                            xhatd2 += get_coeff(0, m, n) * basis_fun_dtheta(0, n, k1, m, k2);
-                            yhatd2 += get_coeff(1, m, n) * basis_fun_dtheta(1, n, k1, m, k2);
-                            xhatd1d2 += get_coeff(0, m, n) * basis_fun_dthetadphi(0, n, k1, m, k2);
-                            yhatd1d2 += get_coeff(1, m, n) * basis_fun_dthetadphi(1, n, k1, m, k2);
-                            zd1d2 += get_coeff(2, m, n) * basis_fun_dthetadphi(2, n, k1, m, k2);
-                        }
+            UniformGrid grid_phi, grid_theta;
+            if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+                return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 1, 1);
+            gamma_direct(data, tables, 1, 1);
+        }
+
+        void gammadash1dash1_impl(Array& data) override {
+            UniformGrid grid_phi, grid_theta;
+            if(use_fft(quadpoints_phi, quadpoints_theta, grid_phi, grid_theta))
+                return gamma_fft(data, quadpoints_phi, grid_phi, grid_theta, 2, 0);
+            gamma_direct(data, tables, 2, 0);
+        }
+
+        void dgamma_by_dcoeff_impl(Array& data) override {
+            dgamma_by_dcoeff_direct(data, tables, 0, 0);
+        }
+
+        void dgammadash1_by_dcoeff_impl(Array& data) override {
+            dgamma_by_dcoeff_direct(data, tables, 1, 0);
+        }
+
+        void dgammadash2_by_dcoeff_impl(Array& data) override {
+            dgamma_by_dcoeff_direct(data, tables, 0, 1);
+        }
+
+        void dgammadash1dash1_by_dcoeff_impl(Array& data) override {
+            dgamma_by_dcoeff_direct(data, tables, 2, 0);
+        }
+
+        void dgammadash1dash2_by_dcoeff_impl(Array& data) override {
+            dgamma_by_dcoeff_direct(data, tables, 1, 1);
+        }
+
+        void dgammadash2dash2_by_dcoeff_impl(Array& data) override {
+            dgamma_by_dcoeff_direct(data, tables, 0, 2);
+        }
+
+        Array dgamma_by_dcoeff_vjp(Array& v) override {
+            if(is_clamped())
+                return Surface<Array>::dgamma_by_dcoeff_vjp(v);
+            return jacobian_vjp(v, 0, 0);
+        }
+
+        Array dgammadash1_by_dcoeff_vjp(Array& v) override {
+            if(is_clamped())
+                return Surface<Array>::dgammadash1_by_dcoeff_vjp(v);
+            return jacobian_vjp(v, 1, 0);
+        }
+
+        Array dgammadash2_by_dcoeff_vjp(Array& v) override {
+            if(is_clamped())
+                return Surface<Array>::dgammadash2_by_dcoeff_vjp(v);
+            return jacobian_vjp(v, 0, 1);
+        }
+
+        Array dgamma_by_dcoeff_jvp_impl(Array& w, int dphi, int dtheta) override {
+            if(is_clamped())
+                return Surface<Array>::dgamma_by_dcoeff_jvp_impl(w, dphi, dtheta);
+            // the coefficients x, y and z for the dofs w, see set_dofs_impl
+            Array coeffs[3];
+            int counter = 0;
+            for (int d = 0; d < 3; ++d) {
+                coeffs[d] = xt::zeros<double>({2*mpol+1, 2*ntor+1});
+                for (int m = 0; m <= 2*mpol; ++m) {
+                    for (int n = 0; n <= 2*ntor; ++n) {
+                        if(skip(d, m, n)) continue;
+                        coeffs[d](m, n) = w[counter++];
                     }
-                    double xd1d2 = xhatd1d2 * cosphi - xhatd2 * sinphi - yhatd1d2 * sinphi  \
-                                -  yhatd2 * cosphi;
-                    double yd1d2 = xhatd1d2 * sinphi + xhatd2 * cosphi
-                                +  yhatd1d2 * cosphi - yhatd2 * sinphi;
-                    data(k1, k2, 0) = 4*M_PI*M_PI*xd1d2;
-                    data(k1, k2, 1) = 4*M_PI*M_PI*yd1d2;
-                    data(k1, k2, 2) = 4*M_PI*M_PI*zd1d2;
                 }
             }
+            Array data = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta, 3});
+            bool fft = fft_wanted(std::max(mpol, ntor));
+            with_fourier_series(quadpoints_phi, nfp, ntor, fft, [&](const auto& series_phi) {
+                with_fourier_series(quadpoints_theta, 1, mpol, fft, [&](const auto& series_theta) {
+                    gamma_series(data, quadpoints_phi, series_phi, series_theta, dphi, dtheta, coeffs);
+                });
+            });
+            return data;
         }
 
-        void gammadash1dash1_impl(Array& data) override {
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                double sinphi = sin(phi);
-                double cosphi = cos(phi);
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    double xhat = 0;
-                    double yhat = 0;
-                    double xhatd = 0;
-                    double yhatd = 0;
-                    double xhatdd = 0;
-                    double yhatdd = 0;
-                    double zdd = 0;
-                    for (int m = 0; m <= 2*mpol; ++m) {
-                        for (int n = 0; n <= 2*ntor; ++n) {
-                            xhat += get_coeff(0, m, n) * basis_fun(0, n, k1, m, k2);
-                            yhat += get_coeff(1, m, n) * basis_fun(1, n, k1, m, k2);
-                            xhatd += get_coeff(0, m, n) * basis_fun_dphi(0, n, k1, m, k2);
-                            yhatd += get_coeff(1, m, n) * basis_fun_dphi(1, n, k1, m, k2);
-                            xhatdd += get_coeff(0, m, n) * basis_fun_dphidphi(0, n, k1, m, k2);
-                            yhatdd += get_coeff(1, m, n) * basis_fun_dphidphi(1, n, k1, m, k2);
-                            zdd += get_coeff(2, m, n) * basis_fun_dphidphi(2, n, k1, m, k2);
-                        }
+    private:
+
+        // The tensor product series are evaluated first in phi for every i
+        // and then in theta for every phi, using FFTs on uniform quadrature
+        // points and direct sums otherwise, see uniformfourier.h. Since the
+        // surface is linear in its dofs, this also applies the Jacobian with
+        // respect to the dofs and its transpose without forming the dense
+        // d*_by_dcoeff arrays. The boundary condition enforcer of clamped
+        // dimensions isn't a Fourier series, so then we always use the
+        // direct evaluation.
+        bool is_clamped() {
+            for (int d = 0; d < 3; ++d) {
+                if(clamped_dims[d])
+                    return true;
+            }
+            return false;
+        }
+
+        bool use_fft(const Array& quadpoints_phi, const Array& quadpoints_theta, UniformGrid& grid_phi, UniformGrid& grid_theta) {
+            if(is_clamped() || !fft_wanted(std::max(mpol, ntor)))
+                return false;
+            grid_phi = uniform_grid(quadpoints_phi, nfp);
+            grid_theta = uniform_grid(quadpoints_theta, 1);
+            return grid_phi.uniform && grid_theta.uniform;
+        }
+
+        void gamma_fft(Array& data, Array& quadpoints_phi, const UniformGrid& grid_phi, const UniformGrid& grid_theta, int dphi, int dtheta) {
+            Array coeffs[3] = {x, y, z};
+            gamma_series(data, quadpoints_phi, UniformFourierSeries(grid_phi, ntor), UniformFourierSeries(grid_theta, mpol), dphi, dtheta, coeffs);
+        }
+
+        Array jacobian_vjp(Array& v, int dphi, int dtheta) {
+            bool fft = fft_wanted(std::max(mpol, ntor));
+            return with_fourier_series(quadpoints_phi, nfp, ntor, fft, [&](const auto& series_phi) {
+                return with_fourier_series(quadpoints_theta, 1, mpol, fft, [&](const auto& series_theta) {
+                    return gamma_series_vjp(v, series_phi, series_theta, dphi, dtheta);
+                });
+            });
+        }
+
+        // The derivatives d^dphi/d(nfp*phi)^dphi d^dtheta/dtheta^dtheta of
+        // \hat x, \hat y and z for the coefficients coeffs = {x, y, z},
+        // stored as res[(d*numquadpoints_phi + k1)*numquadpoints_theta + k2].
+        template<class SeriesPhi, class SeriesTheta>
+        vector<double> xyz_series(const SeriesPhi& series_phi, const SeriesTheta& series_theta, int dphi, int dtheta, const Array* coeffs) {
+            int nphi = series_phi.size();
+            int ntheta = series_theta.size();
+            int nseries = 3*(2*mpol+1);
+            vector<double> a(nseries*(ntor+1), 0.), b(nseries*(ntor+1), 0.);
+            for (int d = 0; d < 3; ++d) {
+                for (int m = 0; m <= 2*mpol; ++m) {
+                    int i = (d*(2*mpol+1) + m)*(ntor+1);
+                    a[i] = skip(d, m, 0) ? 0. : coeffs[d](m, 0);
+                    for (int j = 1; j <= ntor; ++j) {
+                        a[i+j] = skip(d, m, j) ? 0. : coeffs[d](m, j);
+                        b[i+j] = skip(d, m, ntor+j) ? 0. : coeffs[d](m, ntor+j);
+                    }
+                }
+            }
+            vector<double> g(nseries*nphi);
+            series_phi.synthesize(nseries, a.data(), b.data(), dphi, g.data());
+            vector<double> a2(3*nphi*(mpol+1), 0.), b2(3*nphi*(mpol+1), 0.);
+            for (int d = 0; d < 3; ++d) {
+                for (int k1 = 0; k1 < nphi; ++k1) {
+                    int i = (d*nphi + k1)*(mpol+1);
+                    a2[i] = g[(d*(2*mpol+1))*nphi + k1];
+                    for (int m = 1; m <= mpol; ++m) {
+                        a2[i+m] = g[(d*(2*mpol+1) + m)*nphi + k1];
+                        b2[i+m] = g[(d*(2*mpol+1) + mpol + m)*nphi + k1];
                     }
-                    double xdd = xhatdd * cosphi - 2 * xhatd * sinphi - xhat * cosphi \
-                              -  yhatdd * sinphi - 2 * yhatd * cosphi + yhat * sinphi;
-                    double ydd = xhatdd * sinphi + 2 * xhatd * cosphi - xhat * sinphi \
-                              +  yhatdd * cosphi - 2 * yhatd * sinphi - yhat * cosphi;
-                    data(k1, k2, 0) = 4*M_PI*M_PI*xdd;
-                    data(k1, k2, 1) = 4*M_PI*M_PI*ydd;
-                    data(k1, k2, 2) = 4*M_PI*M_PI*zdd;
                 }
             }
+            vector<double> res(3*nphi*ntheta);
+            series_theta.synthesize(3*nphi, a2.data(), b2.data(), dtheta, res.data());
+            return res;
         }
 
-        void dgammadash1dash1_by_dcoeff_impl(Array& data) override {
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    int counter = 0;
-                    for (int d = 0; d < 3; ++d) {
-                        for (int m = 0; m <= 2*mpol; ++m) {
-                            for (int n = 0; n <= 2*ntor; ++n) {
-                                if(skip(d, m, n)) continue;
-                                double wivj = basis_fun(d, n, phi, m, theta);
-                                double wivjd = basis_fun_dphi(d, n, phi, m, theta);
-                                double wivjdd = basis_fun_dphidphi(d, n, phi, m, theta);
-                                if(d==0) {
-                                    double dxhat = wivj;
-                                    double dxhatd = wivjd;
-                                    double dxhatdd = wivjdd;
-                                    double dyhat = 0.;
-                                    double dyhatd = 0.;
-                                    double dyhatdd = 0.;
-                                    double dxdd = dxhatdd * cos(phi) - 2*dxhatd * sin(phi) - dxhat * cos(phi) \
-                                                - dyhatdd * sin(phi) - 2*dyhatd * cos(phi) + dyhat * sin(phi);
-                                    double dydd = dxhatdd * sin(phi) + 2 * dxhatd * cos(phi) - dxhat * sin(phi) \
-                                                + dyhatdd * cos(phi) - 2 * dyhatd * sin(phi) - dyhat * cos(phi);
-                                    data(k1, k2, 0, counter) = 4*M_PI*M_PI*dxdd;
-                                    data(k1, k2, 1, counter) = 4*M_PI*M_PI*dydd;
-                                } else if(d==1) {
-                                    double dxhat = 0.;
-                                    double dxhatd = 0.;
-                                    double dxhatdd = 0.;
-                                    double dyhat = wivj;
-                                    double dyhatd = wivjd;
-                                    double dyhatdd = wivjdd;
-                                    double dxdd = dxhatdd * cos(phi) - 2*dxhatd * sin(phi) - dxhat * cos(phi) \
-                                                - dyhatdd * sin(phi) - 2*dyhatd * cos(phi) + dyhat * sin(phi);
-                                    double dydd = dxhatdd * sin(phi) + 2 * dxhatd * cos(phi) - dxhat * sin(phi) \
-                                                + dyhatdd * cos(phi) - 2 * dyhatd * sin(phi) - dyhat * cos(phi);
-                                    data(k1, k2, 0, counter) = 4*M_PI*M_PI*dxdd;
-                                    data(k1, k2, 1, counter) = 4*M_PI*M_PI*dydd;
-                                }else {
-                                    double dzdd = wivjdd;
-                                    data(k1, k2, 2, counter) = 4*M_PI*M_PI*dzdd;
-                                }
-                                counter++;
-                            }
-                        }
+        template<class SeriesPhi, class SeriesTheta>
+        void gamma_series(Array& data, Array& quadpoints_phi, const SeriesPhi& series_phi, const SeriesTheta& series_theta, int dphi, int dtheta, const Array* coeffs) {
+            int nphi = series_phi.size();
+            int ntheta = series_theta.size();
+            // x = \hat x cos(phi) - \hat y sin(phi), so by the product rule
+            // we need all derivatives of \hat x and \hat y in phi up to dphi.
+            vector<vector<double>> xyz(dphi+1);
+            for (int q = 0; q <= dphi; ++q)
+                xyz[q] = xyz_series(series_phi, series_theta, q, dtheta, coeffs);
+            double scale = std::pow(2*M_PI, dphi + dtheta);
+#pragma omp parallel for
+            for (int k1 = 0; k1 < nphi; ++k1) {
+                double phi = 2*M_PI*quadpoints_phi[k1];
+                for (int k2 = 0; k2 < ntheta; ++k2) {
+                    double x = 0, y = 0;
+                    for (int q = 0; q <= dphi; ++q) {
+                        double c = binomial(dphi, q) * std::pow(nfp, q);
+                        double xhat = c * xyz[q][k1*ntheta + k2];
+                        double yhat = c * xyz[q][(nphi + k1)*ntheta + k2];
+                        double cosphi = cos(phi + (dphi-q)*M_PI/2);
+                        double sinphi = sin(phi + (dphi-q)*M_PI/2);
+                        x += xhat * cosphi - yhat * sinphi;
+                        y += xhat * sinphi + yhat * cosphi;
                     }
+                    data(k1, k2, 0) = scale * x;
+                    data(k1, k2, 1) = scale * y;
+                    data(k1, k2, 2) = scale * std::pow(nfp, dphi) * xyz[dphi][(2*nphi + k1)*ntheta + k2];
                 }
             }
         }
 
-        void dgammadash1dash2_by_dcoeff_impl(Array& data) override {
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    int counter = 0;
-                    for (int d = 0; d < 3; ++d) {
-                        for (int m = 0; m <= 2*mpol; ++m) {
-                            for (int n = 0; n <= 2*ntor; ++n) {
-                                if(skip(d, m, n)) continue;
-                                double wivjd2 = basis_fun_dtheta(d, n, phi, m, theta);
-                                double wivjd1d2 = basis_fun_dthetadphi(d, n, phi, m, theta);
-                                if(d==0) {
-                                    double dxhatd2 = wivjd2;
-                                    double dxhatd1d2 = wivjd1d2;
-                                    double dyhatd2 = 0.;
-                                    double dyhatd1d2 = 0.;
-                                    double dxd1d2 = dxhatd1d2 * cos(phi) - dxhatd2 * sin(phi) \
-                                                  - dyhatd1d2 * sin(phi) - dyhatd2 * cos(phi);
-                                    double dyd1d2 = dxhatd1d2 * sin(phi) + dxhatd2 * cos(phi) \
-                                                + dyhatd1d2 * cos(phi) - dyhatd2 * sin(phi);
-                                    data(k1, k2, 0, counter) = 4*M_PI*M_PI*dxd1d2;
-                                    data(k1, k2, 1, counter) = 4*M_PI*M_PI*dyd1d2;
-                                }else if(d==1) {
-                                    double dxhatd2 = 0.;
-                                    double dxhatd1d2 = 0.;
-                                    double dyhatd2 = wivjd2;
-                                    double dyhatd1d2 = wivjd1d2;
-                                    double dxd1d2 = dxhatd1d2 * cos(phi) - dxhatd2 * sin(phi) \
-                                                  - dyhatd1d2 * sin(phi) - dyhatd2 * cos(phi);
-                                    double dyd1d2 = dxhatd1d2 * sin(phi) + dxhatd2 * cos(phi) \
-                                                  + dyhatd1d2 * cos(phi) - dyhatd2 * sin(phi);
-                                    data(k1, k2, 0, counter) = 4*M_PI*M_PI*dxd1d2;
-                                    data(k1, k2, 1, counter) = 4*M_PI*M_PI*dyd1d2;
-                                }else {
-                                    double dzd1d2 = wivjd1d2;
-                                    data(k1, k2, 2, counter) = 4*M_PI*M_PI*dzd1d2;
-                                }
-                                counter++;
-                            }
+        template<class SeriesPhi, class SeriesTheta>
+        Array gamma_series_vjp(Array& v, const SeriesPhi& series_phi, const SeriesTheta& series_theta, int dphi, int dtheta) {
+            int nphi = series_phi.size();
+            int ntheta = series_theta.size();
+            int nseries = 3*(2*mpol+1);
+            vector<double> w(3*nphi*ntheta), C(3*nphi*(mpol+1)), S(3*nphi*(mpol+1));
+            vector<double> cs(nseries*nphi), A(nseries*(ntor+1)), B(nseries*(ntor+1));
+            Array grad = xt::zeros<double>({3, 2*mpol+1, 2*ntor+1});
+            double scale = std::pow(2*M_PI, dphi + dtheta);
+            for (int q = 0; q <= dphi; ++q) {
+                // the adjoint of the transforms in xyz_series, in reverse order
+                for (int k1 = 0; k1 < nphi; ++k1) {
+                    double phi = 2*M_PI*quadpoints_phi[k1];
+                    double cosphi = cos(phi + (dphi-q)*M_PI/2);
+                    double sinphi = sin(phi + (dphi-q)*M_PI/2);
+                    for (int k2 = 0; k2 < ntheta; ++k2) {
+                        w[k1*ntheta + k2] = v(k1, k2, 0) * cosphi + v(k1, k2, 1) * sinphi;
+                        w[(nphi + k1)*ntheta + k2] = -v(k1, k2, 0) * sinphi + v(k1, k2, 1) * cosphi;
+                        w[(2*nphi + k1)*ntheta + k2] = q == dphi ? v(k1, k2, 2) : 0.;
+                    }
+                }
+                series_theta.analyze(3*nphi, w.data(), dtheta, C.data(), S.data());
+                for (int d = 0; d < 3; ++d) {
+                    for (int k1 = 0; k1 < nphi; ++k1) {
+                        int i = (d*nphi + k1)*(mpol+1);
+                        cs[(d*(2*mpol+1))*nphi + k1] = C[i];
+                        for (int m = 1; m <= mpol; ++m) {
+                            cs[(d*(2*mpol+1) + m)*nphi + k1] = C[i+m];
+                            cs[(d*(2*mpol+1) + mpol + m)*nphi + k1] = S[i+m];
+                        }
+                    }
+                }
+                series_phi.analyze(nseries, cs.data(), q, A.data(), B.data());
+                double c = scale * binomial(dphi, q) * std::pow(nfp, q);
+                for (int d = 0; d < 3; ++d) {
+                    for (int m = 0; m <= 2*mpol; ++m) {
+                        int i = (d*(2*mpol+1) + m)*(ntor+1);
+                        grad(d, m, 0) += c * A[i];
+                        for (int j = 1; j <= ntor; ++j) {
+                            grad(d, m, j) += c * A[i+j];
+                            grad(d, m, ntor+j) += c * B[i+j];
                         }
                     }
                 }
             }
+            // same order as get_dofs
+            Array res = xt::zeros<double>({num_dofs()});
+            int counter = 0;
+            for (int d = 0; d < 3; ++d) {
+                for (int m = 0; m <= 2*mpol; ++m) {
+                    for (int n = 0; n <= 2*ntor; ++n) {
+                        if(skip(d, m, n)) continue;
+                        res[counter++] = grad(d, m, n);
+                    }
+                }
+            }
+            return res;
         }
 
-        void dgammadash2dash2_by_dcoeff_impl(Array& data) override {
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    int counter = 0;
-                    for (int d = 0; d < 3; ++d) {
-                        for (int m = 0; m <= 2*mpol; ++m) {
-                            for (int n = 0; n <= 2*ntor; ++n) {
-                                if(skip(d, m, n)) continue;
-                                double wivj = basis_fun(d, n, phi, m, theta);
-                                double wivjd = basis_fun_dtheta(d, n, phi, m, theta);
-                                double wivjdd = basis_fun_dthetadtheta(d, n, phi, m, theta);
-                                if(d==0) {
-                                    double dxhat = wivj;
-                                    double dyhat = 0.;
-                                    double dxhatd = wivjd;
-                                    double dyhatd = 0.;
-                                    double dxhatdd = wivjdd;
-                                    double dyhatdd = 0.;
-                                    double dxdd = dxhatdd * cos(phi) - dyhatdd * sin(phi);
-                                    double dydd = dxhatdd * sin(phi) + dyhatdd * cos(phi);
-                                    data(k1, k2, 0, counter) = 4*M_PI*M_PI*dxdd;
-                                    data(k1, k2, 1, counter) = 4*M_PI*M_PI*dydd;
-                                }else if(d==1) {
-                                    double dxhat = 0.;
-                                    double dyhat = wivj;
-                                    double dxhatd = 0.;
-                                    double dyhatd = wivjd;
-                                    double dxhatdd = 0.;
-                                    double dyhatdd = wivjdd;
-                                    double dxdd = dxhatdd * cos(phi) - dyhatdd * sin(phi);
-                                    double dydd = dxhatdd * sin(phi) + dyhatdd * cos(phi);
-                                    data(k1, k2, 0, counter) = 4*M_PI*M_PI*dxdd;
-                                    data(k1, k2, 1, counter) = 4*M_PI*M_PI*dydd;
-                                }else {
-                                    double dzdd = wivjdd;
-                                    data(k1, k2, 2, counter) = 4*M_PI*M_PI*dzdd;;
-                                }
-                                counter++;
-                            }
-                        }
+        // The basis functions v_n(phi) and w_m(theta) and their first two
+        // derivatives, and the boundary condition enforcer and its
+        // derivatives, at the quadrature points. They only depend on the
+        // quadrature points, so the tables for the quadrature points of the
+        // surface are computed once in the constructor. The theta direction
+        // is padded to a multiple of the simd size, so that the tensor
+        // products can be evaluated for several theta at once.
+        struct BasisTables {
+            int nphi = 0;
+            int ntheta = 0;
+            int ntheta_padded = 0;
+            // phi[(p*(2*ntor+1) + n)*nphi + k1] = d^p/dphi^p v_n(phi_k1)
+            vector<double> phi;
+            // theta[(q*(2*mpol+1) + m)*ntheta_padded + k2] = d^q/dtheta^q w_m(theta_k2)
+            AlignedPaddedVec theta;
+            // enforcer[((3*p + q)*nphi + k1)*ntheta_padded + k2] =
+            // d^p/dphi^p d^q/dtheta^q e(phi_k1, theta_k2) for p + q <= 2, where
+            // e(phi, theta) = sin(nfp*phi/2)^2 + sin(theta/2)^2
+            AlignedPaddedVec enforcer;
+            // cos(phi_k1 + r*pi/2) and sin(phi_k1 + r*pi/2) at r*nphi + k1,
+            // i.e. the r-th derivatives of cos(phi) and sin(phi)
+            vector<double> cosphi;
+            vector<double> sinphi;
+
+            BasisTables() {}
+
+            BasisTables(SurfaceXYZTensorFourier& s, const Array& quadpoints_phi, const Array& quadpoints_theta)
+                : nphi(quadpoints_phi.size()), ntheta(quadpoints_theta.size()) {
+                int M = 2*s.mpol+1;
+                int N = 2*s.ntor+1;
+                ntheta_padded = (ntheta + harmonic_size - 1)/harmonic_size*harmonic_size;
+                phi = vector<double>(3*N*nphi, 0.);
+                theta = AlignedPaddedVec(3*M*ntheta_padded, 0.);
+                enforcer = AlignedPaddedVec(9*nphi*ntheta_padded, 0.);
+                cosphi = vector<double>(3*nphi, 0.);
+                sinphi = vector<double>(3*nphi, 0.);
+                for (int k1 = 0; k1 < nphi; ++k1) {
+                    double ph = 2*M_PI*quadpoints_phi[k1];
+                    for (int n = 0; n < N; ++n) {
+                        phi[(0*N + n)*nphi + k1] = s.basis_fun_phi(n, ph);
+                        phi[(1*N + n)*nphi + k1] = s.basis_fun_phi_dash(n, ph);
+                        phi[(2*N + n)*nphi + k1] = s.basis_fun_phi_dashdash(n, ph);
+                    }
+                    for (int r = 0; r < 3; ++r) {
+                        cosphi[r*nphi + k1] = cos(ph + r*M_PI/2);
+                        sinphi[r*nphi + k1] = sin(ph + r*M_PI/2);
+                    }
+                }
+                for (int k2 = 0; k2 < ntheta; ++k2) {
+                    double th = 2*M_PI*quadpoints_theta[k2];
+                    for (int m = 0; m < M; ++m) {
+                        theta[(0*M + m)*ntheta_padded + k2] = s.basis_fun_theta(m, th);
+                        theta[(1*M + m)*ntheta_padded + k2] = s.basis_fun_theta_dash(m, th);
+                        theta[(2*M + m)*ntheta_padded + k2] = s.basis_fun_theta_dashdash(m, th);
+                    }
+                }
+                int nfp = s.nfp;
+                for (int k1 = 0; k1 < nphi; ++k1) {
+                    double ph = 2*M_PI*quadpoints_phi[k1];
+                    double sp = sin(nfp*ph/2), cp = cos(nfp*ph/2);
+                    for (int k2 = 0; k2 < ntheta; ++k2) {
+                        double th = 2*M_PI*quadpoints_theta[k2];
+                        double st = sin(th/2), ct = cos(th/2);
+                        enforcer[(0*nphi + k1)*ntheta_padded + k2] = sp*sp + st*st;
+                        enforcer[(1*nphi + k1)*ntheta_padded + k2] = ct*st;
+                        enforcer[(2*nphi + k1)*ntheta_padded + k2] = 0.5*(ct*ct - st*st);
+                        enforcer[(3*nphi + k1)*ntheta_padded + k2] = nfp*cp*sp;
+                        enforcer[(6*nphi + k1)*ntheta_padded + k2] = 0.5*nfp*nfp*(cp*cp - sp*sp);
                     }
                 }
             }
+
+            inline double e(int p, int q, int k1, int k2) const {
+                return enforcer[((3*p + q)*nphi + k1)*ntheta_padded + k2];
+            }
+        };
+
+        BasisTables tables;
+
+        // d^p/dphi^p d^q/dtheta^q of the basis function of the dof (d, m, n),
+        // including the enforcer for clamped dimensions.
+        inline double basis_table(const BasisTables& tab, int d, int m, int n, int p, int q, int k1, int k2) {
+            int M = 2*mpol+1;
+            int N = 2*ntor+1;
+            const double* v = &tab.phi[n*tab.nphi + k1];
+            const double* w = &tab.theta[m*tab.ntheta_padded + k2];
+            int vstride = N*tab.nphi;
+            int wstride = M*tab.ntheta_padded;
+            if(!apply_bc_enforcer(d, n, m))
+                return v[p*vstride] * w[q*wstride];
+            double res = 0.;
+            for (int a = 0; a <= p; ++a)
+                for (int b = 0; b <= q; ++b)
+                    res += binomial(p, a) * binomial(q, b) * v[(p-a)*vstride] * w[(q-b)*wstride] * tab.e(a, b, k1, k2);
+            return res;
         }
 
-        void dgamma_by_dcoeff_impl(Array& data) override {
-#pragma omp parallel for
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    int counter = 0;
+        // The derivative d^dphi/dphi^dphi d^dtheta/dtheta^dtheta of gamma by
+        // the direct sum on the quadrature points of the tables. For every
+        // phi, the sums over n are computed first, after which the sums over
+        // m are vectorized over theta. For clamped dimensions, the terms with
+        // the enforcer are summed separately and then multiplied by the
+        // derivatives of the enforcer, using the product rule.
+        void gamma_direct(Array& data, const BasisTables& tab, int dphi, int dtheta) {
+            int nphi = tab.nphi;
+            int ntheta = tab.ntheta;
+            int ntp = tab.ntheta_padded;
+            int M = 2*mpol+1;
+            int N = 2*ntor+1;
+            int P = dphi+1;
+            double scale = std::pow(2*M_PI, dphi + dtheta);
+#pragma omp parallel
+            {
+                // G[(d*P + p)*M + m] = \sum_n c_d(m, n) v_n^{(p)}(phi_k1) over
+                // the terms without enforcer, and H the same over the terms
+                // with enforcer
+                vector<double> G(3*P*M), H(3*P*M);
+#pragma omp for
+                for (int k1 = 0; k1 < nphi; ++k1) {
                     for (int d = 0; d < 3; ++d) {
-                        for (int m = 0; m <= 2*mpol; ++m) {
-                            for (int n = 0; n <= 2*ntor; ++n) {
-                                if(skip(d, m, n)) continue;
-                                double wivj = basis_fun(d, n, phi, m, theta);
-                                if(d==0) {
-                                    double dxhat = wivj;
-                                    double dyhat = 0;
-                                    double dx = dxhat * cos(phi) - dyhat * sin(phi);
-                                    double dy = dxhat * sin(phi) + dyhat * cos(phi);
-                                    data(k1, k2, 0, counter) = dx;
-                                    data(k1, k2, 1, counter) = dy;
-                                }else if(d==1) {
-                                    double dxhat = 0;
-                                    double dyhat = wivj;
-                                    double dx = dxhat * cos(phi) - dyhat * sin(phi);
-                                    double dy = dxhat * sin(phi) + dyhat * cos(phi);
-                                    data(k1, k2, 0, counter) = dx;
-                                    data(k1, k2, 1, counter) = dy;
-                                }else {
-                                    double dz = wivj;
-                                    data(k1, k2, 2, counter) = dz;
+                        for (int p = 0; p < P; ++p) {
+                            for (int m = 0; m < M; ++m) {
+                                double g = 0., h = 0.;
+                                for (int n = 0; n < N; ++n) {
+                                    double term = get_coeff(d, m, n) * tab.phi[(p*N + n)*nphi + k1];
+                                    if(apply_bc_enforcer(d, n, m))
+                                        h += term;
+                                    else
+                                        g += term;
                                 }
-                                counter++;
+                                G[(d*P + p)*M + m] = g;
+                                H[(d*P + p)*M + m] = h;
                             }
                         }
                     }
-                }
-            }
-        }
-
-        void dgammadash1_by_dcoeff_impl(Array& data) override {
-#pragma omp parallel for
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    int counter = 0;
-                    for (int d = 0; d < 3; ++d) {
-                        for (int m = 0; m <= 2*mpol; ++m) {
-                            for (int n = 0; n <= 2*ntor; ++n) {
-                                if(skip(d, m, n)) continue;
-                                double wivj = basis_fun(d, n, phi, m, theta);
-                                double wivjdash = basis_fun_dphi(d, n, phi, m, theta);
-                                if(d==0) {
-                                    double dxhat = wivj;
-                                    double dyhat = 0.;
-                                    double dxhatdash = wivjdash;
-                                    double dyhatdash = 0.;
-                                    double dxdash = dxhatdash * cos(phi) - dyhatdash * sin(phi) - dxhat * sin(phi) - dyhat * cos(phi);
-                                    double dydash = dxhatdash * sin(phi) + dyhatdash * cos(phi) + dxhat * cos(phi) - dyhat * sin(phi);
-                                    data(k1, k2, 0, counter) = 2*M_PI*dxdash;
-                                    data(k1, k2, 1, counter) = 2*M_PI*dydash;
-                                }else if(d==1) {
-                                    double dxhat = 0.;
-                                    double dyhat = wivj;
-                                    double dxhatdash = 0.;
-                                    double dyhatdash = wivjdash;
-                                    double dxdash = dxhatdash * cos(phi) - dyhatdash * sin(phi) - dxhat * sin(phi) - dyhat * cos(phi);
-                                    double dydash = dxhatdash * sin(phi) + dyhatdash * cos(phi) + dxhat * cos(phi) - dyhat * sin(phi);
-                                    data(k1, k2, 0, counter) = 2*M_PI*dxdash;
-                                    data(k1, k2, 1, counter) = 2*M_PI*dydash;
-                                }else {
-                                    double dzdash = wivjdash;
-                                    data(k1, k2, 2, counter) = 2*M_PI*dzdash;;
+                    for (int k2 = 0; k2 < ntheta; k2 += harmonic_size) {
+                        // hat[d][p] = d^p/dphi^p d^dtheta/dtheta^dtheta of \hat x, \hat y and z
+                        harmonic_t hat[3][3];
+                        for (int d = 0; d < 3; ++d) {
+                            for (int p = 0; p < P; ++p) {
+                                harmonic_t res(0.);
+                                for (int m = 0; m < M; ++m)
+                                    res += G[(d*P + p)*M + m] * harmonic_load(&tab.theta[(dtheta*M + m)*ntp + k2]);
+                                if(clamped_dims[d]) {
+                                    for (int a = 0; a <= p; ++a) {
+                                        for (int b = 0; b <= dtheta; ++b) {
+                                            if(a == 1 && b == 1) // the enforcer has no mixed derivative
+                                                continue;
+                                            harmonic_t sum(0.);
+                                            for (int m = 0; m <= mpol; ++m)
+                                                sum += H[(d*P + p - a)*M + m] * harmonic_load(&tab.theta[((dtheta - b)*M + m)*ntp + k2]);
+                                            res += (binomial(p, a) * binomial(dtheta, b)) * harmonic_load(&tab.enforcer[((3*a + b)*nphi + k1)*ntp + k2]) * sum;
+                                        }
+                                    }
                                 }
-                                counter++;
+                                hat[d][p] = res;
                             }
                         }
+                        // x = \hat x cos(phi) - \hat y sin(phi), y = \hat x sin(phi) + \hat y cos(phi)
+                        harmonic_t x(0.), y(0.);
+                        for (int q = 0; q < P; ++q) {
+                            double c = binomial(dphi, q);
+                            double cosphi = c * tab.cosphi[(dphi - q)*nphi + k1];
+                            double sinphi = c * tab.sinphi[(dphi - q)*nphi + k1];
+                            x += hat[0][q] * cosphi - hat[1][q] * sinphi;
+                            y += hat[0][q] * sinphi + hat[1][q] * cosphi;
+                        }
+                        for (int l = 0; l < harmonic_size && k2 + l < ntheta; ++l) {
+                            data(k1, k2 + l, 0) = scale * harmonic_lane(x, l);
+                            data(k1, k2 + l, 1) = scale * harmonic_lane(y, l);
+                            data(k1, k2 + l, 2) = scale * harmonic_lane(hat[2][dphi], l);
+                        }
                     }
                 }
             }
         }
 
-        void dgammadash2_by_dcoeff_impl(Array& data) override {
+        // The dense Jacobian of d^dphi/dphi^dphi d^dtheta/dtheta^dtheta gamma
+        // with respect to the dofs, from the tables.
+        void dgamma_by_dcoeff_direct(Array& data, const BasisTables& tab, int dphi, int dtheta) {
+            int nphi = tab.nphi;
+            int ntheta = tab.ntheta;
+            int ndofs = num_dofs();
+            double scale = std::pow(2*M_PI, dphi + dtheta);
 #pragma omp parallel for
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
+            for (int k1 = 0; k1 < nphi; ++k1) {
+                double cosphi[3], sinphi[3];
+                for (int q = 0; q <= dphi; ++q) {
+                    cosphi[q] = scale * binomial(dphi, q) * tab.cosphi[(dphi - q)*nphi + k1];
+                    sinphi[q] = scale * binomial(dphi, q) * tab.sinphi[(dphi - q)*nphi + k1];
+                }
+                for (int k2 = 0; k2 < ntheta; ++k2) {
+                    double* res = &data(k1, k2, 0, 0);
                     int counter = 0;
                     for (int d = 0; d < 3; ++d) {
                         for (int m = 0; m <= 2*mpol; ++m) {
                             for (int n = 0; n <= 2*ntor; ++n) {
                                 if(skip(d, m, n)) continue;
-                                double wivj = basis_fun(d, n, phi, m, theta);
-                                double wivjdash = basis_fun_dtheta(d, n, phi, m, theta);
-                                if(d==0) {
-                                    double dxhat = wivj;
-                                    double dyhat = 0.;
-                                    double dxhatdash = wivjdash;
-                                    double dyhatdash = 0.;
-                                    double dxdash = dxhatdash * cos(phi) - dyhatdash * sin(phi);
-                                    double dydash = dxhatdash * sin(phi) + dyhatdash * cos(phi);
-                                    data(k1, k2, 0, counter) = 2*M_PI*dxdash;
-                                    data(k1, k2, 1, counter) = 2*M_PI*dydash;
-                                }else if(d==1) {
-                                    double dxhat = 0.;
-                                    double dyhat = wivj;
-                                    double dxhatdash = 0.;
-                                    double dyhatdash = wivjdash;
-                                    double dxdash = dxhatdash * cos(phi) - dyhatdash * sin(phi);
-                                    double dydash = dxhatdash * sin(phi) + dyhatdash * cos(phi);
-                                    data(k1, k2, 0, counter) = 2*M_PI*dxdash;
-                                    data(k1, k2, 1, counter) = 2*M_PI*dydash;
-                                }else {
-                                    double dzdash = wivjdash;
-                                    data(k1, k2, 2, counter) = 2*M_PI*dzdash;;
+                                double dx = 0., dy = 0., dz = 0.;
+                                if(d == 2) {
+                                    dz = scale * basis_table(tab, d, m, n, dphi, dtheta, k1, k2);
+                                } else {
+                                    for (int q = 0; q <= dphi; ++q) {
+                                        double b = basis_table(tab, d, m, n, q, dtheta, k1, k2);
+                                        dx += d == 0 ? b * cosphi[q] : -b * sinphi[q];
+                                        dy += d == 0 ? b * sinphi[q] : b * cosphi[q];
+                                    }
                                 }
+                                res[counter] = dx;
+                                res[ndofs + counter] = dy;
+                                res[2*ndofs + counter] = dz;
                                 counter++;
                             }
                         }
@@ -597,50 +626,6 @@ class SurfaceXYZTensorFourier : public Surface<Array> {
             }
         }
 
-    private:
-
-        void build_cache() {
-            cache_basis_fun_phi = xt::zeros<double>({numquadpoints_phi, 2*ntor+1});
-            cache_basis_fun_phi_dash = xt::zeros<double>({numquadpoints_phi, 2*ntor+1});
-            cache_basis_fun_phi_dashdash = xt::zeros<double>({numquadpoints_phi, 2*ntor+1});
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                for (int n = 0; n <= 2*ntor; ++n) {
-                    cache_basis_fun_phi(k1, n)= basis_fun_phi(n, phi);
-                    cache_basis_fun_phi_dash(k1, n) = basis_fun_phi_dash(n, phi);
-                    cache_basis_fun_phi_dashdash(k1, n) = basis_fun_phi_dashdash(n, phi);
-                }
-            }
-            cache_basis_fun_theta = xt::zeros<double>({numquadpoints_theta, 2*mpol+1});
-            cache_basis_fun_theta_dash = xt::zeros<double>({numquadpoints_theta, 2*mpol+1});
-            cache_basis_fun_theta_dashdash = xt::zeros<double>({numquadpoints_theta, 2*mpol+1});
-            for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                double theta  = 2*M_PI*quadpoints_theta[k2];
-                for (int m = 0; m <= 2*mpol; ++m) {
-                    cache_basis_fun_theta(k2, m) = basis_fun_theta(m, theta);
-                    cache_basis_fun_theta_dash(k2, m) = basis_fun_theta_dash(m, theta);
-                    cache_basis_fun_theta_dashdash(k2, m) = basis_fun_theta_dashdash(m, theta);
-                }
-            }
-            cache_enforcer = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta});
-            cache_enforcer_dphi = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta});
-            cache_enforcer_dtheta = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta});
-            cache_enforcer_dphidphi = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta});
-            cache_enforcer_dthetadtheta = xt::zeros<double>({numquadpoints_phi, numquadpoints_theta});
-            for (int k1 = 0; k1 < numquadpoints_phi; ++k1) {
-                double phi  = 2*M_PI*quadpoints_phi[k1];
-                for (int k2 = 0; k2 < numquadpoints_theta; ++k2) {
-                    double theta  = 2*M_PI*quadpoints_theta[k2];
-                    cache_enforcer(k1, k2) = pow(sin(nfp*phi/2), 2) + pow(sin(theta/2), 2);
-                    cache_enforcer_dphi(k1, k2) = nfp*cos(nfp*phi/2)*sin(nfp*phi/2);
-                    cache_enforcer_dphidphi(k1, k2) = nfp*(nfp/2)*(pow(cos(nfp*phi/2),2) - pow(sin(nfp*phi/2),2));
-                    cache_enforcer_dtheta(k1, k2) = cos(theta/2)*sin(theta/2);
-                    cache_enforcer_dthetadtheta(k1, k2) = (1/2)*(pow(cos(theta/2),2) - pow(sin(theta/2),2));
-                }
-            }
-
-        }
-
         inline bool apply_bc_enforcer(int dim, int n, int m) {
             return (clamped_dims[dim] && n<=ntor && m<=mpol);
         }
@@ -652,138 +637,11 @@ class SurfaceXYZTensorFourier : public Surface<Array> {
                 return 1;
         }
 
-        inline double bc_enforcer_dphi_fun(int dim, int n, double phi, int m, double theta){
-            if(apply_bc_enforcer(dim, n, m))
-                return nfp*cos(nfp*phi/2)*sin(nfp*phi/2);
-            else
-                return 0;
-        }
-
-        inline double bc_enforcer_dphidphi_fun(int dim, int n, double phi, int m, double theta){
-            if(apply_bc_enforcer(dim, n, m))
-                return (nfp*nfp/2)*(pow(cos(nfp*phi/2),2) - pow(sin(nfp*phi/2),2));
-            else
-                return 0;
-        }
-
-        inline double bc_enforcer_dtheta_fun(int dim, int n, double phi, int m, double theta){
-            if(apply_bc_enforcer(dim, n, m))
-                return cos(theta/2)*sin(theta/2);
-            else
-                return 0;
-        }
-
-        inline double bc_enforcer_dthetadtheta_fun(int dim, int n, double phi, int m, double theta){
-            if(apply_bc_enforcer(dim, n, m))
-                return (1/2)*(pow(cos(theta/2),2) - pow(sin(theta/2),2));
-            else
-                return 0;
-        }
-
-        inline double basis_fun(int dim, int n, int phiidx, int m, int thetaidx){
-            double fun = cache_basis_fun_phi(phiidx, n)*cache_basis_fun_theta(thetaidx, m);
-            if(apply_bc_enforcer(dim, n, m))
-                fun *= cache_enforcer(phiidx, thetaidx);
-            return fun;
-        }
-
-        inline double basis_fun_dphi(int dim, int n, int phiidx, int m, int thetaidx){
-            double fun_dphi = cache_basis_fun_phi_dash(phiidx, n)*cache_basis_fun_theta(thetaidx, m);
-            if(apply_bc_enforcer(dim, n, m)){
-                double fun = cache_basis_fun_phi(phiidx, n)*cache_basis_fun_theta(thetaidx, m);
-                fun_dphi = fun_dphi*cache_enforcer(phiidx, thetaidx) + fun*cache_enforcer_dphi(phiidx, thetaidx);
-            }
-            return fun_dphi;
-        }
-
-        inline double basis_fun_dphidphi(int dim, int n, int phiidx, int m, int thetaidx){
-            double fun_dphidphi = cache_basis_fun_phi_dashdash(phiidx, n)*cache_basis_fun_theta(thetaidx, m);
-            if(apply_bc_enforcer(dim, n, m)){
-                double fun_dphi = cache_basis_fun_phi_dash(phiidx, n)*cache_basis_fun_theta(thetaidx, m);
-                double fun = cache_basis_fun_phi(phiidx, n)*cache_basis_fun_theta(thetaidx, m);
-                fun_dphidphi = fun_dphidphi*cache_enforcer(phiidx, thetaidx) + 2*fun_dphi*cache_enforcer_dphi(phiidx, thetaidx) \
-                            +  fun*cache_enforcer_dphidphi(phiidx, thetaidx);
-            }
-            return fun_dphidphi;
-        }
-
-        inline double basis_fun_dtheta(int dim, int n, int phiidx, int m, int thetaidx){
-            double fun_dtheta = cache_basis_fun_phi(phiidx, n)*cache_basis_fun_theta_dash(thetaidx, m);
-            if(apply_bc_enforcer(dim, n, m)){
-                double fun = cache_basis_fun_phi(phiidx, n)*cache_basis_fun_theta(thetaidx, m);
-                fun_dtheta = fun_dtheta*cache_enforcer(phiidx, thetaidx) + fun*cache_enforcer_dtheta(phiidx, thetaidx);
-            }
-            return fun_dtheta;
-        }
-
-        inline double basis_fun_dthetadphi(int dim, int n, int phiidx, int m, int thetaidx){
-            double fun_dthetadphi = cache_basis_fun_phi_dash(phiidx, n)*cache_basis_fun_theta_dash(thetaidx, m);
-            if(apply_bc_enforcer(dim, n, m)){
-                double fun_dtheta = cache_basis_fun_phi(phiidx, n)*cache_basis_fun_theta_dash(thetaidx, m);
-                double fun_dphi = cache_basis_fun_phi_dash(phiidx, n)*cache_basis_fun_theta(thetaidx, m);
-                fun_dthetadphi = fun_dthetadphi*cache_enforcer(phiidx, thetaidx) \
-                                + fun_dtheta*cache_enforcer_dphi(phiidx, thetaidx) \
-                                + fun_dphi*cache_enforcer_dtheta(phiidx, thetaidx);
-            }
-            return fun_dthetadphi;
-        }
-
-        inline double basis_fun_dthetadtheta(int dim, int n, int phiidx, int m, int thetaidx){
-          double fun_dthetadtheta = cache_basis_fun_phi(phiidx, n)*cache_basis_fun_theta_dashdash(thetaidx, m);
-          if(apply_bc_enforcer(dim, n, m)){
-              double fun = cache_basis_fun_phi(phiidx, n)*cache_basis_fun_theta(thetaidx, m);
-              double fun_dtheta = cache_basis_fun_phi(phiidx, n)*cache_basis_fun_theta_dash(thetaidx, m);
-              fun_dthetadtheta = fun_dthetadtheta*cache_enforcer(phiidx, thetaidx) \
-                              + 2*fun_dtheta*cache_enforcer_dtheta(phiidx, thetaidx) \
-                              + fun*cache_enforcer_dthetadtheta(phiidx, thetaidx);
-          }
-          return fun_dthetadtheta;
-        }
-
         inline double basis_fun(int dim, int n, double phi, int m, double theta){
             double bc_enforcer = bc_enforcer_fun(dim, n, phi, m, theta);
             return basis_fun_phi(n, phi) * basis_fun_theta(m, theta) * bc_enforcer;
         }
 
-        inline double basis_fun_dphi(int dim, int n, double phi, int m, double theta){
-            double bc_enforcer =  bc_enforcer_fun(dim, n, phi, m, theta);
-            double bc_enforcer_dphi = bc_enforcer_dphi_fun(dim, n, phi, m, theta);
-            return basis_fun_phi_dash(n, phi) * basis_fun_theta(m, theta) * bc_enforcer + basis_fun_phi(n, phi) * basis_fun_theta(m, theta) * bc_enforcer_dphi;
-        }
-
-        inline double basis_fun_dtheta(int dim, int n, double phi, int m, double theta){
-            double bc_enforcer =  bc_enforcer_fun(dim, n, phi, m, theta);
-            double bc_enforcer_dtheta = bc_enforcer_dtheta_fun(dim, n, phi, m, theta);
-            return basis_fun_phi(n, phi) * basis_fun_theta_dash(m, theta) * bc_enforcer + basis_fun_phi(n, phi) * basis_fun_theta(m, theta) * bc_enforcer_dtheta;
-        }
-
-        inline double basis_fun_dthetadtheta(int dim, int n, double phi, int m, double theta){
-            double bc_enforcer =  bc_enforcer_fun(dim, n, phi, m, theta);
-            double bc_enforcer_dtheta = bc_enforcer_dtheta_fun(dim, n, phi, m, theta);
-            double bc_enforcer_dthetadtheta = bc_enforcer_dthetadtheta_fun(dim, n, phi, m, theta);
-            return basis_fun_phi(n, phi) * (basis_fun_theta_dashdash(m, theta) * bc_enforcer \
-                 + 2* basis_fun_theta_dash(m, theta) * bc_enforcer_dtheta \
-                 +    basis_fun_theta(m, theta) * bc_enforcer_dthetadtheta);
-        }
-
-        inline double basis_fun_dphidphi(int dim, int n, double phi, int m, double theta){
-            double bc_enforcer =  bc_enforcer_fun(dim, n, phi, m, theta);
-            double bc_enforcer_dphi = bc_enforcer_dphi_fun(dim, n, phi, m, theta);
-            double bc_enforcer_dphidphi = bc_enforcer_dphidphi_fun(dim, n, phi, m, theta);
-            return basis_fun_theta(m, theta) * (basis_fun_phi_dashdash(n, phi) * bc_enforcer \
-                  + 2*basis_fun_phi_dash(n, phi)*bc_enforcer_dphi \
-                  + basis_fun_phi(n,phi) * bc_enforcer_dphidphi);
-        }
-
-        inline double basis_fun_dthetadphi(int dim, int n, double phi, int m, double theta){
-            double bc_enforcer =  bc_enforcer_fun(dim, n, phi, m, theta);
-            double bc_enforcer_dtheta = bc_enforcer_dtheta_fun(dim, n, phi, m, theta);
-            double bc_enforcer_dphi = bc_enforcer_dphi_fun(dim, n, phi, m, theta);
-            return basis_fun_phi_dash(n, phi) * basis_fun_theta_dash(m, theta) * bc_enforcer \
-                 +  basis_fun_phi(n, phi) * basis_fun_theta_dash(m, theta) * bc_enforcer_dphi \
-                 +  basis_fun_phi_dash(n, phi) * basis_fun_theta(m, theta) * bc_enforcer_dtheta;
-        }
-
         inline double basis_fun_phi(int n, double phi){
             if(n <= ntor)
                 return cos(nfp*n*phi);
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+// Control over the threads that run the OpenMP kernels of simsoptpp.
+//
+// The number of threads is a per thread setting in OpenMP, so
+// set_num_threads only affects the kernels that are called from the same
+// (python) thread afterwards. Together with bind_threads, this allows to run
+// two independent optimizations in one process, e.g. one per socket, without
+// oversubscribing the cores.
+//
+// Large arrays that are read by all threads are allocated with
+// first_touch_zeros. Their pages are then placed on the NUMA nodes of the
+// threads that work on them in a static schedule, instead of all on the node
+// of the allocating thread.
+
+inline int get_num_threads() {
+#if defined(_OPENMP)
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+inline void set_num_threads(int nthreads) {
+    if(nthreads < 1)
+        throw std::invalid_argument("The number of threads needs to be positive.");
+#if defined(_OPENMP)
+    omp_set_num_threads(nthreads);
+#endif
+}
+
+// Restricts the calling thread and the threads of its parallel regions to
+// the given cpus. Threads that OpenMP creates later inherit the restriction.
+inline void bind_threads(const std::vector<int>& cpus) {
+#if defined(__linux__)
+    if(cpus.empty())
+        throw std::invalid_argument("At least one cpu is required.");
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if(cpu < 0 || cpu >= CPU_SETSIZE)
+            throw std::invalid_argument("Invalid cpu number.");
+        CPU_SET(cpu, &set);
+    }
+    if(sched_setaffinity(0, sizeof(set), &set) != 0)
+        throw std::runtime_error("The threads could not be bound to the given cpus.");
+#pragma omp parallel
+    sched_setaffinity(0, sizeof(set), &set);
+#else
+    throw std::runtime_error("Binding threads to cpus is only supported on Linux.");
+#endif
+}
+
+// Sets n entries to value, in parallel with a static schedule for large
+// arrays, so that the pages are first touched by the threads that use them.
+inline void first_touch_fill(double* data, std::size_t n, double value) {
+    // smaller arrays are not worth spreading over several nodes
+    constexpr std::size_t min_parallel_size = std::size_t(1) << 17;
+    if(n < min_parallel_size) {
+        std::fill(data, data + n, value);
+        return;
+    }
+    std::ptrdiff_t size = n;
+#pragma omp parallel for schedule(static)
+    for (std::ptrdiff_t i = 0; i < size; ++i)
+        data[i] = value;
+}
+
+// Same as xt::zeros<double>(shape), but see first_touch_fill.
+template<class Array, class Shape>
+Array first_touch_zeros(const Shape& shape) {
+    Array res = Array::from_shape(shape);
+    first_touch_fill(res.data(), res.size(), 0.);
+    return res;
+}
@@ -1,11 +1,19 @@
 #include <memory>
 #include <vector>
 #include <functional>
+#include <algorithm>
+#include <chrono>
 #include "magneticfield.h"
 #include "boozermagneticfield.h"
 #include <cassert>
 #include <stdexcept>
+#include <exception>
 #include "tracing.h"
+#include "perf_counters.h"
+#include "gil.h"
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 using std::shared_ptr;
 using std::vector;
 using std::tuple;
@@ -16,10 +24,8 @@ using std::function;
 #include "xtensor-python/pytensor.hpp"     // Numpy bindings
 typedef xt::pyarray<double> Array;
 
-#include <boost/math/tools/roots.hpp>
 #include <boost/numeric/odeint.hpp>
 //#include <boost/numeric/odeint/stepper/bulirsch_stoer_dense_out.hpp>
-using boost::math::tools::toms748_solve;
 using namespace boost::numeric::odeint;
 
 template<template<class, std::size_t, xt::layout_type> class T>
@@ -34,7 +40,8 @@ class GuidingCenterVacuumRHS {
      */
     private:
         std::array<double, 3> BcrossGradAbsB = {0., 0., 0.};
-        typename MagneticField<T>::Tensor2 rphiz = xt::zeros<double>({1, 3});
+        std::array<double, 3> B = {0., 0., 0.};
+        std::array<double, 3> GradAbsB = {0., 0., 0.};
         shared_ptr<MagneticField<T>> field;
         double m, q, mu;
     public:
@@ -47,33 +54,88 @@ class GuidingCenterVacuumRHS {
 
             }
 
+        void set_mu(double mu_) {
+            mu = mu_;
+        }
+
         void operator()(const State &ys, array<double, 4> &dydt,
                 const double t) {
+            SIMSOPT_PERF_COUNT(tracing_rhs, 1, 1);
             double x = ys[0];
             double y = ys[1];
             double z = ys[2];
             double v_par = ys[3];
 
-            rphiz(0, 0) = std::sqrt(x*x+y*y);
-            rphiz(0, 1) = std::atan2(y, x);
-            if(rphiz(0, 1) < 0)
-                rphiz(0, 1) += 2*M_PI;
-            rphiz(0, 2) = z;
+            field->evaluate_point(x, y, z, B.data(), GradAbsB.data());
+            double AbsB = std::sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+            BcrossGradAbsB[0] = (B[1] * GradAbsB[2]) - (B[2] * GradAbsB[1]);
+            BcrossGradAbsB[1] = (B[2] * GradAbsB[0]) - (B[0] * GradAbsB[2]);
+            BcrossGradAbsB[2] = (B[0] * GradAbsB[1]) - (B[1] * GradAbsB[0]);
+            double v_perp2 = 2*mu*AbsB;
+            double fak1 = (v_par/AbsB);
+            double fak2 = (m/(q*pow(AbsB, 3)))*(0.5*v_perp2 + v_par*v_par);
+            dydt[0] = fak1*B[0] + fak2*BcrossGradAbsB[0];
+            dydt[1] = fak1*B[1] + fak2*BcrossGradAbsB[1];
+            dydt[2] = fak1*B[2] + fak2*BcrossGradAbsB[2];
+            dydt[3] = -mu*(B[0]*GradAbsB[0] + B[1]*GradAbsB[1] + B[2]*GradAbsB[2])/AbsB;
+        }
+};
+
+template<template<class, std::size_t, xt::layout_type> class T>
+class GuidingCenterVacuumBatchRHS {
+    /*
+     * Same equations as GuidingCenterVacuumRHS, but evaluated for a block of
+     * particles at once: the field is evaluated at the positions of all
+     * active particles with a single call to set_points_cyl, so that fields
+     * such as InterpolatedField can process them together.
+     */
+    private:
+        typename MagneticField<T>::Tensor2 rphiz = xt::zeros<double>({1, 3});
+        shared_ptr<MagneticField<T>> field;
+        double m, q;
+        vector<double> mu;
+    public:
+        static constexpr int Size = 4;
+        using State = std::array<double, Size>;
+
+        GuidingCenterVacuumBatchRHS(shared_ptr<MagneticField<T>> field, double m, double q, vector<double> mu)
+            : field(field), m(m), q(q), mu(mu) {
+
+            }
+
+        void operator()(const vector<int>& lanes, const vector<State>& ys, vector<State>& dydt) {
+            int n = lanes.size();
+            SIMSOPT_PERF_COUNT(tracing_rhs, 1, n);
+            if(rphiz.shape(0) != n)
+                rphiz = xt::zeros<double>({n, 3});
+            for (int i = 0; i < n; ++i) {
+                const State& y = ys[lanes[i]];
+                rphiz(i, 0) = std::sqrt(y[0]*y[0]+y[1]*y[1]);
+                rphiz(i, 1) = std::atan2(y[1], y[0]);
+                if(rphiz(i, 1) < 0)
+                    rphiz(i, 1) += 2*M_PI;
+                rphiz(i, 2) = y[2];
+            }
 
             field->set_points_cyl(rphiz);
             auto& GradAbsB = field->GradAbsB_ref();
             auto& B = field->B_ref();
-            double AbsB = field->AbsB_ref()(0);
-            BcrossGradAbsB[0] = (B(0, 1) * GradAbsB(0, 2)) - (B(0, 2) * GradAbsB(0, 1));
-            BcrossGradAbsB[1] = (B(0, 2) * GradAbsB(0, 0)) - (B(0, 0) * GradAbsB(0, 2));
-            BcrossGradAbsB[2] = (B(0, 0) * GradAbsB(0, 1)) - (B(0, 1) * GradAbsB(0, 0));
-            double v_perp2 = 2*mu*AbsB;
-            double fak1 = (v_par/AbsB);
-            double fak2 = (m/(q*pow(AbsB, 3)))*(0.5*v_perp2 + v_par*v_par);
-            dydt[0] = fak1*B(0, 0) + fak2*BcrossGradAbsB[0];
-            dydt[1] = fak1*B(0, 1) + fak2*BcrossGradAbsB[1];
-            dydt[2] = fak1*B(0, 2) + fak2*BcrossGradAbsB[2];
-            dydt[3] = -mu*(B(0, 0)*GradAbsB(0, 0) + B(0, 1)*GradAbsB(0, 1) + B(0, 2)*GradAbsB(0, 2))/AbsB;
+            auto& AbsBs = field->AbsB_ref();
+            for (int i = 0; i < n; ++i) {
+                int l = lanes[i];
+                double v_par = ys[l][3];
+                double AbsB = AbsBs(i, 0);
+                double BcrossGradAbsB0 = (B(i, 1) * GradAbsB(i, 2)) - (B(i, 2) * GradAbsB(i, 1));
+                double BcrossGradAbsB1 = (B(i, 2) * GradAbsB(i, 0)) - (B(i, 0) * GradAbsB(i, 2));
+                double BcrossGradAbsB2 = (B(i, 0) * GradAbsB(i, 1)) - (B(i, 1) * GradAbsB(i, 0));
+                double v_perp2 = 2*mu[l]*AbsB;
+                double fak1 = (v_par/AbsB);
+                double fak2 = (m/(q*pow(AbsB, 3)))*(0.5*v_perp2 + v_par*v_par);
+                dydt[l][0] = fak1*B(i, 0) + fak2*BcrossGradAbsB0;
+                dydt[l][1] = fak1*B(i, 1) + fak2*BcrossGradAbsB1;
+                dydt[l][2] = fak1*B(i, 2) + fak2*BcrossGradAbsB2;
+                dydt[l][3] = -mu[l]*(B(i, 0)*GradAbsB(i, 0) + B(i, 1)*GradAbsB(i, 1) + B(i, 2)*GradAbsB(i, 2))/AbsB;
+            }
         }
 };
 
@@ -91,7 +153,7 @@ class GuidingCenterVacuumBoozerRHS {
      *
      */
     private:
-        typename BoozerMagneticField<T>::Tensor2 stz = xt::zeros<double>({1, 3});
+        BoozerPointValues values;
         shared_ptr<BoozerMagneticField<T>> field;
         double m, q, mu;
     public:
@@ -105,20 +167,17 @@ class GuidingCenterVacuumBoozerRHS {
 
         void operator()(const State &ys, array<double, 4> &dydt,
                 const double t) {
+            SIMSOPT_PERF_COUNT(tracing_rhs, 1, 1);
             double v_par = ys[3];
 
-            stz(0, 0) = ys[0];
-            stz(0, 1) = ys[1];
-            stz(0, 2) = ys[2];
-
-            field->set_points(stz);
+            field->evaluate_point(ys[0], ys[1], ys[2], values, BoozerPointValues::vacuum);
             auto psi0 = field->psi0;
-            double modB = field->modB_ref()(0);
-            double G = field->G_ref()(0);
-            double iota = field->iota_ref()(0);
-            double dmodBds = field->modB_derivs_ref()(0);
-            double dmodBdtheta = field->modB_derivs_ref()(1);
-            double dmodBdzeta = field->modB_derivs_ref()(2);
+            double modB = values.modB;
+            double G = values.G;
+            double iota = values.iota;
+            double dmodBds = values.dmodBds;
+            double dmodBdtheta = values.dmodBdtheta;
+            double dmodBdzeta = values.dmodBdzeta;
             double v_perp2 = 2*mu*modB;
             double fak1 = m*v_par*v_par/modB + m*mu;
 
@@ -145,7 +204,7 @@ class GuidingCenterNoKBoozerRHS {
      *  with the limit K = 0.
      */
     private:
-        typename BoozerMagneticField<T>::Tensor2 stz = xt::zeros<double>({1, 3});
+        BoozerPointValues values;
         shared_ptr<BoozerMagneticField<T>> field;
         double m, q, mu;
     public:
@@ -159,23 +218,20 @@ class GuidingCenterNoKBoozerRHS {
 
         void operator()(const State &ys, array<double, 4> &dydt,
                 const double t) {
+            SIMSOPT_PERF_COUNT(tracing_rhs, 1, 1);
             double v_par = ys[3];
 
-            stz(0, 0) = ys[0];
-            stz(0, 1) = ys[1];
-            stz(0, 2) = ys[2];
-
-            field->set_points(stz);
+            field->evaluate_point(ys[0], ys[1], ys[2], values, BoozerPointValues::noK);
             auto psi0 = field->psi0;
-            double modB = field->modB_ref()(0);
-            double G = field->G_ref()(0);
-            double I = field->I_ref()(0);
-            double dGdpsi = field->dGds_ref()(0)/psi0;
-            double dIdpsi = field->dIds_ref()(0)/psi0;
-            double iota = field->iota_ref()(0);
-            double dmodBdpsi = field->modB_derivs_ref()(0)/psi0;
-            double dmodBdtheta = field->modB_derivs_ref()(1);
-            double dmodBdzeta = field->modB_derivs_ref()(2);
+            double modB = values.modB;
+            double G = values.G;
+            double I = values.I;
+            double dGdpsi = values.dGds/psi0;
+            double dIdpsi = values.dIds/psi0;
+            double iota = values.iota;
+            double dmodBdpsi = values.dmodBds/psi0;
+            double dmodBdtheta = values.dmodBdtheta;
+            double dmodBdzeta = values.dmodBdzeta;
             double v_perp2 = 2*mu*modB;
             double fak1 = m*v_par*v_par/modB + m*mu;
             double D = ((q + m*v_par*dIdpsi/modB)*G - (-q*iota + m*v_par*dGdpsi/modB)*I)/iota;
@@ -204,7 +260,7 @@ class GuidingCenterBoozerRHS {
      *  :math:`m` is the mass, and :math:`v_\perp = 2\mu|B|`.
      */
     private:
-        typename BoozerMagneticField<T>::Tensor2 stz = xt::zeros<double>({1, 3});
+        BoozerPointValues values;
         shared_ptr<BoozerMagneticField<T>> field;
         double m, q, mu;
     public:
@@ -217,29 +273,26 @@ class GuidingCenterBoozerRHS {
 
         void operator()(const State &ys, array<double, 4> &dydt,
                 const double t) {
+            SIMSOPT_PERF_COUNT(tracing_rhs, 1, 1);
             double v_par = ys[3];
 
-            stz(0, 0) = ys[0];
-            stz(0, 1) = ys[1];
-            stz(0, 2) = ys[2];
-
             assert(ys[0]>0);
 
-            field->set_points(stz);
+            field->evaluate_point(ys[0], ys[1], ys[2], values, BoozerPointValues::full);
             auto psi0 = field->psi0;
-            double modB = field->modB_ref()(0);
-            double K = field->K_ref()(0);
-            double dKdtheta = field->K_derivs_ref()(0);
-            double dKdzeta = field->K_derivs_ref()(1);
-
-            double G = field->G_ref()(0);
-            double I = field->I_ref()(0);
-            double dGdpsi = field->dGds_ref()(0)/psi0;
-            double dIdpsi = field->dIds_ref()(0)/psi0;
-            double iota = field->iota_ref()(0);
-            double dmodBdpsi = field->modB_derivs_ref()(0)/psi0;
-            double dmodBdtheta = field->modB_derivs_ref()(1);
-            double dmodBdzeta = field->modB_derivs_ref()(2);
+            double modB = values.modB;
+            double K = values.K;
+            double dKdtheta = values.dKdtheta;
+            double dKdzeta = values.dKdzeta;
+
+            double G = values.G;
+            double I = values.I;
+            double dGdpsi = values.dGds/psi0;
+            double dIdpsi = values.dIds/psi0;
+            double iota = values.iota;
+            double dmodBdpsi = values.dmodBds/psi0;
+            double dmodBdtheta = values.dmodBdtheta;
+            double dmodBdzeta = values.dmodBdzeta;
             double v_perp2 = 2*mu*modB;
             double fak1 = m*v_par*v_par/modB + m*mu; // dHdB
             double C = -m*v_par*(dKdzeta-dGdpsi)/modB - q*iota;
@@ -262,7 +315,7 @@ class FullorbitRHS {
     // and hence \dot\dot (x, y, z) = (q/m)* \dot(x,y,z) \cross B
     // where we used v = \dot (x,y,z)
     private:
-        typename MagneticField<T>::Tensor2 rphiz = xt::zeros<double>({1, 6});
+        std::array<double, 3> Bxyz = {0., 0., 0.};
         shared_ptr<MagneticField<T>> field;
         const double qoverm;
     public:
@@ -273,24 +326,29 @@ class FullorbitRHS {
             : field(field), qoverm(q/m) {
 
             }
+
+        double charge_over_mass() const {
+            return qoverm;
+        }
+
+        // Magnetic field at the point xyz, used by the Boris scheme.
+        void B(const array<double, 3>& xyz, array<double, 3>& B) {
+            field->evaluate_point(xyz[0], xyz[1], xyz[2], B.data(), nullptr);
+        }
+
         void operator()(const array<double, 6> &ys, array<double, 6> &dydt,
                 const double t) {
+            SIMSOPT_PERF_COUNT(tracing_rhs, 1, 1);
             double x = ys[0];
             double y = ys[1];
             double z = ys[2];
             double vx = ys[3];
             double vy = ys[4];
             double vz = ys[5];
-            rphiz(0, 0) = std::sqrt(x*x+y*y);
-            rphiz(0, 1) = std::atan2(y, x);
-            if(rphiz(0, 1) < 0)
-                rphiz(0, 1) += 2*M_PI;
-            rphiz(0, 2) = z;
-            field->set_points_cyl(rphiz);
-            auto& B = field->B_ref();
-            double Bx = B(0, 0);
-            double By = B(0, 1);
-            double Bz = B(0, 2);
+            field->evaluate_point(x, y, z, Bxyz.data(), nullptr);
+            double Bx = Bxyz[0];
+            double By = Bxyz[1];
+            double Bz = Bxyz[2];
             dydt[0] = vx;
             dydt[1] = vy;
             dydt[2] = vz;
@@ -302,7 +360,6 @@ class FullorbitRHS {
 template<template<class, std::size_t, xt::layout_type> class T>
 class FieldlineRHS {
     private:
-        typename MagneticField<T>::Tensor2 rphiz = xt::zeros<double>({1, 3});
         shared_ptr<MagneticField<T>> field;
     public:
         static constexpr int Size = 3;
@@ -314,19 +371,11 @@ class FieldlineRHS {
             }
         void operator()(const array<double, 3> &ys, array<double, 3> &dydt,
                 const double t) {
+            SIMSOPT_PERF_COUNT(tracing_rhs, 1, 1);
             double x = ys[0];
             double y = ys[1];
             double z = ys[2];
-            rphiz(0, 0) = std::sqrt(x*x+y*y);
-            rphiz(0, 1) = std::atan2(y, x);
-            if(rphiz(0, 1) < 0)
-                rphiz(0, 1) += 2*M_PI;
-            rphiz(0, 2) = z;
-            field->set_points_cyl(rphiz);
-            auto& B = field->B_ref();
-            dydt[0] = B(0, 0);
-            dydt[1] = B(0, 1);
-            dydt[2] = B(0, 2);
+            field->evaluate_point(x, y, z, dydt.data(), nullptr);
         }
 };
 
@@ -364,29 +413,452 @@ std::array<double, m+n> join(const std::array<double, m>& a, const std::array<do
 
 
 
-template<class RHS>
+// Stores the states of a trajectory that are selected by a TrajectoryOutput.
+// calc_state(t, y) has to evaluate the dense output of the integrator on the
+// last accepted step.
+template<std::size_t Size>
+class TrajectoryRecorder {
+    private:
+        vector<array<double, Size+1>>& res;
+        TrajectoryOutput output;
+        long nsample = 1;
+        array<double, Size> temp;
+
+        void push(double t, const array<double, Size>& y) {
+            res.push_back(join<1, Size>({t}, y));
+        }
+
+        // stores the samples with times in (t_last_step, tend), or (t_last_step, tend] if inclusive is true
+        template<class F>
+        void sample_until(double tend, bool inclusive, F&& calc_state) {
+            while(nsample*output.dt < tend || (inclusive && nsample*output.dt == tend)) {
+                double ts = nsample*output.dt;
+                calc_state(ts, temp);
+                push(ts, temp);
+                nsample++;
+            }
+        }
+
+    public:
+        TrajectoryRecorder(vector<array<double, Size+1>>& res, TrajectoryOutput output, long nsample=1) : res(res), output(output), nsample(nsample) {
+            if(output.mode == TrajectoryOutput::every_n && output.every < 1)
+                throw std::invalid_argument("TrajectoryOutput: every needs to be positive.");
+            if(output.mode == TrajectoryOutput::sampled && !(output.dt > 0))
+                throw std::invalid_argument("TrajectoryOutput: dt needs to be positive.");
+        }
+
+        // index of the next sample for TrajectoryOutput::sampled
+        long next_sample() const { return nsample; }
+
+        void initial(const array<double, Size>& y) {
+            if(output.mode != TrajectoryOutput::none)
+                push(0., y);
+        }
+
+        // Called after the accepted step number iter that ended at time t in
+        // state y, if the integration continues afterwards.
+        template<class F>
+        void step(int iter, double t, const array<double, Size>& y, F&& calc_state) {
+            if(output.mode == TrajectoryOutput::full)
+                push(t, y);
+            else if(output.mode == TrajectoryOutput::every_n && iter % output.every == 0)
+                push(t, y);
+            else if(output.mode == TrajectoryOutput::sampled)
+                sample_until(t, true, calc_state);
+        }
+
+        // Called once at the end of the integration. If stop is false, the
+        // last step passed tmax, otherwise a stopping criterion was satisfied
+        // in state y at time t.
+        template<class F>
+        void final(bool stop, double t, const array<double, Size>& y, double tmax, F&& calc_state) {
+            if(output.mode == TrajectoryOutput::none)
+                return;
+            if(!stop) {
+                if(output.mode == TrajectoryOutput::sampled)
+                    sample_until(tmax, false, calc_state);
+                calc_state(tmax, temp);
+                push(tmax, temp);
+            } else if(output.mode != TrajectoryOutput::full) {
+                if(output.mode == TrajectoryOutput::sampled)
+                    sample_until(t, false, calc_state);
+                push(t, y);
+            }
+        }
+};
+
+// Real roots of c3 s^3 + c2 s^2 + c1 s + c0, written to roots. The number of
+// roots is returned. Polynomials with (relatively) negligible leading
+// coefficients are treated as quadratic or linear.
+int real_roots_cubic(double c3, double c2, double c1, double c0, double* roots) {
+    double scale = std::abs(c0) + std::abs(c1) + std::abs(c2) + std::abs(c3);
+    if(scale == 0.)
+        return 0;
+    if(std::abs(c3) <= 1e-10*scale) {
+        if(std::abs(c2) <= 1e-10*scale) {
+            if(c1 == 0.)
+                return 0;
+            roots[0] = -c0/c1;
+            return 1;
+        }
+        double disc = c1*c1 - 4*c2*c0;
+        if(disc < 0)
+            return 0;
+        double q = -0.5*(c1 + std::copysign(std::sqrt(disc), c1));
+        if(q == 0.) {
+            roots[0] = 0.;
+            return 1;
+        }
+        roots[0] = q/c2;
+        roots[1] = c0/q;
+        return 2;
+    }
+    double b = c2/c3, c = c1/c3, d = c0/c3;
+    // with s = u - b/3 the cubic becomes u^3 + p u + q
+    double shift = -b/3;
+    double p = c - b*b/3;
+    double q = 2*b*b*b/27 - b*c/3 + d;
+    double disc = 0.25*q*q + p*p*p/27;
+    if(disc > 0) {
+        double A = -std::copysign(std::cbrt(0.5*std::abs(q) + std::sqrt(disc)), q);
+        roots[0] = (A == 0. ? 0. : A - p/(3*A)) + shift;
+        return 1;
+    }
+    if(p == 0.) {
+        roots[0] = shift;
+        return 1;
+    }
+    double m = 2*std::sqrt(-p/3);
+    double theta = std::acos(std::max(-1., std::min(1., 3*q/(p*m))))/3;
+    for (int k = 0; k < 3; ++k)
+        roots[k] = m*std::cos(theta - 2*M_PI*k/3) + shift;
+    return 3;
+}
+
+// Finds the crossings of a trajectory with the planes phi = phis[i] + 2 pi k.
+// The angles are sorted once, so that the planes that are crossed in a step
+// are found with a binary search instead of a loop over all of them. For a
+// step with crossings, phi is approximated by the cubic polynomial that
+// interpolates the dense output at four equidistant times of the step. Its
+// roots are computed in closed form and polished with Newton iterations on
+// the dense output, using the slope of the cubic.
+template<std::size_t Size>
+class PhiPlaneCrossings {
+    private:
+        typedef array<double, Size> State;
+        vector<double> angles, phis;
+        vector<int> idxs;
+        double tol;
+        static constexpr int maxit = 20;
+
+    public:
+        PhiPlaneCrossings(const vector<double>& phis_in, double tol) : tol(tol) {
+            vector<int> order(phis_in.size());
+            for (int i = 0; i < order.size(); ++i)
+                order[i] = i;
+            auto reduce = [](double phi) { return phi - std::floor(phi/(2*M_PI))*2*M_PI; };
+            std::stable_sort(order.begin(), order.end(),
+                    [&phis_in, &reduce](int i, int j) { return reduce(phis_in[i]) < reduce(phis_in[j]); });
+            for (int i : order) {
+                angles.push_back(reduce(phis_in[i]));
+                phis.push_back(phis_in[i]);
+                idxs.push_back(i);
+            }
+        }
+
+        // Calls hit(t, i, state) for every plane phis[i] + 2 pi k in the half
+        // open interval between phi_last and phi_current, in the order in
+        // which they are crossed during the step from tlast to tcurrent.
+        // calc_state(t, state) has to evaluate the dense output on that step.
+        // If flux is true, the angle is the third component of the state,
+        // otherwise it is computed from the first two.
+        template<class F, class G>
+        void find(double tlast, double tcurrent, double phi_last, double phi_current, bool flux, F&& calc_state, G&& hit) const {
+            if(angles.size() == 0 || phi_last == phi_current)
+                return;
+            State temp;
+            auto phase = [flux, phi_last](const State& state) {
+                return flux ? state[2] : get_phi(state[0], state[1], phi_last);
+            };
+            double lo = std::min(phi_last, phi_current);
+            double hi = std::max(phi_last, phi_current);
+            bool forward = phi_current > phi_last;
+            double h = tcurrent - tlast;
+            bool have_cubic = false;
+            double c[4];
+            long mlo = std::floor(lo/(2*M_PI));
+            long mhi = std::floor(hi/(2*M_PI));
+            for (long m = forward ? mlo : mhi; forward ? m <= mhi : m >= mlo; m += forward ? 1 : -1) {
+                int first = std::upper_bound(angles.begin(), angles.end(), lo - m*2*M_PI) - angles.begin();
+                int last = std::upper_bound(angles.begin(), angles.end(), hi - m*2*M_PI) - angles.begin();
+                for (int j = forward ? first : last-1; forward ? j < last : j >= first; j += forward ? 1 : -1) {
+                    double phi_shift = phis[j] + (m - std::floor(phis[j]/(2*M_PI)))*2*M_PI;
+                    if(!have_cubic) {
+                        double f0 = phi_last, f3 = phi_current;
+                        calc_state(tlast + h/3, temp);
+                        double f1 = phase(temp);
+                        calc_state(tlast + 2*h/3, temp);
+                        double f2 = phase(temp);
+                        c[0] = f0;
+                        c[1] = 0.5*(-11*f0 + 18*f1 - 9*f2 + 2*f3);
+                        c[2] = 0.5*(18*f0 - 45*f1 + 36*f2 - 9*f3);
+                        c[3] = 0.5*(-9*f0 + 27*f1 - 27*f2 + 9*f3);
+                        have_cubic = true;
+                    }
+                    hit(root(tlast, h, phi_last - phi_shift, phi_current - phi_shift, phi_shift, c, phase, calc_state, temp), idxs[j], temp);
+                }
+            }
+        }
+
+    private:
+        // Returns the time of the crossing of phi_shift and leaves the state
+        // at that time in temp. ga and gb are the differences to phi_shift at
+        // the beginning and the end of the step.
+        template<class P, class F>
+        double root(double tlast, double h, double ga, double gb, double phi_shift, const double* c, P& phase, F& calc_state, State& temp) const {
+            double t;
+            if(ga == 0. || gb == 0.) {
+                t = ga == 0. ? tlast : tlast + h;
+                calc_state(t, temp);
+                return t;
+            }
+            double roots[3];
+            int nroots = real_roots_cubic(c[3], c[2], c[1], c[0] - phi_shift, roots);
+            double s = ga/(ga-gb);
+            for (int k = 0, found = 0; k < nroots; ++k) {
+                if(roots[k] >= 0. && roots[k] <= 1. && (!found || roots[k] < s)) {
+                    s = roots[k];
+                    found = 1;
+                }
+            }
+            double ta = tlast, tb = tlast + h;
+            t = tlast + s*h;
+            for (int it = 0; it < maxit; ++it) {
+                calc_state(t, temp);
+                double g = phase(temp) - phi_shift;
+                if(g == 0.)
+                    return t;
+                if((g < 0) == (ga < 0))
+                    ta = t;
+                else
+                    tb = t;
+                s = (t - tlast)/h;
+                double slope = (c[1] + s*(2*c[2] + s*3*c[3]))/h;
+                double tnew = t - g/slope;
+                if(!(tnew > ta && tnew < tb))
+                    tnew = 0.5*(ta + tb);
+                bool converged = std::abs(tnew - t) <= tol*std::max(std::abs(t), h);
+                t = tnew;
+                if(converged)
+                    break;
+            }
+            calc_state(t, temp);
+            return t;
+        }
+};
+
+// The steppers below share the interface of the dense output steppers of
+// boost::odeint: do_step advances the state by one step and returns the
+// interval that was covered, and calc_state evaluates the solution on that
+// interval.
+
+template<class State>
+class Dopri5Stepper {
+    private:
+        typedef typename boost::numeric::odeint::result_of::make_dense_output<runge_kutta_dopri5<State>>::type dense_stepper_type;
+        dense_stepper_type dense;
+    public:
+        Dopri5Stepper(double tol, double dtmax) : dense(make_dense_output(tol, tol, dtmax, runge_kutta_dopri5<State>())) {}
+        void initialize(const State& y, double t, double dt) { dense.initialize(y, t, dt); }
+        template<class RHS>
+        pair<double, double> do_step(RHS& rhs) { return dense.do_step(std::ref(rhs)); }
+        double current_time() const { return dense.current_time(); }
+        double current_time_step() const { return dense.current_time_step(); }
+        const State& current_state() const { return dense.current_state(); }
+        void calc_state(double t, State& state) const { dense.calc_state(t, state); }
+};
+
+// Cubic Hermite interpolation of the states y0 at t0 and y1 at t1 = t0 + h
+// with derivatives f0 and f1.
+template<class State>
+void hermite_state(double t, double t0, double h, const State& y0, const State& f0, const State& y1, const State& f1, State& state) {
+    double s = (t-t0)/h;
+    double h00 = (1+2*s)*(1-s)*(1-s);
+    double h10 = s*(1-s)*(1-s);
+    double h01 = s*s*(3-2*s);
+    double h11 = s*s*(s-1);
+    for (int i = 0; i < state.size(); ++i)
+        state[i] = h00*y0[i] + h10*h*f0[i] + h01*y1[i] + h11*h*f1[i];
+}
+
+// Classical fourth order Runge-Kutta method with a fixed step. The derivative
+// at the end of a step is reused as the first stage of the next one, so every
+// step takes four evaluations of the right hand side.
+template<class State>
+class RK4Stepper {
+    private:
+        double dt, t = 0, t_old = 0;
+        State y, y_old, dydt, dydt_old, k2, k3, k4, temp;
+        bool have_dydt = false;
+    public:
+        RK4Stepper(double dt) : dt(dt) {
+            if(!(dt > 0))
+                throw std::invalid_argument("The rk4 integrator needs a positive step size dt.");
+        }
+        void initialize(const State& y0, double t0, double) {
+            y = y0;
+            t = t0;
+            have_dydt = false;
+        }
+        template<class RHS>
+        pair<double, double> do_step(RHS& rhs) {
+            if(!have_dydt) {
+                rhs(y, dydt, t);
+                have_dydt = true;
+            }
+            y_old = y;
+            dydt_old = dydt;
+            t_old = t;
+            for (int i = 0; i < y.size(); ++i)
+                temp[i] = y_old[i] + 0.5*dt*dydt_old[i];
+            rhs(temp, k2, t_old + 0.5*dt);
+            for (int i = 0; i < y.size(); ++i)
+                temp[i] = y_old[i] + 0.5*dt*k2[i];
+            rhs(temp, k3, t_old + 0.5*dt);
+            for (int i = 0; i < y.size(); ++i)
+                temp[i] = y_old[i] + dt*k3[i];
+            rhs(temp, k4, t_old + dt);
+            for (int i = 0; i < y.size(); ++i)
+                y[i] = y_old[i] + (dt/6)*(dydt_old[i] + 2*k2[i] + 2*k3[i] + k4[i]);
+            t = t_old + dt;
+            rhs(y, dydt, t);
+            return std::make_pair(t_old, t);
+        }
+        double current_time() const { return t; }
+        double current_time_step() const { return dt; }
+        const State& current_state() const { return y; }
+        void calc_state(double tt, State& state) const {
+            hermite_state(tt, t_old, t-t_old, y_old, dydt_old, y, dydt, state);
+        }
+};
+
+// Boris scheme for the full orbit equations with a fixed step, in the
+// symmetric drift-kick-drift form
+//
+//   x_{n+1/2} = x_n + dt/2 v_n,
+//   v_{n+1}   = rotation of v_n around B(x_{n+1/2}) by the angle q|B|dt/m,
+//   x_{n+1}   = x_{n+1/2} + dt/2 v_{n+1},
+//
+// see Boris, Relativistic plasma simulation-optimization of a hybrid code
+// (1970). The state is (x, y, z, v_x, v_y, v_z) as for FullorbitRHS. In
+// between steps, the position is interpolated with the cubic Hermite
+// polynomial with derivatives v_n and v_{n+1} and the velocity with its
+// derivative.
+template<class State>
+class BorisStepper {
+    private:
+        double dt, t = 0, t_old = 0;
+        State y, y_old;
+    public:
+        BorisStepper(double dt) : dt(dt) {
+            if(!(dt > 0))
+                throw std::invalid_argument("The boris integrator needs a positive step size dt.");
+        }
+        void initialize(const State& y0, double t0, double) {
+            y = y0;
+            t = t0;
+        }
+        template<class RHS>
+        pair<double, double> do_step(RHS& rhs) {
+            y_old = y;
+            t_old = t;
+            array<double, 3> xhalf, B, v, vprime, tvec, svec;
+            for (int i = 0; i < 3; ++i) {
+                xhalf[i] = y_old[i] + 0.5*dt*y_old[3+i];
+                v[i] = y_old[3+i];
+            }
+            rhs.B(xhalf, B);
+            double fak = 0.5*dt*rhs.charge_over_mass();
+            for (int i = 0; i < 3; ++i)
+                tvec[i] = fak*B[i];
+            double tnorm2 = tvec[0]*tvec[0] + tvec[1]*tvec[1] + tvec[2]*tvec[2];
+            for (int i = 0; i < 3; ++i)
+                svec[i] = 2*tvec[i]/(1+tnorm2);
+            vprime[0] = v[0] + v[1]*tvec[2] - v[2]*tvec[1];
+            vprime[1] = v[1] + v[2]*tvec[0] - v[0]*tvec[2];
+            vprime[2] = v[2] + v[0]*tvec[1] - v[1]*tvec[0];
+            y[3] = v[0] + vprime[1]*svec[2] - vprime[2]*svec[1];
+            y[4] = v[1] + vprime[2]*svec[0] - vprime[0]*svec[2];
+            y[5] = v[2] + vprime[0]*svec[1] - vprime[1]*svec[0];
+            for (int i = 0; i < 3; ++i)
+                y[i] = xhalf[i] + 0.5*dt*y[3+i];
+            t = t_old + dt;
+            return std::make_pair(t_old, t);
+        }
+        double current_time() const { return t; }
+        double current_time_step() const { return dt; }
+        const State& current_state() const { return y; }
+        void calc_state(double tt, State& state) const {
+            double h = t-t_old;
+            double s = (tt-t_old)/h;
+            double h00 = (1+2*s)*(1-s)*(1-s);
+            double h10 = s*(1-s)*(1-s);
+            double h01 = s*s*(3-2*s);
+            double h11 = s*s*(s-1);
+            // derivatives of the basis polynomials with respect to s
+            double dh00 = 6*s*s - 6*s;
+            double dh10 = 3*s*s - 4*s + 1;
+            double dh01 = -6*s*s + 6*s;
+            double dh11 = 3*s*s - 2*s;
+            for (int i = 0; i < 3; ++i) {
+                state[i] = h00*y_old[i] + h10*h*y_old[3+i] + h01*y[i] + h11*h*y[3+i];
+                state[3+i] = (dh00*y_old[i] + dh01*y[i])/h + dh10*y_old[3+i] + dh11*y[3+i];
+            }
+        }
+};
+
+template<class RHS, class Stepper>
 tuple<vector<array<double, RHS::Size+1>>, vector<array<double, RHS::Size+2>>>
-solve(RHS rhs, typename RHS::State y, double tmax, double dt, double dtmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, bool flux=false)
+solve_with_stepper(RHS& rhs, Stepper& dense, typename RHS::State y, double tmax, double dt, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, bool flux, TrajectoryOutput output, TracingState* state)
 {
     vector<array<double, RHS::Size+1>> res = {};
     vector<array<double, RHS::Size+2>> res_phi_hits = {};
     typedef typename RHS::State State;
-    typedef typename boost::numeric::odeint::result_of::make_dense_output<runge_kutta_dopri5<State>>::type dense_stepper_type;
-    dense_stepper_type dense = make_dense_output(tol, tol, dtmax, runge_kutta_dopri5<State>());
     double t = 0;
-    dense.initialize(y, t, dt);
     int iter = 0;
-    bool stop = false;
+    long nsample = 1;
+    bool stop = false, pause = false;
     double phi_last = get_phi(y[0], y[1], M_PI);
     if (flux) {
       phi_last = y[2];
     }
+    SIMSOPT_PERF_SCOPE(tracing, 0);
+    bool resume = state && state->started;
+    if(state && state->finished)
+        throw std::invalid_argument("The integration has already finished.");
+    if(resume) {
+        if(state->y.size() != RHS::Size || state->criteria.size() != stopping_criteria.size())
+            throw std::invalid_argument("The tracing state does not match the problem.");
+        t = state->t;
+        dt = state->dt;
+        iter = state->iter;
+        nsample = state->nsample;
+        std::copy(state->y.begin(), state->y.end(), y.begin());
+        phi_last = state->phi;
+        for (int i = 0; i < stopping_criteria.size(); ++i) {
+            if(stopping_criteria[i])
+                stopping_criteria[i]->set_state(state->criteria[i]);
+        }
+    }
+    TrajectoryRecorder<RHS::Size> recorder(res, output, nsample);
+    dense.initialize(y, t, dt);
     double phi_current;
-    boost::math::tools::eps_tolerance<double> roottol(-int(std::log2(tol)));
-    uintmax_t rootmaxit = 200;
-    State temp;
+    PhiPlaneCrossings<RHS::Size> crossings(phis, tol);
+    auto calc_state = [&dense](double tt, State& state) { dense.calc_state(tt, state); };
+    auto start = std::chrono::steady_clock::now();
+    if(!resume)
+        recorder.initial(y);
     do {
-        res.push_back(join<1, RHS::Size>({t}, y));
         tuple<double, double> step = dense.do_step(rhs);
         iter++;
         t = dense.current_time();
@@ -398,36 +870,10 @@ solve(RHS rhs, typename RHS::State y, double tmax, double dt, double dtmax, doub
         double tlast = std::get<0>(step);
         double tcurrent = std::get<1>(step);
         // Now check whether we have hit any of the phi planes
-        for (int i = 0; i < phis.size(); ++i) {
-            double phi = phis[i];
-            if(std::floor((phi_last-phi)/(2*M_PI)) != std::floor((phi_current-phi)/(2*M_PI))){ // check whether phi+k*2pi for some k was crossed
-                int fak = std::round(((phi_last+phi_current)/2-phi)/(2*M_PI));
-                double phi_shift = fak*2*M_PI + phi;
-                assert((phi_last <= phi_shift && phi_shift <= phi_current) || (phi_current <= phi_shift && phi_shift <= phi_last));
-
-                std::function<double(double)> rootfun = [&dense, &phi_shift, &temp, &phi_last, &flux](double t){
-                    dense.calc_state(t, temp);
-                    double diff = get_phi(temp[0], temp[1], phi_last)-phi_shift;
-                    if (flux) {
-                      diff = temp[2]-phi_shift;
-                    }
-                    return diff;
-                };
-                auto root = toms748_solve(rootfun, tlast, tcurrent, phi_last - phi_shift, phi_current - phi_shift, roottol, rootmaxit);
-                double f0 = rootfun(root.first);
-                double f1 = rootfun(root.second);
-                double troot = std::abs(f0) < std::abs(f1) ? root.first : root.second;
-                dense.calc_state(troot, temp);
-                // double rroot = std::sqrt(temp[0]*temp[0] + temp[1]*temp[1]);
-                // double phiroot = std::atan2(temp[1], temp[0]);
-                // if(phiroot<0)
-                //     phiroot += 2*M_PI;
-                //fmt::print("root=({:.5f}, {:.5f}), tlast={:.5f}, phi_last={:.5f}, tcurrent={:.5f}, phi_current={:.5f}, phi_shift={:.5f}, phi_root={:.5f}\n", std::get<0>(root), std::get<1>(root), tlast, phi_last, tcurrent, phi_current, phi_shift, get_phi(temp[0], temp[1], phi_last));
-                //fmt::print("t={:.5f}, xyz=({:.5f}, {:.5f}, {:.5f}), rphiz=({}, {}, {})\n", troot, temp[0], temp[1], temp[2], rroot, phiroot, temp[2]);
-                //fmt::print("x={}, y={}, phi={}\n", temp[0], temp[1], std::atan2(temp[1], temp[0]));
-                res_phi_hits.push_back(join<2, RHS::Size>({troot, double(i)}, temp));
-            }
-        }
+        crossings.find(tlast, tcurrent, phi_last, phi_current, flux, calc_state,
+                [&res_phi_hits](double troot, int i, const State& state) {
+                    res_phi_hits.push_back(join<2, RHS::Size>({troot, double(i)}, state));
+                });
         // check whether we have satisfied any of the extra stopping criteria (e.g. left a surface)
         for (int i = 0; i < stopping_criteria.size(); ++i) {
             if(stopping_criteria[i] && (*stopping_criteria[i])(iter, t, y[0], y[1], y[2])){
@@ -437,19 +883,224 @@ solve(RHS rhs, typename RHS::State y, double tmax, double dt, double dtmax, doub
             }
         }
         phi_last = phi_current;
-    } while(t < tmax && !stop);
-    if(!stop){
-        dense.calc_state(tmax, y);
-        res.push_back(join<1, RHS::Size>({tmax}, y));
+        if(t < tmax && !stop) {
+            recorder.step(iter, t, y, calc_state);
+            pause = state && std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > state->max_walltime;
+        }
+    } while(t < tmax && !stop && !pause);
+    SIMSOPT_PERF_COUNT(tracing, 0, resume ? iter - state->iter : iter);
+    if(!pause)
+        recorder.final(stop, t, y, tmax, calc_state);
+    if(state) {
+        state->started = true;
+        state->finished = !pause;
+        state->t = t;
+        state->dt = dense.current_time_step();
+        state->iter = iter;
+        state->nsample = recorder.next_sample();
+        state->y = vector<double>(y.begin(), y.end());
+        state->phi = phi_last;
+        state->criteria.clear();
+        for (int i = 0; i < stopping_criteria.size(); ++i)
+            state->criteria.push_back(stopping_criteria[i] ? stopping_criteria[i]->get_state() : vector<double>());
     }
     return std::make_tuple(res, res_phi_hits);
 }
 
+template<class RHS>
+tuple<vector<array<double, RHS::Size+1>>, vector<array<double, RHS::Size+2>>>
+solve(RHS& rhs, typename RHS::State y, double tmax, double dt, double dtmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, bool flux=false, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator(), TracingState* state=nullptr)
+{
+    typedef typename RHS::State State;
+    if(integrator.method == Integrator::rk4) {
+        RK4Stepper<State> stepper(integrator.dt);
+        return solve_with_stepper(rhs, stepper, y, tmax, integrator.dt, tol, phis, stopping_criteria, flux, output, state);
+    } else if(integrator.method == Integrator::boris) {
+        throw std::invalid_argument("The boris integrator is only available for full orbit tracing.");
+    }
+    Dopri5Stepper<State> stepper(tol, dtmax);
+    return solve_with_stepper(rhs, stepper, y, tmax, dt, tol, phis, stopping_criteria, flux, output, state);
+}
+
+// Full orbit tracing additionally supports the Boris scheme.
+template<template<class, std::size_t, xt::layout_type> class T>
+tuple<vector<array<double, 7>>, vector<array<double, 8>>>
+solve(FullorbitRHS<T>& rhs, array<double, 6> y, double tmax, double dt, double dtmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, bool flux=false, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator(), TracingState* state=nullptr)
+{
+    if(integrator.method == Integrator::boris) {
+        BorisStepper<array<double, 6>> stepper(integrator.dt);
+        return solve_with_stepper(rhs, stepper, y, tmax, integrator.dt, tol, phis, stopping_criteria, flux, output, state);
+    }
+    return solve<FullorbitRHS<T>>(rhs, y, tmax, dt, dtmax, tol, phis, stopping_criteria, flux, output, integrator, state);
+}
+
+// Dormand-Prince 5(4) tableau, see Hairer, Norsett, Wanner, Solving Ordinary
+// Differential Equations I, and its continuous extension of order 4.
+namespace dopri5 {
+    constexpr double c[7] = {0., 1./5, 3./10, 4./5, 8./9, 1., 1.};
+    constexpr double a[7][6] = {
+        {0., 0., 0., 0., 0., 0.},
+        {1./5, 0., 0., 0., 0., 0.},
+        {3./40, 9./40, 0., 0., 0., 0.},
+        {44./45, -56./15, 32./9, 0., 0., 0.},
+        {19372./6561, -25360./2187, 64448./6561, -212./729, 0., 0.},
+        {9017./3168, -355./33, 46732./5247, 49./176, -5103./18656, 0.},
+        {35./384, 0., 500./1113, 125./192, -2187./6784, 11./84}
+    };
+    // difference of the 5th and the embedded 4th order weights
+    constexpr double e[7] = {71./57600, 0., -71./16695, 71./1920, -17253./339200, 22./525, -1./40};
+    // coefficients of the dense output
+    constexpr double d[7] = {-12715105075./11282082432, 0., 87487479700./32700410799, -10690763975./1880347072,
+        701980252875./199316789632, -1453857185./822651844, 69997945./29380423};
+}
+
+// Advances a block of independent initial value problems in lockstep with the
+// Dormand-Prince 5(4) method: in every stage, the right hand side is evaluated
+// for all particles that are still active with a single call, which allows
+// the field to evaluate all of them at once (e.g. the simd paths of
+// InterpolatedField). Each particle has its own adaptive time step, and
+// particles for which the step was rejected simply retry with a smaller step
+// in the next sweep. Particles that reach tmax or satisfy a stopping criterion
+// are removed from the block. The output for each particle is the same as
+// for solve().
+//
+// The RHS object has to provide
+//     void operator()(const vector<int>& lanes, const vector<State>& ys, vector<State>& dydt)
+// which evaluates dydt[l] for all l in lanes.
+template<class RHS>
+vector<tuple<vector<array<double, RHS::Size+1>>, vector<array<double, RHS::Size+2>>>>
+solve_batch(RHS& rhs, vector<typename RHS::State> y, double tmax, vector<double> dt, vector<double> dtmax, double tol,
+        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, bool flux=false, TrajectoryOutput output=TrajectoryOutput())
+{
+    typedef typename RHS::State State;
+    constexpr int Size = RHS::Size;
+    for (auto& crit : stopping_criteria) {
+        // this criterion keeps the angle of the last call, so it cannot be
+        // shared by particles that are integrated at the same time
+        if(std::dynamic_pointer_cast<ToroidalTransitStoppingCriterion>(crit))
+            throw std::invalid_argument("ToroidalTransitStoppingCriterion is not supported for batched tracing.");
+    }
+    SIMSOPT_PERF_SCOPE(tracing, 0);
+    int nlanes = y.size();
+    vector<tuple<vector<array<double, Size+1>>, vector<array<double, Size+2>>>> results(nlanes);
+    vector<double> t(nlanes, 0.), phi_last(nlanes);
+    vector<int> iter(nlanes, 0);
+    vector<array<State, 7>> k(nlanes);
+    vector<array<State, 5>> dense(nlanes);
+    vector<State> ystage(nlanes), ynew(nlanes);
+    vector<int> active(nlanes);
+    vector<TrajectoryRecorder<Size>> recorders;
+    for (int l = 0; l < nlanes; ++l) {
+        active[l] = l;
+        phi_last[l] = flux ? y[l][2] : get_phi(y[l][0], y[l][1], M_PI);
+        recorders.push_back(TrajectoryRecorder<Size>(std::get<0>(results[l]), output));
+        recorders[l].initial(y[l]);
+    }
+    PhiPlaneCrossings<Size> crossings(phis, tol);
+
+    // first stage of the first step, afterwards this is the last stage of
+    // the previous step
+    vector<State> kstage(nlanes);
+    rhs(active, y, kstage);
+    for (int l : active)
+        k[l][0] = kstage[l];
+
+    while(active.size() > 0) {
+        for (int s = 1; s < 7; ++s) {
+            for (int l : active) {
+                for (int i = 0; i < Size; ++i) {
+                    double incr = 0.;
+                    for (int j = 0; j < s; ++j)
+                        incr += dopri5::a[s][j] * k[l][j][i];
+                    ystage[l][i] = y[l][i] + dt[l] * incr;
+                }
+            }
+            rhs(active, ystage, kstage);
+            for (int l : active)
+                k[l][s] = kstage[l];
+        }
+
+        vector<int> still_active;
+        for (int l : active) {
+            // the 7th stage is evaluated at the 5th order solution
+            State& y5 = ystage[l];
+            double err = 0.;
+            for (int i = 0; i < Size; ++i) {
+                double xerr = 0.;
+                for (int j = 0; j < 7; ++j)
+                    xerr += dopri5::e[j] * k[l][j][i];
+                xerr = std::abs(dt[l] * xerr);
+                err = std::max(err, xerr/(tol + tol*(std::abs(y[l][i]) + dt[l]*std::abs(k[l][0][i]))));
+            }
+            if(err > 1.) {
+                dt[l] *= std::max(0.9*std::pow(err, -1./3.), 0.2);
+                still_active.push_back(l);
+                continue;
+            }
+            double h = dt[l];
+            double tlast = t[l];
+            for (int i = 0; i < Size; ++i) {
+                double ydiff = y5[i] - y[l][i];
+                double bspl = h*k[l][0][i] - ydiff;
+                dense[l][0][i] = y[l][i];
+                dense[l][1][i] = ydiff;
+                dense[l][2][i] = bspl;
+                dense[l][3][i] = ydiff - h*k[l][6][i] - bspl;
+                double d5 = 0.;
+                for (int j = 0; j < 7; ++j)
+                    d5 += dopri5::d[j] * k[l][j][i];
+                dense[l][4][i] = h*d5;
+            }
+            auto calc_state = [&dense, l, tlast, h](double tt, State& res) {
+                double theta = (tt - tlast)/h;
+                double theta1 = 1. - theta;
+                for (int i = 0; i < Size; ++i)
+                    res[i] = dense[l][0][i] + theta*(dense[l][1][i] + theta1*(dense[l][2][i] + theta*(dense[l][3][i] + theta1*dense[l][4][i])));
+            };
+            y[l] = y5;
+            k[l][0] = k[l][6];
+            t[l] = tlast + h;
+            iter[l]++;
+            if(err < 0.5) {
+                err = std::max(std::pow(5., -5.), err);
+                dt[l] = h * 0.9 * std::pow(err, -1./5.);
+            }
+            dt[l] = std::min(dt[l], dtmax[l]);
+
+            auto& res_phi_hits = std::get<1>(results[l]);
+            double phi_current = flux ? y[l][2] : get_phi(y[l][0], y[l][1], phi_last[l]);
+            crossings.find(tlast, t[l], phi_last[l], phi_current, flux, calc_state,
+                    [&res_phi_hits](double troot, int i, const State& state) {
+                        res_phi_hits.push_back(join<2, Size>({troot, double(i)}, state));
+                    });
+            bool stop = false;
+            for (int i = 0; i < stopping_criteria.size(); ++i) {
+                if(stopping_criteria[i] && (*stopping_criteria[i])(iter[l], t[l], y[l][0], y[l][1], y[l][2])){
+                    stop = true;
+                    res_phi_hits.push_back(join<2, Size>({t[l], -1-double(i)}, y[l]));
+                    break;
+                }
+            }
+            phi_last[l] = phi_current;
+            if(stop || t[l] >= tmax) {
+                recorders[l].final(stop, t[l], y[l], tmax, calc_state);
+                continue;
+            }
+            recorders[l].step(iter[l], t[l], y[l], calc_state);
+            still_active.push_back(l);
+        }
+        active = still_active;
+    }
+    for (int l = 0; l < nlanes; ++l)
+        SIMSOPT_PERF_COUNT(tracing, 0, iter[l]);
+    return results;
+}
+
 template<template<class, std::size_t, xt::layout_type> class T>
 tuple<vector<array<double, 5>>, vector<array<double, 6>>>
 particle_guiding_center_tracing(
         shared_ptr<MagneticField<T>> field, array<double, 3> xyz_init,
-        double m, double q, double vtotal, double vtang, double tmax, double tol, bool vacuum, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria)
+        double m, double q, double vtotal, double vtang, double tmax, double tol, bool vacuum, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output, Integrator integrator, shared_ptr<TracingState> state)
 {
     typename MagneticField<T>::Tensor2 xyz({{xyz_init[0], xyz_init[1], xyz_init[2]}});
     field->set_points(xyz);
@@ -464,18 +1115,50 @@ particle_guiding_center_tracing(
 
     if(vacuum){
         auto rhs_class = GuidingCenterVacuumRHS<T>(field, m, q, mu);
-        return solve(rhs_class, y, tmax, dt, dtmax, tol, phis, stopping_criteria);
+        return solve(rhs_class, y, tmax, dt, dtmax, tol, phis, stopping_criteria, false, output, integrator, state.get());
     }
     else
         throw std::logic_error("Guiding center right hand side currently only implemented for vacuum fields.");
 }
 
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 5>>, vector<array<double, 6>>>>
+particle_guiding_center_tracing_batch(
+        shared_ptr<MagneticField<T>> field, vector<array<double, 3>> xyz_inits,
+        double m, double q, double vtotal, vector<double> vtangs, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output)
+{
+    int n = xyz_inits.size();
+    if(vtangs.size() != n)
+        throw std::invalid_argument("xyz_inits and vtangs need to have the same length.");
+    if(n == 0)
+        return {};
+    typename MagneticField<T>::Tensor2 xyz = xt::zeros<double>({n, 3});
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < 3; ++j)
+            xyz(i, j) = xyz_inits[i][j];
+    field->set_points(xyz);
+    auto& AbsB = field->AbsB_ref();
+
+    vector<double> mu(n), dt(n), dtmax(n);
+    vector<array<double, 4>> y(n);
+    for (int i = 0; i < n; ++i) {
+        double vperp2 = vtotal*vtotal - vtangs[i]*vtangs[i];
+        mu[i] = vperp2/(2*AbsB(i, 0));
+        y[i] = {xyz_inits[i][0], xyz_inits[i][1], xyz_inits[i][2], vtangs[i]};
+        double r0 = std::sqrt(xyz_inits[i][0]*xyz_inits[i][0] + xyz_inits[i][1]*xyz_inits[i][1]);
+        dtmax[i] = r0*0.5*M_PI/vtotal; // can at most do quarter of a revolution per step
+        dt[i] = 1e-3 * dtmax[i]; // initial guess for first timestep, will be adjusted by adaptive timestepper
+    }
+    auto rhs_class = GuidingCenterVacuumBatchRHS<T>(field, m, q, mu);
+    return solve_batch(rhs_class, y, tmax, dt, dtmax, tol, phis, stopping_criteria, false, output);
+}
+
 template<template<class, std::size_t, xt::layout_type> class T>
 tuple<vector<array<double, 5>>, vector<array<double, 6>>>
 particle_guiding_center_boozer_tracing(
         shared_ptr<BoozerMagneticField<T>> field, array<double, 3> stz_init,
         double m, double q, double vtotal, double vtang, double tmax, double tol,
-        bool vacuum, bool noK, vector<double> zetas, vector<shared_ptr<StoppingCriterion>> stopping_criteria)
+        bool vacuum, bool noK, vector<double> zetas, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output, Integrator integrator, shared_ptr<TracingState> state)
 {
     typename BoozerMagneticField<T>::Tensor2 stz({{stz_init[0], stz_init[1], stz_init[2]}});
     field->set_points(stz);
@@ -491,13 +1174,13 @@ particle_guiding_center_boozer_tracing(
 
     if (vacuum) {
       auto rhs_class = GuidingCenterVacuumBoozerRHS<T>(field, m, q, mu);
-      return solve(rhs_class, y, tmax, dt, dtmax, tol, zetas, stopping_criteria, true);
+      return solve(rhs_class, y, tmax, dt, dtmax, tol, zetas, stopping_criteria, true, output, integrator, state.get());
     } else if (noK) {
       auto rhs_class = GuidingCenterNoKBoozerRHS<T>(field, m, q, mu);
-      return solve(rhs_class, y, tmax, dt, dtmax, tol, zetas, stopping_criteria, true);
+      return solve(rhs_class, y, tmax, dt, dtmax, tol, zetas, stopping_criteria, true, output, integrator, state.get());
     } else {
       auto rhs_class = GuidingCenterBoozerRHS<T>(field, m, q, mu);
-      return solve(rhs_class, y, tmax, dt, dtmax, tol, zetas, stopping_criteria, true);
+      return solve(rhs_class, y, tmax, dt, dtmax, tol, zetas, stopping_criteria, true, output, integrator, state.get());
     }
 }
 
@@ -505,20 +1188,26 @@ template
 tuple<vector<array<double, 5>>, vector<array<double, 6>>> particle_guiding_center_boozer_tracing<xt::pytensor>(
         shared_ptr<BoozerMagneticField<xt::pytensor>> field, array<double, 3> stz_init,
         double m, double q, double vtotal, double vtang, double tmax, double tol,
-        bool vacuum, bool noK, vector<double> zetas, vector<shared_ptr<StoppingCriterion>> stopping_criteria);
+        bool vacuum, bool noK, vector<double> zetas, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output, Integrator integrator, shared_ptr<TracingState> state);
 
 template
 tuple<vector<array<double, 5>>, vector<array<double, 6>>> particle_guiding_center_tracing<xt::pytensor>(
         shared_ptr<MagneticField<xt::pytensor>> field, array<double, 3> xyz_init,
         double m, double q, double vtotal, double vtang, double tmax, double tol, bool vacuum,
-        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria);
+        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output, Integrator integrator, shared_ptr<TracingState> state);
+
+template
+vector<tuple<vector<array<double, 5>>, vector<array<double, 6>>>> particle_guiding_center_tracing_batch<xt::pytensor>(
+        shared_ptr<MagneticField<xt::pytensor>> field, vector<array<double, 3>> xyz_inits,
+        double m, double q, double vtotal, vector<double> vtangs, double tmax, double tol,
+        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output);
 
 
 template<template<class, std::size_t, xt::layout_type> class T>
 tuple<vector<array<double, 7>>, vector<array<double, 8>>>
 particle_fullorbit_tracing(
         shared_ptr<MagneticField<T>> field, array<double, 3> xyz_init, array<double, 3> v_init,
-        double m, double q, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria)
+        double m, double q, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output, Integrator integrator, shared_ptr<TracingState> state)
 {
 
     auto rhs_class = FullorbitRHS<T>(field, m, q);
@@ -529,19 +1218,19 @@ particle_fullorbit_tracing(
     double dtmax = r0*0.5*M_PI/vtotal; // can at most do quarter of a revolution per step
     double dt = 1e-3 * dtmax; // initial guess for first timestep, will be adjusted by adaptive timestepper
 
-    return solve(rhs_class, y, tmax, dt, dtmax, tol, phis, stopping_criteria);
+    return solve(rhs_class, y, tmax, dt, dtmax, tol, phis, stopping_criteria, false, output, integrator, state.get());
 }
 
 template
 tuple<vector<array<double, 7>>, vector<array<double, 8>>> particle_fullorbit_tracing<xt::pytensor>(
         shared_ptr<MagneticField<xt::pytensor>> field, array<double, 3> xyz_init, array<double, 3> v_init,
-        double m, double q, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria);
+        double m, double q, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output, Integrator integrator, shared_ptr<TracingState> state);
 
 template<template<class, std::size_t, xt::layout_type> class T>
 tuple<vector<array<double, 4>>, vector<array<double, 5>>>
 fieldline_tracing(
     shared_ptr<MagneticField<T>> field, array<double, 3> xyz_init,
-    double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria)
+    double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output, Integrator integrator)
 {
     auto rhs_class = FieldlineRHS<T>(field);
     double r0 = std::sqrt(xyz_init[0]*xyz_init[0] + xyz_init[1]*xyz_init[1]);
@@ -550,11 +1239,265 @@ fieldline_tracing(
     double AbsB = field->AbsB_ref()(0);
     double dtmax = r0*0.5*M_PI/AbsB; // can at most do quarter of a revolution per step
     double dt = 1e-5 * dtmax; // initial guess for first timestep, will be adjusted by adaptive timestepper
-    return solve(rhs_class, xyz_init, tmax, dt, dtmax, tol, phis, stopping_criteria);
+    return solve(rhs_class, xyz_init, tmax, dt, dtmax, tol, phis, stopping_criteria, false, output, integrator);
 }
 
 template
 tuple<vector<array<double, 4>>, vector<array<double, 5>>>
 fieldline_tracing(
     shared_ptr<MagneticField<xt::pytensor>> field, array<double, 3> xyz_init,
-    double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria);
+    double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output, Integrator integrator);
+
+
+// Returns one field per thread for tracing with nthreads threads (0 means the
+// number of OpenMP threads), using copy() to create the additional fields,
+// see MagneticField::thread_copy. If the field cannot be copied, only the
+// field itself is returned and the particles are traced on a single thread.
+template<class Field, class Copy>
+vector<shared_ptr<Field>> thread_fields(shared_ptr<Field> field, int nthreads, vector<shared_ptr<StoppingCriterion>>& stopping_criteria, Copy&& copy) {
+    if(nthreads != 1) {
+        for (auto& crit : stopping_criteria) {
+            // this criterion keeps the angle of the last call, so it cannot
+            // be shared by particles that are traced at the same time
+            if(std::dynamic_pointer_cast<ToroidalTransitStoppingCriterion>(crit))
+                throw std::invalid_argument("ToroidalTransitStoppingCriterion is not supported for multithreaded tracing.");
+        }
+    }
+#if defined(_OPENMP)
+    if(nthreads <= 0)
+        nthreads = omp_get_max_threads();
+#else
+    nthreads = 1;
+#endif
+    vector<shared_ptr<Field>> fields = {field};
+    for (int i = 1; i < nthreads; ++i) {
+        auto field_copy = copy();
+        if(!field_copy)
+            return {field};
+        fields.push_back(field_copy);
+    }
+    return fields;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<shared_ptr<MagneticField<T>>> thread_fields(shared_ptr<MagneticField<T>> field, int nthreads, vector<shared_ptr<StoppingCriterion>>& stopping_criteria) {
+    return thread_fields(field, nthreads, stopping_criteria, [&field]() { return field->thread_copy(); });
+}
+
+// Calls trace(rhs, i) for i = 0, ..., n-1, where rhs is the right hand side
+// object of the calling thread. The particles are handed out one at a time,
+// so that threads that finish short lived (e.g. lost) particles pick up the
+// remaining work. The rhs objects have to be constructed and evaluated once
+// beforehand, so that no arrays are allocated inside the parallel region,
+// which is why the GIL can be released for the whole region. Callers whose
+// right hand sides may still allocate set release_gil to false.
+template<class RHS, class Result>
+vector<Result> trace_many(vector<RHS>& rhss, int n, std::function<Result(RHS&, int)> trace, bool release_gil=true) {
+    vector<Result> results(n);
+    std::exception_ptr error = nullptr;
+    int nthreads = rhss.size();
+    ReleaseGIL nogil(release_gil);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+    for (int i = 0; i < n; ++i) {
+#if defined(_OPENMP)
+        int thread = omp_get_thread_num();
+#else
+        int thread = 0;
+#endif
+        try {
+            results[i] = trace(rhss[thread], i);
+        } catch (...) {
+#pragma omp critical
+            if(!error)
+                error = std::current_exception();
+        }
+    }
+    if(error)
+        std::rethrow_exception(error);
+    return results;
+}
+
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 5>>, vector<array<double, 6>>>>
+particle_guiding_center_tracing_many(
+        shared_ptr<MagneticField<T>> field, vector<array<double, 3>> xyz_inits,
+        double m, double q, double vtotal, vector<double> vtangs, double tmax, double tol, bool vacuum,
+        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output, Integrator integrator)
+{
+    if(!vacuum)
+        throw std::logic_error("Guiding center right hand side currently only implemented for vacuum fields.");
+    int n = xyz_inits.size();
+    if(vtangs.size() != n)
+        throw std::invalid_argument("xyz_inits and vtangs need to have the same length.");
+    if(n == 0)
+        return {};
+    typename MagneticField<T>::Tensor2 xyz = xt::zeros<double>({n, 3});
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < 3; ++j)
+            xyz(i, j) = xyz_inits[i][j];
+    field->set_points(xyz);
+    auto& AbsB = field->AbsB_ref();
+    vector<double> mu(n);
+    for (int i = 0; i < n; ++i)
+        mu[i] = (vtotal*vtotal - vtangs[i]*vtangs[i])/(2*AbsB(i, 0));
+
+    auto fields = thread_fields(field, nthreads, stopping_criteria);
+    vector<GuidingCenterVacuumRHS<T>> rhss;
+    array<double, 4> y0 = {xyz_inits[0][0], xyz_inits[0][1], xyz_inits[0][2], vtangs[0]};
+    array<double, 4> dydt;
+    for (auto& f : fields) {
+        rhss.push_back(GuidingCenterVacuumRHS<T>(f, m, q, mu[0]));
+        rhss.back()(y0, dydt, 0.);
+    }
+    std::function<tuple<vector<array<double, 5>>, vector<array<double, 6>>>(GuidingCenterVacuumRHS<T>&, int)> trace =
+        [&](GuidingCenterVacuumRHS<T>& rhs, int i) {
+            rhs.set_mu(mu[i]);
+            array<double, 4> y = {xyz_inits[i][0], xyz_inits[i][1], xyz_inits[i][2], vtangs[i]};
+            double r0 = std::sqrt(xyz_inits[i][0]*xyz_inits[i][0] + xyz_inits[i][1]*xyz_inits[i][1]);
+            double dtmax = r0*0.5*M_PI/vtotal; // can at most do quarter of a revolution per step
+            double dt = 1e-3 * dtmax; // initial guess for first timestep, will be adjusted by adaptive timestepper
+            return solve(rhs, y, tmax, dt, dtmax, tol, phis, stopping_criteria, false, output, integrator);
+        };
+    return trace_many(rhss, n, trace);
+}
+
+template
+vector<tuple<vector<array<double, 5>>, vector<array<double, 6>>>> particle_guiding_center_tracing_many<xt::pytensor>(
+        shared_ptr<MagneticField<xt::pytensor>> field, vector<array<double, 3>> xyz_inits,
+        double m, double q, double vtotal, vector<double> vtangs, double tmax, double tol, bool vacuum,
+        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output, Integrator integrator);
+
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 5>>, vector<array<double, 6>>>>
+particle_guiding_center_boozer_tracing_many(
+        shared_ptr<BoozerMagneticField<T>> field, vector<array<double, 3>> stz_inits,
+        double m, double q, double vtotal, vector<double> vtangs, double tmax, double tol,
+        bool vacuum, bool noK, vector<double> zetas, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output, Integrator integrator)
+{
+    int n = stz_inits.size();
+    if(vtangs.size() != n)
+        throw std::invalid_argument("stz_inits and vtangs need to have the same length.");
+    if(n == 0)
+        return {};
+    typename BoozerMagneticField<T>::Tensor2 stz = xt::zeros<double>({n, 3});
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < 3; ++j)
+            stz(i, j) = stz_inits[i][j];
+    field->set_points(stz);
+    auto& modB = field->modB_ref();
+    auto& G = field->G_ref();
+    vector<double> mu(n), dtmax(n);
+    for (int i = 0; i < n; ++i) {
+        mu[i] = (vtotal*vtotal - vtangs[i]*vtangs[i])/(2*modB(i, 0));
+        double r0 = std::abs(G(i, 0))/modB(i, 0);
+        dtmax[i] = r0*0.5*M_PI/vtotal; // can at most do quarter of a revolution per step
+    }
+
+    auto equations = vacuum ? BoozerPointValues::vacuum : (noK ? BoozerPointValues::noK : BoozerPointValues::full);
+    // Fields without thread_copy use the default evaluate_point, which goes
+    // through set_points and may allocate arrays or call into python. They
+    // are traced on a single thread with the GIL held.
+    bool copyable = field->thread_copy(equations) != nullptr;
+    auto fields = copyable ? thread_fields(field, nthreads, stopping_criteria, [&field, equations]() { return field->thread_copy(equations); })
+        : vector<shared_ptr<BoozerMagneticField<T>>>{field};
+    // the right hand sides of copyable fields do not allocate, so they are
+    // created per particle
+    std::function<tuple<vector<array<double, 5>>, vector<array<double, 6>>>(shared_ptr<BoozerMagneticField<T>>&, int)> trace =
+        [&](shared_ptr<BoozerMagneticField<T>>& f, int i) {
+            array<double, 4> y = {stz_inits[i][0], stz_inits[i][1], stz_inits[i][2], vtangs[i]};
+            double dt = 1e-3 * dtmax[i]; // initial guess for first timestep, will be adjusted by adaptive timestepper
+            if (vacuum) {
+                auto rhs_class = GuidingCenterVacuumBoozerRHS<T>(f, m, q, mu[i]);
+                return solve(rhs_class, y, tmax, dt, dtmax[i], tol, zetas, stopping_criteria, true, output, integrator);
+            } else if (noK) {
+                auto rhs_class = GuidingCenterNoKBoozerRHS<T>(f, m, q, mu[i]);
+                return solve(rhs_class, y, tmax, dt, dtmax[i], tol, zetas, stopping_criteria, true, output, integrator);
+            } else {
+                auto rhs_class = GuidingCenterBoozerRHS<T>(f, m, q, mu[i]);
+                return solve(rhs_class, y, tmax, dt, dtmax[i], tol, zetas, stopping_criteria, true, output, integrator);
+            }
+        };
+    return trace_many(fields, n, trace, copyable);
+}
+
+template
+vector<tuple<vector<array<double, 5>>, vector<array<double, 6>>>> particle_guiding_center_boozer_tracing_many<xt::pytensor>(
+        shared_ptr<BoozerMagneticField<xt::pytensor>> field, vector<array<double, 3>> stz_inits,
+        double m, double q, double vtotal, vector<double> vtangs, double tmax, double tol,
+        bool vacuum, bool noK, vector<double> zetas, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output, Integrator integrator);
+
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 7>>, vector<array<double, 8>>>>
+particle_fullorbit_tracing_many(
+        shared_ptr<MagneticField<T>> field, vector<array<double, 3>> xyz_inits, vector<array<double, 3>> v_inits,
+        double m, double q, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output, Integrator integrator)
+{
+    int n = xyz_inits.size();
+    if(v_inits.size() != n)
+        throw std::invalid_argument("xyz_inits and v_inits need to have the same length.");
+    if(n == 0)
+        return {};
+    auto fields = thread_fields(field, nthreads, stopping_criteria);
+    vector<FullorbitRHS<T>> rhss;
+    array<double, 6> y0 = {xyz_inits[0][0], xyz_inits[0][1], xyz_inits[0][2], v_inits[0][0], v_inits[0][1], v_inits[0][2]};
+    array<double, 6> dydt;
+    for (auto& f : fields) {
+        rhss.push_back(FullorbitRHS<T>(f, m, q));
+        rhss.back()(y0, dydt, 0.);
+    }
+    std::function<tuple<vector<array<double, 7>>, vector<array<double, 8>>>(FullorbitRHS<T>&, int)> trace =
+        [&](FullorbitRHS<T>& rhs, int i) {
+            array<double, 6> y = {xyz_inits[i][0], xyz_inits[i][1], xyz_inits[i][2], v_inits[i][0], v_inits[i][1], v_inits[i][2]};
+            double vtotal = std::sqrt(std::pow(v_inits[i][0], 2) + std::pow(v_inits[i][1], 2) + std::pow(v_inits[i][2], 2));
+            double r0 = std::sqrt(xyz_inits[i][0]*xyz_inits[i][0] + xyz_inits[i][1]*xyz_inits[i][1]);
+            double dtmax = r0*0.5*M_PI/vtotal; // can at most do quarter of a revolution per step
+            double dt = 1e-3 * dtmax; // initial guess for first timestep, will be adjusted by adaptive timestepper
+            return solve(rhs, y, tmax, dt, dtmax, tol, phis, stopping_criteria, false, output, integrator);
+        };
+    return trace_many(rhss, n, trace);
+}
+
+template
+vector<tuple<vector<array<double, 7>>, vector<array<double, 8>>>> particle_fullorbit_tracing_many<xt::pytensor>(
+        shared_ptr<MagneticField<xt::pytensor>> field, vector<array<double, 3>> xyz_inits, vector<array<double, 3>> v_inits,
+        double m, double q, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output, Integrator integrator);
+
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 4>>, vector<array<double, 5>>>>
+fieldline_tracing_many(
+    shared_ptr<MagneticField<T>> field, vector<array<double, 3>> xyz_inits,
+    double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output, Integrator integrator)
+{
+    int n = xyz_inits.size();
+    if(n == 0)
+        return {};
+    typename MagneticField<T>::Tensor2 xyz = xt::zeros<double>({n, 3});
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < 3; ++j)
+            xyz(i, j) = xyz_inits[i][j];
+    field->set_points(xyz);
+    auto& AbsBs = field->AbsB_ref();
+    vector<double> AbsB(AbsBs.data(), AbsBs.data() + n);
+
+    auto fields = thread_fields(field, nthreads, stopping_criteria);
+    vector<FieldlineRHS<T>> rhss;
+    array<double, 3> dydt;
+    for (auto& f : fields) {
+        rhss.push_back(FieldlineRHS<T>(f));
+        rhss.back()(xyz_inits[0], dydt, 0.);
+    }
+    std::function<tuple<vector<array<double, 4>>, vector<array<double, 5>>>(FieldlineRHS<T>&, int)> trace =
+        [&](FieldlineRHS<T>& rhs, int i) {
+            double r0 = std::sqrt(xyz_inits[i][0]*xyz_inits[i][0] + xyz_inits[i][1]*xyz_inits[i][1]);
+            double dtmax = r0*0.5*M_PI/AbsB[i]; // can at most do quarter of a revolution per step
+            double dt = 1e-5 * dtmax; // initial guess for first timestep, will be adjusted by adaptive timestepper
+            return solve(rhs, xyz_inits[i], tmax, dt, dtmax, tol, phis, stopping_criteria, false, output, integrator);
+        };
+    return trace_many(rhss, n, trace);
+}
+
+template
+vector<tuple<vector<array<double, 4>>, vector<array<double, 5>>>>
+fieldline_tracing_many(
+    shared_ptr<MagneticField<xt::pytensor>> field, vector<array<double, 3>> xyz_inits,
+    double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output, Integrator integrator);
@@ -1,6 +1,7 @@
 #pragma once
 #include <memory>
 #include <vector>
+#include <limits>
 #include "magneticfield.h"
 #include "boozermagneticfield.h"
 #include "regular_grid_interpolant_3d.h"
@@ -15,6 +16,10 @@ class StoppingCriterion {
     public:
         // Should return true if the Criterion is satisfied.
         virtual bool operator()(int iter, double t, double x, double y, double z) = 0;
+        // The information that the criterion keeps between calls, so that
+        // an interrupted integration can be resumed, see TracingState.
+        virtual vector<double> get_state() { return {}; }
+        virtual void set_state(const vector<double>& state) {}
         virtual ~StoppingCriterion() {}
 };
 
@@ -42,6 +47,15 @@ class ToroidalTransitStoppingCriterion : public StoppingCriterion {
             int ntransits = std::abs(std::floor((phi-phi_init)/(2*M_PI)));
             return ntransits>=max_transits;
         };
+        vector<double> get_state() override {
+            return {phi_last, phi_init};
+        }
+        void set_state(const vector<double>& state) override {
+            if(state.size() != 2)
+                throw std::invalid_argument("ToroidalTransitStoppingCriterion: invalid state.");
+            phi_last = state[0];
+            phi_init = state[1];
+        }
 };
 
 class MaxToroidalFluxStoppingCriterion : public StoppingCriterion{
@@ -118,41 +132,164 @@ template<class Array>
 class LevelsetStoppingCriterion : public StoppingCriterion{
     private:
         shared_ptr<RegularGridInterpolant3D<Array>> levelset;
+        int nfp;
+        bool stellsym;
     public:
-        LevelsetStoppingCriterion(shared_ptr<RegularGridInterpolant3D<Array>> levelset) : levelset(levelset) { };
+        // For nfp > 1 or stellsym, the levelset is only given on one (half)
+        // field period, and the points are mapped into it in the same way as
+        // in InterpolatedField.
+        LevelsetStoppingCriterion(shared_ptr<RegularGridInterpolant3D<Array>> levelset, int nfp=1, bool stellsym=false) : levelset(levelset), nfp(nfp), stellsym(stellsym) { };
         bool operator()(int iter, double t, double x, double y, double z) override {
             double r = std::sqrt(x*x + y*y);
             double phi = std::atan2(y, x);
             if(phi < 0)
                 phi += 2*M_PI;
+            if(z < 0 && stellsym) {
+                z = -z;
+                phi = 2*M_PI - phi;
+            }
+            double period = (2*M_PI)/nfp;
+            phi -= int(phi/period)*period;
             double f = levelset->evaluate(r, phi, z)[0];
             //fmt::print("Levelset at xyz=({}, {}, {}), rphiz=({}, {}, {}), f={}\n", x, y, z, r, phi, z, f);
             return f<0;
         };
 };
 
+// Selects which states of a trajectory the tracing functions return:
+//  - full: the state after every accepted step of the integrator,
+//  - every_n: the state after every `every`-th accepted step,
+//  - sampled: the states at t = 0, dt, 2dt, ..., evaluated with the dense
+//    output of the integrator,
+//  - hits_only: only the initial and the final state, for when only the
+//    phi/zeta hits and the end state are of interest,
+//  - none: no states at all.
+// In all modes but none, the trajectory starts with the initial state and
+// ends with the state at tmax. If a stopping criterion is satisfied, the
+// trajectory ends with the state at which it was satisfied, except for mode
+// full, which keeps the historical behaviour of ending with the last state
+// before that.
+struct TrajectoryOutput {
+    enum Mode { full, every_n, sampled, hits_only, none };
+    Mode mode = full;
+    int every = 1;
+    double dt = 0.;
+    TrajectoryOutput() {}
+    TrajectoryOutput(Mode mode, int every, double dt) : mode(mode), every(every), dt(dt) {}
+};
+
+// Selects the time integration scheme of the tracing functions:
+//  - dopri5: the adaptive Dormand-Prince 5(4) method with tolerance tol,
+//  - rk4: the classical fourth order Runge-Kutta method with fixed step dt,
+//  - boris: the Boris scheme with fixed step dt, only for full orbit tracing.
+//    It needs a single field evaluation per step, conserves the kinetic
+//    energy exactly and is volume preserving, so it stays stable over long
+//    times without small steps.
+// For the fixed step methods, the states in between steps (phi hits and
+// sampled output) are obtained by cubic Hermite interpolation.
+struct Integrator {
+    enum Method { dopri5, rk4, boris };
+    Method method = dopri5;
+    double dt = 0.;
+    Integrator() {}
+    Integrator(Method method, double dt) : method(method), dt(dt) {}
+};
+
+// The state of an integration in progress, so that the tracing of a particle
+// can be interrupted and resumed later, e.g. from a checkpoint file. If a
+// TracingState is passed to one of the particle tracing functions, the
+// integration continues from it once it has been started, and returns after
+// the first step that ends more than max_walltime seconds after the start of
+// the call, storing the current state again. The returned trajectory and hits
+// only cover the part of the integration done in that call. The stopping
+// criteria have to be the same in every call.
+struct TracingState {
+    // whether the integration has been started, and whether it has finished,
+    // i.e. reached tmax or satisfied one of the stopping criteria
+    bool started = false, finished = false;
+    double max_walltime = std::numeric_limits<double>::infinity();
+    // time, step size for the next step, number of accepted steps, and
+    // index of the next sample for TrajectoryOutput::sampled
+    double t = 0., dt = 0.;
+    int iter = 0;
+    long nsample = 1;
+    vector<double> y;
+    // toroidal angle at t without wrapping, to detect the phi plane crossings
+    double phi = 0.;
+    // StoppingCriterion::get_state for each of the stopping criteria
+    vector<vector<double>> criteria;
+};
+
 template<template<class, std::size_t, xt::layout_type> class T>
 tuple<vector<array<double, 5>>, vector<array<double, 6>>>
 particle_guiding_center_boozer_tracing(
         shared_ptr<BoozerMagneticField<T>> field, array<double, 3> stz_init,
         double m, double q, double vtotal, double vtang, double tmax, double tol,
-        bool vacuum, bool noK, vector<double> zetas, vector<shared_ptr<StoppingCriterion>> stopping_criteria);
+        bool vacuum, bool noK, vector<double> zetas, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator(), shared_ptr<TracingState> state=nullptr);
 
 template<template<class, std::size_t, xt::layout_type> class T>
 tuple<vector<array<double, 5>>, vector<array<double, 6>>>
 particle_guiding_center_tracing(
         shared_ptr<MagneticField<T>> field, array<double, 3> xyz_init,
         double m, double q, double vtotal, double vtang, double tmax, double tol, bool vacuum,
-        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria);
+        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator(), shared_ptr<TracingState> state=nullptr);
+
+// Traces a block of particles in a vacuum field with the guiding center
+// equations. The particles are advanced in lockstep, each with its own time
+// step, and the field is evaluated for all particles that are still active at
+// once. The result for each particle is the same as for
+// particle_guiding_center_tracing up to the tolerance of the integrator.
+// ToroidalTransitStoppingCriterion is not supported, since it stores the state
+// of the particle it was last called for.
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 5>>, vector<array<double, 6>>>>
+particle_guiding_center_tracing_batch(
+        shared_ptr<MagneticField<T>> field, vector<array<double, 3>> xyz_inits,
+        double m, double q, double vtotal, vector<double> vtangs, double tmax, double tol,
+        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output=TrajectoryOutput());
 
 template<template<class, std::size_t, xt::layout_type> class T>
 tuple<vector<array<double, 7>>, vector<array<double, 8>>>
 particle_fullorbit_tracing(
         shared_ptr<MagneticField<T>> field, array<double, 3> xyz_init, array<double, 3> v_init,
-        double m, double q, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria);
+        double m, double q, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator(), shared_ptr<TracingState> state=nullptr);
 
 template<template<class, std::size_t, xt::layout_type> class T>
 tuple<vector<array<double, 4>>, vector<array<double, 5>>>
 fieldline_tracing(
         shared_ptr<MagneticField<T>> field, array<double, 3> xyz_init,
-        double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria);
+        double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator());
+
+// The following functions trace many particles (or field lines) at once and
+// return one result per initial condition, in the same format as the
+// functions above. The work is distributed dynamically over nthreads threads
+// (0 means the number of OpenMP threads). Every thread evaluates its own copy
+// of the field, see MagneticField::thread_copy; fields that do not support
+// copying are traced on a single thread.
+// ToroidalTransitStoppingCriterion is only supported for nthreads = 1.
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 5>>, vector<array<double, 6>>>>
+particle_guiding_center_tracing_many(
+        shared_ptr<MagneticField<T>> field, vector<array<double, 3>> xyz_inits,
+        double m, double q, double vtotal, vector<double> vtangs, double tmax, double tol, bool vacuum,
+        vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator());
+
+// For Boozer fields, see BoozerMagneticField::thread_copy.
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 5>>, vector<array<double, 6>>>>
+particle_guiding_center_boozer_tracing_many(
+        shared_ptr<BoozerMagneticField<T>> field, vector<array<double, 3>> stz_inits,
+        double m, double q, double vtotal, vector<double> vtangs, double tmax, double tol,
+        bool vacuum, bool noK, vector<double> zetas, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator());
+
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 7>>, vector<array<double, 8>>>>
+particle_fullorbit_tracing_many(
+        shared_ptr<MagneticField<T>> field, vector<array<double, 3>> xyz_inits, vector<array<double, 3>> v_inits,
+        double m, double q, double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator());
+
+template<template<class, std::size_t, xt::layout_type> class T>
+vector<tuple<vector<array<double, 4>>, vector<array<double, 5>>>>
+fieldline_tracing_many(
+        shared_ptr<MagneticField<T>> field, vector<array<double, 3>> xyz_inits,
+        double tmax, double tol, vector<double> phis, vector<shared_ptr<StoppingCriterion>> stopping_criteria, int nthreads, TrajectoryOutput output=TrajectoryOutput(), Integrator integrator=Integrator());
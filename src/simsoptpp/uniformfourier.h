@@ -0,0 +1,295 @@
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <unsupported/Eigen/FFT>
+#include "harmonics.h"
+
+using std::vector;
+
+// Fourier curves and surfaces are usually evaluated on uniform quadrature
+// points, e.g. np.linspace(0, 1, n, endpoint=False). On such a grid the
+// evaluation of a Fourier series is an inverse discrete Fourier transform,
+// and the contraction of a vector with the basis functions (needed for the
+// vector Jacobian products) is a forward transform. Both can be computed in
+// O(n log n) instead of O(n * modes) operations using an FFT.
+//
+// The FFT is used automatically once the number of modes exceeds
+// fft_min_modes, and only if the quadrature points are uniform. This can be
+// changed globally via set_fft_mode("auto" | "always" | "never").
+//
+// On other quadrature points, FourierSeries provides the same two operations
+// from tables of the basis functions. Since the Fourier curves and surfaces
+// are linear in their dofs, synthesize applies the Jacobian of gamma with
+// respect to the dofs and analyze its transpose, without forming the dense
+// (numquadpoints, 3, num_dofs) tensor.
+
+enum FFTMode { FFT_AUTO = 0, FFT_ALWAYS, FFT_NEVER };
+
+inline FFTMode& fft_mode_ref() {
+    static FFTMode mode = FFT_AUTO;
+    return mode;
+}
+
+inline void set_fft_mode(const std::string& mode) {
+    if(mode == "auto")
+        fft_mode_ref() = FFT_AUTO;
+    else if(mode == "always")
+        fft_mode_ref() = FFT_ALWAYS;
+    else if(mode == "never")
+        fft_mode_ref() = FFT_NEVER;
+    else
+        throw std::invalid_argument("Unknown fft mode " + mode + ", expected one of 'auto', 'always' or 'never'.");
+}
+
+inline std::string get_fft_mode() {
+    switch(fft_mode_ref()) {
+        case FFT_ALWAYS: return "always";
+        case FFT_NEVER: return "never";
+        default: return "auto";
+    }
+}
+
+// Below this number of modes, the direct evaluation is faster.
+constexpr int fft_min_modes = 8;
+
+inline bool fft_wanted(int modes) {
+    FFTMode mode = fft_mode_ref();
+    return mode == FFT_ALWAYS || (mode == FFT_AUTO && modes >= fft_min_modes);
+}
+
+// The grid of angles theta_k = 2*pi*frequency*quadpoints[k]. It is uniform if
+// theta_k = theta0 + 2*pi*stride*k/N for an integer stride, so that
+// exp(i*j*theta_k) = exp(i*j*theta0) * exp(2*pi*i*(j*stride mod N)*k/N).
+// For curves and surfaces with nfp field periods the frequency is nfp, and
+// quadrature points on [0, 1/nfp) and on [0, 1) both give uniform grids.
+struct UniformGrid {
+    bool uniform = false;
+    int N = 0;
+    int stride = 0;
+    double theta0 = 0.;
+};
+
+template<class Array>
+UniformGrid uniform_grid(const Array& quadpoints, int frequency) {
+    UniformGrid grid;
+    int N = quadpoints.size();
+    if(N < 2)
+        return grid;
+    double h = quadpoints[1] - quadpoints[0];
+    for (int k = 2; k < N; ++k) {
+        if(std::abs(quadpoints[k] - (quadpoints[0] + k*h)) > 1e-12)
+            return grid;
+    }
+    double s = frequency * h * N;
+    int stride = std::lround(s);
+    if(stride == 0 || std::abs(s - stride) > 1e-10)
+        return grid;
+    grid.uniform = true;
+    grid.N = N;
+    grid.stride = stride;
+    grid.theta0 = 2*M_PI*frequency*quadpoints[0];
+    return grid;
+}
+
+// Real Fourier series
+//
+//      f(theta) = \sum_{j=0}^{J} a_j cos(j*theta) + b_j sin(j*theta)
+//
+// on a uniform grid. Several series are evaluated at once; coefficients and
+// values are stored row by row, i.e. a[i*(J+1) + j] and f[i*N + k] for the
+// i-th series. Two real series are combined into one complex transform.
+class UniformFourierSeries {
+    private:
+        typedef std::complex<double> Complex;
+        UniformGrid grid;
+        int J;
+        vector<int> bins;       // j*stride mod N
+        vector<Complex> shifts; // exp(i*j*theta0)
+
+        // (i*j)^p
+        static Complex derivative_factor(int j, int p) {
+            Complex res(1., 0.);
+            for (int l = 0; l < p; ++l)
+                res *= Complex(0., j);
+            return res;
+        }
+
+    public:
+        UniformFourierSeries(const UniformGrid& grid, int J) : grid(grid), J(J), bins(J+1), shifts(J+1) {
+            int N = grid.N;
+            for (int j = 0; j <= J; ++j) {
+                bins[j] = (int)(((long)j * grid.stride % N + N) % N);
+                shifts[j] = std::polar(1., j * grid.theta0);
+            }
+        }
+
+        int size() const { return grid.N; }
+
+        // Evaluates the p-th derivative with respect to theta of `count` series.
+        void synthesize(int count, const double* a, const double* b, int p, double* f) const {
+            int N = grid.N;
+            int npairs = (count + 1)/2;
+#pragma omp parallel
+            {
+                Eigen::FFT<double> fft;
+                fft.SetFlag(Eigen::FFT<double>::Unscaled);
+                vector<Complex> X(N), values(N);
+#pragma omp for
+                for (int pair = 0; pair < npairs; ++pair) {
+                    std::fill(X.begin(), X.end(), Complex(0., 0.));
+                    for (int l = 0; l < 2 && 2*pair + l < count; ++l) {
+                        int i = 2*pair + l;
+                        // the second series of a pair goes into the imaginary part
+                        Complex unit = l == 0 ? Complex(1., 0.) : Complex(0., 1.);
+                        for (int j = 0; j <= J; ++j) {
+                            Complex c = Complex(a[i*(J+1) + j], -b[i*(J+1) + j]) * shifts[j] * derivative_factor(j, p);
+                            // split into a hermitian spectrum so that the transform is real
+                            X[bins[j]] += unit * 0.5 * c;
+                            X[(N - bins[j]) % N] += unit * 0.5 * std::conj(c);
+                        }
+                    }
+                    fft.inv(values, X);
+                    for (int k = 0; k < N; ++k)
+                        f[2*pair*N + k] = values[k].real();
+                    if(2*pair + 1 < count) {
+                        for (int k = 0; k < N; ++k)
+                            f[(2*pair+1)*N + k] = values[k].imag();
+                    }
+                }
+            }
+        }
+
+        // The adjoint of synthesize:
+        //      A_j = \sum_k v_k d^p/dtheta^p cos(j*theta_k)
+        //      B_j = \sum_k v_k d^p/dtheta^p sin(j*theta_k)
+        void analyze(int count, const double* v, int p, double* A, double* B) const {
+            int N = grid.N;
+            int npairs = (count + 1)/2;
+#pragma omp parallel
+            {
+                Eigen::FFT<double> fft;
+                vector<Complex> z(N), Z(N);
+#pragma omp for
+                for (int pair = 0; pair < npairs; ++pair) {
+                    bool second = 2*pair + 1 < count;
+                    for (int k = 0; k < N; ++k)
+                        z[k] = Complex(v[2*pair*N + k], second ? v[(2*pair+1)*N + k] : 0.);
+                    fft.fwd(Z, z);
+                    for (int j = 0; j <= J; ++j) {
+                        Complex Zp = Z[bins[j]];
+                        Complex Zm = std::conj(Z[(N - bins[j]) % N]);
+                        // the transforms of the real and imaginary part
+                        Complex V[2] = {0.5*(Zp + Zm), Complex(0., -0.5)*(Zp - Zm)};
+                        for (int l = 0; l < 2 && 2*pair + l < count; ++l) {
+                            int i = 2*pair + l;
+                            // \sum_k v_k exp(i*j*theta_k)
+                            Complex S = shifts[j] * std::conj(V[l]) * derivative_factor(j, p);
+                            A[i*(J+1) + j] = S.real();
+                            B[i*(J+1) + j] = S.imag();
+                        }
+                    }
+                }
+            }
+        }
+};
+
+// The same series as UniformFourierSeries at arbitrary angles
+// theta_k = 2*pi*frequency*quadpoints[k], evaluated directly in O(N*J)
+// operations from tables of cos(j*theta_k) and sin(j*theta_k).
+class FourierSeries {
+    private:
+        int N;
+        int J;
+        vector<double> cosines; // cos(j*theta_k) at [j*N + k]
+        vector<double> sines;
+
+        // j^p cos^{(p)}(j*theta_k) and j^p sin^{(p)}(j*theta_k), using
+        // cos^{(p)}(x) = cos(x + p*pi/2) and sin^{(p)}(x) = sin(x + p*pi/2).
+        inline void basis(int j, int k, int p, double& c, double& s) const {
+            double cj = cosines[j*N + k];
+            double sj = sines[j*N + k];
+            double scale = std::pow(j, p);
+            switch(p % 4) {
+                case 0: c = cj; s = sj; break;
+                case 1: c = -sj; s = cj; break;
+                case 2: c = -cj; s = -sj; break;
+                default: c = sj; s = -cj; break;
+            }
+            c *= scale;
+            s *= scale;
+        }
+
+    public:
+        template<class Array>
+        FourierSeries(const Array& quadpoints, int frequency, int J) : N(quadpoints.size()), J(J), cosines((J+1)*N), sines((J+1)*N) {
+#pragma omp parallel for
+            for (int k = 0; k < N; ++k) {
+                Harmonics<double> h(2*M_PI*frequency*quadpoints[k]);
+                for (int j = 0; j <= J; ++j, h.next()) {
+                    cosines[j*N + k] = h.cos();
+                    sines[j*N + k] = h.sin();
+                }
+            }
+        }
+
+        int size() const { return N; }
+
+        void synthesize(int count, const double* a, const double* b, int p, double* f) const {
+#pragma omp parallel for
+            for (int k = 0; k < N; ++k) {
+                for (int i = 0; i < count; ++i) {
+                    double res = 0.;
+                    for (int j = 0; j <= J; ++j) {
+                        double c, s;
+                        basis(j, k, p, c, s);
+                        res += a[i*(J+1) + j] * c + b[i*(J+1) + j] * s;
+                    }
+                    f[i*N + k] = res;
+                }
+            }
+        }
+
+        void analyze(int count, const double* v, int p, double* A, double* B) const {
+#pragma omp parallel for collapse(2)
+            for (int i = 0; i < count; ++i) {
+                for (int j = 0; j <= J; ++j) {
+                    double resA = 0., resB = 0.;
+                    for (int k = 0; k < N; ++k) {
+                        double c, s;
+                        basis(j, k, p, c, s);
+                        resA += v[i*N + k] * c;
+                        resB += v[i*N + k] * s;
+                    }
+                    A[i*(J+1) + j] = resA;
+                    B[i*(J+1) + j] = resB;
+                }
+            }
+        }
+};
+
+// Calls f(series) with the series for the angles 2*pi*frequency*quadpoints
+// and modes 0, ..., J: a UniformFourierSeries if an FFT is wanted and the
+// quadrature points are uniform, and a FourierSeries otherwise.
+template<class Array, class F>
+auto with_fourier_series(const Array& quadpoints, int frequency, int J, bool fft, F&& f) {
+    if(fft) {
+        UniformGrid grid = uniform_grid(quadpoints, frequency);
+        if(grid.uniform)
+            return f(UniformFourierSeries(grid, J));
+    }
+    return f(FourierSeries(quadpoints, frequency, J));
+}
+
+// Binomial coefficients for the product rule, e.g. in
+// d^p/dphi^p (r(phi) cos(phi)) = \sum_q binomial(p, q) r^{(q)}(phi) cos^{(p-q)}(phi),
+// where cos^{(d)}(phi) = cos(phi + d*pi/2).
+inline double binomial(int p, int q) {
+    double res = 1.;
+    for (int l = 1; l <= q; ++l)
+        res = res * (p - q + l) / l;
+    return res;
+}
@@ -0,0 +1,221 @@
+#include "virtual_casing.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "xtensor/xbuilder.hpp"
+#include "vec3dsimd.h"
+#include "gil.h"
+
+#if defined(USE_XSIMD)
+typedef Vec3dSimd Vec3dPack;
+typedef simd_t RealPack;
+static constexpr int pack_size = simd_t::size;
+
+// 1/r, except for the source point that coincides with the target
+static inline simd_t rinv_without_self(const simd_t& r2) {
+    return xsimd::select(r2 > simd_t(0.), rsqrt(r2), simd_t(0.));
+}
+
+static inline void store(const simd_t& x, double* ptr) {
+    x.store_aligned(ptr);
+}
+#else
+typedef Vec3dStd Vec3dPack;
+typedef double RealPack;
+static constexpr int pack_size = 1;
+
+static inline double rinv_without_self(double r2) {
+    return r2 > 0. ? rsqrt(r2) : 0.;
+}
+
+static inline void store(double x, double* ptr) {
+    *ptr = x;
+}
+#endif
+
+// Side length of the blocks of source points that may be evaluated on a
+// coarser grid, and thereby the largest coarsening.
+static constexpr int block_size = 8;
+
+struct SourceBlock {
+    // range of the block in the grid of the full torus
+    int phi0, phi1, theta0, theta1;
+    // only full blocks are coarsened
+    bool full;
+    // bounding sphere and largest distance of neighbouring grid points
+    Vec3d center;
+    double radius;
+    double spacing;
+};
+
+// The source points of the full torus, in SoA layout. With the unit normal
+// n and the area element dA, the data of a point is its position x, the
+// weighted normal N = n dA, and sigma = N . B and K = N x B.
+struct Sources {
+    vector<double> x, y, z, nx, ny, nz, sigma, kx, ky, kz;
+};
+
+static Sources rotated_sources(Array& gamma, Array& normal, Array& B, int nfp, double weight) {
+    int n = gamma.shape(0)*gamma.shape(1);
+    Sources s;
+    for (auto* v : {&s.x, &s.y, &s.z, &s.nx, &s.ny, &s.nz, &s.sigma, &s.kx, &s.ky, &s.kz})
+        v->resize(nfp*n);
+    double* g = gamma.data();
+    double* nn = normal.data();
+    double* b = B.data();
+    for (int p = 0; p < nfp; ++p) {
+        double c = std::cos(2*M_PI*p/nfp);
+        double sn = std::sin(2*M_PI*p/nfp);
+        auto rotate = [c, sn](const double* v) {
+            return Vec3d{c*v[0] - sn*v[1], sn*v[0] + c*v[1], v[2]};
+        };
+        for (int k = 0; k < n; ++k) {
+            Vec3d xk = rotate(g + 3*k);
+            Vec3d nk = weight*rotate(nn + 3*k);
+            Vec3d bk = rotate(b + 3*k);
+            Vec3d kk = cross(nk, bk);
+            int kp = p*n + k;
+            s.x[kp] = xk.coeff(0); s.y[kp] = xk.coeff(1); s.z[kp] = xk.coeff(2);
+            s.nx[kp] = nk.coeff(0); s.ny[kp] = nk.coeff(1); s.nz[kp] = nk.coeff(2);
+            s.sigma[kp] = inner(nk, bk);
+            s.kx[kp] = kk.coeff(0); s.ky[kp] = kk.coeff(1); s.kz[kp] = kk.coeff(2);
+        }
+    }
+    return s;
+}
+
+static vector<SourceBlock> source_blocks(const Sources& s, int nfp, int nphi, int ntheta) {
+    vector<SourceBlock> blocks;
+    auto point = [&s, ntheta](int i, int j) {
+        int k = i*ntheta + j;
+        return Vec3d{s.x[k], s.y[k], s.z[k]};
+    };
+    for (int p = 0; p < nfp; ++p) {
+        for (int i0 = 0; i0 < nphi; i0 += block_size) {
+            for (int j0 = 0; j0 < ntheta; j0 += block_size) {
+                SourceBlock b;
+                b.phi0 = p*nphi + i0;
+                b.phi1 = p*nphi + std::min(i0 + block_size, nphi);
+                b.theta0 = j0;
+                b.theta1 = std::min(j0 + block_size, ntheta);
+                b.full = b.phi1 - b.phi0 == block_size && b.theta1 - b.theta0 == block_size;
+                b.center = Vec3d::Zero();
+                for (int i = b.phi0; i < b.phi1; ++i)
+                    for (int j = b.theta0; j < b.theta1; ++j)
+                        b.center += point(i, j);
+                b.center /= (b.phi1 - b.phi0)*(b.theta1 - b.theta0);
+                b.radius = 0.;
+                b.spacing = 0.;
+                for (int i = b.phi0; i < b.phi1; ++i) {
+                    for (int j = b.theta0; j < b.theta1; ++j) {
+                        b.radius = std::max(b.radius, norm(point(i, j) - b.center));
+                        if(i + 1 < b.phi1)
+                            b.spacing = std::max(b.spacing, norm(point(i + 1, j) - point(i, j)));
+                        if(j + 1 < b.theta1)
+                            b.spacing = std::max(b.spacing, norm(point(i, j + 1) - point(i, j)));
+                    }
+                }
+                blocks.push_back(b);
+            }
+        }
+    }
+    return blocks;
+}
+
+Array virtual_casing_B_external(Array& gamma, Array& normal, Array& B, Array& targets, Array& B_targets, int nfp, double eta) {
+    if(gamma.dimension() != 3 || gamma.shape(2) != 3)
+        throw std::logic_error("gamma needs to be given on a (nphi, ntheta, 3) grid.");
+    if(normal.shape() != gamma.shape() || B.shape() != gamma.shape())
+        throw std::logic_error("gamma, normal and B need to have the same shape.");
+    if(targets.shape() != B_targets.shape() || targets.size() % 3 != 0)
+        throw std::logic_error("targets and B_targets need to have the same shape (..., 3).");
+    if(nfp < 1)
+        throw std::logic_error("nfp needs to be positive.");
+    int nphi = gamma.shape(0);
+    int ntheta = gamma.shape(1);
+    int ntargets = targets.size()/3;
+
+    Array res = xt::zeros<double>(targets.shape());
+    if(ntargets == 0)
+        return res;
+    double* t = targets.data();
+    double* bt = B_targets.data();
+    double* r = res.data();
+    {
+        ReleaseGIL nogil;
+        double weight = 1./(nfp*nphi*ntheta);
+        Sources s = rotated_sources(gamma, normal, B, nfp, weight);
+        vector<SourceBlock> blocks = source_blocks(s, nfp, nphi, ntheta);
+
+        // the targets are padded with copies of the last one, and each
+        // group of pack_size targets gets its bounding sphere
+        int npacks = (ntargets + pack_size - 1)/pack_size;
+        AlignedPaddedVec tx(npacks*pack_size), ty(npacks*pack_size), tz(npacks*pack_size);
+        for (int i = 0; i < npacks*pack_size; ++i) {
+            int ii = std::min(i, ntargets - 1);
+            tx[i] = t[3*ii + 0];
+            ty[i] = t[3*ii + 1];
+            tz[i] = t[3*ii + 2];
+        }
+        vector<Vec3d> pack_center(npacks, Vec3d::Zero());
+        vector<double> pack_radius(npacks, 0.);
+        for (int ip = 0; ip < npacks; ++ip) {
+            for (int l = 0; l < pack_size; ++l)
+                pack_center[ip] += Vec3d{tx[ip*pack_size + l], ty[ip*pack_size + l], tz[ip*pack_size + l]};
+            pack_center[ip] /= pack_size;
+            for (int l = 0; l < pack_size; ++l)
+                pack_radius[ip] = std::max(pack_radius[ip], norm(Vec3d{tx[ip*pack_size + l], ty[ip*pack_size + l], tz[ip*pack_size + l]} - pack_center[ip]));
+        }
+
+        // The integral splits into a part that only depends on the sources,
+        //   S = \int [(n'.B') d + (n' x B') x d] / |d|^3 dA',
+        // and a part that is linear in B(x),
+        //   \int [(n'.B(x)) d + (n' x B(x)) x d] / |d|^3 dA' = Q x B(x) + q B(x)
+        // with Q = \int (n' x d) / |d|^3 dA' and q = \int (n'.d) / |d|^3 dA',
+        // where d = x - x'.
+#pragma omp parallel for schedule(dynamic)
+        for (int ip = 0; ip < npacks; ++ip) {
+            int t0 = ip*pack_size;
+            Vec3dPack x(&tx[t0], &ty[t0], &tz[t0]);
+            Vec3dPack S, Q;
+            RealPack q(0.);
+            for (const SourceBlock& b : blocks) {
+                int stride = 1;
+                if(eta > 0 && b.full) {
+                    double dist = norm(b.center - pack_center[ip]) - b.radius - pack_radius[ip];
+                    while(2*stride <= block_size && dist >= eta*2*stride*b.spacing)
+                        stride *= 2;
+                }
+                double w = stride*stride;
+                for (int i = b.phi0; i < b.phi1; i += stride) {
+                    for (int j = b.theta0; j < b.theta1; j += stride) {
+                        int k = i*ntheta + j;
+                        Vec3dPack diff = x - Vec3dPack(s.x[k], s.y[k], s.z[k]);
+                        RealPack rinv = rinv_without_self(normsq(diff));
+                        RealPack fak = rinv*rinv*rinv*w;
+                        Vec3dPack nk(s.nx[k], s.ny[k], s.nz[k]);
+                        Vec3dPack kk(s.kx[k], s.ky[k], s.kz[k]);
+                        S += (diff*RealPack(s.sigma[k]) + cross(kk, diff))*fak;
+                        Q += cross(nk, diff)*fak;
+                        q += inner(nk, diff)*fak;
+                    }
+                }
+            }
+            alignas(64) double lanes[7][pack_size];
+            store(S.x, lanes[0]); store(S.y, lanes[1]); store(S.z, lanes[2]);
+            store(Q.x, lanes[3]); store(Q.y, lanes[4]); store(Q.z, lanes[5]);
+            store(q, lanes[6]);
+            for (int l = 0; l < pack_size && t0 + l < ntargets; ++l) {
+                int ti = t0 + l;
+                Vec3d Bt{bt[3*ti + 0], bt[3*ti + 1], bt[3*ti + 2]};
+                Vec3d St{lanes[0][l], lanes[1][l], lanes[2][l]};
+                Vec3d Qt{lanes[3][l], lanes[4][l], lanes[5][l]};
+                Vec3d Bext = Bt - (St - cross(Qt, Bt) - lanes[6][l]*Bt)/(4*M_PI);
+                r[3*ti + 0] = Bext.coeff(0);
+                r[3*ti + 1] = Bext.coeff(1);
+                r[3*ti + 2] = Bext.coeff(2);
+            }
+        }
+    }
+    return res;
+}
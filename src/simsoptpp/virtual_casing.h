@@ -0,0 +1,27 @@
+#pragma once
+
+#include "xtensor-python/pyarray.hpp"     // Numpy bindings
+typedef xt::pyarray<double> Array;
+
+// Virtual casing principle: computes the part of the magnetic field on a
+// closed surface that is due to currents outside of the surface, given the
+// total field B on the surface,
+//
+//   B_ext(x) = B(x) - 1/(4 pi) \int [(n'.(B' - B(x))) (x - x') + (n' x (B' - B(x))) x (x - x')] / |x - x'|^3 dA'
+//
+// where n' is the outward normal. Subtracting B(x) turns the principal value
+// integral into a weakly singular one, with an integrand of order
+// 1/|x - x'|, which is computed with the trapezoidal rule, leaving out x' = x.
+//
+// gamma, normal and B are given on a uniform (nphi, ntheta) grid of one
+// field period of the surface, normal as returned by Surface::normal(), i.e.
+// not normalized, but pointing outwards. The other field periods are
+// obtained by rotating the grid nfp times. B_ext is evaluated at the points targets (..., 3) on the surface,
+// at which the total field is B_targets, e.g. the grid points of a single
+// field period.
+//
+// For eta > 0, blocks of 8x8 source points that are far away from a group of
+// targets are evaluated on a coarser grid, with 2, 4 or 8 times the spacing,
+// if the distance is at least eta times the coarse spacing. This is the
+// analogue of BiotSavart::set_adaptive_quadrature for surface integrals.
+Array virtual_casing_B_external(Array& gamma, Array& normal, Array& B, Array& targets, Array& B_targets, int nfp, double eta=0.);
@@ -1,10 +1,12 @@
+import os
 import unittest
 
 import numpy as np
 
 from simsopt.geo.curvexyzfourier import CurveXYZFourier
-from simsopt.field.biotsavart import BiotSavart
-from simsopt.field.coil import Coil, Current, ScaledCurrent
+from simsopt.field.biotsavart import BiotSavart, BiotSavartSymmetric
+from simsopt.field.coil import Coil, Current, ScaledCurrent, coils_via_symmetries
+import simsoptpp as sopp
 
 
 def get_curve(num_quadrature_points=200, perturb=False):
@@ -32,6 +34,488 @@ class Testing(unittest.TestCase):
         assert np.linalg.norm(B1) > 1e-5
         assert np.allclose(B1, B2)
 
+    def test_biotsavart_treecode(self):
+        np.random.seed(1)
+        coils = [Coil(get_curve(perturb=True), Current(1e4)) for _ in range(3)]
+        points = 3 * (np.random.rand(50, 3) - 0.5)
+        bs = BiotSavart(coils).set_points(points)
+        B, dB, ddB = bs.B(), bs.dB_by_dX(), bs.d2B_by_dXdX()
+        A, dA = bs.A(), bs.dA_by_dX()
+        errs_old = None
+        for theta in [0.4, 0.2, 0.1]:
+            bs.set_treecode(theta)
+            assert bs.treecode_theta == theta
+            errs = [np.linalg.norm(bs.B()-B)/np.linalg.norm(B),
+                    np.linalg.norm(bs.dB_by_dX()-dB)/np.linalg.norm(dB),
+                    np.linalg.norm(bs.d2B_by_dXdX()-ddB)/np.linalg.norm(ddB),
+                    np.linalg.norm(bs.A()-A)/np.linalg.norm(A),
+                    np.linalg.norm(bs.dA_by_dX()-dA)/np.linalg.norm(dA)]
+            assert max(errs) < 0.1
+            if errs_old is not None:
+                assert all(e < 0.5 * eo for e, eo in zip(errs, errs_old))
+            errs_old = errs
+        # the per coil field cache is filled in the same way as for the direct sum
+        dB_by_dcoilcurrents = bs.dB_by_dcoilcurrents()
+        assert np.allclose(sum(c.current.get_value() * Bi for c, Bi in zip(coils, dB_by_dcoilcurrents)), bs.B())
+        bs.set_treecode(0.)
+        assert np.allclose(bs.B(), B)
+
+    def test_biotsavart_compute_all(self):
+        np.random.seed(1)
+        coils = [Coil(get_curve(perturb=True), Current(1e4)) for _ in range(3)]
+        points = 3 * (np.random.rand(37, 3) - 0.5)
+        bs = BiotSavart(coils).set_points(points)
+        ref = [bs.B(), bs.dB_by_dX(), bs.d2B_by_dXdX(), bs.A(), bs.dA_by_dX(), bs.d2A_by_dXdX()]
+        for derivs_B in range(3):
+            for derivs_A in range(3):
+                bs.set_points(points)
+                bs.compute_all(derivs_B, derivs_A)
+                assert np.allclose(bs.B_ref(), ref[0])
+                assert np.allclose(bs.A_ref(), ref[3])
+                if derivs_B > 0:
+                    assert np.allclose(bs.dB_by_dX_ref(), ref[1])
+                if derivs_B > 1:
+                    assert np.allclose(bs.d2B_by_dXdX_ref(), ref[2])
+                if derivs_A > 0:
+                    assert np.allclose(bs.dA_by_dX_ref(), ref[4])
+                if derivs_A > 1:
+                    assert np.allclose(bs.d2A_by_dXdX_ref(), ref[5])
+                dB_by_dcoilcurrents = bs.dB_by_dcoilcurrents()
+                assert np.allclose(sum(c.current.get_value() * Bi for c, Bi in zip(coils, dB_by_dcoilcurrents)), ref[0])
+
+    def test_biotsavart_mixed_precision(self):
+        np.random.seed(1)
+        coils = [Coil(get_curve(perturb=True), Current(1e4)) for _ in range(3)]
+        points = 3 * (np.random.rand(37, 3) - 0.5)
+        bs = BiotSavart(coils).set_points(points)
+        ref = [bs.B(), bs.dB_by_dX(), bs.d2B_by_dXdX(), bs.A(), bs.dA_by_dX(), bs.d2A_by_dXdX()]
+        bs.set_mixed_precision(True)
+        assert bs.mixed_precision
+        res = [bs.B(), bs.dB_by_dX(), bs.d2B_by_dXdX(), bs.A(), bs.dA_by_dX(), bs.d2A_by_dXdX()]
+        for r, f in zip(ref, res):
+            err = np.linalg.norm(r-f)/np.linalg.norm(r)
+            assert 0 < err < 1e-4, err
+        bs.set_mixed_precision(False)
+        assert np.allclose(bs.B(), ref[0], rtol=1e-13, atol=0)
+
+    def test_biotsavart_totals_only(self):
+        np.random.seed(1)
+        coils = [Coil(get_curve(perturb=True), Current(1e4*(i+1))) for i in range(3)]
+        points = 3 * (np.random.rand(37, 3) - 0.5)
+        bs = BiotSavart(coils).set_points(points)
+        ref = [bs.B(), bs.dB_by_dX(), bs.d2B_by_dXdX(), bs.A(), bs.dA_by_dX(), bs.d2A_by_dXdX()]
+        dB_dI = [b.copy() for b in bs.dB_by_dcoilcurrents()]
+        bs.set_totals_only(True)
+        assert bs.totals_only
+        res = [bs.B(), bs.dB_by_dX(), bs.d2B_by_dXdX(), bs.A(), bs.dA_by_dX(), bs.d2A_by_dXdX()]
+        for r, f in zip(ref, res):
+            assert np.allclose(r, f, rtol=1e-13, atol=1e-13)
+        with self.assertRaises(RuntimeError):
+            bs.dB_by_dcoilcurrents()
+        # also check a set of points that is not a multiple of the chunk size
+        points2 = 3 * (np.random.rand(1001, 3) - 0.5)
+        bs.set_points(points2)
+        B2 = bs.B().copy()
+        bs.set_totals_only(False)
+        assert np.allclose(bs.B(), B2, rtol=1e-13, atol=1e-13)
+        bs.set_points(points)
+        for r, f in zip(dB_dI, bs.dB_by_dcoilcurrents()):
+            assert np.allclose(r, f, rtol=1e-13, atol=0)
+
+    def test_biotsavart_empty(self):
+        # neither an empty coil list nor an empty set of points may break
+        # the splitting of the work into tiles
+        np.random.seed(1)
+        points = 3 * (np.random.rand(20, 3) - 0.5)
+        bs = BiotSavart([]).set_points(points)
+        assert np.all(bs.B() == 0)
+        assert np.all(bs.dB_by_dX() == 0)
+        assert bs.B().shape == (20, 3)
+        coils = [Coil(get_curve(), Current(1e4))]
+        for totals_only in [False, True]:
+            bs = BiotSavart(coils)
+            bs.set_totals_only(totals_only)
+            bs.set_points(np.zeros((0, 3)))
+            assert bs.B().shape == (0, 3)
+            assert bs.dB_by_dX().shape == (0, 3, 3)
+
+    def test_biotsavart_coil_collection(self):
+        # in totals only mode and for B_vjp, the coils are packed into one
+        # array that has to be refreshed when a curve or a current changes
+        np.random.seed(1)
+        curves = [get_curve(num_quadrature_points=n, perturb=True) for n in [200, 101, 37]]
+        currents = [Current(1e4*(i+1)) for i in range(3)]
+        coils = [Coil(c, I) for c, I in zip(curves, currents)]
+        points = 3 * (np.random.rand(37, 3) - 0.5)
+        v = np.random.standard_normal(size=(len(points), 3))
+        bs = BiotSavart(coils).set_points(points)
+        bs.set_totals_only(True)
+        for step in range(3):
+            ref = BiotSavart(coils).set_points(points)
+            for f, r in [(bs.B, ref.B), (bs.dB_by_dX, ref.dB_by_dX), (bs.d2B_by_dXdX, ref.d2B_by_dXdX),
+                         (bs.A, ref.A), (bs.dA_by_dX, ref.dA_by_dX), (bs.d2A_by_dXdX, ref.d2A_by_dXdX)]:
+                assert np.allclose(f(), r(), rtol=1e-13, atol=1e-13)
+            # reference for the vjp from the per coil kernel
+            gammas = [c.gamma() for c in curves]
+            gammadashs = [c.gammadash() for c in curves]
+            res_gamma = [np.zeros_like(g) for g in gammas]
+            res_gammadash = [np.zeros_like(g) for g in gammadashs]
+            sopp.biot_savart_vjp_graph(points, gammas, gammadashs, [I.get_value() for I in currents], v,
+                                       res_gamma, res_gammadash, [], [], [])
+            res_current = [np.sum(v * B) for B in ref.dB_by_dcoilcurrents()]
+            vjp_gamma = [np.zeros_like(g) for g in gammas]
+            vjp_gammadash = [np.zeros_like(g) for g in gammadashs]
+            vjp_current = bs.B_vjp_graph(v, vjp_gamma, vjp_gammadash)
+            for i in range(3):
+                assert np.allclose(vjp_gamma[i], res_gamma[i], rtol=1e-12, atol=1e-12)
+                assert np.allclose(vjp_gammadash[i], res_gammadash[i], rtol=1e-12, atol=1e-12)
+                assert np.allclose(vjp_current[i], res_current[i], rtol=1e-12, atol=0)
+            vjp = bs.B_vjp(v)
+            vjp_ref = ref.B_vjp(v)
+            for c in curves:
+                assert np.allclose(vjp(c), vjp_ref(c), rtol=1e-12, atol=1e-12)
+            # change the shape of one coil and the current of another
+            curves[step].x = curves[step].x + 0.01 * np.random.standard_normal(size=curves[step].x.shape)
+            currents[(step + 1) % 3].x = 1.5 * currents[(step + 1) % 3].x
+        with self.assertRaises(ValueError):
+            bs.B_vjp_graph(v[:10], vjp_gamma, vjp_gammadash)
+        with self.assertRaises(ValueError):
+            bs.B_vjp_graph(v, vjp_gamma[:2], vjp_gammadash[:2])
+
+    def test_biotsavart_per_coil_updates(self):
+        np.random.seed(1)
+        curves = [get_curve(perturb=True) for _ in range(3)]
+        currents = [Current(1e4*(i+1)) for i in range(3)]
+        coils = [Coil(c, I) for c, I in zip(curves, currents)]
+        points = 3 * (np.random.rand(37, 3) - 0.5)
+        bs = BiotSavart(coils).set_points(points)
+        bs.B(), bs.dB_by_dX(), bs.A()
+        B_1 = bs.fieldcache_get_or_create('B_1', [len(points), 3]).copy()
+
+        def check():
+            ref = BiotSavart(coils).set_points(points)
+            assert np.allclose(bs.B(), ref.B(), rtol=1e-13, atol=0)
+            assert np.allclose(bs.dB_by_dX(), ref.dB_by_dX(), rtol=1e-13, atol=0)
+            assert np.allclose(bs.A(), ref.A(), rtol=1e-13, atol=0)
+            for i in range(len(coils)):
+                assert np.allclose(bs.dB_by_dcoilcurrents()[i], ref.dB_by_dcoilcurrents()[i], rtol=1e-13, atol=0)
+
+        # a change of a current only requires summing up the per coil fields
+        currents[1].x = currents[1].x * 2
+        assert bs.fieldcache_get_status('B_1')
+        check()
+        # a change of one curve only invalidates the field of that coil
+        curves[0].x = curves[0].x + 1e-2
+        assert not bs.fieldcache_get_status('B_0')
+        assert bs.fieldcache_get_status('B_1')
+        check()
+        assert np.array_equal(bs.fieldcache_get_or_create('B_1', [len(points), 3]), B_1)
+        # new points discard all per coil fields
+        bs.set_points(points + 0.1)
+        assert not bs.fieldcache_get_status('B_1')
+        points = points + 0.1
+        check()
+
+    def test_biotsavart_scratch_allocations(self):
+        # after a first evaluation, repeated evaluations take their
+        # temporaries from the scratch arena and don't allocate
+        import simsoptpp as sopp
+        np.random.seed(1)
+        curves = [get_curve(perturb=True) for _ in range(3)]
+        currents = [Current(1e4*(i+1)) for i in range(3)]
+        bs = BiotSavart([Coil(c, I) for c, I in zip(curves, currents)])
+        bs.set_points(3 * (np.random.rand(37, 3) - 0.5))
+        bs.dB_by_dX()
+        bs.A()
+        allocations = sopp.scratch_heap_allocations()
+        for k in range(3):
+            currents[0].x = currents[0].x * 1.1
+            curves[1].x = curves[1].x + 1e-3
+            bs.dB_by_dX()
+            bs.A()
+        assert sopp.scratch_heap_allocations() == allocations
+        assert sopp.scratch_capacity() > 0
+
+    def test_biotsavart_perf_counters(self):
+        if not sopp.perf_counters_enabled:
+            self.skipTest("simsoptpp was built without SIMSOPT_PERF_COUNTERS")
+        np.random.seed(1)
+        bs = BiotSavart([Coil(get_curve(perturb=True), Current(1e4))])
+        bs.set_points(3 * (np.random.rand(37, 3) - 0.5))
+        sopp.reset_perf_counters()
+        bs.B()
+        bs.A()
+        counters = sopp.perf_counters(per_thread=True)
+        assert counters["biot_savart_B"]["calls"] == 1
+        assert counters["biot_savart_B"]["items"] == 37
+        assert counters["biot_savart_B"]["unit"] == "points"
+        assert counters["biot_savart_B"]["time"] > 0
+        assert counters["biot_savart_A"]["calls"] == 1
+        assert counters["biot_savart_vjp"]["calls"] == 0
+        assert sum(t["calls"] for t in counters["biot_savart_B"]["threads"].values()) == 1
+        sopp.reset_perf_counters()
+        assert sopp.perf_counters()["biot_savart_B"]["calls"] == 0
+
+    def test_simd_variant(self):
+        assert sopp.simd_variant in sopp.simd_variants
+        assert sopp.Curve.__module__ == "simsoptpp"
+        if sopp.simd_variant != "native" and "SIMSOPT_SIMD_VARIANT" not in os.environ:
+            # built with SIMSOPT_SIMD_DISPATCH, the best variant is imported by default
+            assert sopp.simd_variant == sopp.simd_variants[0]
+            assert sopp.using_xsimd
+
+    def test_biotsavart_batch(self):
+        np.random.seed(1)
+        coils = [Coil(get_curve(perturb=True), Current(1e4*(i+1))) for i in range(3)]
+        point_sets = [3 * (np.random.rand(n, 3) - 0.5) for n in [1, 37, 200]]
+        main_points = 3 * (np.random.rand(11, 3) - 0.5)
+        bs = BiotSavart(coils).set_points(main_points)
+        B_main = bs.B().copy()
+        Bs = bs.B_batch(point_sets)
+        dBs = bs.dB_by_dX_batch(point_sets)
+        assert len(Bs) == len(point_sets) and len(dBs) == len(point_sets)
+        # the points of the field are untouched
+        assert np.array_equal(bs.get_points_cart(), main_points)
+        assert np.array_equal(bs.B(), B_main)
+        for points, B, dB in zip(point_sets, Bs, dBs):
+            ref = BiotSavart(coils).set_points(points)
+            assert np.allclose(B, ref.B(), rtol=1e-13, atol=1e-13)
+            assert np.allclose(dB, ref.dB_by_dX(), rtol=1e-13, atol=1e-13)
+
+    def test_biotsavart_views(self):
+        np.random.seed(1)
+        coils = [Coil(get_curve(perturb=True), Current(1e4*(i+1))) for i in range(3)]
+        points = 3 * (np.random.rand(20, 3) - 0.5)
+        bs = BiotSavart(coils).set_points(points)
+        B = bs.B_view()
+        dB = bs.dB_by_dX_view()
+        assert not B.flags.writeable
+        assert np.shares_memory(B, bs.B_ref())
+        assert np.array_equal(B, bs.B())
+        B_old, dB_old = B.copy(), dB.copy()
+        # the views keep their values when the field is evaluated again at
+        # different points of the same shape
+        bs.set_points(points[::-1].copy())
+        B_new = bs.B()
+        assert np.array_equal(B, B_old) and np.array_equal(dB, dB_old)
+        assert not np.shares_memory(B, bs.B_ref())
+        assert np.allclose(B_new, B_old[::-1])
+        # evaluating at the same points again reuses the points in SoA layout
+        bs.invalidate_cache()
+        assert np.array_equal(bs.B(), B_new)
+
+    def test_num_threads(self):
+        from concurrent.futures import ThreadPoolExecutor
+        np.random.seed(1)
+        coils = [Coil(get_curve(perturb=True), Current(1e4*(i+1))) for i in range(3)]
+        points = 3 * (np.random.rand(100, 3) - 0.5)
+        B = BiotSavart(coils).set_points(points).B()
+        nthreads = sopp.get_num_threads()
+
+        def evaluate():
+            # the setting only applies to the calling thread
+            sopp.set_num_threads(1)
+            return sopp.get_num_threads(), BiotSavart(coils).set_points(points).B()
+
+        with ThreadPoolExecutor(max_workers=1) as executor:
+            nthreads_worker, B_worker = executor.submit(evaluate).result()
+        assert nthreads_worker == 1
+        assert sopp.get_num_threads() == nthreads
+        assert np.allclose(B, B_worker, rtol=1e-13, atol=1e-13)
+        with self.assertRaises(ValueError):
+            sopp.set_num_threads(0)
+
+    def test_biotsavart_concurrent(self):
+        # the kernels release the GIL, so distinct fields can be evaluated
+        # from several python threads at once
+        from concurrent.futures import ThreadPoolExecutor
+        np.random.seed(1)
+        points = 3 * (np.random.rand(500, 3) - 0.5)
+        fields = [BiotSavart([Coil(get_curve(perturb=True), Current(1e4*(i+1))) for i in range(3)]) for _ in range(4)]
+
+        def evaluate(bs):
+            bs.set_points(points)
+            return bs.B().copy(), bs.dB_by_dX().copy(), bs.A().copy()
+
+        with ThreadPoolExecutor(max_workers=4) as executor:
+            results = list(executor.map(evaluate, fields))
+        for bs, (B, dB, A) in zip(fields, results):
+            bs.set_points(points[::-1].copy())
+            bs.set_points(points)
+            assert np.allclose(B, bs.B(), rtol=1e-13, atol=1e-13)
+            assert np.allclose(dB, bs.dB_by_dX(), rtol=1e-13, atol=1e-13)
+            assert np.allclose(A, bs.A(), rtol=1e-13, atol=1e-13)
+
+    def test_biotsavart_B_and_B_vjp(self):
+        np.random.seed(1)
+        curves = [get_curve(perturb=True) for _ in range(3)]
+        coils = [Coil(c, Current(1e4*(i+1))) for i, c in enumerate(curves)]
+        points = 3 * (np.random.rand(37, 3) - 0.5)
+        v = np.random.standard_normal(size=(len(points), 3))
+        ref = BiotSavart(coils).set_points(points)
+        B_ref, dB_ref = ref.B(), ref.dB_by_dX()
+        vjp_ref = ref.B_vjp(v)
+        bs = BiotSavart(coils).set_points(points)
+        B, vjp = bs.B_and_B_vjp(v)
+        assert np.allclose(B, B_ref, rtol=1e-13, atol=0)
+        for c in curves:
+            assert np.allclose(vjp(c), vjp_ref(c), rtol=1e-12, atol=1e-12)
+        for coil in coils:
+            assert np.allclose(vjp(coil.current), vjp_ref(coil.current), rtol=1e-12, atol=0)
+        # the per coil fields and the gradient are available as well
+        res_gamma = [np.zeros_like(c.gamma()) for c in curves]
+        res_gammadash = [np.zeros_like(c.gammadash()) for c in curves]
+        bs.set_points(points)
+        bs.compute_and_vjp(v, 1, res_gamma, res_gammadash)
+        assert np.allclose(bs.dB_by_dX(), dB_ref, rtol=1e-13, atol=0)
+        for i in range(len(coils)):
+            assert np.allclose(bs.dB_by_dcoilcurrents()[i], ref.dB_by_dcoilcurrents()[i], rtol=1e-13, atol=0)
+
+    def test_biotsavart_adaptive_quadrature(self):
+        np.random.seed(1)
+        coils = [Coil(get_curve(perturb=True), Current(1e4*(i+1))) for i in range(3)]
+        # a mix of points close to and far away from the coils
+        points = np.concatenate((3 * (np.random.rand(64, 3) - 0.5), 20 * (np.random.rand(64, 3) - 0.5)))
+        bs = BiotSavart(coils).set_points(points)
+        ref = [bs.B().copy(), bs.dB_by_dX().copy(), bs.A().copy()]
+        bs.set_adaptive_quadrature(8.)
+        assert bs.adaptive_quadrature == 8.
+        res = [bs.B(), bs.dB_by_dX(), bs.A()]
+        for r, f in zip(ref, res):
+            r, f = r.reshape((len(points), -1)), f.reshape((len(points), -1))
+            err = np.max(np.linalg.norm(r-f, axis=1)/np.linalg.norm(r, axis=1))
+            assert err < 1e-8, err
+        # a large safety factor uses all quadrature points
+        bs.set_adaptive_quadrature(1e10)
+        assert np.allclose(bs.B(), ref[0], rtol=1e-14, atol=0)
+        with self.assertRaises(ValueError):
+            bs.set_adaptive_quadrature(-1.)
+
+    def test_biotsavart_B_and_B_vjp_adaptive_quadrature(self):
+        np.random.seed(1)
+        coils = [Coil(get_curve(perturb=True), Current(1e4*(i+1))) for i in range(3)]
+        points = np.concatenate((3 * (np.random.rand(64, 3) - 0.5), 20 * (np.random.rand(64, 3) - 0.5)))
+        v = np.random.standard_normal(size=(len(points), 3))
+        B_full = BiotSavart(coils).set_points(points).B().copy()
+        ref = BiotSavart(coils).set_points(points)
+        ref.set_adaptive_quadrature(8.)
+        B_ref = ref.B().copy()
+        vjp_ref = ref.B_vjp(v)
+        assert not np.allclose(B_ref, B_full, rtol=1e-14, atol=0)
+        # the fused pass has to give the same field as compute
+        bs = BiotSavart(coils).set_points(points)
+        bs.set_adaptive_quadrature(8.)
+        B, vjp = bs.B_and_B_vjp(v)
+        assert np.allclose(B, B_ref, rtol=1e-14, atol=0)
+        assert np.allclose(bs.B(), B_ref, rtol=1e-14, atol=0)
+        for coil in coils:
+            assert np.allclose(vjp(coil.curve), vjp_ref(coil.curve), rtol=1e-12, atol=1e-12)
+            assert np.allclose(vjp(coil.current), vjp_ref(coil.current), rtol=1e-12, atol=0)
+
+    def test_biotsavart_response_matrix(self):
+        np.random.seed(1)
+        curves = [get_curve(perturb=True) for _ in range(3)]
+        currents = [Current(1e4*(i+1)) for i in range(3)]
+        coils = [Coil(c, I) for c, I in zip(curves, currents)]
+        points = 3 * (np.random.rand(37, 3) - 0.5)
+        normal = np.random.standard_normal(size=(len(points), 3))
+        bs = BiotSavart(coils).set_points(points)
+        R = bs.response_matrix()
+        assert R.shape == (len(coils), len(points), 3)
+        for i in range(len(coils)):
+            assert np.allclose(R[i], bs.dB_by_dcoilcurrents()[i], rtol=1e-14, atol=0)
+        Rn = bs.normal_response_matrix(normal)
+        assert np.allclose(Rn, np.sum(R * normal[None, :, :], axis=2), rtol=1e-14, atol=1e-14)
+
+        I = np.asarray([2e4, -1e4, 5e3])
+        for c, val in zip(currents, I):
+            c.x = [val]
+        B = bs.B()
+        assert np.allclose(bs.B_from_currents(I), B, rtol=1e-13, atol=1e-13)
+        assert np.allclose(bs.Bn_from_currents(normal, I), np.sum(B * normal, axis=1), rtol=1e-13, atol=1e-13)
+        v = np.random.standard_normal(size=(len(points), 3))
+        w = np.random.standard_normal(size=(len(points), ))
+        vjp = bs.B_vjp(v)
+        assert np.allclose(bs.B_vjp_currents(v), [vjp(c)[0] for c in currents], rtol=1e-13, atol=0)
+        assert np.allclose(bs.Bn_vjp_currents(normal, w), bs.B_vjp_currents(w[:, None] * normal), rtol=1e-13, atol=0)
+
+        # a change of the geometry updates the response matrix
+        curves[1].x = curves[1].x + 1e-2
+        ref = BiotSavart(coils).set_points(points)
+        assert np.allclose(bs.B_from_currents(I), ref.B(), rtol=1e-13, atol=1e-13)
+
+    def test_biotsavart_gpu(self):
+        import simsoptpp as sopp
+        if not sopp.gpu_available():
+            with self.assertRaises(RuntimeError):
+                sopp.set_gpu_enabled(True)
+            self.skipTest("No GPU available")
+        np.random.seed(1)
+        curves = [get_curve(perturb=True) for _ in range(3)]
+        coils = [Coil(c, Current(1e4)) for c in curves]
+        points = 3 * (np.random.rand(301, 3) - 0.5)
+        bs = BiotSavart(coils).set_points(points)
+        B, dB, ddB = bs.B(), bs.dB_by_dX(), bs.d2B_by_dXdX()
+        dJ = bs.B_and_dB_vjp(B, dB)
+        vjp = bs.B_vjp(B)
+        try:
+            sopp.set_gpu_enabled(True)
+            # setting the points discards the per coil fields
+            bs.set_points(points)
+            assert np.allclose(bs.B(), B)
+            assert np.allclose(bs.dB_by_dX(), dB)
+            assert np.allclose(bs.d2B_by_dXdX(), ddB)
+            dJ_gpu = bs.B_and_dB_vjp(B, dB)
+            for c in curves:
+                assert np.allclose(dJ[0](c), dJ_gpu[0](c))
+                assert np.allclose(dJ[1](c), dJ_gpu[1](c))
+            vjp_gpu = bs.B_vjp(B)
+            for coil in coils:
+                assert np.allclose(vjp(coil.curve), vjp_gpu(coil.curve))
+                assert np.allclose(vjp(coil.current), vjp_gpu(coil.current))
+            # geometry changes have to be picked up by the device copies
+            curves[0].x = curves[0].x + 1e-2
+            B_gpu = bs.B()
+        finally:
+            sopp.set_gpu_enabled(False)
+        bs.set_points(points)
+        assert np.allclose(bs.B(), B_gpu)
+
+    def test_biotsavart_symmetric(self):
+        np.random.seed(1)
+        curves = [get_curve(perturb=True) for _ in range(2)]
+        currents = [Current(1e4), Current(-2e4)]
+        points = 3 * (np.random.rand(31, 3) - 0.5)
+        for nfp, stellsym in [(1, False), (3, False), (2, True)]:
+            bs = BiotSavart(coils_via_symmetries(curves, currents, nfp, stellsym)).set_points(points)
+            base_coils = [Coil(c, I) for c, I in zip(curves, currents)]
+            bss = BiotSavartSymmetric(base_coils, nfp, stellsym).set_points(points)
+            assert bss.num_symmetries() == nfp * (1 + stellsym)
+            assert np.allclose(bs.B(), bss.B())
+            assert np.allclose(bs.dB_by_dX(), bss.dB_by_dX())
+            assert np.allclose(bs.d2B_by_dXdX(), bss.d2B_by_dXdX())
+            assert np.allclose(bs.A(), bss.A())
+            assert np.allclose(bs.dA_by_dX(), bss.dA_by_dX())
+
+            B = bs.B()
+            dJ = bs.B_vjp(B)
+            dJs = bss.B_vjp(B)
+            dB = bs.dB_by_dX()
+            dJ_grad = bs.B_and_dB_vjp(B, dB)[1]
+            dJs_grad = bss.B_and_dB_vjp(B, dB)[1]
+            for c in curves:
+                assert np.allclose(dJ(c), dJs(c))
+                assert np.allclose(dJ_grad(c), dJs_grad(c))
+
+            # the field on the symmetric images of the points follows from the
+            # field on the points
+            images = bss.symmetric_images_of_points()
+            Bimages = bss.B_on_symmetric_images()
+            dBimages = bss.dB_by_dX_on_symmetric_images()
+            bs.set_points(images)
+            assert np.allclose(bs.B(), Bimages)
+            assert np.allclose(bs.dB_by_dX(), dBimages)
+
     def test_biotsavart_exponential_convergence(self):
         BiotSavart([Coil(get_curve(), Current(1e4))])
         points = np.asarray(10 * [[-1.41513202e-03, 8.99999382e-01, -3.14473221e-04]])
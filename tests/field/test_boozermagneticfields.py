@@ -115,6 +115,223 @@ class TestingAnalytic(unittest.TestCase):
         assert (ba.K1 == 3.7)
 
 
+class TestingFourierTransforms(unittest.TestCase):
+    def test_fourier_transforms(self):
+        """
+        Compare the Boozer Fourier transforms with direct sums, on a tensor
+        product grid in both orderings, on scattered points and for
+        non-integer mode numbers, and check the batched variants.
+        """
+        import simsoptpp as sopp
+        np.random.seed(1)
+        mboz, nboz, nfp = 5, 3, 2
+        xm = [0]
+        xn = [0]
+        for m in range(mboz+1):
+            for n in range(-nboz, nboz+1):
+                if m > 0 or n > 0:
+                    xm.append(m)
+                    xn.append(n*nfp)
+        xm = np.asarray(xm, dtype=float)
+        xn = np.asarray(xn, dtype=float)
+        ntheta, nzeta = 2*(2*mboz+1), 2*(2*nboz+1)
+        theta1d = np.linspace(0, 2*np.pi, ntheta, endpoint=False)
+        zeta1d = np.linspace(0, 2*np.pi/nfp, nzeta, endpoint=False)
+        grids = [np.meshgrid(theta1d, zeta1d), np.meshgrid(theta1d, zeta1d, indexing='ij'),
+                 np.random.uniform(-3, 3, (2, 40))]
+        for xn_ in [xn, xn + 0.1]:
+            for thetas, zetas in grids:
+                thetas = thetas.flatten()
+                zetas = zetas.flatten()
+                angles = xm[:, None]*thetas[None, :] - xn_[:, None]*zetas[None, :]
+                K = np.random.standard_normal((thetas.size, 3))
+                for odd, basis in [(True, np.sin(angles)), (False, np.cos(angles))]:
+                    forward = sopp.fourier_transform_odd if odd else sopp.fourier_transform_even
+                    inverse = sopp.inverse_fourier_transform_odd if odd else sopp.inverse_fourier_transform_even
+                    first = 1 if odd else 0
+                    ref = (basis @ K)/np.sum(basis**2, axis=1)[:, None]
+                    ref[:first] = 0.
+                    np.testing.assert_allclose(forward(K, xm, xn_, thetas, zetas), ref, rtol=1e-12, atol=1e-12)
+                    np.testing.assert_allclose(forward(K[:, 1], xm, xn_, thetas, zetas), ref[:, 1], rtol=1e-12, atol=1e-12)
+
+                    kmns = np.random.standard_normal(xm.size)
+                    f = np.zeros((thetas.size, 2))
+                    inverse(f[:, 0], kmns, xm, xn_, thetas, zetas)
+                    np.testing.assert_allclose(f[:, 0], kmns[first:] @ basis[first:], rtol=1e-12, atol=1e-12)
+                    kmns_points = np.random.standard_normal((xm.size, thetas.size))
+                    inverse(f[:, 1], kmns_points, xm, xn_, thetas, zetas)
+                    np.testing.assert_allclose(f[:, 1], np.sum(kmns_points[first:]*basis[first:], axis=0), rtol=1e-12, atol=1e-12)
+                    kmns_batch = np.random.standard_normal((xm.size, 3))
+                    fb = np.zeros((thetas.size, 3))
+                    inverse(fb, kmns_batch, xm, xn_, thetas, zetas)
+                    np.testing.assert_allclose(fb, basis[first:].T @ kmns_batch[first:], rtol=1e-12, atol=1e-12)
+                    with self.assertRaises(ValueError):
+                        inverse(fb, kmns, xm, xn_, thetas, zetas)
+
+    def test_compute_kmns(self):
+        """
+        Compare compute_kmns and compute_kmnc_kmns with direct sums over the
+        points, on the grid used by BoozerRadialInterpolant and on scattered
+        points.
+        """
+        import simsoptpp as sopp
+        np.random.seed(2)
+        mboz, nboz, nfp, nsurf = 4, 3, 3, 5
+        xm = [0]
+        xn = [0]
+        for m in range(mboz+1):
+            for n in range(-nboz, nboz+1):
+                if m > 0 or n > 0:
+                    xm.append(m)
+                    xn.append(n*nfp)
+        xm = np.asarray(xm, dtype=float)
+        xn = np.asarray(xn, dtype=float)
+        ntheta, nzeta = 2*(2*mboz+1), 2*(2*nboz+1)
+        thetas, zetas = np.meshgrid(np.linspace(0, 2*np.pi, ntheta, endpoint=False),
+                                    np.linspace(0, 2*np.pi/nfp, nzeta, endpoint=False))
+        grids = [(thetas.flatten(), zetas.flatten()), np.random.uniform(-3, 3, (2, 50))]
+
+        # rmnc, drmncds, zmns, dzmnsds, numns, dnumnsds, bmnc and the non stellarator symmetric ones
+        even = [0.05*np.random.standard_normal((xm.size, nsurf)) for k in range(7)]
+        odd = [0.05*np.random.standard_normal((xm.size, nsurf)) for k in range(7)]
+        even[0][0, :] = 1.
+        even[6][0, :] = 1.
+        iota = 0.4 + 0.1*np.random.standard_normal(nsurf)
+        G = 1 + 0.1*np.random.standard_normal(nsurf)
+        I = 0.1*np.random.standard_normal(nsurf)
+
+        for thetas, zetas in grids:
+            angles = xm[:, None]*thetas[None, :] - xn[:, None]*zetas[None, :]
+            cos, sin = np.cos(angles), np.sin(angles)
+
+            def reference(stellsym):
+                rmnc, drmncds, zmns, dzmnsds, numns, dnumnsds, bmnc = even
+                rmns, drmnsds, zmnc, dzmncds, numnc, dnumncds, bmns = [0*c if stellsym else c for c in odd]
+                m, n = xm[:, None], xn[:, None]
+                B = bmnc.T @ cos + bmns.T @ sin
+                R = rmnc.T @ cos + rmns.T @ sin
+                dRdtheta = (rmns*m).T @ cos - (rmnc*m).T @ sin
+                dRdzeta = (rmnc*n).T @ sin - (rmns*n).T @ cos
+                dRds = drmncds.T @ cos + drmnsds.T @ sin
+                dZdtheta = (zmns*m).T @ cos - (zmnc*m).T @ sin
+                dZdzeta = (zmnc*n).T @ sin - (zmns*n).T @ cos
+                dZds = dzmnsds.T @ sin + dzmncds.T @ cos
+                nu = numns.T @ sin + numnc.T @ cos
+                dnuds = dnumnsds.T @ sin + dnumncds.T @ cos
+                dnudtheta = (numns*m).T @ cos - (numnc*m).T @ sin
+                dnudzeta = (numnc*n).T @ sin - (numns*n).T @ cos
+                phi = zetas[None, :] - nu
+                dXdtheta = dRdtheta*np.cos(phi) + R*np.sin(phi)*dnudtheta
+                dYdtheta = dRdtheta*np.sin(phi) - R*np.cos(phi)*dnudtheta
+                dXds = dRds*np.cos(phi) + R*np.sin(phi)*dnuds
+                dYds = dRds*np.sin(phi) - R*np.cos(phi)*dnuds
+                dXdzeta = dRdzeta*np.cos(phi) - R*np.sin(phi)*(1 - dnudzeta)
+                dYdzeta = dRdzeta*np.sin(phi) + R*np.cos(phi)*(1 - dnudzeta)
+                gstheta = dXdtheta*dXds + dYdtheta*dYds + dZdtheta*dZds
+                gszeta = dXdzeta*dXds + dYdzeta*dYds + dZdzeta*dZds
+                sqrtg = (G + iota*I)[:, None]/B**2
+                K = (gszeta + iota[:, None]*gstheta)/sqrtg
+                kmns = (sin @ K.T)/(2*np.pi**2)
+                kmns[0] = 0.
+                kmnc = (cos @ K.T)/(2*np.pi**2)
+                kmnc[0] /= 2
+                return kmnc, kmns
+
+            kmns = sopp.compute_kmns(*even, iota, G, I, xm, xn, thetas, zetas)
+            np.testing.assert_allclose(kmns, reference(True)[1], rtol=1e-12, atol=1e-12)
+            kmnc_kmns = sopp.compute_kmnc_kmns(*even, *odd, iota, G, I, xm, xn, thetas, zetas)
+            np.testing.assert_allclose(kmnc_kmns, np.asarray(reference(False)), rtol=1e-12, atol=1e-12)
+
+    def test_boozerradialinterpolant_splines(self):
+        """
+        Compare the compiled evaluation of the radial splines of
+        BoozerRadialInterpolant with direct sums over the modes of the scipy
+        splines, including derivative splines of lower degree, extrapolation
+        in s and fused quantities.
+        """
+        import simsoptpp as sopp
+        from scipy.interpolate import InterpolatedUnivariateSpline
+        np.random.seed(2)
+        xm = np.array([0, 0, 1, 1, 2, 3], dtype=float)
+        xn = np.array([0, 4, -4, 0, 8, -4], dtype=float)
+        s_half = np.linspace(0.05, 0.95, 10)
+        s_full = np.linspace(0, 1, 12)
+        order = 3
+        families = {'modB': ('bmnc', 'bmns'), 'R': ('rmnc', 'rmns'), 'Z': ('zmnc', 'zmns'),
+                    'nu': ('numnc', 'numns'), 'K': ('kmnc', 'kmns')}
+        for stellsym in [True, False]:
+            splines = {}
+            for name in ['psip', 'G', 'I', 'iota', 'dGds', 'dIds', 'diotads']:
+                splines[name] = [InterpolatedUnivariateSpline(s_full, np.random.uniform(size=s_full.size), k=order)]
+            splines['mn_factor'] = [InterpolatedUnivariateSpline(s_half, 1 + s_half**(m/2), k=order) for m in xm]
+            splines['d_mn_factor'] = [InterpolatedUnivariateSpline(s_half, (m/2)*s_half**(m/2 - 1), k=order) for m in xm]
+            for cos, sin in families.values():
+                for name in [cos, sin]:
+                    splines[name] = [InterpolatedUnivariateSpline(s_half, np.random.uniform(-1, 1, s_half.size), k=order) for m in xm]
+                    if name[0] != 'k':
+                        d = 'd' + name + 'ds'
+                        splines[d] = [spline.derivative() for spline in splines[name]]
+                        splines[d][0] = InterpolatedUnivariateSpline(s_full, np.random.uniform(size=s_full.size), k=order)
+
+            field = sopp.BoozerRadialInterpolant(1.3, xm, xn, stellsym, False)
+            for name, spl in splines.items():
+                field.set_splines(name, [spline.get_knots() for spline in spl], [spline.get_coeffs() for spline in spl])
+            field.set_fused(['modB', 'K'])
+            self.assertEqual(field.get_fused(), ['modB', 'K'])
+            with self.assertRaises(ValueError):
+                field.set_fused(['B'])
+
+            points = np.random.uniform(size=(20, 3))*[1.2, 2*np.pi, 2*np.pi]
+            points[:, 0] -= 0.1
+            s, thetas, zetas = points.T
+            angles = xm[:, None]*thetas[None, :] - xn[:, None]*zetas[None, :]
+
+            def evaluate(name, derivative=False):
+                mn_factor = np.array([spline(s) for spline in splines['mn_factor']])
+                values = np.array([spline(s) for spline in splines[name]])/mn_factor
+                if not derivative:
+                    return values
+                d_mn_factor = np.array([spline(s) for spline in splines['d_mn_factor']])
+                dvalues = np.array([spline(s) for spline in splines['d' + name + 'ds']])/mn_factor
+                return dvalues - values*d_mn_factor/mn_factor
+
+            field.set_points(points)
+            for family, (cos, sin) in families.items():
+                A, B = evaluate(cos), evaluate(sin)
+                if family == 'K':
+                    dA, dB = 0*A, 0*B
+                else:
+                    dA, dB = evaluate(cos, True), evaluate(sin, True)
+                if stellsym and family in ['modB', 'R']:
+                    B[:] = dB[:] = 0.
+                elif stellsym:
+                    A[:] = dA[:] = 0.
+                dangle = B*np.cos(angles) - A*np.sin(angles)
+                derivs = [np.sum(dA*np.cos(angles) + dB*np.sin(angles), axis=0),
+                          np.sum(xm[:, None]*dangle, axis=0), np.sum(-xn[:, None]*dangle, axis=0)]
+                if family == 'K':
+                    derivs = derivs[1:]
+                value = np.sum(A*np.cos(angles) + B*np.sin(angles), axis=0)
+                np.testing.assert_allclose(getattr(field, family)()[:, 0], value, rtol=1e-12, atol=1e-12)
+                np.testing.assert_allclose(getattr(field, family + '_derivs')(), np.array(derivs).T, rtol=1e-12, atol=1e-12)
+            for name in ['psip', 'G', 'I', 'iota', 'dGds', 'dIds', 'diotads']:
+                np.testing.assert_allclose(getattr(field, name)()[:, 0], splines[name][0](s), rtol=1e-12, atol=1e-12)
+
+            # modB fills the caches of its derivatives and of the fused K
+            modB_derivs = field.modB_derivs()
+            K = field.K()
+            field.set_points(points)
+            field.modB()
+            np.testing.assert_allclose(field.dmodBds()[:, 0], modB_derivs[:, 0], rtol=1e-14, atol=0)
+            np.testing.assert_allclose(field.dKdzeta()[:, 0], field.K_derivs()[:, 1], rtol=1e-14, atol=0)
+            np.testing.assert_allclose(field.K(), K, rtol=1e-14, atol=0)
+
+            with self.assertRaises(ValueError):
+                field.set_splines('bmnc', [], [])
+            with self.assertRaises(ValueError):
+                field.set_splines('B', [], [])
+
+
 @unittest.skipIf(vmec is None, "vmec python package is not found")
 class TestingVmec(unittest.TestCase):
     def test_boozerradialinterpolant_finite_beta(self):
@@ -594,6 +811,44 @@ class TestingVmec(unittest.TestCase):
         assert np.allclose(bsh.modB_derivs()[:, 1], bsh.dmodBdtheta()[:, 0])
         assert np.allclose(bsh.modB_derivs()[:, 2], bsh.dmodBdzeta()[:, 0])
 
+    def test_interpolatedboozerfield_fused(self):
+        """
+        Check that interpolating several quantities in one fused interpolant
+        gives the same values as interpolating each of them separately,
+        including the stellarator symmetry and the flux functions.
+        """
+        vmec = Vmec(filename_mhd_lowres)
+        bri = BoozerRadialInterpolant(vmec, 3, mpol=5, ntor=5, rescale=True)
+        nfp = vmec.wout.nfp
+        n = 6
+        ranges = ([0.4, 0.6, n], [0, np.pi, n], [0, 2*np.pi/nfp, 2*n])
+        names = ['modB', 'modB_derivs', 'G', 'iota', 'K', 'K_derivs', 'nu', 'R_derivs', 'Z', 'dIds']
+        bsh = InterpolatedBoozerField(bri, 3, *ranges, True, stellsym=True, nfp=nfp)
+        bsh_fused = InterpolatedBoozerField(bri, 3, *ranges, True, stellsym=True, nfp=nfp, fused=names)
+        assert bsh_fused.get_fused() == names
+
+        np.random.seed(2)
+        points = np.random.uniform(size=(20, 3))
+        points[:, 0] = 0.4 + 0.2*points[:, 0]
+        points[:, 1] = -np.pi + 3*np.pi*points[:, 1]
+        points[:, 2] = (-2*np.pi + 6*np.pi*points[:, 2])/nfp
+        bsh.set_points(points)
+        bsh_fused.set_points(points)
+        for name in names[::-1] + ['diotads']:
+            expected = getattr(bsh, name)()
+            assert np.allclose(getattr(bsh_fused, name)(), expected, rtol=1e-12, atol=1e-12*np.max(np.abs(expected)))
+
+        flux = InterpolatedBoozerField(bri, 3, *ranges, True, stellsym=True, nfp=nfp, fused=['G', 'I'])
+        flux.set_points(points)
+        bsh.set_points(points)
+        assert np.allclose(flux.I(), bsh.I(), rtol=1e-13)
+        assert np.allclose(flux.G(), bsh.G(), rtol=1e-13)
+
+        with self.assertRaises(ValueError):
+            bsh.set_fused(['modB', 'B'])
+        with self.assertRaises(ValueError):
+            bsh.set_fused(['modB', 'iota', 'modB'])
+
     def test_interpolatedboozerfield_no_sym(self):
         """
         Here we perform 3D interpolation on a random set of points. Compare
@@ -2,7 +2,8 @@ import unittest
 import logging
 import numpy as np
 
-from simsopt.field.magneticfieldclasses import ToroidalField, PoloidalField, InterpolatedField, UniformInterpolationRule
+from simsopt.field.magneticfieldclasses import ToroidalField, PoloidalField, InterpolatedField, UniformInterpolationRule, \
+    Dommaschk, Reiman
 from simsopt.field.tracing import compute_fieldlines, particles_to_vtk, plot_poincare_data, \
     MinRStoppingCriterion, MinZStoppingCriterion, MaxRStoppingCriterion, MaxZStoppingCriterion
 from simsopt.field.biotsavart import BiotSavart
@@ -55,6 +56,26 @@ class FieldlineTesting(unittest.TestCase):
         if pyevtk is not None:
             particles_to_vtk(res_tys, '/tmp/fieldlines')
 
+    def test_poincare_many_planes(self):
+        # the planes are sorted internally, so pass many of them in a random
+        # order and partly outside of [0, 2pi)
+        R0test = 1.3
+        B0test = 0.8
+        Bfield = ToroidalField(R0test, B0test)
+        nphis = 150
+        phis_sorted = np.linspace(0, 2*np.pi, nphis, endpoint=False)
+        perm = np.random.default_rng(1).permutation(nphis)
+        phis = phis_sorted[perm] + 2*np.pi*(perm % 3 - 1)
+        res_tys, res_phi_hits = compute_fieldlines(
+            Bfield, [1.2], [0.], tmax=20, phis=phis, stopping_criteria=[])
+        hits = res_phi_hits[0]
+        assert len(hits) > 2*nphis
+        assert np.all(np.diff(hits[:, 0]) > 0)
+        idxs = hits[:, 1].astype(int)
+        phi_hits = np.arctan2(hits[:, 3], hits[:, 2])
+        assert np.allclose(np.mod(phi_hits - phis[idxs] + np.pi, 2*np.pi), np.pi, atol=1e-8)
+        assert validate_phi_hits(np.stack([hits[:, 0], perm[idxs]], axis=1), nphis)
+
     def test_poincare_tokamak(self):
         # Test a simple circular tokamak geometry that
         # consists of a superposition of a purely toroidal
@@ -102,6 +123,87 @@ class FieldlineTesting(unittest.TestCase):
         except ImportError:
             pass
 
+    def test_fieldlines_multithreaded(self):
+        curves, currents, ma = get_ncsx_data()
+        nfp = 3
+        coils = coils_via_symmetries(curves, currents, nfp, True)
+        bs = BiotSavart(coils)
+        n = 10
+        rrange = (1.0, 1.9, n)
+        phirange = (0, 2*np.pi/nfp, n*2)
+        zrange = (0, 0.4, n)
+        bsh = InterpolatedField(
+            bs, UniformInterpolationRule(2),
+            rrange, phirange, zrange, True, nfp=3, stellsym=True
+        )
+        nlines = 6
+        r0 = np.linalg.norm(ma.gamma()[0, :2])
+        z0 = ma.gamma()[0, 2]
+        R0 = [r0 + i*0.01 for i in range(nlines)]
+        Z0 = [z0 for i in range(nlines)]
+        phis = np.linspace(0, 2*np.pi/nfp, 4, endpoint=False)
+        stopping_criteria = [MaxRStoppingCriterion(r0 + 0.04)]
+        res_tys, res_phi_hits = compute_fieldlines(
+            bsh, R0, Z0, tmax=100, phis=phis, stopping_criteria=stopping_criteria)
+        for nthreads in [0, 1, 3]:
+            res_tys_mt, res_phi_hits_mt = compute_fieldlines(
+                bsh, R0, Z0, tmax=100, phis=phis, stopping_criteria=stopping_criteria, nthreads=nthreads)
+            for i in range(nlines):
+                np.testing.assert_allclose(res_tys_mt[i], res_tys[i], rtol=1e-13, atol=1e-13)
+                np.testing.assert_allclose(res_phi_hits_mt[i], res_phi_hits[i], rtol=1e-13, atol=1e-13)
+        # fields that cannot be copied for other threads are traced on one thread
+        res_tys, _ = compute_fieldlines(bs, R0[:2], Z0[:2], tmax=1, stopping_criteria=[])
+        res_tys_mt, _ = compute_fieldlines(bs, R0[:2], Z0[:2], tmax=1, stopping_criteria=[], nthreads=2)
+        for i in range(2):
+            np.testing.assert_allclose(res_tys_mt[i], res_tys[i], rtol=1e-13, atol=1e-13)
+
+    def test_fieldlines_native_fields(self):
+        # sums and multiples of fields implemented in C++ are traced without
+        # python and can be copied for multithreaded tracing
+        dommaschk = Dommaschk(mn=[[10, 2], [15, 3]], coeffs=[[-2.18, -2.18], [25.8, -25.8]])
+        reiman = Reiman()
+        field = dommaschk + 1e-3 * reiman
+        points = np.asarray([[0.9231, 0.8423, -0.1123], [1.05, 0.1, 0.02]])
+        field.set_points(points)
+        dommaschk.set_points(points)
+        reiman.set_points(points)
+        np.testing.assert_allclose(field.B(), dommaschk.B() + 1e-3 * reiman.B(), rtol=1e-14, atol=1e-14)
+        np.testing.assert_allclose(field.dB_by_dX(), dommaschk.dB_by_dX() + 1e-3 * reiman.dB_by_dX(), rtol=1e-14, atol=1e-14)
+        R0 = [1.0 + 0.01 * i for i in range(4)]
+        Z0 = [0. for _ in R0]
+        phis = np.linspace(0, 2*np.pi, 4, endpoint=False)
+        stopping_criteria = [MaxRStoppingCriterion(1.2)]
+        res_tys, res_phi_hits = compute_fieldlines(
+            field, R0, Z0, tmax=20, phis=phis, stopping_criteria=stopping_criteria)
+        res_tys_mt, res_phi_hits_mt = compute_fieldlines(
+            field, R0, Z0, tmax=20, phis=phis, stopping_criteria=stopping_criteria, nthreads=2)
+        for i in range(len(R0)):
+            np.testing.assert_allclose(res_tys_mt[i], res_tys[i], rtol=1e-13, atol=1e-13)
+            np.testing.assert_allclose(res_phi_hits_mt[i], res_phi_hits[i], rtol=1e-13, atol=1e-13)
+
+    def test_fieldlines_interpolated_symmetries(self):
+        # the interpolated field evaluates single points without the cache;
+        # start below the midplane so that the stellarator symmetry is used
+        curves, currents, ma = get_ncsx_data()
+        nfp = 3
+        coils = coils_via_symmetries(curves, currents, nfp, True)
+        bs = BiotSavart(coils)
+        bsh = InterpolatedField(
+            bs, UniformInterpolationRule(4),
+            (1.2, 1.8, 20), (0, 2*np.pi/nfp, 40), (0, 0.3, 20), True, nfp=nfp, stellsym=True
+        )
+        r0 = np.linalg.norm(ma.gamma()[0, :2])
+        R0 = [r0, r0 + 0.05]
+        Z0 = [-0.03, -0.03]
+        phis = np.linspace(0, 2*np.pi/nfp, 4, endpoint=False)
+        res_tys, res_phi_hits = compute_fieldlines(bs, R0, Z0, tmax=10, phis=phis, stopping_criteria=[])
+        res_tys_h, res_phi_hits_h = compute_fieldlines(bsh, R0, Z0, tmax=10, phis=phis, stopping_criteria=[])
+        for i in range(len(R0)):
+            assert np.max(np.abs(res_tys[i][:, 3])) > 0.03
+            assert np.linalg.norm(res_tys_h[i][-1, 1:] - res_tys[i][-1, 1:]) < 1e-3
+            assert len(res_phi_hits_h[i]) == len(res_phi_hits[i])
+            np.testing.assert_allclose(res_phi_hits_h[i][:, 2:], res_phi_hits[i][:, 2:], atol=1e-3)
+
     def test_poincare_ncsx_known(self):
         curves, currents, ma = get_ncsx_data()
         nfp = 3
@@ -1,3 +1,5 @@
+import os
+import tempfile
 import numpy as np
 import unittest
 import simsoptpp as sopp
@@ -147,6 +149,343 @@ class Testing(unittest.TestCase):
         assert np.allclose(fhxyz[:3, :], fxyz[:3, :], atol=1e-12, rtol=1e-12)
         assert np.allclose(fhxyz[3:, :], 100, atol=1e-12, rtol=1e-12)
 
+    def test_batch_matches_pointwise(self):
+        """
+        Check that the batch evaluation, which sorts the points by cell, agrees
+        with the evaluation at single points, also for skipped cells and for
+        points out of bounds.
+        """
+        np.random.seed(0)
+        xran = (1.0, 4.0, 20)
+        yran = (1.1, 3.9, 10)
+        zran = (1.2, 3.8, 15)
+
+        def skip(xs, ys, zs):
+            return np.asarray(xs) > 3.5
+
+        nsamples = 1000
+        xyz = np.random.uniform(low=[1.0, 1.1, 1.2], high=[4.0, 3.9, 3.8], size=(nsamples, 3))
+        xyz[-100:, 0] += 0.5
+        # many points in a few cells, so that the vectorized path is used
+        xyz[:200, :] = np.random.uniform(low=[2.0, 2.0, 2.0], high=[2.1, 2.1, 2.1], size=(200, 3))
+        for dim in [1, 3, 7]:
+            for degree in [1, 3]:
+                with self.subTest(dim=dim, degree=degree):
+                    fun = get_random_polynomial(dim, degree)
+                    rule = sopp.UniformInterpolationRule(degree)
+                    interpolant = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True, skip)
+                    interpolant.interpolate_batch(fun)
+                    fhxyz = 100*np.ones((nsamples, dim))
+                    interpolant.evaluate_batch(xyz, fhxyz)
+                    fhxyz_pointwise = 100*np.ones((nsamples, dim))
+                    for i in range(nsamples):
+                        fhxyz_pointwise[i, :] = interpolant.evaluate(*xyz[i, :])
+                    # the cells with x >= 3.55 are skipped
+                    inside = xyz[:, 0] < 3.55
+                    assert np.all(fhxyz[~inside, :] == 100.)
+                    assert np.allclose(fhxyz[inside], fhxyz_pointwise[inside], atol=1e-13, rtol=1e-13)
+                    fxyz = fun(xyz[:, 0], xyz[:, 1], xyz[:, 2], flatten=False)
+                    assert np.allclose(fhxyz[inside], fxyz[inside], atol=1e-11, rtol=1e-11)
+
+    def test_save_load(self):
+        """
+        Check that an interpolant written to a file and mapped into memory
+        again agrees with the original one, and that the cache file is
+        used instead of evaluating the function again.
+        """
+        np.random.seed(0)
+        xran = (1.0, 4.0, 20)
+        yran = (1.1, 3.9, 10)
+        zran = (1.2, 3.8, 15)
+        dim = 3
+        degree = 2
+        fun = get_random_polynomial(dim, degree)
+        ncalls = [0]
+
+        def counting_fun(x, y, z):
+            ncalls[0] += 1
+            return fun(x, y, z)
+
+        def skip(xs, ys, zs):
+            return np.asarray(xs) > 3.5
+
+        rule = sopp.UniformInterpolationRule(degree)
+        xyz = np.random.uniform(low=[1.0, 1.1, 1.2], high=[3.5, 3.9, 3.8], size=(100, 3))
+        fhxyz = np.zeros((100, dim))
+        interpolant = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True, skip)
+        interpolant.interpolate_batch(fun)
+        interpolant.evaluate_batch(xyz, fhxyz)
+        with tempfile.TemporaryDirectory() as tmpdir:
+            filename = os.path.join(tmpdir, 'interpolant.rgi')
+            loaded = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True, skip)
+            assert not loaded.load(filename)
+            interpolant.save(filename)
+            assert loaded.load(filename)
+            fhxyz_loaded = np.zeros((100, dim))
+            loaded.evaluate_batch(xyz, fhxyz_loaded)
+            assert np.all(fhxyz == fhxyz_loaded)
+
+            # files for a different grid or set of skipped cells are rejected
+            other = sopp.RegularGridInterpolant3D(rule, xran, yran, (1.2, 3.8, 14), dim, True, skip)
+            assert not other.load(filename)
+            other = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True)
+            assert not other.load(filename)
+
+            cached = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True, skip)
+            cached.set_cache_file(filename)
+            cached.interpolate_batch(counting_fun)
+            assert ncalls[0] == 0
+            cached = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True)
+            cached.set_cache_file(os.path.join(tmpdir, 'noskip.rgi'))
+            cached.interpolate_batch(counting_fun)
+            assert ncalls[0] > 0
+            assert os.path.exists(os.path.join(tmpdir, 'noskip.rgi'))
+
+    def test_tiled_build(self):
+        """
+        Check that building the interpolant in tiles with a small memory
+        budget, on one or several threads, gives the same interpolant and
+        bounds the number of points per call.
+        """
+        np.random.seed(0)
+        xran = (1.0, 4.0, 20)
+        yran = (1.1, 3.9, 10)
+        zran = (1.2, 3.8, 15)
+        dim = 3
+        degree = 3
+        fun = get_random_polynomial(dim, degree+1)
+        rule = sopp.UniformInterpolationRule(degree)
+
+        def skip(xs, ys, zs):
+            return [x + y > 6.5 for x, y in zip(xs, ys)]
+
+        nsamples = 1000
+        xyz = np.random.uniform(low=[xran[0], yran[0], zran[0]], high=[xran[1], yran[1], zran[1]], size=(nsamples, 3))
+        reference = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True, skip)
+        reference.interpolate_batch(fun)
+        fh_reference = np.zeros((nsamples, dim))
+        reference.evaluate_batch(xyz, fh_reference)
+
+        sizes = []
+
+        def counting_fun(x, y, z):
+            sizes.append(len(x))
+            return fun(x, y, z)
+
+        for nthreads in [1, 2]:
+            with self.subTest(nthreads=nthreads):
+                sizes.clear()
+                interpolant = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True, skip)
+                interpolant.set_build_options(100000, nthreads)
+                interpolant.interpolate_batch(counting_fun)
+                assert len(sizes) > 1
+                assert max(sizes) * 8 * (3 + dim) < 100000
+                fhxyz = np.zeros((nsamples, dim))
+                interpolant.evaluate_batch(xyz, fhxyz)
+                assert np.all(fhxyz == fh_reference)
+
+    def test_value_bits(self):
+        """
+        Check that storing the values in single or 16 bit precision changes
+        the interpolant by no more than the rounding error of the storage.
+        """
+        np.random.seed(0)
+        xran = (1.0, 4.0, 10)
+        yran = (1.1, 3.9, 10)
+        zran = (1.2, 3.8, 10)
+        dim = 3
+        degree = 3
+        fun = get_random_polynomial(dim, degree)
+        rule = sopp.UniformInterpolationRule(degree)
+        nsamples = 1000
+        xyz = np.random.uniform(low=[xran[0], yran[0], zran[0]], high=[xran[1], yran[1], zran[1]], size=(nsamples, 3))
+        reference = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True)
+        reference.interpolate_batch(fun)
+        fh_reference = np.zeros((nsamples, dim))
+        reference.evaluate_batch(xyz, fh_reference)
+        fmax = np.max(np.abs(fh_reference))
+
+        for bits, rtol in [(32, 1e-6), (16, 1e-3)]:
+            with self.subTest(bits=bits):
+                interpolant = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True)
+                interpolant.set_value_bits(bits)
+                interpolant.interpolate_batch(fun)
+                fhxyz = np.zeros((nsamples, dim))
+                interpolant.evaluate_batch(xyz, fhxyz)
+                assert np.max(np.abs(fhxyz - fh_reference)) < rtol * fmax
+                assert np.max(np.abs(fhxyz - fh_reference)) > 0
+                fh = np.asarray([interpolant.evaluate(*p) for p in xyz])
+                assert np.allclose(fh, fhxyz, rtol=1e-14, atol=1e-14 * fmax)
+
+        interpolant = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True)
+        with self.assertRaises(ValueError):
+            interpolant.set_value_bits(8)
+
+    def test_gradient(self):
+        """
+        Check that the derivatives of the interpolant are exact for
+        polynomials of the degree of the interpolant, and that the values
+        agree with evaluate_batch.
+        """
+        np.random.seed(0)
+        xran = (1.0, 4.0, 7)
+        yran = (1.1, 3.9, 5)
+        zran = (1.2, 3.8, 6)
+        degree = 4
+
+        def fun(x, y, z):
+            x, y, z = np.asarray(x), np.asarray(y), np.asarray(z)
+            return np.stack([x**degree * y, z**2 * y, x + y*z], axis=1).flatten()
+
+        def dfun(x, y, z):
+            zero = np.zeros_like(x)
+            return np.stack([degree * x**(degree-1) * y, x**degree, zero,
+                             zero, z**2, 2*z*y,
+                             np.ones_like(x), z, y], axis=1)
+
+        for rule in [sopp.UniformInterpolationRule(degree), sopp.ChebyshevInterpolationRule(degree)]:
+            interpolant = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, 3, False)
+            interpolant.interpolate_batch(fun)
+            xyz = np.random.uniform(low=[xran[0], yran[0], zran[0]], high=[xran[1], yran[1], zran[1]], size=(200, 3))
+            fhxyz = np.zeros((len(xyz), 3))
+            dfhxyz = np.zeros((len(xyz), 9))
+            interpolant.evaluate_batch_with_gradient(xyz, fhxyz, dfhxyz)
+            fh = np.zeros((len(xyz), 3))
+            interpolant.evaluate_batch(xyz, fh)
+            assert np.allclose(fhxyz, fh, rtol=1e-14, atol=1e-14)
+            assert np.allclose(dfhxyz, dfun(xyz[:, 0], xyz[:, 1], xyz[:, 2]), rtol=1e-10, atol=1e-10)
+
+    def test_lazy(self):
+        """
+        Check that a lazy interpolant only evaluates the function on the cells
+        that are visited, agrees with the interpolant that is built up front,
+        and can be saved and resumed while partially filled.
+        """
+        np.random.seed(0)
+        xran = (1.0, 4.0, 20)
+        yran = (1.1, 3.9, 10)
+        zran = (1.2, 3.8, 15)
+        dim = 3
+        degree = 3
+        fun = get_random_polynomial(dim, degree)
+        rule = sopp.UniformInterpolationRule(degree)
+        evaluated = []
+
+        def counting_fun(x, y, z):
+            evaluated.append(len(x))
+            return fun(x, y, z)
+
+        # the points only visit a corner of the domain
+        xyz = np.random.uniform(low=[1.0, 1.1, 1.2], high=[1.5, 1.5, 1.5], size=(500, 3))
+        reference = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True)
+        reference.interpolate_batch(fun)
+        fh_reference = np.zeros((len(xyz), dim))
+        reference.evaluate_batch(xyz, fh_reference)
+
+        interpolant = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True)
+        interpolant.set_lazy(True)
+        interpolant.interpolate_batch(counting_fun)
+        assert len(evaluated) == 0
+        fhxyz = np.zeros((len(xyz), dim))
+        interpolant.evaluate_batch(xyz[:250], fhxyz[:250])
+        assert len(evaluated) == 1
+        for i in range(250, len(xyz)):
+            fhxyz[i, :] = interpolant.evaluate(*xyz[i, :])
+        assert np.all(fhxyz == fh_reference)
+        assert 0 < interpolant.num_filled() < 20*10*15 // 10
+        assert sum(evaluated) < (20*3+1)*(10*3+1)*(15*3+1) // 10
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            filename = os.path.join(tmpdir, "lazy.rgi")
+            interpolant.save(filename)
+            eager = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True)
+            assert not eager.load(filename)
+            resumed = sopp.RegularGridInterpolant3D(rule, xran, yran, zran, dim, True)
+            resumed.set_lazy(True)
+            resumed.set_cache_file(filename)
+            evaluated.clear()
+            resumed.interpolate_batch(counting_fun)
+            assert resumed.num_filled() == interpolant.num_filled()
+            fhxyz = np.zeros((len(xyz), dim))
+            resumed.evaluate_batch(xyz, fhxyz)
+            assert len(evaluated) == 0
+            assert np.all(fhxyz == fh_reference)
+
+    def test_adaptive_refinement(self):
+        """
+        Check that the adaptive interpolant is exact for polynomials, and that
+        for a function with a sharp peak it reaches the accuracy of a finer
+        regular grid with fewer dofs.
+        """
+        np.random.seed(0)
+        degree = 3
+        rule = sopp.UniformInterpolationRule(degree)
+        xran = (1.0, 4.0, 4)
+        yran = (1.1, 3.9, 4)
+        zran = (1.2, 3.8, 4)
+        nsamples = 1000
+        xyz = np.random.uniform(low=[xran[0], yran[0], zran[0]], high=[xran[1], yran[1], zran[1]], size=(nsamples, 3))
+
+        fun = get_random_polynomial(2, degree)
+        interpolant = sopp.AdaptiveInterpolant3D(rule, xran, yran, zran, 2, True, 1e-8, 3)
+        interpolant.interpolate_batch(fun)
+        # polynomials are interpolated exactly, so no cell is refined
+        assert interpolant.num_cells() == 4**3
+        fhxyz = np.zeros((nsamples, 2))
+        interpolant.evaluate_batch(xyz, fhxyz)
+        assert np.allclose(fun(xyz[:, 0], xyz[:, 1], xyz[:, 2], flatten=False), fhxyz, atol=1e-12, rtol=1e-12)
+
+        def peak(x, y, z):
+            x = np.asarray(x)
+            y = np.asarray(y)
+            z = np.asarray(z)
+            d = (x-1.3)**2 + (y-1.5)**2 + (z-1.5)**2
+            return np.ascontiguousarray(np.stack([1/(d+0.01), x*y], axis=1)).flatten()
+
+        interpolant = sopp.AdaptiveInterpolant3D(rule, xran, yran, zran, 2, True, 1e-3, 6)
+        interpolant.interpolate_batch(peak)
+        assert interpolant.depth() > 1
+        assert interpolant.num_dofs() == interpolant.num_cells() * (degree+1)**3
+
+        regular = sopp.RegularGridInterpolant3D(rule, (1.0, 4.0, 16), (1.1, 3.9, 16), (1.2, 3.8, 16), 2, True)
+        regular.interpolate_batch(peak)
+        fhxyz = np.zeros((nsamples, 2))
+        regular.evaluate_batch(xyz, fhxyz)
+        fhxyz_adaptive = np.zeros((nsamples, 2))
+        interpolant.evaluate_batch(xyz, fhxyz_adaptive)
+        fxyz = peak(xyz[:, 0], xyz[:, 1], xyz[:, 2]).reshape((nsamples, 2))
+        err_regular = np.mean(np.linalg.norm(fxyz-fhxyz, axis=1))
+        assert np.mean(np.linalg.norm(fxyz-fhxyz_adaptive, axis=1)) < err_regular
+        assert interpolant.num_cells() < 16**3 / 4
+
+    def test_adaptive_skip(self):
+        """
+        Check that the adaptive interpolant skips cells like the regular one,
+        and raises for points in skipped cells unless out_of_bounds_ok.
+        """
+        rule = sopp.UniformInterpolationRule(2)
+        xran = (1.0, 4.0, 6)
+        yran = (1.1, 3.9, 4)
+        zran = (1.2, 3.8, 4)
+        fun = get_random_polynomial(3, 2)
+
+        def skip(xs, ys, zs):
+            return [x > 3. for x in xs]
+
+        interpolant = sopp.AdaptiveInterpolant3D(rule, xran, yran, zran, 3, True, 1e-6, 2, skip)
+        interpolant.interpolate_batch(fun)
+        # the cells with x in [3.5, 4.0] have all corners in the skipped region
+        assert interpolant.num_cells() == 5*4*4
+        assert np.all(np.asarray(interpolant.evaluate(3.8, 2., 2.)) == 0.)
+        assert np.allclose(interpolant.evaluate(2., 2., 2.), fun([2.], [2.], [2.]))
+
+        interpolant = sopp.AdaptiveInterpolant3D(rule, xran, yran, zran, 3, False, 1e-6, 2, skip)
+        interpolant.interpolate_batch(fun)
+        with assert_raises(RuntimeError):
+            interpolant.evaluate(3.8, 2., 2.)
+        with assert_raises(RuntimeError):
+            interpolant.evaluate(4.5, 2., 2.)
+
     def test_convergence_order(self):
         for dim in [1, 4, 6]:
             for degree in [1, 3]:
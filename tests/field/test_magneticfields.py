@@ -27,7 +27,7 @@ from simsopt.objectives import SquaredFlux
 from simsopt.geo import (CurveHelical, CurveRZFourier, CurveXYZFourier,
                          PermanentMagnetGrid, SurfaceRZFourier,
                          create_equally_spaced_curves)
-from simsoptpp import dipole_field_Bn
+from simsoptpp import dipole_field_Bn, DipoleFieldTreecode
 
 TEST_DIR = (Path(__file__).parent / ".." / "test_files").resolve()
 
@@ -627,6 +627,34 @@ class Testing(unittest.TestCase):
         with ScratchDir("."):
             Bfield._toVTK('test')
 
+    def test_DipoleField_treecode(self):
+        np.random.seed(1)
+        Ndipoles = 2000
+        m_loc = np.random.rand(Ndipoles, 3) - 0.5
+        m = np.random.rand(Ndipoles, 3) - 0.5
+        points = 2 * (np.random.rand(50, 3) - 0.5) + np.array([2., 0., 0.])
+        Bfield = DipoleField(m_loc, m, stellsym=False, coordinate_flag='cartesian')
+        Bfield.set_points(points)
+        B, dB, A, dA = Bfield.B(), Bfield.dB_by_dX(), Bfield.A(), Bfield.dA_by_dX()
+        errs_old = None
+        for theta in [0.4, 0.2, 0.1]:
+            Bfield.set_treecode(theta)
+            assert Bfield.treecode_theta == theta
+            errs = [np.linalg.norm(Bfield.B()-B)/np.linalg.norm(B),
+                    np.linalg.norm(Bfield.dB_by_dX()-dB)/np.linalg.norm(dB),
+                    np.linalg.norm(Bfield.A()-A)/np.linalg.norm(A),
+                    np.linalg.norm(Bfield.dA_by_dX()-dA)/np.linalg.norm(dA)]
+            assert max(errs) < 0.1
+            if errs_old is not None:
+                assert all(e < errs_old_e for e, errs_old_e in zip(errs, errs_old))
+            errs_old = errs
+        # a tree that is always opened gives the direct sum
+        tree = DipoleFieldTreecode(Bfield.dipole_grid, Bfield.m_vec, 0.)
+        assert np.allclose(tree.B(points), B)
+        assert np.allclose(tree.dB(points), dB)
+        Bfield.set_treecode(0.)
+        assert np.allclose(Bfield.B(), B)
+
     def test_DipoleField_multiple_points_multiple_dipoles(self):
         Ndipoles = 101
         m = np.ravel(np.outer(np.ones(Ndipoles), np.array([0.5, 0.5, 0.5])))
@@ -772,6 +800,18 @@ class Testing(unittest.TestCase):
             f_B_Am = 0.5 * np.linalg.norm(pm_opt.A_obj.dot(dipoles) - pm_opt.b_obj, ord=2) ** 2
             f_B = SquaredFlux(s, b_dipole, -Bn).J()
             assert np.isclose(f_B, f_B_Am)
+            # the matrix-free operator applies the same matrix
+            with ScratchDir("."):
+                pm_mf = PermanentMagnetGrid.geo_setup_between_toroidal_surfaces(
+                    s, Bn, s_inner, s_outer, matrix_free=True)
+            assert pm_mf.A_obj.shape == pm_opt.A_obj.shape
+            assert np.allclose(pm_mf.A_obj.todense(), pm_opt.A_obj)
+            assert np.allclose(pm_mf.A_obj.matvec(dipoles), pm_opt.A_obj.dot(dipoles))
+            assert np.allclose(pm_mf.A_obj.rmatvec(pm_opt.b_obj), pm_opt.ATb)
+            assert np.allclose(pm_mf.ATb, pm_opt.ATb)
+            assert 0.99 * pm_opt.ATA_scale <= pm_mf.ATA_scale <= 1.02 * pm_opt.ATA_scale
+            w = np.random.rand(pm_opt.ndipoles * 3)
+            assert np.allclose(pm_mf.A_obj.scale_columns(w).todense(), pm_opt.A_obj * w)
 
     def test_BifieldMultiply(self):
         scalar = 1.2345
@@ -1008,6 +1048,93 @@ class Testing(unittest.TestCase):
         assert np.allclose(Bc, Bhc, rtol=1e-2)
         assert np.allclose(dBc, dBhc, rtol=1e-2, atol=1e-5)
 
+    def test_interpolated_field_cache(self):
+        rrange = [1.0, 2.0, 8]
+        phirange = [0, 2*np.pi/3, 8]
+        zrange = [0, 0.5, 8]
+        points = np.random.uniform(size=(50, 3))
+        points[:, 0] = 1 + points[:, 0]
+        points[:, 1] *= 2*np.pi
+        points[:, 2] = 0.5*points[:, 2] - 0.25
+        with tempfile.TemporaryDirectory() as cache_dir:
+            def evaluate(B0):
+                bsh = InterpolatedField(ToroidalField(1.5, B0), 3, rrange, phirange, zrange, True, nfp=3,
+                                        stellsym=True, cache_dir=cache_dir)
+                bsh.set_points_cyl(points)
+                return bsh.B().copy(), bsh.GradAbsB().copy()
+
+            B, dB = evaluate(0.8)
+            files = sorted(Path(cache_dir).iterdir())
+            assert len(files) == 2
+            mtimes = [f.stat().st_mtime_ns for f in files]
+            # the second field loads the interpolants without rebuilding them
+            B_cached, dB_cached = evaluate(0.8)
+            assert np.all(B_cached == B) and np.all(dB_cached == dB)
+            assert sorted(Path(cache_dir).iterdir()) == files
+            assert [f.stat().st_mtime_ns for f in files] == mtimes
+            # a different underlying field gets its own files
+            B_other, _ = evaluate(0.9)
+            assert np.allclose(B_other, B*0.9/0.8)
+            assert len(list(Path(cache_dir).iterdir())) == 4
+
+    def test_interpolated_field_adaptive(self):
+        R0test = 1.5
+        B0test = 0.8
+        B0 = ToroidalField(R0test, B0test)
+        curves, currents, ma = get_ncsx_data()
+        coils = coils_via_symmetries(curves, currents, 3, True)
+        btotal = BiotSavart(coils) + B0
+        rrange = (1.2, 1.8, 4)
+        phirange = (0, 2*np.pi/3, 8)
+        zrange = (0, 0.3, 4)
+        np.random.seed(1)
+        points = np.random.uniform(size=(100, 3))
+        points[:, 0] = 1.25 + 0.5*points[:, 0]
+        points[:, 1] *= 2*np.pi
+        points[:, 2] = 0.5*points[:, 2] - 0.25
+        btotal.set_points_cyl(points)
+        B = btotal.B().copy()
+        bsh = InterpolatedField(btotal, 3, rrange, phirange, zrange, True, nfp=3, stellsym=True,
+                                adaptive_tol=1e-4, max_refinement=3)
+        bsh.set_points_cyl(points)
+        err = np.max(np.linalg.norm(bsh.B() - B, axis=1))/np.max(np.linalg.norm(B, axis=1))
+        assert err < 5e-3
+        # the same initial grid without refinement is less accurate
+        err_adaptive = bsh.estimate_error_B(1000)[1]
+        coarse = InterpolatedField(btotal, 3, rrange, phirange, zrange, True, nfp=3, stellsym=True)
+        assert err_adaptive < coarse.estimate_error_B(1000)[1]
+
+    def test_interpolated_field_analytic_gradient(self):
+        R0test = 1.5
+        B0test = 0.8
+        B0 = ToroidalField(R0test, B0test)
+        curves, currents, ma = get_ncsx_data()
+        coils = coils_via_symmetries(curves, currents, 3, True)
+        btotal = BiotSavart(coils) + B0
+        rrange = (1.2, 1.8, 10)
+        phirange = (0, 2*np.pi/3, 20)
+        zrange = (0, 0.3, 10)
+        np.random.seed(1)
+        points = np.random.uniform(size=(100, 3))
+        points[:, 0] = 1.25 + 0.5*points[:, 0]
+        points[:, 1] *= 2*np.pi
+        points[:, 2] = 0.5*points[:, 2] - 0.25
+        btotal.set_points_cyl(points)
+        GradAbsB = btotal.GradAbsB().copy()
+        bsh = InterpolatedField(btotal, 4, rrange, phirange, zrange, True, nfp=3, stellsym=True)
+        bsh_analytic = InterpolatedField(btotal, 4, rrange, phirange, zrange, True, nfp=3, stellsym=True,
+                                         analytic_gradient=True)
+        bsh.set_points_cyl(points)
+        bsh_analytic.set_points_cyl(points)
+        # GradAbsB first, so that it fills the cache of B from the same lookup
+        GradAbsBh = bsh_analytic.GradAbsB()
+        assert np.allclose(bsh_analytic.B(), bsh.B(), rtol=1e-14, atol=1e-14)
+        scale = np.max(np.linalg.norm(GradAbsB, axis=1))
+        err = np.max(np.linalg.norm(GradAbsBh - GradAbsB, axis=1))/scale
+        assert err < 2e-2
+        # the separately interpolated gradient is more accurate
+        assert np.max(np.linalg.norm(bsh.GradAbsB() - GradAbsB, axis=1))/scale < err
+
     def test_interpolated_field_convergence_rate(self):
         R0test = 1.5
         B0test = 0.8
@@ -11,7 +11,7 @@ try:
 except ImportError:
     vmec = None
 
-from simsopt.configs import get_w7x_data
+from simsopt.configs import get_w7x_data, get_ncsx_data
 from simsopt.field import BiotSavart, coils_via_symmetries, MGrid
 from simsopt.mhd import Vmec
 
@@ -75,6 +75,32 @@ class Testing(unittest.TestCase):
         mgrid = MGrid.from_file(test_file)
         mgrid.plot(show=False)
 
+    def test_to_mgrid_groups(self):
+        """
+        Write the field of several coil groups in slabs and using stellarator
+        symmetry, and compare with the fields of the groups written one by one.
+        """
+        curves, currents, ma = get_ncsx_data()
+        nfp = 3
+        coils = coils_via_symmetries(curves, currents, nfp, True)
+        # all copies of the first base coil, and all copies of the others
+        groups = [coils[0::3], [c for j, c in enumerate(coils) if j % 3 != 0]]
+        bs = BiotSavart(coils)
+        kwargs = dict(nr=5, nz=6, rmin=1.0, rmax=2.0, zmin=-0.6, zmax=0.6, nfp=nfp)
+        with ScratchDir("."):
+            for nphi in [6, 7]:
+                bs.to_mgrid('mgrid.groups.nc', nphi=nphi, groups=groups, group_names=['a', 'b'],
+                            stellsym=True, max_points=40, **kwargs)
+                mgrid = MGrid.from_file('mgrid.groups.nc')
+                assert mgrid.n_ext_cur == 2
+                assert [name.strip('_') for name in mgrid.coil_names] == ['a', 'b']
+                for j, group in enumerate(groups):
+                    BiotSavart(group).to_mgrid('mgrid.group.nc', nphi=nphi, **kwargs)
+                    reference = MGrid.from_file('mgrid.group.nc')
+                    np.testing.assert_allclose(mgrid.br_arr[j], reference.br_arr[0], atol=1e-12)
+                    np.testing.assert_allclose(mgrid.bp_arr[j], reference.bp_arr[0], atol=1e-12)
+                    np.testing.assert_allclose(mgrid.bz_arr[j], reference.bz_arr[0], atol=1e-12)
+
 
 @unittest.skipIf(vmec is None, "Interface to VMEC not found")
 class VmecTests(unittest.TestCase):
@@ -12,8 +12,9 @@ except ImportError:
 from simsopt.field.coil import coils_via_symmetries
 from simsopt.field.biotsavart import BiotSavart
 from simsopt.configs.zoo import get_ncsx_data
-from simsopt.field.tracing import trace_particles_starting_on_curve, compute_fieldlines
+from simsopt.field.tracing import trace_particles_starting_on_curve, compute_fieldlines, trace_particles_boozer
 from simsopt.field.magneticfieldclasses import InterpolatedField, UniformInterpolationRule
+from simsopt.field.boozermagneticfield import BoozerAnalytic, InterpolatedBoozerField
 from simsopt.util.constants import PROTON_MASS, ELEMENTARY_CHARGE, ONE_EV
 
 
@@ -84,3 +85,29 @@ class MPITracingTesting(unittest.TestCase):
             phis=[], mode='gc_vac', comm=None)
         for i in range(nparticles):
             assert np.allclose(gc_phi_hits_mpi[i], gc_phi_hits[i], atol=1e-9, rtol=1e-9)
+
+    @unittest.skipIf(not with_mpi, "mpi not found")
+    def test_parallel_boozer_dynamic(self):
+        ba = BoozerAnalytic(1.2, 1.0, 0, 1.1, 0.8, 0.4)
+        bsh = InterpolatedBoozerField(ba, 3, [0.1, 0.9, 10], [0, np.pi, 10], [0, 2*np.pi, 20], True, nfp=1, stellsym=True)
+        nparticles = 7
+        m = PROTON_MASS
+        q = ELEMENTARY_CHARGE
+        Ekin = 100.*ONE_EV
+        vpar = np.sqrt(2*Ekin/m)
+        np.random.seed(1)
+        stz_inits = np.random.uniform(size=(nparticles, 3))
+        stz_inits[:, 0] = 0.3 + 0.3*stz_inits[:, 0]
+        stz_inits[:, 1:] *= np.pi
+        vpar_inits = vpar*np.random.uniform(-1, 1, size=(nparticles, ))
+        comm = MPI.COMM_WORLD
+        res_tys_mpi, res_zeta_hits_mpi = trace_particles_boozer(
+            bsh, stz_inits, vpar_inits, tmax=1e-5, mass=m, charge=q, Ekin=Ekin,
+            zetas=[0.], mode='gc_vac', comm=comm, chunk_size=2, nthreads=2)
+        res_tys, res_zeta_hits = trace_particles_boozer(
+            bsh, stz_inits, vpar_inits, tmax=1e-5, mass=m, charge=q, Ekin=Ekin,
+            zetas=[0.], mode='gc_vac', comm=None)
+        assert len(res_tys_mpi) == nparticles
+        for i in range(nparticles):
+            assert np.allclose(res_tys_mpi[i], res_tys[i], atol=1e-9, rtol=1e-9)
+            assert np.allclose(res_zeta_hits_mpi[i], res_zeta_hits[i], atol=1e-9, rtol=1e-9)
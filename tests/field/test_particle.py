@@ -1,5 +1,8 @@
 import unittest
+from unittest import mock
 import logging
+import os
+import tempfile
 
 logging.basicConfig()
 
@@ -13,12 +16,14 @@ from simsopt.field.tracing import trace_particles_starting_on_curve, SurfaceClas
     particles_to_vtk, LevelsetStoppingCriterion, compute_gc_radius, gc_to_fullorbit_initial_guesses, \
     IterationStoppingCriterion, trace_particles_starting_on_surface, trace_particles_boozer, \
     MinToroidalFluxStoppingCriterion, MaxToroidalFluxStoppingCriterion, ToroidalTransitStoppingCriterion, \
-    compute_poloidal_transits, compute_toroidal_transits, trace_particles, compute_resonances
+    compute_poloidal_transits, compute_toroidal_transits, trace_particles, compute_resonances, \
+    TrajectoryOutput, Integrator, TracingState
 from simsopt.geo.surfacerzfourier import SurfaceRZFourier
-from simsopt.field.boozermagneticfield import BoozerAnalytic
+from simsopt.field.boozermagneticfield import BoozerAnalytic, InterpolatedBoozerField
 from simsopt.field.magneticfieldclasses import InterpolatedField, UniformInterpolationRule, ToroidalField, PoloidalField
 from simsopt.util.constants import PROTON_MASS, ELEMENTARY_CHARGE, ONE_EV
 from simsopt.geo.curverzfourier import CurveRZFourier
+import simsoptpp as sopp
 
 
 try:
@@ -379,6 +384,270 @@ class ParticleTracingTesting(unittest.TestCase):
         assert gc_phi_hits[0][-1][1] == -1
         assert np.all(sc.evaluate_xyz(gc_tys[0][:, 1:4]) > 0)
 
+    def test_batched_guidingcenter_tracing(self):
+        bsh = self.bsh
+        ma = self.ma
+        m = PROTON_MASS
+        q = ELEMENTARY_CHARGE
+        Ekin = 9000*ONE_EV
+        speed_total = np.sqrt(2*Ekin/m)
+        nphis = 4
+        phis = np.linspace(0, 2*np.pi, nphis, endpoint=False)
+        xyz_inits = ma.gamma()[::10, :][:5, :]
+        nparticles = xyz_inits.shape[0]
+        vpar_inits = speed_total * np.linspace(-0.5, 0.5, nparticles)
+        tmax = 2e-5
+        stopping_criteria = [IterationStoppingCriterion(300)]
+
+        tys, phi_hits = trace_particles(
+            bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+            tol=1e-10, phis=phis, mode='gc_vac', stopping_criteria=stopping_criteria)
+        for batch_size in [1, 3, 8]:
+            tys_batch, phi_hits_batch = trace_particles(
+                bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+                tol=1e-10, phis=phis, mode='gc_vac', stopping_criteria=stopping_criteria,
+                batch_size=batch_size)
+            for i in range(nparticles):
+                np.testing.assert_allclose(tys_batch[i][0], tys[i][0])
+                np.testing.assert_allclose(tys_batch[i][-1], tys[i][-1], rtol=1e-6)
+                self.assertEqual(len(phi_hits_batch[i]), len(phi_hits[i]))
+                if len(phi_hits[i]) > 0:
+                    np.testing.assert_allclose(phi_hits_batch[i][:, 1], phi_hits[i][:, 1])
+                    np.testing.assert_allclose(phi_hits_batch[i][:, 2:], phi_hits[i][:, 2:], rtol=1e-6, atol=1e-8)
+                assert validate_phi_hits(phi_hits_batch[i], bsh, nphis)
+
+        # the transit criterion keeps the state of a single particle
+        with self.assertRaises(ValueError):
+            trace_particles(
+                bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+                phis=phis, mode='gc_vac', stopping_criteria=[ToroidalTransitStoppingCriterion(1, False)],
+                batch_size=2)
+
+    def test_guidingcenter_tracing_varying_modB(self):
+        # every particle needs the magnetic moment for |B| at its own initial
+        # position, not at that of the first particle
+        bsh = self.bsh
+        ma = self.ma
+        m = PROTON_MASS
+        q = ELEMENTARY_CHARGE
+        Ekin = 9000*ONE_EV
+        speed_total = np.sqrt(2*Ekin/m)
+        phis = np.linspace(0, 2*np.pi, 4, endpoint=False)
+        axis = ma.gamma()[::15, :][:3, :]
+        xyz_inits = np.concatenate([axis * np.array([f, f, 1.]) for f in [0.97, 1., 1.03]])
+        nparticles = xyz_inits.shape[0]
+        modB = bsh.set_points(xyz_inits).AbsB()[:, 0]
+        assert np.ptp(modB) > 0.02 * np.mean(modB)
+        vpar_inits = 0.3 * speed_total * np.ones(nparticles)
+        tmax = 1e-5
+        stopping_criteria = [IterationStoppingCriterion(200)]
+
+        tys, phi_hits = trace_particles(
+            bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+            tol=1e-10, phis=phis, mode='gc_vac', stopping_criteria=stopping_criteria)
+        tys_batch, _ = trace_particles(
+            bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+            tol=1e-10, phis=phis, mode='gc_vac', stopping_criteria=stopping_criteria,
+            batch_size=nparticles)
+        tys_mt, _ = trace_particles(
+            bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+            tol=1e-10, phis=phis, mode='gc_vac', stopping_criteria=stopping_criteria,
+            nthreads=2)
+        for i in range(nparticles):
+            np.testing.assert_allclose(tys_batch[i][-1], tys[i][-1], rtol=1e-6)
+            np.testing.assert_allclose(tys_mt[i], tys[i], rtol=1e-13, atol=1e-13)
+
+    def test_multithreaded_guidingcenter_tracing(self):
+        bsh = self.bsh
+        ma = self.ma
+        m = PROTON_MASS
+        q = ELEMENTARY_CHARGE
+        Ekin = 9000*ONE_EV
+        speed_total = np.sqrt(2*Ekin/m)
+        nphis = 4
+        phis = np.linspace(0, 2*np.pi, nphis, endpoint=False)
+        xyz_inits = ma.gamma()[::5, :][:7, :]
+        nparticles = xyz_inits.shape[0]
+        vpar_inits = speed_total * np.linspace(-0.6, 0.6, nparticles)
+        tmax = 2e-5
+        # the iteration criterion makes the particles stop at different times
+        stopping_criteria = [IterationStoppingCriterion(200)]
+
+        tys, phi_hits = trace_particles(
+            bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+            phis=phis, mode='gc_vac', stopping_criteria=stopping_criteria)
+        for nthreads in [0, 2, 3]:
+            tys_mt, phi_hits_mt = trace_particles(
+                bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+                phis=phis, mode='gc_vac', stopping_criteria=stopping_criteria, nthreads=nthreads)
+            for i in range(nparticles):
+                np.testing.assert_allclose(tys_mt[i], tys[i], rtol=1e-13, atol=1e-13)
+                np.testing.assert_allclose(phi_hits_mt[i], phi_hits[i], rtol=1e-13, atol=1e-13)
+
+        with self.assertRaises(ValueError):
+            trace_particles(
+                bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+                phis=phis, mode='gc_vac', stopping_criteria=[ToroidalTransitStoppingCriterion(1, False)],
+                nthreads=2)
+
+    def test_trajectory_output(self):
+        bsh = self.bsh
+        ma = self.ma
+        m = PROTON_MASS
+        q = ELEMENTARY_CHARGE
+        Ekin = 9000*ONE_EV
+        speed_total = np.sqrt(2*Ekin/m)
+        phis = np.linspace(0, 2*np.pi, 4, endpoint=False)
+        xyz_inits = ma.gamma()[:1, :]
+        vpar_inits = [0.3*speed_total]
+        tmax = 1e-5
+
+        def trace(output):
+            tys, phi_hits = trace_particles(
+                bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+                phis=phis, mode='gc_vac', stopping_criteria=[], trajectory_output=output)
+            return tys[0], phi_hits[0]
+
+        ty, phi_hit = trace(None)
+        assert isinstance(ty, np.ndarray) and ty.shape[1] == 5
+        assert len(phi_hit) > 0
+
+        # a power of two, so that tmax is a multiple of dt also in floating point
+        dt = tmax/32
+        ty_sampled, phi_hit_sampled = trace(TrajectoryOutput('sampled', dt=dt))
+        np.testing.assert_allclose(ty_sampled[:, 0], np.linspace(0, tmax, 33), rtol=1e-13, atol=1e-16)
+        np.testing.assert_allclose(phi_hit_sampled, phi_hit, rtol=1e-13, atol=1e-13)
+        # the end state agrees with the one of the full trajectory
+        np.testing.assert_allclose(ty_sampled[-1], ty[-1], rtol=1e-12, atol=1e-12)
+
+        ty_every, _ = trace(TrajectoryOutput('every_n', every=3))
+        np.testing.assert_allclose(ty_every[1:-1], ty[3:-1:3], rtol=1e-13, atol=1e-13)
+        np.testing.assert_allclose(ty_every[[0, -1]], ty[[0, -1]], rtol=1e-13, atol=1e-13)
+
+        ty_hits, phi_hit_hits = trace(TrajectoryOutput('hits_only'))
+        np.testing.assert_allclose(ty_hits, ty[[0, -1]], rtol=1e-13, atol=1e-13)
+        np.testing.assert_allclose(phi_hit_hits, phi_hit, rtol=1e-13, atol=1e-13)
+
+        ty_none, phi_hit_none = trace(TrajectoryOutput('none'))
+        assert len(ty_none) == 0
+        np.testing.assert_allclose(phi_hit_none, phi_hit, rtol=1e-13, atol=1e-13)
+
+        with self.assertRaises(ValueError):
+            TrajectoryOutput('every')
+        with self.assertRaises(ValueError):
+            trace(TrajectoryOutput('sampled', dt=0.))
+
+    def test_fixed_step_integrators(self):
+        bsh = self.bsh
+        ma = self.ma
+        m = PROTON_MASS
+        q = ELEMENTARY_CHARGE
+        Ekin = 1000*ONE_EV
+        speed_total = np.sqrt(2*Ekin/m)
+        phis = np.linspace(0, 2*np.pi, 20, endpoint=False)
+        xyz_inits = ma.gamma()[:1, :]
+        vpar_inits = [0.5*speed_total]
+        tmax = 2e-6
+
+        def trace(mode, integrator):
+            tys, phi_hits = trace_particles(
+                bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+                phis=phis, mode=mode, tol=1e-11, stopping_criteria=[], integrator=integrator)
+            return tys[0], phi_hits[0]
+
+        for mode, method, dt in [('full', 'rk4', 1e-10), ('full', 'boris', 1e-10), ('gc_vac', 'rk4', 1e-8)]:
+            ty, phi_hit = trace(mode, None)
+            ty_fixed, phi_hit_fixed = trace(mode, Integrator(method, dt=dt))
+            np.testing.assert_allclose(np.diff(ty_fixed[:-1, 0]), dt, rtol=1e-6)
+            assert abs(ty_fixed[-1, 0] - tmax) < 1e-15
+            assert np.linalg.norm(ty_fixed[-1, 1:4] - ty[-1, 1:4]) < 1e-4
+            assert len(phi_hit) > 0 and len(phi_hit_fixed) == len(phi_hit)
+            np.testing.assert_allclose(phi_hit_fixed[:, 1], phi_hit[:, 1])
+            np.testing.assert_allclose(phi_hit_fixed[:, 2:5], phi_hit[:, 2:5], atol=1e-4)
+            if method == 'boris':
+                # the Boris scheme conserves the kinetic energy up to round off
+                speeds = np.linalg.norm(ty_fixed[:, 4:7], axis=1)
+                np.testing.assert_allclose(speeds, speed_total, rtol=1e-12)
+
+        with self.assertRaises(ValueError):
+            trace('gc_vac', Integrator('boris', dt=1e-8))
+        with self.assertRaises(ValueError):
+            trace('full', Integrator('rk4'))
+        with self.assertRaises(ValueError):
+            Integrator('euler')
+
+    def test_checkpoint_resume(self):
+        bsh = self.bsh
+        ma = self.ma
+        m = PROTON_MASS
+        q = ELEMENTARY_CHARGE
+        Ekin = 9000*ONE_EV
+        speed_total = np.sqrt(2*Ekin/m)
+        phis = np.linspace(0, 2*np.pi, 4, endpoint=False)
+        xyz_inits = ma.gamma()[:2, :]
+        vpar_inits = [0.3*speed_total, -0.2*speed_total]
+        tmax = 1e-5
+        stopping_criteria = [ToroidalTransitStoppingCriterion(1, False)]
+
+        def trace(mode, tmax, output=None, **kwargs):
+            return trace_particles(
+                bsh, xyz_inits, vpar_inits, tmax=tmax, mass=m, charge=q, Ekin=Ekin,
+                phis=phis, mode=mode, stopping_criteria=stopping_criteria, trajectory_output=output, **kwargs)
+
+        # tracing in many short segments gives the same results
+        res_tys, res_phi_hits = trace('gc_vac', tmax)
+        state = TracingState()
+        state.max_walltime = 0.
+        tys, hits = [], []
+        while not state.finished:
+            ty, hit = sopp.particle_guiding_center_tracing(
+                bsh, xyz_inits[0, :], m, q, speed_total, vpar_inits[0], tmax, 1e-9,
+                vacuum=True, phis=phis, stopping_criteria=stopping_criteria, state=state)
+            tys.append(np.asarray(ty).reshape(-1, 5))
+            hits.append(np.asarray(hit).reshape(-1, 6))
+        assert len(tys) > 10
+        np.testing.assert_allclose(np.concatenate(tys), res_tys[0], rtol=1e-13, atol=1e-13)
+        np.testing.assert_allclose(np.concatenate(hits), res_phi_hits[0], rtol=1e-13, atol=1e-13)
+        with self.assertRaises(ValueError):
+            sopp.particle_guiding_center_tracing(
+                bsh, xyz_inits[0, :], m, q, speed_total, vpar_inits[0], tmax, 1e-9,
+                vacuum=True, phis=phis, stopping_criteria=stopping_criteria, state=state)
+
+        # interrupt a run with checkpoints and resume it from the file
+        for mode, name, tmax_mode, output in [
+                ('gc_vac', 'particle_guiding_center_tracing', tmax, None),
+                ('full', 'particle_fullorbit_tracing', tmax/10, TrajectoryOutput('sampled', dt=tmax/320))]:
+            res_tys, res_phi_hits = trace(mode, tmax_mode, output)
+            traced = getattr(sopp, name)
+            ncalls = [0]
+
+            def interrupted(*args, **kwargs):
+                ncalls[0] += 1
+                if ncalls[0] > 20:
+                    raise KeyboardInterrupt
+                return traced(*args, **kwargs)
+
+            with tempfile.TemporaryDirectory() as tmpdir:
+                checkpoint = os.path.join(tmpdir, 'tracing')
+                with mock.patch.object(sopp, name, interrupted):
+                    with self.assertRaises(KeyboardInterrupt):
+                        trace(mode, tmax_mode, output, checkpoint=checkpoint, checkpoint_interval=0.)
+                assert os.path.exists(checkpoint + '.npz')
+                res_tys_cp, res_phi_hits_cp = trace(mode, tmax_mode, output, checkpoint=checkpoint, checkpoint_interval=0.)
+                for i in range(len(xyz_inits)):
+                    ncols = res_tys[i].shape[1] + 1
+                    np.testing.assert_allclose(res_tys_cp[i], res_tys[i], rtol=1e-13, atol=1e-13)
+                    np.testing.assert_allclose(res_phi_hits_cp[i].reshape(-1, ncols), res_phi_hits[i].reshape(-1, ncols),
+                                               rtol=1e-13, atol=1e-13)
+                # a finished run is simply loaded from the checkpoint
+                res_tys_cp, _ = trace(mode, tmax_mode, output, checkpoint=checkpoint)
+                np.testing.assert_allclose(res_tys_cp[1], res_tys[1], rtol=1e-13, atol=1e-13)
+                # but the checkpoint of a different set of particles is rejected
+                with self.assertRaises(ValueError):
+                    trace_particles(
+                        bsh, xyz_inits[:1, :], vpar_inits[:1], tmax=tmax_mode, mass=m, charge=q, Ekin=Ekin,
+                        phis=phis, mode=mode, checkpoint=checkpoint)
+
     def test_tracing_on_surface_runs(self):
         bsh = self.bsh
         ma = self.ma
@@ -617,6 +886,62 @@ class BoozerGuidingCenterTracingTesting(unittest.TestCase):
         assert np.shape(gc_tys[0])[0] == 2
         np.seterr(divide='warn')
 
+    def test_multithreaded_boozer_tracing(self):
+        # the threads share the interpolants of the InterpolatedBoozerField,
+        # so the results have to agree with the serial ones. The threaded run
+        # goes first, since it builds the interpolants before tracing.
+        ba = BoozerAnalytic(1.2, 1.0, 0, 1.1, 0.8, 0.4, I0=0.1, G1=0.2, I1=0.1, K1=0.3)
+        bsh = InterpolatedBoozerField(ba, 3, [0.1, 0.9, 10], [0, np.pi, 10], [0, 2*np.pi, 20], True, nfp=1, stellsym=True)
+        nparticles = 8
+        m = PROTON_MASS
+        q = ELEMENTARY_CHARGE
+        Ekin = 100.*ONE_EV
+        vpar = np.sqrt(2*Ekin/m)
+        np.random.seed(1)
+        stz_inits = np.random.uniform(size=(nparticles, 3))
+        stz_inits[:, 0] = 0.3 + 0.3*stz_inits[:, 0]
+        stz_inits[:, 1:] *= np.pi
+        vpar_inits = vpar*np.random.uniform(-1, 1, size=(nparticles, ))
+        zetas = [0., np.pi/2]
+        for mode in ['gc_vac', 'gc_nok', 'gc']:
+            res_tys_mt, res_zeta_hits_mt = trace_particles_boozer(
+                bsh, stz_inits, vpar_inits, tmax=1e-5, mass=m, charge=q, Ekin=Ekin,
+                zetas=zetas, mode=mode, stopping_criteria=[MaxToroidalFluxStoppingCriterion(0.95)], nthreads=2)
+            res_tys, res_zeta_hits = trace_particles_boozer(
+                bsh, stz_inits, vpar_inits, tmax=1e-5, mass=m, charge=q, Ekin=Ekin,
+                zetas=zetas, mode=mode, stopping_criteria=[MaxToroidalFluxStoppingCriterion(0.95)])
+            assert len(res_tys_mt) == nparticles
+            for i in range(nparticles):
+                assert np.allclose(res_tys[i], res_tys_mt[i], atol=1e-12, rtol=1e-12)
+                assert np.allclose(res_zeta_hits[i], res_zeta_hits_mt[i], atol=1e-12, rtol=1e-12)
+
+    def test_multithreaded_boozer_tracing_python_field(self):
+        # BoozerAnalytic is implemented in python and cannot be copied for
+        # the threads, so it is traced on a single thread with the GIL held
+        ba = BoozerAnalytic(1.2, 1.0, 0, 1.1, 0.8, 0.4, I0=0.1, G1=0.2, I1=0.1, K1=0.3)
+        nparticles = 4
+        m = PROTON_MASS
+        q = ELEMENTARY_CHARGE
+        Ekin = 100.*ONE_EV
+        vpar = np.sqrt(2*Ekin/m)
+        np.random.seed(1)
+        stz_inits = np.random.uniform(size=(nparticles, 3))
+        stz_inits[:, 0] = 0.3 + 0.3*stz_inits[:, 0]
+        stz_inits[:, 1:] *= np.pi
+        vpar_inits = vpar*np.random.uniform(-1, 1, size=(nparticles, ))
+        zetas = [0., np.pi/2]
+        for mode in ['gc_vac', 'gc_nok', 'gc']:
+            res_tys_mt, res_zeta_hits_mt = trace_particles_boozer(
+                ba, stz_inits, vpar_inits, tmax=1e-6, mass=m, charge=q, Ekin=Ekin,
+                zetas=zetas, mode=mode, stopping_criteria=[MaxToroidalFluxStoppingCriterion(0.95)], nthreads=2)
+            res_tys, res_zeta_hits = trace_particles_boozer(
+                ba, stz_inits, vpar_inits, tmax=1e-6, mass=m, charge=q, Ekin=Ekin,
+                zetas=zetas, mode=mode, stopping_criteria=[MaxToroidalFluxStoppingCriterion(0.95)])
+            assert len(res_tys_mt) == nparticles
+            for i in range(nparticles):
+                assert np.allclose(res_tys[i], res_tys_mt[i], atol=1e-12, rtol=1e-12)
+                assert np.allclose(res_zeta_hits[i], res_zeta_hits_mt[i], atol=1e-12, rtol=1e-12)
+
     def test_compute_poloidal_toroidal_transits(self):
         """
         Trace low-energy particle on an iota=1 field line for one toroidal
@@ -2,6 +2,7 @@ import unittest
 import logging
 
 import numpy as np
+import simsoptpp as sopp
 from scipy import constants
 from scipy.interpolate import interp1d
 
@@ -10,6 +11,7 @@ from simsopt.geo.curve import create_equally_spaced_curves
 from simsopt.configs import get_hsx_data, get_ncsx_data
 from simsopt.geo import CurveXYZFourier
 from simsopt.field.selffield import (
+    B_regularized,
     B_regularized_circ,
     B_regularized_rect,
     rectangular_xsection_k,
@@ -18,6 +20,8 @@ from simsopt.field.selffield import (
 )
 from simsopt.field.force import (
     coil_force,
+    coil_forces,
+    coil_forces_vjp,
     self_force_circ, 
     self_force_rect, 
     MeanSquaredForce, 
@@ -310,6 +314,63 @@ class CoilForcesTest(unittest.TestCase):
             np.testing.assert_array_less(err_new, 0.31 * err)
             err = err_new
 
+    def test_coil_forces_compiled(self):
+        """Compare the compiled kernels to coil_force on the base coils of a
+        symmetric configuration."""
+        nfp = 3
+        ncoils = 3
+        base_curves = create_equally_spaced_curves(ncoils, nfp, True, order=2)
+        base_currents = [Current(1.7e4 * (1 + 0.1 * j)) for j in range(ncoils)]
+        coils = coils_via_symmetries(base_curves, base_currents, nfp, True)
+        base_coils = coils[:ncoils]
+        regularizations = [regularization_circ(0.05 + 0.01 * j) for j in range(ncoils)]
+
+        for coil, regularization in zip(base_coils, regularizations):
+            np.testing.assert_allclose(
+                sopp.B_regularized(coil.curve.gamma(), coil.curve.gammadash(), coil.curve.gammadashdash(),
+                                   coil.curve.quadpoints, coil.current.get_value(), regularization),
+                B_regularized(coil, regularization), rtol=1e-8, atol=1e-12)
+
+        forces, net_forces, net_torques = coil_forces(base_coils, coils, regularizations)
+        for i, (coil, regularization) in enumerate(zip(base_coils, regularizations)):
+            force = coil_force(coil, coils, regularization)
+            np.testing.assert_allclose(forces[i], force, rtol=1e-8, atol=1e-8 * np.max(np.abs(force)))
+            arclength = np.linalg.norm(coil.curve.gammadash(), axis=1)[:, None] / len(coil.curve.quadpoints)
+            np.testing.assert_allclose(net_forces[i], np.sum(force * arclength, axis=0), rtol=1e-8, atol=1e-6)
+            np.testing.assert_allclose(net_torques[i], np.sum(np.cross(coil.curve.gamma(), force) * arclength, axis=0),
+                                       rtol=1e-8, atol=1e-6)
+
+    def test_coil_forces_vjp_taylor_test(self):
+        """Verify coil_forces_vjp against finite differences."""
+        curves, currents, axis = get_ncsx_data(Nt_coils=2)
+        coils = [Coil(curve, current) for curve, current in zip(curves, currents)]
+        base_coils = coils[:2]
+        regularizations = [regularization_circ(0.05)] * 2
+        rng = np.random.default_rng(1)
+        v = [rng.standard_normal((len(c.curve.quadpoints), 3)) for c in base_coils]
+
+        def J():
+            forces, _, _ = coil_forces(base_coils, coils, regularizations)
+            return sum(np.sum(vi * fi) for vi, fi in zip(v, forces))
+
+        deriv_full = coil_forces_vjp(base_coils, coils, regularizations, v)
+        for coil in coils[:3]:
+            dofs = coil.x
+            h = rng.uniform(size=dofs.shape)
+            deriv = np.sum(deriv_full(coil) * h)
+            err = 1e6
+            for i in range(10, 16):
+                eps = 0.5**i
+                coil.x = dofs + eps * h
+                Jp = J()
+                coil.x = dofs - eps * h
+                Jm = J()
+                deriv_est = (Jp - Jm) / (2 * eps)
+                err_new = np.abs(deriv_est - deriv) / np.abs(deriv)
+                np.testing.assert_array_less(err_new, 0.3 * err)
+                err = err_new
+            coil.x = dofs
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -1,6 +1,7 @@
 import unittest
 
 import numpy as np
+import simsoptpp as sopp
 from simsopt.field.coil import coils_via_symmetries
 from simsopt.geo.boozersurface import BoozerSurface
 from simsopt.field.biotsavart import BiotSavart
@@ -530,6 +531,66 @@ class BoozerSurfaceTests(unittest.TestCase):
             print(f'max err     ({i1:03}, {j1:03}): {np.max(diff):.6e}, {Ha[i1, j1]:.6e}\nmax rel err ({i2:03}, {j2:03}): {np.max(rel_diff):.6e}, {Ha[i2,j2]:.6e}\n')
         compute_differences(H0, H1)
 
+    def test_boozer_residual_hvp(self):
+        """
+        Verify that the matrix-free Hessian vector product of the Boozer
+        residual agrees with the dense Hessian of boozer_residual_ds2.
+        """
+        np.random.seed(1)
+        curves, currents, ma = get_ncsx_data()
+        coils = coils_via_symmetries(curves, currents, 3, True)
+        bs = BiotSavart(coils)
+        for surfacetype in surfacetypes_list:
+            for weight_inv_modB in [False, True]:
+                with self.subTest(surfacetype=surfacetype, weight_inv_modB=weight_inv_modB):
+                    s = get_surface(surfacetype, True, nphi=5, ntheta=6, mpol=3, ntor=3)
+                    s.fit_to_curve(ma, 0.1)
+                    x = s.gamma()
+                    nphi, ntheta = x.shape[:2]
+                    bs.set_points(x.reshape((-1, 3)))
+                    B = bs.B().reshape((nphi, ntheta, 3))
+                    dB_dx = bs.dB_by_dX().reshape((nphi, ntheta, 3, 3))
+                    d2B_dx2 = bs.d2B_by_dXdX().reshape((nphi, ntheta, 3, 3, 3))
+                    args = (1.3, -0.4, B, dB_dx, d2B_dx2, s.gammadash1(), s.gammadash2(),
+                            s.dgamma_by_dcoeff(), s.dgammadash1_by_dcoeff(), s.dgammadash2_by_dcoeff())
+                    _, _, H = sopp.boozer_residual_ds2(*args, weight_inv_modB)
+                    v = np.random.standard_normal(H.shape[0])
+                    Hv = sopp.boozer_residual_hvp(*args, v, weight_inv_modB)
+                    np.testing.assert_allclose(Hv, H@v, rtol=1e-11, atol=1e-11*np.max(np.abs(H@v)))
+                    # strided vectors are supported as well
+                    vv = np.repeat(v, 2)[::2]
+                    np.testing.assert_allclose(sopp.boozer_residual_hvp(*args, vv, weight_inv_modB), Hv, rtol=0, atol=0)
+                    with self.assertRaises(ValueError):
+                        sopp.boozer_residual_hvp(*args, v[:-1], weight_inv_modB)
+
+    def test_boozer_dresidual_dc(self):
+        """
+        Check boozer_dresidual_dc, with and without a preallocated output,
+        and its contraction boozer_dresidual_dc_vjp against numpy.
+        """
+        np.random.seed(1)
+        nphi, ntheta, ndofs = 4, 5, 11
+        dB_dc = np.random.standard_normal((nphi, ntheta, 3, ndofs))
+        dxphi_dc = np.random.standard_normal((nphi, ntheta, 3, ndofs))
+        dxtheta_dc = np.random.standard_normal((nphi, ntheta, 3, ndofs))
+        B = np.random.standard_normal((nphi, ntheta, 3))
+        tang = np.random.standard_normal((nphi, ntheta, 3))
+        B2 = np.sum(B**2, axis=2)
+        G, iota = 1.3, -0.4
+        args = (G, dB_dc, B, tang, B2, dxphi_dc, iota, dxtheta_dc)
+        ref = G*dB_dc - 2*np.sum(B[..., None]*dB_dc, axis=2)[:, :, None, :] * tang[..., None] - B2[..., None, None] * (dxphi_dc + iota * dxtheta_dc)
+        np.testing.assert_allclose(sopp.boozer_dresidual_dc(*args), ref, rtol=1e-14, atol=1e-14)
+        out = np.zeros_like(ref)
+        res = sopp.boozer_dresidual_dc(*args, out=out)
+        assert res is out
+        np.testing.assert_allclose(out, ref, rtol=1e-14, atol=1e-14)
+        with self.assertRaises(ValueError):
+            sopp.boozer_dresidual_dc(*args, out=np.zeros((nphi, ntheta, 3, ndofs+1)))
+        with self.assertRaises(ValueError):
+            sopp.boozer_dresidual_dc(*args, out=np.zeros((nphi, ntheta, 3, ndofs), dtype=np.float32))
+        v = np.random.standard_normal((nphi, ntheta, 3))
+        np.testing.assert_allclose(sopp.boozer_dresidual_dc_vjp(*args, v), np.einsum('ijd,ijdm->m', v, ref), rtol=1e-13, atol=1e-13)
+
     def test_boozer_surface_quadpoints(self):
         """ 
         this unit test checks that the quadpoints mask for stellarator symmetric Boozer Surfaces are correctly initialized
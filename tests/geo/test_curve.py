@@ -5,6 +5,7 @@ import os
 
 
 import numpy as np
+import simsoptpp as sopp
 
 from simsopt._core.json import GSONEncoder, GSONDecoder, SIMSON
 from simsopt.geo.curvexyzfourier import CurveXYZFourier, JaxCurveXYZFourier
@@ -12,7 +13,7 @@ from simsopt.geo.curverzfourier import CurveRZFourier
 from simsopt.geo.curveplanarfourier import CurvePlanarFourier
 from simsopt.geo.curvehelical import CurveHelical
 from simsopt.geo.curvexyzfouriersymmetries import CurveXYZFourierSymmetries
-from simsopt.geo.curve import RotatedCurve, curves_to_vtk
+from simsopt.geo.curve import RotatedCurve, CurveBatch, curves_to_vtk
 from simsopt.geo import parameters
 from simsopt.configs.zoo import get_ncsx_data, get_w7x_data  
 from simsopt.field import BiotSavart, Current, coils_via_symmetries, Coil
@@ -724,6 +725,202 @@ class Testing(unittest.TestCase):
         rc.gamma_impl(tmp, quadpoints[:10])
         assert np.allclose(cg[:10, :]@mat, tmp)
 
+    def test_fourier_harmonics_high_order(self):
+        # the Fourier curves obtain cos(i*phi) and sin(i*phi) from a
+        # recurrence, so compare them to a direct evaluation at high order and
+        # for a number of quadrature points that isn't a multiple of the simd
+        # vector size
+        np.random.seed(1)
+        order, nfp, nquad = 20, 3, 37
+        curve = CurveRZFourier(nquad, order, nfp, False)
+        curve.x = np.random.standard_normal(curve.x.shape) / 10
+        phi = 2 * np.pi * curve.quadpoints
+        n = nfp * np.arange(order + 1)
+        cosines = np.cos(np.outer(phi, n))
+        sines = np.sin(np.outer(phi, n))
+        r = cosines @ curve.rc + sines[:, 1:] @ curve.rs
+        z = cosines @ curve.zc + sines[:, 1:] @ curve.zs
+        drdphi = -(sines * n) @ curve.rc + (cosines[:, 1:] * n[1:]) @ curve.rs
+        dzdphi = -(sines * n) @ curve.zc + (cosines[:, 1:] * n[1:]) @ curve.zs
+        gamma = np.stack((r * np.cos(phi), r * np.sin(phi), z), axis=1)
+        gammadash = 2 * np.pi * np.stack((
+            drdphi * np.cos(phi) - r * np.sin(phi), drdphi * np.sin(phi) + r * np.cos(phi), dzdphi), axis=1)
+        np.testing.assert_allclose(curve.gamma(), gamma, atol=1e-12)
+        np.testing.assert_allclose(curve.gammadash(), gammadash, atol=1e-10)
+        dofs = curve.get_dofs()
+        np.testing.assert_allclose(curve.dgamma_by_dcoeff() @ dofs, gamma, atol=1e-12)
+        np.testing.assert_allclose(curve.dgammadash_by_dcoeff() @ dofs, gammadash, atol=1e-10)
+
+        curve = CurveXYZFourier(nquad, order)
+        curve.x = np.random.standard_normal(curve.x.shape) / 10
+        t = 2 * np.pi * curve.quadpoints
+        basis = [np.ones_like(t)]
+        for j in range(1, order + 1):
+            basis += [np.sin(j * t), np.cos(j * t)]
+        basis = np.stack(basis, axis=1)
+        coeffs = curve.get_dofs().reshape((3, 2 * order + 1))
+        np.testing.assert_allclose(curve.gamma(), basis @ coeffs.T, atol=1e-12)
+        np.testing.assert_allclose(curve.dgamma_by_dcoeff() @ curve.get_dofs(), basis @ coeffs.T, atol=1e-12)
+
+    def test_fft_evaluation(self):
+        # on uniform quadrature points the Fourier curves are evaluated using
+        # FFTs, compare to the direct evaluation for grids that cover one or
+        # all field periods, are offset, or have fewer points than modes
+        np.random.seed(2)
+        order, nfp = 9, 3
+        grids = [np.linspace(0, 1, 30, endpoint=False),
+                 np.linspace(0, 1, 30, endpoint=False) + 0.01,
+                 np.linspace(0, 1/nfp, 12, endpoint=False),
+                 np.linspace(0, 1, 7, endpoint=False)]
+        constructors = [lambda q: CurveXYZFourier(q, order),
+                        lambda q: CurveRZFourier(q, order, nfp, False),
+                        lambda q: CurveRZFourier(q, order, nfp, True)]
+        try:
+            for quadpoints in grids:
+                for constructor in constructors:
+                    results = []
+                    for mode in ["never", "always"]:
+                        sopp.set_fft_mode(mode)
+                        curve = constructor(quadpoints)
+                        curve.x = np.random.RandomState(0).standard_normal(curve.x.shape) / 5
+                        v = np.random.RandomState(1).standard_normal((len(quadpoints), 3))
+                        results.append([curve.gamma(), curve.gammadash(), curve.gammadashdash(), curve.gammadashdashdash(),
+                                        curve.dgamma_by_dcoeff_vjp_impl(v), curve.dgammadash_by_dcoeff_vjp_impl(v),
+                                        curve.dgammadashdash_by_dcoeff_vjp_impl(v), curve.dgammadashdashdash_by_dcoeff_vjp_impl(v)])
+                    for direct, fft in zip(*results):
+                        np.testing.assert_allclose(fft, direct, rtol=1e-11, atol=1e-11 * np.max(np.abs(direct)))
+        finally:
+            sopp.set_fft_mode("auto")
+        self.assertEqual(sopp.get_fft_mode(), "auto")
+        with self.assertRaises(ValueError):
+            sopp.set_fft_mode("sometimes")
+
+    def test_jacobian_products(self):
+        # the Fourier curves apply dgamma_by_dcoeff and its transpose without
+        # forming the dense arrays, compare to the dense arrays on uniform and
+        # non-uniform quadrature points
+        order, nfp = 6, 2
+        grids = [np.linspace(0, 1, 25, endpoint=False), np.linspace(0, 1, 20, endpoint=False)**1.2]
+        for quadpoints in grids:
+            for curve in [CurveXYZFourier(quadpoints, order), CurveRZFourier(quadpoints, order, nfp, False),
+                          CurvePlanarFourier(quadpoints, order, 1, False)]:
+                curve.x = np.random.RandomState(0).standard_normal(curve.x.shape) / 5
+                v = np.random.RandomState(1).standard_normal((len(quadpoints), 3))
+                w = np.random.RandomState(2).standard_normal(curve.num_dofs())
+                jacobians = [curve.dgamma_by_dcoeff(), curve.dgammadash_by_dcoeff(),
+                             curve.dgammadashdash_by_dcoeff(), curve.dgammadashdashdash_by_dcoeff()]
+                vjps = [curve.dgamma_by_dcoeff_vjp_impl(v), curve.dgammadash_by_dcoeff_vjp_impl(v),
+                        curve.dgammadashdash_by_dcoeff_vjp_impl(v), curve.dgammadashdashdash_by_dcoeff_vjp_impl(v)]
+                for derivative, (J, vjp) in enumerate(zip(jacobians, vjps)):
+                    np.testing.assert_allclose(vjp, np.einsum('ijk,ij->k', J, v), rtol=1e-11, atol=1e-11 * np.max(np.abs(vjp)))
+                    jvp = curve.dgamma_by_dcoeff_jvp(w, derivative)
+                    np.testing.assert_allclose(jvp, J @ w, rtol=1e-11, atol=1e-11 * np.max(np.abs(jvp)))
+        with self.assertRaises(ValueError):
+            curve.dgamma_by_dcoeff_jvp(w, 4)
+
+    def test_curve_batch(self):
+        # the batched evaluation has to agree with the evaluation of the
+        # individual curves, on uniform and non-uniform quadrature points
+        order, nfp, ncurves = 4, 3, 5
+        grids = [np.linspace(0, 1, 25, endpoint=False), np.linspace(0, 1, 20, endpoint=False)**1.2]
+        for quadpoints in grids:
+            for make in [lambda: CurveXYZFourier(quadpoints, order),
+                         lambda: CurveRZFourier(quadpoints, order, nfp, False),
+                         lambda: CurveRZFourier(quadpoints, order, nfp, True),
+                         lambda: CurvePlanarFourier(quadpoints, order, nfp, True)]:
+                curves = [make() for _ in range(ncurves)]
+                for i, curve in enumerate(curves):
+                    curve.x = np.random.RandomState(i).standard_normal(curve.x.shape) / 5
+                expected = [[curve.gamma().copy(), curve.gammadash().copy(), curve.gammadashdash().copy(),
+                             curve.gammadashdashdash().copy()] for curve in curves]
+                batch = CurveBatch(curves)
+                assert len(batch) == ncurves
+                for curve in curves:
+                    curve.invalidate_cache()
+                    curve.enable_cache_stats(True)
+                batch.evaluate(3)
+                for curve, values in zip(curves, expected):
+                    for value, computed in zip(values, [curve.gamma(), curve.gammadash(), curve.gammadashdash(), curve.gammadashdashdash()]):
+                        np.testing.assert_allclose(computed, value, rtol=1e-12, atol=1e-12 * np.max(np.abs(value)))
+                    # the curves took the values from the cache
+                    assert curve.cache_stats()['gamma'].recomputes == 0
+
+                # only the curves with new dofs are evaluated again
+                curves[1].x = curves[1].x + 0.01
+                batch.evaluate(0)
+                fresh = make()
+                fresh.x = curves[1].x
+                np.testing.assert_allclose(curves[1].gamma(), fresh.gamma(), atol=1e-12)
+                assert curves[0].cache_stats()['gamma'].recomputes == 0
+
+        with self.assertRaises(ValueError):
+            CurveBatch([CurveXYZFourier(20, 3), CurveXYZFourier(20, 4)])
+        with self.assertRaises(ValueError):
+            CurveBatch([CurveXYZFourier(20, 3), CurveRZFourier(20, 3, 1, True)])
+
+    def test_cache_stats(self):
+        curve = CurveXYZFourier(20, 3)
+        curve.set('xc(1)', 1.0)
+        curve.set('ys(1)', 1.0)
+        curve.enable_cache_stats(True)
+        for _ in range(3):
+            curve.gamma()
+            curve.dgamma_by_dcoeff()
+        stats = curve.cache_stats()
+        assert set(stats.keys()) == {'gamma', 'dgamma_by_dcoeff'}
+        assert stats['gamma'].recomputes == 1 and stats['gamma'].hits == 2
+        assert stats['gamma'].allocations == 1
+        assert stats['gamma'].seconds >= 0
+
+        # gamma is recomputed after the dofs change, but dgamma_by_dcoeff is
+        # in the persistent cache since the curve is linear in the dofs
+        curve.set('xc(1)', 1.1)
+        curve.gamma()
+        curve.dgamma_by_dcoeff()
+        stats = curve.cache_stats()
+        assert stats['gamma'].recomputes == 2 and stats['gamma'].hits == 2
+        assert stats['dgamma_by_dcoeff'].recomputes == 1 and stats['dgamma_by_dcoeff'].hits == 3
+        assert np.allclose(curve.gamma()[0], [1.1, 0, 0])
+
+        curve.reset_cache_stats()
+        assert curve.cache_stats() == {}
+        curve.enable_cache_stats(False)
+        curve.gamma()
+        assert curve.cache_stats() == {}
+
+    def test_cache_budget(self):
+        curve = CurveXYZFourier(20, 3)
+        curve.set('xc(1)', 1.0)
+        curve.set('ys(1)', 1.0)
+        gamma = curve.gamma().copy()
+        kappa = curve.kappa().copy()
+        nbytes = curve.cache_bytes()
+        assert nbytes['gamma'] == 20 * 3 * 8
+        assert nbytes['kappa'] == 20 * 8
+        usage = [u for u in sopp.cache_usage() if u[1] == curve.cache_id()]
+        assert {u[2] for u in usage} == set(nbytes.keys())
+        assert all(u[0] == 'Curve' and u[4] for u in usage)
+        assert sopp.cache_total_bytes() >= sum(nbytes.values())
+
+        try:
+            # stale entries are freed as soon as a budget is set...
+            curve.invalidate_cache()
+            evictions = sopp.cache_evictions()
+            sopp.set_cache_budget(1)
+            assert sum(curve.cache_bytes().values()) == 0
+            assert sopp.cache_evictions() >= evictions + len(nbytes)
+            # ... and recomputed on the next access
+            assert np.allclose(curve.gamma(), gamma)
+            assert np.allclose(curve.kappa(), kappa)
+            # valid entries are only freed by an explicit trim
+            assert curve.cache_bytes()['gamma'] == 20 * 3 * 8
+            assert sopp.cache_trim() >= 20 * 3 * 8
+            assert sum(curve.cache_bytes().values()) == 0
+            assert np.allclose(curve.kappa(), kappa)
+        finally:
+            sopp.set_cache_budget(0)
+        assert sopp.get_cache_budget() == 0
+
     def subtest_serialization(self, curvetype, rotated):
         epss = [0.5**i for i in range(10, 15)]
         x = np.asarray([0.6] + [0.6 + eps for eps in epss])
@@ -293,6 +293,32 @@ class Testing(unittest.TestCase):
         candidates = sopp.get_pointclouds_closer_than_threshold_between_two_collections(pointCloudsA, pointCloudsB, threshold)
         assert len(candidates) == 1
 
+    def test_minimum_distance_candidates_incremental(self):
+        np.random.seed(0)
+        n_clouds = 6
+        threshold = 0.5
+        pointClouds = [np.random.uniform(low=-1.0, high=+1.0, size=(5, 3)) for _ in range(n_clouds)]
+        grid = sopp.PointCloudGrid(pointClouds, threshold)
+        for it in range(5):
+            for num_base in [2, n_clouds]:
+                candidates = sopp.get_pointclouds_closer_than_threshold_within_collection(pointClouds, threshold, num_base)
+                assert sorted(candidates) == grid.close_pairs(num_base)
+            # only move one cloud, the grid rehashes just that one
+            p = it % n_clouds
+            pointClouds[p] = np.random.uniform(low=-1.0, high=+1.0, size=(5, 3))
+            grid.set_cloud(p, pointClouds[p])
+
+        # the curves that moved are passed to recompute_bell as parent
+        base_curves, base_currents, _ = get_ncsx_data(Nt_coils=10)
+        curves = [c.curve for c in coils_via_symmetries(base_curves, base_currents, 3, True)]
+        J = CurveCurveDistance(curves, 0.2)
+        J.compute_candidates()
+        base_curves[0].x = base_curves[0].x + 0.05 * np.random.standard_normal(base_curves[0].x.shape)
+        J.compute_candidates()
+        assert J._moved == set()
+        assert J.candidates == sopp.get_pointclouds_closer_than_threshold_within_collection(
+            [c.gamma() for c in curves], 0.2, len(curves))
+
     def test_minimum_distance_candidates_symmetry(self):
         from scipy.spatial.distance import cdist
         base_curves, base_currents, _ = get_ncsx_data(Nt_coils=10)
@@ -357,6 +383,41 @@ class Testing(unittest.TestCase):
             assert err_new < 0.3 * err
             err = err_new
 
+    def test_distance_penalty_kernels(self):
+        from jax import grad
+        from simsopt.geo.curveobjectives import cc_distance_pure, cs_distance_pure
+        np.random.seed(0)
+        dmin = 1.0
+        gammas = [np.random.uniform(-1, 1, size=(n, 3)) for n in [7, 9, 10]]
+        ls = [np.random.uniform(-1, 1, size=(n, 3)) for n in [7, 9, 10]]
+        candidates = [(1, 0), (2, 0), (2, 1)]
+        J, dgamma, dl = sopp.curve_curve_distance_penalty(gammas, ls, candidates, dmin)
+        Jref = 0
+        dgamma_ref = [np.zeros_like(g) for g in gammas]
+        dl_ref = [np.zeros_like(g) for g in gammas]
+        for i, j in candidates:
+            args = (gammas[i], ls[i], gammas[j], ls[j], dmin)
+            Jref += cc_distance_pure(*args)
+            dgamma_ref[i] += grad(cc_distance_pure, argnums=0)(*args)
+            dl_ref[i] += grad(cc_distance_pure, argnums=1)(*args)
+            dgamma_ref[j] += grad(cc_distance_pure, argnums=2)(*args)
+            dl_ref[j] += grad(cc_distance_pure, argnums=3)(*args)
+        np.testing.assert_allclose(J, Jref, rtol=1e-12)
+        for k in range(3):
+            np.testing.assert_allclose(dgamma[k], dgamma_ref[k], rtol=1e-10, atol=1e-14)
+            np.testing.assert_allclose(dl[k], dl_ref[k], rtol=1e-10, atol=1e-14)
+
+        xyz_surf = np.random.uniform(-1, 1, size=(20, 3))
+        ns = np.random.uniform(-1, 1, size=(20, 3))
+        J, dgamma, dl = sopp.curve_surface_distance_penalty(gammas, ls, xyz_surf, ns, [0, 2], dmin)
+        Jref = sum(cs_distance_pure(gammas[i], ls[i], xyz_surf, ns, dmin) for i in [0, 2])
+        np.testing.assert_allclose(J, Jref, rtol=1e-12)
+        for k in [0, 2]:
+            args = (gammas[k], ls[k], xyz_surf, ns, dmin)
+            np.testing.assert_allclose(dgamma[k], grad(cs_distance_pure, argnums=0)(*args), rtol=1e-10, atol=1e-14)
+            np.testing.assert_allclose(dl[k], grad(cs_distance_pure, argnums=1)(*args), rtol=1e-10, atol=1e-14)
+        assert np.all(dgamma[1] == 0)
+
     def test_linking_number(self):
         for downsample in [1, 2, 5]:
             curves1 = create_equally_spaced_curves(2, 1, stellsym=True, R0=1, R1=0.5, order=5, numquadpoints=120)
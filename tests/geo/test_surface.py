@@ -4,6 +4,7 @@ from pathlib import Path
 import os
 import logging
 import numpy as np
+import simsoptpp as sopp
 
 
 from simsopt.geo.surface import Surface
@@ -13,7 +14,7 @@ from simsopt.geo.surfacexyztensorfourier import SurfaceXYZTensorFourier
 from simsopt.geo.surfacehenneberg import SurfaceHenneberg
 from simsopt.geo.surfacegarabedian import SurfaceGarabedian
 from simsopt.geo.surface import signed_distance_from_surface, SurfaceScaled, \
-    best_nphi_over_ntheta
+    best_nphi_over_ntheta, SurfaceClassifier
 from simsopt.geo.curverzfourier import CurveRZFourier
 from simsopt._core.json import GSONDecoder, GSONEncoder, SIMSON
 from .surface_test_helpers import get_surface, get_boozer_surface
@@ -247,6 +248,33 @@ class SurfaceDistanceTests(unittest.TestCase):
         d = signed_distance_from_surface(xyz, s)
         assert np.allclose(d, [-0.8, 0.2, -0.8])
 
+    def test_surface_classifier(self):
+        """
+        The signed distance to a circular torus, computed on the triangulated
+        grid of a single field period and interpolated with and without
+        exploiting the symmetries, matches the exact distance.
+        """
+        R0, a = 1., 0.2
+        s = SurfaceRZFourier(nfp=2, mpol=1, ntor=0,
+                             quadpoints_phi=np.linspace(0, 0.5, 32, endpoint=False),
+                             quadpoints_theta=np.linspace(0, 1, 32, endpoint=False))
+        s.set_rc(0, 0, R0)
+        s.set_rc(1, 0, a)
+        s.set_zs(1, 0, a)
+        np.random.seed(0)
+        xyz = np.random.uniform(low=[-1.3, -1.3, -0.3], high=[1.3, 1.3, 0.3], size=(2000, 3))
+        exact = a - np.sqrt((np.linalg.norm(xyz[:, :2], axis=1) - R0)**2 + xyz[:, 2]**2)
+
+        dist = sopp.SurfaceDistance(SurfaceClassifier._full_torus_gamma(s))
+        d = dist.signed_distance(xyz)
+        assert np.allclose(d, exact, atol=3e-3)
+
+        close = np.abs(exact) < 0.1
+        sc = SurfaceClassifier(s, p=2, h=0.05)
+        sc_sym = SurfaceClassifier(s, p=2, h=0.05, nfp=2, stellsym=True)
+        assert np.allclose(sc.evaluate_xyz(xyz)[close, 0], exact[close], atol=5e-3)
+        assert np.allclose(sc_sym.evaluate_xyz(xyz)[close, 0], exact[close], atol=5e-3)
+
 
 class SurfaceScaledTests(unittest.TestCase):
     def test_surface_scaled(self):
@@ -405,6 +433,116 @@ class isSelfIntersecting(unittest.TestCase):
         assert s.is_self_intersecting(thetas=202) 
 
 
+class FourierEvaluationTests(unittest.TestCase):
+    def test_fft_evaluation(self):
+        # on uniform quadrature points SurfaceRZFourier and
+        # SurfaceXYZTensorFourier are evaluated using FFTs, compare to the
+        # direct evaluation
+        nfp, mpol, ntor = 3, 4, 3
+        grids = [(np.linspace(0, 1/nfp, 15, endpoint=False), np.linspace(0, 1, 13, endpoint=False)),
+                 (np.linspace(0, 1, 20, endpoint=False) + 0.02, np.linspace(0, 1, 16, endpoint=False) + 0.1),
+                 (np.linspace(0, 1/nfp, 5, endpoint=False), np.linspace(0, 1, 6, endpoint=False))]
+        try:
+            for quadpoints_phi, quadpoints_theta in grids:
+                for stellsym in stellsym_list:
+                    for surfacetype in [SurfaceRZFourier, SurfaceXYZTensorFourier]:
+                        results = []
+                        for mode in ["never", "always"]:
+                            sopp.set_fft_mode(mode)
+                            s = surfacetype(nfp=nfp, stellsym=stellsym, mpol=mpol, ntor=ntor,
+                                            quadpoints_phi=quadpoints_phi, quadpoints_theta=quadpoints_theta)
+                            s.x = np.random.RandomState(0).standard_normal(s.x.shape) / 5
+                            v = np.random.RandomState(1).standard_normal((len(quadpoints_phi), len(quadpoints_theta), 3))
+                            results.append([s.gamma(), s.gammadash1(), s.gammadash2(),
+                                            s.gammadash1dash1(), s.gammadash1dash2(), s.gammadash2dash2(),
+                                            s.dgamma_by_dcoeff_vjp(v), s.dgammadash1_by_dcoeff_vjp(v), s.dgammadash2_by_dcoeff_vjp(v)])
+                        for direct, fft in zip(*results):
+                            np.testing.assert_allclose(fft, direct, rtol=1e-11, atol=1e-11 * np.max(np.abs(direct)))
+        finally:
+            sopp.set_fft_mode("auto")
+
+    def test_jacobian_products(self):
+        # SurfaceRZFourier and SurfaceXYZTensorFourier apply the Jacobians of
+        # gamma and its derivatives with respect to the dofs, and their
+        # transposes, without forming the dense arrays
+        nfp, mpol, ntor = 2, 3, 2
+        grids = [(np.linspace(0, 1/nfp, 9, endpoint=False), np.linspace(0, 1, 10, endpoint=False)),
+                 (np.linspace(0, 1/nfp, 8, endpoint=False)**1.1, np.linspace(0, 1, 11, endpoint=False)**1.2)]
+        for quadpoints_phi, quadpoints_theta in grids:
+            for stellsym in stellsym_list:
+                for surfacetype in [SurfaceRZFourier, SurfaceXYZTensorFourier, SurfaceXYZFourier]:
+                    s = surfacetype(nfp=nfp, stellsym=stellsym, mpol=mpol, ntor=ntor,
+                                    quadpoints_phi=quadpoints_phi, quadpoints_theta=quadpoints_theta)
+                    s.x = np.random.RandomState(0).standard_normal(s.x.shape) / 5
+                    v = np.random.RandomState(1).standard_normal((len(quadpoints_phi), len(quadpoints_theta), 3))
+                    w = np.random.RandomState(2).standard_normal(s.num_dofs())
+                    for J, vjp in [(s.dgamma_by_dcoeff(), s.dgamma_by_dcoeff_vjp(v)),
+                                   (s.dgammadash1_by_dcoeff(), s.dgammadash1_by_dcoeff_vjp(v)),
+                                   (s.dgammadash2_by_dcoeff(), s.dgammadash2_by_dcoeff_vjp(v))]:
+                        np.testing.assert_allclose(vjp, np.einsum('ijkl,ijk->l', J, v), rtol=1e-11, atol=1e-11 * np.max(np.abs(vjp)))
+                    for (dphi, dtheta), J in [((0, 0), s.dgamma_by_dcoeff()), ((1, 0), s.dgammadash1_by_dcoeff()),
+                                              ((0, 1), s.dgammadash2_by_dcoeff()), ((2, 0), s.dgammadash1dash1_by_dcoeff()),
+                                              ((1, 1), s.dgammadash1dash2_by_dcoeff()), ((0, 2), s.dgammadash2dash2_by_dcoeff())]:
+                        jvp = s.dgamma_by_dcoeff_jvp(w, dphi, dtheta)
+                        np.testing.assert_allclose(jvp, J @ w, rtol=1e-11, atol=1e-11 * np.max(np.abs(jvp)))
+
+    def test_clamped_second_derivatives(self):
+        # the second derivatives of a SurfaceXYZTensorFourier with a clamped
+        # dimension include the derivatives of the boundary condition
+        # enforcer, compare to finite differences of the first derivatives
+        nfp, mpol, ntor = 2, 3, 2
+        quadpoints_phi = np.linspace(0, 1/nfp, 7, endpoint=False)**1.1
+        quadpoints_theta = np.linspace(0, 1, 9, endpoint=False)**1.2
+        h = 1e-5
+        for stellsym in stellsym_list:
+            def surface(dphi, dtheta):
+                s = SurfaceXYZTensorFourier(nfp=nfp, stellsym=stellsym, mpol=mpol, ntor=ntor,
+                                            clamped_dims=[True, False, True],
+                                            quadpoints_phi=quadpoints_phi + dphi, quadpoints_theta=quadpoints_theta + dtheta)
+                s.x = np.random.RandomState(0).standard_normal(s.x.shape) / 5
+                return s
+            s = surface(0, 0)
+            sp, sm = surface(h, 0), surface(-h, 0)
+            tp, tm = surface(0, h), surface(0, -h)
+            for exact, fd in [(s.gammadash1(), (sp.gamma() - sm.gamma())/(2*h)),
+                              (s.gammadash1dash1(), (sp.gammadash1() - sm.gammadash1())/(2*h)),
+                              (s.gammadash1dash2(), (tp.gammadash1() - tm.gammadash1())/(2*h)),
+                              (s.gammadash2dash2(), (tp.gammadash2() - tm.gammadash2())/(2*h))]:
+                np.testing.assert_allclose(exact, fd, rtol=0, atol=1e-6 * np.max(np.abs(exact)))
+
+
+class HessianTests(unittest.TestCase):
+    def test_area_volume_hessians(self):
+        # the Hessians of the area and the volume are assembled without the
+        # second derivative of the normal, compare to the formulas using
+        # d2normal_by_dcoeffdcoeff, and the Hessian vector products to the
+        # dense Hessians
+        for surfacetype in ["SurfaceRZFourier", "SurfaceXYZFourier", "SurfaceXYZTensorFourier"]:
+            for stellsym in stellsym_list:
+                with self.subTest(surfacetype=surfacetype, stellsym=stellsym):
+                    s = get_surface(surfacetype, stellsym, mpol=3, ntor=2, nphi=8, ntheta=9)
+                    s.x = s.x + np.random.RandomState(0).standard_normal(s.x.shape) * 1e-2
+                    w = np.random.RandomState(1).standard_normal(s.num_dofs())
+                    nq = len(s.quadpoints_phi) * len(s.quadpoints_theta)
+                    n = s.normal()
+                    dn = s.dnormal_by_dcoeff()
+                    d2n = s.d2normal_by_dcoeffdcoeff()
+                    norm = np.linalg.norm(n, axis=2)
+                    ndn = np.einsum('ijk,ijkm->ijm', n, dn)
+                    d2area = (np.einsum('ijkm,ijkn,ij->mn', dn, dn, 1/norm)
+                              - np.einsum('ijm,ijn,ij->mn', ndn, ndn, 1/norm**3)
+                              + np.einsum('ijk,ijkmn,ij->mn', n, d2n, 1/norm)) / nq
+                    x = s.gamma()
+                    dx = s.dgamma_by_dcoeff()
+                    d2volume = (np.einsum('ijkm,ijkn->mn', dx, dn) + np.einsum('ijkn,ijkm->mn', dx, dn)
+                                + np.einsum('ijk,ijkmn->mn', x, d2n)) / (3 * nq)
+                    for H, Hw, ref in [(s.d2area_by_dcoeffdcoeff(), s.d2area_by_dcoeffdcoeff_hvp(w), d2area),
+                                       (s.d2volume_by_dcoeffdcoeff(), s.d2volume_by_dcoeffdcoeff_hvp(w), d2volume)]:
+                        np.testing.assert_allclose(H, ref, rtol=0, atol=1e-12 * np.max(np.abs(ref)))
+                        np.testing.assert_array_equal(H, H.T)
+                        np.testing.assert_allclose(Hw, H @ w, rtol=0, atol=1e-12 * np.max(np.abs(H)) * np.linalg.norm(w, 1))
+
+
 class UtilTests(unittest.TestCase):
     def test_extend_via_normal(self):
         """
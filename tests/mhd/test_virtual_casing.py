@@ -25,6 +25,8 @@ except ImportError:
 
 from simsopt.mhd.vmec import Vmec
 from simsopt.mhd.virtual_casing import VirtualCasing
+from simsopt.geo import SurfaceRZFourier, CurveXYZFourier, create_equally_spaced_curves
+from simsopt.field import BiotSavart, Current, Coil, coils_via_symmetries
 from . import TEST_DIR
 
 logger = logging.getLogger(__name__)
@@ -220,3 +222,57 @@ class VirtualCasingTests(unittest.TestCase):
         plt.tight_layout()
         plt.show()
         """
+
+
+class VirtualCasingSimsoptTests(unittest.TestCase):
+
+    def test_coils_inside_and_outside(self):
+        """
+        For the field of coils on both sides of a torus, the compiled virtual
+        casing kernel should return the field of the coils outside of the
+        torus only.
+        """
+        nfp = 2
+        surf = SurfaceRZFourier(nfp=nfp, mpol=1, ntor=0,
+                                quadpoints_phi=np.linspace(0, 1 / nfp, 48, endpoint=False),
+                                quadpoints_theta=np.linspace(0, 1, 48, endpoint=False))
+        surf.set_rc(0, 0, 1.0)
+        surf.set_rc(1, 0, 0.25)
+        surf.set_zs(1, 0, 0.25)
+
+        curves = create_equally_spaced_curves(2, nfp, stellsym=True, R0=1.0, R1=0.6, order=1)
+        outside = BiotSavart(coils_via_symmetries(curves, [Current(1e5), Current(1e5)], nfp, True))
+        axis = CurveXYZFourier(128, 1)
+        axis.set('xc(1)', 1.0)
+        axis.set('ys(1)', 1.0)
+        inside = BiotSavart([Coil(axis, Current(3e4))])
+
+        gamma = surf.gamma()
+        points = gamma.reshape((-1, 3))
+        outside.set_points(points)
+        inside.set_points(points)
+        B_outside = outside.B().reshape(gamma.shape)
+        B = B_outside + inside.B().reshape(gamma.shape)
+        # the field of the coil inside is not small
+        assert np.max(np.abs(B - B_outside)) > 0.02
+
+        B_external = VirtualCasing.B_external_from_surface(surf, B)
+        logger.info(f'max(|B_external - B_outside|): {np.max(np.abs(B_external - B_outside))}')
+        np.testing.assert_allclose(B_external, B_outside, atol=3e-3)
+
+        # targets that are not on the source grid
+        trgt_surf = SurfaceRZFourier(nfp=nfp, mpol=1, ntor=0,
+                                     quadpoints_phi=np.linspace(0, 1 / nfp, 7, endpoint=False) + 0.01,
+                                     quadpoints_theta=np.linspace(0, 1, 9, endpoint=False) + 0.02)
+        trgt_surf.x = surf.x
+        targets = trgt_surf.gamma()
+        outside.set_points(targets.reshape((-1, 3)))
+        inside.set_points(targets.reshape((-1, 3)))
+        B_outside_targets = outside.B().reshape(targets.shape)
+        B_targets = B_outside_targets + inside.B().reshape(targets.shape)
+        B_external = VirtualCasing.B_external_from_surface(surf, B, targets, B_targets)
+        np.testing.assert_allclose(B_external, B_outside_targets, atol=3e-3)
+
+        # far away source blocks on a coarser grid
+        B_external_eta = VirtualCasing.B_external_from_surface(surf, B, targets, B_targets, eta=4.0)
+        np.testing.assert_allclose(B_external_eta, B_external, atol=1e-3)
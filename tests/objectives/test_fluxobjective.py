@@ -8,6 +8,7 @@ from simsopt.field.coil import coils_via_symmetries, Current
 from simsopt.geo.curve import create_equally_spaced_curves
 from simsopt.geo.curveobjectives import CurveLength
 from simsopt.field.biotsavart import BiotSavart
+from simsopt.field.magneticfield import MagneticFieldSum
 from simsopt.objectives.fluxobjective import SquaredFlux
 from simsopt._core.json import GSONDecoder, GSONEncoder, SIMSON
 
@@ -112,3 +113,24 @@ class FluxObjectiveTests(unittest.TestCase):
                 ALPHA = 1e-5
                 JF_scaled_summed = Jf + ALPHA * sum(Jls)
                 self.check_taylor_test(JF_scaled_summed)
+
+    def test_fused_biotsavart(self):
+        """The fused evaluation for BiotSavart agrees with the generic one."""
+        s = SurfaceRZFourier.from_vmec_input(filename)
+        ncoils = 3
+        base_curves = create_equally_spaced_curves(ncoils, s.nfp, stellsym=s.stellsym, R0=1.0, R1=0.5, order=6)
+        base_currents = [Current(1e5) for i in range(ncoils)]
+        coils = coils_via_symmetries(base_curves, base_currents, s.nfp, s.stellsym)
+        bs = BiotSavart(coils)
+        target = 0.01 * np.random.default_rng(0).standard_normal(s.gamma().shape[0:2])
+        for definition in ["quadratic flux", "normalized", "local"]:
+            with self.subTest(definition=definition):
+                # the sum is not a BiotSavart, so it uses B() and B_vjp()
+                Jf = SquaredFlux(s, bs, target, definition=definition)
+                Jf_generic = SquaredFlux(s, MagneticFieldSum([bs]), target, definition=definition)
+                bs.clear_cached_properties()
+                np.testing.assert_allclose(Jf.J(), Jf_generic.J(), rtol=1e-12)
+                bs.clear_cached_properties()
+                np.testing.assert_allclose(Jf.dJ(), Jf_generic.dJ(), rtol=1e-10, atol=1e-14)
+                # with B in the cache
+                np.testing.assert_allclose(Jf.dJ(), Jf_generic.dJ(), rtol=1e-10, atol=1e-14)
@@ -5,9 +5,14 @@ import numpy as np
 from monty.tempfile import ScratchDir
 
 import simsoptpp as sopp
+try:
+    from mpi4py import MPI
+except ImportError:
+    MPI = None
 from simsopt.solve.permanent_magnet_optimization import prox_l0, prox_l1
 from simsopt.solve.permanent_magnet_optimization import setup_initial_condition
 from simsopt.solve import relax_and_split, GPMO
+from simsopt.solve.permanent_magnet_optimization import GPMO_baseline_mpi, _mpi_dipole_range
 from simsopt.util import *
 from simsopt.geo import SurfaceRZFourier, PermanentMagnetGrid
 from simsopt.field import BiotSavart
@@ -27,6 +32,56 @@ class Testing(unittest.TestCase):
         m_thresholded = prox_l1(m, mmax, reg_l0, nu)
         assert np.linalg.norm(m_thresholded) < np.linalg.norm(m)
 
+    def test_connectivity_matrix(self):
+        """
+            Test that the k-d tree neighbour search agrees with a brute
+            force search, including the ordering of dipoles at the same
+            distance on a regular grid.
+        """
+        np.random.seed(1)
+        grid = np.stack(np.meshgrid(np.arange(9), np.arange(7), np.arange(5), indexing='ij'), axis=-1).reshape(-1, 3) * 0.1
+        for xyz in [grid, np.random.rand(300, 3)]:
+            xyz = np.ascontiguousarray(xyz)
+            ndipoles = xyz.shape[0]
+            dist = np.linalg.norm(xyz[None, :, :] - xyz[:, None, :], axis=-1)
+            for Nneighbors in [7, 50]:
+                connect = sopp.connectivity_matrix(xyz, 7, Nneighbors)
+                assert connect.shape == (ndipoles, Nneighbors)
+                assert np.all(connect[:, 0] == np.arange(ndipoles))
+                for j in range(ndipoles):
+                    assert np.allclose(dist[j, connect[j].astype(int)], np.sort(dist[j])[:Nneighbors])
+            # columns beyond the number of dipoles are zero
+            connect = sopp.connectivity_matrix(xyz[:10], 7, 20)
+            assert np.all(connect[:, 10:] == 0)
+        with self.assertRaises(ValueError):
+            sopp.connectivity_matrix(grid, 7, 5)
+
+    @unittest.skipIf(MPI is None, "mpi4py not found")
+    def test_GPMO_baseline_mpi(self):
+        """
+            Test that the distributed GPMO picks the same dipoles and
+            records the same histories as the serial GPMO_baseline.
+        """
+        comm = MPI.COMM_WORLD
+        np.random.seed(1)
+        ndipoles, ngrid, K, nhistory = 37, 25, 20, 10
+        A = np.random.rand(3 * ndipoles, ngrid) - 0.5
+        b = np.random.rand(ngrid)
+        mmax = 0.1 * np.random.rand(3 * ndipoles)
+        normal_norms = np.random.rand(ngrid)
+        start, end = _mpi_dipole_range(ndipoles, comm)
+        for single_direction in [-1, 1]:
+            ref = sopp.GPMO_baseline(A_obj=A, b_obj=b, mmax=mmax, normal_norms=normal_norms, K=K,
+                                     verbose=True, nhistory=nhistory, single_direction=single_direction)
+            res = GPMO_baseline_mpi(A[3 * start:3 * end], b, mmax[3 * start:3 * end], normal_norms, comm=comm,
+                                    K=K, verbose=True, nhistory=nhistory, single_direction=single_direction)
+            assert np.allclose(res[3], ref[3])
+            if comm.rank == 0:
+                for r1, r2 in zip(res[:3], ref[:3]):
+                    assert np.allclose(r1, r2)
+            else:
+                assert res[0] is None
+
     def test_MwPGP(self):
         """ 
             Test the MwPGP algorithm for solving the convex
@@ -51,6 +106,14 @@ class Testing(unittest.TestCase):
             assert dipoles.shape == (ndipoles, 3)
             assert m_hist.shape == (ndipoles, 3, 21)
 
+            # A can be stored in single precision
+            MwPGP_hist_f, _, m_hist_f, dipoles_f = sopp.MwPGP_algorithm(
+                A_obj=A.astype(np.float32), b_obj=b, ATb=ATb, m_proxy=m0, m0=m0, m_maxima=m_maxima,
+                alpha=alpha, nu=1e100, epsilon=1e-4, max_iter=max_iter,
+                reg_l0=0.0, reg_l1=0.0, reg_l2=0.0)
+            assert np.allclose(dipoles, dipoles_f, rtol=1e-4, atol=1e-4 * np.max(m_maxima))
+            assert np.allclose(MwPGP_hist, MwPGP_hist_f, rtol=1e-3)
+
     def test_algorithms(self):
         """ 
             Test the relax and split algorithm for solving
@@ -136,6 +199,17 @@ class Testing(unittest.TestCase):
             kwargs['K'] = 10
             errors1, Bn_errors1, m_history1 = GPMO(pm_opt, algorithm='baseline', **kwargs)
             m1 = pm_opt.m
+
+            # Runs with checkpoints, and runs resumed from a checkpoint,
+            # place the same magnets
+            GPMO(pm_opt, algorithm='baseline', checkpoint_file='gpmo.npz', checkpoint_every=4, **kwargs)
+            assert np.allclose(pm_opt.m, m1)
+            GPMO(pm_opt, algorithm='baseline', **dict(kwargs, K=4, nhistory=4), checkpoint_file='gpmo_resume.npz')
+            errors_resumed, _, _ = GPMO(pm_opt, algorithm='baseline', checkpoint_file='gpmo_resume.npz', **kwargs)
+            assert np.allclose(pm_opt.m, m1)
+            assert np.isclose(errors_resumed[-1], errors1[-1])
+            GPMO(pm_opt, algorithm='baseline', m_init=m1.reshape(-1, 3), **dict(kwargs, K=0, nhistory=0))
+            assert np.allclose(pm_opt.m, m1)
             ndipoles = pm_opt.ndipoles
             pol_vector_x = np.zeros((ndipoles, 3))
             pol_vector_x[:, 0] = 1.0
@@ -168,6 +242,78 @@ class Testing(unittest.TestCase):
             assert np.allclose(Bn_errors1, Bn_errors4)
             assert np.allclose(m_history1, m_history4)
 
+            # The incremental engine of the GPMO variants picks the same dipoles
+            # and records the same histories
+            baseline_kwargs = {key: kwargs[key] for key in ['K', 'nhistory', 'verbose']}
+            multi_kwargs = dict(baseline_kwargs, Nadjacent=kwargs['Nadjacent'], dipole_grid_xyz=kwargs['dipole_grid_xyz'])
+            for algorithm, kw, errors, Bn_errors, m_history, m in [
+                    ('baseline', baseline_kwargs, errors1, Bn_errors1, m_history1, m1),
+                    ('multi', multi_kwargs, errors3, Bn_errors3, m_history3, m3),
+                    ('backtracking', kwargs, errors4, Bn_errors4, m_history4, m4)]:
+                errors_inc, Bn_errors_inc, m_history_inc = GPMO(pm_opt, algorithm=algorithm, incremental=True, **kw)
+                assert np.allclose(m, pm_opt.m)
+                assert np.allclose(errors, errors_inc)
+                assert np.allclose(Bn_errors, Bn_errors_inc)
+                assert np.allclose(m_history, m_history_inc)
+
+            # Storing A_obj in single precision gives the same solutions
+            A_obj = pm_opt.A_obj
+            with self.assertRaises(ValueError):
+                pm_opt.convert_A_obj(np.int32)
+            pm_opt.convert_A_obj(np.float32)
+            assert pm_opt.A_obj.dtype == np.float32
+            for incremental in [False, True]:
+                errors_f, Bn_errors_f, m_history_f = GPMO(pm_opt, algorithm='baseline', incremental=incremental, **baseline_kwargs)
+                assert np.allclose(m1, pm_opt.m)
+                assert np.allclose(errors1, errors_f, rtol=1e-4)
+                assert np.allclose(Bn_errors1, Bn_errors_f, rtol=1e-4)
+                assert np.allclose(m_history1, m_history_f)
+            pm_opt.A_obj = A_obj
+
+            # The matrix-free dipole operator gives the same solutions
+            pm_mf = PermanentMagnetGrid.geo_setup_between_toroidal_surfaces(
+                s, Bnormal, s_inner, s_outer, matrix_free=True, **kwargs_geo
+            )
+            assert isinstance(pm_mf.A_obj, sopp.DipoleFieldOperator)
+            for algorithm, kw, errors, m in [
+                    ('baseline', baseline_kwargs, errors1, m1),
+                    ('multi', multi_kwargs, errors3, m3),
+                    ('backtracking', kwargs, errors4, m4)]:
+                errors_mf, _, _ = GPMO(pm_mf, algorithm=algorithm, **kw)
+                assert np.allclose(m, pm_mf.m)
+                assert np.allclose(errors, errors_mf)
+            with self.assertRaises(ValueError):
+                GPMO(pm_mf, algorithm='ArbVec', **baseline_kwargs)
+            with self.assertRaises(ValueError):
+                pm_mf.convert_A_obj(np.float32)
+            relax_and_split(pm_mf, max_iter=20)
+            assert pm_mf.m.shape == (pm_mf.ndipoles * 3,)
+
+            # A dense matrix written to disk in blocks and memory-mapped gives
+            # the same matrix and the same solutions
+            pm_mf.write_A_obj("A_obj.npy", block_size=7)
+            assert isinstance(pm_mf.A_obj, np.memmap)
+            assert not pm_mf.A_obj.flags.writeable
+            A_max = np.max(np.abs(pm_opt.A_obj))
+            assert np.allclose(pm_mf.A_obj, pm_opt.A_obj, rtol=0, atol=1e-12 * A_max)
+            pm_mf.write_A_obj("A_gpmo.npy", gpmo=True, block_size=5)
+            mmax_vec = np.repeat(pm_mf.m_maxima, 3)
+            assert np.allclose(pm_mf.A_obj_gpmo, (pm_opt.A_obj * mmax_vec).T, rtol=0, atol=1e-12 * A_max * np.max(mmax_vec))
+            for algorithm, kw, errors, m in [
+                    ('baseline', baseline_kwargs, errors1, m1),
+                    ('backtracking', kwargs, errors4, m4)]:
+                errors_mm, _, _ = GPMO(pm_mf, algorithm=algorithm, **kw)
+                assert np.allclose(m, pm_mf.m)
+                assert np.allclose(errors, errors_mm)
+            pm_mf.write_A_obj("A_obj32.npy", dtype=np.float32)
+            assert pm_mf.A_obj.dtype == np.float32
+            assert np.allclose(pm_mf.A_obj, pm_opt.A_obj, rtol=0, atol=1e-6 * A_max)
+            pm_mf.load_A_obj("A_obj.npy")
+            assert pm_mf.A_obj.dtype == np.float64
+            relax_and_split(pm_mf, max_iter=20)
+            with self.assertRaises(ValueError):
+                pm_mf.load_A_obj("A_obj.npy", gpmo=True)
+
             # Note: ArbVec_backtracking history arrays contain one additional
             # entry at the beginning for the initialized solution
 